@@ -15,7 +15,11 @@
 #include "gematria/basic_block/basic_block.h"
 
 #include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <ios>
+#include <memory>
 #include <ostream>
 #include <sstream>
 #include <string>
@@ -24,6 +28,8 @@
 #include <utility>
 #include <vector>
 
+#include "gematria/basic_block/token_interner.h"
+
 namespace gematria {
 
 #define GEMATRIA_PRINT_ENUM_VALUE_TO_OS(os, enum_value) \
@@ -45,6 +51,44 @@ std::ostream& operator<<(std::ostream& os, OperandType operand_type) {
 
 #undef GEMATRIA_PRINT_ENUM_VALUE_TO_OS
 
+void StableHasher::AddDouble(double value) {
+  // 0.0 and -0.0 are equal but have different bit patterns.
+  if (value == 0.0) value = 0.0;
+  uint64_t bits = 0;
+  static_assert(sizeof(bits) == sizeof(value));
+  std::memcpy(&bits, &value, sizeof(bits));
+  AddInt(bits);
+}
+
+void StableHasher::AddString(std::string_view value) {
+  AddInt(value.size());
+  // Combine the characters in little-endian order independently of the byte
+  // order of the platform, to keep the hash stable.
+  size_t pos = 0;
+  for (; pos + 8 <= value.size(); pos += 8) {
+    uint64_t word = 0;
+    for (int i = 7; i >= 0; --i) {
+      word = (word << 8) | static_cast<uint8_t>(value[pos + i]);
+    }
+    AddInt(word);
+  }
+  if (pos < value.size()) {
+    uint64_t word = 0;
+    for (size_t i = value.size(); i > pos; --i) {
+      word = (word << 8) | static_cast<uint8_t>(value[i - 1]);
+    }
+    AddInt(word);
+  }
+}
+
+uint64_t StableHasher::Finish() const {
+  // The finalizer of SplitMix64.
+  uint64_t hash = state_;
+  hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9;
+  hash = (hash ^ (hash >> 27)) * 0x94d049bb133111eb;
+  return hash ^ (hash >> 31);
+}
+
 bool AddressTuple::operator==(const AddressTuple& other) const {
   const auto as_tuple = [](const AddressTuple& address) {
     return std::tie(address.base_register, address.displacement,
@@ -54,6 +98,20 @@ bool AddressTuple::operator==(const AddressTuple& other) const {
   return as_tuple(*this) == as_tuple(other);
 }
 
+void AddressTuple::AddToHasher(StableHasher& hasher) const {
+  hasher.AddString(base_register);
+  hasher.AddInt(static_cast<uint64_t>(displacement));
+  hasher.AddString(index_register);
+  hasher.AddInt(static_cast<uint64_t>(scaling));
+  hasher.AddString(segment_register);
+}
+
+uint64_t AddressTuple::Hash() const {
+  StableHasher hasher;
+  AddToHasher(hasher);
+  return hasher.Finish();
+}
+
 std::string AddressTuple::ToString() const {
   std::stringstream buffer;
   buffer << "AddressTuple(";
@@ -92,7 +150,7 @@ bool InstructionOperand::operator==(const InstructionOperand& other) const {
     case OperandType::kUnknown:
       return true;
     case OperandType::kRegister:
-      return register_name() == other.register_name();
+      return register_id() == other.register_id();
     case OperandType::kImmediateValue:
       return immediate_value() == other.immediate_value();
     case OperandType::kFpImmediateValue:
@@ -104,34 +162,70 @@ bool InstructionOperand::operator==(const InstructionOperand& other) const {
   }
 }
 
+void InstructionOperand::AddToHasher(StableHasher& hasher) const {
+  hasher.AddInt(static_cast<uint64_t>(type()));
+  switch (type()) {
+    case OperandType::kUnknown:
+      break;
+    case OperandType::kRegister:
+      // Hash the name rather than the ID; the IDs depend on the order in which
+      // the names were interned in this process.
+      hasher.AddString(register_name());
+      break;
+    case OperandType::kImmediateValue:
+      hasher.AddInt(immediate_value());
+      break;
+    case OperandType::kFpImmediateValue:
+      hasher.AddDouble(fp_immediate_value());
+      break;
+    case OperandType::kAddress:
+      address().AddToHasher(hasher);
+      break;
+    case OperandType::kMemory:
+      hasher.AddInt(static_cast<uint64_t>(alias_group_id()));
+      break;
+  }
+}
+
+uint64_t InstructionOperand::Hash() const {
+  StableHasher hasher;
+  AddToHasher(hasher);
+  return hasher.Finish();
+}
+
 InstructionOperand InstructionOperand::Register(
-    const std::string register_name) {
+    std::string_view register_name) {
+  return RegisterFromId(TokenInterner::Global().Intern(register_name));
+}
+
+InstructionOperand InstructionOperand::RegisterFromId(TokenId register_id) {
+  assert(register_id >= 0);
   InstructionOperand result;
-  result.type_ = OperandType::kRegister;
-  result.register_name_ = std::move(register_name);
+  result.value_.emplace<static_cast<size_t>(OperandType::kRegister)>(
+      register_id);
   return result;
 }
 
 InstructionOperand InstructionOperand::ImmediateValue(
     uint64_t immediate_value) {
   InstructionOperand result;
-  result.type_ = OperandType::kImmediateValue;
-  result.immediate_value_ = immediate_value;
+  result.value_.emplace<static_cast<size_t>(OperandType::kImmediateValue)>(
+      immediate_value);
   return result;
 }
 
 InstructionOperand InstructionOperand::FpImmediateValue(
     double fp_immediate_value) {
   InstructionOperand result;
-  result.type_ = OperandType::kFpImmediateValue;
-  result.fp_immediate_value_ = fp_immediate_value;
+  result.value_.emplace<static_cast<size_t>(OperandType::kFpImmediateValue)>(
+      fp_immediate_value);
   return result;
 }
 
 InstructionOperand InstructionOperand::Address(AddressTuple address_tuple) {
   InstructionOperand result;
-  result.type_ = OperandType::kAddress;
-  result.address_ = std::move(address_tuple);
+  result.value_.emplace<static_cast<size_t>(OperandType::kAddress)>(
+      std::make_shared<const AddressTuple>(std::move(address_tuple)));
   return result;
 }
 
@@ -140,56 +234,55 @@ InstructionOperand InstructionOperand::Address(std::string base_register,
                                                std::string index_register,
                                                int scaling,
                                                std::string segment_register) {
-  InstructionOperand result;
-  result.type_ = OperandType::kAddress;
-  result.address_.base_register = std::move(base_register);
-  result.address_.index_register = std::move(index_register);
-  result.address_.displacement = displacement;
-  result.address_.scaling = scaling;
-  result.address_.segment_register = segment_register;
-  return result;
+  return Address(AddressTuple(
+      /* base_register = */ std::move(base_register),
+      /* displacement = */ displacement,
+      /* index_register = */ std::move(index_register),
+      /* scaling = */ scaling,
+      /* segment_register = */ std::move(segment_register)));
 }
 
 InstructionOperand InstructionOperand::MemoryLocation(int alias_group_id) {
   InstructionOperand result;
-  result.type_ = OperandType::kMemory;
-  result.alias_group_id_ = alias_group_id;
+  result.value_.emplace<static_cast<size_t>(OperandType::kMemory)>(
+      alias_group_id);
   return result;
 }
 
+namespace {
+
+// A token visitor for InstructionOperand::VisitTokens() and
+// Instruction::VisitTokens() that appends the indices of the tokens in a
+// vocabulary to a vector.
+class AddTokenIndexVisitor {
+ public:
+  AddTokenIndexVisitor(const TokenVocabulary& vocabulary,
+                       std::vector<int>& token_indices)
+      : vocabulary_(vocabulary), token_indices_(token_indices) {}
+
+  void operator()(TokenId token_id) const {
+    token_indices_.push_back(vocabulary_.IndexOf(token_id));
+  }
+  void operator()(std::string_view token) const {
+    token_indices_.push_back(vocabulary_.IndexOf(token));
+  }
+
+ private:
+  const TokenVocabulary& vocabulary_;
+  std::vector<int>& token_indices_;
+};
+
+}  // namespace
+
 void InstructionOperand::AddTokensToList(
     std::vector<std::string>& tokens) const {
-  switch (type()) {
-    case OperandType::kUnknown:
-      break;
-    case OperandType::kRegister:
-      tokens.push_back(register_name());
-      break;
-    case OperandType::kImmediateValue:
-      tokens.emplace_back(kImmediateToken);
-      break;
-    case OperandType::kFpImmediateValue:
-      tokens.emplace_back(kImmediateToken);
-      break;
-    case OperandType::kAddress:
-      tokens.emplace_back(kAddressToken);
-      tokens.emplace_back(address().base_register.empty()
-                              ? kNoRegisterToken
-                              : address().base_register);
-      tokens.emplace_back(address().index_register.empty()
-                              ? kNoRegisterToken
-                              : address().index_register);
-      if (!address().segment_register.empty()) {
-        tokens.push_back(address().segment_register);
-      }
-      if (address().displacement != 0) {
-        tokens.emplace_back(kDisplacementToken);
-      }
-      break;
-    case OperandType::kMemory:
-      tokens.emplace_back(kMemoryToken);
-      break;
-  }
+  ForEachToken(
+      [&tokens](std::string_view token) { tokens.emplace_back(token); });
+}
+
+void InstructionOperand::AddTokenIndicesToList(
+    const TokenVocabulary& vocabulary, std::vector<int>& token_indices) const {
+  VisitTokens(AddTokenIndexVisitor(vocabulary, token_indices));
 }
 
 std::vector<std::string> InstructionOperand::AsTokenList() const {
@@ -254,6 +347,27 @@ bool Instruction::operator==(const Instruction& other) const {
   return as_tuple(*this) == as_tuple(other);
 }
 
+void Instruction::AddToHasher(StableHasher& hasher) const {
+  hasher.AddString(mnemonic);
+  hasher.AddString(llvm_mnemonic);
+  hasher.AddInt(prefixes.size());
+  for (const std::string& prefix : prefixes) hasher.AddString(prefix);
+  for (const std::vector<InstructionOperand>* operands :
+       {&input_operands, &implicit_input_operands, &output_operands,
+        &implicit_output_operands}) {
+    hasher.AddInt(operands->size());
+    for (const InstructionOperand& operand : *operands) {
+      operand.AddToHasher(hasher);
+    }
+  }
+}
+
+uint64_t Instruction::Hash() const {
+  StableHasher hasher;
+  AddToHasher(hasher);
+  return hasher.Finish();
+}
+
 std::string Instruction::ToString() const {
   std::stringstream buffer;
   buffer << "Instruction(";
@@ -300,23 +414,13 @@ std::string Instruction::ToString() const {
 }
 
 void Instruction::AddTokensToList(std::vector<std::string>& tokens) const {
-  for (const std::string& prefix : prefixes) tokens.push_back(prefix);
-  tokens.push_back(mnemonic);
-  tokens.emplace_back(kDelimiterToken);
-  for (const auto& operand : output_operands) {
-    operand.AddTokensToList(tokens);
-  }
-  for (const auto& operand : implicit_output_operands) {
-    operand.AddTokensToList(tokens);
-  }
-  tokens.emplace_back(kDelimiterToken);
-  for (const auto& operand : input_operands) {
-    operand.AddTokensToList(tokens);
-  }
-  for (const auto& operand : implicit_input_operands) {
-    operand.AddTokensToList(tokens);
-  }
-  tokens.emplace_back(kDelimiterToken);
+  ForEachToken(
+      [&tokens](std::string_view token) { tokens.emplace_back(token); });
+}
+
+void Instruction::AddTokenIndicesToList(const TokenVocabulary& vocabulary,
+                                        std::vector<int>& token_indices) const {
+  VisitTokens(AddTokenIndexVisitor(vocabulary, token_indices));
 }
 
 std::vector<std::string> Instruction::AsTokenList() const {
@@ -330,6 +434,18 @@ std::ostream& operator<<(std::ostream& os, const Instruction& instruction) {
   return os;
 }
 
+void Instruction::Clear() {
+  mnemonic.clear();
+  llvm_mnemonic.clear();
+  prefixes.clear();
+  input_operands.clear();
+  implicit_input_operands.clear();
+  output_operands.clear();
+  implicit_output_operands.clear();
+  address = 0;
+  size = 0;
+}
+
 BasicBlock::BasicBlock(std::vector<Instruction> instructions)
     : instructions(std::move(instructions)) {}
 
@@ -337,6 +453,19 @@ bool BasicBlock::operator==(const BasicBlock& other) const {
   return instructions == other.instructions;
 }
 
+void BasicBlock::AddToHasher(StableHasher& hasher) const {
+  hasher.AddInt(instructions.size());
+  for (const Instruction& instruction : instructions) {
+    instruction.AddToHasher(hasher);
+  }
+}
+
+uint64_t BasicBlock::Hash() const {
+  StableHasher hasher;
+  AddToHasher(hasher);
+  return hasher.Finish();
+}
+
 std::string BasicBlock::ToString() const {
   std::string buffer = "BasicBlock(";
   if (!instructions.empty()) {
@@ -25,12 +25,18 @@
 #include <cassert>
 #include <cstddef>
 #include <cstdint>
+#include <functional>
+#include <memory>
 #include <ostream>
 #include <string>
 #include <string_view>
+#include <type_traits>
 #include <utility>
+#include <variant>
 #include <vector>
 
+#include "gematria/basic_block/token_interner.h"
+
 namespace gematria {
 
 // Tokens used for instruction canonicalization in Gematria. The values used
@@ -43,7 +49,8 @@ inline constexpr std::string_view kMemoryToken = "_MEMORY_";
 inline constexpr std::string_view kNoRegisterToken = "_NO_REGISTER_";
 inline constexpr std::string_view kDisplacementToken = "_DISPLACEMENT_";
 
-// The type of an operand of an instruction.
+// The type of an operand of an instruction. The values of the enum are also the
+// indices of the alternatives in InstructionOperand::Value.
 enum class OperandType {
   // The type of the operand is not known/the operand was not correctly
   // initialized.
@@ -72,6 +79,37 @@ enum class OperandType {
 
 std::ostream& operator<<(std::ostream& os, OperandType operand_type);
 
+// Computes a 64-bit hash of a sequence of values. The hash is stable: it
+// depends only on the values added to the hasher and on their order, not on the
+// process, the platform, or the version of the standard library. It is not a
+// cryptographic hash.
+//
+// Typical usage:
+//   StableHasher hasher;
+//   hasher.AddString(instruction.mnemonic);
+//   hasher.AddInt(instruction.prefixes.size());
+//   const uint64_t hash = hasher.Finish();
+class StableHasher {
+ public:
+  void AddInt(uint64_t value) {
+    state_ = (state_ ^ (value * kMultiplier1)) * kMultiplier2;
+    state_ ^= state_ >> 29;
+  }
+  void AddDouble(double value);
+  // Adds the length and the contents of the string, so that sequences of
+  // strings with the same concatenation have different hashes.
+  void AddString(std::string_view value);
+
+  // Returns the hash of all values added so far.
+  uint64_t Finish() const;
+
+ private:
+  static constexpr uint64_t kMultiplier1 = 0x9e3779b97f4a7c15;
+  static constexpr uint64_t kMultiplier2 = 0xbf58476d1ce4e5b9;
+
+  uint64_t state_ = 0x84222325cbf29ce4;
+};
+
 // Represents inputs to address computation of an instruction.
 struct AddressTuple {
   AddressTuple() {}
@@ -92,6 +130,10 @@ struct AddressTuple {
   bool operator==(const AddressTuple& other) const;
   bool operator!=(const AddressTuple& other) const { return !(*this == other); }
 
+  // Returns a stable hash of the address tuple; see BasicBlock::Hash().
+  uint64_t Hash() const;
+  void AddToHasher(StableHasher& hasher) const;
+
   // Returns a human-readable string representation of the address tuple. This
   // representation corresponds to Python code that creates the same object,
   // e.g. "AddressTuple(base_register='RAX', displacement=16,
@@ -140,7 +182,11 @@ class InstructionOperand {
   InstructionOperand& operator=(InstructionOperand&&) = default;
 
   // The operands must be created through one of the factory functions.
-  static InstructionOperand Register(std::string register_name);
+  static InstructionOperand Register(std::string_view register_name);
+  // Creates a register operand from the ID of the register name in
+  // TokenInterner::Global(). This avoids the lookup of the register name in the
+  // interner when the caller already has the ID.
+  static InstructionOperand RegisterFromId(TokenId register_id);
   static InstructionOperand ImmediateValue(uint64_t immediate_value);
   static InstructionOperand FpImmediateValue(double fp_immediate_value);
   static InstructionOperand Address(AddressTuple address_tuple);
@@ -155,12 +201,34 @@ class InstructionOperand {
     return !(*this == other);
   }
 
+  // Returns a stable hash of the operand; see BasicBlock::Hash().
+  uint64_t Hash() const;
+  void AddToHasher(StableHasher& hasher) const;
+
   // Adds tokens of the instruction to a list of tokens.
   void AddTokensToList(std::vector<std::string>& tokens) const;
 
   // Returns the list of tokens representing this instruction.
   std::vector<std::string> AsTokenList() const;
 
+  // Calls `callback` with each token of the operand as a std::string_view, in
+  // the order used by AsTokenList(). Does not copy any strings; the views are
+  // valid for the lifetime of the operand.
+  template <typename Callback>
+  void ForEachToken(Callback&& callback) const;
+
+  // Appends the indices of the tokens of the operand in `vocabulary` to
+  // `token_indices`, in the order used by AsTokenList().
+  void AddTokenIndicesToList(const TokenVocabulary& vocabulary,
+                             std::vector<int>& token_indices) const;
+
+  // Calls `visitor` with each token of the operand, in the order used by
+  // AsTokenList(). Tokens that are already interned (register names) are passed
+  // as a TokenId, all other tokens are passed as a std::string_view. This is
+  // the building block of ForEachToken() and AddTokenIndicesToList().
+  template <typename Visitor>
+  void VisitTokens(Visitor&& visitor) const;
+
   // Returns a human-readable representation of the operand.
   //
   // This method implements the __str__() and __repr__() methods in the Python
@@ -170,50 +238,66 @@ class InstructionOperand {
 
   // Returns the type of the operand. Valid for all operand types including
   // kUnknown.
-  OperandType type() const { return type_; }
+  OperandType type() const { return static_cast<OperandType>(value_.index()); }
 
   // Returns the name of the register. Valid only when type() is kRegister.
   const std::string& register_name() const {
-    assert(type_ == OperandType::kRegister);
-    return register_name_;
+    return TokenInterner::Global().token(register_id());
+  }
+
+  // Returns the ID of the name of the register in TokenInterner::Global().
+  // Valid only when type() is kRegister.
+  TokenId register_id() const {
+    return Get<OperandType::kRegister>();
   }
 
   // Returns the immediate value in the operand. Valid only when type() is
   // kImmediateValue.
   uint64_t immediate_value() const {
-    assert(type_ == OperandType::kImmediateValue);
-    return immediate_value_;
+    return Get<OperandType::kImmediateValue>();
   }
 
   // Returns the floating point immediate value in the operand. Valid only when
   // type() is kFpImmediateValue.
   double fp_immediate_value() const {
-    assert(type_ == OperandType::kFpImmediateValue);
-    return fp_immediate_value_;
+    return Get<OperandType::kFpImmediateValue>();
   }
 
   // Returns the address computation data structure in the operand. Valid only
   // when type() is kAddress.
   const AddressTuple& address() const {
-    assert(type_ == OperandType::kAddress);
-    return address_;
+    return *Get<OperandType::kAddress>();
   }
 
   // Returns the alias group ID of the memory access in the operand. Valid only
   // when type() is kMemory.
   int alias_group_id() const {
-    assert(type_ == OperandType::kMemory);
-    return alias_group_id_;
+    return Get<OperandType::kMemory>();
   }
 
  private:
-  OperandType type_ = OperandType::kUnknown;
+  // The payload of the operand. The index of the alternative is the operand
+  // type, so the order of the alternatives must match the order of the values
+  // in OperandType: kUnknown, kRegister, kImmediateValue, kFpImmediateValue,
+  // kAddress, kMemory.
+  //
+  // The register name is interned, so that register operands can be created
+  // and copied without allocating memory. Address tuples are much larger than
+  // the other alternatives and they are relatively rare; they are stored out of
+  // line, so that a vector of operands is dense. The address tuple is never
+  // modified after the operand is created, which makes it safe to share it
+  // between copies of the operand.
+  using Value = std::variant<std::monostate, TokenId, uint64_t, double,
+                             std::shared_ptr<const AddressTuple>, int>;
+
+  template <OperandType operand_type>
+  const std::variant_alternative_t<static_cast<size_t>(operand_type), Value>&
+  Get() const {
+    assert(type() == operand_type);
+    return *std::get_if<static_cast<size_t>(operand_type)>(&value_);
+  }
 
-  std::string register_name_;
-  uint64_t immediate_value_ = 0;
-  double fp_immediate_value_ = 0.0;
-  AddressTuple address_;
-  int alias_group_id_ = 0;
+  Value value_;
 };
 
 std::ostream& operator<<(std::ostream& os, const InstructionOperand& operand);
@@ -240,6 +324,10 @@ struct Instruction {
   bool operator==(const Instruction& other) const;
   bool operator!=(const Instruction& other) const { return !(*this == other); }
 
+  // Returns a stable hash of the instruction; see BasicBlock::Hash().
+  uint64_t Hash() const;
+  void AddToHasher(StableHasher& hasher) const;
+
   // Returns the list of tokens representing this instruction. The returned list
   // contains the tokens from the assembly representation of the instruction
   // with delimiter tokens separating the instructions and the different types
@@ -247,6 +335,20 @@ struct Instruction {
   std::vector<std::string> AsTokenList() const;
   void AddTokensToList(std::vector<std::string>& tokens) const;
 
+  // Versions of the methods of InstructionOperand with the same name, applied
+  // to all tokens of the instruction in the order used by AsTokenList().
+  template <typename Callback>
+  void ForEachToken(Callback&& callback) const;
+  void AddTokenIndicesToList(const TokenVocabulary& vocabulary,
+                             std::vector<int>& token_indices) const;
+  template <typename Visitor>
+  void VisitTokens(Visitor&& visitor) const;
+
+  // Removes all data from the instruction, but keeps the memory allocated by
+  // its strings and vectors. This allows reusing the instruction object without
+  // allocating memory when the new contents fit in the existing capacity.
+  void Clear();
+
   // Returns a human-readable representation of the instruction.
   //
   // This method implements the __str__() and __repr__() methods in the Python
@@ -305,6 +407,12 @@ struct BasicBlock {
   bool operator==(const BasicBlock& other) const;
   bool operator!=(const BasicBlock& other) const { return !(*this == other); }
 
+  // Returns a 64-bit hash of the contents of the basic block. The hash is
+  // consistent with operator==, and it does not depend on the process or the
+  // platform, so it can be stored and compared across runs.
+  uint64_t Hash() const;
+  void AddToHasher(StableHasher& hasher) const;
+
   // Returns a human-readable representation of the basic block.
   //
   // This method implements the __str__() and __repr__() methods in the Python
@@ -318,6 +426,107 @@ struct BasicBlock {
 
 std::ostream& operator<<(std::ostream& os, const BasicBlock& block);
 
+template <typename Visitor>
+void InstructionOperand::VisitTokens(Visitor&& visitor) const {
+  switch (type()) {
+    case OperandType::kUnknown:
+      break;
+    case OperandType::kRegister:
+      visitor(register_id());
+      break;
+    case OperandType::kImmediateValue:
+    case OperandType::kFpImmediateValue:
+      visitor(kImmediateToken);
+      break;
+    case OperandType::kAddress: {
+      const AddressTuple& address_tuple = address();
+      visitor(kAddressToken);
+      visitor(address_tuple.base_register.empty()
+                  ? kNoRegisterToken
+                  : std::string_view(address_tuple.base_register));
+      visitor(address_tuple.index_register.empty()
+                  ? kNoRegisterToken
+                  : std::string_view(address_tuple.index_register));
+      if (!address_tuple.segment_register.empty()) {
+        visitor(std::string_view(address_tuple.segment_register));
+      }
+      if (address_tuple.displacement != 0) visitor(kDisplacementToken);
+    } break;
+    case OperandType::kMemory:
+      visitor(kMemoryToken);
+      break;
+  }
+}
+
+template <typename Callback>
+void InstructionOperand::ForEachToken(Callback&& callback) const {
+  VisitTokens([&callback](auto token) {
+    if constexpr (std::is_same_v<decltype(token), TokenId>) {
+      callback(std::string_view(TokenInterner::Global().token(token)));
+    } else {
+      callback(token);
+    }
+  });
+}
+
+template <typename Visitor>
+void Instruction::VisitTokens(Visitor&& visitor) const {
+  for (const std::string& prefix : prefixes) visitor(std::string_view(prefix));
+  visitor(std::string_view(mnemonic));
+  visitor(kDelimiterToken);
+  for (const auto& operand : output_operands) operand.VisitTokens(visitor);
+  for (const auto& operand : implicit_output_operands) {
+    operand.VisitTokens(visitor);
+  }
+  visitor(kDelimiterToken);
+  for (const auto& operand : input_operands) operand.VisitTokens(visitor);
+  for (const auto& operand : implicit_input_operands) {
+    operand.VisitTokens(visitor);
+  }
+  visitor(kDelimiterToken);
+}
+
+template <typename Callback>
+void Instruction::ForEachToken(Callback&& callback) const {
+  VisitTokens([&callback](auto token) {
+    if constexpr (std::is_same_v<decltype(token), TokenId>) {
+      callback(std::string_view(TokenInterner::Global().token(token)));
+    } else {
+      callback(token);
+    }
+  });
+}
+
 }  // namespace gematria
 
+// Allow the data structures to be used as keys in hash-based containers.
+namespace std {
+
+template <>
+struct hash<gematria::AddressTuple> {
+  size_t operator()(const gematria::AddressTuple& address_tuple) const {
+    return static_cast<size_t>(address_tuple.Hash());
+  }
+};
+template <>
+struct hash<gematria::InstructionOperand> {
+  size_t operator()(const gematria::InstructionOperand& operand) const {
+    return static_cast<size_t>(operand.Hash());
+  }
+};
+template <>
+struct hash<gematria::Instruction> {
+  size_t operator()(const gematria::Instruction& instruction) const {
+    return static_cast<size_t>(instruction.Hash());
+  }
+};
+template <>
+struct hash<gematria::BasicBlock> {
+  size_t operator()(const gematria::BasicBlock& block) const {
+    return static_cast<size_t>(block.Hash());
+  }
+};
+
+}  // namespace std
+
 #endif  // GEMATRIA_BASIC_BLOCK_BASIC_BLOCK_H_
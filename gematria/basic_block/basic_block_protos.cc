@@ -15,12 +15,16 @@
 #include "gematria/basic_block/basic_block_protos.h"
 
 #include <algorithm>
+#include <cstdint>
 #include <iterator>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "gematria/basic_block/basic_block.h"
+#include "gematria/proto/basic_block.pb.h"
 #include "gematria/proto/canonicalized_instruction.pb.h"
+#include "gematria/proto/throughput.pb.h"
 #include "google/protobuf/repeated_ptr_field.h"
 
 namespace gematria {
@@ -35,6 +39,16 @@ AddressTuple AddressTupleFromProto(
       /* segment_register = */ proto.segment());
 }
 
+AddressTuple AddressTupleFromProto(
+    CanonicalizedOperandProto::AddressTuple&& proto) {
+  return AddressTuple(
+      /* base_register = */ std::move(*proto.mutable_base_register()),
+      /* displacement = */ proto.displacement(),
+      /* index_register = */ std::move(*proto.mutable_index_register()),
+      /* scaling = */ proto.scaling(),
+      /* segment_register = */ std::move(*proto.mutable_segment()));
+}
+
 CanonicalizedOperandProto::AddressTuple ProtoFromAddressTuple(
     const AddressTuple& address_tuple) {
   CanonicalizedOperandProto::AddressTuple proto;
@@ -66,6 +80,17 @@ InstructionOperand InstructionOperandFromProto(
   }
 }
 
+InstructionOperand InstructionOperandFromProto(
+    CanonicalizedOperandProto&& proto) {
+  // Register names are interned, and only address tuples own strings that can
+  // be moved.
+  if (proto.operand_case() == CanonicalizedOperandProto::kAddress) {
+    return InstructionOperand::Address(
+        AddressTupleFromProto(std::move(*proto.mutable_address())));
+  }
+  return InstructionOperandFromProto(std::as_const(proto));
+}
+
 CanonicalizedOperandProto ProtoFromInstructionOperand(
     const InstructionOperand& operand) {
   CanonicalizedOperandProto proto;
@@ -93,13 +118,25 @@ CanonicalizedOperandProto ProtoFromInstructionOperand(
 
 namespace {
 
-std::vector<InstructionOperand> ToVector(
+void AssignFromRepeatedPtrField(
     const google::protobuf::RepeatedPtrField<CanonicalizedOperandProto>&
-        protos) {
-  std::vector<InstructionOperand> result(protos.size());
-  std::transform(protos.begin(), protos.end(), result.begin(),
-                 InstructionOperandFromProto);
-  return result;
+        protos,
+    std::vector<InstructionOperand>& operands) {
+  operands.resize(protos.size());
+  std::transform(protos.begin(), protos.end(), operands.begin(),
+                 [](const CanonicalizedOperandProto& proto) {
+                   return InstructionOperandFromProto(proto);
+                 });
+}
+
+void AssignFromRepeatedPtrField(
+    google::protobuf::RepeatedPtrField<CanonicalizedOperandProto>&& protos,
+    std::vector<InstructionOperand>& operands) {
+  operands.resize(protos.size());
+  std::transform(protos.begin(), protos.end(), operands.begin(),
+                 [](CanonicalizedOperandProto& proto) {
+                   return InstructionOperandFromProto(std::move(proto));
+                 });
 }
 
 void ToRepeatedPtrField(
@@ -115,17 +152,51 @@ void ToRepeatedPtrField(
 }  // namespace
 
 Instruction InstructionFromProto(const CanonicalizedInstructionProto& proto) {
-  return Instruction(
-      /* mnemonic = */ proto.mnemonic(),
-      /* llvm_mnemonic = */ proto.llvm_mnemonic(),
-      /* prefixes = */
-      std::vector<std::string>(proto.prefixes().begin(),
-                               proto.prefixes().end()),
-      /* input_operands = */ ToVector(proto.input_operands()),
-      /* implicit_input_operands = */ ToVector(proto.implicit_input_operands()),
-      /* output_operands = */ ToVector(proto.output_operands()),
-      /* implicit_output_operands = */
-      ToVector(proto.implicit_output_operands()));
+  Instruction instruction;
+  AssignInstructionFromProto(proto, instruction);
+  return instruction;
+}
+
+void AssignInstructionFromProto(const CanonicalizedInstructionProto& proto,
+                                Instruction& instruction) {
+  instruction.Clear();
+  instruction.mnemonic.assign(proto.mnemonic());
+  instruction.llvm_mnemonic.assign(proto.llvm_mnemonic());
+  instruction.prefixes.assign(proto.prefixes().begin(), proto.prefixes().end());
+  AssignFromRepeatedPtrField(proto.input_operands(),
+                             instruction.input_operands);
+  AssignFromRepeatedPtrField(proto.implicit_input_operands(),
+                             instruction.implicit_input_operands);
+  AssignFromRepeatedPtrField(proto.output_operands(),
+                             instruction.output_operands);
+  AssignFromRepeatedPtrField(proto.implicit_output_operands(),
+                             instruction.implicit_output_operands);
+}
+
+Instruction InstructionFromProto(CanonicalizedInstructionProto&& proto) {
+  Instruction instruction;
+  AssignInstructionFromProto(std::move(proto), instruction);
+  return instruction;
+}
+
+void AssignInstructionFromProto(CanonicalizedInstructionProto&& proto,
+                                Instruction& instruction) {
+  instruction.Clear();
+  instruction.mnemonic = std::move(*proto.mutable_mnemonic());
+  instruction.llvm_mnemonic = std::move(*proto.mutable_llvm_mnemonic());
+  instruction.prefixes.assign(
+      std::make_move_iterator(proto.mutable_prefixes()->begin()),
+      std::make_move_iterator(proto.mutable_prefixes()->end()));
+  AssignFromRepeatedPtrField(std::move(*proto.mutable_input_operands()),
+                             instruction.input_operands);
+  AssignFromRepeatedPtrField(
+      std::move(*proto.mutable_implicit_input_operands()),
+      instruction.implicit_input_operands);
+  AssignFromRepeatedPtrField(std::move(*proto.mutable_output_operands()),
+                             instruction.output_operands);
+  AssignFromRepeatedPtrField(
+      std::move(*proto.mutable_implicit_output_operands()),
+      instruction.implicit_output_operands);
 }
 
 CanonicalizedInstructionProto ProtoFromInstruction(
@@ -146,22 +217,206 @@ CanonicalizedInstructionProto ProtoFromInstruction(
   return proto;
 }
 
+CanonicalizedInstructionProto ProtoFromInstruction(Instruction&& instruction) {
+  CanonicalizedInstructionProto proto;
+  proto.set_mnemonic(std::move(instruction.mnemonic));
+  proto.set_llvm_mnemonic(std::move(instruction.llvm_mnemonic));
+  proto.mutable_prefixes()->Reserve(instruction.prefixes.size());
+  for (std::string& prefix : instruction.prefixes) {
+    proto.add_prefixes(std::move(prefix));
+  }
+  ToRepeatedPtrField(instruction.input_operands,
+                     proto.mutable_input_operands());
+  ToRepeatedPtrField(instruction.implicit_input_operands,
+                     proto.mutable_implicit_input_operands());
+  ToRepeatedPtrField(instruction.output_operands,
+                     proto.mutable_output_operands());
+  ToRepeatedPtrField(instruction.implicit_output_operands,
+                     proto.mutable_implicit_output_operands());
+  return proto;
+}
+
+BasicBlock BasicBlockFromProto(const BasicBlockProto& proto) {
+  BasicBlock block;
+  AssignBasicBlockFromProto(proto, block);
+  return block;
+}
+
+void AssignBasicBlockFromProto(const BasicBlockProto& proto,
+                               BasicBlock& block) {
+  const auto& instruction_protos = proto.canonicalized_instructions();
+  // Note that resize() keeps the existing instructions, and the memory they
+  // allocated, when the new block is not longer than the previous one.
+  block.instructions.resize(instruction_protos.size());
+  for (int i = 0; i < instruction_protos.size(); ++i) {
+    AssignInstructionFromProto(instruction_protos[i], block.instructions[i]);
+  }
+}
+
+BasicBlock BasicBlockFromProto(BasicBlockProto&& proto) {
+  BasicBlock block;
+  AssignBasicBlockFromProto(std::move(proto), block);
+  return block;
+}
+
+void AssignBasicBlockFromProto(BasicBlockProto&& proto, BasicBlock& block) {
+  auto& instruction_protos = *proto.mutable_canonicalized_instructions();
+  block.instructions.resize(instruction_protos.size());
+  for (int i = 0; i < instruction_protos.size(); ++i) {
+    AssignInstructionFromProto(std::move(instruction_protos[i]),
+                               block.instructions[i]);
+  }
+}
+
 namespace {
 
-std::vector<Instruction> ToVector(
-    const google::protobuf::RepeatedPtrField<CanonicalizedInstructionProto>&
-        protos) {
-  std::vector<Instruction> result(protos.size());
-  std::transform(protos.begin(), protos.end(), result.begin(),
-                 InstructionFromProto);
-  return result;
+// Adds `proto` to `hasher` the same way as InstructionOperand::AddToHasher()
+// adds the operand created from `proto`.
+void AddOperandProtoToHasher(const CanonicalizedOperandProto& proto,
+                             StableHasher& hasher) {
+  switch (proto.operand_case()) {
+    case CanonicalizedOperandProto::OPERAND_NOT_SET:
+      hasher.AddInt(static_cast<uint64_t>(OperandType::kUnknown));
+      break;
+    case CanonicalizedOperandProto::kRegisterName:
+      hasher.AddInt(static_cast<uint64_t>(OperandType::kRegister));
+      hasher.AddString(proto.register_name());
+      break;
+    case CanonicalizedOperandProto::kImmediateValue:
+      hasher.AddInt(static_cast<uint64_t>(OperandType::kImmediateValue));
+      hasher.AddInt(proto.immediate_value());
+      break;
+    case CanonicalizedOperandProto::kFpImmediateValue:
+      hasher.AddInt(static_cast<uint64_t>(OperandType::kFpImmediateValue));
+      hasher.AddDouble(proto.fp_immediate_value());
+      break;
+    case CanonicalizedOperandProto::kAddress: {
+      hasher.AddInt(static_cast<uint64_t>(OperandType::kAddress));
+      const CanonicalizedOperandProto::AddressTuple& address = proto.address();
+      hasher.AddString(address.base_register());
+      hasher.AddInt(static_cast<uint64_t>(address.displacement()));
+      hasher.AddString(address.index_register());
+      hasher.AddInt(static_cast<uint64_t>(address.scaling()));
+      hasher.AddString(address.segment());
+      break;
+    }
+    case CanonicalizedOperandProto::kMemory:
+      hasher.AddInt(static_cast<uint64_t>(OperandType::kMemory));
+      hasher.AddInt(static_cast<uint64_t>(proto.memory().alias_group_id()));
+      break;
+  }
+}
+
+// Returns true when `proto` describes the same operand as `operand`; the
+// operand proto counterpart of InstructionOperand::operator==.
+bool OperandProtoEquals(const CanonicalizedOperandProto& proto,
+                        const InstructionOperand& operand) {
+  switch (proto.operand_case()) {
+    case CanonicalizedOperandProto::OPERAND_NOT_SET:
+      return operand.type() == OperandType::kUnknown;
+    case CanonicalizedOperandProto::kRegisterName:
+      return operand.type() == OperandType::kRegister &&
+             operand.register_name() == proto.register_name();
+    case CanonicalizedOperandProto::kImmediateValue:
+      return operand.type() == OperandType::kImmediateValue &&
+             operand.immediate_value() == proto.immediate_value();
+    case CanonicalizedOperandProto::kFpImmediateValue:
+      return operand.type() == OperandType::kFpImmediateValue &&
+             operand.fp_immediate_value() == proto.fp_immediate_value();
+    case CanonicalizedOperandProto::kAddress: {
+      if (operand.type() != OperandType::kAddress) return false;
+      const CanonicalizedOperandProto::AddressTuple& address = proto.address();
+      const AddressTuple& address_tuple = operand.address();
+      return address_tuple.base_register == address.base_register() &&
+             address_tuple.displacement == address.displacement() &&
+             address_tuple.index_register == address.index_register() &&
+             address_tuple.scaling == address.scaling() &&
+             address_tuple.segment_register == address.segment();
+    }
+    case CanonicalizedOperandProto::kMemory:
+      return operand.type() == OperandType::kMemory &&
+             operand.alias_group_id() == proto.memory().alias_group_id();
+  }
+  return false;
+}
+
+bool OperandProtosEqual(
+    const google::protobuf::RepeatedPtrField<CanonicalizedOperandProto>&
+        protos,
+    const std::vector<InstructionOperand>& operands) {
+  if (protos.size() != operands.size()) return false;
+  for (int i = 0; i < protos.size(); ++i) {
+    if (!OperandProtoEquals(protos[i], operands[i])) return false;
+  }
+  return true;
 }
 
 }  // namespace
 
-BasicBlock BasicBlockFromProto(const BasicBlockProto& proto) {
-  return BasicBlock(
-      /* instructions = */ ToVector(proto.canonicalized_instructions()));
+bool InstructionProtoView::Equals(const Instruction& instruction) const {
+  return proto_->mnemonic() == instruction.mnemonic &&
+         proto_->llvm_mnemonic() == instruction.llvm_mnemonic &&
+         std::equal(proto_->prefixes().begin(), proto_->prefixes().end(),
+                    instruction.prefixes.begin(), instruction.prefixes.end()) &&
+         OperandProtosEqual(proto_->input_operands(),
+                            instruction.input_operands) &&
+         OperandProtosEqual(proto_->implicit_input_operands(),
+                            instruction.implicit_input_operands) &&
+         OperandProtosEqual(proto_->output_operands(),
+                            instruction.output_operands) &&
+         OperandProtosEqual(proto_->implicit_output_operands(),
+                            instruction.implicit_output_operands);
+}
+
+uint64_t InstructionProtoView::Hash() const {
+  // Keep in sync with Instruction::AddToHasher().
+  StableHasher hasher;
+  hasher.AddString(proto_->mnemonic());
+  hasher.AddString(proto_->llvm_mnemonic());
+  hasher.AddInt(proto_->prefixes_size());
+  for (const std::string& prefix : proto_->prefixes()) {
+    hasher.AddString(prefix);
+  }
+  for (const auto* operands :
+       {&proto_->input_operands(), &proto_->implicit_input_operands(),
+        &proto_->output_operands(), &proto_->implicit_output_operands()}) {
+    hasher.AddInt(operands->size());
+    for (const CanonicalizedOperandProto& operand : *operands) {
+      AddOperandProtoToHasher(operand, hasher);
+    }
+  }
+  return hasher.Finish();
+}
+
+std::vector<InstructionProtoView> InstructionProtoViews(
+    const BasicBlockProto& proto) {
+  std::vector<InstructionProtoView> views;
+  views.reserve(proto.canonicalized_instructions_size());
+  for (const CanonicalizedInstructionProto& instruction :
+       proto.canonicalized_instructions()) {
+    views.emplace_back(instruction);
+  }
+  return views;
+}
+
+std::vector<BasicBlock> BasicBlocksFromProto(
+    const BasicBlockWithThroughputListProto& proto) {
+  std::vector<BasicBlock> blocks(proto.basic_blocks_size());
+  for (int i = 0; i < proto.basic_blocks_size(); ++i) {
+    AssignBasicBlockFromProto(proto.basic_blocks(i).basic_block(), blocks[i]);
+  }
+  return blocks;
+}
+
+std::vector<BasicBlock> BasicBlocksFromProto(
+    BasicBlockWithThroughputListProto&& proto) {
+  std::vector<BasicBlock> blocks(proto.basic_blocks_size());
+  for (int i = 0; i < proto.basic_blocks_size(); ++i) {
+    AssignBasicBlockFromProto(
+        std::move(*proto.mutable_basic_blocks(i)->mutable_basic_block()),
+        blocks[i]);
+  }
+  return blocks;
 }
 
 }  // namespace gematria
@@ -19,15 +19,26 @@
 #ifndef GEMATRIA_BASIC_BLOCK_BASIC_BLOCK_PROTOS_H_
 #define GEMATRIA_BASIC_BLOCK_BASIC_BLOCK_PROTOS_H_
 
+#include <cstdint>
+#include <vector>
+
 #include "gematria/basic_block/basic_block.h"
 #include "gematria/proto/basic_block.pb.h"
 #include "gematria/proto/canonicalized_instruction.pb.h"
+#include "gematria/proto/throughput.pb.h"
 
 namespace gematria {
 
+// The functions that create data structures from protos have overloads that
+// take the proto as an rvalue reference. These overloads move the strings out
+// of the proto instead of copying them, and leave the proto in a valid but
+// unspecified state.
+
 // Creates an address tuple data structure from a proto.
 AddressTuple AddressTupleFromProto(
     const CanonicalizedOperandProto::AddressTuple& proto);
+AddressTuple AddressTupleFromProto(
+    CanonicalizedOperandProto::AddressTuple&& proto);
 
 // Creates a proto representing the given address tuple.
 CanonicalizedOperandProto::AddressTuple ProtoFromAddressTuple(
@@ -36,6 +47,8 @@ CanonicalizedOperandProto::AddressTuple ProtoFromAddressTuple(
 // Creates an instruction operand data structure from a proto.
 InstructionOperand InstructionOperandFromProto(
     const CanonicalizedOperandProto& proto);
+InstructionOperand InstructionOperandFromProto(
+    CanonicalizedOperandProto&& proto);
 
 // Creates a proto representing the given instruction operand.
 CanonicalizedOperandProto ProtoFromInstructionOperand(
@@ -43,13 +56,75 @@ CanonicalizedOperandProto ProtoFromInstructionOperand(
 
 // Creates an instruction data structure from a proto.
 Instruction InstructionFromProto(const CanonicalizedInstructionProto& proto);
+Instruction InstructionFromProto(CanonicalizedInstructionProto&& proto);
 
-// Creates a proto representing the given instruction.
+// Replaces the contents of `instruction` with data from a proto. Reuses the
+// memory already allocated by `instruction` where possible.
+void AssignInstructionFromProto(const CanonicalizedInstructionProto& proto,
+                                Instruction& instruction);
+void AssignInstructionFromProto(CanonicalizedInstructionProto&& proto,
+                                Instruction& instruction);
+
+// Creates a proto representing the given instruction. The overload that takes
+// an rvalue reference moves the mnemonics and the prefixes to the proto.
 CanonicalizedInstructionProto ProtoFromInstruction(
     const Instruction& instruction);
+CanonicalizedInstructionProto ProtoFromInstruction(Instruction&& instruction);
 
 // Creates a basic block data structure from a proto.
 BasicBlock BasicBlockFromProto(const BasicBlockProto& proto);
+BasicBlock BasicBlockFromProto(BasicBlockProto&& proto);
+
+// Replaces the contents of `block` with data from a proto. Reuses the memory
+// already allocated by `block` and its instructions where possible. When the
+// same block object is used for a stream of protos, this removes most of the
+// memory allocations done by BasicBlockFromProto().
+void AssignBasicBlockFromProto(const BasicBlockProto& proto, BasicBlock& block);
+void AssignBasicBlockFromProto(BasicBlockProto&& proto, BasicBlock& block);
+
+// A read-only view of a CanonicalizedInstructionProto that provides the
+// instruction without creating an Instruction object. The view can be passed to
+// BasicBlockGraphBuilder::AddBasicBlockFromInstructionViews(), which creates
+// the Instruction only when it is not in the instruction fragment cache. The
+// view does not own the proto; the proto must outlive the view.
+class InstructionProtoView {
+ public:
+  explicit InstructionProtoView(const CanonicalizedInstructionProto& proto)
+      : proto_(&proto) {}
+
+  // Returns the same value as InstructionFromProto(proto()).Hash().
+  uint64_t Hash() const;
+
+  // Returns true when InstructionFromProto(proto()) == instruction, without
+  // creating the Instruction.
+  bool Equals(const Instruction& instruction) const;
+
+  // Replaces the contents of `instruction` with the viewed instruction. Reuses
+  // the memory already allocated by `instruction` where possible.
+  void AssignTo(Instruction& instruction) const {
+    AssignInstructionFromProto(*proto_, instruction);
+  }
+
+  const CanonicalizedInstructionProto& proto() const { return *proto_; }
+
+ private:
+  const CanonicalizedInstructionProto* proto_;
+};
+
+// Returns views of the instructions of `proto`, in the order in which they
+// appear in the basic block. The views point to the instruction protos in
+// `proto`.
+std::vector<InstructionProtoView> InstructionProtoViews(
+    const BasicBlockProto& proto);
+
+// Creates basic block data structures from all basic blocks in a list of basic
+// blocks with throughput, in the order in which they appear in the list. The
+// throughput information is ignored. Each basic block is converted in place in
+// the returned vector.
+std::vector<BasicBlock> BasicBlocksFromProto(
+    const BasicBlockWithThroughputListProto& proto);
+std::vector<BasicBlock> BasicBlocksFromProto(
+    BasicBlockWithThroughputListProto&& proto);
 
 }  // namespace gematria
 
@@ -14,9 +14,13 @@
 
 #include "gematria/basic_block/basic_block_protos.h"
 
+#include <utility>
+#include <vector>
+
 #include "gematria/basic_block/basic_block.h"
 #include "gematria/proto/basic_block.pb.h"
 #include "gematria/proto/canonicalized_instruction.pb.h"
+#include "gematria/proto/throughput.pb.h"
 #include "gematria/testing/matchers.h"
 #include "gematria/testing/parse_proto.h"
 #include "gmock/gmock.h"
@@ -172,6 +176,22 @@ TEST(InstructionFromProtoTest, AllFields) {
                   {InstructionOperand::Register("EFLAGS")}));
 }
 
+TEST(InstructionFromProtoTest, MovesFromRvalue) {
+  const CanonicalizedInstructionProto proto = ParseTextProto(R"pb(
+    mnemonic: "MOV"
+    prefixes: "LOCK"
+    llvm_mnemonic: "MOV64rm"
+    output_operands { register_name: "RCX" }
+    input_operands {
+      address { base_register: "RAX" index_register: "RBX" scaling: 1 }
+    }
+    input_operands { memory { alias_group_id: 1 } }
+  )pb");
+  CanonicalizedInstructionProto proto_copy = proto;
+  EXPECT_EQ(InstructionFromProto(std::move(proto_copy)),
+            InstructionFromProto(proto));
+}
+
 TEST(ProtoFromInstructionTest, AllFields) {
   EXPECT_THAT(ProtoFromInstruction(Instruction(
                   /* mnemonic = */ "ADC", /* llvm_mnemonic = */ "ADC32rr",
@@ -234,5 +254,168 @@ TEST(BasicBlockFromProtoTest, SomeInstructions) {
                /* implicit_output_operands = */ {})}));
 }
 
+TEST(AssignBasicBlockFromProtoTest, ReplacesPreviousContents) {
+  const BasicBlockProto long_proto = ParseTextProto(R"pb(
+    canonicalized_instructions: {
+      mnemonic: "MOV"
+      llvm_mnemonic: "MOV64rm"
+      prefixes: "LOCK"
+      output_operands: { register_name: "RCX" }
+      input_operands: {
+        address: { base_register: "RAX" displacement: 16 }
+      }
+      input_operands: { memory: { alias_group_id: 1 } }
+    }
+    canonicalized_instructions: {
+      mnemonic: "NOT"
+      llvm_mnemonic: "NOT64r"
+      output_operands: { register_name: "RCX" }
+      input_operands: { register_name: "RCX" }
+    }
+  )pb");
+  const BasicBlockProto short_proto = ParseTextProto(R"pb(
+    canonicalized_instructions: {
+      mnemonic: "ADD"
+      llvm_mnemonic: "ADD64rr"
+      output_operands: { register_name: "RAX" }
+      input_operands: { register_name: "RAX" }
+      input_operands: { register_name: "RBX" }
+      implicit_output_operands: { register_name: "EFLAGS" }
+    }
+  )pb");
+
+  BasicBlock block;
+  AssignBasicBlockFromProto(long_proto, block);
+  EXPECT_EQ(block, BasicBlockFromProto(long_proto));
+  AssignBasicBlockFromProto(short_proto, block);
+  EXPECT_EQ(block, BasicBlockFromProto(short_proto));
+  AssignBasicBlockFromProto(long_proto, block);
+  EXPECT_EQ(block, BasicBlockFromProto(long_proto));
+
+  BasicBlockProto short_proto_copy = short_proto;
+  AssignBasicBlockFromProto(std::move(short_proto_copy), block);
+  EXPECT_EQ(block, BasicBlockFromProto(short_proto));
+}
+
+TEST(InstructionProtoViewTest, HashAndAssign) {
+  const BasicBlockProto proto = ParseTextProto(R"pb(
+    canonicalized_instructions {
+      mnemonic: "MOV"
+      prefixes: "LOCK"
+      llvm_mnemonic: "MOV64rm"
+      output_operands { register_name: "RCX" }
+      input_operands {
+        address {
+          base_register: "RAX"
+          displacement: -8
+          index_register: "RBX"
+          scaling: 2
+          segment: "FS"
+        }
+      }
+      input_operands { memory { alias_group_id: 1 } }
+    }
+    canonicalized_instructions {
+      mnemonic: "ADD"
+      llvm_mnemonic: "ADD64ri8"
+      output_operands { register_name: "RAX" }
+      input_operands { register_name: "RAX" }
+      input_operands { immediate_value: 16 }
+      implicit_input_operands { fp_immediate_value: 1.5 }
+      implicit_output_operands { register_name: "EFLAGS" }
+      implicit_output_operands {}
+    }
+  )pb");
+  const std::vector<InstructionProtoView> views = InstructionProtoViews(proto);
+  ASSERT_EQ(views.size(), 2);
+  Instruction instruction;
+  for (int i = 0; i < views.size(); ++i) {
+    const Instruction expected =
+        InstructionFromProto(proto.canonicalized_instructions(i));
+    EXPECT_EQ(&views[i].proto(), &proto.canonicalized_instructions(i));
+    EXPECT_EQ(views[i].Hash(), expected.Hash());
+    views[i].AssignTo(instruction);
+    EXPECT_EQ(instruction, expected);
+    EXPECT_TRUE(views[i].Equals(expected));
+  }
+}
+
+TEST(InstructionProtoViewTest, Equals) {
+  const BasicBlockProto proto = ParseTextProto(R"pb(
+    canonicalized_instructions {
+      mnemonic: "MOV"
+      llvm_mnemonic: "MOV64rm"
+      output_operands { register_name: "RCX" }
+      input_operands {
+        address { base_register: "RAX" displacement: -8 scaling: 1 }
+      }
+      input_operands { memory { alias_group_id: 1 } }
+    }
+  )pb");
+  const InstructionProtoView view(proto.canonicalized_instructions(0));
+  const Instruction instruction =
+      InstructionFromProto(proto.canonicalized_instructions(0));
+  EXPECT_TRUE(view.Equals(instruction));
+
+  Instruction different = instruction;
+  different.prefixes.push_back("LOCK");
+  EXPECT_FALSE(view.Equals(different));
+
+  different = instruction;
+  different.output_operands[0] = InstructionOperand::Register("RDX");
+  EXPECT_FALSE(view.Equals(different));
+
+  different = instruction;
+  different.input_operands[0] =
+      InstructionOperand::Address("RAX", -16, "", 1, "");
+  EXPECT_FALSE(view.Equals(different));
+
+  different = instruction;
+  different.input_operands[1] = InstructionOperand::MemoryLocation(2);
+  EXPECT_FALSE(view.Equals(different));
+
+  different = instruction;
+  different.input_operands.pop_back();
+  EXPECT_FALSE(view.Equals(different));
+}
+
+TEST(BasicBlocksFromProtoTest, ThroughputList) {
+  const BasicBlockWithThroughputListProto proto = ParseTextProto(R"pb(
+    basic_blocks {
+      basic_block {
+        canonicalized_instructions: {
+          mnemonic: "NOT"
+          llvm_mnemonic: "NOT64r"
+          output_operands: { register_name: "RCX" }
+          input_operands: { register_name: "RCX" }
+        }
+      }
+      inverse_throughputs {
+        source: "test"
+        inverse_throughput_cycles: 1
+      }
+    }
+    basic_blocks {
+      basic_block {
+        canonicalized_instructions: {
+          mnemonic: "MOV"
+          llvm_mnemonic: "MOV64rm"
+          output_operands: { register_name: "RCX" }
+          input_operands: {
+            address: { base_register: "RAX" displacement: 16 }
+          }
+        }
+      }
+    }
+  )pb");
+  const std::vector<BasicBlock> expected_blocks = {
+      BasicBlockFromProto(proto.basic_blocks(0).basic_block()),
+      BasicBlockFromProto(proto.basic_blocks(1).basic_block())};
+  EXPECT_EQ(BasicBlocksFromProto(proto), expected_blocks);
+
+  BasicBlockWithThroughputListProto proto_copy = proto;
+  EXPECT_EQ(BasicBlocksFromProto(std::move(proto_copy)), expected_blocks);
+}
+
 }  // namespace
 }  // namespace gematria
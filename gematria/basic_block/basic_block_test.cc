@@ -16,8 +16,10 @@
 
 #include <cstdint>
 #include <string>
+#include <string_view>
 #include <vector>
 
+#include "gematria/basic_block/token_interner.h"
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 
@@ -165,6 +167,15 @@ TEST(InstructionOperandTest, ConstructorRegister) {
   EXPECT_EQ(operand.register_name(), "R10");
 }
 
+TEST(InstructionOperandTest, ConstructorRegisterFromId) {
+  const TokenId register_id = TokenInterner::Global().Intern("R11");
+  const auto operand = InstructionOperand::RegisterFromId(register_id);
+  EXPECT_EQ(operand.type(), OperandType::kRegister);
+  EXPECT_EQ(operand.register_id(), register_id);
+  EXPECT_EQ(operand.register_name(), "R11");
+  EXPECT_EQ(operand, InstructionOperand::Register("R11"));
+}
+
 TEST(InstructionOperandTest, ConstructorImmediateValue) {
   const auto operand = InstructionOperand::ImmediateValue(123);
   EXPECT_EQ(operand.type(), OperandType::kImmediateValue);
@@ -198,6 +209,25 @@ TEST(InstructionOperandTest, ConstructorFromMemoryLocation) {
   EXPECT_EQ(operand.alias_group_id(), kAliasGroupId);
 }
 
+TEST(InstructionOperandTest, CopyAndAssign) {
+  const auto address = InstructionOperand::Address("RSI", -16, "RDI", 0, "");
+  InstructionOperand operand = address;
+  EXPECT_EQ(operand, address);
+  EXPECT_EQ(operand.address(), AddressTuple("RSI", -16, "RDI", 0, ""));
+
+  operand = InstructionOperand::Register("RAX");
+  EXPECT_EQ(operand.type(), OperandType::kRegister);
+  EXPECT_EQ(operand.register_name(), "RAX");
+  // Assigning to the copy does not change the original operand.
+  EXPECT_EQ(address.address(), AddressTuple("RSI", -16, "RDI", 0, ""));
+}
+
+TEST(InstructionOperandTest, IsCompact) {
+  // Only one payload is stored in the operand at a time, and the address tuple
+  // is stored out of line.
+  EXPECT_LE(sizeof(InstructionOperand), 3 * sizeof(void*));
+}
+
 TEST(InstructionOperandTest, Equality) {
   // Registers.
   const auto operand_rax_a = InstructionOperand::Register("RAX");
@@ -376,6 +406,46 @@ TEST(InstructionTest, AsTokenList) {
                           kImmediateToken, kMemoryToken, kDelimiterToken));
 }
 
+TEST(InstructionTest, ForEachToken) {
+  const Instruction instruction(
+      /* mnemonic = */ "ADD",
+      /* llvm_mnemonic = */ "ADD64rm",
+      /* prefixes = */ {"LOCK"},
+      /* input_operands = */
+      {InstructionOperand::Register("RAX"),
+       InstructionOperand::Address("RSI", 8, "", 0, "FS"),
+       InstructionOperand::MemoryLocation(1)},
+      /* implicit_input_operands = */ {},
+      /* output_operands = */ {InstructionOperand::Register("RAX")},
+      /* implicit_output_operands = */
+      {InstructionOperand::Register("EFLAGS")});
+  std::vector<std::string> tokens;
+  instruction.ForEachToken(
+      [&tokens](std::string_view token) { tokens.emplace_back(token); });
+  EXPECT_THAT(tokens, ElementsAreArray(instruction.AsTokenList()));
+}
+
+TEST(InstructionTest, AddTokenIndicesToList) {
+  constexpr int kOutOfVocabularyIndex = 100;
+  const TokenVocabulary vocabulary(
+      {std::string(kDelimiterToken), std::string(kImmediateToken), "MOV",
+       "RAX", "RBX"},
+      kOutOfVocabularyIndex);
+  const Instruction instruction(
+      /* mnemonic = */ "MOV",
+      /* llvm_mnemonic = */ "MOV64ri",
+      /* prefixes = */ {},
+      /* input_operands = */ {InstructionOperand::ImmediateValue(1)},
+      /* implicit_input_operands = */ {InstructionOperand::Register("RBX")},
+      /* output_operands = */ {InstructionOperand::Register("RAX")},
+      /* implicit_output_operands = */
+      {InstructionOperand::Register("EFLAGS")});
+  std::vector<int> token_indices = {42};
+  instruction.AddTokenIndicesToList(vocabulary, token_indices);
+  EXPECT_THAT(token_indices,
+              ElementsAre(42, 2, 0, 3, kOutOfVocabularyIndex, 0, 1, 4, 0));
+}
+
 TEST(InstructionTest, ToString) {
   const Instruction instruction(
       /* mnemonic = */ "ADC",
@@ -565,5 +635,73 @@ TEST(BasicBlockTest, ToString) {
   EXPECT_EQ(block.ToString(), kExpectedString);
 }
 
+BasicBlock MakeBasicBlockForHashing() {
+  return BasicBlock(
+      {Instruction(
+           /* mnemonic = */ "MOV", /* llvm_mnemonic = */ "MOV64rm",
+           /* prefixes = */ {"LOCK"},
+           /* input_operands = */
+           {InstructionOperand::Address("RSI", 8, "RDI", 2, "FS"),
+            InstructionOperand::MemoryLocation(1)},
+           /* implicit_input_operands = */ {},
+           /* output_operands = */ {InstructionOperand::Register("RAX")},
+           /* implicit_output_operands = */ {}),
+       Instruction(
+           /* mnemonic = */ "ADD", /* llvm_mnemonic = */ "ADD64ri32",
+           /* prefixes = */ {},
+           /* input_operands = */
+           {InstructionOperand::Register("RAX"),
+            InstructionOperand::ImmediateValue(16)},
+           /* implicit_input_operands = */ {},
+           /* output_operands = */ {InstructionOperand::Register("RAX")},
+           /* implicit_output_operands = */
+           {InstructionOperand::Register("EFLAGS")})});
+}
+
+TEST(BasicBlockTest, HashIsConsistentWithEquality) {
+  const BasicBlock block = MakeBasicBlockForHashing();
+  BasicBlock same_block = MakeBasicBlockForHashing();
+  // The address and the size of instructions are ignored by operator==.
+  same_block.instructions[0].address = 0x1000;
+  same_block.instructions[0].size = 5;
+  ASSERT_EQ(block, same_block);
+  EXPECT_EQ(block.Hash(), same_block.Hash());
+  EXPECT_EQ(std::hash<BasicBlock>()(block), std::hash<BasicBlock>()(block));
+
+  EXPECT_EQ(InstructionOperand::FpImmediateValue(0.0).Hash(),
+            InstructionOperand::FpImmediateValue(-0.0).Hash());
+}
+
+TEST(BasicBlockTest, HashDependsOnContents) {
+  const BasicBlock block = MakeBasicBlockForHashing();
+  std::vector<BasicBlock> different_blocks(8, block);
+  different_blocks[0].instructions[0].mnemonic = "MOVX";
+  different_blocks[1].instructions[0].prefixes.clear();
+  different_blocks[2].instructions[1].input_operands[1] =
+      InstructionOperand::ImmediateValue(17);
+  different_blocks[3].instructions[0].input_operands[0] =
+      InstructionOperand::Address("RSI", 8, "RDI", 3, "FS");
+  different_blocks[4].instructions[1].output_operands[0] =
+      InstructionOperand::Register("RBX");
+  std::swap(different_blocks[5].instructions[0],
+            different_blocks[5].instructions[1]);
+  different_blocks[6].instructions.pop_back();
+  // Moving an operand to a different list changes the hash.
+  different_blocks[7].instructions[1].implicit_input_operands.push_back(
+      InstructionOperand::Register("EFLAGS"));
+  different_blocks[7].instructions[1].implicit_output_operands.clear();
+
+  for (const BasicBlock& different_block : different_blocks) {
+    ASSERT_NE(block, different_block);
+    EXPECT_NE(block.Hash(), different_block.Hash()) << different_block;
+  }
+}
+
+TEST(BasicBlockTest, HashIsStable) {
+  // The hash may be stored in files and used across processes. Changing the
+  // hash function invalidates such files.
+  EXPECT_EQ(MakeBasicBlockForHashing().Hash(), 0x323508618c2e1318u);
+}
+
 }  // namespace
 }  // namespace gematria
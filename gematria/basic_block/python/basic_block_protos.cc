@@ -14,6 +14,7 @@
 
 #include "gematria/basic_block/basic_block_protos.h"
 
+#include "gematria/proto/basic_block.pb.h"
 #include "gematria/proto/canonicalized_instruction.pb.h"
 #include "pybind11/cast.h"
 #include "pybind11/detail/common.h"
@@ -29,11 +30,23 @@ PYBIND11_MODULE(basic_block_protos, m) {
 
   m.doc() = "Functions for converting protos to Gematria data structures.";
 
-  m.def("basic_block_from_proto", BasicBlockFromProto, py::arg("proto"));
-  m.def("instruction_from_proto", InstructionFromProto, py::arg("proto"));
-  m.def("instruction_operand_from_proto", InstructionOperandFromProto,
+  // The conversion functions are overloaded for rvalue references; the Python
+  // bindings always use the versions that copy from the proto.
+  m.def("basic_block_from_proto",
+        py::overload_cast<const BasicBlockProto&>(BasicBlockFromProto),
+        py::arg("proto"));
+  m.def("instruction_from_proto",
+        py::overload_cast<const CanonicalizedInstructionProto&>(
+            InstructionFromProto),
+        py::arg("proto"));
+  m.def("instruction_operand_from_proto",
+        py::overload_cast<const CanonicalizedOperandProto&>(
+            InstructionOperandFromProto),
+        py::arg("proto"));
+  m.def("address_tuple_from_proto",
+        py::overload_cast<const CanonicalizedOperandProto::AddressTuple&>(
+            AddressTupleFromProto),
         py::arg("proto"));
-  m.def("address_tuple_from_proto", AddressTupleFromProto, py::arg("proto"));
 }
 
 }  // namespace gematria
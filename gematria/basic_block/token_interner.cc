@@ -0,0 +1,81 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/basic_block/token_interner.h"
+
+#include <cassert>
+#include <cstddef>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace gematria {
+
+TokenInterner& TokenInterner::Global() {
+  // The interner is intentionally leaked to avoid problems with the order of
+  // destruction of static objects.
+  static TokenInterner* const interner = new TokenInterner();
+  return *interner;
+}
+
+TokenId TokenInterner::Intern(std::string_view token) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (const auto it = ids_.find(token); it != ids_.end()) return it->second;
+  const size_t token_id = size_.load(std::memory_order_relaxed);
+  const size_t chunk_index = token_id / kChunkSize;
+  if (chunk_index == kMaxChunks) {
+    std::cerr << "Too many interned tokens";
+    std::abort();
+  }
+  std::unique_ptr<std::string[]>& chunk = chunks_[chunk_index];
+  if (chunk == nullptr) chunk = std::make_unique<std::string[]>(kChunkSize);
+  std::string& stored_token = chunk[token_id % kChunkSize];
+  stored_token.assign(token);
+  ids_.emplace(stored_token, static_cast<TokenId>(token_id));
+  size_.store(token_id + 1, std::memory_order_release);
+  return static_cast<TokenId>(token_id);
+}
+
+TokenId TokenInterner::Find(std::string_view token) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto it = ids_.find(token);
+  return it == ids_.end() ? kInvalidTokenId : it->second;
+}
+
+TokenVocabulary::TokenVocabulary(std::vector<std::string> tokens,
+                                 int out_of_vocabulary_index)
+    : out_of_vocabulary_index_(out_of_vocabulary_index),
+      tokens_(std::move(tokens)) {
+  TokenInterner& interner = TokenInterner::Global();
+  index_by_token_.reserve(tokens_.size());
+  for (int i = 0; i < tokens_.size(); ++i) {
+    const TokenId token_id = interner.Intern(tokens_[i]);
+    if (!index_by_token_.emplace(interner.token(token_id), i).second) {
+      // TODO(ondrasej): Make this return a status.
+      std::cerr << "Duplicate token: '" << tokens_[i] << "'";
+      std::abort();
+    }
+    if (token_id >= index_by_token_id_.size()) {
+      index_by_token_id_.resize(token_id + 1, out_of_vocabulary_index_);
+    }
+    index_by_token_id_[token_id] = i;
+  }
+}
+
+}  // namespace gematria
@@ -0,0 +1,152 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Contains a symbol table that maps the tokens used in the basic block data
+// model (register names, mnemonics and prefixes) to small integer IDs.
+
+#ifndef GEMATRIA_BASIC_BLOCK_TOKEN_INTERNER_H_
+#define GEMATRIA_BASIC_BLOCK_TOKEN_INTERNER_H_
+
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace gematria {
+
+// The type of the IDs of interned tokens.
+using TokenId = int32_t;
+
+// The value used for tokens that are not interned.
+inline constexpr TokenId kInvalidTokenId = -1;
+
+// A symbol table that assigns a unique ID to each distinct token. The IDs are
+// assigned sequentially from zero, so they can be used directly as indices into
+// tables indexed by token. Once assigned, an ID never changes and the string
+// returned by token() remains valid for the whole lifetime of the interner.
+//
+// All methods are thread-safe. token() does not take a lock, so it can be used
+// on hot paths.
+//
+// Typical usage:
+//   TokenInterner& interner = TokenInterner::Global();
+//   const TokenId rax = interner.Intern("RAX");
+//   assert(interner.token(rax) == "RAX");
+class TokenInterner {
+ public:
+  TokenInterner() = default;
+
+  TokenInterner(const TokenInterner&) = delete;
+  TokenInterner& operator=(const TokenInterner&) = delete;
+
+  // Returns the process-wide interner used by the basic block data model. The
+  // IDs stored in InstructionOperand refer to this interner.
+  static TokenInterner& Global();
+
+  // Returns the ID of `token`. Assigns a new ID when `token` was not interned
+  // before.
+  TokenId Intern(std::string_view token);
+
+  // Returns the ID of `token`, or kInvalidTokenId when `token` was not interned
+  // before.
+  TokenId Find(std::string_view token) const;
+
+  // Returns the token with the given ID. `token_id` must be an ID returned by
+  // Intern() of this interner.
+  const std::string& token(TokenId token_id) const {
+    assert(token_id >= 0);
+    assert(token_id < size());
+    // A thread can only have an ID after a call to Intern() or Find() that
+    // returned it, or after receiving the ID from such a thread. Either way,
+    // the write of the chunk and the token happens-before this read.
+    return chunks_[token_id / kChunkSize][token_id % kChunkSize];
+  }
+
+  // Returns the number of interned tokens. All IDs assigned by the interner are
+  // smaller than this value.
+  size_t size() const { return size_.load(std::memory_order_acquire); }
+
+ private:
+  // The tokens are stored in fixed-size chunks that are never moved or freed,
+  // so that token() can read them without a lock while other threads intern
+  // new tokens.
+  static constexpr size_t kChunkSize = 4096;
+  static constexpr size_t kMaxChunks = 4096;
+
+  mutable std::mutex mutex_;
+  // The interned tokens; the token with ID i is in chunk i / kChunkSize at
+  // position i % kChunkSize. New chunks are allocated under `mutex_`.
+  std::array<std::unique_ptr<std::string[]>, kMaxChunks> chunks_;
+  // The number of interned tokens.
+  std::atomic<size_t> size_ = 0;
+  // Maps the interned tokens to their IDs. The keys point to the strings in
+  // `chunks_`. Guarded by `mutex_`.
+  std::unordered_map<std::string_view, TokenId> ids_;
+};
+
+// Maps tokens to their indices in a vocabulary, e.g. the token list of a model.
+// The vocabulary is immutable after construction, so lookups do not take any
+// lock and can run concurrently on hot paths; lookups by TokenId do not hash
+// the token. Building the indices takes a noticeable time for large
+// vocabularies, so users that need the same vocabulary in many places, e.g.
+// the graph builders of all instances of a model, share one object.
+class TokenVocabulary {
+ public:
+  // Creates the vocabulary; the index of each token is its position in
+  // `tokens`. Interns all tokens in TokenInterner::Global(). Tokens that are
+  // not in the vocabulary are mapped to `out_of_vocabulary_index`. Aborts when
+  // `tokens` contains duplicates.
+  explicit TokenVocabulary(std::vector<std::string> tokens,
+                           int out_of_vocabulary_index = -1);
+
+  // Returns the index of `token`, or the out-of-vocabulary index when `token`
+  // is not in the vocabulary.
+  int IndexOf(std::string_view token) const {
+    const auto it = index_by_token_.find(token);
+    return it == index_by_token_.end() ? out_of_vocabulary_index_ : it->second;
+  }
+  int IndexOf(TokenId token_id) const {
+    assert(token_id >= 0);
+    return token_id < index_by_token_id_.size() ? index_by_token_id_[token_id]
+                                                : out_of_vocabulary_index_;
+  }
+
+  // Returns the tokens of the vocabulary, in the order of their indices.
+  const std::vector<std::string>& tokens() const { return tokens_; }
+  // Returns the number of tokens in the vocabulary.
+  int size() const { return static_cast<int>(tokens_.size()); }
+
+ private:
+  // The indices of tokens in the vocabulary, indexed by the ID of the token.
+  // All tokens of the vocabulary are interned by the constructor, so tokens
+  // interned later are never in the vocabulary.
+  std::vector<int> index_by_token_id_;
+  // The indices of tokens in the vocabulary, keyed by the token. The keys point
+  // to the strings owned by TokenInterner::Global(), which are never moved or
+  // freed.
+  std::unordered_map<std::string_view, int> index_by_token_;
+  int out_of_vocabulary_index_;
+  std::vector<std::string> tokens_;
+};
+
+}  // namespace gematria
+
+#endif  // GEMATRIA_BASIC_BLOCK_TOKEN_INTERNER_H_
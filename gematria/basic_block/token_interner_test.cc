@@ -0,0 +1,109 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/basic_block/token_interner.h"
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace gematria {
+namespace {
+
+using ::testing::Each;
+using ::testing::ElementsAre;
+using ::testing::Eq;
+
+TEST(TokenInternerTest, InternAssignsSequentialIds) {
+  TokenInterner interner;
+  EXPECT_EQ(interner.size(), 0);
+  EXPECT_EQ(interner.Intern("RAX"), 0);
+  EXPECT_EQ(interner.Intern("RBX"), 1);
+  EXPECT_EQ(interner.Intern("RAX"), 0);
+  EXPECT_EQ(interner.size(), 2);
+}
+
+TEST(TokenInternerTest, Find) {
+  TokenInterner interner;
+  const TokenId rax = interner.Intern("RAX");
+  EXPECT_EQ(interner.Find("RAX"), rax);
+  EXPECT_EQ(interner.Find("RBX"), kInvalidTokenId);
+  // Find() does not intern the token.
+  EXPECT_EQ(interner.size(), 1);
+}
+
+TEST(TokenInternerTest, TokenReferencesAreStable) {
+  TokenInterner interner;
+  const TokenId rax = interner.Intern("RAX");
+  const std::string& rax_token = interner.token(rax);
+  for (int i = 0; i < 1000; ++i) {
+    interner.Intern("TOKEN" + std::to_string(i));
+  }
+  EXPECT_EQ(&interner.token(rax), &rax_token);
+  EXPECT_EQ(rax_token, "RAX");
+}
+
+TEST(TokenInternerTest, ConcurrentIntern) {
+  static constexpr int kNumThreads = 4;
+  static constexpr int kNumTokens = 100;
+  TokenInterner interner;
+  std::vector<std::vector<TokenId>> ids(kNumThreads);
+  std::vector<std::thread> threads;
+  for (int thread = 0; thread < kNumThreads; ++thread) {
+    threads.emplace_back([&interner, &thread_ids = ids[thread]]() {
+      for (int i = 0; i < kNumTokens; ++i) {
+        thread_ids.push_back(interner.Intern("TOKEN" + std::to_string(i)));
+      }
+    });
+  }
+  for (std::thread& thread : threads) thread.join();
+  EXPECT_EQ(interner.size(), kNumTokens);
+  EXPECT_THAT(ids, Each(Eq(ids.front())));
+  for (int i = 0; i < kNumTokens; ++i) {
+    EXPECT_EQ(interner.token(ids.front()[i]), "TOKEN" + std::to_string(i));
+  }
+}
+
+TEST(TokenVocabularyTest, IndexOf) {
+  const TokenVocabulary vocabulary({"MOV", "RAX", "RBX"},
+                                   /* out_of_vocabulary_index = */ 3);
+  EXPECT_EQ(vocabulary.size(), 3);
+  EXPECT_EQ(vocabulary.IndexOf("MOV"), 0);
+  EXPECT_EQ(vocabulary.IndexOf("RBX"), 2);
+  EXPECT_EQ(vocabulary.IndexOf(TokenInterner::Global().Intern("RAX")), 1);
+  EXPECT_EQ(vocabulary.IndexOf("ThisTokenIsNotInTheVocabulary"), 3);
+  EXPECT_EQ(vocabulary.IndexOf(TokenInterner::Global().Intern("RCX")), 3);
+}
+
+TEST(TokenVocabularyTest, Tokens) {
+  const TokenVocabulary vocabulary({"MOV", "RAX"});
+  EXPECT_THAT(vocabulary.tokens(), ElementsAre("MOV", "RAX"));
+  // Tokens interned after the vocabulary was created are not in it.
+  TokenInterner::Global().Intern("InternedAfterTheVocabulary");
+  EXPECT_EQ(vocabulary.IndexOf("InternedAfterTheVocabulary"), -1);
+  EXPECT_EQ(vocabulary.IndexOf(
+                TokenInterner::Global().Intern("InternedAfterTheVocabulary")),
+            -1);
+}
+
+TEST(TokenVocabularyDeathTest, DuplicateTokens) {
+  EXPECT_DEATH(TokenVocabulary({"MOV", "RAX", "MOV"}),
+               "Duplicate token: 'MOV'");
+}
+
+}  // namespace
+}  // namespace gematria
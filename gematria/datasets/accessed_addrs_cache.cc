@@ -0,0 +1,214 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/datasets/accessed_addrs_cache.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_format.h"
+#include "absl/strings/str_join.h"
+#include "absl/strings/str_split.h"
+#include "absl/types/span.h"
+#include "gematria/datasets/find_accessed_addrs.h"
+#include "gematria/utils/string.h"
+
+namespace gematria {
+namespace {
+
+// The first word of the header line of cache files. The number at the end is
+// the version of the file format.
+constexpr std::string_view kCacheFileMagic = "GEMATRIA_ACCESSED_ADDRS_CACHE_1";
+
+// The number of values in the second column of an entry: the code location,
+// the block size, and the initial values of the sixteen registers.
+constexpr int kNumScalarValues = 18;
+
+std::string KeyForMachineCode(absl::Span<const uint8_t> machine_code) {
+  return FormatAsHexString(std::string_view(
+      reinterpret_cast<const char*>(machine_code.data()), machine_code.size()));
+}
+
+// Returns the fields of X64Regs in the order in which they are stored in the
+// cache file.
+std::vector<int64_t*> RegisterFields(X64Regs& regs) {
+  return {&regs.rax, &regs.rbx, &regs.rcx, &regs.rdx, &regs.rsi, &regs.rdi,
+          &regs.rsp, &regs.rbp, &regs.r8,  &regs.r9,  &regs.r10, &regs.r11,
+          &regs.r12, &regs.r13, &regs.r14, &regs.r15};
+}
+
+// Formats the entry as a line of the cache file, without the line break.
+// The line has three tab-separated columns: the machine code in hex, the
+// code location, block size, and the initial register values, and the
+// addresses of the accessed blocks. All numbers are in hex and separated by
+// commas.
+std::string FormatEntry(std::string_view key, AccessedAddrs accessed_addrs) {
+  std::vector<uint64_t> scalar_values = {accessed_addrs.code_location,
+                                         accessed_addrs.block_size};
+  for (const int64_t* reg : RegisterFields(accessed_addrs.initial_regs)) {
+    scalar_values.push_back(static_cast<uint64_t>(*reg));
+  }
+  const auto hex_formatter = [](std::string* out, uint64_t value) {
+    absl::StrAppend(out, absl::Hex(value));
+  };
+  return absl::StrCat(
+      key, "\t", absl::StrJoin(scalar_values, ",", hex_formatter), "\t",
+      absl::StrJoin(accessed_addrs.accessed_blocks, ",", hex_formatter));
+}
+
+// Parses a comma-separated list of hex numbers. Returns std::nullopt when one
+// of the numbers is not valid.
+std::optional<std::vector<uint64_t>> ParseHexList(std::string_view list) {
+  std::vector<uint64_t> values;
+  if (list.empty()) return values;
+  for (const std::string_view value_str : absl::StrSplit(list, ',')) {
+    uint64_t value = 0;
+    if (!absl::SimpleHexAtoi(value_str, &value)) return std::nullopt;
+    values.push_back(value);
+  }
+  return values;
+}
+
+// Parses a line created by FormatEntry(). Returns false when the line is not
+// valid.
+bool ParseEntry(std::string_view line, std::string& key,
+                AccessedAddrs& accessed_addrs) {
+  const std::vector<std::string_view> columns = absl::StrSplit(line, '\t');
+  if (columns.size() != 3 || columns[0].empty()) return false;
+  if (!ParseHexString(columns[0]).has_value()) return false;
+  const std::optional<std::vector<uint64_t>> scalar_values =
+      ParseHexList(columns[1]);
+  if (!scalar_values.has_value() ||
+      scalar_values->size() != kNumScalarValues) {
+    return false;
+  }
+  std::optional<std::vector<uint64_t>> accessed_blocks =
+      ParseHexList(columns[2]);
+  if (!accessed_blocks.has_value()) return false;
+
+  key = std::string(columns[0]);
+  accessed_addrs.code_location = (*scalar_values)[0];
+  accessed_addrs.block_size = (*scalar_values)[1];
+  const std::vector<int64_t*> registers =
+      RegisterFields(accessed_addrs.initial_regs);
+  for (int i = 0; i < registers.size(); ++i) {
+    *registers[i] = static_cast<int64_t>((*scalar_values)[i + 2]);
+  }
+  accessed_addrs.accessed_blocks.assign(accessed_blocks->begin(),
+                                        accessed_blocks->end());
+  return true;
+}
+
+}  // namespace
+
+AccessedAddrsCache::AccessedAddrsCache(std::string annotator_id)
+    : annotator_id_(std::move(annotator_id)) {}
+
+std::optional<AccessedAddrs> AccessedAddrsCache::Lookup(
+    absl::Span<const uint8_t> machine_code) const {
+  const std::string key = KeyForMachineCode(machine_code);
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto it = entries_.find(key);
+  if (it == entries_.end()) return std::nullopt;
+  return it->second;
+}
+
+void AccessedAddrsCache::Insert(absl::Span<const uint8_t> machine_code,
+                                const AccessedAddrs& accessed_addrs) {
+  std::string key = KeyForMachineCode(machine_code);
+  std::lock_guard<std::mutex> lock(mutex_);
+  entries_.insert_or_assign(std::move(key), accessed_addrs);
+}
+
+size_t AccessedAddrsCache::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return entries_.size();
+}
+
+absl::Status AccessedAddrsCache::SaveToFile(
+    const std::string& file_name) const {
+  // Write the entries to a temporary file first, so that an interrupted run
+  // does not destroy the cache from the previous runs.
+  const std::string temp_file_name = absl::StrCat(file_name, ".tmp");
+  {
+    std::ofstream out(temp_file_name, std::ios::trunc);
+    if (!out.is_open()) {
+      return absl::NotFoundError(absl::StrCat("Could not open ", file_name));
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    out << kCacheFileMagic << " " << annotator_id_ << "\n";
+    for (const auto& [key, accessed_addrs] : entries_) {
+      out << FormatEntry(key, accessed_addrs) << "\n";
+    }
+    out.close();
+    if (out.fail()) {
+      std::remove(temp_file_name.c_str());
+      return absl::InternalError(absl::StrCat("Could not write ", file_name));
+    }
+  }
+  if (std::rename(temp_file_name.c_str(), file_name.c_str()) != 0) {
+    std::remove(temp_file_name.c_str());
+    return absl::InternalError(absl::StrCat("Could not replace ", file_name));
+  }
+  return absl::OkStatus();
+}
+
+absl::Status AccessedAddrsCache::LoadFromFile(const std::string& file_name) {
+  std::ifstream in(file_name);
+  if (!in.is_open()) {
+    // A missing file is an empty cache; this is the case on the first run.
+    return absl::OkStatus();
+  }
+
+  std::string line;
+  std::getline(in, line);
+  const std::pair<std::string_view, std::string_view> header =
+      absl::StrSplit(line, absl::MaxSplits(' ', 1));
+  if (header.first != kCacheFileMagic) {
+    return absl::InvalidArgumentError(absl::StrFormat(
+        "%s is not an accessed address cache file", file_name));
+  }
+  if (header.second != annotator_id_) return absl::OkStatus();
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  int line_number = 1;
+  std::string key;
+  while (std::getline(in, line)) {
+    ++line_number;
+    if (line.empty()) continue;
+    AccessedAddrs accessed_addrs;
+    if (!ParseEntry(line, key, accessed_addrs)) {
+      return absl::InvalidArgumentError(absl::StrFormat(
+          "Invalid cache entry at %s:%d", file_name, line_number));
+    }
+    entries_.insert_or_assign(std::move(key), std::move(accessed_addrs));
+  }
+  if (in.bad()) {
+    return absl::InternalError(absl::StrCat("Could not read ", file_name));
+  }
+  return absl::OkStatus();
+}
+
+}  // namespace gematria
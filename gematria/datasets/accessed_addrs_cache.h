@@ -0,0 +1,87 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Contains a persistent cache of the results of the annotators that find the
+// memory accessed by a basic block (FindAccessedAddrs() and
+// ExegesisAnnotator). Data sets are converted many times, and the annotation of
+// the same machine code always gives the same results; with the cache, each
+// block is annotated only once.
+
+#ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_DATASETS_ACCESSED_ADDRS_CACHE_H_
+#define THIRD_PARTY_GEMATRIA_GEMATRIA_DATASETS_ACCESSED_ADDRS_CACHE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "absl/status/status.h"
+#include "absl/types/span.h"
+#include "gematria/datasets/find_accessed_addrs.h"
+
+namespace gematria {
+
+// A cache of AccessedAddrs keyed by the machine code of the basic block. All
+// methods are thread-safe, so a single cache can be shared by annotators
+// running on different threads.
+//
+// The cache can be saved to a file and loaded back in a later run. The file
+// records an identifier of the annotator that produced the entries, and the
+// cache ignores files created by a different annotator. The identifier must
+// change whenever the annotator changes in a way that affects its results.
+class AccessedAddrsCache {
+ public:
+  // Creates an empty cache for entries produced by the annotator identified by
+  // `annotator_id`. The identifier must not contain whitespace.
+  explicit AccessedAddrsCache(std::string annotator_id);
+
+  // Returns the cached result for `machine_code`, or std::nullopt when there
+  // is none.
+  std::optional<AccessedAddrs> Lookup(
+      absl::Span<const uint8_t> machine_code) const;
+
+  // Adds the result for `machine_code` to the cache. When the machine code is
+  // already in the cache, replaces the result.
+  void Insert(absl::Span<const uint8_t> machine_code,
+              const AccessedAddrs& accessed_addrs);
+
+  // Saves the contents of the cache to `file_name`. Replaces the file if it
+  // exists; the file is replaced only after all entries were written.
+  absl::Status SaveToFile(const std::string& file_name) const;
+
+  // Loads entries from a file created by SaveToFile(). Does nothing when the
+  // file does not exist or when it was created by a different annotator.
+  // Returns an error when the file can't be read or parsed.
+  absl::Status LoadFromFile(const std::string& file_name);
+
+  // Returns the number of entries in the cache.
+  size_t size() const;
+
+  const std::string& annotator_id() const { return annotator_id_; }
+
+ private:
+  const std::string annotator_id_;
+
+  mutable std::mutex mutex_;
+  // Maps the machine code formatted with FormatAsHexString() to the cached
+  // result. Guarded by `mutex_`.
+  std::unordered_map<std::string, AccessedAddrs> entries_;
+};
+
+}  // namespace gematria
+
+#endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_DATASETS_ACCESSED_ADDRS_CACHE_H_
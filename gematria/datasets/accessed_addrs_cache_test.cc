@@ -0,0 +1,138 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/datasets/accessed_addrs_cache.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <ios>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "gematria/datasets/find_accessed_addrs.h"
+#include "gematria/testing/matchers.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace gematria {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::Optional;
+
+class AccessedAddrsCacheTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    path_ = ::testing::TempDir() + "/accessed_addrs_cache.txt";
+    std::remove(path_.c_str());
+    accessed_addrs_ = {
+        .code_location = 0x2b0000000000,
+        .block_size = 4096,
+        .accessed_blocks = {0x15000, 0x800000000},
+        .initial_regs = {.rax = 0x15000, .rbx = -1, .r15 = 0x1000000},
+    };
+  }
+
+  // Checks that `actual` is equal to `accessed_addrs_`.
+  void ExpectSameAccessedAddrs(const std::optional<AccessedAddrs>& actual) {
+    ASSERT_TRUE(actual.has_value());
+    EXPECT_EQ(actual->code_location, accessed_addrs_.code_location);
+    EXPECT_EQ(actual->block_size, accessed_addrs_.block_size);
+    EXPECT_EQ(actual->accessed_blocks, accessed_addrs_.accessed_blocks);
+    EXPECT_EQ(actual->initial_regs.rax, accessed_addrs_.initial_regs.rax);
+    EXPECT_EQ(actual->initial_regs.rbx, accessed_addrs_.initial_regs.rbx);
+    EXPECT_EQ(actual->initial_regs.rcx, accessed_addrs_.initial_regs.rcx);
+    EXPECT_EQ(actual->initial_regs.r15, accessed_addrs_.initial_regs.r15);
+  }
+
+  std::string path_;
+  const std::vector<uint8_t> machine_code_ = {0x3b, 0x31};
+  AccessedAddrs accessed_addrs_;
+};
+
+TEST_F(AccessedAddrsCacheTest, LookupAndInsert) {
+  AccessedAddrsCache cache("fast-1");
+  EXPECT_EQ(cache.Lookup(machine_code_), std::nullopt);
+  cache.Insert(machine_code_, accessed_addrs_);
+  EXPECT_EQ(cache.size(), 1);
+  ExpectSameAccessedAddrs(cache.Lookup(machine_code_));
+  EXPECT_EQ(cache.Lookup(std::vector<uint8_t>{0x3b}), std::nullopt);
+
+  // Inserting the same machine code again replaces the entry.
+  accessed_addrs_.accessed_blocks = {0x10000};
+  cache.Insert(machine_code_, accessed_addrs_);
+  EXPECT_EQ(cache.size(), 1);
+  EXPECT_THAT(cache.Lookup(machine_code_),
+              Optional(testing::Field(&AccessedAddrs::accessed_blocks,
+                                      ElementsAre(0x10000))));
+}
+
+TEST_F(AccessedAddrsCacheTest, SaveAndLoad) {
+  AccessedAddrsCache cache("fast-1");
+  cache.Insert(machine_code_, accessed_addrs_);
+  AccessedAddrs no_accesses = accessed_addrs_;
+  no_accesses.accessed_blocks.clear();
+  cache.Insert(std::vector<uint8_t>{0x48, 0x01, 0xd8}, no_accesses);
+  ASSERT_OK(cache.SaveToFile(path_));
+
+  AccessedAddrsCache loaded_cache("fast-1");
+  ASSERT_OK(loaded_cache.LoadFromFile(path_));
+  EXPECT_EQ(loaded_cache.size(), 2);
+  ExpectSameAccessedAddrs(loaded_cache.Lookup(machine_code_));
+  EXPECT_THAT(loaded_cache.Lookup(std::vector<uint8_t>{0x48, 0x01, 0xd8}),
+              Optional(testing::Field(&AccessedAddrs::accessed_blocks,
+                                      testing::IsEmpty())));
+}
+
+TEST_F(AccessedAddrsCacheTest, LoadMissingFile) {
+  AccessedAddrsCache cache("fast-1");
+  EXPECT_OK(cache.LoadFromFile(path_));
+  EXPECT_EQ(cache.size(), 0);
+}
+
+TEST_F(AccessedAddrsCacheTest, LoadFileFromDifferentAnnotator) {
+  AccessedAddrsCache cache("fast-1");
+  cache.Insert(machine_code_, accessed_addrs_);
+  ASSERT_OK(cache.SaveToFile(path_));
+
+  AccessedAddrsCache other_cache("exegesis-1");
+  EXPECT_OK(other_cache.LoadFromFile(path_));
+  EXPECT_EQ(other_cache.size(), 0);
+}
+
+TEST_F(AccessedAddrsCacheTest, LoadInvalidFile) {
+  {
+    std::ofstream file(path_, std::ios::trunc);
+    file << "not a cache file\n";
+  }
+  AccessedAddrsCache cache("fast-1");
+  EXPECT_THAT(cache.LoadFromFile(path_),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+
+  AccessedAddrsCache valid_cache("fast-1");
+  valid_cache.Insert(machine_code_, accessed_addrs_);
+  ASSERT_OK(valid_cache.SaveToFile(path_));
+  {
+    std::ofstream file(path_, std::ios::app);
+    file << "3b31\t1,2\t\n";
+  }
+  EXPECT_THAT(cache.LoadFromFile(path_),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
+}  // namespace
+}  // namespace gematria
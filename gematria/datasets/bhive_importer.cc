@@ -21,13 +21,12 @@
 #include <utility>
 #include <vector>
 
-#include "absl/container/inlined_vector.h"
 #include "absl/log/die_if_null.h"
 #include "absl/status/status.h"
 #include "absl/status/statusor.h"
 #include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
 #include "absl/strings/str_format.h"
-#include "absl/strings/str_split.h"
 #include "gematria/basic_block/basic_block_protos.h"
 #include "gematria/llvm/canonicalizer.h"
 #include "gematria/llvm/disassembler.h"
@@ -35,6 +34,7 @@
 #include "gematria/proto/basic_block.pb.h"
 #include "gematria/proto/throughput.pb.h"
 #include "gematria/utils/string.h"
+#include "gematria/utils/tracing.h"
 #include "llvm/ADT/ArrayRef.h"
 #include "llvm/MC/TargetRegistry.h"
 #include "llvm/Support/Error.h"
@@ -47,6 +47,28 @@ namespace {
 // each architecture, since it is guaranteed to always be there.
 constexpr int kDefaultSyntax = 0;
 
+// Finds the columns at `first_index` and `second_index` of the CSV line `line`
+// and stores them in `first` and `second`. Scans the line only up to the end of
+// the last of the two columns and does not allocate. Returns false when the
+// line has fewer columns.
+bool FindCsvColumns(std::string_view line, size_t first_index,
+                    size_t second_index, std::string_view& first,
+                    std::string_view& second) {
+  const size_t last_index = std::max(first_index, second_index);
+  size_t column_begin = 0;
+  for (size_t column = 0; column <= last_index; ++column) {
+    if (column_begin > line.size()) return false;
+    size_t column_end = line.find(',', column_begin);
+    if (column_end == std::string_view::npos) column_end = line.size();
+    const std::string_view value =
+        line.substr(column_begin, column_end - column_begin);
+    if (column == first_index) first = value;
+    if (column == second_index) second = value;
+    column_begin = column_end + 1;
+  }
+  return true;
+}
+
 }  // namespace
 
 BHiveImporter::BHiveImporter(const Canonicalizer* canonicalizer)
@@ -81,6 +103,7 @@ BasicBlockProto BHiveImporter::BasicBlockProtoFromInstructions(
 
 absl::StatusOr<BasicBlockProto> BHiveImporter::BasicBlockProtoFromMachineCode(
     llvm::ArrayRef<uint8_t> machine_code, uint64_t base_address /*= 0*/) {
+  GEMATRIA_TRACE_SCOPE("BHiveImporter::BasicBlockProtoFromMachineCode");
   BasicBlockProto basic_block_proto;
   llvm::Expected<std::vector<DisassembledInstruction>> instructions =
       DisassembleAllInstructions(*disassembler_,
@@ -98,28 +121,29 @@ absl::StatusOr<BasicBlockProto> BHiveImporter::BasicBlockProtoFromMachineCode(
 absl::StatusOr<BasicBlockProto>
 BHiveImporter::BasicBlockProtoFromMachineCodeHex(
     std::string_view machine_code_hex, uint64_t base_address /*= 0*/) {
-  const auto machine_code_bytes_or_status = ParseHexString(machine_code_hex);
-  if (!machine_code_bytes_or_status.has_value()) {
+  if (!ParseHexString(machine_code_hex, machine_code_buffer_)) {
     return absl::InvalidArgumentError(
         absl::StrCat("cannot parse: ", machine_code_hex));
   }
 
-  return BasicBlockProtoFromMachineCode(machine_code_bytes_or_status.value(),
-                                        base_address);
+  return BasicBlockProtoFromMachineCode(machine_code_buffer_, base_address);
 }
 
 absl::StatusOr<BasicBlockWithThroughputProto> BHiveImporter::ParseBHiveCsvLine(
     std::string_view source_name, std::string_view line,
     size_t machine_code_hex_column_index, size_t throughput_column_index,
     double throughput_scaling /*= 1.0*/, uint64_t base_address /*= 0*/) {
-  const absl::InlinedVector<std::string_view, 2> columns =
-      absl::StrSplit(line, ',');
-  const int min_required_num_columns =
-      std::max(machine_code_hex_column_index, throughput_column_index) + 1;
-  if (columns.size() < min_required_num_columns) {
+  std::string_view machine_code_hex;
+  std::string_view throughput_str;
+  if (!FindCsvColumns(line, machine_code_hex_column_index,
+                      throughput_column_index, machine_code_hex,
+                      throughput_str)) {
+    const int min_required_num_columns =
+        std::max(machine_code_hex_column_index, throughput_column_index) + 1;
+    const int num_columns = std::count(line.begin(), line.end(), ',') + 1;
     return absl::InvalidArgumentError(absl::StrFormat(
         "Expected `line` to have at least %d columns, found %d: %s",
-        min_required_num_columns, columns.size(), line));
+        min_required_num_columns, num_columns, line));
   }
   if (machine_code_hex_column_index == throughput_column_index) {
     return absl::InvalidArgumentError(absl::StrFormat(
@@ -127,9 +151,6 @@ absl::StatusOr<BasicBlockWithThroughputProto> BHiveImporter::ParseBHiveCsvLine(
         "different, but were both %d: %s",
         machine_code_hex_column_index, line));
   }
-  const std::string_view machine_code_hex =
-      columns[machine_code_hex_column_index];
-  const std::string_view throughput_str = columns[throughput_column_index];
 
   BasicBlockWithThroughputProto proto;
   absl::StatusOr<BasicBlockProto> block_proto_or_status =
@@ -151,4 +172,26 @@ absl::StatusOr<BasicBlockWithThroughputProto> BHiveImporter::ParseBHiveCsvLine(
   return proto;
 }
 
+std::vector<absl::StatusOr<BasicBlockWithThroughputProto>>
+BHiveImporter::ParseBHiveCsv(std::string_view source_name,
+                             std::string_view csv_data,
+                             size_t machine_code_hex_column_index,
+                             size_t throughput_column_index,
+                             double throughput_scaling /*= 1.0*/,
+                             uint64_t base_address /*= 0*/) {
+  std::vector<absl::StatusOr<BasicBlockWithThroughputProto>> protos;
+  while (!csv_data.empty()) {
+    size_t line_end = csv_data.find('\n');
+    if (line_end == std::string_view::npos) line_end = csv_data.size();
+    std::string_view line = csv_data.substr(0, line_end);
+    csv_data.remove_prefix(std::min(line_end + 1, csv_data.size()));
+    if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+    if (line.empty()) continue;
+    protos.push_back(ParseBHiveCsvLine(
+        source_name, line, machine_code_hex_column_index,
+        throughput_column_index, throughput_scaling, base_address));
+  }
+  return protos;
+}
+
 }  // namespace gematria
@@ -21,6 +21,7 @@
 #include <cstdint>
 #include <memory>
 #include <string_view>
+#include <vector>
 
 #include "absl/status/statusor.h"
 #include "gematria/llvm/canonicalizer.h"
@@ -35,7 +36,8 @@
 
 namespace gematria {
 
-// Parser for BHive CSV files.
+// Parser for BHive CSV files. The importer is not thread-safe; each thread
+// needs its own importer, but the canonicalizer can be shared.
 class BHiveImporter {
  public:
   // Creates a new BHive importer from a given canonicalizer. The canonicalizer
@@ -80,12 +82,27 @@ class BHiveImporter {
       size_t machine_code_hex_column_index, size_t throughput_column_index,
       double throughput_scaling = 1.0, uint64_t base_address = 0);
 
+  // A version of ParseBHiveCsvLine() that parses all lines of a BHive CSV file
+  // from `csv_data`, e.g. from a memory-mapped file. The lines are separated by
+  // '\n' with an optional '\r' before it; empty lines are skipped. Returns one
+  // element per non-empty line, in the order of the input: either the basic
+  // block parsed from the line, or the error for the line.
+  std::vector<absl::StatusOr<BasicBlockWithThroughputProto>> ParseBHiveCsv(
+      std::string_view source_name, std::string_view csv_data,
+      size_t machine_code_hex_column_index, size_t throughput_column_index,
+      double throughput_scaling = 1.0, uint64_t base_address = 0);
+
  private:
   const Canonicalizer& canonicalizer_;
   const llvm::TargetMachine& target_machine_;
   std::unique_ptr<llvm::MCContext> context_;
   std::unique_ptr<llvm::MCDisassembler> disassembler_;
   std::unique_ptr<llvm::MCInstPrinter> mc_inst_printer_;
+
+  // The buffer for the machine code parsed by
+  // BasicBlockProtoFromMachineCodeHex(); it is reused between the calls to
+  // avoid an allocation per block.
+  std::vector<uint8_t> machine_code_buffer_;
 };
 
 }  // namespace gematria
@@ -15,9 +15,13 @@
 #include "gematria/datasets/bhive_importer.h"
 
 #include <memory>
+#include <vector>
 
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
 #include "gematria/llvm/canonicalizer.h"
 #include "gematria/llvm/llvm_architecture_support.h"
+#include "gematria/proto/throughput.pb.h"
 #include "gematria/testing/matchers.h"
 #include "gematria/utils/string.h"
 #include "gmock/gmock.h"
@@ -257,5 +261,40 @@ TEST_F(BHiveImporterTest, NonStandardColumns) {
                                             })pb")));
 }
 
+TEST_F(BHiveImporterTest, CsvBuffer) {
+  const std::vector<absl::StatusOr<BasicBlockWithThroughputProto>> protos =
+      x86_bhive_importer_->ParseBHiveCsv(
+          kSourceName, "4929d2,100\r\n\nnot a line\n,200", 0, 1, kScaling);
+  ASSERT_EQ(protos.size(), 3);
+  EXPECT_THAT(protos[0], IsOkAndHolds(EqualsProto(
+                             R"pb(basic_block {
+                                    machine_instructions {
+                                      assembly: "\tsubq\t%rdx, %r10"
+                                      machine_code: "I)\322"
+                                    }
+                                    canonicalized_instructions {
+                                      mnemonic: "SUB"
+                                      llvm_mnemonic: "SUB64rr"
+                                      output_operands { register_name: "R10" }
+                                      input_operands { register_name: "R10" }
+                                      input_operands { register_name: "RDX" }
+                                      implicit_output_operands {
+                                        register_name: "EFLAGS"
+                                      }
+                                    }
+                                  }
+                                  inverse_throughputs {
+                                    source: "bhive: skl"
+                                    inverse_throughput_cycles: 1
+                                  })pb")));
+  EXPECT_THAT(protos[1], StatusIs(absl::StatusCode::kInvalidArgument));
+  EXPECT_THAT(protos[2], IsOkAndHolds(EqualsProto(
+                             R"pb(basic_block {}
+                                  inverse_throughputs {
+                                    source: "bhive: skl"
+                                    inverse_throughput_cycles: 2
+                                  })pb")));
+}
+
 }  // namespace
 }  // namespace gematria
@@ -0,0 +1,144 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/datasets/conversion_stats.h"
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_format.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "gematria/datasets/find_accessed_addrs.h"
+
+namespace gematria {
+namespace {
+
+constexpr ConversionStage kAllStages[] = {
+    ConversionStage::kParseHex, ConversionStage::kDisassemble,
+    ConversionStage::kAnnotate, ConversionStage::kWriteOutput};
+
+double BlocksPerSecond(int64_t num_blocks, absl::Duration elapsed) {
+  const double seconds = absl::ToDoubleSeconds(elapsed);
+  return seconds > 0 ? num_blocks / seconds : 0.0;
+}
+
+}  // namespace
+
+std::string_view ConversionStageName(ConversionStage stage) {
+  switch (stage) {
+    case ConversionStage::kParseHex:
+      return "parse_hex";
+    case ConversionStage::kDisassemble:
+      return "disassemble";
+    case ConversionStage::kAnnotate:
+      return "annotate";
+    case ConversionStage::kWriteOutput:
+      return "write_output";
+  }
+  return "unknown";
+}
+
+ConversionStats::ConversionStats() : start_time_(absl::Now()) {}
+
+void ConversionStats::AddStageTime(ConversionStage stage,
+                                   absl::Duration duration) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  stages_[static_cast<int>(stage)].time += duration;
+}
+
+void ConversionStats::AddFailure(ConversionStage stage,
+                                 const absl::Status& status) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  ++stages_[static_cast<int>(stage)].failures[status.code()];
+  ++num_failures_;
+}
+
+void ConversionStats::AddBlock() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  ++num_blocks_;
+}
+
+void ConversionStats::AddCacheHit() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  ++num_cache_hits_;
+}
+
+void ConversionStats::AddFindAccessedAddrsStats(
+    const FindAccessedAddrsStats& stats) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  find_accessed_addrs_stats_.num_runs += stats.num_runs;
+  find_accessed_addrs_stats_.num_retries += stats.num_retries;
+  find_accessed_addrs_stats_.num_forks += stats.num_forks;
+}
+
+int64_t ConversionStats::num_blocks() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return num_blocks_;
+}
+
+std::string ConversionStats::FormatProgress() const {
+  const absl::Duration elapsed = absl::Now() - start_time_;
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::string progress = absl::StrFormat(
+      "%d blocks in %.1fs (%.1f blocks/s), %d failures, %d cache hits, "
+      "%d retries, %d forks;",
+      num_blocks_, absl::ToDoubleSeconds(elapsed),
+      BlocksPerSecond(num_blocks_, elapsed), num_failures_, num_cache_hits_,
+      find_accessed_addrs_stats_.num_retries,
+      find_accessed_addrs_stats_.num_forks);
+  for (const ConversionStage stage : kAllStages) {
+    absl::StrAppendFormat(
+        &progress, " %s %.3fs", ConversionStageName(stage),
+        absl::ToDoubleSeconds(stages_[static_cast<int>(stage)].time));
+  }
+  return progress;
+}
+
+std::string ConversionStats::FormatJson() const {
+  const absl::Duration elapsed = absl::Now() - start_time_;
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::string json = absl::StrFormat(
+      R"({"blocks":%d,"failures":%d,"cache_hits":%d,"block_runs":%d,)"
+      R"("retries":%d,"forks":%d,"elapsed_seconds":%.6f,)"
+      R"("blocks_per_second":%.3f,"stages":{)",
+      num_blocks_, num_failures_, num_cache_hits_,
+      find_accessed_addrs_stats_.num_runs,
+      find_accessed_addrs_stats_.num_retries,
+      find_accessed_addrs_stats_.num_forks, absl::ToDoubleSeconds(elapsed),
+      BlocksPerSecond(num_blocks_, elapsed));
+  for (const ConversionStage stage : kAllStages) {
+    const StageStats& stage_stats = stages_[static_cast<int>(stage)];
+    if (stage != kAllStages[0]) json += ",";
+    absl::StrAppendFormat(&json, R"("%s":{"seconds":%.6f,"failures":{)",
+                          ConversionStageName(stage),
+                          absl::ToDoubleSeconds(stage_stats.time));
+    bool first_failure = true;
+    for (const auto& [code, count] : stage_stats.failures) {
+      if (!first_failure) json += ",";
+      first_failure = false;
+      absl::StrAppendFormat(&json, R"("%s":%d)", absl::StatusCodeToString(code),
+                            count);
+    }
+    json += "}}";
+  }
+  json += "}}";
+  return json;
+}
+
+}  // namespace gematria
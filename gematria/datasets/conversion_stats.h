@@ -0,0 +1,131 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Contains timers and counters of the stages of the tools that convert BHive
+// data sets (convert_bhive_to_llvm_exegesis_input and
+// find_accessed_addrs_from_bhive), used to find where the time of long
+// conversions goes.
+
+#ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_DATASETS_CONVERSION_STATS_H_
+#define THIRD_PARTY_GEMATRIA_GEMATRIA_DATASETS_CONVERSION_STATS_H_
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+#include "absl/status/status.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "gematria/datasets/find_accessed_addrs.h"
+
+namespace gematria {
+
+// The stages of the processing of a basic block.
+enum class ConversionStage {
+  // Parsing the hex string from the input file.
+  kParseHex,
+  // Disassembling the machine code to a BasicBlockProto.
+  kDisassemble,
+  // Finding the memory accessed by the basic block.
+  kAnnotate,
+  // Writing the annotated block to the output files.
+  kWriteOutput,
+};
+
+inline constexpr int kNumConversionStages = 4;
+
+// Returns the name of `stage` used in the output of ConversionStats.
+std::string_view ConversionStageName(ConversionStage stage);
+
+// Timers and counters of a conversion. All methods are thread-safe, so the
+// stats can be shared by the threads that process the blocks.
+class ConversionStats {
+ public:
+  // Creates empty stats. The throughput is computed from the time of the
+  // creation of the object.
+  ConversionStats();
+
+  // Adds `duration` to the time spent in `stage`.
+  void AddStageTime(ConversionStage stage, absl::Duration duration);
+
+  // Records that a block failed in `stage` with `status`.
+  void AddFailure(ConversionStage stage, const absl::Status& status);
+
+  // Records that a block went through all the stages.
+  void AddBlock();
+
+  // Records that the annotation of a block was found in the annotation cache.
+  void AddCacheHit();
+
+  // Adds the work done by FindAccessedAddrs() for one block.
+  void AddFindAccessedAddrsStats(const FindAccessedAddrsStats& stats);
+
+  // Returns the number of blocks recorded by AddBlock().
+  int64_t num_blocks() const;
+
+  // Returns a one-line human-readable summary of the stats, for progress
+  // reports.
+  std::string FormatProgress() const;
+
+  // Returns the stats as a single-line JSON object. The object has the
+  // following fields:
+  //   "blocks", "failures", "cache_hits", "block_runs", "retries", "forks":
+  //     the counters (the last three come from FindAccessedAddrs()).
+  //   "elapsed_seconds", "blocks_per_second": the wall time since the creation
+  //     of the object and the throughput.
+  //   "stages": an object with one field per stage, each an object with the
+  //     "seconds" spent in the stage (summed over all threads) and the
+  //     "failures" in the stage keyed by the absl::StatusCode name.
+  std::string FormatJson() const;
+
+ private:
+  struct StageStats {
+    absl::Duration time;
+    std::map<absl::StatusCode, int64_t> failures;
+  };
+
+  const absl::Time start_time_;
+
+  mutable std::mutex mutex_;
+  // All the fields below are guarded by `mutex_`.
+  StageStats stages_[kNumConversionStages];
+  int64_t num_blocks_ = 0;
+  int64_t num_failures_ = 0;
+  int64_t num_cache_hits_ = 0;
+  FindAccessedAddrsStats find_accessed_addrs_stats_;
+};
+
+// Adds the time between its creation and its destruction to a stage of
+// ConversionStats.
+class ScopedStageTimer {
+ public:
+  ScopedStageTimer(ConversionStats& stats, ConversionStage stage)
+      : stats_(stats), stage_(stage), start_time_(absl::Now()) {}
+  ScopedStageTimer(const ScopedStageTimer&) = delete;
+  ScopedStageTimer& operator=(const ScopedStageTimer&) = delete;
+  ~ScopedStageTimer() {
+    stats_.AddStageTime(stage_, absl::Now() - start_time_);
+  }
+
+ private:
+  ConversionStats& stats_;
+  const ConversionStage stage_;
+  const absl::Time start_time_;
+};
+
+}  // namespace gematria
+
+#endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_DATASETS_CONVERSION_STATS_H_
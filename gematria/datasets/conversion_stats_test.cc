@@ -0,0 +1,115 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/datasets/conversion_stats.h"
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "gematria/datasets/find_accessed_addrs.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace gematria {
+namespace {
+
+using ::testing::ContainsRegex;
+using ::testing::HasSubstr;
+using ::testing::StartsWith;
+
+TEST(ConversionStatsTest, Empty) {
+  const ConversionStats stats;
+  EXPECT_EQ(stats.num_blocks(), 0);
+  EXPECT_THAT(stats.FormatJson(),
+              StartsWith(R"({"blocks":0,"failures":0,"cache_hits":0,)"
+                         R"("block_runs":0,"retries":0,"forks":0,)"));
+  EXPECT_THAT(
+      stats.FormatJson(),
+      HasSubstr(R"("stages":{"parse_hex":{"seconds":0.000000,"failures":{}},)"
+                R"("disassemble":{"seconds":0.000000,"failures":{}},)"
+                R"("annotate":{"seconds":0.000000,"failures":{}},)"
+                R"("write_output":{"seconds":0.000000,"failures":{}}}})"));
+}
+
+TEST(ConversionStatsTest, Counters) {
+  ConversionStats stats;
+  stats.AddBlock();
+  stats.AddBlock();
+  stats.AddCacheHit();
+  stats.AddFindAccessedAddrsStats(
+      {.num_runs = 3, .num_retries = 1, .num_forks = 2});
+  stats.AddFindAccessedAddrsStats(
+      {.num_runs = 1, .num_retries = 0, .num_forks = 0});
+  stats.AddFailure(ConversionStage::kAnnotate,
+                   absl::InvalidArgumentError("unmappable"));
+  stats.AddFailure(ConversionStage::kAnnotate,
+                   absl::InvalidArgumentError("unmappable"));
+  stats.AddFailure(ConversionStage::kAnnotate,
+                   absl::InternalError("crashed"));
+  stats.AddFailure(ConversionStage::kDisassemble,
+                   absl::InvalidArgumentError("bad instruction"));
+  stats.AddStageTime(ConversionStage::kWriteOutput, absl::Milliseconds(1500));
+  stats.AddStageTime(ConversionStage::kWriteOutput, absl::Milliseconds(500));
+
+  EXPECT_EQ(stats.num_blocks(), 2);
+  const std::string json = stats.FormatJson();
+  EXPECT_THAT(json,
+              StartsWith(R"({"blocks":2,"failures":4,"cache_hits":1,)"
+                         R"("block_runs":4,"retries":1,"forks":2,)"));
+  EXPECT_THAT(json, HasSubstr(R"("disassemble":{"seconds":0.000000,)"
+                              R"("failures":{"INVALID_ARGUMENT":1}})"));
+  EXPECT_THAT(json, HasSubstr(R"("annotate":{"seconds":0.000000,)"
+                              R"("failures":{"INVALID_ARGUMENT":2,)"
+                              R"("INTERNAL":1}})"));
+  EXPECT_THAT(json, HasSubstr(R"("write_output":{"seconds":2.000000,)"));
+
+  EXPECT_THAT(stats.FormatProgress(),
+              ContainsRegex("^2 blocks in [0-9.]+s \\([0-9.]+ blocks/s\\), "
+                            "4 failures, 1 cache hits, 1 retries, 2 forks; "
+                            "parse_hex 0.000s disassemble 0.000s "
+                            "annotate 0.000s write_output 2.000s$"));
+}
+
+TEST(ConversionStatsTest, ScopedStageTimer) {
+  ConversionStats stats;
+  {
+    ScopedStageTimer timer(stats, ConversionStage::kParseHex);
+    absl::SleepFor(absl::Milliseconds(10));
+  }
+  // The timer must record at least 10 ms.
+  EXPECT_THAT(stats.FormatJson(),
+              ContainsRegex(
+                  R"("parse_hex":\{"seconds":([1-9]|0\.[1-9]|0\.0[1-9]))"));
+}
+
+TEST(ConversionStatsTest, MultipleThreads) {
+  constexpr int kNumThreads = 4;
+  constexpr int kBlocksPerThread = 1000;
+  ConversionStats stats;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads.emplace_back([&stats]() {
+      for (int block = 0; block < kBlocksPerThread; ++block) stats.AddBlock();
+    });
+  }
+  for (std::thread& thread : threads) thread.join();
+  EXPECT_EQ(stats.num_blocks(), kNumThreads * kBlocksPerThread);
+}
+
+}  // namespace
+}  // namespace gematria
@@ -12,22 +12,37 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <limits>
 #include <memory>
+#include <optional>
 #include <sstream>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <utility>
 #include <vector>
 
+#include <unistd.h>
+
 #include "X86RegisterInfo.h"
 #include "X86Subtarget.h"
 #include "absl/flags/flag.h"
 #include "absl/flags/parse.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "gematria/datasets/accessed_addrs_cache.h"
 #include "gematria/datasets/bhive_importer.h"
+#include "gematria/datasets/conversion_stats.h"
 #include "gematria/datasets/find_accessed_addrs.h"
 #include "gematria/datasets/find_accessed_addrs_exegesis.h"
+#include "gematria/datasets/input_shard.h"
 #include "gematria/llvm/canonicalizer.h"
 #include "gematria/llvm/llvm_architecture_support.h"
 #include "gematria/llvm/llvm_to_absl.h"
@@ -78,6 +93,20 @@ std::string AbslUnparseFlag(AnnotatorType type) {
 }
 
 ABSL_FLAG(std::string, bhive_csv, "", "Filename of the input BHive CSV file");
+ABSL_FLAG(int, shard_index, 0,
+          "The index of the shard of the input file processed by this run, see "
+          "--num_shards.");
+ABSL_FLAG(int, num_shards, 1,
+          "The number of shards of the input file. When greater than one, "
+          "processes only the lines that begin in the --shard_index-th of "
+          "--num_shards equal byte ranges of the input file, and adds the "
+          "shard suffix to the names of the output files, so that all shards "
+          "can write to the same output directories. The shards together "
+          "process every block exactly once. Each shard should use its own "
+          "--annotation_cache and --stats_json.");
+ABSL_FLAG(std::string, shard_manifest, "",
+          "Filename of a JSON file to which a manifest of the shard, its JSON "
+          "output files and its stats is written at the end of the run.");
 ABSL_FLAG(
     std::string, asm_output_dir, "",
     "Directory containing output files that can be executed by llvm-exegesis");
@@ -88,20 +117,57 @@ ABSL_FLAG(std::string, json_output_dir, "",
 ABSL_FLAG(
     unsigned, blocks_per_json_file, std::numeric_limits<unsigned>::max(),
     "The number of annotated basic blocks to include in a single JSON file");
+ABSL_FLAG(unsigned, json_indent, 0,
+          "The number of spaces per indentation level in the JSON files. When "
+          "zero, the JSON files are written without any whitespace.");
 ABSL_FLAG(unsigned, max_bb_count, std::numeric_limits<unsigned>::max(),
-          "The maximum number of basic blocks to process");
+          "The maximum number of basic blocks to process. With --num_shards, "
+          "the maximum for each shard.");
 ABSL_FLAG(unsigned, report_progress_every, std::numeric_limits<unsigned>::max(),
           "The number of blocks after which to report progress.");
+ABSL_FLAG(unsigned, num_threads, 1,
+          "The number of threads that annotate basic blocks. The output does "
+          "not depend on the number of threads.");
+ABSL_FLAG(std::string, annotation_cache, "",
+          "Filename of a cache of annotations. When set, blocks found in the "
+          "cache are not annotated again, and the annotations of new blocks "
+          "are added to the cache at the end of the run. The cache is specific "
+          "to the annotator implementation and version.");
+ABSL_FLAG(unsigned, accessed_block_size, 0,
+          "The size of the blocks of memory mapped by the fast annotator for "
+          "each accessed address, in bytes. Must be a multiple of the page "
+          "size; zero uses the page size. Larger blocks give fewer memory "
+          "mappings for blocks that access large arrays.");
+ABSL_FLAG(std::string, stats_json, "",
+          "Filename of a JSON file to which a summary of the timers and "
+          "counters of the conversion is written at the end of the run. The "
+          "stats are also printed with the progress reports.");
+
+// The number of lines annotated by each thread before the annotated blocks are
+// written to the output files.
+constexpr int kLinesPerThreadPerWindow = 256;
 
 absl::StatusOr<gematria::AccessedAddrs> GetAccessedAddrs(
     absl::Span<const uint8_t> basic_block,
-    gematria::ExegesisAnnotator* exegesis_annotator) {
+    const gematria::BasicBlockProto& basic_block_proto,
+    gematria::ExegesisAnnotator* exegesis_annotator,
+    gematria::ConversionStats& stats) {
   const AnnotatorType annotator_implementation =
       absl::GetFlag(FLAGS_annotator_implementation);
   switch (annotator_implementation) {
-    case AnnotatorType::kFast:
-      // This will only get the first segfault address.
-      return gematria::FindAccessedAddrs(basic_block);
+    case AnnotatorType::kFast: {
+      const std::vector<gematria::InstructionAddressRegisters>
+          address_registers =
+              gematria::GetInstructionAddressRegisters(basic_block_proto);
+      gematria::FindAccessedAddrsStats find_accessed_addrs_stats;
+      auto addrs = gematria::FindAccessedAddrs(
+          basic_block,
+          {.address_registers = address_registers,
+           .block_size = absl::GetFlag(FLAGS_accessed_block_size)},
+          find_accessed_addrs_stats);
+      stats.AddFindAccessedAddrsStats(find_accessed_addrs_stats);
+      return addrs;
+    }
     case AnnotatorType::kExegesis:
       return gematria::LlvmExpectedToStatusOr(
           exegesis_annotator->findAccessedAddrs(
@@ -112,26 +178,233 @@ absl::StatusOr<gematria::AccessedAddrs> GetAccessedAddrs(
   return absl::InvalidArgumentError("unknown annotator type");
 }
 
-bool WriteJsonFile(llvm::json::Array to_write, size_t json_file_number,
-                   llvm::StringRef json_output_dir) {
-  llvm::SmallString<40> json_output_file_path(json_output_dir);
-  llvm::sys::path::append(json_output_file_path,
-                          llvm::Twine(json_file_number).concat(".json"));
-  std::error_code file_ec;
-  llvm::raw_fd_ostream json_output_file(json_output_file_path, file_ec);
-
-  if (file_ec) {
-    std::cerr << "Failed to open output file: "
-              << static_cast<std::string_view>(json_output_file_path.str())
-              << "\n";
-    return false;
+// The annotators used by one thread. None of them is thread-safe.
+struct Annotators {
+  std::unique_ptr<gematria::BHiveImporter> bhive_importer;
+  std::unique_ptr<llvm::exegesis::LLVMState> llvm_state;
+  std::unique_ptr<gematria::ExegesisAnnotator> exegesis_annotator;
+};
+
+// The result of processing one line of the input file. The processing stops at
+// the first step that fails; the fields of the later steps are not set.
+struct AnnotatedLine {
+  size_t comma_index = std::string::npos;
+  std::optional<std::vector<uint8_t>> bytes;
+  absl::StatusOr<gematria::BasicBlockProto> proto;
+  absl::StatusOr<gematria::AccessedAddrs> addrs;
+};
+
+// Returns the identifier of the annotator for AccessedAddrsCache, or
+// std::nullopt when the annotator can't be cached.
+std::optional<std::string> GetAnnotatorId(AnnotatorType annotator_type) {
+  switch (annotator_type) {
+    case AnnotatorType::kFast: {
+      std::string id = llvm::formatv("{0}-{1}", AbslUnparseFlag(annotator_type),
+                                     gematria::kFindAccessedAddrsVersion)
+                           .str();
+      // The results depend on the block size; the default is the page size.
+      const unsigned block_size = absl::GetFlag(FLAGS_accessed_block_size);
+      if (block_size != 0 &&
+          block_size != static_cast<unsigned>(getpagesize())) {
+        id += llvm::formatv("-{0}", block_size).str();
+      }
+      return id;
+    }
+    case AnnotatorType::kExegesis:
+      return llvm::formatv("{0}-{1}", AbslUnparseFlag(annotator_type),
+                           gematria::kExegesisAnnotatorVersion)
+          .str();
+    case AnnotatorType::kNone:
+      return std::nullopt;
   }
+  return std::nullopt;
+}
+
+AnnotatedLine AnnotateLine(std::string_view line, Annotators& annotators,
+                           gematria::AccessedAddrsCache* cache,
+                           gematria::ConversionStats& stats) {
+  AnnotatedLine annotated_line;
+  {
+    gematria::ScopedStageTimer timer(stats,
+                                     gematria::ConversionStage::kParseHex);
+    annotated_line.comma_index = line.find(',');
+    if (annotated_line.comma_index == std::string::npos) return annotated_line;
+
+    const std::string_view hex = line.substr(0, annotated_line.comma_index);
+    annotated_line.bytes = gematria::ParseHexString(hex);
+    if (!annotated_line.bytes.has_value()) return annotated_line;
+  }
+
+  {
+    gematria::ScopedStageTimer timer(stats,
+                                     gematria::ConversionStage::kDisassemble);
+    annotated_line.proto =
+        annotators.bhive_importer->BasicBlockProtoFromMachineCode(
+            *annotated_line.bytes);
+  }
+  if (!annotated_line.proto.ok()) {
+    stats.AddFailure(gematria::ConversionStage::kDisassemble,
+                     annotated_line.proto.status());
+    return annotated_line;
+  }
+
+  gematria::ScopedStageTimer timer(stats, gematria::ConversionStage::kAnnotate);
+  if (cache != nullptr) {
+    if (auto cached_addrs = cache->Lookup(*annotated_line.bytes)) {
+      stats.AddCacheHit();
+      annotated_line.addrs = *std::move(cached_addrs);
+      return annotated_line;
+    }
+  }
+  annotated_line.addrs =
+      GetAccessedAddrs(*annotated_line.bytes, *annotated_line.proto,
+                       annotators.exegesis_annotator.get(), stats);
+  if (!annotated_line.addrs.ok()) {
+    stats.AddFailure(gematria::ConversionStage::kAnnotate,
+                     annotated_line.addrs.status());
+  }
+  // Errors are not cached, so that the blocks are retried in the next run.
+  if (cache != nullptr && annotated_line.addrs.ok()) {
+    cache->Insert(*annotated_line.bytes, *annotated_line.addrs);
+  }
+  return annotated_line;
+}
+
+// Annotates the first `num_lines` lines of `lines`, using one thread for each
+// element of `annotators`. Stores the result for `lines[i]` in
+// `annotated_lines[i]`. When `cache` is not null, uses the cached annotations
+// and adds the new ones to the cache. Adds the time and the failures of the
+// annotation to `stats`.
+void AnnotateLines(const std::vector<std::string>& lines, int num_lines,
+                   std::vector<Annotators>& annotators,
+                   gematria::AccessedAddrsCache* cache,
+                   gematria::ConversionStats& stats,
+                   std::vector<AnnotatedLine>& annotated_lines) {
+  std::atomic<int> next_line = 0;
+  const auto annotate_lines = [&](Annotators& thread_annotators) {
+    for (int i = next_line++; i < num_lines; i = next_line++) {
+      annotated_lines[i] =
+          AnnotateLine(lines[i], thread_annotators, cache, stats);
+    }
+  };
 
-  json_output_file
-      << llvm::formatv("{0:2}", llvm::json::Value(std::move(to_write))).str();
-  return true;
+  const int num_threads = std::min<int>(annotators.size(), num_lines);
+  std::vector<std::thread> threads;
+  for (int thread = 1; thread < num_threads; ++thread) {
+    threads.emplace_back(annotate_lines, std::ref(annotators[thread]));
+  }
+  if (num_threads > 0) annotate_lines(annotators[0]);
+  for (std::thread& thread : threads) thread.join();
 }
 
+// Writes snippets to numbered JSON files in a directory, with at most a given
+// number of snippets per file. Each file contains a JSON array of snippets.
+// The snippets are written as they are added, and only the current file is
+// open, so the memory used by the writer does not depend on the number of
+// snippets. When the input is sharded, the file names have the shard suffix,
+// e.g. "0-00002-of-00016.json".
+class JsonSnippetWriter {
+ public:
+  // Creates a writer that writes files to `output_dir`. `indent` is the
+  // number of spaces per indentation level; when zero, writes compact JSON.
+  JsonSnippetWriter(std::string output_dir, unsigned snippets_per_file,
+                    unsigned indent, int shard_index, int num_shards)
+      : output_dir_(std::move(output_dir)),
+        snippets_per_file_(snippets_per_file),
+        indent_(indent),
+        shard_index_(shard_index),
+        num_shards_(num_shards) {}
+
+  // Writes the snippet for the basic block `hex` with memory accesses
+  // `addrs`. Opens a new file when the current one is full. Returns false
+  // when the file can't be opened.
+  bool AddSnippet(std::string_view hex, const gematria::AccessedAddrs& addrs) {
+    if (json_ == nullptr && !OpenFile()) return false;
+
+    json_->object([&]() {
+      json_->attribute("Hex", llvm::StringRef(hex));
+      json_->attributeArray("MemoryDefinitions", [&]() {
+        if (addrs.accessed_blocks.empty()) return;
+        json_->object([&]() {
+          json_->attribute("Name", llvm::json::Value(kMemNamePrefix));
+          json_->attribute("Size", addrs.block_size);
+          json_->attribute("Value", llvm::json::Value(kInitialMemVal));
+        });
+      });
+      json_->attributeArray("MemoryMappings", [&]() {
+        for (const uintptr_t addr : addrs.accessed_blocks) {
+          json_->object([&]() {
+            json_->attribute("Address", addr);
+            json_->attribute("Value", llvm::json::Value(kMemNamePrefix));
+          });
+        }
+      });
+    });
+
+    ++num_snippets_;
+    if (num_snippets_ % snippets_per_file_ == 0) return CloseFile();
+    return true;
+  }
+
+  // Finishes the current file. Returns false when some of the data could not
+  // be written.
+  bool CloseFile() {
+    if (json_ == nullptr) return true;
+    json_->arrayEnd();
+    json_.reset();
+    file_->close();
+    const bool success = !file_->has_error();
+    if (!success) {
+      std::cerr << "Failed to write output file: "
+                << static_cast<std::string_view>(file_path_.str()) << "\n";
+      file_->clear_error();
+    }
+    file_.reset();
+    return success;
+  }
+
+  // The paths of the files opened by the writer, in the order of their
+  // creation.
+  const std::vector<std::string>& output_files() const {
+    return output_files_;
+  }
+
+ private:
+  bool OpenFile() {
+    file_path_ = output_dir_;
+    llvm::sys::path::append(
+        file_path_,
+        gematria::ShardFileName(
+            std::to_string(num_snippets_ / snippets_per_file_), shard_index_,
+            num_shards_) +
+            ".json");
+    output_files_.emplace_back(file_path_.str());
+    std::error_code file_ec;
+    file_ = std::make_unique<llvm::raw_fd_ostream>(file_path_, file_ec);
+    if (file_ec) {
+      std::cerr << "Failed to open output file: "
+                << static_cast<std::string_view>(file_path_.str()) << "\n";
+      file_.reset();
+      return false;
+    }
+    json_ = std::make_unique<llvm::json::OStream>(*file_, indent_);
+    json_->arrayBegin();
+    return true;
+  }
+
+  const std::string output_dir_;
+  const unsigned snippets_per_file_;
+  const unsigned indent_;
+  const int shard_index_;
+  const int num_shards_;
+
+  size_t num_snippets_ = 0;
+  std::vector<std::string> output_files_;
+  llvm::SmallString<40> file_path_;
+  std::unique_ptr<llvm::raw_fd_ostream> file_;
+  std::unique_ptr<llvm::json::OStream> json_;
+};
+
 int main(int argc, char* argv[]) {
   absl::ParseCommandLine(argc, argv);
 
@@ -141,6 +414,14 @@ int main(int argc, char* argv[]) {
     return 1;
   }
 
+  const int shard_index = absl::GetFlag(FLAGS_shard_index);
+  const int num_shards = absl::GetFlag(FLAGS_num_shards);
+  if (absl::Status status = gematria::ValidateShard(shard_index, num_shards);
+      !status.ok()) {
+    std::cerr << "Error: " << status.message() << "\n";
+    return 1;
+  }
+
   const std::string json_output_dir = absl::GetFlag(FLAGS_json_output_dir);
   const std::string asm_output_dir = absl::GetFlag(FLAGS_asm_output_dir);
 
@@ -154,6 +435,18 @@ int main(int argc, char* argv[]) {
   const AnnotatorType annotator_implementation =
       absl::GetFlag(FLAGS_annotator_implementation);
 
+  const unsigned num_threads = absl::GetFlag(FLAGS_num_threads);
+  if (num_threads == 0) {
+    std::cerr << "Error: --num_threads must be positive.\n";
+    return 1;
+  }
+
+  if (absl::GetFlag(FLAGS_accessed_block_size) % getpagesize() != 0) {
+    std::cerr << "Error: --accessed_block_size must be a multiple of the page "
+                 "size.\n";
+    return 1;
+  }
+
   std::string initial_reg_val_str =
       gematria::ConvertHexToString(kInitialRegVal);
   std::string initial_mem_val_str =
@@ -200,157 +493,229 @@ int main(int argc, char* argv[]) {
   }
 
   gematria::X86Canonicalizer canonicalizer(&llvm_support->target_machine());
-  gematria::BHiveImporter bhive_importer(&canonicalizer);
 
   llvm::exegesis::InitializeX86ExegesisTarget();
 
-  auto llvm_state_or_error = llvm::exegesis::LLVMState::Create("", "native");
-  if (!llvm_state_or_error) {
-    std::cerr << "Failed to create LLVMState\n";
-    return 1;
+  // Each thread has its own annotators. The canonicalizer is thread-safe and
+  // shared by all the importers.
+  std::vector<Annotators> annotators(num_threads);
+  for (Annotators& thread_annotators : annotators) {
+    thread_annotators.bhive_importer =
+        std::make_unique<gematria::BHiveImporter>(&canonicalizer);
+
+    auto llvm_state_or_error = llvm::exegesis::LLVMState::Create("", "native");
+    if (!llvm_state_or_error) {
+      std::cerr << "Failed to create LLVMState\n";
+      return 1;
+    }
+    thread_annotators.llvm_state =
+        std::make_unique<llvm::exegesis::LLVMState>(
+            std::move(*llvm_state_or_error));
+
+    if (annotator_implementation == AnnotatorType::kExegesis) {
+      auto exegesis_annotator_or_error =
+          gematria::ExegesisAnnotator::create(*thread_annotators.llvm_state);
+      if (!exegesis_annotator_or_error) {
+        std::cerr << "Failed to create exegesis annotator\n";
+        return 1;
+      }
+      thread_annotators.exegesis_annotator =
+          std::move(*exegesis_annotator_or_error);
+    }
   }
 
-  std::unique_ptr<gematria::ExegesisAnnotator> exegesis_annotator = nullptr;
-  if (annotator_implementation == AnnotatorType::kExegesis) {
-    auto exegesis_annotator_or_error =
-        gematria::ExegesisAnnotator::create(*llvm_state_or_error);
-    if (!exegesis_annotator_or_error) {
-      std::cerr << "Failed to create exegesis annotator\n";
+  const std::string annotation_cache_path =
+      absl::GetFlag(FLAGS_annotation_cache);
+  std::unique_ptr<gematria::AccessedAddrsCache> cache;
+  const std::optional<std::string> annotator_id =
+      GetAnnotatorId(annotator_implementation);
+  if (!annotation_cache_path.empty() && annotator_id.has_value()) {
+    cache = std::make_unique<gematria::AccessedAddrsCache>(*annotator_id);
+    if (absl::Status status = cache->LoadFromFile(annotation_cache_path);
+        !status.ok()) {
+      std::cerr << "Failed to load the annotation cache: " << status << "\n";
       return 1;
     }
-    exegesis_annotator = std::move(*exegesis_annotator_or_error);
   }
 
-  std::ifstream bhive_csv_file(bhive_filename);
-  llvm::json::Array processed_snippets;
+  absl::StatusOr<std::unique_ptr<gematria::ShardedLineReader>> bhive_csv_file =
+      gematria::ShardedLineReader::Open(bhive_filename, shard_index,
+                                        num_shards);
+  if (!bhive_csv_file.ok()) {
+    std::cerr << "Failed to open the input file: " << bhive_csv_file.status()
+              << "\n";
+    return 1;
+  }
+  std::optional<JsonSnippetWriter> json_writer;
+  if (!json_output_dir.empty()) {
+    json_writer.emplace(json_output_dir, blocks_per_json_file,
+                        absl::GetFlag(FLAGS_json_indent), shard_index,
+                        num_shards);
+  }
   const unsigned max_bb_count = absl::GetFlag(FLAGS_max_bb_count);
   const unsigned report_progress_every =
       absl::GetFlag(FLAGS_report_progress_every);
   unsigned int file_counter = 0;
-  for (std::string line; std::getline(bhive_csv_file, line);) {
-    if (file_counter >= max_bb_count) break;
-
-    auto comma_index = line.find(',');
-    if (comma_index == std::string::npos) {
-      std::cerr << "Invalid CSV file: no comma in line '" << line << "'\n";
-      return 2;
-    }
-
-    std::string_view hex = std::string_view(line).substr(0, comma_index);
-    // For each line, find the accessed addresses & disassemble instructions.
-    auto bytes = gematria::ParseHexString(hex);
-    if (!bytes.has_value()) {
-      std::cerr << "could not parse: " << hex << "\n";
-      return 3;
+  int64_t num_processed_lines = 0;
+  gematria::ConversionStats stats;
+
+  // The lines are read and annotated in windows; the annotated blocks are then
+  // written in the order of the input file, so that the output files are the
+  // same for any number of threads.
+  const int window_size = num_threads * kLinesPerThreadPerWindow;
+  std::vector<std::string> lines(window_size);
+  std::vector<AnnotatedLine> annotated_lines(window_size);
+  while (file_counter < max_bb_count) {
+    int num_lines = 0;
+    while (num_lines < window_size &&
+           (*bhive_csv_file)->ReadLine(lines[num_lines])) {
+      ++num_lines;
     }
+    if (num_lines == 0) break;
+    AnnotateLines(lines, num_lines, annotators, cache.get(), stats,
+                  annotated_lines);
 
-    auto proto = bhive_importer.BasicBlockProtoFromMachineCode(*bytes);
+    for (int i = 0; i < num_lines; ++i) {
+      if (file_counter >= max_bb_count) break;
+      ++num_processed_lines;
 
-    // Check for errors.
-    if (!proto.ok()) {
-      std::cerr << "Failed to disassemble block '" << hex
-                << "': " << proto.status() << "\n";
-      continue;
-    }
-
-    auto addrs = GetAccessedAddrs(*bytes, exegesis_annotator.get());
+      const std::string& line = lines[i];
+      const AnnotatedLine& annotated_line = annotated_lines[i];
 
-    if (!addrs.ok()) {
-      std::cerr << "Failed to find addresses for block '" << hex
-                << "': " << addrs.status() << "\n";
-      std::cerr << "Block disassembly:\n";
-      for (const auto& instr : proto->machine_instructions()) {
-        std::cerr << "\t" << instr.assembly() << "\n";
+      auto comma_index = annotated_line.comma_index;
+      if (comma_index == std::string::npos) {
+        std::cerr << "Invalid CSV file: no comma in line '" << line << "'\n";
+        return 2;
       }
-      continue;
-    }
 
-    if (!asm_output_dir.empty()) {
-      // Create output file path.
-      llvm::Twine output_file_path = llvm::Twine(asm_output_dir)
-                                         .concat("/")
-                                         .concat(llvm::Twine(file_counter))
-                                         .concat(".test");
-
-      // Open output file for writing.
-      std::ofstream output_file(output_file_path.str());
-      if (!output_file.is_open()) {
-        std::cerr << "Failed to open output file: " << output_file_path.str()
-                  << "\n";
-        return 4;
+      std::string_view hex = std::string_view(line).substr(0, comma_index);
+      // For each line, find the accessed addresses & disassemble instructions.
+      const auto& bytes = annotated_line.bytes;
+      if (!bytes.has_value()) {
+        std::cerr << "could not parse: " << hex << "\n";
+        return 3;
       }
 
-      // Write the register definition lines into the output file.
-      output_file << register_defs_lines;
+      const auto& proto = annotated_line.proto;
 
-      // Multiple mappings can point to the same definition.
-      if (addrs->accessed_blocks.size() > 0) {
-        output_file << kMemDefPrefix << kMemNamePrefix << " "
-                    << addrs->block_size << " " << initial_mem_val_str << "\n";
-      }
-      for (const auto& addr : addrs->accessed_blocks) {
-        output_file << kMemMapPrefix << kMemNamePrefix << " " << std::dec
-                    << addr << "\n";
+      // Check for errors.
+      if (!proto.ok()) {
+        std::cerr << "Failed to disassemble block '" << hex
+                  << "': " << proto.status() << "\n";
+        continue;
       }
 
-      // Append disassembled instructions.
-      for (const auto& instr : proto->machine_instructions()) {
-        output_file << instr.assembly() << "\n";
-      }
-    }
+      const auto& addrs = annotated_line.addrs;
 
-    if (!json_output_dir.empty()) {
-      llvm::json::Object current_snippet;
-
-      if (addrs->accessed_blocks.size() > 0) {
-        llvm::json::Array memory_definitions;
-        llvm::json::Object current_memory_definition;
-        current_memory_definition["Name"] = llvm::json::Value(kMemNamePrefix);
-        current_memory_definition["Size"] = addrs->block_size;
-        current_memory_definition["Value"] = llvm::json::Value(kInitialMemVal);
-        memory_definitions.push_back(std::move(current_memory_definition));
-        current_snippet["MemoryDefinitions"] =
-            llvm::json::Value(std::move(memory_definitions));
-
-        llvm::json::Array memory_mappings;
-        for (const uintptr_t addr : addrs->accessed_blocks) {
-          llvm::json::Object current_memory_mapping;
-          current_memory_mapping["Value"] = llvm::json::Value(kMemNamePrefix);
-          current_memory_mapping["Address"] = addr;
-          memory_mappings.push_back(std::move(current_memory_mapping));
+      if (!addrs.ok()) {
+        std::cerr << "Failed to find addresses for block '" << hex
+                  << "': " << addrs.status() << "\n";
+        std::cerr << "Block disassembly:\n";
+        for (const auto& instr : proto->machine_instructions()) {
+          std::cerr << "\t" << instr.assembly() << "\n";
         }
-        current_snippet["MemoryMappings"] =
-            llvm::json::Value(std::move(memory_mappings));
-      } else {
-        current_snippet["MemoryDefinitions"] = llvm::json::Array();
-        current_snippet["MemoryMappings"] = llvm::json::Array();
+        continue;
       }
 
-      current_snippet["Hex"] = std::string(hex);
+      gematria::ScopedStageTimer write_timer(
+          stats, gematria::ConversionStage::kWriteOutput);
+      if (!asm_output_dir.empty()) {
+        // Create output file path.
+        const std::string output_file_path = absl::StrCat(
+            asm_output_dir, "/",
+            gematria::ShardFileName(std::to_string(file_counter), shard_index,
+                                    num_shards),
+            ".test");
+
+        // Open output file for writing.
+        std::ofstream output_file(output_file_path);
+        if (!output_file.is_open()) {
+          std::cerr << "Failed to open output file: " << output_file_path
+                    << "\n";
+          return 4;
+        }
+
+        // Write the register definition lines into the output file.
+        output_file << register_defs_lines;
 
-      processed_snippets.push_back(
-          llvm::json::Value(std::move(current_snippet)));
+        // Multiple mappings can point to the same definition.
+        if (addrs->accessed_blocks.size() > 0) {
+          output_file << kMemDefPrefix << kMemNamePrefix << " "
+                      << addrs->block_size << " " << initial_mem_val_str
+                      << "\n";
+        }
+        for (const auto& addr : addrs->accessed_blocks) {
+          output_file << kMemMapPrefix << kMemNamePrefix << " " << std::dec
+                      << addr << "\n";
+        }
 
-      if ((file_counter + 1) % blocks_per_json_file == 0) {
-        size_t json_file_number = file_counter / blocks_per_json_file;
-        bool write_successfully = WriteJsonFile(
-            std::move(processed_snippets), json_file_number, json_output_dir);
-        if (!write_successfully) return 4;
-        processed_snippets.clear();
+        // Append disassembled instructions.
+        for (const auto& instr : proto->machine_instructions()) {
+          output_file << instr.assembly() << "\n";
+        }
       }
+
+      if (json_writer.has_value() && !json_writer->AddSnippet(hex, *addrs)) {
+        return 4;
+      }
+
+      stats.AddBlock();
+      if (file_counter != 0 && file_counter % report_progress_every == 0) {
+        std::cerr << "Finished annotating block #" << file_counter << ". "
+                  << stats.FormatProgress() << "\n";
+      }
+
+      file_counter++;
     }
+  }
+
+  if (json_writer.has_value() && !json_writer->CloseFile()) return 4;
+  if (absl::Status status = (*bhive_csv_file)->status(); !status.ok()) {
+    std::cerr << status << "\n";
+    return 2;
+  }
 
-    if (file_counter != 0 && file_counter % report_progress_every == 0)
-      std::cerr << "Finished annotating block #" << file_counter << ".\n";
+  const std::string stats_json = absl::GetFlag(FLAGS_stats_json);
+  if (!stats_json.empty()) {
+    std::ofstream stats_file(stats_json);
+    stats_file << stats.FormatJson() << "\n";
+    stats_file.close();
+    if (!stats_file) {
+      std::cerr << "Failed to write the stats file: " << stats_json << "\n";
+      return 4;
+    }
+  }
 
-    file_counter++;
+  const std::string shard_manifest = absl::GetFlag(FLAGS_shard_manifest);
+  if (!shard_manifest.empty()) {
+    // The .test files are not listed; there is one per block, and their names
+    // follow from `num_blocks`.
+    gematria::ShardManifest manifest;
+    manifest.tool = "convert_bhive_to_llvm_exegesis_input";
+    manifest.input_path = bhive_filename;
+    manifest.shard_index = shard_index;
+    manifest.num_shards = num_shards;
+    manifest.range = (*bhive_csv_file)->range();
+    manifest.num_lines = num_processed_lines;
+    manifest.num_blocks = file_counter;
+    if (json_writer.has_value()) {
+      manifest.output_files = json_writer->output_files();
+    }
+    manifest.stats_json = stats.FormatJson();
+    if (absl::Status status =
+            gematria::WriteShardManifest(shard_manifest, manifest);
+        !status.ok()) {
+      std::cerr << "Failed to write the shard manifest: " << status << "\n";
+      return 4;
+    }
   }
 
-  if (!json_output_dir.empty() && processed_snippets.size() != 0) {
-    size_t json_file_number = file_counter / blocks_per_json_file;
-    bool write_successfully = WriteJsonFile(std::move(processed_snippets),
-                                            json_file_number, json_output_dir);
-    if (!write_successfully) return 4;
+  if (cache != nullptr) {
+    if (absl::Status status = cache->SaveToFile(annotation_cache_path);
+        !status.ok()) {
+      std::cerr << "Failed to save the annotation cache: " << status << "\n";
+      return 4;
+    }
   }
 
   return 0;
@@ -15,9 +15,11 @@
 #include "gematria/datasets/find_accessed_addrs.h"
 
 #include <bits/types/siginfo_t.h>
+#include <poll.h>
 #include <signal.h>
 #include <sys/mman.h>
 #include <sys/ptrace.h>
+#include <sys/syscall.h>
 #include <sys/user.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -30,7 +32,11 @@
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
+#include <iterator>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <vector>
 
 #include "absl/random/random.h"
 #include "absl/random/uniform_int_distribution.h"
@@ -40,6 +46,8 @@
 #include "absl/strings/string_view.h"
 #include "absl/types/span.h"
 #include "gematria/datasets/block_wrapper.h"
+#include "gematria/proto/basic_block.pb.h"
+#include "gematria/proto/canonicalized_instruction.pb.h"
 
 namespace gematria {
 namespace {
@@ -51,6 +59,13 @@ namespace {
 // kernel gives us. But if possible, we use this address.
 constexpr uintptr_t kDefaultCodeLocation = 0x2b00'0000'0000;
 
+// The largest basic block and the largest number of accessed blocks that can be
+// sent to the fork server. The fork server keeps its buffers on its stack,
+// because it must not allocate memory; larger requests are executed in a new
+// forked process.
+constexpr size_t kMaxForkServerBlockSize = 16 * 1024;
+constexpr size_t kMaxForkServerAccessedBlocks = 1024;
+
 // The data which is communicated from the child to the parent. The protocol is
 // that the child will either write nothing (if it crashes unexpectedly before
 // getting the chance to write to the pipe), or it will write one copy of this
@@ -64,6 +79,40 @@ struct PipedData {
   uintptr_t code_address;
 };
 
+// A request to run a basic block, sent from the parent to the fork server. The
+// request is followed by `num_accessed_blocks` addresses of the accessed blocks
+// (as uintptr_t), and by `basic_block_size` bytes of the basic block. The same
+// ABI considerations as for PipedData apply.
+struct ForkServerRequest {
+  uintptr_t code_location;
+  size_t accessed_block_size;
+  size_t num_accessed_blocks;
+  size_t basic_block_size;
+  X64Regs initial_regs;
+};
+
+// The memory mapped by MapAndRunBlock() for one run of a basic block. The fork
+// server uses it to restore a clean address space before the next run.
+struct BlockMappings {
+  uintptr_t code_address;
+  size_t code_size;
+  size_t accessed_block_size;
+  size_t num_accessed_blocks;
+  uintptr_t accessed_blocks[kMaxForkServerAccessedBlocks];
+
+  // Unmaps all the recorded mappings, and clears the record.
+  void Unmap() {
+    if (code_address != 0) {
+      munmap(reinterpret_cast<void*>(code_address), code_size);
+    }
+    for (size_t i = 0; i < num_accessed_blocks; ++i) {
+      munmap(reinterpret_cast<void*>(accessed_blocks[i]), accessed_block_size);
+    }
+    code_address = 0;
+    num_accessed_blocks = 0;
+  }
+};
+
 PipedData MakePipedData() {
   PipedData piped_data;
 
@@ -79,10 +128,15 @@ bool IsRetryable(int err) {
   return err == EINTR || err == EAGAIN || err == EWOULDBLOCK;
 }
 
-absl::Status WriteAll(int fd, const PipedData& piped_data) {
-  auto data_span = absl::MakeConstSpan(
-      reinterpret_cast<const uint8_t*>(&piped_data), sizeof piped_data);
+// The functions used in the child processes must not allocate memory: when the
+// parent is multi-threaded, another thread may hold the lock of the allocator
+// at the time of the fork, and the allocator would deadlock in the child. The
+// Raw*() functions below report errors as errno values instead of absl::Status
+// for this reason.
 
+// Writes all of `data_span` to `fd`. Returns 0 on success, and the errno value
+// of the failed write otherwise.
+int RawWriteAll(int fd, absl::Span<const uint8_t> data_span) {
   size_t current_offset = 0;
   while (current_offset < data_span.size()) {
     size_t to_write = data_span.size() - current_offset;
@@ -92,51 +146,106 @@ absl::Status WriteAll(int fd, const PipedData& piped_data) {
     do {
       bytes_written = write(fd, data_span.data() + current_offset, to_write);
       err = errno;
-    } while (IsRetryable(err));
+    } while (bytes_written < 0 && IsRetryable(err));
 
     if (bytes_written < 0) {
-      return absl::ErrnoToStatus(err, "Failed to write to pipe");
+      return err;
     }
 
     current_offset += bytes_written;
   }
 
-  close(fd);
-  return absl::OkStatus();
+  return 0;
 }
 
-absl::StatusOr<PipedData> ReadAll(int fd) {
-  PipedData piped_data;
-  auto data_span = absl::MakeSpan(reinterpret_cast<uint8_t*>(&piped_data),
-                                  sizeof piped_data);
+template <typename T>
+int RawWriteAll(int fd, const T& value) {
+  return RawWriteAll(
+      fd, absl::MakeConstSpan(reinterpret_cast<const uint8_t*>(&value),
+                              sizeof(T)));
+}
 
-  size_t current_offset = 0;
-  while (current_offset < data_span.size()) {
-    size_t to_read = data_span.size() - current_offset;
+// Reads `data_span.size()` bytes from `fd`, or less when the end of the file is
+// reached first. Stores the number of bytes read in `bytes_read`. Returns 0 on
+// success, and the errno value of the failed read otherwise.
+int RawReadAll(int fd, absl::Span<uint8_t> data_span, size_t& bytes_read) {
+  bytes_read = 0;
+  while (bytes_read < data_span.size()) {
+    size_t to_read = data_span.size() - bytes_read;
 
-    ssize_t bytes_read;
+    ssize_t result;
     int err;
     do {
-      bytes_read = read(fd, data_span.data() + current_offset, to_read);
+      result = read(fd, data_span.data() + bytes_read, to_read);
       err = errno;
-    } while (IsRetryable(err));
+    } while (result < 0 && IsRetryable(err));
 
-    if (bytes_read < 0) {
-      return absl::ErrnoToStatus(err, "Failed to read from pipe");
+    if (result < 0) {
+      return err;
     }
 
-    if (bytes_read == 0) {
+    if (result == 0) {
       break;
     }
-    current_offset += bytes_read;
+    bytes_read += result;
   }
+  return 0;
+}
+
+// Reads exactly `data_span.size()` bytes from `fd`. Returns false when the read
+// fails or when the end of the file is reached first.
+bool RawReadExactly(int fd, absl::Span<uint8_t> data_span) {
+  size_t bytes_read;
+  return RawReadAll(fd, data_span, bytes_read) == 0 &&
+         bytes_read == data_span.size();
+}
 
-  if (current_offset != data_span.size()) {
+absl::Status WriteAll(int fd, absl::Span<const uint8_t> data_span) {
+  const int err = RawWriteAll(fd, data_span);
+  if (err != 0) {
+    return absl::ErrnoToStatus(err, "Failed to write to pipe");
+  }
+  return absl::OkStatus();
+}
+
+template <typename T>
+absl::Status WriteAll(int fd, const T& value) {
+  return WriteAll(fd, absl::MakeConstSpan(
+                          reinterpret_cast<const uint8_t*>(&value), sizeof(T)));
+}
+
+absl::Status ReadAll(int fd, absl::Span<uint8_t> data_span) {
+  size_t bytes_read;
+  const int err = RawReadAll(fd, data_span, bytes_read);
+  if (err != 0) {
+    return absl::ErrnoToStatus(err, "Failed to read from pipe");
+  }
+  if (bytes_read != data_span.size()) {
     return absl::InternalError(absl::StrFormat(
         "Read less than expected from pipe (expected %uB, got %uB)",
-        data_span.size(), current_offset));
+        data_span.size(), bytes_read));
+  }
+  return absl::OkStatus();
+}
+
+// Returns true when there is data to read in the pipe `fd`. Does not block.
+bool HasDataToRead(int fd) {
+  struct pollfd poll_fd = {.fd = fd, .events = POLLIN, .revents = 0};
+  int num_ready;
+  do {
+    num_ready = poll(&poll_fd, 1, /*timeout=*/0);
+  } while (num_ready < 0 && IsRetryable(errno));
+  return num_ready == 1 && (poll_fd.revents & POLLIN) != 0;
+}
+
+absl::StatusOr<PipedData> ReadPipedData(int fd) {
+  PipedData piped_data;
+  auto status = ReadAll(
+      fd, absl::MakeSpan(reinterpret_cast<uint8_t*>(&piped_data),
+                         sizeof piped_data));
+  if (!status.ok()) {
+    return status;
   }
-  close(fd);
   return piped_data;
 }
 
@@ -155,28 +264,11 @@ std::string DumpRegs(const struct user_regs_struct& regs) {
       regs.r13, regs.r14, regs.r15);
 }
 
-absl::Status ParentProcessInner(int child_pid, AccessedAddrs& accessed_addrs) {
-  int status;
-  waitpid(child_pid, &status, 0);
-
-  if (!WIFSTOPPED(status)) {
-    return absl::InternalError(absl::StrFormat(
-        "Child terminated with an unexpected status: %d", status));
-  }
-
-  // At this point the child is stopped, and we are attached.
-  // TODO(orodley): Since we don't set any ptrace options here, do we actually
-  // need this initial stop and continue, or could the child just PTRACE_TRACEME
-  // and keep going without raising an initial SIGSTOP?
-  ptrace(PTRACE_CONT, child_pid, nullptr, nullptr);
-
-  waitpid(child_pid, &status, 0);
-  if (!WIFSTOPPED(status)) {
-    return absl::InternalError(absl::StrFormat(
-        "Child terminated with an unexpected status: %d", status));
-  }
-
-  int signal = WSTOPSIG(status);
+// Interprets the signal that stopped the child process after it ran the basic
+// block. Adds the accessed block to `accessed_addrs` when the block tried to
+// access unmapped memory.
+absl::Status HandleStopSignal(int child_pid, int signal,
+                              AccessedAddrs& accessed_addrs) {
   if (signal == SIGSEGV) {
     // SIGSEGV means the block tried to access some unmapped memory, as
     // expected.
@@ -221,6 +313,30 @@ absl::Status ParentProcessInner(int child_pid, AccessedAddrs& accessed_addrs) {
                       strsignal(signal), DumpRegs(registers)));
 }
 
+absl::Status ParentProcessInner(int child_pid, AccessedAddrs& accessed_addrs) {
+  int status;
+  waitpid(child_pid, &status, 0);
+
+  if (!WIFSTOPPED(status)) {
+    return absl::InternalError(absl::StrFormat(
+        "Child terminated with an unexpected status: %d", status));
+  }
+
+  // At this point the child is stopped, and we are attached.
+  // TODO(orodley): Since we don't set any ptrace options here, do we actually
+  // need this initial stop and continue, or could the child just PTRACE_TRACEME
+  // and keep going without raising an initial SIGSTOP?
+  ptrace(PTRACE_CONT, child_pid, nullptr, nullptr);
+
+  waitpid(child_pid, &status, 0);
+  if (!WIFSTOPPED(status)) {
+    return absl::InternalError(absl::StrFormat(
+        "Child terminated with an unexpected status: %d", status));
+  }
+
+  return HandleStopSignal(child_pid, WSTOPSIG(status), accessed_addrs);
+}
+
 absl::Status ParentProcess(int child_pid, int pipe_read_fd,
                            AccessedAddrs& accessed_addrs) {
   auto result = ParentProcessInner(child_pid, accessed_addrs);
@@ -234,6 +350,7 @@ absl::Status ParentProcess(int child_pid, int pipe_read_fd,
   int err = kill(child_pid, SIGKILL);
   if (err != 0) {
     char* err_str = strerror(err);
+    close(pipe_read_fd);
     return absl::InternalError(
         absl::StrFormat("Failed to kill child process: %s", err_str));
   }
@@ -242,10 +359,18 @@ absl::Status ParentProcess(int child_pid, int pipe_read_fd,
   waitpid(child_pid, nullptr, 0);
 
   if (!result.ok()) {
+    close(pipe_read_fd);
     return result;
   }
 
-  auto pipe_data = ReadAll(pipe_read_fd);
+  // The child is gone, so anything it wrote is in the pipe by now. Don't wait
+  // for the end of the file: when the parent is multi-threaded, other child
+  // processes forked at the same time may hold the write end of the pipe.
+  absl::StatusOr<PipedData> pipe_data =
+      HasDataToRead(pipe_read_fd)
+          ? ReadPipedData(pipe_read_fd)
+          : absl::InternalError("The child process did not respond");
+  close(pipe_read_fd);
   if (!pipe_data.ok()) {
     return pipe_data.status();
   }
@@ -266,47 +391,108 @@ void repmovsb(void* dst, const void* src, size_t count) {
   asm volatile("rep movsb" : "+D"(dst), "+S"(src), "+c"(count) : : "memory");
 }
 
-[[noreturn]] void AbortChildProcess(int pipe_write_fd, absl::Status status) {
-  auto piped_data = MakePipedData();
-  piped_data.status_code = status.code();
+// Sends `signal` to the current process using raw system calls. Unlike raise(),
+// this does not touch the signal mask or the stack, so the fork server can be
+// resumed from the state before the signal (see ForkServerProcess()).
+__attribute__((always_inline)) inline void KillSelf(int signal) {
+  int64_t pid;
+  asm volatile("syscall"
+               : "=a"(pid)
+               : "a"(SYS_getpid)
+               : "rcx", "r11", "memory");
+  int64_t result;
+  asm volatile("syscall"
+               : "=a"(result)
+               : "a"(SYS_kill), "D"(pid), "S"(signal)
+               : "rcx", "r11", "memory");
+}
 
-  // Write as much of the message as we can fit into the piped data struct. We
-  // subtract one from the size to ensure we always leave a null-terminator on
-  // the end.
-  size_t message_length =
-      std::min(status.message().length(), sizeof piped_data.status_message - 1);
-  repmovsb(piped_data.status_message, status.message().data(), message_length);
+// Reports an error with `status_code` to the parent, and stops the child
+// process. The message of the error is `message`, followed by `address` in
+// hexadecimal. Does not allocate memory, see RawWriteAll().
+[[noreturn]] void AbortChildProcess(int pipe_write_fd,
+                                    absl::StatusCode status_code,
+                                    std::string_view message,
+                                    uintptr_t address) {
+  auto piped_data = MakePipedData();
+  piped_data.status_code = status_code;
+
+  // Write as much of the message as we can fit into the piped data struct,
+  // leaving space for the address. MakePipedData() zeroes the message, so it is
+  // always null-terminated.
+  constexpr size_t kAddressLength = sizeof(" 0x") - 1 + 2 * sizeof(uintptr_t);
+  constexpr size_t kMaxMessageLength =
+      sizeof piped_data.status_message - kAddressLength - 1;
+  size_t message_length = std::min(message.length(), kMaxMessageLength);
+  repmovsb(piped_data.status_message, message.data(), message_length);
+
+  char* const address_chars = piped_data.status_message + message_length;
+  address_chars[0] = ' ';
+  address_chars[1] = '0';
+  address_chars[2] = 'x';
+  for (size_t i = 0; i < 2 * sizeof(uintptr_t); ++i) {
+    const int shift = 4 * (2 * sizeof(uintptr_t) - 1 - i);
+    address_chars[3 + i] = "0123456789abcdef"[(address >> shift) & 0xf];
+  }
 
-  WriteAll(pipe_write_fd, piped_data).IgnoreError();
+  // The parent detects that the child stopped before reporting anything, so
+  // the result of the write does not matter here.
+  RawWriteAll(pipe_write_fd, piped_data);
+  // The parent reads the status after the child is stopped by SIGABRT, in the
+  // same way as after a block that finished without errors.
+  KillSelf(SIGABRT);
   abort();
 }
 
-[[noreturn]] void ChildProcess(absl::Span<const uint8_t> basic_block,
-                               int pipe_write_fd,
-                               const AccessedAddrs& accessed_addrs) {
-  // Make sure the parent is attached before doing anything that they might want
-  // to listen for.
-  ptrace(PTRACE_TRACEME, 0, nullptr, nullptr);
-  raise(SIGSTOP);
+// Maps one accessed block of `block_size` bytes at `location`, and fills it
+// with values that are likely to be valid addresses. Returns the address of the
+// mapping, which may differ from `location` when the kernel can't map the
+// block there, or MAP_FAILED when the mapping fails.
+void* MapAccessedBlock(uintptr_t location, size_t block_size) {
+  void* mapped_address =
+      mmap(reinterpret_cast<void*>(location), block_size,
+           PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapped_address == MAP_FAILED) {
+    return mapped_address;
+  }
 
-  // This value will turn up when reading from newly-mapped blocks (see below).
-  // Unmap it so that we can correctly segfault and detect we've accessed it.
-  // If it fails, oh well. Not worth aborting for as we might not even access
-  // this address.
-  munmap(reinterpret_cast<void*>(0x800000000), 0x10000);
+  // Initialise every fourth byte to 8, leaving the rest as zeroes. This
+  // ensures that every aligned 8-byte chunk will contain 0x800000008, which
+  // is a mappable address, and every 4-byte chunk will contain 0x8, which is
+  // a non-zero value which won't give SIGFPE if used with div.
+  uint8_t* block = reinterpret_cast<uint8_t*>(mapped_address);
+  for (int i = 0; i < block_size; i += 4) {
+    block[i] = 8;
+  }
+  return mapped_address;
+}
 
-  // Map all the locations we've previously discovered this code accesses.
-  for (uintptr_t accessed_location : accessed_addrs.accessed_blocks) {
+// Maps all the locations that we have previously discovered the block accesses,
+// copies the block to memory, reports the code address to the parent, and runs
+// the block. The run ends with a signal caught by the parent. When `mappings`
+// is not null, records all the memory mapped for the run in it.
+[[noreturn]] void MapAndRunBlock(absl::Span<const uint8_t> basic_block,
+                                 absl::Span<const uintptr_t> accessed_blocks,
+                                 size_t accessed_block_size,
+                                 uintptr_t code_location,
+                                 const X64Regs& initial_regs, int pipe_write_fd,
+                                 BlockMappings* mappings) {
+  if (mappings != nullptr) {
+    mappings->accessed_block_size = accessed_block_size;
+  }
+  for (uintptr_t accessed_location : accessed_blocks) {
     auto location_ptr = reinterpret_cast<void*>(accessed_location);
     void* mapped_address =
-        mmap(location_ptr, accessed_addrs.block_size, PROT_READ | PROT_WRITE,
-             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        MapAccessedBlock(accessed_location, accessed_block_size);
 
     if (mapped_address == MAP_FAILED) {
-      AbortChildProcess(pipe_write_fd, absl::InternalError(absl::StrFormat(
-                                           "mapping previously discovered "
-                                           "address %p failed",
-                                           location_ptr)));
+      AbortChildProcess(pipe_write_fd, absl::StatusCode::kInternal,
+                        "mapping failed for previously discovered address",
+                        accessed_location);
+    }
+    if (mappings != nullptr) {
+      mappings->accessed_blocks[mappings->num_accessed_blocks++] =
+          reinterpret_cast<uintptr_t>(mapped_address);
     }
     if (mapped_address != location_ptr) {
       // Use InvalidArgument only for the case where we couldn't map an address.
@@ -314,21 +500,9 @@ void repmovsb(void* dst, const void* src, size_t count) {
       // up not being valid to map, which is potentially fixable by running
       // again with different register values. By using a unique error code we
       // can distinguish this case easily.
-      AbortChildProcess(
-          pipe_write_fd,
-          absl::InvalidArgumentError(absl::StrFormat(
-              "tried to map previously discovered address %p, but mmap "
-              "couldn't map this address\n",
-              (void*)location_ptr)));
-    }
-
-    // Initialise every fourth byte to 8, leaving the rest as zeroes. This
-    // ensures that every aligned 8-byte chunk will contain 0x800000008, which
-    // is a mappable address, and every 4-byte chunk will contain 0x8, which is
-    // a non-zero value which won't give SIGFPE if used with div.
-    uint8_t* block = reinterpret_cast<uint8_t*>(mapped_address);
-    for (int i = 0; i < accessed_addrs.block_size; i += 4) {
-      block[i] = 8;
+      AbortChildProcess(pipe_write_fd, absl::StatusCode::kInvalidArgument,
+                        "mmap couldn't map previously discovered address",
+                        accessed_location);
     }
   }
 
@@ -341,7 +515,7 @@ void repmovsb(void* dst, const void* src, size_t count) {
   const auto total_block_size =
       before_block.size() + basic_block.size() + after_block.size();
 
-  uintptr_t desired_code_location = accessed_addrs.code_location;
+  uintptr_t desired_code_location = code_location;
   if (desired_code_location == 0) {
     desired_code_location = kDefaultCodeLocation;
   }
@@ -350,15 +524,19 @@ void repmovsb(void* dst, const void* src, size_t count) {
       mmap(reinterpret_cast<void*>(desired_code_location), total_block_size,
            PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
   if (mapped_address == MAP_FAILED) {
-    perror("mmap failed");
-    abort();
+    AbortChildProcess(pipe_write_fd, absl::StatusCode::kInternal,
+                      "mapping failed for the basic block at",
+                      desired_code_location);
+  }
+  if (mappings != nullptr) {
+    mappings->code_address = reinterpret_cast<uintptr_t>(mapped_address);
+    mappings->code_size = total_block_size;
   }
 
   auto piped_data = MakePipedData();
-  piped_data.status_code = absl::OkStatus().code();
+  piped_data.status_code = absl::StatusCode::kOk;
   piped_data.code_address = reinterpret_cast<uintptr_t>(mapped_address);
-  auto status = WriteAll(pipe_write_fd, piped_data);
-  if (!status.ok()) {
+  if (RawWriteAll(pipe_write_fd, piped_data) != 0) {
     abort();
   }
 
@@ -372,13 +550,36 @@ void repmovsb(void* dst, const void* src, size_t count) {
 
   auto mapped_func =
       reinterpret_cast<void (*)(const X64Regs* initial_regs)>(mapped_address);
-  mapped_func(&accessed_addrs.initial_regs);
+  mapped_func(&initial_regs);
 
   // mapped_func should never return, but we can't put [[noreturn]] on a
   // function pointer. So stick this here to satisfy the compiler.
   abort();
 }
 
+// This value will turn up when reading from newly-mapped blocks (see
+// MapAndRunBlock). Unmap it so that we can correctly segfault and detect we've
+// accessed it. If it fails, oh well. Not worth aborting for as we might not
+// even access this address.
+void UnmapFillValueAddress() {
+  munmap(reinterpret_cast<void*>(0x800000000), 0x10000);
+}
+
+[[noreturn]] void ChildProcess(absl::Span<const uint8_t> basic_block,
+                               int pipe_write_fd,
+                               const AccessedAddrs& accessed_addrs) {
+  // Make sure the parent is attached before doing anything that they might want
+  // to listen for.
+  ptrace(PTRACE_TRACEME, 0, nullptr, nullptr);
+  raise(SIGSTOP);
+
+  UnmapFillValueAddress();
+  MapAndRunBlock(basic_block, accessed_addrs.accessed_blocks,
+                 accessed_addrs.block_size, accessed_addrs.code_location,
+                 accessed_addrs.initial_regs, pipe_write_fd,
+                 /*mappings=*/nullptr);
+}
+
 absl::Status ForkAndTestAddresses(absl::Span<const uint8_t> basic_block,
                                   AccessedAddrs& accessed_addrs) {
   int pipe_fds[2];
@@ -394,6 +595,8 @@ absl::Status ForkAndTestAddresses(absl::Span<const uint8_t> basic_block,
   switch (pid) {
     case -1: {
       int err = errno;
+      close(pipe_read_fd);
+      close(pipe_write_fd);
       return absl::ErrnoToStatus(err, "Failed to fork");
     }
     case 0:  // child
@@ -410,35 +613,514 @@ absl::Status ForkAndTestAddresses(absl::Span<const uint8_t> basic_block,
   }
 }
 
-void RandomiseRegs(absl::BitGen& gen, X64Regs& regs) {
-  // Pick between three values: 0, a low address, and a high address. These are
-  // picked to try to maximise the chance that some combination will produce a
-  // valid address when run through a wide range of functions. This is just a
-  // first stab, there are likely better sets of values we could use here.
-  constexpr int64_t kValues[] = {0, 0x15000, 0x1000000};
-  absl::uniform_int_distribution<int> dist(0, std::size(kValues) - 1);
-  auto random_reg = [&gen, &dist]() { return kValues[dist(gen)]; };
-
-  regs.rax = random_reg();
-  regs.rbx = random_reg();
-  regs.rcx = random_reg();
-  regs.rdx = random_reg();
-  regs.rsi = random_reg();
-  regs.rdi = random_reg();
-  regs.rsp = random_reg();
-  regs.rbp = random_reg();
-  regs.r8 = random_reg();
-  regs.r9 = random_reg();
-  regs.r10 = random_reg();
-  regs.r11 = random_reg();
-  regs.r12 = random_reg();
-  regs.r13 = random_reg();
-  regs.r14 = random_reg();
-  regs.r15 = random_reg();
+// The state of the fork server process that survives between runs of basic
+// blocks. It is kept in the frame of ForkServerProcess(), see the comments
+// there for details.
+struct ForkServerState {
+  int request_fd;
+  int response_fd;
+  ForkServerRequest request;
+  uintptr_t accessed_blocks[kMaxForkServerAccessedBlocks];
+  uint8_t basic_block[kMaxForkServerBlockSize];
+  BlockMappings mappings;
+};
+
+// Reads one request from the parent, and runs the basic block from the request
+// in a clean address space. Exits the process when the parent closes the
+// request pipe.
+[[noreturn]] void ServeForkServerRequest(ForkServerState& state) {
+  // Restore the address space to the state before the previous run.
+  state.mappings.Unmap();
+
+  ForkServerRequest& request = state.request;
+  if (!RawReadExactly(state.request_fd,
+                      absl::MakeSpan(reinterpret_cast<uint8_t*>(&request),
+                                     sizeof request)) ||
+      request.num_accessed_blocks > kMaxForkServerAccessedBlocks ||
+      request.basic_block_size > kMaxForkServerBlockSize ||
+      !RawReadExactly(
+          state.request_fd,
+          absl::MakeSpan(reinterpret_cast<uint8_t*>(state.accessed_blocks),
+                         request.num_accessed_blocks * sizeof(uintptr_t))) ||
+      !RawReadExactly(state.request_fd, absl::MakeSpan(
+                                            state.basic_block,
+                                            request.basic_block_size))) {
+    _exit(0);
+  }
+
+  MapAndRunBlock(
+      absl::MakeConstSpan(state.basic_block, request.basic_block_size),
+      absl::MakeConstSpan(state.accessed_blocks, request.num_accessed_blocks),
+      request.accessed_block_size, request.code_location,
+      request.initial_regs, state.response_fd, &state.mappings);
+}
+
+// The mappings of the current run of the fork server. Only set in the fork
+// server process.
+BlockMappings* fork_server_mappings = nullptr;
+
+// Maps an accessed block in the fork server while a basic block is running, on
+// behalf of the parent. The parent stops the basic block when it accesses an
+// unmapped block, and calls this function by setting the registers of the
+// server; the stack is the part of the stack of the server below the frame of
+// ForkServerProcess(), which is not used while the basic block runs. The
+// function reports back to the parent with a breakpoint, with `location` in
+// rax when the block was mapped at `location` and 0 otherwise. The parent then
+// restores the registers of the basic block and resumes it.
+[[noreturn]] void MapAccessedBlockForParent(uintptr_t location,
+                                            size_t block_size) {
+  uintptr_t result = 0;
+  BlockMappings& mappings = *fork_server_mappings;
+  if (mappings.num_accessed_blocks < kMaxForkServerAccessedBlocks) {
+    void* mapped_address = MapAccessedBlock(location, block_size);
+    if (mapped_address != MAP_FAILED) {
+      // Record the mapping even when it's at a different address, so that it
+      // is unmapped before the next run.
+      mappings.accessed_blocks[mappings.num_accessed_blocks++] =
+          reinterpret_cast<uintptr_t>(mapped_address);
+      if (mapped_address == reinterpret_cast<void*>(location)) {
+        result = location;
+      }
+    }
+  }
+  asm volatile("int3" : : "a"(result) : "memory");
+  abort();
+}
+
+[[noreturn]] void ForkServerProcess(int request_fd, int response_fd) {
+  ptrace(PTRACE_TRACEME, 0, nullptr, nullptr);
+  UnmapFillValueAddress();
+
+  ForkServerState state;
+  state.request_fd = request_fd;
+  state.response_fd = response_fd;
+  state.mappings.code_address = 0;
+  state.mappings.num_accessed_blocks = 0;
+  fork_server_mappings = &state.mappings;
+
+  // The parent takes a snapshot of the registers at this stop. Each run of a
+  // basic block ends with a signal; the parent then restores the snapshot and
+  // discards the signal, and the process continues from here as if it just
+  // left the stop. All state that survives between runs is in `state`, in the
+  // frame of this function, i.e. above the stack pointer at the time of the
+  // stop. The frames of the functions called below are always rebuilt, and
+  // KillSelf() does not touch the signal mask.
+  KillSelf(SIGSTOP);
+  ServeForkServerRequest(state);
+}
+
+// A persistent child process that runs basic blocks on behalf of the parent,
+// to avoid forking the whole parent process for each run. The server is forked
+// once, and for each run it receives the basic block and the accessed blocks
+// over a pipe, maps them in its address space, and runs the block. The parent
+// traces the server; after each run, it resets the registers of the server to
+// the state before the first run, and the server unmaps the memory mapped for
+// the previous run.
+//
+// When the basic block accesses an unmapped block of memory, the parent makes
+// the server map the block (see MapAccessedBlockForParent()) and resumes the
+// basic block from the faulting instruction, so that a single run finds all
+// the blocks accessed by the basic block.
+//
+// The basic block runs in the address space of the server, so a block that
+// writes to memory of the server that happens to be mapped may corrupt it. The
+// server is restarted whenever it stops responding. A ForkServer must be used
+// only from the thread that created it, because only this thread can issue
+// ptrace requests to the server.
+class ForkServer {
+ public:
+  ForkServer() = default;
+  ForkServer(const ForkServer&) = delete;
+  ForkServer& operator=(const ForkServer&) = delete;
+  ~ForkServer() { Stop(); }
+
+  // Runs `basic_block` with the accessed blocks and the registers from
+  // `accessed_addrs`. Has the same semantics as ForkAndTestAddresses(), and
+  // falls back to it for requests that do not fit in the buffers of the
+  // server. Sets `finished` to true when the basic block ran to its end, i.e.
+  // when `accessed_addrs` contains all blocks accessed by it.
+  absl::Status TestAddresses(absl::Span<const uint8_t> basic_block,
+                             AccessedAddrs& accessed_addrs, bool* finished);
+
+  // Returns the number of processes forked by this object: the server
+  // processes, and the processes of the runs that did not use the server.
+  int num_forks() const { return num_forks_; }
+
+  // Returns the offset in the basic block of the instruction that accessed an
+  // address that can't be mapped in the last call to TestAddresses(). Returns
+  // std::nullopt when the last call did not fail this way, or when the
+  // instruction is not known.
+  std::optional<size_t> unmappable_access_offset() const {
+    return unmappable_access_offset_;
+  }
+
+ private:
+  absl::Status Start();
+  void Stop();
+
+  // Handles a SIGSEGV stop of the server while it's running a basic block.
+  // Adds the accessed block to `accessed_addrs` when it's not there yet, maps
+  // it in the server, and resumes the basic block. Returns true when the basic
+  // block was resumed, and false when the run ended at the SIGSEGV. Returns
+  // InvalidArgument when the block can't be mapped; the run ends, and the
+  // address of the instruction is stored in `unmappable_access_rip_`.
+  absl::StatusOr<bool> MapBlockAndResume(AccessedAddrs& accessed_addrs);
+
+  pid_t pid_ = -1;
+  int request_fd_ = -1;
+  int response_fd_ = -1;
+  // The registers of the server at the stop before the first run.
+  struct user_regs_struct initial_regs_;
+  struct user_fpregs_struct initial_fpregs_;
+  int num_forks_ = 0;
+  std::optional<uintptr_t> unmappable_access_rip_;
+  std::optional<size_t> unmappable_access_offset_;
+};
+
+absl::Status ForkServer::Start() {
+  int request_fds[2];
+  int response_fds[2];
+  if (pipe(request_fds) != 0) {
+    int err = errno;
+    return absl::ErrnoToStatus(
+        err, "Failed to open pipe for communication with the fork server");
+  }
+  if (pipe(response_fds) != 0) {
+    int err = errno;
+    close(request_fds[0]);
+    close(request_fds[1]);
+    return absl::ErrnoToStatus(
+        err, "Failed to open pipe for communication with the fork server");
+  }
+
+  pid_t pid = fork();
+  if (pid > 0) ++num_forks_;
+  switch (pid) {
+    case -1: {
+      int err = errno;
+      for (int fd : {request_fds[0], request_fds[1], response_fds[0],
+                     response_fds[1]}) {
+        close(fd);
+      }
+      return absl::ErrnoToStatus(err, "Failed to fork");
+    }
+    case 0:  // child
+      close(request_fds[1]);
+      close(response_fds[0]);
+      // ForkServerProcess doesn't return.
+      ForkServerProcess(request_fds[0], response_fds[1]);
+    default:  // parent
+      close(request_fds[0]);
+      close(response_fds[1]);
+      pid_ = pid;
+      request_fd_ = request_fds[1];
+      response_fd_ = response_fds[0];
+  }
+
+  int status;
+  waitpid(pid_, &status, 0);
+  if (!WIFSTOPPED(status)) {
+    pid_ = -1;
+    Stop();
+    return absl::InternalError(absl::StrFormat(
+        "Fork server terminated with an unexpected status: %d", status));
+  }
+  // Kill the server when the parent exits, so that it never outlives us.
+  ptrace(PTRACE_SETOPTIONS, pid_, nullptr,
+         reinterpret_cast<void*>(PTRACE_O_EXITKILL));
+  ptrace(PTRACE_GETREGS, pid_, nullptr, &initial_regs_);
+  ptrace(PTRACE_GETFPREGS, pid_, nullptr, &initial_fpregs_);
+  // The stop happened on the return from the kill() syscall. Make sure that
+  // the kernel never tries to restart the syscall when the registers are
+  // restored.
+  initial_regs_.orig_rax = -1;
+  ptrace(PTRACE_CONT, pid_, nullptr, nullptr);
+  return absl::OkStatus();
+}
+
+void ForkServer::Stop() {
+  if (request_fd_ >= 0) close(request_fd_);
+  if (response_fd_ >= 0) close(response_fd_);
+  request_fd_ = -1;
+  response_fd_ = -1;
+  if (pid_ > 0) {
+    kill(pid_, SIGKILL);
+    waitpid(pid_, nullptr, 0);
+  }
+  pid_ = -1;
+}
+
+absl::StatusOr<bool> ForkServer::MapBlockAndResume(
+    AccessedAddrs& accessed_addrs) {
+  siginfo_t siginfo;
+  ptrace(PTRACE_GETSIGINFO, pid_, 0, &siginfo);
+  const uintptr_t addr = AlignDown(
+      reinterpret_cast<uintptr_t>(siginfo.si_addr), accessed_addrs.block_size);
+  if (std::find(accessed_addrs.accessed_blocks.begin(),
+                accessed_addrs.accessed_blocks.end(),
+                addr) != accessed_addrs.accessed_blocks.end()) {
+    // The block is already mapped, so mapping it again won't help.
+    return false;
+  }
+  accessed_addrs.accessed_blocks.push_back(addr);
+  if (accessed_addrs.accessed_blocks.size() > kMaxForkServerAccessedBlocks) {
+    return false;
+  }
+
+  struct user_regs_struct block_regs;
+  struct user_fpregs_struct block_fpregs;
+  if (ptrace(PTRACE_GETREGS, pid_, nullptr, &block_regs) != 0 ||
+      ptrace(PTRACE_GETFPREGS, pid_, nullptr, &block_fpregs) != 0) {
+    return absl::InternalError("Failed to read the registers of the block");
+  }
+
+  // Call MapAccessedBlockForParent() on the stack below the frame of
+  // ForkServerProcess(). The stack pointer must be aligned as it would be after
+  // a call instruction.
+  constexpr uintptr_t kStackGap = 256;
+  struct user_regs_struct map_regs = initial_regs_;
+  map_regs.rip = reinterpret_cast<uintptr_t>(&MapAccessedBlockForParent);
+  map_regs.rdi = addr;
+  map_regs.rsi = accessed_addrs.block_size;
+  map_regs.rsp = AlignDown(initial_regs_.rsp - kStackGap, 16) - 8;
+  if (ptrace(PTRACE_SETREGS, pid_, nullptr, &map_regs) != 0 ||
+      ptrace(PTRACE_CONT, pid_, nullptr, nullptr) != 0) {
+    return absl::InternalError("Failed to resume the fork server");
+  }
+  int status;
+  waitpid(pid_, &status, 0);
+  if (!WIFSTOPPED(status) || WSTOPSIG(status) != SIGTRAP ||
+      ptrace(PTRACE_GETREGS, pid_, nullptr, &map_regs) != 0) {
+    return absl::InternalError(absl::StrFormat(
+        "The fork server failed to map an accessed block: %d", status));
+  }
+  if (map_regs.rax != addr) {
+    // The block can't be mapped at this address. This is potentially fixable by
+    // running again with different register values, see MapAndRunBlock().
+    accessed_addrs.accessed_blocks.pop_back();
+    unmappable_access_rip_ = block_regs.rip;
+    return absl::InvalidArgumentError(absl::StrFormat(
+        "the block accessed address %p, but mmap couldn't map this address",
+        reinterpret_cast<void*>(addr)));
+  }
+
+  if (ptrace(PTRACE_SETREGS, pid_, nullptr, &block_regs) != 0 ||
+      ptrace(PTRACE_SETFPREGS, pid_, nullptr, &block_fpregs) != 0 ||
+      ptrace(PTRACE_CONT, pid_, nullptr, nullptr) != 0) {
+    return absl::InternalError("Failed to resume the block");
+  }
+  return true;
+}
+
+absl::Status ForkServer::TestAddresses(absl::Span<const uint8_t> basic_block,
+                                       AccessedAddrs& accessed_addrs,
+                                       bool* finished) {
+  *finished = false;
+  unmappable_access_rip_.reset();
+  unmappable_access_offset_.reset();
+  if (basic_block.size() > kMaxForkServerBlockSize ||
+      accessed_addrs.accessed_blocks.size() > kMaxForkServerAccessedBlocks) {
+    ++num_forks_;
+    return ForkAndTestAddresses(basic_block, accessed_addrs);
+  }
+  if (pid_ < 0) {
+    auto status = Start();
+    if (!status.ok()) {
+      return status;
+    }
+  }
+
+  ForkServerRequest request;
+  // Zero out the padding, for the same reason as in MakePipedData().
+  memset(&request, 0, sizeof(request));
+  request.code_location = accessed_addrs.code_location;
+  request.accessed_block_size = accessed_addrs.block_size;
+  request.num_accessed_blocks = accessed_addrs.accessed_blocks.size();
+  request.basic_block_size = basic_block.size();
+  request.initial_regs = accessed_addrs.initial_regs;
+  const auto accessed_blocks = absl::MakeConstSpan(
+      reinterpret_cast<const uint8_t*>(accessed_addrs.accessed_blocks.data()),
+      accessed_addrs.accessed_blocks.size() * sizeof(uintptr_t));
+  for (absl::Status status : {
+           WriteAll(request_fd_, request),
+           WriteAll(request_fd_, accessed_blocks),
+           WriteAll(request_fd_, basic_block),
+       }) {
+    if (!status.ok()) {
+      Stop();
+      return status;
+    }
+  }
+
+  absl::Status result;
+  bool block_finished = false;
+  while (true) {
+    int status;
+    waitpid(pid_, &status, 0);
+    if (!WIFSTOPPED(status)) {
+      // The server is gone; there is nothing to kill.
+      pid_ = -1;
+      Stop();
+      return absl::InternalError(absl::StrFormat(
+          "Fork server terminated with an unexpected status: %d", status));
+    }
+    // The server writes its response before running the block, so a SIGSEGV
+    // with a response in the pipe comes from the basic block.
+    if (WSTOPSIG(status) == SIGSEGV && HasDataToRead(response_fd_)) {
+      absl::StatusOr<bool> resumed = MapBlockAndResume(accessed_addrs);
+      if (absl::IsInvalidArgument(resumed.status())) {
+        result = resumed.status();
+        break;
+      }
+      if (!resumed.ok()) {
+        Stop();
+        return resumed.status();
+      }
+      if (*resumed) continue;
+      break;
+    }
+    result = HandleStopSignal(pid_, WSTOPSIG(status), accessed_addrs);
+    block_finished = WSTOPSIG(status) == SIGABRT;
+    break;
+  }
+
+  // The response must be in the pipe by now. When it isn't, the server crashed
+  // in its own code, and it must be restarted.
+  absl::StatusOr<PipedData> pipe_data =
+      HasDataToRead(response_fd_) ? ReadPipedData(response_fd_)
+                    : absl::InternalError("The fork server did not respond");
+
+  if (pipe_data.ok() &&
+      ptrace(PTRACE_SETREGS, pid_, nullptr, &initial_regs_) == 0 &&
+      ptrace(PTRACE_SETFPREGS, pid_, nullptr, &initial_fpregs_) == 0 &&
+      ptrace(PTRACE_CONT, pid_, nullptr, nullptr) == 0) {
+    // The server is ready for the next request.
+  } else {
+    Stop();
+  }
+
+  if (unmappable_access_rip_.has_value() && pipe_data.ok()) {
+    const uintptr_t block_start =
+        pipe_data->code_address + GetGematriaBeforeBlockCode().size();
+    if (*unmappable_access_rip_ >= block_start &&
+        *unmappable_access_rip_ - block_start < basic_block.size()) {
+      unmappable_access_offset_ = *unmappable_access_rip_ - block_start;
+    }
+  }
+
+  if (!result.ok()) {
+    return result;
+  }
+  if (!pipe_data.ok()) {
+    return pipe_data.status();
+  }
+  if (pipe_data->status_code != absl::StatusCode::kOk) {
+    return absl::Status(pipe_data->status_code, pipe_data->status_message);
+  }
+
+  accessed_addrs.code_location = pipe_data->code_address;
+  *finished = block_finished;
+
+  return absl::OkStatus();
+}
+
+// The values used for the registers. These are picked to try to maximise the
+// chance that some combination will produce a valid address when run through a
+// wide range of functions. This is just a first stab, there are likely better
+// sets of values we could use here.
+constexpr int64_t kRegValues[] = {0, 0x15000, 0x1000000};
+
+// The values set to all the changed registers in the first retries, before
+// using random values. The initial value of the registers is 0x15000 for the
+// default block size.
+constexpr int64_t kSeedRegValues[] = {0x1000000, 0};
+
+// The number of retries that change only the address registers of the
+// instruction that accessed an unmappable address. The registers may have been
+// overwritten before the instruction, so the later retries change all of them.
+constexpr int kMaxGuidedRetries = 8;
+
+// Sets the registers in `registers` to `value`.
+void SetRegs(X64RegisterMask registers, int64_t value, X64Regs& regs) {
+  for (int i = 0; i < std::size(kX64RegsFields); ++i) {
+    if (registers & (1 << i)) regs.*kX64RegsFields[i] = value;
+  }
+}
+
+// Sets the registers in `registers` to random values from kRegValues.
+void RandomiseRegs(absl::BitGen& gen, X64RegisterMask registers,
+                   X64Regs& regs) {
+  absl::uniform_int_distribution<int> dist(0, std::size(kRegValues) - 1);
+  for (int i = 0; i < std::size(kX64RegsFields); ++i) {
+    if (registers & (1 << i)) regs.*kX64RegsFields[i] = kRegValues[dist(gen)];
+  }
+}
+
+// Returns the address registers of the instruction at `offset`, or zero when
+// there is no such instruction in `address_registers`.
+X64RegisterMask AddressRegistersAt(
+    absl::Span<const InstructionAddressRegisters> address_registers,
+    size_t offset) {
+  for (const InstructionAddressRegisters& instruction : address_registers) {
+    if (offset >= instruction.offset &&
+        offset - instruction.offset < instruction.size) {
+      return instruction.registers;
+    }
+  }
+  return 0;
 }
 
 }  // namespace
 
+X64RegisterMask X64RegisterMaskFromName(std::string_view register_name) {
+  // The names of the parts of the registers, in the order of kX64RegsFields.
+  static constexpr std::string_view kRegisterNames[][5] = {
+      {"RAX", "EAX", "AX", "AL", "AH"},  {"RBX", "EBX", "BX", "BL", "BH"},
+      {"RCX", "ECX", "CX", "CL", "CH"},  {"RDX", "EDX", "DX", "DL", "DH"},
+      {"RSI", "ESI", "SI", "SIL"},       {"RDI", "EDI", "DI", "DIL"},
+      {"RSP", "ESP", "SP", "SPL"},       {"RBP", "EBP", "BP", "BPL"},
+      {"R8", "R8D", "R8W", "R8B"},       {"R9", "R9D", "R9W", "R9B"},
+      {"R10", "R10D", "R10W", "R10B"},   {"R11", "R11D", "R11W", "R11B"},
+      {"R12", "R12D", "R12W", "R12B"},   {"R13", "R13D", "R13W", "R13B"},
+      {"R14", "R14D", "R14W", "R14B"},   {"R15", "R15D", "R15W", "R15B"}};
+  if (register_name.empty()) return 0;
+  for (int i = 0; i < std::size(kRegisterNames); ++i) {
+    for (const std::string_view name : kRegisterNames[i]) {
+      if (name == register_name) return 1 << i;
+    }
+  }
+  return 0;
+}
+
+std::vector<InstructionAddressRegisters> GetInstructionAddressRegisters(
+    const BasicBlockProto& basic_block) {
+  std::vector<InstructionAddressRegisters> result;
+  const int num_instructions =
+      std::min(basic_block.machine_instructions_size(),
+               basic_block.canonicalized_instructions_size());
+  size_t offset = 0;
+  for (int i = 0; i < num_instructions; ++i) {
+    const CanonicalizedInstructionProto& instruction =
+        basic_block.canonicalized_instructions(i);
+    X64RegisterMask registers = 0;
+    for (const auto* operands : {&instruction.input_operands(),
+                                 &instruction.implicit_input_operands()}) {
+      for (const CanonicalizedOperandProto& operand : *operands) {
+        if (!operand.has_address()) continue;
+        registers |= X64RegisterMaskFromName(operand.address().base_register());
+        registers |=
+            X64RegisterMaskFromName(operand.address().index_register());
+      }
+    }
+    const size_t size =
+        basic_block.machine_instructions(i).machine_code().size();
+    result.push_back(
+        {.offset = offset, .size = size, .registers = registers});
+    offset += size;
+  }
+  return result;
+}
+
 // TODO(orodley):
 // * Set up registers to minimise chance of needing to map an unmappable or
 //   already mapped address, the communicate the necessary set of register in
@@ -453,6 +1135,22 @@ void RandomiseRegs(absl::BitGen& gen, X64Regs& regs) {
 // * Much more complete testing.
 absl::StatusOr<AccessedAddrs> FindAccessedAddrs(
     absl::Span<const uint8_t> basic_block) {
+  FindAccessedAddrsStats stats;
+  return FindAccessedAddrs(basic_block, FindAccessedAddrsOptions(), stats);
+}
+
+absl::StatusOr<AccessedAddrs> FindAccessedAddrs(
+    absl::Span<const uint8_t> basic_block,
+    const FindAccessedAddrsOptions& options, FindAccessedAddrsStats& stats) {
+  const size_t page_size = getpagesize();
+  const size_t block_size =
+      options.block_size == 0 ? page_size : options.block_size;
+  if (block_size % page_size != 0) {
+    return absl::FailedPreconditionError(absl::StrFormat(
+        "The block size %d is not a multiple of the page size %d", block_size,
+        page_size));
+  }
+
   // This value is chosen to be almost the lowest address that's able to be
   // mapped. We want it to be low so that even if a register is multiplied or
   // added to another register, it will still be likely to be within an
@@ -460,53 +1158,79 @@ absl::StatusOr<AccessedAddrs> FindAccessedAddrs(
   // offsets from a register as a memory address, so we want to leave some space
   // below so that such addresses will still be accessible.
   constexpr int64_t kInitialRegValue = 0x15000;
+  // With large blocks, keep the address in the second block, because the first
+  // one can't be mapped.
+  const int64_t initial_reg_value = block_size > kInitialRegValue
+                                        ? block_size + kInitialRegValue
+                                        : kInitialRegValue;
 
   absl::BitGen gen;
 
   AccessedAddrs accessed_addrs = {
       .code_location = 0,
-      .block_size = static_cast<size_t>(getpagesize()),
+      .block_size = block_size,
       .accessed_blocks = {},
-      .initial_regs =
-          {
-              .rax = kInitialRegValue,
-              .rbx = kInitialRegValue,
-              .rcx = kInitialRegValue,
-              .rdx = kInitialRegValue,
-              .rsi = kInitialRegValue,
-              .rdi = kInitialRegValue,
-              .rsp = kInitialRegValue,
-              .rbp = kInitialRegValue,
-              .r8 = kInitialRegValue,
-              .r9 = kInitialRegValue,
-              .r10 = kInitialRegValue,
-              .r11 = kInitialRegValue,
-              .r12 = kInitialRegValue,
-              .r13 = kInitialRegValue,
-              .r14 = kInitialRegValue,
-              .r15 = kInitialRegValue,
-          },
   };
-
+  SetRegs(kAllX64Registers, initial_reg_value, accessed_addrs.initial_regs);
+
+  // Each thread has its own fork server, because only the thread that started
+  // the server can trace it. The server is reused across calls.
+  static thread_local ForkServer fork_server;
+  const int initial_num_forks = fork_server.num_forks();
+  const auto update_num_forks = [&]() {
+    stats.num_forks += fork_server.num_forks() - initial_num_forks;
+  };
   int n = 0;
+  int num_retries = 0;
   size_t num_accessed_blocks;
+  bool finished;
+  bool retry;
   do {
     num_accessed_blocks = accessed_addrs.accessed_blocks.size();
-    auto status = ForkAndTestAddresses(basic_block, accessed_addrs);
+    retry = false;
+    auto status =
+        fork_server.TestAddresses(basic_block, accessed_addrs, &finished);
+    ++stats.num_runs;
     if (absl::IsInvalidArgument(status)) {
       if (n > 100) {
+        update_num_forks();
         return status;
       }
 
-      accessed_addrs.accessed_blocks.clear();
-      RandomiseRegs(gen, accessed_addrs.initial_regs);
+      // Change only the registers used to compute the address when they are
+      // known. The blocks found so far are kept; they may no longer be
+      // accessed, but they can still be mapped.
+      X64RegisterMask registers = kAllX64Registers;
+      const std::optional<size_t> offset =
+          fork_server.unmappable_access_offset();
+      if (offset.has_value() && num_retries < kMaxGuidedRetries) {
+        registers = AddressRegistersAt(options.address_registers, *offset);
+        if (registers == 0) registers = kAllX64Registers;
+      }
+      if (registers == kAllX64Registers) {
+        accessed_addrs.accessed_blocks.clear();
+      }
+      if (num_retries < std::size(kSeedRegValues)) {
+        SetRegs(registers, kSeedRegValues[num_retries],
+                accessed_addrs.initial_regs);
+      } else {
+        RandomiseRegs(gen, registers, accessed_addrs.initial_regs);
+      }
+      ++num_retries;
+      ++stats.num_retries;
+      retry = true;
     } else if (!status.ok()) {
+      update_num_forks();
       return status;
     }
 
     n++;
-  } while (accessed_addrs.accessed_blocks.size() != num_accessed_blocks);
+    // When the block ran to its end with all accessed blocks mapped, running it
+    // again would not find any new blocks.
+  } while (retry || (!finished && accessed_addrs.accessed_blocks.size() !=
+                                       num_accessed_blocks));
 
+  update_num_forks();
   return accessed_addrs;
 }
 
@@ -15,11 +15,14 @@
 #ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_DATASETS_FIND_ACCESSED_ADDRS_H_
 #define THIRD_PARTY_GEMATRIA_GEMATRIA_DATASETS_FIND_ACCESSED_ADDRS_H_
 
+#include <cstddef>
 #include <cstdint>
+#include <string_view>
 #include <vector>
 
 #include "absl/status/statusor.h"
 #include "absl/types/span.h"
+#include "gematria/proto/basic_block.pb.h"
 
 namespace gematria {
 
@@ -42,6 +45,44 @@ struct X64Regs {
   int64_t r15;
 };
 
+// A set of the registers in X64Regs. Bit `i` of the mask corresponds to the
+// register `kX64RegsFields[i]`.
+using X64RegisterMask = uint16_t;
+
+inline constexpr X64RegisterMask kAllX64Registers = 0xffff;
+
+inline constexpr int64_t X64Regs::*kX64RegsFields[] = {
+    &X64Regs::rax, &X64Regs::rbx, &X64Regs::rcx, &X64Regs::rdx,
+    &X64Regs::rsi, &X64Regs::rdi, &X64Regs::rsp, &X64Regs::rbp,
+    &X64Regs::r8,  &X64Regs::r9,  &X64Regs::r10, &X64Regs::r11,
+    &X64Regs::r12, &X64Regs::r13, &X64Regs::r14, &X64Regs::r15};
+
+// Returns the mask of the register in X64Regs that contains the register
+// `register_name`. The name is the LLVM name of a general purpose register or
+// of one of its parts, e.g. "RAX", "EAX", "AX", "AH" and "AL" all return the
+// mask of rax. Returns zero for all other registers.
+X64RegisterMask X64RegisterMaskFromName(std::string_view register_name);
+
+// The registers used in the address computations of one instruction of a basic
+// block.
+struct InstructionAddressRegisters {
+  // The position of the instruction in the machine code of the basic block, in
+  // bytes.
+  size_t offset;
+  size_t size;
+  // The base and index registers of the memory operands of the instruction.
+  X64RegisterMask registers;
+};
+
+// Returns the address registers of each instruction of `basic_block`.
+std::vector<InstructionAddressRegisters> GetInstructionAddressRegisters(
+    const BasicBlockProto& basic_block);
+
+// The version of the results of FindAccessedAddrs(). Must be incremented
+// whenever a change to FindAccessedAddrs() changes its results for some basic
+// blocks, so that results stored in AccessedAddrsCache files are not reused.
+inline constexpr int kFindAccessedAddrsVersion = 2;
+
 struct AccessedAddrs {
   uintptr_t code_location;
   size_t block_size;
@@ -49,12 +90,50 @@ struct AccessedAddrs {
   X64Regs initial_regs;
 };
 
+// Counters of the work done by FindAccessedAddrs().
+struct FindAccessedAddrsStats {
+  // The number of times the basic block was run.
+  int num_runs = 0;
+  // The number of times the registers were set to new random values after a
+  // run accessed an address that can't be mapped.
+  int num_retries = 0;
+  // The number of processes forked to run the basic block.
+  int num_forks = 0;
+};
+
 // Given a basic block of code, attempt to determine what addresses that code
 // accesses. This is done by executing the code in a new process, so the code
 // must match the architecture on which this function is executed.
 absl::StatusOr<AccessedAddrs> FindAccessedAddrs(
     absl::Span<const uint8_t> basic_block);
 
+// Options of FindAccessedAddrs().
+struct FindAccessedAddrsOptions {
+  // The address registers of the instructions of the basic block, see
+  // GetInstructionAddressRegisters(). When a run accesses an address that can't
+  // be mapped, the registers are set to new values and the block is run again.
+  // The address registers are used to change only the registers that were used
+  // to compute the address and to keep the blocks found until then. May be
+  // empty, e.g. when the block can't be disassembled; all registers are changed
+  // then.
+  absl::Span<const InstructionAddressRegisters> address_registers;
+
+  // The size of the blocks of memory mapped for the accessed addresses, in
+  // bytes; each access maps the whole block that contains it. Must be a
+  // multiple of the page size; zero uses the page size. Larger blocks need
+  // fewer runs and fewer mappings for basic blocks that access large arrays,
+  // but they also map memory that is not accessed. The blocks can't be mapped
+  // below the lowest mappable address, so accesses to the first block of the
+  // address space always fail.
+  size_t block_size = 0;
+};
+
+// Same as above, but uses `options` and adds the work done for the basic block
+// to `stats`. Returns FailedPrecondition when the options are not valid.
+absl::StatusOr<AccessedAddrs> FindAccessedAddrs(
+    absl::Span<const uint8_t> basic_block,
+    const FindAccessedAddrsOptions& options, FindAccessedAddrsStats& stats);
+
 }  // namespace gematria
 
 #endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_DATASETS_FIND_ACCESSED_ADDRS_H_
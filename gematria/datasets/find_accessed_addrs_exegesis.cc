@@ -45,10 +45,25 @@ ExegesisAnnotator::ExegesisAnnotator(
   MachineDisassembler.reset(
       State.getTargetMachine().getTarget().createMCDisassembler(
           State.getSubtargetInfo(), *MachineContext));
-  MachinePrinter.reset(State.getTargetMachine().getTarget().createMCInstPrinter(
-      State.getTargetMachine().getTargetTriple(), 0,
-      *State.getTargetMachine().getMCAsmInfo(), State.getInstrInfo(),
-      State.getRegInfo()));
+
+  const llvm::MCRegisterInfo &MRI = State.getRegInfo();
+
+  for (unsigned i = 0;
+       i < MRI.getRegClass(X86::GR64_NOREX2RegClassID).getNumRegs(); ++i) {
+    RegisterValue RegVal;
+    RegVal.Register =
+        MRI.getRegClass(X86::GR64_NOREX2RegClassID).getRegister(i);
+    RegVal.Value = APInt(64, 0x12345600);
+    InitialRegisterValues.push_back(RegVal);
+  }
+
+  for (unsigned i = 0; i < MRI.getRegClass(X86::VR128RegClassID).getNumRegs();
+       ++i) {
+    RegisterValue RegVal;
+    RegVal.Register = MRI.getRegClass(X86::VR128RegClassID).getRegister(i);
+    RegVal.Value = APInt(128, 0x12345600);
+    InitialRegisterValues.push_back(RegVal);
+  }
 }
 
 Expected<std::unique_ptr<ExegesisAnnotator>> ExegesisAnnotator::create(
@@ -77,25 +92,17 @@ Expected<std::unique_ptr<ExegesisAnnotator>> ExegesisAnnotator::create(
 
 Expected<AccessedAddrs> ExegesisAnnotator::findAccessedAddrs(
     ArrayRef<uint8_t> BasicBlock) {
-  Expected<std::vector<DisassembledInstruction>> DisInstructions =
-      DisassembleAllInstructions(*MachineDisassembler, State.getInstrInfo(),
-                                 State.getRegInfo(), State.getSubtargetInfo(),
-                                 *MachinePrinter, 0, BasicBlock);
-
-  if (!DisInstructions) return DisInstructions.takeError();
+  Expected<std::vector<MCInst>> Instructions =
+      DisassembleAllMCInsts(*MachineDisassembler, BasicBlock);
 
-  std::vector<MCInst> Instructions;
-  Instructions.reserve(DisInstructions->size());
-
-  for (const auto &DisInstruction : *DisInstructions)
-    Instructions.push_back(DisInstruction.mc_inst);
+  if (!Instructions) return Instructions.takeError();
 
   AccessedAddrs MemAnnotations;
   MemAnnotations.code_location = 0;
   MemAnnotations.block_size = 4096;
 
   BenchmarkCode BenchCode;
-  BenchCode.Key.Instructions = Instructions;
+  BenchCode.Key.Instructions = std::move(*Instructions);
 
   MemoryValue MemVal;
   MemVal.Value = APInt(64, 0x12345600);
@@ -103,31 +110,13 @@ Expected<AccessedAddrs> ExegesisAnnotator::findAccessedAddrs(
   MemVal.SizeBytes = 4096;
 
   BenchCode.Key.MemoryValues["memdef1"] = MemVal;
-
-  const llvm::MCRegisterInfo &MRI = State.getRegInfo();
-
-  for (unsigned i = 0;
-       i < MRI.getRegClass(X86::GR64_NOREX2RegClassID).getNumRegs(); ++i) {
-    RegisterValue RegVal;
-    RegVal.Register =
-        MRI.getRegClass(X86::GR64_NOREX2RegClassID).getRegister(i);
-    RegVal.Value = APInt(64, 0x12345600);
-    BenchCode.Key.RegisterInitialValues.push_back(RegVal);
-  }
-
-  for (unsigned i = 0; i < MRI.getRegClass(X86::VR128RegClassID).getNumRegs();
-       ++i) {
-    RegisterValue RegVal;
-    RegVal.Register = MRI.getRegClass(X86::VR128RegClassID).getRegister(i);
-    RegVal.Value = APInt(128, 0x12345600);
-    BenchCode.Key.RegisterInitialValues.push_back(RegVal);
-  }
+  BenchCode.Key.RegisterInitialValues = InitialRegisterValues;
 
   while (true) {
-    std::unique_ptr<const SnippetRepetitor> SR = SnippetRepetitor::Create(
-        Benchmark::RepetitionModeE::Duplicate, State, X86::R8);
+    // The snippet is assembled again for each new memory mapping, because
+    // llvm-exegesis sets up the mappings in the code of the snippet.
     Expected<BenchmarkRunner::RunnableConfiguration> RCOrErr =
-        Runner->getRunnableConfiguration(BenchCode, 10000, 0, *SR);
+        Runner->getRunnableConfiguration(BenchCode, 10000, 0, *Repetitor);
 
     if (!RCOrErr) return RCOrErr.takeError();
 
@@ -33,14 +33,19 @@ using namespace llvm::exegesis;
 
 namespace gematria {
 
+// The version of the results of ExegesisAnnotator; see
+// kFindAccessedAddrsVersion.
+inline constexpr int kExegesisAnnotatorVersion = 1;
+
 class ExegesisAnnotator {
-  std::unique_ptr<MCInstPrinter> MachinePrinter;
   std::unique_ptr<MCContext> MachineContext;
   std::unique_ptr<MCDisassembler> MachineDisassembler;
 
   LLVMState &State;
   std::unique_ptr<BenchmarkRunner> Runner;
   std::unique_ptr<const SnippetRepetitor> Repetitor;
+  // The initial values of the registers, shared by all snippets.
+  std::vector<RegisterValue> InitialRegisterValues;
 
   ExegesisAnnotator(LLVMState &ExegesisState,
                     std::unique_ptr<BenchmarkRunner> BenchRunner,
@@ -49,6 +54,9 @@ class ExegesisAnnotator {
  public:
   static Expected<std::unique_ptr<ExegesisAnnotator>> create(
       LLVMState &ExegesisState);
+  // Finds the memory accessed by `BasicBlock`. The annotator can be reused for
+  // any number of basic blocks; reusing it avoids setting up the benchmark
+  // runner again for each block.
   Expected<AccessedAddrs> findAccessedAddrs(ArrayRef<uint8_t> BasicBlock);
 };
 
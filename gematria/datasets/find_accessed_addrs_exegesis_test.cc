@@ -133,5 +133,32 @@ TEST_F(FindAccessedAddrsExegesisTest, ExegesisMultipleSameAddressError) {
   ASSERT_FALSE(static_cast<bool>(AddrsOrErr));
 }
 
+TEST_F(FindAccessedAddrsExegesisTest, ExegesisMultipleBlocks) {
+  // Annotate several blocks with the same annotator, to check that no state
+  // is left over from the previous blocks.
+  auto Annotator = cantFail(ExegesisAnnotator::create(State));
+  for (int i = 0; i < 2; ++i) {
+    auto Code = Assemble(R"asm(
+      movq $0x10000, %rax
+      movq (%rax), %rax
+      movq $0x20000, %rbx
+      movq (%rbx), %rbx
+    )asm");
+    auto AddrsOrErr = Annotator->findAccessedAddrs(llvm::ArrayRef(
+        reinterpret_cast<const uint8_t*>(Code.data()), Code.size()));
+    ASSERT_TRUE(static_cast<bool>(AddrsOrErr));
+    EXPECT_EQ(AddrsOrErr->accessed_blocks,
+              (std::vector<uintptr_t>{0x10000, 0x20000}));
+
+    Code = Assemble(R"asm(
+      movq %r11, %r12
+    )asm");
+    AddrsOrErr = Annotator->findAccessedAddrs(llvm::ArrayRef(
+        reinterpret_cast<const uint8_t*>(Code.data()), Code.size()));
+    ASSERT_TRUE(static_cast<bool>(AddrsOrErr));
+    EXPECT_TRUE(AddrsOrErr->accessed_blocks.empty());
+  }
+}
+
 }  // namespace
 }  // namespace gematria
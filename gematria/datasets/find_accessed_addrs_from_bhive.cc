@@ -12,28 +12,155 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
 #include <fstream>
 #include <iostream>
+#include <limits>
 #include <memory>
 #include <optional>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <unistd.h>
 
 #include "absl/flags/flag.h"
 #include "absl/flags/parse.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "gematria/datasets/accessed_addrs_cache.h"
 #include "gematria/datasets/bhive_importer.h"
+#include "gematria/datasets/conversion_stats.h"
 #include "gematria/datasets/find_accessed_addrs.h"
+#include "gematria/datasets/input_shard.h"
 #include "gematria/llvm/canonicalizer.h"
 #include "gematria/llvm/llvm_architecture_support.h"
+#include "gematria/proto/basic_block.pb.h"
 #include "gematria/utils/string.h"
 
 ABSL_FLAG(std::string, bhive_csv, "", "Filename of the input BHive CSV file");
+ABSL_FLAG(int, shard_index, 0,
+          "The index of the shard of the input file processed by this run, see "
+          "--num_shards.");
+ABSL_FLAG(int, num_shards, 1,
+          "The number of shards of the input file. When greater than one, "
+          "processes only the lines that begin in the --shard_index-th of "
+          "--num_shards equal byte ranges of the input file, and adds the "
+          "shard suffix to --failing_blocks_csv. The shards together process "
+          "every block exactly once. Each shard should use its own "
+          "--annotation_cache and --stats_json.");
+ABSL_FLAG(std::string, shard_manifest, "",
+          "Filename of a JSON file to which a manifest of the shard, its "
+          "output files and its stats is written at the end of the run.");
 ABSL_FLAG(bool, failures_only, false,
           "Only produce output for blocks which FindAccessedAddrs fails on");
 ABSL_FLAG(bool, quiet, false, "Omit all output except for the final summary");
 ABSL_FLAG(std::string, failing_blocks_csv, "",
           "Filename of an output CSV file to which any failing blocks are "
           "written. This can be used as an input for subsequent runs.");
+ABSL_FLAG(unsigned, num_threads, 1,
+          "The number of threads that call FindAccessedAddrs. The output does "
+          "not depend on the number of threads.");
+ABSL_FLAG(std::string, annotation_cache, "",
+          "Filename of a cache of FindAccessedAddrs results. When set, blocks "
+          "found in the cache are not processed again, and the results for new "
+          "blocks are added to the cache at the end of the run. The cache can "
+          "be shared with convert_bhive_to_llvm_exegesis_input when it uses "
+          "the fast annotator.");
+ABSL_FLAG(unsigned, accessed_block_size, 0,
+          "The size of the blocks of memory mapped for each accessed address, "
+          "in bytes. Must be a multiple of the page size; zero uses the page "
+          "size.");
+ABSL_FLAG(unsigned, report_progress_every, std::numeric_limits<unsigned>::max(),
+          "The number of blocks after which to report progress.");
+ABSL_FLAG(std::string, stats_json, "",
+          "Filename of a JSON file to which a summary of the timers and "
+          "counters of the run is written at the end of the run.");
+
+// The number of lines processed by each thread before the results are printed.
+constexpr int kLinesPerThreadPerWindow = 256;
+
+// Calls FindAccessedAddrs() on the blocks in the first `num_lines` lines of
+// `lines`, using `num_threads` threads. Stores the result for `lines[i]` in
+// `results[i]`. Lines that are not valid CSV lines with a hex string in the
+// first column get no result; they are reported when printing the results.
+// When `cache` is not null, uses the cached results and adds the new ones to
+// the cache. Adds the time and the failures of the calls to `stats`. The blocks
+// are disassembled with `canonicalizer` to find their address registers.
+void FindAccessedAddrsInLines(
+    const std::vector<std::string>& lines, int num_lines, int num_threads,
+    const gematria::Canonicalizer* canonicalizer,
+    gematria::AccessedAddrsCache* cache, gematria::ConversionStats& stats,
+    std::vector<std::optional<absl::StatusOr<gematria::AccessedAddrs>>>&
+        results) {
+  std::atomic<int> next_line = 0;
+  const auto process_lines = [&]() {
+    // The importer is not thread-safe, so each thread has its own.
+    gematria::BHiveImporter bhive_importer(canonicalizer);
+    for (int i = next_line++; i < num_lines; i = next_line++) {
+      results[i].reset();
+      std::optional<std::vector<uint8_t>> bytes_or;
+      {
+        gematria::ScopedStageTimer timer(stats,
+                                         gematria::ConversionStage::kParseHex);
+        auto comma_index = lines[i].find(',');
+        if (comma_index == std::string::npos) continue;
+        bytes_or = gematria::ParseHexString(
+            std::string_view(lines[i]).substr(0, comma_index));
+        if (!bytes_or.has_value()) continue;
+      }
+      if (cache != nullptr) {
+        if (auto cached_addrs = cache->Lookup(*bytes_or)) {
+          stats.AddCacheHit();
+          results[i] = *std::move(cached_addrs);
+          continue;
+        }
+      }
+      std::vector<gematria::InstructionAddressRegisters> address_registers;
+      {
+        gematria::ScopedStageTimer timer(
+            stats, gematria::ConversionStage::kDisassemble);
+        const absl::StatusOr<gematria::BasicBlockProto> proto =
+            bhive_importer.BasicBlockProtoFromMachineCode(*bytes_or);
+        // Blocks that can't be disassembled are still annotated, but without
+        // the address registers.
+        if (proto.ok()) {
+          address_registers = gematria::GetInstructionAddressRegisters(*proto);
+        }
+      }
+      gematria::ScopedStageTimer timer(stats,
+                                       gematria::ConversionStage::kAnnotate);
+      gematria::FindAccessedAddrsStats find_accessed_addrs_stats;
+      results[i] = gematria::FindAccessedAddrs(
+          *bytes_or,
+          {.address_registers = address_registers,
+           .block_size = absl::GetFlag(FLAGS_accessed_block_size)},
+          find_accessed_addrs_stats);
+      stats.AddFindAccessedAddrsStats(find_accessed_addrs_stats);
+      if (!results[i]->ok()) {
+        stats.AddFailure(gematria::ConversionStage::kAnnotate,
+                         results[i]->status());
+      }
+      // Errors are not cached, so that the blocks are retried in the next run.
+      if (cache != nullptr && results[i]->ok()) {
+        cache->Insert(*bytes_or, **results[i]);
+      }
+    }
+  };
+
+  num_threads = std::min(num_threads, num_lines);
+  std::vector<std::thread> threads;
+  for (int thread = 1; thread < num_threads; ++thread) {
+    threads.emplace_back(process_lines);
+  }
+  if (num_threads > 0) process_lines();
+  for (std::thread& thread : threads) thread.join();
+}
 
 int main(int argc, char* argv[]) {
   absl::ParseCommandLine(argc, argv);
@@ -44,6 +171,26 @@ int main(int argc, char* argv[]) {
     return 1;
   }
 
+  const int shard_index = absl::GetFlag(FLAGS_shard_index);
+  const int num_shards = absl::GetFlag(FLAGS_num_shards);
+  if (absl::Status status = gematria::ValidateShard(shard_index, num_shards);
+      !status.ok()) {
+    std::cerr << "Error: " << status.message() << "\n";
+    return 1;
+  }
+
+  const unsigned num_threads = absl::GetFlag(FLAGS_num_threads);
+  if (num_threads == 0) {
+    std::cerr << "Error: --num_threads must be positive\n";
+    return 1;
+  }
+
+  if (absl::GetFlag(FLAGS_accessed_block_size) % getpagesize() != 0) {
+    std::cerr << "Error: --accessed_block_size must be a multiple of the page "
+                 "size\n";
+    return 1;
+  }
+
   const bool print_failures = !absl::GetFlag(FLAGS_quiet);
   const bool print_successes =
       !absl::GetFlag(FLAGS_failures_only) && !absl::GetFlag(FLAGS_quiet);
@@ -53,70 +200,173 @@ int main(int argc, char* argv[]) {
   gematria::X86Canonicalizer canonicalizer(&llvm_support->target_machine());
   gematria::BHiveImporter bhive_importer(&canonicalizer);
 
+  std::string failing_blocks_csv = absl::GetFlag(FLAGS_failing_blocks_csv);
   std::optional<std::ofstream> failing_blocks_csv_file;
-  if (!absl::GetFlag(FLAGS_failing_blocks_csv).empty()) {
-    failing_blocks_csv_file =
-        std::ofstream(absl::GetFlag(FLAGS_failing_blocks_csv));
+  if (!failing_blocks_csv.empty()) {
+    failing_blocks_csv =
+        gematria::ShardFileName(failing_blocks_csv, shard_index, num_shards);
+    failing_blocks_csv_file = std::ofstream(failing_blocks_csv);
   }
 
-  std::ifstream bhive_csv_file(bhive_filename);
+  const std::string annotation_cache_path =
+      absl::GetFlag(FLAGS_annotation_cache);
+  std::unique_ptr<gematria::AccessedAddrsCache> cache;
+  if (!annotation_cache_path.empty()) {
+    // Use the same annotator identifier as convert_bhive_to_llvm_exegesis_input
+    // for its fast annotator.
+    std::string annotator_id =
+        absl::StrCat("fast-", gematria::kFindAccessedAddrsVersion);
+    const unsigned block_size = absl::GetFlag(FLAGS_accessed_block_size);
+    if (block_size != 0 &&
+        block_size != static_cast<unsigned>(getpagesize())) {
+      absl::StrAppend(&annotator_id, "-", block_size);
+    }
+    cache = std::make_unique<gematria::AccessedAddrsCache>(annotator_id);
+    if (absl::Status status = cache->LoadFromFile(annotation_cache_path);
+        !status.ok()) {
+      std::cerr << "Failed to load the annotation cache: " << status << "\n";
+      return 1;
+    }
+  }
+
+  absl::StatusOr<std::unique_ptr<gematria::ShardedLineReader>> bhive_csv_file =
+      gematria::ShardedLineReader::Open(bhive_filename, shard_index,
+                                        num_shards);
+  if (!bhive_csv_file.ok()) {
+    std::cerr << "Failed to open the input file: " << bhive_csv_file.status()
+              << "\n";
+    return 1;
+  }
   int successful_calls = 0;
   int total_calls = 0;
-  for (std::string line; std::getline(bhive_csv_file, line);) {
-    auto comma_index = line.find(',');
-    if (comma_index == std::string::npos) {
-      std::cerr << "Invalid CSV file: no comma in line '" << line << "'\n";
-      return 2;
-    }
+  const unsigned report_progress_every =
+      absl::GetFlag(FLAGS_report_progress_every);
+  gematria::ConversionStats stats;
 
-    std::string_view hex = std::string_view(line).substr(0, comma_index);
-    auto bytes_or = gematria::ParseHexString(hex);
-    if (!bytes_or.has_value()) {
-      std::cerr << "could not parse: " << hex << "\n";
-      return 3;
+  // The lines are read and processed in windows; the results are then printed
+  // in the order of the input file.
+  const int window_size = num_threads * kLinesPerThreadPerWindow;
+  std::vector<std::string> lines(window_size);
+  std::vector<std::optional<absl::StatusOr<gematria::AccessedAddrs>>> results(
+      window_size);
+  while (true) {
+    int num_lines = 0;
+    while (num_lines < window_size &&
+           (*bhive_csv_file)->ReadLine(lines[num_lines])) {
+      ++num_lines;
     }
+    if (num_lines == 0) break;
+    FindAccessedAddrsInLines(lines, num_lines, num_threads, &canonicalizer,
+                             cache.get(), stats, results);
 
-    const auto& bytes = bytes_or.value();
-    auto addrs_or = gematria::FindAccessedAddrs(bytes);
-    if (addrs_or.ok()) {
-      successful_calls++;
+    for (int i = 0; i < num_lines; ++i) {
+      const std::string& line = lines[i];
+      auto comma_index = line.find(',');
+      if (comma_index == std::string::npos) {
+        std::cerr << "Invalid CSV file: no comma in line '" << line << "'\n";
+        return 2;
+      }
+
+      std::string_view hex = std::string_view(line).substr(0, comma_index);
+      auto bytes_or = gematria::ParseHexString(hex);
+      if (!bytes_or.has_value()) {
+        std::cerr << "could not parse: " << hex << "\n";
+        return 3;
+      }
 
-      if (print_successes) {
-        auto addrs = addrs_or.value();
-        std::cout << "Successfully found addresses for block '" << hex << "'"
-                  << ". When mapped at 0x" << std::hex << addrs.code_location
-                  << ", block accesses addresses in " << std::dec
-                  << addrs.accessed_blocks.size() << " chunk(s) of size 0x"
-                  << std::hex << addrs.block_size << std::dec << ":";
+      const auto& bytes = bytes_or.value();
+      const auto& addrs_or = *results[i];
+      if (addrs_or.ok()) {
+        successful_calls++;
 
-        for (const auto& addr : addrs.accessed_blocks) {
-          std::cout << " 0x" << addr;
+        if (print_successes) {
+          const auto& addrs = addrs_or.value();
+          std::cout << "Successfully found addresses for block '" << hex << "'"
+                    << ". When mapped at 0x" << std::hex << addrs.code_location
+                    << ", block accesses addresses in " << std::dec
+                    << addrs.accessed_blocks.size() << " chunk(s) of size 0x"
+                    << std::hex << addrs.block_size << std::dec << ":";
 
-          if (&addr != &addrs.accessed_blocks.back()) std::cout << ",";
+          for (const auto& addr : addrs.accessed_blocks) {
+            std::cout << " 0x" << addr;
+
+            if (&addr != &addrs.accessed_blocks.back()) std::cout << ",";
+          }
+          std::cout << "\n";
         }
-        std::cout << "\n";
-      }
-    } else {
-      if (failing_blocks_csv_file.has_value()) {
-        *failing_blocks_csv_file << line << "\n";
-      }
-      if (print_failures) {
-        std::cerr << "Failed to find addresses for block '" << hex
-                  << "': " << addrs_or.status() << "\n";
-        auto proto = bhive_importer.BasicBlockProtoFromMachineCode(bytes);
-        if (proto.ok()) {
-          std::cerr << "Block disassembly:\n";
-          for (const auto& instr : proto->machine_instructions()) {
-            std::cerr << "\t" << instr.assembly() << "\n";
+      } else {
+        if (failing_blocks_csv_file.has_value()) {
+          *failing_blocks_csv_file << line << "\n";
+        }
+        if (print_failures) {
+          std::cerr << "Failed to find addresses for block '" << hex
+                    << "': " << addrs_or.status() << "\n";
+          auto proto = bhive_importer.BasicBlockProtoFromMachineCode(bytes);
+          if (proto.ok()) {
+            std::cerr << "Block disassembly:\n";
+            for (const auto& instr : proto->machine_instructions()) {
+              std::cerr << "\t" << instr.assembly() << "\n";
+            }
           }
         }
       }
+
+      stats.AddBlock();
+      total_calls++;
+      if (total_calls % report_progress_every == 0) {
+        std::cerr << "Processed " << total_calls
+                  << " blocks: " << stats.FormatProgress() << "\n";
+      }
     }
+  }
 
-    total_calls++;
+  if (absl::Status status = (*bhive_csv_file)->status(); !status.ok()) {
+    std::cerr << status << "\n";
+    return 2;
   }
 
   std::cout << "Called FindAccessedAddrs successfully on " << std::dec
             << successful_calls << " / " << total_calls << " blocks\n";
+
+  const std::string stats_json = absl::GetFlag(FLAGS_stats_json);
+  if (!stats_json.empty()) {
+    std::ofstream stats_file(stats_json);
+    stats_file << stats.FormatJson() << "\n";
+    stats_file.close();
+    if (!stats_file) {
+      std::cerr << "Failed to write the stats file: " << stats_json << "\n";
+      return 4;
+    }
+  }
+
+  const std::string shard_manifest = absl::GetFlag(FLAGS_shard_manifest);
+  if (!shard_manifest.empty()) {
+    gematria::ShardManifest manifest;
+    manifest.tool = "find_accessed_addrs_from_bhive";
+    manifest.input_path = bhive_filename;
+    manifest.shard_index = shard_index;
+    manifest.num_shards = num_shards;
+    manifest.range = (*bhive_csv_file)->range();
+    manifest.num_lines = (*bhive_csv_file)->num_lines();
+    manifest.num_blocks = total_calls;
+    if (failing_blocks_csv_file.has_value()) {
+      manifest.output_files.push_back(failing_blocks_csv);
+    }
+    manifest.stats_json = stats.FormatJson();
+    if (absl::Status status =
+            gematria::WriteShardManifest(shard_manifest, manifest);
+        !status.ok()) {
+      std::cerr << "Failed to write the shard manifest: " << status << "\n";
+      return 4;
+    }
+  }
+
+  if (cache != nullptr) {
+    if (absl::Status status = cache->SaveToFile(annotation_cache_path);
+        !status.ok()) {
+      std::cerr << "Failed to save the annotation cache: " << status << "\n";
+      return 4;
+    }
+  }
   return 0;
 }
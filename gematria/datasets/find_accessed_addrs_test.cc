@@ -19,6 +19,7 @@
 #include <memory>
 #include <string>
 #include <string_view>
+#include <vector>
 
 #include "absl/log/check.h"
 #include "absl/memory/memory.h"
@@ -29,7 +30,9 @@
 #include "absl/types/span.h"
 #include "gematria/llvm/asm_parser.h"
 #include "gematria/llvm/llvm_architecture_support.h"
+#include "gematria/proto/basic_block.pb.h"
 #include "gematria/testing/matchers.h"
+#include "gematria/testing/parse_proto.h"
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 #include "llvm/ADT/SmallVector.h"
@@ -45,6 +48,7 @@
 namespace gematria {
 namespace {
 
+using testing::AllOf;
 using testing::ElementsAre;
 using testing::Field;
 using testing::IsEmpty;
@@ -98,11 +102,13 @@ class FindAccessedAddrsTest : public testing::Test {
   }
 
   absl::StatusOr<AccessedAddrs> FindAccessedAddrsAsm(
-      std::string_view textual_assembly) {
+      std::string_view textual_assembly,
+      const FindAccessedAddrsOptions& options = {}) {
     auto code = Assemble(textual_assembly);
     auto span = absl::MakeConstSpan(
         reinterpret_cast<const uint8_t*>(code.data()), code.size());
-    return FindAccessedAddrs(span);
+    FindAccessedAddrsStats stats;
+    return FindAccessedAddrs(span, options, stats);
   }
 };
 
@@ -194,5 +200,133 @@ TEST_F(FindAccessedAddrsTest, DivideByPointee) {
                                  ElementsAre(0x15000))));
 }
 
+TEST_F(FindAccessedAddrsTest, ManyPagesInOneBlock) {
+  EXPECT_THAT(FindAccessedAddrsAsm(R"asm(
+    mov [0x10000], eax
+    mov [0x20000], eax
+    mov rbx, [0x30000]
+    mov [rbx], eax
+    mov [0x40000], eax
+    mov [0x50000], eax
+    mov [0x60000], eax
+    mov [0x70000], eax
+  )asm"),
+              IsOkAndHolds(Field(&AccessedAddrs::accessed_blocks,
+                                 ElementsAre(0x10000, 0x20000, 0x30000,
+                                             0x800000000, 0x40000, 0x50000,
+                                             0x60000, 0x70000))));
+}
+
+TEST_F(FindAccessedAddrsTest, RecoversAfterIllegalInstruction) {
+  // The illegal instruction kills the fork server; the next call must start a
+  // new one and return correct results.
+  EXPECT_FALSE(FindAccessedAddrsAsm("ud2").ok());
+  EXPECT_THAT(FindAccessedAddrsAsm("mov [0x10000], eax"),
+              IsOkAndHolds(Field(&AccessedAddrs::accessed_blocks,
+                                 ElementsAre(0x10000))));
+}
+
+TEST_F(FindAccessedAddrsTest, Stats) {
+  const std::string code = Assemble("mov [0x10000], eax");
+  const auto span = absl::MakeConstSpan(
+      reinterpret_cast<const uint8_t*>(code.data()), code.size());
+  // The first call starts the fork server of this thread when there is none.
+  ASSERT_OK(FindAccessedAddrs(span));
+
+  FindAccessedAddrsStats stats;
+  ASSERT_OK(FindAccessedAddrs(span, FindAccessedAddrsOptions(), stats));
+  EXPECT_EQ(stats.num_runs, 1);
+  EXPECT_EQ(stats.num_retries, 0);
+  EXPECT_EQ(stats.num_forks, 0);
+}
+
+TEST_F(FindAccessedAddrsTest, GuidedRetryChangesOnlyAddressRegisters) {
+  // rdi - 0x20000 can't be mapped with the initial value of rdi.
+  const std::string first = Assemble("mov [0x10000], eax");
+  const std::string second = Assemble("mov [rdi - 0x20000], eax");
+  const std::string code = first + second;
+  const InstructionAddressRegisters address_registers[] = {
+      {.offset = 0, .size = first.size(), .registers = 0},
+      {.offset = first.size(),
+       .size = second.size(),
+       .registers = X64RegisterMaskFromName("RDI")}};
+  FindAccessedAddrsStats stats;
+  const absl::StatusOr<AccessedAddrs> addrs = FindAccessedAddrs(
+      absl::MakeConstSpan(reinterpret_cast<const uint8_t*>(code.data()),
+                          code.size()),
+      {.address_registers = address_registers}, stats);
+  ASSERT_OK(addrs);
+  EXPECT_GT(stats.num_retries, 0);
+  EXPECT_EQ(addrs->initial_regs.rax, 0x15000);
+  EXPECT_NE(addrs->initial_regs.rdi, 0x15000);
+  EXPECT_THAT(addrs->accessed_blocks,
+              ElementsAre(0x10000, AlignDown(addrs->initial_regs.rdi - 0x20000,
+                                             addrs->block_size)));
+}
+
+TEST_F(FindAccessedAddrsTest, LargeBlockSize) {
+  EXPECT_THAT(FindAccessedAddrsAsm(R"asm(
+    mov [0x10000], eax
+    mov [0x11000], eax
+    mov [0x1f000], eax
+    mov [0x20000], eax
+  )asm",
+                                   {.block_size = 0x10000}),
+              IsOkAndHolds(AllOf(Field(&AccessedAddrs::block_size, 0x10000),
+                                 Field(&AccessedAddrs::accessed_blocks,
+                                       ElementsAre(0x10000, 0x20000)))));
+}
+
+TEST_F(FindAccessedAddrsTest, BlockSizeAboveInitialRegisterValue) {
+  // The first 2 MiB block can't be mapped, so the registers start in the
+  // second one.
+  EXPECT_THAT(FindAccessedAddrsAsm("mov [rax], eax", {.block_size = 0x200000}),
+              IsOkAndHolds(Field(&AccessedAddrs::accessed_blocks,
+                                 ElementsAre(0x200000))));
+}
+
+TEST_F(FindAccessedAddrsTest, InvalidBlockSize) {
+  EXPECT_THAT(FindAccessedAddrsAsm("mov eax, ebx", {.block_size = 1000}),
+              StatusIs(absl::StatusCode::kFailedPrecondition));
+}
+
+TEST(X64RegisterMaskFromNameTest, Registers) {
+  EXPECT_EQ(X64RegisterMaskFromName("RAX"), 1);
+  EXPECT_EQ(X64RegisterMaskFromName("AH"), 1);
+  EXPECT_EQ(X64RegisterMaskFromName("SPL"), 1 << 6);
+  EXPECT_EQ(X64RegisterMaskFromName("R15B"), 1 << 15);
+  EXPECT_EQ(X64RegisterMaskFromName("RIP"), 0);
+  EXPECT_EQ(X64RegisterMaskFromName("XMM0"), 0);
+  EXPECT_EQ(X64RegisterMaskFromName(""), 0);
+}
+
+TEST(GetInstructionAddressRegistersTest, AddressOperands) {
+  const BasicBlockProto basic_block = ParseTextProto(R"pb(
+    machine_instructions { machine_code: "\x48\x8b\x04\x4b" }
+    machine_instructions { machine_code: "\x89\xd8" }
+    canonicalized_instructions {
+      mnemonic: "MOV"
+      output_operands { register_name: "RAX" }
+      input_operands { memory { alias_group_id: 1 } }
+      input_operands {
+        address { base_register: "RBX" index_register: "RCX" scaling: 2 }
+      }
+    }
+    canonicalized_instructions {
+      mnemonic: "MOV"
+      output_operands { register_name: "EAX" }
+      input_operands { register_name: "EBX" }
+    })pb");
+  const std::vector<InstructionAddressRegisters> address_registers =
+      GetInstructionAddressRegisters(basic_block);
+  ASSERT_EQ(address_registers.size(), 2);
+  EXPECT_EQ(address_registers[0].offset, 0);
+  EXPECT_EQ(address_registers[0].size, 4);
+  EXPECT_EQ(address_registers[0].registers, 0b110);
+  EXPECT_EQ(address_registers[1].offset, 4);
+  EXPECT_EQ(address_registers[1].size, 2);
+  EXPECT_EQ(address_registers[1].registers, 0);
+}
+
 }  // namespace
 }  // namespace gematria
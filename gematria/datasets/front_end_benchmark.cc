@@ -0,0 +1,262 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Benchmarks of the front-end that converts machine code to the inputs of the
+// models: disassembly, canonicalization, conversion to and from protos, and
+// building of the basic block graphs. All benchmarks run over the sample of
+// BHive blocks in gematria/testing/testdata/bhive_sample_machine_code.txt and
+// report the throughput in instructions per second and the number of memory
+// allocations per processed instruction.
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <new>
+#include <optional>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "absl/log/check.h"
+#include "benchmark/benchmark.h"
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/basic_block/basic_block_protos.h"
+#include "gematria/granite/graph_builder.h"
+#include "gematria/llvm/canonicalizer.h"
+#include "gematria/llvm/disassembler.h"
+#include "gematria/llvm/llvm_architecture_support.h"
+#include "gematria/model/oov_token_behavior.h"
+#include "gematria/proto/basic_block.pb.h"
+#include "gematria/utils/string.h"
+#include "llvm/MC/MCInst.h"
+#include "llvm/MC/MCInstPrinter.h"
+#include "llvm/Support/Error.h"
+#include "tools/cpp/runfiles/runfiles.h"
+
+namespace gematria {
+namespace {
+
+using ::bazel::tools::cpp::runfiles::Runfiles;
+
+constexpr std::string_view kSampleResourcePath =
+    "com_google_gematria/gematria/testing/testdata/"
+    "bhive_sample_machine_code.txt";
+
+// The number of calls of the global operator new since the start of the
+// program.
+std::atomic<int64_t> num_allocations = 0;
+
+// The sample of basic blocks in all the forms used by the benchmarks. The
+// sample is loaded and converted once and shared by all benchmarks.
+struct Sample {
+  std::shared_ptr<const LlvmArchitectureSupport> llvm_support;
+  std::unique_ptr<X86Canonicalizer> canonicalizer;
+
+  std::vector<std::vector<uint8_t>> machine_codes;
+  std::vector<std::vector<llvm::MCInst>> mc_insts;
+  std::vector<BasicBlock> basic_blocks;
+  std::vector<BasicBlockProto> protos;
+  // All tokens that appear in `basic_blocks`, used as the vocabulary of the
+  // graph builder.
+  std::vector<std::string> tokens;
+
+  int64_t num_instructions = 0;
+};
+
+const Sample& GetSample() {
+  static const Sample* const sample = []() {
+    auto sample = std::make_unique<Sample>();
+    sample->llvm_support = LlvmArchitectureSupport::SharedX86_64();
+    sample->canonicalizer = std::make_unique<X86Canonicalizer>(
+        &sample->llvm_support->target_machine());
+
+    std::string error;
+    const std::unique_ptr<Runfiles> runfiles(Runfiles::CreateForTest(&error));
+    CHECK(runfiles != nullptr) << error;
+    std::ifstream input(runfiles->Rlocation(std::string(kSampleResourcePath)));
+    CHECK(input.is_open()) << "Could not open " << kSampleResourcePath;
+    std::string line;
+    while (std::getline(input, line)) {
+      if (line.empty() || line[0] == '#') continue;
+      std::optional<std::vector<uint8_t>> machine_code = ParseHexString(line);
+      CHECK(machine_code.has_value()) << "Invalid hex string: " << line;
+      sample->machine_codes.push_back(*std::move(machine_code));
+    }
+    CHECK(!sample->machine_codes.empty());
+
+    std::set<std::string> tokens = {
+        std::string(kImmediateToken), std::string(kAddressToken),
+        std::string(kMemoryToken)};
+    for (const std::vector<uint8_t>& machine_code : sample->machine_codes) {
+      llvm::Expected<std::vector<llvm::MCInst>> mc_insts =
+          DisassembleAllMCInsts(sample->llvm_support->mc_disassembler(),
+                                machine_code);
+      CHECK(static_cast<bool>(mc_insts))
+          << llvm::toString(mc_insts.takeError());
+      BasicBlock block = sample->canonicalizer->BasicBlockFromMCInst(*mc_insts);
+      BasicBlockProto proto;
+      for (const Instruction& instruction : block.instructions) {
+        *proto.add_canonicalized_instructions() =
+            ProtoFromInstruction(instruction);
+        for (std::string& token : instruction.AsTokenList()) {
+          tokens.insert(std::move(token));
+        }
+      }
+      sample->num_instructions += block.instructions.size();
+      sample->mc_insts.push_back(*std::move(mc_insts));
+      sample->basic_blocks.push_back(std::move(block));
+      sample->protos.push_back(std::move(proto));
+    }
+    sample->tokens.assign(tokens.begin(), tokens.end());
+    return sample.release();
+  }();
+  return *sample;
+}
+
+// Runs `process_sample` once per iteration of the benchmark, and reports the
+// number of processed instructions per second and the number of allocations
+// per instruction. `process_sample` must process all blocks of the sample.
+template <typename ProcessSample>
+void RunFrontEndBenchmark(benchmark::State& state,
+                          const ProcessSample& process_sample) {
+  const Sample& sample = GetSample();
+  const int64_t allocations_before = num_allocations.load();
+  for (auto _ : state) {
+    process_sample(sample);
+  }
+  const int64_t num_processed_instructions =
+      state.iterations() * sample.num_instructions;
+  state.SetItemsProcessed(num_processed_instructions);
+  state.counters["allocs_per_instruction"] = benchmark::Counter(
+      static_cast<double>(num_allocations.load() - allocations_before) /
+      num_processed_instructions);
+}
+
+void BM_DisassembleAllInstructions(benchmark::State& state) {
+  const LlvmArchitectureSupport& llvm_support = *GetSample().llvm_support;
+  const std::unique_ptr<llvm::MCInstPrinter> printer =
+      llvm_support.CreateMCInstPrinter(/*syntax_variant=*/1);
+  RunFrontEndBenchmark(state, [&](const Sample& sample) {
+    for (const std::vector<uint8_t>& machine_code : sample.machine_codes) {
+      auto instructions = DisassembleAllInstructions(
+          llvm_support.mc_disassembler(), llvm_support.mc_instr_info(),
+          llvm_support.mc_register_info(), llvm_support.mc_subtarget_info(),
+          *printer, /*base_address=*/0, machine_code);
+      CHECK(static_cast<bool>(instructions));
+      benchmark::DoNotOptimize(instructions);
+    }
+  });
+}
+
+BENCHMARK(BM_DisassembleAllInstructions);
+
+void BM_DisassembleAllMCInsts(benchmark::State& state) {
+  const LlvmArchitectureSupport& llvm_support = *GetSample().llvm_support;
+  RunFrontEndBenchmark(state, [&](const Sample& sample) {
+    for (const std::vector<uint8_t>& machine_code : sample.machine_codes) {
+      auto mc_insts =
+          DisassembleAllMCInsts(llvm_support.mc_disassembler(), machine_code);
+      CHECK(static_cast<bool>(mc_insts));
+      benchmark::DoNotOptimize(mc_insts);
+    }
+  });
+}
+
+BENCHMARK(BM_DisassembleAllMCInsts);
+
+void BM_BasicBlockFromMCInst(benchmark::State& state) {
+  RunFrontEndBenchmark(state, [](const Sample& sample) {
+    for (const std::vector<llvm::MCInst>& mc_insts : sample.mc_insts) {
+      BasicBlock block = sample.canonicalizer->BasicBlockFromMCInst(mc_insts);
+      benchmark::DoNotOptimize(block);
+    }
+  });
+}
+
+BENCHMARK(BM_BasicBlockFromMCInst);
+
+// Like BM_BasicBlockFromMCInst, but reuses one BasicBlock object for all blocks
+// as a streaming importer would.
+void BM_AssignBasicBlockFromMCInst(benchmark::State& state) {
+  BasicBlock block;
+  RunFrontEndBenchmark(state, [&block](const Sample& sample) {
+    for (const std::vector<llvm::MCInst>& mc_insts : sample.mc_insts) {
+      sample.canonicalizer->AssignBasicBlockFromMCInst(mc_insts, block);
+      benchmark::DoNotOptimize(block);
+    }
+  });
+}
+
+BENCHMARK(BM_AssignBasicBlockFromMCInst);
+
+void BM_ProtoFromInstruction(benchmark::State& state) {
+  RunFrontEndBenchmark(state, [](const Sample& sample) {
+    for (const BasicBlock& block : sample.basic_blocks) {
+      for (const Instruction& instruction : block.instructions) {
+        CanonicalizedInstructionProto proto = ProtoFromInstruction(instruction);
+        benchmark::DoNotOptimize(proto);
+      }
+    }
+  });
+}
+
+BENCHMARK(BM_ProtoFromInstruction);
+
+void BM_BasicBlockFromProto(benchmark::State& state) {
+  RunFrontEndBenchmark(state, [](const Sample& sample) {
+    for (const BasicBlockProto& proto : sample.protos) {
+      BasicBlock block = BasicBlockFromProto(proto);
+      benchmark::DoNotOptimize(block);
+    }
+  });
+}
+
+BENCHMARK(BM_BasicBlockFromProto);
+
+// Adds all blocks of the sample to a graph builder in each iteration. The graph
+// builder is reset between the iterations, so that its buffers are reused.
+void BM_AddBasicBlock(benchmark::State& state) {
+  const Sample& sample = GetSample();
+  BasicBlockGraphBuilder graph_builder(
+      sample.tokens, /*immediate_token=*/kImmediateToken,
+      /*fp_immediate_token=*/kImmediateToken,
+      /*address_token=*/kAddressToken, /*memory_token=*/kMemoryToken,
+      OutOfVocabularyTokenBehavior::ReturnError());
+  RunFrontEndBenchmark(state, [&graph_builder](const Sample& sample) {
+    graph_builder.Reset();
+    for (const BasicBlock& block : sample.basic_blocks) {
+      CHECK(graph_builder.AddBasicBlock(block));
+    }
+    benchmark::DoNotOptimize(graph_builder);
+  });
+}
+
+BENCHMARK(BM_AddBasicBlock);
+
+}  // namespace
+}  // namespace gematria
+
+// Counts all allocations with the global operator new, for the allocation
+// counters of the benchmarks. The default array, nothrow and sized versions of
+// operator new and operator delete forward to these two.
+void* operator new(std::size_t size) {
+  gematria::num_allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void* const ptr = std::malloc(size)) return ptr;
+  throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept { std::free(ptr); }
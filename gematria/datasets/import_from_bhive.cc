@@ -0,0 +1,212 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Creates a Gematria data set from a BHive data set. A native, multi-threaded
+// version of gematria/datasets/python/import_from_bhive.py that accepts the
+// same flags, and in addition can write sharded output.
+//
+// Usage:
+//   import_from_bhive \
+//       --gematria_input_csv=/tmp/bhive/skl.csv \
+//       --gematria_output_tfrecord=/tmp/bhive/skl.tfrecord \
+//       --gematria_throughput_source_name="bhive: skl" \
+//       --gematria_num_shards=16
+//
+// Large data sets can be imported on many machines at once: with
+// --gematria_num_input_shards=N, each of the N runs of the tool with a
+// different --gematria_input_shard_index reads only its own line-aligned byte
+// range of the input file, writes its own output files, and can describe them
+// in a manifest for gematria/datasets/python/merge_shard_manifests.py.
+
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "gematria/datasets/input_shard.h"
+#include "gematria/datasets/parallel_bhive_importer.h"
+#include "gematria/llvm/canonicalizer.h"
+#include "gematria/llvm/llvm_architecture_support.h"
+#include "gematria/utils/tracing.h"
+#include "llvm/Support/Error.h"
+
+ABSL_FLAG(std::string, gematria_input_csv, "",
+          "The name of the BHive CSV file to import.");
+ABSL_FLAG(std::string, gematria_output_tfrecord, "",
+          "The name of the TFRecord file to write the data to. With "
+          "--gematria_num_shards > 1, the prefix of the names of the shards.");
+ABSL_FLAG(std::string, gematria_throughput_source_name, "",
+          "The name of the throughput source used for the throughput data "
+          "from the CSV file.");
+ABSL_FLAG(double, gematria_throughput_scaling, 1.0,
+          "The scaling coefficient applied to the throughput values from the "
+          "CSV file.");
+ABSL_FLAG(std::string, gematria_llvm_triple, "x86_64",
+          "The LLVM triple used for disassembling the instructions in the data "
+          "set.");
+ABSL_FLAG(int, machine_code_hex_column_index, 0,
+          "The index of the the machine code hex column in the input CSV "
+          "file.");
+ABSL_FLAG(int, throughput_column_index, 1,
+          "The index of the throughput value column in the input CSV file.");
+ABSL_FLAG(int, gematria_num_shards, 1,
+          "The number of output TFRecord files. The blocks are distributed "
+          "among the shards in a round-robin fashion.");
+ABSL_FLAG(int, gematria_input_shard_index, 0,
+          "The index of the input shard imported by this run, see "
+          "--gematria_num_input_shards.");
+ABSL_FLAG(int, gematria_num_input_shards, 1,
+          "The number of input shards. When greater than one, imports only the "
+          "lines that begin in the --gematria_input_shard_index-th of "
+          "--gematria_num_input_shards equal byte ranges of the input file, "
+          "and adds the input shard suffix to --gematria_output_tfrecord. The "
+          "input shards together import every block exactly once.");
+ABSL_FLAG(std::string, gematria_shard_manifest, "",
+          "When not empty, writes a JSON manifest of the input shard and its "
+          "output files to this file.");
+ABSL_FLAG(int, gematria_num_threads, 0,
+          "The number of threads used to disassemble and canonicalize the "
+          "blocks. When not positive, uses one thread per hardware thread.");
+ABSL_FLAG(bool, gematria_report_skipped_blocks, true,
+          "Print the lines that could not be imported to stderr.");
+ABSL_FLAG(std::string, gematria_trace_file, "",
+          "When not empty, records the time spent in the hot paths of the "
+          "import and writes it to this file in the Chrome trace JSON format, "
+          "which can be loaded in Perfetto.");
+ABSL_FLAG(bool, gematria_print_trace_stats, false,
+          "Print the counters and the total time of the hot paths of the "
+          "import to stderr at the end of the import.");
+
+int main(int argc, char* argv[]) {
+  absl::ParseCommandLine(argc, argv);
+
+  gematria::ParallelBHiveImportOptions options;
+  options.input_csv_path = absl::GetFlag(FLAGS_gematria_input_csv);
+  options.output_tfrecord_path = absl::GetFlag(FLAGS_gematria_output_tfrecord);
+  options.source_name = absl::GetFlag(FLAGS_gematria_throughput_source_name);
+  if (options.input_csv_path.empty() || options.output_tfrecord_path.empty() ||
+      options.source_name.empty()) {
+    std::cerr << "Error: --gematria_input_csv, --gematria_output_tfrecord and "
+                 "--gematria_throughput_source_name are required\n";
+    return 1;
+  }
+  const int machine_code_hex_column_index =
+      absl::GetFlag(FLAGS_machine_code_hex_column_index);
+  const int throughput_column_index =
+      absl::GetFlag(FLAGS_throughput_column_index);
+  if (machine_code_hex_column_index < 0 || throughput_column_index < 0 ||
+      machine_code_hex_column_index == throughput_column_index) {
+    std::cerr << "Error: Expected machine code column and throughput column "
+                 "indices to be different and non-negative\n";
+    return 1;
+  }
+  options.machine_code_hex_column_index = machine_code_hex_column_index;
+  options.throughput_column_index = throughput_column_index;
+  options.throughput_scaling = absl::GetFlag(FLAGS_gematria_throughput_scaling);
+  options.num_shards = absl::GetFlag(FLAGS_gematria_num_shards);
+  options.input_shard_index = absl::GetFlag(FLAGS_gematria_input_shard_index);
+  options.num_input_shards = absl::GetFlag(FLAGS_gematria_num_input_shards);
+  if (const absl::Status status = gematria::ValidateShard(
+          options.input_shard_index, options.num_input_shards);
+      !status.ok()) {
+    std::cerr << "Error: " << status.message() << "\n";
+    return 1;
+  }
+  options.output_tfrecord_path =
+      gematria::ShardFileName(options.output_tfrecord_path,
+                              options.input_shard_index,
+                              options.num_input_shards);
+  options.num_threads = absl::GetFlag(FLAGS_gematria_num_threads);
+  if (absl::GetFlag(FLAGS_gematria_report_skipped_blocks)) {
+    options.skipped_line_callback = [](std::string_view line,
+                                       const absl::Status& status) {
+      std::cerr << "Could not process line \"" << line << "\": " << status
+                << "\n";
+    };
+  }
+  const std::string trace_file = absl::GetFlag(FLAGS_gematria_trace_file);
+  const bool print_trace_stats =
+      absl::GetFlag(FLAGS_gematria_print_trace_stats);
+  if (!trace_file.empty()) {
+    gematria::SetTracingMode(gematria::TracingMode::kEvents);
+  } else if (print_trace_stats) {
+    gematria::SetTracingMode(gematria::TracingMode::kStats);
+  }
+  options.progress_callback = [](int64_t num_processed_lines) {
+    std::cerr << "Processed " << num_processed_lines << " blocks.\n";
+  };
+
+  const std::string llvm_triple = absl::GetFlag(FLAGS_gematria_llvm_triple);
+  auto llvm_support =
+      gematria::LlvmArchitectureSupport::Shared(llvm_triple, "", "");
+  if (!llvm_support) {
+    std::cerr << "LLVM triple \"" << llvm_triple
+              << "\" is not known or supported: "
+              << llvm::toString(llvm_support.takeError()) << "\n";
+    return 1;
+  }
+  // TODO(ondrasej): Create the canonicalizer based on the LLVM triple. As of
+  // 2023-05, this is OK, because we support only x86-64 anyway.
+  const gematria::X86Canonicalizer canonicalizer(
+      &(*llvm_support)->target_machine());
+
+  const absl::StatusOr<gematria::ParallelBHiveImportStats> stats =
+      gematria::ImportBHiveCsvToTFRecord(canonicalizer, options);
+  if (!stats.ok()) {
+    std::cerr << "Import failed: " << stats.status() << "\n";
+    return 2;
+  }
+  const int64_t num_imported_blocks =
+      stats->num_input_blocks - stats->num_skipped_blocks;
+  std::cerr << "Imported " << num_imported_blocks << " blocks, skipped "
+            << stats->num_skipped_blocks << ".\n";
+  const std::string shard_manifest =
+      absl::GetFlag(FLAGS_gematria_shard_manifest);
+  if (!shard_manifest.empty()) {
+    gematria::ShardManifest manifest;
+    manifest.tool = "import_from_bhive";
+    manifest.input_path = options.input_csv_path;
+    manifest.shard_index = options.input_shard_index;
+    manifest.num_shards = options.num_input_shards;
+    manifest.range = stats->input_range;
+    manifest.num_lines = stats->num_input_blocks;
+    manifest.num_blocks = num_imported_blocks;
+    for (int shard = 0; shard < options.num_shards; ++shard) {
+      manifest.output_files.push_back(gematria::ShardFileName(
+          options.output_tfrecord_path, shard, options.num_shards));
+    }
+    if (const absl::Status status =
+            gematria::WriteShardManifest(shard_manifest, manifest);
+        !status.ok()) {
+      std::cerr << status << "\n";
+      return 2;
+    }
+  }
+  if (print_trace_stats) std::cerr << gematria::FormatTracingStats();
+  if (!trace_file.empty()) {
+    std::ofstream trace(trace_file);
+    trace << gematria::FormatChromeTraceJson();
+    if (!trace) {
+      std::cerr << "Could not write the trace to " << trace_file << "\n";
+      return 2;
+    }
+  }
+  return 0;
+}
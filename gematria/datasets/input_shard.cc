@@ -0,0 +1,195 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/datasets/input_shard.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_format.h"
+
+namespace gematria {
+namespace {
+
+// Returns `value` as a quoted JSON string.
+std::string JsonString(std::string_view value) {
+  std::string json = "\"";
+  for (const char c : value) {
+    switch (c) {
+      case '"':
+        json += "\\\"";
+        break;
+      case '\\':
+        json += "\\\\";
+        break;
+      case '\n':
+        json += "\\n";
+        break;
+      case '\t':
+        json += "\\t";
+        break;
+      default:
+        if (static_cast<unsigned char>(c) < 0x20) {
+          absl::StrAppendFormat(&json, "\\u%04x", c);
+        } else {
+          json += c;
+        }
+    }
+  }
+  json += "\"";
+  return json;
+}
+
+}  // namespace
+
+std::string ShardFileName(std::string_view path, int shard, int num_shards) {
+  if (num_shards == 1) return std::string(path);
+  return absl::StrFormat("%s-%05d-of-%05d", path, shard, num_shards);
+}
+
+absl::Status ValidateShard(int shard_index, int num_shards) {
+  if (num_shards < 1) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Invalid number of shards: ", num_shards));
+  }
+  if (shard_index < 0 || shard_index >= num_shards) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Invalid shard index: ", shard_index, " out of ", num_shards));
+  }
+  return absl::OkStatus();
+}
+
+InputShardRange ComputeInputShardRange(int64_t file_size, int shard_index,
+                                       int num_shards) {
+  // The products fit into 64 bits for any realistic file size and number of
+  // shards; computing the bounds this way spreads the remainder of the
+  // division among the shards.
+  return {.begin = file_size * shard_index / num_shards,
+          .end = file_size * (shard_index + 1) / num_shards};
+}
+
+absl::StatusOr<std::unique_ptr<ShardedLineReader>> ShardedLineReader::Open(
+    const std::string& path, int shard_index, int num_shards,
+    size_t buffer_size) {
+  if (absl::Status status = ValidateShard(shard_index, num_shards);
+      !status.ok()) {
+    return status;
+  }
+  std::ifstream size_probe(path, std::ios::binary | std::ios::ate);
+  if (!size_probe.is_open()) {
+    return absl::NotFoundError(absl::StrCat("Could not open ", path));
+  }
+  const int64_t file_size = size_probe.tellg();
+  if (file_size < 0) {
+    return absl::InternalError(
+        absl::StrCat("Could not find the size of ", path));
+  }
+  size_probe.close();
+
+  // The constructor is private, so std::make_unique can't be used.
+  std::unique_ptr<ShardedLineReader> reader(new ShardedLineReader(
+      path, ComputeInputShardRange(file_size, shard_index, num_shards),
+      buffer_size));
+  if (absl::Status status = reader->Init(); !status.ok()) return status;
+  return reader;
+}
+
+ShardedLineReader::ShardedLineReader(std::string path, InputShardRange range,
+                                     size_t buffer_size)
+    : path_(std::move(path)), range_(range), buffer_(buffer_size) {}
+
+absl::Status ShardedLineReader::Init() {
+  // The buffer must be set before the file is opened to take effect.
+  input_.rdbuf()->pubsetbuf(buffer_.data(), buffer_.size());
+  input_.open(path_, std::ios::binary);
+  if (!input_.is_open()) {
+    return absl::NotFoundError(absl::StrCat("Could not open ", path_));
+  }
+  position_ = range_.begin;
+  if (range_.begin == 0 || range_.begin >= range_.end) return absl::OkStatus();
+
+  // The first line of the shard is the first line that begins at or after
+  // `range_.begin`. It begins at `range_.begin` exactly when the previous byte
+  // is an end of line; otherwise, the line that contains `range_.begin` belongs
+  // to the previous shard and is skipped.
+  input_.seekg(range_.begin - 1);
+  char previous = '\0';
+  if (!input_.get(previous)) return status();
+  if (previous != '\n') {
+    std::string partial_line;
+    if (std::getline(input_, partial_line)) {
+      position_ += partial_line.size() + (input_.eof() ? 0 : 1);
+    }
+  }
+  return status();
+}
+
+bool ShardedLineReader::ReadLine(std::string& line) {
+  if (position_ >= range_.end) return false;
+  if (!std::getline(input_, line)) return false;
+  // std::getline() sets eofbit only when the last line of the file does not
+  // end with an end of line.
+  position_ += line.size() + (input_.eof() ? 0 : 1);
+  ++num_lines_;
+  return true;
+}
+
+absl::Status ShardedLineReader::status() const {
+  if (input_.bad()) {
+    return absl::InternalError(absl::StrCat("Could not read ", path_));
+  }
+  return absl::OkStatus();
+}
+
+std::string FormatShardManifestJson(const ShardManifest& manifest) {
+  std::string json = absl::StrFormat(
+      R"({"tool":%s,"input":%s,"shard_index":%d,"num_shards":%d,)"
+      R"("begin_offset":%d,"end_offset":%d,"num_lines":%d,"num_blocks":%d,)"
+      R"("output_files":[)",
+      JsonString(manifest.tool), JsonString(manifest.input_path),
+      manifest.shard_index, manifest.num_shards, manifest.range.begin,
+      manifest.range.end, manifest.num_lines, manifest.num_blocks);
+  for (size_t i = 0; i < manifest.output_files.size(); ++i) {
+    if (i > 0) json += ",";
+    json += JsonString(manifest.output_files[i]);
+  }
+  json += "]";
+  if (!manifest.stats_json.empty()) {
+    absl::StrAppend(&json, R"(,"stats":)", manifest.stats_json);
+  }
+  json += "}";
+  return json;
+}
+
+absl::Status WriteShardManifest(const std::string& path,
+                                const ShardManifest& manifest) {
+  std::ofstream output(path);
+  output << FormatShardManifestJson(manifest) << "\n";
+  output.close();
+  if (!output) {
+    return absl::InternalError(absl::StrCat("Could not write ", path));
+  }
+  return absl::OkStatus();
+}
+
+}  // namespace gematria
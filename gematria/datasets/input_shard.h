@@ -0,0 +1,135 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Contains utilities for processing a large input file in shards on many
+// machines without a pre-splitting pass: each shard is a range of bytes of the
+// input file aligned to line boundaries, and each shard describes its outputs
+// in a manifest that can be combined with the manifests of the other shards.
+
+#ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_DATASETS_INPUT_SHARD_H_
+#define THIRD_PARTY_GEMATRIA_GEMATRIA_DATASETS_INPUT_SHARD_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+
+namespace gematria {
+
+// Returns the name of the output file for shard `shard` out of `num_shards`.
+// Uses the common "{path}-{shard}-of-{num_shards}" naming scheme with five
+// digits per number. Returns `path` itself when `num_shards` is one.
+std::string ShardFileName(std::string_view path, int shard, int num_shards);
+
+// Returns an error when `shard_index` is not a valid index of a shard out of
+// `num_shards`.
+absl::Status ValidateShard(int shard_index, int num_shards);
+
+// The range of bytes of the input file that belongs to a shard, before the
+// alignment to line boundaries. Shard `i` out of `n` gets the bytes
+// [file_size * i / n, file_size * (i + 1) / n).
+struct InputShardRange {
+  int64_t begin = 0;
+  int64_t end = 0;
+};
+
+InputShardRange ComputeInputShardRange(int64_t file_size, int shard_index,
+                                       int num_shards);
+
+// Reads the lines of one shard of a text file. A shard owns all lines that
+// begin inside its byte range, so the shards of a file partition its lines
+// without gaps and overlaps, and each line is read by exactly one shard for any
+// number of shards. The lines are read in the order of the file.
+class ShardedLineReader {
+ public:
+  // The default size of the input buffer, in bytes.
+  static constexpr size_t kDefaultBufferSize = 1 << 20;
+
+  // Opens `path` for reading the lines of shard `shard_index` out of
+  // `num_shards`. Returns an error when the shard is not valid or when the
+  // file can't be opened.
+  static absl::StatusOr<std::unique_ptr<ShardedLineReader>> Open(
+      const std::string& path, int shard_index, int num_shards,
+      size_t buffer_size = kDefaultBufferSize);
+
+  ShardedLineReader(const ShardedLineReader&) = delete;
+  ShardedLineReader& operator=(const ShardedLineReader&) = delete;
+
+  // Reads the next line of the shard to `line`, without the end of line
+  // character. Returns false when there are no more lines in the shard or when
+  // reading fails; use status() to tell the two apart.
+  bool ReadLine(std::string& line);
+
+  // Returns an error when reading the file failed.
+  absl::Status status() const;
+
+  // The byte range of the shard before the alignment to line boundaries.
+  const InputShardRange& range() const { return range_; }
+  // The number of lines read so far.
+  int64_t num_lines() const { return num_lines_; }
+
+ private:
+  ShardedLineReader(std::string path, InputShardRange range,
+                    size_t buffer_size);
+
+  // Opens the file and moves to the first line of the shard.
+  absl::Status Init();
+
+  const std::string path_;
+  const InputShardRange range_;
+  std::vector<char> buffer_;
+  std::ifstream input_;
+  // The offset of the next line in the file.
+  int64_t position_ = 0;
+  int64_t num_lines_ = 0;
+};
+
+// Describes the outputs of one shard of a sharded run of a tool. The manifests
+// of all shards of a run are combined by
+// gematria/datasets/python/merge_shard_manifests.py.
+struct ShardManifest {
+  std::string tool;
+  std::string input_path;
+  int shard_index = 0;
+  int num_shards = 1;
+  InputShardRange range;
+  // The number of input lines read by the shard.
+  int64_t num_lines = 0;
+  // The number of blocks written to the outputs of the shard.
+  int64_t num_blocks = 0;
+  // The files written by the shard, in the order in which they were written.
+  std::vector<std::string> output_files;
+  // When not empty, a JSON object with the stats of the shard, e.g. the output
+  // of ConversionStats::FormatJson(). It is embedded in the manifest verbatim.
+  std::string stats_json;
+};
+
+// Returns the manifest as a single-line JSON object with the fields "tool",
+// "input", "shard_index", "num_shards", "begin_offset", "end_offset",
+// "num_lines", "num_blocks", "output_files" and, when present, "stats".
+std::string FormatShardManifestJson(const ShardManifest& manifest);
+
+// Writes the manifest in the JSON format to `path`.
+absl::Status WriteShardManifest(const std::string& path,
+                                const ShardManifest& manifest);
+
+}  // namespace gematria
+
+#endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_DATASETS_INPUT_SHARD_H_
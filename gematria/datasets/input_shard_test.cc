@@ -0,0 +1,209 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/datasets/input_shard.h"
+
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace gematria {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::IsEmpty;
+
+class InputShardTest : public ::testing::Test {
+ protected:
+  void SetUp() override { path_ = ::testing::TempDir() + "/input.txt"; }
+
+  void WriteInput(std::string_view contents) {
+    std::ofstream file(path_, std::ios::binary);
+    file << contents;
+  }
+
+  // Returns the lines of shard `shard_index` out of `num_shards` of the input
+  // file.
+  std::vector<std::string> ReadShard(int shard_index, int num_shards,
+                                     size_t buffer_size = 16) {
+    absl::StatusOr<std::unique_ptr<ShardedLineReader>> reader =
+        ShardedLineReader::Open(path_, shard_index, num_shards, buffer_size);
+    EXPECT_TRUE(reader.ok()) << reader.status();
+    if (!reader.ok()) return {};
+    std::vector<std::string> lines;
+    std::string line;
+    while ((*reader)->ReadLine(line)) lines.push_back(line);
+    EXPECT_TRUE((*reader)->status().ok()) << (*reader)->status();
+    EXPECT_EQ((*reader)->num_lines(), lines.size());
+    return lines;
+  }
+
+  // Returns the lines of all shards of the input file, in the order of the
+  // shards.
+  std::vector<std::string> ReadAllShards(int num_shards) {
+    std::vector<std::string> lines;
+    for (int shard = 0; shard < num_shards; ++shard) {
+      for (std::string& line : ReadShard(shard, num_shards)) {
+        lines.push_back(std::move(line));
+      }
+    }
+    return lines;
+  }
+
+  std::string path_;
+};
+
+TEST(ShardFileNameTest, Names) {
+  EXPECT_EQ(ShardFileName("/tmp/skl.tfrecord", 0, 1), "/tmp/skl.tfrecord");
+  EXPECT_EQ(ShardFileName("/tmp/skl.tfrecord", 3, 16),
+            "/tmp/skl.tfrecord-00003-of-00016");
+}
+
+TEST(ValidateShardTest, Shards) {
+  EXPECT_TRUE(ValidateShard(0, 1).ok());
+  EXPECT_TRUE(ValidateShard(15, 16).ok());
+  EXPECT_EQ(ValidateShard(0, 0).code(), absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(ValidateShard(-1, 4).code(), absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(ValidateShard(4, 4).code(), absl::StatusCode::kInvalidArgument);
+}
+
+TEST(ComputeInputShardRangeTest, Ranges) {
+  const InputShardRange first = ComputeInputShardRange(10, 0, 3);
+  EXPECT_EQ(first.begin, 0);
+  EXPECT_EQ(first.end, 3);
+  const InputShardRange second = ComputeInputShardRange(10, 1, 3);
+  EXPECT_EQ(second.begin, 3);
+  EXPECT_EQ(second.end, 6);
+  const InputShardRange last = ComputeInputShardRange(10, 2, 3);
+  EXPECT_EQ(last.begin, 6);
+  EXPECT_EQ(last.end, 10);
+}
+
+TEST_F(InputShardTest, SingleShard) {
+  WriteInput("first\nsecond\n\nfourth\n");
+  EXPECT_THAT(ReadShard(0, 1), ElementsAre("first", "second", "", "fourth"));
+}
+
+TEST_F(InputShardTest, ShardsPartitionLines) {
+  constexpr std::string_view kInput =
+      "4829d38b44246c8b54246848c1fb034829d04839c3,10\n"
+      "3b31,45.36\n"
+      "\n"
+      "4889de4889c24c89ff,91.31\n"
+      "418b4424084d8b3c2489442418,74.00\n"
+      "48895c2428,11.06\n";
+  const std::vector<std::string> expected = {
+      "4829d38b44246c8b54246848c1fb034829d04839c3,10",
+      "3b31,45.36",
+      "",
+      "4889de4889c24c89ff,91.31",
+      "418b4424084d8b3c2489442418,74.00",
+      "48895c2428,11.06"};
+  WriteInput(kInput);
+  // Includes numbers of shards for which the shard boundaries fall at the
+  // beginning, in the middle, and at the end of lines, and more shards than
+  // there are bytes in the file.
+  for (int num_shards = 1; num_shards <= kInput.size() + 3; ++num_shards) {
+    EXPECT_EQ(ReadAllShards(num_shards), expected)
+        << "num_shards = " << num_shards;
+  }
+}
+
+TEST_F(InputShardTest, NoFinalEndOfLine) {
+  WriteInput("first\nsecond\nthird");
+  for (int num_shards = 1; num_shards <= 20; ++num_shards) {
+    EXPECT_THAT(ReadAllShards(num_shards),
+                ElementsAre("first", "second", "third"))
+        << "num_shards = " << num_shards;
+  }
+}
+
+TEST_F(InputShardTest, LinesLongerThanBuffer) {
+  const std::string long_line(100, 'a');
+  // The lines begin at offsets 0, 101 and 202, and the second shard begins in
+  // the middle of the second line at offset 151.
+  WriteInput(long_line + "\n" + long_line + "\nb" + long_line + "\n");
+  EXPECT_THAT(ReadShard(0, 2, /*buffer_size=*/8),
+              ElementsAre(long_line, long_line));
+  EXPECT_THAT(ReadShard(1, 2, /*buffer_size=*/8),
+              ElementsAre("b" + long_line));
+}
+
+TEST_F(InputShardTest, EmptyFile) {
+  WriteInput("");
+  EXPECT_THAT(ReadShard(0, 1), IsEmpty());
+  EXPECT_THAT(ReadShard(1, 2), IsEmpty());
+}
+
+TEST_F(InputShardTest, InvalidShard) {
+  WriteInput("first\n");
+  EXPECT_EQ(ShardedLineReader::Open(path_, 2, 2).status().code(),
+            absl::StatusCode::kInvalidArgument);
+}
+
+TEST_F(InputShardTest, MissingFile) {
+  EXPECT_EQ(ShardedLineReader::Open(::testing::TempDir() + "/does_not_exist",
+                                    0, 1)
+                .status()
+                .code(),
+            absl::StatusCode::kNotFound);
+}
+
+TEST(ShardManifestTest, FormatJson) {
+  ShardManifest manifest;
+  manifest.tool = "import_from_bhive";
+  manifest.input_path = "/data/\"skl\".csv";
+  manifest.shard_index = 1;
+  manifest.num_shards = 4;
+  manifest.range = {.begin = 100, .end = 200};
+  manifest.num_lines = 3;
+  manifest.num_blocks = 2;
+  manifest.output_files = {"/out/a", "/out/b"};
+  EXPECT_EQ(FormatShardManifestJson(manifest),
+            R"({"tool":"import_from_bhive","input":"/data/\"skl\".csv",)"
+            R"("shard_index":1,"num_shards":4,"begin_offset":100,)"
+            R"("end_offset":200,"num_lines":3,"num_blocks":2,)"
+            R"("output_files":["/out/a","/out/b"]})");
+
+  manifest.output_files.clear();
+  manifest.stats_json = R"({"blocks":2})";
+  EXPECT_EQ(FormatShardManifestJson(manifest),
+            R"({"tool":"import_from_bhive","input":"/data/\"skl\".csv",)"
+            R"("shard_index":1,"num_shards":4,"begin_offset":100,)"
+            R"("end_offset":200,"num_lines":3,"num_blocks":2,)"
+            R"("output_files":[],"stats":{"blocks":2}})");
+}
+
+TEST(ShardManifestTest, Write) {
+  const std::string path = ::testing::TempDir() + "/manifest.json";
+  ShardManifest manifest;
+  manifest.tool = "tool";
+  ASSERT_TRUE(WriteShardManifest(path, manifest).ok());
+  std::ifstream file(path);
+  const std::string contents(std::istreambuf_iterator<char>(file), {});
+  EXPECT_EQ(contents, FormatShardManifestJson(manifest) + "\n");
+}
+
+}  // namespace
+}  // namespace gematria
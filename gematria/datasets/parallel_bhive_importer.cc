@@ -0,0 +1,170 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/datasets/parallel_bhive_importer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "gematria/datasets/bhive_importer.h"
+#include "gematria/datasets/input_shard.h"
+#include "gematria/io/tfrecord_writer.h"
+#include "gematria/llvm/canonicalizer.h"
+#include "gematria/proto/throughput.pb.h"
+
+namespace gematria {
+namespace {
+
+// The size of the buffer used for reading the input file.
+constexpr int kInputBufferSize = 1 << 20;
+
+// Parses `lines` into `records` using one thread per importer. The record at
+// index `i` contains either the serialized proto for `lines[i]`, or the error
+// for this line. The lines are assigned to the threads dynamically in chunks of
+// `chunk_size` lines.
+void ParseLines(const std::vector<std::string>& lines, int num_lines,
+                int chunk_size, const ParallelBHiveImportOptions& options,
+                std::vector<std::unique_ptr<BHiveImporter>>& importers,
+                std::vector<absl::StatusOr<std::string>>& records) {
+  std::atomic<int> next_chunk_begin = 0;
+  const auto parse_chunks = [&](int thread) {
+    BHiveImporter& importer = *importers[thread];
+    while (true) {
+      const int chunk_begin = next_chunk_begin.fetch_add(chunk_size);
+      if (chunk_begin >= num_lines) return;
+      const int chunk_end = std::min(chunk_begin + chunk_size, num_lines);
+      for (int i = chunk_begin; i < chunk_end; ++i) {
+        absl::StatusOr<BasicBlockWithThroughputProto> proto =
+            importer.ParseBHiveCsvLine(
+                options.source_name, lines[i],
+                options.machine_code_hex_column_index,
+                options.throughput_column_index, options.throughput_scaling);
+        if (proto.ok()) {
+          records[i] = proto->SerializeAsString();
+        } else {
+          records[i] = std::move(proto).status();
+        }
+      }
+    }
+  };
+
+  const int num_chunks = (num_lines + chunk_size - 1) / chunk_size;
+  const int num_threads = std::min<int>(importers.size(), num_chunks);
+  std::vector<std::thread> threads;
+  for (int thread = 1; thread < num_threads; ++thread) {
+    threads.emplace_back(parse_chunks, thread);
+  }
+  if (num_threads > 0) parse_chunks(0);
+  for (std::thread& thread : threads) thread.join();
+}
+
+}  // namespace
+
+absl::StatusOr<ParallelBHiveImportStats> ImportBHiveCsvToTFRecord(
+    const Canonicalizer& canonicalizer,
+    const ParallelBHiveImportOptions& options) {
+  if (options.num_shards < 1) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Invalid number of shards: ", options.num_shards));
+  }
+  if (options.chunk_size < 1 || options.chunks_per_thread < 1) {
+    return absl::InvalidArgumentError(
+        "The chunk size and the number of chunks per thread must be positive");
+  }
+
+  absl::StatusOr<std::unique_ptr<ShardedLineReader>> input_file =
+      ShardedLineReader::Open(options.input_csv_path, options.input_shard_index,
+                              options.num_input_shards, kInputBufferSize);
+  if (!input_file.ok()) return input_file.status();
+
+  std::vector<std::unique_ptr<TFRecordWriter>> writers;
+  for (int shard = 0; shard < options.num_shards; ++shard) {
+    absl::StatusOr<std::unique_ptr<TFRecordWriter>> writer =
+        TFRecordWriter::Open(ShardFileName(options.output_tfrecord_path, shard,
+                                           options.num_shards));
+    if (!writer.ok()) return writer.status();
+    writers.push_back(std::move(writer).value());
+  }
+
+  const int num_threads =
+      options.num_threads > 0
+          ? options.num_threads
+          : static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+  // BHiveImporter owns a disassembler that is not thread-safe; each thread
+  // needs its own importer. The canonicalizer is thread-safe and shared.
+  std::vector<std::unique_ptr<BHiveImporter>> importers;
+  importers.reserve(num_threads);
+  for (int i = 0; i < num_threads; ++i) {
+    importers.push_back(std::make_unique<BHiveImporter>(&canonicalizer));
+  }
+
+  // The strings are reused across windows, so that they can keep their
+  // allocated memory.
+  const int window_size =
+      num_threads * options.chunk_size * options.chunks_per_thread;
+  std::vector<std::string> lines(window_size);
+  std::vector<absl::StatusOr<std::string>> records(window_size);
+  ParallelBHiveImportStats stats;
+  stats.input_range = (*input_file)->range();
+  int64_t num_written_records = 0;
+  while (true) {
+    int num_lines = 0;
+    while (num_lines < window_size &&
+           (*input_file)->ReadLine(lines[num_lines])) {
+      ++num_lines;
+    }
+    if (num_lines == 0) break;
+
+    ParseLines(lines, num_lines, options.chunk_size, options, importers,
+               records);
+    for (int i = 0; i < num_lines; ++i) {
+      if (!records[i].ok()) {
+        ++stats.num_skipped_blocks;
+        if (options.skipped_line_callback) {
+          options.skipped_line_callback(lines[i], records[i].status());
+        }
+        continue;
+      }
+      TFRecordWriter& writer =
+          *writers[num_written_records % options.num_shards];
+      if (absl::Status status = writer.Write(*records[i]); !status.ok()) {
+        return status;
+      }
+      ++num_written_records;
+    }
+    stats.num_input_blocks += num_lines;
+    if (options.progress_callback) {
+      options.progress_callback(stats.num_input_blocks);
+    }
+  }
+  if (absl::Status status = (*input_file)->status(); !status.ok()) {
+    return status;
+  }
+
+  for (std::unique_ptr<TFRecordWriter>& writer : writers) {
+    if (absl::Status status = writer->Close(); !status.ok()) return status;
+  }
+  return stats;
+}
+
+}  // namespace gematria
@@ -0,0 +1,99 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Contains a multi-threaded importer that converts a BHive CSV file to
+// (optionally sharded) TFRecord files of BasicBlockWithThroughputProto without
+// passing the blocks through Python.
+
+#ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_DATASETS_PARALLEL_BHIVE_IMPORTER_H_
+#define THIRD_PARTY_GEMATRIA_GEMATRIA_DATASETS_PARALLEL_BHIVE_IMPORTER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "gematria/datasets/input_shard.h"
+#include "gematria/llvm/canonicalizer.h"
+
+namespace gematria {
+
+struct ParallelBHiveImportOptions {
+  // The path of the input BHive CSV file.
+  std::string input_csv_path;
+  // The shard of the input file processed by the importer. The input file is
+  // split into `num_input_shards` byte ranges aligned to line boundaries, see
+  // ShardedLineReader, so that the shards can be imported independently, e.g.
+  // on different machines.
+  int input_shard_index = 0;
+  int num_input_shards = 1;
+  // The path of the output TFRecord file. When `num_shards` is greater than
+  // one, this is the prefix of the shard file names, see ShardFileName().
+  std::string output_tfrecord_path;
+  // The number of output shards. The blocks are distributed among the shards
+  // in a round-robin fashion; within each shard, they are in the order of the
+  // input file.
+  int num_shards = 1;
+
+  // The parameters of BHiveImporter::ParseBHiveCsvLine().
+  std::string source_name;
+  size_t machine_code_hex_column_index = 0;
+  size_t throughput_column_index = 1;
+  double throughput_scaling = 1.0;
+
+  // The number of threads that parse the input lines. Each thread has its own
+  // BHiveImporter. When not positive, uses one thread per hardware thread.
+  int num_threads = 0;
+  // The number of consecutive lines processed by a thread at once.
+  int chunk_size = 256;
+  // The number of chunks read from the input file at once, per thread. The
+  // memory used by the importer is proportional to
+  // `num_threads * chunk_size * chunks_per_thread`.
+  int chunks_per_thread = 16;
+
+  // When set, called for each line that can't be imported, in the order of the
+  // input file. Called from the thread that called ImportBHiveCsvToTFRecord().
+  std::function<void(std::string_view line, const absl::Status& status)>
+      skipped_line_callback;
+  // When set, called after each window of lines with the number of the lines
+  // processed so far.
+  std::function<void(int64_t num_processed_lines)> progress_callback;
+};
+
+struct ParallelBHiveImportStats {
+  // The number of lines read from the input file.
+  int64_t num_input_blocks = 0;
+  // The number of lines that could not be imported.
+  int64_t num_skipped_blocks = 0;
+  // The byte range of the input shard.
+  InputShardRange input_range;
+};
+
+// Imports all blocks from the BHive CSV file specified in `options`, and
+// writes them to the output TFRecord files. When `options.num_input_shards` is
+// greater than one, imports only the lines of the input shard. `canonicalizer`
+// must be for the architecture of the data set; it is shared by all threads.
+// Lines that can't be parsed are skipped and counted in the returned stats.
+// Returns an error when the input or the output files can't be opened or
+// written.
+absl::StatusOr<ParallelBHiveImportStats> ImportBHiveCsvToTFRecord(
+    const Canonicalizer& canonicalizer,
+    const ParallelBHiveImportOptions& options);
+
+}  // namespace gematria
+
+#endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_DATASETS_PARALLEL_BHIVE_IMPORTER_H_
@@ -0,0 +1,215 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/datasets/parallel_bhive_importer.h"
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "gematria/datasets/bhive_importer.h"
+#include "gematria/datasets/input_shard.h"
+#include "gematria/llvm/canonicalizer.h"
+#include "gematria/llvm/llvm_architecture_support.h"
+#include "gematria/proto/throughput.pb.h"
+#include "gematria/testing/matchers.h"
+#include "gmock/gmock.h"
+#include "google/protobuf/text_format.h"
+#include "gtest/gtest.h"
+
+namespace gematria {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::IsEmpty;
+using ::testing::Pointwise;
+
+constexpr std::string_view kSourceName = "bhive: skl";
+constexpr double kScaling = 1.0 / 100.0;
+
+constexpr std::string_view kValidLines[] = {
+    "4829d38b44246c8b54246848c1fb034829d04839c3,10",
+    "3b31,45.36",
+    "4889de4889c24c89ff,91.31",
+    "418b4424084d8b3c2489442418,74.00",
+    "48895c2428,11.06",
+};
+
+// Reads all records from a TFRecord file. Does not check the checksums.
+std::vector<BasicBlockWithThroughputProto> ReadRecords(
+    const std::string& path) {
+  std::ifstream file(path, std::ios::binary);
+  const std::string data(std::istreambuf_iterator<char>(file), {});
+  std::vector<BasicBlockWithThroughputProto> records;
+  for (size_t offset = 0; offset < data.size();) {
+    uint64_t length = 0;
+    for (int i = 0; i < sizeof(length); ++i) {
+      length |= uint64_t{static_cast<uint8_t>(data[offset + i])} << (8 * i);
+    }
+    offset += sizeof(uint64_t) + sizeof(uint32_t);
+    records.emplace_back().ParseFromString(data.substr(offset, length));
+    offset += length + sizeof(uint32_t);
+  }
+  return records;
+}
+
+class ParallelBHiveImporterTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    x86_llvm_ = LlvmArchitectureSupport::X86_64();
+    x86_canonicalizer_ =
+        std::make_unique<X86Canonicalizer>(&x86_llvm_->target_machine());
+
+    input_csv_path_ = ::testing::TempDir() + "/input.csv";
+    output_path_ = ::testing::TempDir() + "/output.tfrecord";
+    options_.input_csv_path = input_csv_path_;
+    options_.output_tfrecord_path = output_path_;
+    options_.source_name = std::string(kSourceName);
+    options_.throughput_scaling = kScaling;
+    options_.num_threads = 3;
+    options_.chunk_size = 1;
+    options_.chunks_per_thread = 1;
+  }
+
+  void WriteInput(const std::vector<std::string_view>& lines) {
+    std::ofstream file(input_csv_path_);
+    for (std::string_view line : lines) file << line << "\n";
+  }
+
+  // Returns the expected protos for the valid lines in `lines` in the text
+  // format, produced by a single-threaded BHiveImporter.
+  std::vector<std::string> ExpectedProtos(
+      const std::vector<std::string_view>& lines) {
+    BHiveImporter importer(x86_canonicalizer_.get());
+    std::vector<std::string> protos;
+    for (std::string_view line : lines) {
+      auto proto =
+          importer.ParseBHiveCsvLine(kSourceName, line, 0, 1, kScaling);
+      if (!proto.ok()) continue;
+      google::protobuf::TextFormat::PrintToString(*proto,
+                                                  &protos.emplace_back());
+    }
+    return protos;
+  }
+
+  std::unique_ptr<LlvmArchitectureSupport> x86_llvm_;
+  std::unique_ptr<Canonicalizer> x86_canonicalizer_;
+  std::string input_csv_path_;
+  std::string output_path_;
+  ParallelBHiveImportOptions options_;
+};
+
+TEST_F(ParallelBHiveImporterTest, SingleShard) {
+  const std::vector<std::string_view> lines(std::begin(kValidLines),
+                                            std::end(kValidLines));
+  WriteInput(lines);
+
+  auto stats = ImportBHiveCsvToTFRecord(*x86_canonicalizer_, options_);
+  ASSERT_OK(stats);
+  EXPECT_EQ(stats->num_input_blocks, lines.size());
+  EXPECT_EQ(stats->num_skipped_blocks, 0);
+  EXPECT_THAT(ReadRecords(output_path_),
+              Pointwise(EqualsProto(), ExpectedProtos(lines)));
+}
+
+TEST_F(ParallelBHiveImporterTest, MultipleShardsAndInvalidLines) {
+  const std::vector<std::string_view> lines = {
+      kValidLines[0], "not a block", kValidLines[1], kValidLines[2],
+      "4829,not a throughput", kValidLines[3], kValidLines[4]};
+  WriteInput(lines);
+  options_.num_shards = 2;
+  std::vector<std::string> skipped_lines;
+  options_.skipped_line_callback = [&skipped_lines](std::string_view line,
+                                                    const absl::Status&) {
+    skipped_lines.emplace_back(line);
+  };
+
+  auto stats = ImportBHiveCsvToTFRecord(*x86_canonicalizer_, options_);
+  ASSERT_OK(stats);
+  EXPECT_EQ(stats->num_input_blocks, lines.size());
+  EXPECT_EQ(stats->num_skipped_blocks, 2);
+  EXPECT_THAT(skipped_lines,
+              ElementsAre("not a block", "4829,not a throughput"));
+
+  // The valid blocks are distributed among the shards in a round-robin
+  // fashion.
+  const std::vector<std::string> expected = ExpectedProtos(lines);
+  ASSERT_EQ(expected.size(), 5);
+  const std::vector<std::string> expected_shard_0 = {expected[0], expected[2],
+                                                     expected[4]};
+  const std::vector<std::string> expected_shard_1 = {expected[1], expected[3]};
+  EXPECT_THAT(ReadRecords(ShardFileName(output_path_, 0, 2)),
+              Pointwise(EqualsProto(), expected_shard_0));
+  EXPECT_THAT(ReadRecords(ShardFileName(output_path_, 1, 2)),
+              Pointwise(EqualsProto(), expected_shard_1));
+}
+
+TEST_F(ParallelBHiveImporterTest, InputShards) {
+  const std::vector<std::string_view> lines(std::begin(kValidLines),
+                                            std::end(kValidLines));
+  WriteInput(lines);
+  constexpr int kNumInputShards = 3;
+  options_.num_input_shards = kNumInputShards;
+
+  // The input shards together import each line exactly once, in the order of
+  // the input file.
+  std::vector<BasicBlockWithThroughputProto> records;
+  int64_t num_input_blocks = 0;
+  for (int shard = 0; shard < kNumInputShards; ++shard) {
+    options_.input_shard_index = shard;
+    options_.output_tfrecord_path =
+        ShardFileName(output_path_, shard, kNumInputShards);
+    auto stats = ImportBHiveCsvToTFRecord(*x86_canonicalizer_, options_);
+    ASSERT_OK(stats);
+    num_input_blocks += stats->num_input_blocks;
+    for (BasicBlockWithThroughputProto& record :
+         ReadRecords(options_.output_tfrecord_path)) {
+      records.push_back(std::move(record));
+    }
+  }
+  EXPECT_EQ(num_input_blocks, lines.size());
+  EXPECT_THAT(records, Pointwise(EqualsProto(), ExpectedProtos(lines)));
+}
+
+TEST_F(ParallelBHiveImporterTest, InvalidInputShard) {
+  WriteInput({});
+  options_.input_shard_index = 2;
+  options_.num_input_shards = 2;
+  EXPECT_THAT(ImportBHiveCsvToTFRecord(*x86_canonicalizer_, options_),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
+TEST_F(ParallelBHiveImporterTest, EmptyInput) {
+  WriteInput({});
+  auto stats = ImportBHiveCsvToTFRecord(*x86_canonicalizer_, options_);
+  ASSERT_OK(stats);
+  EXPECT_EQ(stats->num_input_blocks, 0);
+  EXPECT_THAT(ReadRecords(output_path_), IsEmpty());
+}
+
+TEST_F(ParallelBHiveImporterTest, MissingInput) {
+  options_.input_csv_path = ::testing::TempDir() + "/does_not_exist.csv";
+  EXPECT_THAT(ImportBHiveCsvToTFRecord(*x86_canonicalizer_, options_),
+              StatusIs(absl::StatusCode::kNotFound));
+}
+
+}  // namespace
+}  // namespace gematria
@@ -15,13 +15,20 @@
 #include "gematria/datasets/bhive_importer.h"
 
 #include <cstdint>
+#include <optional>
+#include <string>
 #include <string_view>
+#include <utility>
+#include <vector>
 
+#include "absl/status/statusor.h"
 #include "gematria/llvm/canonicalizer.h"
+#include "gematria/proto/throughput.pb.h"
 #include "llvm/ADT/ArrayRef.h"
 #include "pybind11/cast.h"
 #include "pybind11/detail/common.h"
 #include "pybind11/pybind11.h"
+#include "pybind11/stl.h"
 #include "pybind11_abseil/import_status_module.h"
 #include "pybind11_abseil/status_casters.h"
 #include "pybind11_protobuf/native_proto_caster.h"
@@ -35,7 +42,14 @@ PYBIND11_MODULE(bhive_importer, m) {
 
   py::google::ImportStatusModule();
 
-  py::class_<BHiveImporter>(m, "BHiveImporter")
+  py::class_<BHiveImporter>(m, "BHiveImporter",
+                            R"(Parser for BHive CSV files.
+
+      The methods of the importer release the GIL while disassembling the
+      machine code, so that multiple Python threads can import data in parallel.
+      A single importer must not be used by multiple threads at the same time;
+      each thread should create its own importer. The canonicalizer can be
+      shared by all importers.)")
       .def(  //
           py::init<const Canonicalizer* /* canonicalizer */>(),
           py::arg("canonicalizer"),
@@ -54,6 +68,8 @@ PYBIND11_MODULE(bhive_importer, m) {
             llvm::ArrayRef<uint8_t> machine_code_bytes(
                 reinterpret_cast<const uint8_t*>(machine_code_view.data()),
                 machine_code_view.size());
+            // `machine_code` keeps the data alive while the GIL is released.
+            py::gil_scoped_release release_gil;
             return self.BasicBlockProtoFromMachineCode(machine_code_bytes,
                                                        base_address);
           },
@@ -79,6 +95,7 @@ PYBIND11_MODULE(bhive_importer, m) {
           "basic_block_proto_from_hex",
           &BHiveImporter::BasicBlockProtoFromMachineCodeHex,
           py::arg("machine_code_hex"), py::arg("base_address") = uint64_t{0},
+          py::call_guard<py::gil_scoped_release>(),
           R"(Creates a BasicBlockProto from machine code in hex string.
 
           Similar to `basic_block_proto_from_bytes` but the machine code is
@@ -107,6 +124,7 @@ PYBIND11_MODULE(bhive_importer, m) {
           py::arg("throughput_column_index"),
           py::arg("throughput_scaling") = 1.0,
           py::arg("base_address") = uint64_t{0},
+          py::call_guard<py::gil_scoped_release>(),
           R"(Creates a BasicBlockWithThroughputProto from a BHive CSV line.
 
           Takes a string in the format "{machine_code},{throughput}" where
@@ -133,7 +151,115 @@ PYBIND11_MODULE(bhive_importer, m) {
 
           Raises:
             StatusNotOk: When parsing the CSV line or extracting data from the
-              machine code fails.)");
+              machine code fails.)")
+      .def(  //
+          "parse_bhive_csv_lines",
+          [](BHiveImporter& self, std::string_view source_name,
+             const std::vector<std::string>& lines,
+             size_t machine_code_hex_column_index,
+             size_t throughput_column_index, double throughput_scaling,
+             uint64_t base_address) {
+            std::vector<std::optional<BasicBlockWithThroughputProto>> protos(
+                lines.size());
+            {
+              // The protos are converted to Python objects only after the GIL
+              // is acquired again.
+              py::gil_scoped_release release_gil;
+              for (size_t i = 0; i < lines.size(); ++i) {
+                absl::StatusOr<BasicBlockWithThroughputProto> proto =
+                    self.ParseBHiveCsvLine(
+                        source_name, lines[i], machine_code_hex_column_index,
+                        throughput_column_index, throughput_scaling,
+                        base_address);
+                if (proto.ok()) protos[i] = std::move(proto).value();
+              }
+            }
+            return protos;
+          },
+          py::arg("source_name"), py::arg("lines"),
+          py::arg("machine_code_hex_column_index"),
+          py::arg("throughput_column_index"),
+          py::arg("throughput_scaling") = 1.0,
+          py::arg("base_address") = uint64_t{0},
+          R"(Creates BasicBlockWithThroughputProtos from BHive CSV lines.
+
+          A batch version of `basic_block_with_throughput_proto_from_csv_line`.
+          Processes all lines in a single call without holding the GIL.
+
+          Args:
+            source_name: The name of the throughput source used in the output
+              protos.
+            lines: The lines from the BHive CSV file.
+            machine_code_hex_column_index: The index of the column in the CSV
+              containing the machine code in hex format.
+            throughput_column_index: The index of the column in the CSV
+              containing the throughput in cycles.
+            throughput_scaling: An optional scaling applied to {throughput}.
+            base_address: The address of the first instruction of each basic
+              block.
+
+          Returns:
+            A list that contains one element for each line in `lines`. The
+            element is the BasicBlockWithThroughputProto for the line, or None
+            when the line could not be parsed.)")
+      .def(  //
+          "parse_bhive_csv",
+          [](BHiveImporter& self, std::string_view source_name,
+             py::buffer csv_data, size_t machine_code_hex_column_index,
+             size_t throughput_column_index, double throughput_scaling,
+             uint64_t base_address) {
+            const py::buffer_info csv_data_info = csv_data.request();
+            const std::string_view csv_data_view(
+                static_cast<const char*>(csv_data_info.ptr),
+                csv_data_info.size * csv_data_info.itemsize);
+            std::vector<std::optional<BasicBlockWithThroughputProto>> protos;
+            {
+              // `csv_data_info` keeps the buffer alive while the GIL is
+              // released. The protos are converted to Python objects only
+              // after the GIL is acquired again.
+              py::gil_scoped_release release_gil;
+              std::vector<absl::StatusOr<BasicBlockWithThroughputProto>>
+                  parsed_protos = self.ParseBHiveCsv(
+                      source_name, csv_data_view, machine_code_hex_column_index,
+                      throughput_column_index, throughput_scaling,
+                      base_address);
+              protos.resize(parsed_protos.size());
+              for (size_t i = 0; i < parsed_protos.size(); ++i) {
+                if (parsed_protos[i].ok()) {
+                  protos[i] = *std::move(parsed_protos[i]);
+                }
+              }
+            }
+            return protos;
+          },
+          py::arg("source_name"), py::arg("csv_data"),
+          py::arg("machine_code_hex_column_index"),
+          py::arg("throughput_column_index"),
+          py::arg("throughput_scaling") = 1.0,
+          py::arg("base_address") = uint64_t{0},
+          R"(Creates BasicBlockWithThroughputProtos from a BHive CSV file.
+
+          A version of `parse_bhive_csv_lines` that takes the contents of the
+          whole CSV file in any object that supports the buffer protocol, e.g.
+          `bytes` or an `mmap.mmap` of the file, and splits it into lines
+          without creating a Python string per line. Empty lines are skipped.
+
+          Args:
+            source_name: The name of the throughput source used in the output
+              protos.
+            csv_data: The contents of the BHive CSV file.
+            machine_code_hex_column_index: The index of the column in the CSV
+              containing the machine code in hex format.
+            throughput_column_index: The index of the column in the CSV
+              containing the throughput in cycles.
+            throughput_scaling: An optional scaling applied to {throughput}.
+            base_address: The address of the first instruction of each basic
+              block.
+
+          Returns:
+            A list that contains one element for each non-empty line of
+            `csv_data`. The element is the BasicBlockWithThroughputProto for the
+            line, or None when the line could not be parsed.)");
 }
 
 }  // namespace gematria
@@ -12,6 +12,8 @@
 # See the License for the specific language governing permissions and
 # limitations under the License.
 
+from concurrent import futures
+
 from absl.testing import absltest
 from gematria.datasets.python import bhive_importer
 from gematria.llvm.python import canonicalizer
@@ -246,6 +248,97 @@ class BhiveImporterTest(absltest.TestCase):
         ),
     )
 
+  def test_x86_parse_csv_lines(self):
+    source_name = "test: made-up"
+    importer = bhive_importer.BHiveImporter(self._x86_canonicalizer)
+    block_protos = importer.parse_bhive_csv_lines(
+        source_name=source_name,
+        lines=[
+            "4829d38b44246c8b54246848c1fb034829d04839c3,10",
+            "not a valid line",
+            "4829d38b44246c8b54246848c1fb034829d04839c3,5",
+        ],
+        machine_code_hex_column_index=0,
+        throughput_column_index=1,
+        base_address=600,
+        throughput_scaling=2.0,
+    )
+    self.assertLen(block_protos, 3)
+    self.assertIsNone(block_protos[1])
+    for block_proto, throughput in (
+        (block_protos[0], 20.0),
+        (block_protos[2], 10.0),
+    ):
+      self.assertEqual(
+          block_proto,
+          throughput_pb2.BasicBlockWithThroughputProto(
+              basic_block=_EXPECTED_BASIC_BLOCK_PROTO,
+              inverse_throughputs=(
+                  throughput_pb2.ThroughputWithSourceProto(
+                      source=source_name,
+                      inverse_throughput_cycles=[throughput],
+                  ),
+              ),
+          ),
+      )
+
+  def test_x86_parse_csv(self):
+    source_name = "test: made-up"
+    importer = bhive_importer.BHiveImporter(self._x86_canonicalizer)
+    block_protos = importer.parse_bhive_csv(
+        source_name=source_name,
+        csv_data=(
+            b"4829d38b44246c8b54246848c1fb034829d04839c3,10\r\n"
+            b"not a valid line\n"
+            b"\n"
+            b"4829d38b44246c8b54246848c1fb034829d04839c3,5\n"
+        ),
+        machine_code_hex_column_index=0,
+        throughput_column_index=1,
+        base_address=600,
+        throughput_scaling=2.0,
+    )
+    self.assertLen(block_protos, 3)
+    self.assertIsNone(block_protos[1])
+    for block_proto, throughput in (
+        (block_protos[0], 20.0),
+        (block_protos[2], 10.0),
+    ):
+      self.assertEqual(
+          block_proto,
+          throughput_pb2.BasicBlockWithThroughputProto(
+              basic_block=_EXPECTED_BASIC_BLOCK_PROTO,
+              inverse_throughputs=(
+                  throughput_pb2.ThroughputWithSourceProto(
+                      source=source_name,
+                      inverse_throughput_cycles=[throughput],
+                  ),
+              ),
+          ),
+      )
+
+  def test_x86_parse_csv_lines_from_multiple_threads(self):
+    num_threads = 4
+    lines = ["4829d38b44246c8b54246848c1fb034829d04839c3,10"] * 100
+
+    def parse_lines(_):
+      # Each thread needs its own importer; the canonicalizer is shared.
+      importer = bhive_importer.BHiveImporter(self._x86_canonicalizer)
+      return importer.parse_bhive_csv_lines(
+          source_name="test: made-up",
+          lines=lines,
+          machine_code_hex_column_index=0,
+          throughput_column_index=1,
+          base_address=600,
+      )
+
+    with futures.ThreadPoolExecutor(num_threads) as executor:
+      results = list(executor.map(parse_lines, range(num_threads)))
+    for block_protos in results:
+      self.assertLen(block_protos, len(lines))
+      for block_proto in block_protos:
+        self.assertEqual(block_proto.basic_block, _EXPECTED_BASIC_BLOCK_PROTO)
+
 
 if __name__ == "__main__":
   absltest.main()
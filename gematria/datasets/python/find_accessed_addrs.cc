@@ -0,0 +1,225 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/datasets/find_accessed_addrs.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <variant>
+#include <vector>
+
+#include "absl/status/statusor.h"
+#include "absl/types/span.h"
+#include "gematria/proto/basic_block.pb.h"
+#include "pybind11/cast.h"
+#include "pybind11/detail/common.h"
+#include "pybind11/pybind11.h"
+#include "pybind11/stl.h"
+#include "pybind11_abseil/import_status_module.h"
+#include "pybind11_abseil/status_casters.h"
+#include "pybind11_protobuf/native_proto_caster.h"
+
+namespace gematria {
+namespace {
+
+namespace py = ::pybind11;
+
+absl::Span<const uint8_t> MachineCodeSpan(std::string_view machine_code) {
+  return absl::Span<const uint8_t>(
+      reinterpret_cast<const uint8_t*>(machine_code.data()),
+      machine_code.size());
+}
+
+// The result of the annotation of one basic block in a batch: the accessed
+// addresses, or the error message when the annotation failed.
+using AccessedAddrsOrError = std::variant<AccessedAddrs, std::string>;
+
+// Annotates all blocks in `machine_codes` using `num_threads` threads. When
+// `basic_blocks` is not empty, it must have one element per block, and the
+// address registers from the protos are used to guide the retries of the
+// annotation.
+std::vector<AccessedAddrsOrError> FindAccessedAddrsBatch(
+    const std::vector<std::string_view>& machine_codes,
+    absl::Span<const BasicBlockProto> basic_blocks, int num_threads,
+    size_t block_size) {
+  std::vector<AccessedAddrsOrError> results(machine_codes.size());
+  std::atomic<size_t> next_block = 0;
+  const auto annotate_blocks = [&]() {
+    for (size_t i = next_block++; i < machine_codes.size(); i = next_block++) {
+      std::vector<InstructionAddressRegisters> address_registers;
+      if (!basic_blocks.empty()) {
+        address_registers = GetInstructionAddressRegisters(basic_blocks[i]);
+      }
+      FindAccessedAddrsStats stats;
+      absl::StatusOr<AccessedAddrs> accessed_addrs = FindAccessedAddrs(
+          MachineCodeSpan(machine_codes[i]),
+          {.address_registers = address_registers, .block_size = block_size},
+          stats);
+      if (accessed_addrs.ok()) {
+        results[i] = *std::move(accessed_addrs);
+      } else {
+        results[i] = accessed_addrs.status().ToString();
+      }
+    }
+  };
+  // FindAccessedAddrs() keeps a fork server per thread, so each thread of the
+  // batch starts its own child process; there is no point in using more
+  // threads than there are blocks.
+  const size_t num_workers =
+      std::min<size_t>(num_threads, std::max<size_t>(machine_codes.size(), 1));
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < num_workers; ++i) {
+    workers.emplace_back(annotate_blocks);
+  }
+  annotate_blocks();
+  for (std::thread& worker : workers) worker.join();
+  return results;
+}
+
+}  // namespace
+
+PYBIND11_MODULE(find_accessed_addrs, m) {
+  m.doc() = "Finds the memory addresses accessed by basic blocks.";
+
+  py::google::ImportStatusModule();
+  pybind11_protobuf::ImportNativeProtoCasters();
+
+  py::class_<X64Regs>(m, "X64Regs",
+                      R"(The initial values of the general purpose registers.
+
+      The values are signed 64-bit integers, as in the C++ struct.)")
+      .def_readonly("rax", &X64Regs::rax)
+      .def_readonly("rbx", &X64Regs::rbx)
+      .def_readonly("rcx", &X64Regs::rcx)
+      .def_readonly("rdx", &X64Regs::rdx)
+      .def_readonly("rsi", &X64Regs::rsi)
+      .def_readonly("rdi", &X64Regs::rdi)
+      .def_readonly("rsp", &X64Regs::rsp)
+      .def_readonly("rbp", &X64Regs::rbp)
+      .def_readonly("r8", &X64Regs::r8)
+      .def_readonly("r9", &X64Regs::r9)
+      .def_readonly("r10", &X64Regs::r10)
+      .def_readonly("r11", &X64Regs::r11)
+      .def_readonly("r12", &X64Regs::r12)
+      .def_readonly("r13", &X64Regs::r13)
+      .def_readonly("r14", &X64Regs::r14)
+      .def_readonly("r15", &X64Regs::r15);
+
+  py::class_<AccessedAddrs>(m, "AccessedAddrs",
+                            R"(The memory accessed by a basic block.
+
+      Attributes:
+        code_location: The address at which the basic block was executed.
+        block_size: The size of the accessed memory blocks in bytes.
+        accessed_blocks: The start addresses of the accessed memory blocks.
+        initial_regs: The initial register values with which the basic block
+          accesses only the memory in `accessed_blocks`.)")
+      .def_readonly("code_location", &AccessedAddrs::code_location)
+      .def_readonly("block_size", &AccessedAddrs::block_size)
+      .def_readonly("accessed_blocks", &AccessedAddrs::accessed_blocks)
+      .def_readonly("initial_regs", &AccessedAddrs::initial_regs);
+
+  m.def(
+      "find_accessed_addrs",
+      [](py::bytes machine_code, size_t block_size) {
+        std::string_view machine_code_view = machine_code;
+        // `machine_code` keeps the data alive while the GIL is released.
+        py::gil_scoped_release release_gil;
+        FindAccessedAddrsStats stats;
+        return FindAccessedAddrs(MachineCodeSpan(machine_code_view),
+                                 {.block_size = block_size}, stats);
+      },
+      py::arg("machine_code"), py::arg("block_size") = size_t{0},
+      R"(Finds the memory accessed by a basic block.
+
+      Runs the basic block in a child process, so the machine code must be for
+      the architecture of the host. Releases the GIL while the block runs.
+
+      Args:
+        machine_code: A `bytes` object that contains the machine code of the
+          basic block.
+        block_size: The size of the memory blocks mapped for the accessed
+          addresses. Must be a multiple of the page size; zero uses the page
+          size.
+
+      Returns:
+        The AccessedAddrs of the basic block.
+
+      Raises:
+        StatusNotOk: When the addresses accessed by the basic block could not
+          be found.)");
+
+  m.def(
+      "find_accessed_addrs_batch",
+      [](const std::vector<py::bytes>& machine_codes,
+         const std::optional<std::vector<BasicBlockProto>>& basic_blocks,
+         int num_threads, size_t block_size) {
+        if (num_threads < 1) {
+          throw py::value_error("num_threads must be positive");
+        }
+        if (basic_blocks.has_value() &&
+            basic_blocks->size() != machine_codes.size()) {
+          throw py::value_error(
+              "basic_blocks must have one element per machine code");
+        }
+        // The views point to the data of the bytes objects in
+        // `machine_codes`, which keeps them alive while the GIL is released.
+        std::vector<std::string_view> machine_code_views(
+            machine_codes.begin(), machine_codes.end());
+        py::gil_scoped_release release_gil;
+        return FindAccessedAddrsBatch(
+            machine_code_views,
+            basic_blocks.has_value() ? absl::MakeConstSpan(*basic_blocks)
+                                     : absl::Span<const BasicBlockProto>(),
+            num_threads, block_size);
+      },
+      py::arg("machine_codes"), py::arg("basic_blocks") = std::nullopt,
+      py::arg("num_threads") = 1, py::arg("block_size") = size_t{0},
+      R"(Finds the memory accessed by a batch of basic blocks.
+
+      A batch version of `find_accessed_addrs`. Annotates the blocks in
+      `num_threads` threads without holding the GIL. Each thread starts its own
+      child process for running the blocks, so large batches amortize the cost
+      better than many small ones.
+
+      Args:
+        machine_codes: A list of `bytes` objects that contain the machine code
+          of the basic blocks.
+        basic_blocks: An optional list of BasicBlockProtos with the
+          disassembled basic blocks, one per element of `machine_codes`. When
+          provided, the address registers of the instructions are used to
+          change only the relevant registers when a block accesses an address
+          that can't be mapped, which needs fewer runs of the block.
+        num_threads: The number of threads used for the annotation.
+        block_size: The size of the memory blocks mapped for the accessed
+          addresses. Must be a multiple of the page size; zero uses the page
+          size.
+
+      Returns:
+        A list that contains one element for each element of `machine_codes`.
+        The element is the AccessedAddrs of the block, or a string with the
+        error when the addresses could not be found.
+
+      Raises:
+        ValueError: When `num_threads` is not positive, or when `basic_blocks`
+          does not have the same length as `machine_codes`.)");
+}
+
+}  // namespace gematria
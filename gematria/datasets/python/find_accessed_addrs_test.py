@@ -0,0 +1,110 @@
+# Copyright 2023 Google Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#    http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+from absl.testing import absltest
+from gematria.datasets.python import bhive_importer
+from gematria.datasets.python import find_accessed_addrs
+from gematria.llvm.python import canonicalizer
+from gematria.llvm.python import llvm_architecture_support
+from pybind11_abseil import status
+
+# mov dword ptr [0x10000], eax
+_MOV_TO_CONSTANT_ADDRESS = b"\x89\x04\x25\x00\x00\x01\x00"
+# mov eax, ebx
+_MOV_BETWEEN_REGISTERS = b"\x89\xd8"
+# ud2
+_ILLEGAL_INSTRUCTION = b"\x0f\x0b"
+
+
+class FindAccessedAddrsTest(absltest.TestCase):
+  """Test for the Python bindings of FindAccessedAddrs().
+
+  Most of the functionality is tested in the corresponding cc_test(). Here we
+  test just that the bindings return the expected data.
+  """
+
+  def test_find_accessed_addrs(self):
+    accessed_addrs = find_accessed_addrs.find_accessed_addrs(
+        _MOV_TO_CONSTANT_ADDRESS
+    )
+    self.assertEqual(accessed_addrs.accessed_blocks, [0x10000])
+    self.assertGreater(accessed_addrs.block_size, 0)
+    self.assertNotEqual(accessed_addrs.code_location, 0)
+    self.assertIsInstance(accessed_addrs.initial_regs.rax, int)
+
+  def test_find_accessed_addrs_with_block_size(self):
+    accessed_addrs = find_accessed_addrs.find_accessed_addrs(
+        _MOV_TO_CONSTANT_ADDRESS, block_size=0x10000
+    )
+    self.assertEqual(accessed_addrs.block_size, 0x10000)
+    self.assertEqual(accessed_addrs.accessed_blocks, [0x10000])
+
+  def test_find_accessed_addrs_error(self):
+    with self.assertRaises(status.StatusNotOk):
+      find_accessed_addrs.find_accessed_addrs(_ILLEGAL_INSTRUCTION)
+    with self.assertRaises(status.StatusNotOk):
+      find_accessed_addrs.find_accessed_addrs(
+          _MOV_BETWEEN_REGISTERS, block_size=1000
+      )
+
+  def test_find_accessed_addrs_batch(self):
+    machine_codes = [
+        _MOV_TO_CONSTANT_ADDRESS,
+        _ILLEGAL_INSTRUCTION,
+        _MOV_BETWEEN_REGISTERS,
+    ] * 10
+    results = find_accessed_addrs.find_accessed_addrs_batch(
+        machine_codes, num_threads=4
+    )
+    self.assertLen(results, len(machine_codes))
+    for i in range(0, len(results), 3):
+      self.assertIsInstance(results[i], find_accessed_addrs.AccessedAddrs)
+      self.assertEqual(results[i].accessed_blocks, [0x10000])
+      self.assertIsInstance(results[i + 1], str)
+      self.assertIsInstance(results[i + 2], find_accessed_addrs.AccessedAddrs)
+      self.assertEmpty(results[i + 2].accessed_blocks)
+
+  def test_find_accessed_addrs_batch_with_basic_blocks(self):
+    x86_llvm = llvm_architecture_support.LlvmArchitectureSupport.x86_64()
+    importer = bhive_importer.BHiveImporter(
+        canonicalizer.Canonicalizer.x86_64(x86_llvm)
+    )
+    machine_codes = [_MOV_TO_CONSTANT_ADDRESS, _MOV_BETWEEN_REGISTERS]
+    basic_blocks = [
+        importer.basic_block_proto_from_bytes(machine_code)
+        for machine_code in machine_codes
+    ]
+    results = find_accessed_addrs.find_accessed_addrs_batch(
+        machine_codes, basic_blocks=basic_blocks, num_threads=2
+    )
+    self.assertLen(results, 2)
+    self.assertEqual(results[0].accessed_blocks, [0x10000])
+    self.assertEmpty(results[1].accessed_blocks)
+
+  def test_find_accessed_addrs_batch_empty(self):
+    self.assertEmpty(find_accessed_addrs.find_accessed_addrs_batch([]))
+
+  def test_find_accessed_addrs_batch_invalid_arguments(self):
+    with self.assertRaises(ValueError):
+      find_accessed_addrs.find_accessed_addrs_batch(
+          [_MOV_BETWEEN_REGISTERS], num_threads=0
+      )
+    with self.assertRaises(ValueError):
+      find_accessed_addrs.find_accessed_addrs_batch(
+          [_MOV_BETWEEN_REGISTERS], basic_blocks=[]
+      )
+
+
+if __name__ == "__main__":
+  absltest.main()
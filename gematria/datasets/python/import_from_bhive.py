@@ -22,6 +22,16 @@ Usage:
       --gematria_input_csv=/tmp/bhive/skl.csv \
       --gematria_output_tfrecord=/tmp/bhive/skl.tfrecord \
       --gematria_throughput_source_name="bhive: skl"
+
+Large data sets can be imported on many machines at once: with
+--gematria_num_input_shards=N, each of the N runs with a different
+--gematria_input_shard_index imports only its line-aligned byte range of the
+input file, and writes the blocks to its own output file. The manifests written
+with --gematria_shard_manifest can be combined by merge_shard_manifests.
+
+For large data sets, prefer the native //gematria/datasets:import_from_bhive,
+which accepts the same flags, processes the blocks on multiple threads, and can
+write sharded output.
 """
 
 from collections.abc import Sequence
@@ -30,6 +40,7 @@ from absl import app
 from absl import flags
 from absl import logging
 from gematria.datasets.python import bhive_importer
+from gematria.datasets.python import input_shard
 from gematria.llvm.python import canonicalizer
 from gematria.llvm.python import llvm_architecture_support
 from pybind11_abseil import status
@@ -45,7 +56,9 @@ _INPUT_CSV_FILE = flags.DEFINE_string(
 _OUTPUT_TFRECORD_FILE = flags.DEFINE_string(
     'gematria_output_tfrecord',
     None,
-    'The name of the TFRecord file to write the data to.',
+    'The name of the TFRecord file to write the data to. With'
+    ' --gematria_num_input_shards > 1, the input shard suffix is added to the'
+    ' name.',
     required=True,
 )
 _SOURCE_NAME = flags.DEFINE_string(
@@ -76,6 +89,38 @@ _THROUGHPUT_COLUMN_INDEX = flags.DEFINE_integer(
     '1',
     'The index of the throughput value column in the input CSV file.',
 )
+_INPUT_SHARD_INDEX = flags.DEFINE_integer(
+    'gematria_input_shard_index',
+    0,
+    'The index of the input shard imported by this run, see'
+    ' --gematria_num_input_shards.',
+)
+_NUM_INPUT_SHARDS = flags.DEFINE_integer(
+    'gematria_num_input_shards',
+    1,
+    'The number of input shards. When greater than one, imports only the lines'
+    ' that begin in the --gematria_input_shard_index-th of'
+    ' --gematria_num_input_shards equal byte ranges of the input file. The'
+    ' input shards together import every block exactly once.',
+)
+_SHARD_MANIFEST = flags.DEFINE_string(
+    'gematria_shard_manifest',
+    None,
+    'When set, writes a JSON manifest of the input shard and its output file'
+    ' to this file.',
+)
+
+
+@flags.multi_flags_validator(
+    [_INPUT_SHARD_INDEX.name, _NUM_INPUT_SHARDS.name],
+    message='Expected a valid input shard index and number of input shards',
+)
+def _validate_input_shard(flags_dict):
+  return (
+      0
+      <= flags_dict[_INPUT_SHARD_INDEX.name]
+      < flags_dict[_NUM_INPUT_SHARDS.name]
+  )
 
 
 @flags.multi_flags_validator(
@@ -111,10 +156,15 @@ def main(argv: Sequence[str]) -> None:
   canonicalizer_obj = canonicalizer.Canonicalizer.x86_64(llvm)
   importer = bhive_importer.BHiveImporter(canonicalizer_obj)
 
-  with (
-      tf.io.gfile.GFile(_INPUT_CSV_FILE.value, 'r') as bhive_csv_file,
-      tf.io.TFRecordWriter(_OUTPUT_TFRECORD_FILE.value) as writer,
-  ):
+  bhive_csv_file = input_shard.ShardedLineReader(
+      _INPUT_CSV_FILE.value, _INPUT_SHARD_INDEX.value, _NUM_INPUT_SHARDS.value
+  )
+  output_tfrecord_file = input_shard.shard_file_name(
+      _OUTPUT_TFRECORD_FILE.value,
+      _INPUT_SHARD_INDEX.value,
+      _NUM_INPUT_SHARDS.value,
+  )
+  with tf.io.TFRecordWriter(output_tfrecord_file) as writer:
     num_input_blocks = 0
     num_skipped_blocks = 0
     for line in bhive_csv_file:
@@ -140,6 +190,21 @@ def main(argv: Sequence[str]) -> None:
 
       writer.write(block_proto.SerializeToString())
 
+  if _SHARD_MANIFEST.value:
+    with tf.io.gfile.GFile(_SHARD_MANIFEST.value, 'w') as manifest_file:
+      manifest_file.write(
+          input_shard.format_manifest(
+              tool='import_from_bhive',
+              input_path=_INPUT_CSV_FILE.value,
+              reader=bhive_csv_file,
+              shard_index=_INPUT_SHARD_INDEX.value,
+              num_shards=_NUM_INPUT_SHARDS.value,
+              num_blocks=num_input_blocks - num_skipped_blocks,
+              output_files=(output_tfrecord_file,),
+          )
+          + '\n'
+      )
+
 
 if __name__ == '__main__':
   app.run(main)
@@ -0,0 +1,228 @@
+# Copyright 2023 Google Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#    http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Processing of large input files in line-aligned shards.
+
+A Python version of gematria/datasets/input_shard.h. Shard `i` out of `n` of a
+text file owns all lines that begin in the byte range
+[size * i // n, size * (i + 1) // n) of the file, so the shards can be processed
+independently, e.g. on different machines, without splitting the file first.
+Each shard can describe its outputs in a JSON manifest; `merge_manifests()`
+checks that the manifests of a run cover the whole input and combines them.
+"""
+
+from collections.abc import Iterator, Mapping, Sequence
+import json
+from typing import Any
+
+import tensorflow as tf
+
+
+class ShardError(Exception):
+  """Raised when a shard or a set of shard manifests is not valid."""
+
+
+def shard_file_name(path: str, shard: int, num_shards: int) -> str:
+  """Returns the name of the output file for a shard.
+
+  Uses the same "{path}-{shard}-of-{num_shards}" naming scheme as the native
+  tools.
+
+  Args:
+    path: The name of the output file without the shard suffix.
+    shard: The index of the shard.
+    num_shards: The number of shards.
+
+  Returns:
+    The name of the file of the shard; `path` itself when `num_shards` is one.
+  """
+  if num_shards == 1:
+    return path
+  return f'{path}-{shard:05d}-of-{num_shards:05d}'
+
+
+def validate_shard(shard_index: int, num_shards: int) -> None:
+  """Raises ShardError when `shard_index` is not a valid shard index."""
+  if num_shards < 1:
+    raise ShardError(f'Invalid number of shards: {num_shards}')
+  if shard_index < 0 or shard_index >= num_shards:
+    raise ShardError(f'Invalid shard index: {shard_index} out of {num_shards}')
+
+
+class ShardedLineReader:
+  """Iterates over the lines of one shard of a text file.
+
+  The lines are returned as strings without the end of line character, in the
+  order of the file.
+
+  Attributes:
+    begin_offset: The beginning of the byte range of the shard, before the
+      alignment to line boundaries.
+    end_offset: The end of the byte range of the shard.
+    num_lines: The number of lines returned so far.
+  """
+
+  def __init__(self, path: str, shard_index: int, num_shards: int):
+    validate_shard(shard_index, num_shards)
+    self._path = path
+    file_size = tf.io.gfile.stat(path).length
+    self.begin_offset = file_size * shard_index // num_shards
+    self.end_offset = file_size * (shard_index + 1) // num_shards
+    self.num_lines = 0
+
+  def __iter__(self) -> Iterator[str]:
+    if self.begin_offset >= self.end_offset:
+      return
+    with tf.io.gfile.GFile(self._path, 'rb') as input_file:
+      position = self.begin_offset
+      if self.begin_offset > 0:
+        # The line that contains `begin_offset` belongs to the previous shard,
+        # unless it begins exactly at `begin_offset`.
+        input_file.seek(self.begin_offset - 1)
+        if input_file.read(1) != b'\n':
+          position += len(input_file.readline())
+      while position < self.end_offset:
+        line = input_file.readline()
+        if not line:
+          break
+        position += len(line)
+        self.num_lines += 1
+        if line.endswith(b'\n'):
+          line = line[:-1]
+        yield line.decode()
+
+
+def format_manifest(
+    *,
+    tool: str,
+    input_path: str,
+    reader: ShardedLineReader,
+    shard_index: int,
+    num_shards: int,
+    num_blocks: int,
+    output_files: Sequence[str],
+) -> str:
+  """Returns a shard manifest in the format used by the native tools."""
+  return json.dumps(
+      {
+          'tool': tool,
+          'input': input_path,
+          'shard_index': shard_index,
+          'num_shards': num_shards,
+          'begin_offset': reader.begin_offset,
+          'end_offset': reader.end_offset,
+          'num_lines': reader.num_lines,
+          'num_blocks': num_blocks,
+          'output_files': list(output_files),
+      },
+      separators=(',', ':'),
+  )
+
+
+def load_manifest(path: str) -> dict[str, Any]:
+  """Loads a shard manifest from a JSON file."""
+  with tf.io.gfile.GFile(path, 'r') as manifest_file:
+    return json.load(manifest_file)
+
+
+# Stats fields that are not summed over the shards. The elapsed time of a run is
+# the time of its slowest shard, and the throughput is recomputed from it.
+_ELAPSED_SECONDS = 'elapsed_seconds'
+_BLOCKS_PER_SECOND = 'blocks_per_second'
+
+
+def _merge_stats(
+    merged: dict[str, Any], stats: Mapping[str, Any]
+) -> dict[str, Any]:
+  """Adds the counters and timers from `stats` to `merged`."""
+  for key, value in stats.items():
+    if isinstance(value, Mapping):
+      merged[key] = _merge_stats(merged.get(key, {}), value)
+    elif key == _ELAPSED_SECONDS:
+      merged[key] = max(merged.get(key, 0), value)
+    elif key != _BLOCKS_PER_SECOND:
+      merged[key] = merged.get(key, 0) + value
+  return merged
+
+
+def merge_manifests(
+    manifests: Sequence[Mapping[str, Any]],
+) -> dict[str, Any]:
+  """Combines the manifests of all shards of a run.
+
+  Args:
+    manifests: The manifests of the shards, in any order.
+
+  Returns:
+    A manifest of the whole run. It has the fields of the shard manifests
+    except for the shard index and the byte range; the counters and the stats
+    are summed over the shards, and the output files of the shards are listed
+    in the order of the shards.
+
+  Raises:
+    ShardError: When the manifests are not from the same run, or when some
+      shards are missing or present more than once.
+  """
+  if not manifests:
+    raise ShardError('No shard manifests')
+  first = manifests[0]
+  num_shards = first['num_shards']
+  for manifest in manifests:
+    for key in ('tool', 'input', 'num_shards'):
+      if manifest[key] != first[key]:
+        raise ShardError(
+            f'The manifests have different values of "{key}":'
+            f' {first[key]!r} and {manifest[key]!r}'
+        )
+  ordered = sorted(manifests, key=lambda manifest: manifest['shard_index'])
+  shard_indices = [manifest['shard_index'] for manifest in ordered]
+  if shard_indices != list(range(num_shards)):
+    raise ShardError(
+        f'Expected the shards 0 to {num_shards - 1}, got {shard_indices}'
+    )
+  # The byte ranges of the shards must cover the input file without gaps; this
+  # also catches manifests of runs over different versions of the input file.
+  if ordered[0]['begin_offset'] != 0:
+    raise ShardError('The first shard does not begin at offset 0')
+  for previous, manifest in zip(ordered, ordered[1:]):
+    if previous['end_offset'] != manifest['begin_offset']:
+      raise ShardError(
+          f'Shard {manifest["shard_index"]} begins at offset'
+          f' {manifest["begin_offset"]}, but shard'
+          f' {previous["shard_index"]} ends at offset'
+          f' {previous["end_offset"]}'
+      )
+
+  merged = {
+      'tool': first['tool'],
+      'input': first['input'],
+      'num_shards': num_shards,
+      'size': ordered[-1]['end_offset'],
+      'num_lines': sum(manifest['num_lines'] for manifest in ordered),
+      'num_blocks': sum(manifest['num_blocks'] for manifest in ordered),
+      'output_files': [
+          output_file
+          for manifest in ordered
+          for output_file in manifest['output_files']
+      ],
+  }
+  if any('stats' in manifest for manifest in ordered):
+    stats = {}
+    for manifest in ordered:
+      _merge_stats(stats, manifest.get('stats', {}))
+    elapsed_seconds = stats.get(_ELAPSED_SECONDS, 0)
+    if elapsed_seconds > 0 and 'blocks' in stats:
+      stats[_BLOCKS_PER_SECOND] = stats['blocks'] / elapsed_seconds
+    merged['stats'] = stats
+  return merged
@@ -0,0 +1,177 @@
+# Copyright 2023 Google Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#    http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+from os import path
+
+from gematria.datasets.python import input_shard
+import tensorflow as tf
+
+_LINES = (
+    '4829d38b44246c8b54246848c1fb034829d04839c3,10',
+    '3b31,45.36',
+    '',
+    '4889de4889c24c89ff,91.31',
+    '418b4424084d8b3c2489442418,74.00',
+    '48895c2428,11.06',
+)
+
+
+def _manifest(shard_index, num_shards, begin_offset, end_offset, **kwargs):
+  manifest = {
+      'tool': 'tool',
+      'input': 'input.csv',
+      'shard_index': shard_index,
+      'num_shards': num_shards,
+      'begin_offset': begin_offset,
+      'end_offset': end_offset,
+      'num_lines': 2,
+      'num_blocks': 1,
+      'output_files': [f'output-{shard_index}'],
+  }
+  manifest.update(kwargs)
+  return manifest
+
+
+class ShardFileNameTest(tf.test.TestCase):
+
+  def test_names(self):
+    self.assertEqual(
+        input_shard.shard_file_name('/tmp/skl.tfrecord', 0, 1),
+        '/tmp/skl.tfrecord',
+    )
+    self.assertEqual(
+        input_shard.shard_file_name('/tmp/skl.tfrecord', 3, 16),
+        '/tmp/skl.tfrecord-00003-of-00016',
+    )
+
+
+class ShardedLineReaderTest(tf.test.TestCase):
+
+  def _write_input(self, contents):
+    input_path = path.join(self.create_tempdir().full_path, 'input.csv')
+    with tf.io.gfile.GFile(input_path, 'w') as input_file:
+      input_file.write(contents)
+    return input_path
+
+  def _read_all_shards(self, input_path, num_shards):
+    lines = []
+    for shard in range(num_shards):
+      lines.extend(input_shard.ShardedLineReader(input_path, shard, num_shards))
+    return lines
+
+  def test_shards_partition_lines(self):
+    contents = '\n'.join(_LINES) + '\n'
+    input_path = self._write_input(contents)
+    for num_shards in range(1, len(contents) + 4):
+      self.assertSequenceEqual(
+          self._read_all_shards(input_path, num_shards), _LINES
+      )
+
+  def test_no_final_end_of_line(self):
+    input_path = self._write_input('first\nsecond\nthird')
+    for num_shards in range(1, 20):
+      self.assertSequenceEqual(
+          self._read_all_shards(input_path, num_shards),
+          ('first', 'second', 'third'),
+      )
+
+  def test_offsets_and_num_lines(self):
+    input_path = self._write_input('first\nsecond\nthird\n')
+    reader = input_shard.ShardedLineReader(input_path, 1, 2)
+    self.assertEqual(reader.begin_offset, 9)
+    self.assertEqual(reader.end_offset, 19)
+    self.assertSequenceEqual(list(reader), ('third',))
+    self.assertEqual(reader.num_lines, 1)
+
+  def test_invalid_shard(self):
+    input_path = self._write_input('first\n')
+    with self.assertRaises(input_shard.ShardError):
+      input_shard.ShardedLineReader(input_path, 2, 2)
+
+
+class MergeManifestsTest(tf.test.TestCase):
+
+  def test_merge(self):
+    merged = input_shard.merge_manifests((
+        _manifest(
+            1,
+            2,
+            10,
+            25,
+            stats={
+                'blocks': 1,
+                'elapsed_seconds': 4.0,
+                'stages': {'annotate': {'failures': {'INTERNAL': 1}}},
+            },
+        ),
+        _manifest(
+            0,
+            2,
+            0,
+            10,
+            stats={
+                'blocks': 3,
+                'elapsed_seconds': 2.0,
+                'blocks_per_second': 1.5,
+                'stages': {'annotate': {'failures': {'INTERNAL': 2}}},
+            },
+        ),
+    ))
+    self.assertEqual(
+        merged,
+        {
+            'tool': 'tool',
+            'input': 'input.csv',
+            'num_shards': 2,
+            'size': 25,
+            'num_lines': 4,
+            'num_blocks': 2,
+            'output_files': ['output-0', 'output-1'],
+            'stats': {
+                'blocks': 4,
+                'elapsed_seconds': 4.0,
+                'blocks_per_second': 1.0,
+                'stages': {'annotate': {'failures': {'INTERNAL': 3}}},
+            },
+        },
+    )
+
+  def test_missing_shard(self):
+    with self.assertRaises(input_shard.ShardError):
+      input_shard.merge_manifests(
+          (_manifest(0, 3, 0, 10), _manifest(2, 3, 20, 30))
+      )
+
+  def test_duplicate_shard(self):
+    with self.assertRaises(input_shard.ShardError):
+      input_shard.merge_manifests(
+          (_manifest(0, 2, 0, 10), _manifest(0, 2, 0, 10))
+      )
+
+  def test_gap_between_shards(self):
+    with self.assertRaises(input_shard.ShardError):
+      input_shard.merge_manifests(
+          (_manifest(0, 2, 0, 10), _manifest(1, 2, 12, 30))
+      )
+
+  def test_different_inputs(self):
+    with self.assertRaises(input_shard.ShardError):
+      input_shard.merge_manifests((
+          _manifest(0, 2, 0, 10),
+          _manifest(1, 2, 10, 30, input='other.csv'),
+      ))
+
+
+if __name__ == '__main__':
+  tf.test.main()
@@ -0,0 +1,95 @@
+# Copyright 2023 Google Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#    http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+r"""Combines the shard manifests of a sharded run of a data set tool.
+
+Checks that the manifests written with --shard_manifest (or
+--gematria_shard_manifest) by all shards of a run of import_from_bhive,
+convert_bhive_to_llvm_exegesis_input or find_accessed_addrs_from_bhive cover
+the whole input file exactly once, and writes a manifest of the whole run with
+the summed counters and stats and the output files of all shards in the order
+of the input file.
+
+Usage:
+  merge_shard_manifests \
+      --gematria_shard_manifests=/tmp/skl/0.json,/tmp/skl/1.json \
+      --gematria_merged_manifest=/tmp/skl/manifest.json \
+      --gematria_concatenated_output=/tmp/skl.tfrecord
+"""
+
+from collections.abc import Sequence
+import json
+
+from absl import app
+from absl import flags
+from absl import logging
+from gematria.datasets.python import input_shard
+import tensorflow as tf
+
+_SHARD_MANIFESTS = flags.DEFINE_list(
+    'gematria_shard_manifests',
+    None,
+    'The manifests of all shards of the run, in any order.',
+    required=True,
+)
+_MERGED_MANIFEST = flags.DEFINE_string(
+    'gematria_merged_manifest',
+    None,
+    'The name of the file to which the manifest of the whole run is written.',
+    required=True,
+)
+_CONCATENATED_OUTPUT = flags.DEFINE_string(
+    'gematria_concatenated_output',
+    None,
+    'When set, the output files of all shards are concatenated to this file,'
+    ' in the order of the input file. Valid only for outputs that can be'
+    ' concatenated byte by byte, such as TFRecord files and CSV files; not for'
+    ' the JSON files of convert_bhive_to_llvm_exegesis_input.',
+)
+
+# The size of the chunks in which the output files are copied.
+_COPY_CHUNK_SIZE = 1 << 24
+
+
+def main(argv: Sequence[str]) -> None:
+  if len(argv) > 1:
+    raise app.UsageError('Too many command-line arguments.')
+  manifests = [
+      input_shard.load_manifest(path) for path in _SHARD_MANIFESTS.value
+  ]
+  merged = input_shard.merge_manifests(manifests)
+  logging.info(
+      'Merged %d shards with %d blocks and %d output files.',
+      merged['num_shards'],
+      merged['num_blocks'],
+      len(merged['output_files']),
+  )
+
+  if _CONCATENATED_OUTPUT.value:
+    with tf.io.gfile.GFile(_CONCATENATED_OUTPUT.value, 'wb') as output_file:
+      for shard_output in merged['output_files']:
+        with tf.io.gfile.GFile(shard_output, 'rb') as shard_file:
+          while True:
+            chunk = shard_file.read(_COPY_CHUNK_SIZE)
+            if not chunk:
+              break
+            output_file.write(chunk)
+    merged['output_files'] = [_CONCATENATED_OUTPUT.value]
+
+  with tf.io.gfile.GFile(_MERGED_MANIFEST.value, 'w') as manifest_file:
+    manifest_file.write(json.dumps(merged, separators=(',', ':')) + '\n')
+
+
+if __name__ == '__main__':
+  app.run(main)
@@ -0,0 +1,209 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Benchmarks of access patterns where multiple threads write to the same
+// memory, and performance is dominated by the cache coherence traffic.
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "absl/base/optimization.h"
+#include "benchmark/benchmark.h"
+#include "gematria/experiments/access_pattern_bm/numa.h"
+
+namespace gematria {
+namespace {
+
+// The maximal number of threads used by the benchmarks.
+constexpr int kMaxThreads = 16;
+
+// The number of increments or queue operations done by each thread in one
+// iteration of a benchmark.
+constexpr int kOperationsPerIteration = 1024;
+
+// Skips the benchmark when the NUMA nodes requested by `state.range(0)` (the
+// node of the data) and `state.range(1)` (the node of the threads) are not
+// available, and pins the calling thread to its node. Returns false when the
+// benchmark was skipped.
+bool PinBenchmarkThread(benchmark::State &state,
+                        std::unique_ptr<ScopedNumaNodeAffinity> &affinity) {
+  const int data_node = state.range(0);
+  const int thread_node = state.range(1);
+  if (!HasNumaNodes(data_node) || !HasNumaNodes(thread_node)) {
+    state.SkipWithError("The NUMA nodes are not available");
+    return false;
+  }
+  affinity = std::make_unique<ScopedNumaNodeAffinity>(
+      NumaNodeForThread(thread_node, state.thread_index()));
+  if (!affinity->ok()) {
+    state.SkipWithError("Could not run on the NUMA node");
+    return false;
+  }
+  return true;
+}
+
+// A counter that shares its cache line with the counters of other threads.
+struct UnpaddedCounter {
+  std::atomic<int64_t> value;
+};
+
+// A counter that has a cache line for itself.
+struct alignas(ABSL_CACHELINE_SIZE) PaddedCounter {
+  std::atomic<int64_t> value;
+};
+
+// The counters used by BM_Counters<Counter>, one per thread.
+template <typename Counter>
+std::unique_ptr<Counter[]> shared_counters;
+
+template <typename Counter>
+void SetUpCounters(const benchmark::State &state) {
+  // The counters are initialized on the CPUs of the data node, which places
+  // them on that node.
+  ScopedNumaNodeAffinity affinity(state.range(0));
+  shared_counters<Counter> = std::make_unique<Counter[]>(kMaxThreads);
+}
+
+template <typename Counter>
+void TearDownCounters(const benchmark::State &state) {
+  shared_counters<Counter>.reset();
+}
+
+// Each thread increments its own counter. The increments are plain loads and
+// stores rather than atomic read-modify-write operations, so that the time is
+// dominated by the transfers of the cache lines between the cores: with
+// UnpaddedCounter, the counters of different threads share cache lines (false
+// sharing); with PaddedCounter, they don't.
+template <typename Counter>
+void BM_Counters(benchmark::State &state) {
+  std::unique_ptr<ScopedNumaNodeAffinity> affinity;
+  if (!PinBenchmarkThread(state, affinity)) return;
+  std::atomic<int64_t> &counter =
+      shared_counters<Counter>[state.thread_index()].value;
+
+  for (auto _ : state) {
+    for (int i = 0; i < kOperationsPerIteration; ++i) {
+      counter.store(counter.load(std::memory_order_relaxed) + 1,
+                    std::memory_order_relaxed);
+    }
+  }
+}
+
+BENCHMARK(BM_Counters<UnpaddedCounter>)
+    ->Setup(SetUpCounters<UnpaddedCounter>)
+    ->Teardown(TearDownCounters<UnpaddedCounter>)
+    ->ArgsProduct({{kNoNumaNode, 0}, {kNoNumaNode, 0, 1, kAlternateNumaNodes}})
+    ->ThreadRange(1, kMaxThreads);
+BENCHMARK(BM_Counters<PaddedCounter>)
+    ->Setup(SetUpCounters<PaddedCounter>)
+    ->Teardown(TearDownCounters<PaddedCounter>)
+    ->ArgsProduct({{kNoNumaNode, 0}, {kNoNumaNode, 0, 1, kAlternateNumaNodes}})
+    ->ThreadRange(1, kMaxThreads);
+
+// All threads atomically increment the same counter (true sharing).
+void BM_SharedAtomicCounter(benchmark::State &state) {
+  std::unique_ptr<ScopedNumaNodeAffinity> affinity;
+  if (!PinBenchmarkThread(state, affinity)) return;
+  std::atomic<int64_t> &counter = shared_counters<PaddedCounter>[0].value;
+
+  for (auto _ : state) {
+    for (int i = 0; i < kOperationsPerIteration; ++i) {
+      counter.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+}
+
+BENCHMARK(BM_SharedAtomicCounter)
+    ->Setup(SetUpCounters<PaddedCounter>)
+    ->Teardown(TearDownCounters<PaddedCounter>)
+    ->ArgsProduct({{kNoNumaNode, 0}, {kNoNumaNode, 0, 1, kAlternateNumaNodes}})
+    ->ThreadRange(1, kMaxThreads);
+
+// A single-producer single-consumer ring buffer of integers. The indices are
+// on separate cache lines, so that the producer and the consumer exchange only
+// the cache lines with the items and the index written by the other side.
+class SpscQueue {
+ public:
+  static constexpr int kCapacity = 1024;
+
+  // Adds `value` to the queue; spins while the queue is full.
+  void Push(int value) {
+    const int64_t tail = tail_.load(std::memory_order_relaxed);
+    while (tail - head_.load(std::memory_order_acquire) == kCapacity) {
+    }
+    items_[tail % kCapacity] = value;
+    tail_.store(tail + 1, std::memory_order_release);
+  }
+
+  // Removes and returns the oldest value in the queue; spins while the queue
+  // is empty.
+  int Pop() {
+    const int64_t head = head_.load(std::memory_order_relaxed);
+    while (tail_.load(std::memory_order_acquire) == head) {
+    }
+    const int value = items_[head % kCapacity];
+    head_.store(head + 1, std::memory_order_release);
+    return value;
+  }
+
+ private:
+  alignas(ABSL_CACHELINE_SIZE) std::atomic<int64_t> head_ = 0;
+  alignas(ABSL_CACHELINE_SIZE) std::atomic<int64_t> tail_ = 0;
+  alignas(ABSL_CACHELINE_SIZE) int items_[kCapacity];
+};
+
+// The queues used by BM_ProducerConsumer, one per pair of threads.
+std::unique_ptr<SpscQueue[]> shared_queues;
+
+void SetUpQueues(const benchmark::State &state) {
+  // The queues are initialized on the CPUs of the data node, which places them
+  // on that node.
+  ScopedNumaNodeAffinity affinity(state.range(0));
+  shared_queues = std::make_unique<SpscQueue[]>(kMaxThreads / 2);
+}
+
+void TearDownQueues(const benchmark::State &state) { shared_queues.reset(); }
+
+// Pairs of threads pass integers through a queue: the thread with an even
+// index is the producer and the next thread is the consumer. All threads run
+// the same number of iterations, so each consumer pops exactly the items pushed
+// by its producer. With kAlternateNumaNodes, the producer and the consumer of
+// each pair run on different NUMA nodes.
+void BM_ProducerConsumer(benchmark::State &state) {
+  std::unique_ptr<ScopedNumaNodeAffinity> affinity;
+  if (!PinBenchmarkThread(state, affinity)) return;
+  SpscQueue &queue = shared_queues[state.thread_index() / 2];
+  const bool is_producer = state.thread_index() % 2 == 0;
+
+  for (auto _ : state) {
+    if (is_producer) {
+      for (int i = 0; i < kOperationsPerIteration; ++i) queue.Push(i);
+    } else {
+      int sum = 0;
+      for (int i = 0; i < kOperationsPerIteration; ++i) sum += queue.Pop();
+      benchmark::DoNotOptimize(sum);
+    }
+  }
+}
+
+BENCHMARK(BM_ProducerConsumer)
+    ->Setup(SetUpQueues)
+    ->Teardown(TearDownQueues)
+    ->ArgsProduct({{kNoNumaNode, 0}, {kNoNumaNode, 0, 1, kAlternateNumaNodes}})
+    ->DenseThreadRange(2, kMaxThreads, 2);
+
+}  // namespace
+}  // namespace gematria
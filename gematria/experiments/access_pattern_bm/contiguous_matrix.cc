@@ -14,28 +14,42 @@
 
 #include "gematria/experiments/access_pattern_bm/contiguous_matrix.h"
 
-#include <immintrin.h>
-
+#include <cstddef>
 #include <memory>
 #include <random>
 
-#include "absl/base/optimization.h"
+#include "gematria/experiments/access_pattern_bm/flush.h"
+#include "gematria/experiments/access_pattern_bm/memory_backend.h"
 
 namespace gematria {
+namespace {
 
-// Creates a size x size matrix, as an array of (size * size) random integers.
-std::unique_ptr<int[]> CreateRandomContiguousMatrix(const std::size_t size) {
+// Fills the size x size matrix `matrix` with random integers.
+void FillRandomContiguousMatrix(int *matrix, const std::size_t size) {
   std::default_random_engine generator;
   std::uniform_int_distribution<int> distribution(0, 1023);
 
-  auto matrix = std::make_unique<int[]>(size * size);
-
   for (int i = 0; i < size; ++i) {
     for (int j = 0; j < size; ++j) {
       matrix[size * i + j] = distribution(generator);
     }
   }
+}
 
+}  // namespace
+
+// Creates a size x size matrix, as an array of (size * size) random integers.
+std::unique_ptr<int[]> CreateRandomContiguousMatrix(const std::size_t size) {
+  auto matrix = std::make_unique<int[]>(size * size);
+  FillRandomContiguousMatrix(matrix.get(), size);
+  return matrix;
+}
+
+BackedArray<int> CreateRandomContiguousMatrix(const std::size_t size,
+                                              const MemoryBackend backend) {
+  auto matrix = CastBackedArray<int>(
+      AllocateMemory(size * size * sizeof(int), backend));
+  if (matrix != nullptr) FillRandomContiguousMatrix(matrix.get(), size);
   return matrix;
 }
 
@@ -44,15 +58,9 @@ std::unique_ptr<int[]> CreateRandomContiguousMatrix(const std::size_t size) {
 // holding size * size ints).
 void FlushContiguousMatrixFromCache(const void *matrix,
                                     const std::size_t size) {
-  constexpr int line_size = ABSL_CACHELINE_SIZE;
-  const char *begin = reinterpret_cast<const char *>(matrix);
-  const char *end = begin + size * size * sizeof(int);
-
-  _mm_mfence();
-  for (; begin < end; begin += line_size) {
-    _mm_clflushopt(begin);
-  }
-  _mm_mfence();
+  CacheFlusher flusher;
+  if (!flusher.needs_elements()) return;
+  flusher.FlushRange(matrix, size * size * sizeof(int));
 }
 
 }  // namespace gematria
@@ -15,11 +15,18 @@
 #ifndef GEMATRIA_EXPERIMENTS_ACCESS_PATTERN_BM_CONTIGUOUS_MATRIX_H_
 #define GEMATRIA_EXPERIMENTS_ACCESS_PATTERN_BM_CONTIGUOUS_MATRIX_H_
 
+#include <cstddef>
 #include <memory>
 
+#include "gematria/experiments/access_pattern_bm/memory_backend.h"
+
 namespace gematria {
 
 std::unique_ptr<int[]> CreateRandomContiguousMatrix(std::size_t size);
+// Creates the same matrix as above, but allocated from `backend`. Returns
+// nullptr when the memory can't be allocated.
+BackedArray<int> CreateRandomContiguousMatrix(std::size_t size,
+                                              MemoryBackend backend);
 void FlushContiguousMatrixFromCache(const void *matrix, std::size_t size);
 
 }  // namespace gematria
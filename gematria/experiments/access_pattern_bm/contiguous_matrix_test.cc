@@ -14,12 +14,18 @@
 
 #include "gematria/experiments/access_pattern_bm/contiguous_matrix.h"
 
+#include <immintrin.h>
+
+#include <algorithm>
 #include <cstddef>
 #include <cstdint>
 #include <memory>
+#include <string>
 
 #include "benchmark/benchmark.h"
 #include "gematria/experiments/access_pattern_bm/configuration.h"
+#include "gematria/experiments/access_pattern_bm/memory_backend.h"
+#include "gematria/experiments/access_pattern_bm/numa.h"
 
 namespace gematria {
 namespace {
@@ -93,5 +99,219 @@ void BM_ContiguousMatrix_Flush(benchmark::State &state) {
 
 BENCHMARK(BM_ContiguousMatrix_Flush)->Range(1 << 4, 1 << 12);
 
+// Runs `traverse(matrix, size)` on a random size x size matrix in each
+// iteration of the benchmark, where `size` is `state.range(0)`. When `flush` is
+// true, flushes the matrix from the caches before each traversal; otherwise,
+// flushes a mock matrix when kBalanceFlushingTime is set.
+template <typename Traversal>
+void RunContiguousMatrixBenchmark(benchmark::State &state, bool flush,
+                                  const Traversal &traverse) {
+  const std::size_t size = state.range(0);
+
+  // Create a random matrix.
+  auto matrix = CreateRandomContiguousMatrix(size);
+  std::unique_ptr<int[]> mock;
+  if (!flush && kBalanceFlushingTime) {
+    mock = CreateRandomContiguousMatrix(size);
+  }
+
+  for (auto _ : state) {
+    if (flush || kBalanceFlushingTime) {
+      state.PauseTiming();
+      FlushContiguousMatrixFromCache(flush ? matrix.get() : mock.get(), size);
+      state.ResumeTiming();
+    }
+
+    benchmark::DoNotOptimize(traverse(matrix.get(), size));
+  }
+}
+
+// Sums all elements of the matrix, visiting every `stride`-th element of the
+// underlying array in each pass. A stride of one is a row-major traversal, and
+// a stride of `size` is a column-major traversal.
+int64_t SumStrided(const int *matrix, std::size_t size, std::size_t stride) {
+  int64_t sum = 0;
+  for (std::size_t begin = 0; begin < stride; ++begin) {
+    for (std::size_t i = begin; i < size * size; i += stride) {
+      sum += matrix[i];
+    }
+  }
+  return sum;
+}
+
+// Traverses the matrix with the stride `state.range(1)`; zero means a
+// column-major traversal.
+void BM_ContiguousMatrix_Strided(benchmark::State &state, bool flush) {
+  const std::size_t stride =
+      state.range(1) == 0 ? state.range(0) : state.range(1);
+  RunContiguousMatrixBenchmark(
+      state, flush, [stride](const int *matrix, std::size_t size) {
+        return SumStrided(matrix, size, stride);
+      });
+}
+
+BENCHMARK_CAPTURE(BM_ContiguousMatrix_Strided, NoFlush, false)
+    ->ArgsProduct({benchmark::CreateRange(1 << 6, 1 << 12, 8),
+                   {1, 2, 16, 64, 0}});
+BENCHMARK_CAPTURE(BM_ContiguousMatrix_Strided, Flush, true)
+    ->ArgsProduct({benchmark::CreateRange(1 << 6, 1 << 12, 8),
+                   {1, 2, 16, 64, 0}});
+
+// Sums all elements of the matrix, visiting it in row-major order of
+// `tile_size` x `tile_size` tiles, and in column-major order inside each tile.
+int64_t SumTiled(const int *matrix, std::size_t size, std::size_t tile_size) {
+  int64_t sum = 0;
+  for (std::size_t tile_i = 0; tile_i < size; tile_i += tile_size) {
+    const std::size_t end_i = std::min(tile_i + tile_size, size);
+    for (std::size_t tile_j = 0; tile_j < size; tile_j += tile_size) {
+      const std::size_t end_j = std::min(tile_j + tile_size, size);
+      for (std::size_t j = tile_j; j < end_j; ++j) {
+        for (std::size_t i = tile_i; i < end_i; ++i) {
+          sum += matrix[size * i + j];
+        }
+      }
+    }
+  }
+  return sum;
+}
+
+// Traverses the matrix in tiles of `state.range(1)` x `state.range(1)`
+// elements.
+void BM_ContiguousMatrix_Tiled(benchmark::State &state, bool flush) {
+  const std::size_t tile_size = state.range(1);
+  RunContiguousMatrixBenchmark(
+      state, flush, [tile_size](const int *matrix, std::size_t size) {
+        return SumTiled(matrix, size, tile_size);
+      });
+}
+
+BENCHMARK_CAPTURE(BM_ContiguousMatrix_Tiled, NoFlush, false)
+    ->ArgsProduct({benchmark::CreateRange(1 << 6, 1 << 12, 8),
+                   {4, 16, 64, 256}});
+BENCHMARK_CAPTURE(BM_ContiguousMatrix_Tiled, Flush, true)
+    ->ArgsProduct({benchmark::CreateRange(1 << 6, 1 << 12, 8),
+                   {4, 16, 64, 256}});
+
+// Sums all elements of the matrix in column-major order, and prefetches the
+// element `distance` rows below the current one. A distance of zero disables
+// the software prefetch.
+int64_t SumColumnMajorWithPrefetch(const int *matrix, std::size_t size,
+                                   std::size_t distance) {
+  int64_t sum = 0;
+  for (std::size_t j = 0; j < size; ++j) {
+    for (std::size_t i = 0; i < size; ++i) {
+      if (distance > 0 && i + distance < size) {
+        _mm_prefetch(reinterpret_cast<const char *>(
+                         &matrix[size * (i + distance) + j]),
+                     _MM_HINT_T0);
+      }
+      sum += matrix[size * i + j];
+    }
+  }
+  return sum;
+}
+
+// Traverses the matrix in column-major order with software prefetches
+// `state.range(1)` rows ahead.
+void BM_ContiguousMatrix_Prefetch(benchmark::State &state, bool flush) {
+  const std::size_t distance = state.range(1);
+  RunContiguousMatrixBenchmark(
+      state, flush, [distance](const int *matrix, std::size_t size) {
+        return SumColumnMajorWithPrefetch(matrix, size, distance);
+      });
+}
+
+BENCHMARK_CAPTURE(BM_ContiguousMatrix_Prefetch, NoFlush, false)
+    ->ArgsProduct({benchmark::CreateRange(1 << 6, 1 << 12, 8),
+                   {0, 1, 4, 16, 64}});
+BENCHMARK_CAPTURE(BM_ContiguousMatrix_Prefetch, Flush, true)
+    ->ArgsProduct({benchmark::CreateRange(1 << 6, 1 << 12, 8),
+                   {0, 1, 4, 16, 64}});
+
+// Traverses a matrix allocated from the memory backend `state.range(1)` in
+// column-major order. Every access of a big matrix touches a different page, so
+// the difference between the backends is the cost of the TLB misses.
+void BM_ContiguousMatrix_Backend(benchmark::State &state, bool flush) {
+  const std::size_t size = state.range(0);
+  const auto backend = static_cast<MemoryBackend>(state.range(1));
+
+  auto matrix = CreateRandomContiguousMatrix(size, backend);
+  if (matrix == nullptr) {
+    state.SkipWithError("Could not allocate the matrix");
+    return;
+  }
+  state.SetLabel(std::string(MemoryBackendName(backend)));
+
+  for (auto _ : state) {
+    if (flush) {
+      state.PauseTiming();
+      FlushContiguousMatrixFromCache(matrix.get(), size);
+      state.ResumeTiming();
+    }
+
+    benchmark::DoNotOptimize(SumStrided(matrix.get(), size, size));
+  }
+}
+
+BENCHMARK_CAPTURE(BM_ContiguousMatrix_Backend, NoFlush, false)
+    ->ArgsProduct({benchmark::CreateRange(1 << 6, 1 << 12, 8), {0, 1, 2, 3}});
+BENCHMARK_CAPTURE(BM_ContiguousMatrix_Backend, Flush, true)
+    ->ArgsProduct({benchmark::CreateRange(1 << 6, 1 << 12, 8), {0, 1, 2, 3}});
+
+// The matrix shared by all threads of BM_ContiguousMatrix_Shared.
+std::unique_ptr<int[]> shared_matrix;
+
+void SetUpSharedContiguousMatrix(const benchmark::State &state) {
+  // The matrix is initialized on the CPUs of the data node, which places its
+  // pages on that node.
+  ScopedNumaNodeAffinity affinity(state.range(1));
+  shared_matrix = CreateRandomContiguousMatrix(state.range(0));
+}
+
+void TearDownSharedContiguousMatrix(const benchmark::State &state) {
+  shared_matrix.reset();
+}
+
+// Loops over a matrix shared by all threads of the benchmark. `state.range(1)`
+// is the NUMA node that holds the matrix and `state.range(2)` the NUMA node on
+// which the threads run.
+void BM_ContiguousMatrix_Shared(benchmark::State &state) {
+  const std::size_t size = state.range(0);
+  const int data_node = state.range(1);
+  const int thread_node = state.range(2);
+  if (!HasNumaNodes(data_node) || !HasNumaNodes(thread_node)) {
+    state.SkipWithError("The NUMA nodes are not available");
+    return;
+  }
+  ScopedNumaNodeAffinity affinity(
+      NumaNodeForThread(thread_node, state.thread_index()));
+  if (!affinity.ok()) {
+    state.SkipWithError("Could not run on the NUMA node");
+    return;
+  }
+  const int *const matrix = shared_matrix.get();
+
+  for (auto _ : state) {
+    int64_t sum = 0;
+
+    // Loop over the matrix, doing some dummy operations along the way.
+    for (int i = 0; i < size; ++i) {
+      for (int j = 0; j < size; ++j) {
+        sum += matrix[size * i + j];
+      }
+    }
+
+    benchmark::DoNotOptimize(sum);
+  }
+}
+
+BENCHMARK(BM_ContiguousMatrix_Shared)
+    ->Setup(SetUpSharedContiguousMatrix)
+    ->Teardown(TearDownSharedContiguousMatrix)
+    ->ArgsProduct({benchmark::CreateRange(1 << 6, 1 << 12, 8),
+                   {kNoNumaNode, 0},
+                   {kNoNumaNode, 0, 1, kAlternateNumaNodes}})
+    ->ThreadRange(1, 8);
+
 }  // namespace
 }  // namespace gematria
@@ -0,0 +1,77 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/experiments/access_pattern_bm/flush.h"
+
+#include <immintrin.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <string_view>
+
+#include "absl/base/optimization.h"
+
+namespace gematria {
+namespace {
+
+// The size of the last level cache used when it can't be detected.
+constexpr std::size_t kDefaultLastLevelCacheSize = 64 << 20;
+
+std::size_t GetLastLevelCacheSize() {
+  const long size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+  return size > 0 ? size : kDefaultLastLevelCacheSize;
+}
+
+}  // namespace
+
+FlushStrategy GetFlushStrategy() {
+  static const FlushStrategy strategy = [] {
+    const char *const value = std::getenv(kFlushStrategyEnvironmentVariable);
+    const std::string_view name = value == nullptr ? "" : value;
+    if (name.empty() || name == "cache_line") {
+      return FlushStrategy::kPerCacheLine;
+    }
+    if (name == "element") return FlushStrategy::kPerElement;
+    if (name == "eviction_buffer") return FlushStrategy::kEvictionBuffer;
+    std::fprintf(stderr,
+                 "Unknown flush strategy %s=%s, expected one of cache_line, "
+                 "element, eviction_buffer\n",
+                 kFlushStrategyEnvironmentVariable, value);
+    std::abort();
+  }();
+  return strategy;
+}
+
+void EvictCachesWithBuffer() {
+  static const std::size_t buffer_size = 2 * GetLastLevelCacheSize();
+  static char *const buffer = new char[buffer_size]();
+  // The writes go through a volatile pointer, so that the compiler can't
+  // remove them; writing (rather than reading) also evicts the lines that were
+  // modified by the benchmark.
+  volatile char *const lines = buffer;
+  _mm_mfence();
+  for (std::size_t i = 0; i < buffer_size; i += ABSL_CACHELINE_SIZE) {
+    lines[i] = lines[i] + 1;
+  }
+  _mm_mfence();
+}
+
+CacheFlusher::CacheFlusher() : strategy_(GetFlushStrategy()) {
+  _mm_mfence();
+  if (strategy_ == FlushStrategy::kEvictionBuffer) EvictCachesWithBuffer();
+}
+
+}  // namespace gematria
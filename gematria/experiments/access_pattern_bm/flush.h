@@ -0,0 +1,115 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Contains the strategies used by the benchmarks for flushing their data
+// structures from the caches. The strategy is selected at run time with the
+// environment variable GEMATRIA_FLUSH_STRATEGY, see the README for the
+// available values.
+
+#ifndef GEMATRIA_EXPERIMENTS_ACCESS_PATTERN_BM_FLUSH_H_
+#define GEMATRIA_EXPERIMENTS_ACCESS_PATTERN_BM_FLUSH_H_
+
+#include <immintrin.h>
+
+#include <cstddef>
+#include <cstdint>
+
+#include "absl/base/optimization.h"
+
+namespace gematria {
+
+enum class FlushStrategy {
+  // Flushes the first cache line of every element of the data structure with
+  // _mm_clflushopt.
+  kPerElement,
+  // Flushes every cache line of every element of the data structure with
+  // _mm_clflushopt, and skips the lines flushed just before. This makes the
+  // flush of data structures with small, mostly consecutive elements (e.g.
+  // std::deque<int> or naturally allocated linked lists) several times cheaper,
+  // and also flushes elements that span several cache lines. This is the
+  // default strategy.
+  kPerCacheLine,
+  // Evicts the whole cache hierarchy by writing to a buffer bigger than the
+  // last level cache, without looking at the data structure. The cost does not
+  // depend on the size of the data structure, which makes it the fastest
+  // strategy for large data structures.
+  kEvictionBuffer,
+};
+
+// The name of the environment variable that selects the flush strategy.
+inline constexpr char kFlushStrategyEnvironmentVariable[] =
+    "GEMATRIA_FLUSH_STRATEGY";
+
+// Returns the flush strategy selected by the environment variable
+// GEMATRIA_FLUSH_STRATEGY. The variable is read on the first call. Aborts when
+// the variable contains an unknown strategy.
+FlushStrategy GetFlushStrategy();
+
+// Evicts all data from the caches by writing to each cache line of a buffer
+// that is twice as big as the last level cache.
+void EvictCachesWithBuffer();
+
+// Flushes a data structure from the caches using the strategy returned by
+// GetFlushStrategy(). The flush starts in the constructor and ends in the
+// destructor; between them, the caller passes the elements or the contiguous
+// allocations of the data structure to Flush() and FlushRange() unless
+// needs_elements() is false.
+class CacheFlusher {
+ public:
+  CacheFlusher();
+  CacheFlusher(const CacheFlusher &) = delete;
+  CacheFlusher &operator=(const CacheFlusher &) = delete;
+  ~CacheFlusher() { _mm_mfence(); }
+
+  // Returns true when the strategy needs the addresses of the elements. When
+  // false, the caches were already evicted in the constructor, and the caller
+  // can skip walking the data structure.
+  bool needs_elements() const {
+    return strategy_ != FlushStrategy::kEvictionBuffer;
+  }
+
+  // Flushes `element` from the caches.
+  template <typename T>
+  void Flush(const T *element) {
+    if (strategy_ == FlushStrategy::kPerElement) {
+      _mm_clflushopt(element);
+    } else {
+      FlushRange(element, sizeof(T));
+    }
+  }
+
+  // Flushes every cache line of the `num_bytes` bytes starting at `begin`, and
+  // skips the line flushed just before, if it is the first line of the range.
+  // Used for contiguous allocations, where all strategies flush line by line.
+  void FlushRange(const void *begin, std::size_t num_bytes) {
+    if (num_bytes == 0) return;
+    const uintptr_t address = reinterpret_cast<uintptr_t>(begin);
+    uintptr_t line = address / ABSL_CACHELINE_SIZE;
+    const uintptr_t last_line = (address + num_bytes - 1) / ABSL_CACHELINE_SIZE;
+    if (line == last_line_) ++line;
+    for (; line <= last_line; ++line) {
+      _mm_clflushopt(
+          reinterpret_cast<const void *>(line * ABSL_CACHELINE_SIZE));
+    }
+    last_line_ = last_line;
+  }
+
+ private:
+  const FlushStrategy strategy_;
+  uintptr_t last_line_ = ~uintptr_t{0};
+};
+
+}  // namespace gematria
+
+#endif  // GEMATRIA_EXPERIMENTS_ACCESS_PATTERN_BM_FLUSH_H_
@@ -14,10 +14,17 @@
 
 #include "gematria/experiments/access_pattern_bm/linked_list.h"
 
-#include <immintrin.h>
-
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
 #include <memory>
+#include <new>
+#include <numeric>
 #include <random>
+#include <vector>
+
+#include "gematria/experiments/access_pattern_bm/flush.h"
+#include "gematria/experiments/access_pattern_bm/memory_backend.h"
 
 namespace gematria {
 
@@ -32,16 +39,54 @@ std::unique_ptr<Node, NodeDeleter> CreateRandomLinkedList(
   return std::unique_ptr<Node, NodeDeleter>(head);
 }
 
+PooledLinkedList CreateRandomPooledLinkedList(
+    const std::size_t size, const NodePoolOptions &options) {
+  assert(options.slot_size >= sizeof(Node));
+  assert(options.slot_size % alignof(Node) == 0);
+  const std::size_t num_slots = options.pool_size == 0
+                                    ? size
+                                    : options.pool_size / options.slot_size;
+  assert(num_slots >= size);
+
+  std::default_random_engine generator;
+  std::uniform_int_distribution<int> distribution(0, kMaxRandomListValue);
+
+  // Pick the slots used by the nodes, in the order in which they are linked.
+  std::vector<std::size_t> slots(num_slots);
+  std::iota(slots.begin(), slots.end(), 0);
+  if (options.shuffle || num_slots > size) {
+    std::shuffle(slots.begin(), slots.end(), generator);
+  }
+  slots.resize(size);
+  if (!options.shuffle) std::sort(slots.begin(), slots.end());
+
+  PooledLinkedList list;
+  list.pool = AllocateMemory(num_slots * options.slot_size, options.backend);
+  if (list.pool == nullptr) return list;
+  Node *previous = nullptr;
+  for (const std::size_t slot : slots) {
+    Node *const node = new (list.pool.get() + slot * options.slot_size)
+        Node{.next = nullptr, .value = distribution(generator)};
+    if (previous == nullptr) {
+      list.head = node;
+    } else {
+      previous->next = node;
+    }
+    previous = node;
+  }
+  return list;
+}
+
 void FlushLinkedListFromCache(const Node *ptr) {
+  CacheFlusher flusher;
+  if (!flusher.needs_elements()) return;
   const Node *current = ptr;
 
-  _mm_mfence();
   while (current) {
     const Node *temp = current->next;
-    _mm_clflushopt(current);
+    flusher.Flush(current);
     current = temp;
   }
-  _mm_mfence();
 }
 
 }  // namespace gematria
@@ -15,8 +15,11 @@
 #ifndef GEMATRIA_EXPERIMENTS_ACCESS_PATTERN_BM_LINKED_LIST_H_
 #define GEMATRIA_EXPERIMENTS_ACCESS_PATTERN_BM_LINKED_LIST_H_
 
+#include <cstddef>
 #include <memory>
 
+#include "gematria/experiments/access_pattern_bm/memory_backend.h"
+
 namespace gematria {
 
 constexpr inline int kMaxRandomListValue = 1023;
@@ -37,7 +40,40 @@ struct NodeDeleter {
   }
 };
 
+// Describes the memory layout of the nodes of a pooled linked list. The pool is
+// divided into slots of `slot_size` bytes, and each node of the list occupies
+// the beginning of one slot.
+struct NodePoolOptions {
+  // The size of a slot in bytes, i.e. the minimal distance between two nodes.
+  // Must be at least sizeof(Node) and a multiple of alignof(Node).
+  std::size_t slot_size = sizeof(Node);
+  // The size of the pool in bytes. Zero means a pool with exactly one slot per
+  // node. A bigger pool makes the nodes sparse: they occupy a random subset of
+  // the slots.
+  std::size_t pool_size = 0;
+  // When true, the nodes are linked in a random order of their slots;
+  // otherwise, they are linked in the order of increasing addresses.
+  bool shuffle = true;
+  // The memory backend from which the pool is allocated.
+  MemoryBackend backend = MemoryBackend::kMalloc;
+};
+
+// A linked list whose nodes are allocated from a single memory pool.
+struct PooledLinkedList {
+  Node *head = nullptr;
+  BackedArray<char> pool;
+};
+
 std::unique_ptr<Node, NodeDeleter> CreateRandomLinkedList(std::size_t size);
+
+// Creates a linked list of `size` random values with the node layout described
+// by `options`. Unlike CreateRandomLinkedList(), where consecutive allocations
+// usually make the nodes contiguous, this allows controlling how predictable
+// the addresses of consecutive nodes are for the hardware prefetcher. Returns
+// an empty list when the pool can't be allocated from `options.backend`.
+PooledLinkedList CreateRandomPooledLinkedList(std::size_t size,
+                                              const NodePoolOptions &options);
+
 void FlushLinkedListFromCache(const Node *ptr);
 
 }  // namespace gematria
@@ -14,10 +14,15 @@
 
 #include "gematria/experiments/access_pattern_bm/linked_list.h"
 
+#include <cstddef>
+#include <cstdint>
 #include <memory>
+#include <set>
+#include <string>
 
 #include "benchmark/benchmark.h"
 #include "gematria/experiments/access_pattern_bm/configuration.h"
+#include "gematria/experiments/access_pattern_bm/memory_backend.h"
 #include "gtest/gtest.h"
 
 namespace gematria {
@@ -36,6 +41,43 @@ TEST(LinkedListTest, CreateRandomLinkedList) {
   ASSERT_EQ(head, nullptr);
 }
 
+TEST(LinkedListTest, CreateRandomPooledLinkedList) {
+  constexpr int kSize = 16;
+  const struct {
+    NodePoolOptions options;
+    std::size_t expected_slots;
+  } kTestCases[] = {
+      {{.slot_size = sizeof(Node)}, kSize},
+      {{.slot_size = 64, .shuffle = false}, kSize},
+      {{.slot_size = 4096}, kSize},
+      {{.slot_size = sizeof(Node), .pool_size = 100 * sizeof(Node)}, 100},
+  };
+  for (const auto &test_case : kTestCases) {
+    const NodePoolOptions &options = test_case.options;
+    const PooledLinkedList list = CreateRandomPooledLinkedList(kSize, options);
+    const auto pool_begin = reinterpret_cast<std::uintptr_t>(list.pool.get());
+    std::set<std::size_t> slots;
+    std::size_t previous_slot = 0;
+    const Node *node = list.head;
+    for (int i = 0; i < kSize; ++i) {
+      ASSERT_NE(node, nullptr);
+      EXPECT_GE(node->value, 0);
+      EXPECT_LE(node->value, kMaxRandomListValue);
+      const std::size_t offset =
+          reinterpret_cast<std::uintptr_t>(node) - pool_begin;
+      EXPECT_EQ(offset % options.slot_size, 0);
+      const std::size_t slot = offset / options.slot_size;
+      EXPECT_LT(slot, test_case.expected_slots);
+      if (!options.shuffle && i > 0) EXPECT_GT(slot, previous_slot);
+      previous_slot = slot;
+      slots.insert(slot);
+      node = node->next;
+    }
+    EXPECT_EQ(node, nullptr);
+    EXPECT_EQ(slots.size(), kSize);
+  }
+}
+
 // Times flushing an entire linked list from cache - not sure how Google
 // Benchmark repeating the test changes the results, i.e. what happens when
 // clflush cache misses (which seems to happen a ton).
@@ -85,6 +127,9 @@ void BM_AccessLinkedList_NoFlush(benchmark::State &state) {
 
     benchmark::DoNotOptimize(sum);
   }
+
+  // The loop over the list executes once per node in each iteration.
+  state.counters["block_executions"] = size;
 }
 
 BENCHMARK(BM_AccessLinkedList_NoFlush)->Range(1 << 4, 1 << 20);
@@ -115,9 +160,85 @@ void BM_AccessLinkedList_Flush(benchmark::State &state) {
 
     benchmark::DoNotOptimize(sum);
   }
+
+  // The loop over the list executes once per node in each iteration.
+  state.counters["block_executions"] = size;
 }
 
 BENCHMARK(BM_AccessLinkedList_Flush)->Range(1 << 4, 1 << 20);
 
+// Traverses a pooled linked list with the node layout given by `options` after
+// flushing it from the caches.
+void BM_AccessPooledLinkedList_Flush(benchmark::State &state,
+                                     const NodePoolOptions &options) {
+  const std::size_t size = state.range(0);
+
+  const PooledLinkedList list = CreateRandomPooledLinkedList(size, options);
+  if (list.pool == nullptr) {
+    state.SkipWithError("Could not allocate the node pool");
+    return;
+  }
+
+  for (auto _ : state) {
+    int sum = 0;
+    state.PauseTiming();
+    FlushLinkedListFromCache(list.head);
+    state.ResumeTiming();
+
+    const Node *current = list.head;
+
+    while (current) {
+      sum += current->value;
+      current = current->next;
+    }
+
+    benchmark::DoNotOptimize(sum);
+  }
+
+  // The loop over the list executes once per node in each iteration.
+  state.counters["block_executions"] = size;
+}
+
+// The nodes are densely packed, but linked in a random order.
+BENCHMARK_CAPTURE(BM_AccessPooledLinkedList_Flush, RandomPermutation,
+                  {.slot_size = sizeof(Node)})
+    ->Range(1 << 4, 1 << 20);
+// The nodes are one cache line apart, in the order of increasing addresses, so
+// the accesses have a fixed stride.
+BENCHMARK_CAPTURE(BM_AccessPooledLinkedList_Flush, FixedStride,
+                  {.slot_size = 64, .shuffle = false})
+    ->Range(1 << 4, 1 << 20);
+// Each node is on its own page, and the pages are visited in a random order,
+// so every access crosses a page boundary.
+BENCHMARK_CAPTURE(BM_AccessPooledLinkedList_Flush, PageCrossing,
+                  {.slot_size = 4096})
+    ->Range(1 << 4, 1 << 16);
+
+// Traverses a pooled linked list whose nodes are scattered randomly in an
+// arena of `state.range(1)` bytes; the bigger the arena, the fewer nodes share
+// a cache line or a page.
+void BM_AccessArenaLinkedList_Flush(benchmark::State &state) {
+  BM_AccessPooledLinkedList_Flush(
+      state, {.slot_size = sizeof(Node),
+              .pool_size = static_cast<std::size_t>(state.range(1))});
+}
+
+BENCHMARK(BM_AccessArenaLinkedList_Flush)
+    ->ArgsProduct({benchmark::CreateRange(1 << 4, 1 << 16, 8),
+                   {1 << 20, 1 << 23, 1 << 26}});
+
+// Traverses a pooled linked list with nodes one cache line apart in a random
+// order, allocated from the memory backend `state.range(1)`. The layout of the
+// nodes is the same for all backends, so the differences come from the TLB.
+void BM_AccessBackendLinkedList_Flush(benchmark::State &state) {
+  const auto backend = static_cast<MemoryBackend>(state.range(1));
+  state.SetLabel(std::string(MemoryBackendName(backend)));
+  BM_AccessPooledLinkedList_Flush(state,
+                                  {.slot_size = 64, .backend = backend});
+}
+
+BENCHMARK(BM_AccessBackendLinkedList_Flush)
+    ->ArgsProduct({benchmark::CreateRange(1 << 4, 1 << 20, 8), {0, 1, 2, 3}});
+
 }  // namespace
 }  // namespace gematria
@@ -0,0 +1,135 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "gematria/experiments/access_pattern_bm/memory_backend.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string_view>
+
+namespace gematria {
+namespace {
+
+constexpr std::size_t k2MiB = std::size_t{1} << 21;
+constexpr std::size_t k1GiB = std::size_t{1} << 30;
+
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+std::size_t RoundUp(std::size_t size, std::size_t alignment) {
+  return (size + alignment - 1) / alignment * alignment;
+}
+
+// Creates a private anonymous mapping of `size` bytes. Returns nullptr on
+// failure.
+char *MapAnonymous(std::size_t size, int extra_flags) {
+  void *const mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | extra_flags, -1, 0);
+  return mapping == MAP_FAILED ? nullptr : static_cast<char *>(mapping);
+}
+
+// Creates a mapping of `size` bytes aligned to 2 MiB, so that it can be backed
+// by transparent huge pages from its first byte.
+char *MapAlignedTo2MiB(std::size_t size) {
+  // Map 2 MiB more than needed and unmap the parts before and after the
+  // aligned range.
+  char *const mapping = MapAnonymous(size + k2MiB, 0);
+  if (mapping == nullptr) return nullptr;
+  const std::uintptr_t address = reinterpret_cast<std::uintptr_t>(mapping);
+  char *const aligned = mapping + (RoundUp(address, k2MiB) - address);
+  if (aligned != mapping) munmap(mapping, aligned - mapping);
+  const std::size_t tail = mapping + size + k2MiB - (aligned + size);
+  if (tail > 0) munmap(aligned + size, tail);
+  return aligned;
+}
+
+}  // namespace
+
+std::string_view MemoryBackendName(MemoryBackend backend) {
+  switch (backend) {
+    case MemoryBackend::kMalloc:
+      return "malloc";
+    case MemoryBackend::kArena:
+      return "arena";
+    case MemoryBackend::kTransparentHugePages:
+      return "thp_2m";
+    case MemoryBackend::kHugeTlbFs:
+      return "hugetlbfs_1g";
+  }
+  return "unknown";
+}
+
+void MemoryDeleter::operator()(void *ptr) const {
+  if (ptr == nullptr) return;
+  if (backend == MemoryBackend::kMalloc) {
+    std::free(ptr);
+  } else {
+    munmap(ptr, mapped_size);
+  }
+}
+
+BackedArray<char> AllocateMemory(std::size_t size, MemoryBackend backend) {
+  if (size == 0) size = 1;
+  MemoryDeleter deleter{.backend = backend};
+  char *memory = nullptr;
+  switch (backend) {
+    case MemoryBackend::kMalloc:
+      memory = static_cast<char *>(std::calloc(size, 1));
+      break;
+    case MemoryBackend::kArena:
+      deleter.mapped_size = RoundUp(size, sysconf(_SC_PAGESIZE));
+      memory = MapAnonymous(deleter.mapped_size, 0);
+      if (memory != nullptr) {
+        madvise(memory, deleter.mapped_size, MADV_NOHUGEPAGE);
+      }
+      break;
+    case MemoryBackend::kTransparentHugePages:
+      deleter.mapped_size = RoundUp(size, k2MiB);
+      memory = MapAlignedTo2MiB(deleter.mapped_size);
+      if (memory != nullptr) {
+        madvise(memory, deleter.mapped_size, MADV_HUGEPAGE);
+      }
+      break;
+    case MemoryBackend::kHugeTlbFs:
+      deleter.mapped_size = RoundUp(size, k1GiB);
+      memory = MapAnonymous(deleter.mapped_size, MAP_HUGETLB | MAP_HUGE_1GB);
+      break;
+  }
+  return BackedArray<char>(memory, deleter);
+}
+
+Arena::Arena(std::size_t capacity, MemoryBackend backend)
+    : memory_(AllocateMemory(capacity, backend)), capacity_(capacity) {}
+
+void *Arena::Allocate(std::size_t size, std::size_t alignment) {
+  assert(ok());
+  assert((alignment & (alignment - 1)) == 0);
+  const std::size_t begin = RoundUp(used_, alignment);
+  if (begin + size > capacity_) {
+    std::fprintf(stderr, "Arena of %zu bytes is full\n", capacity_);
+    std::abort();
+  }
+  used_ = begin + size;
+  return memory_.get() + begin;
+}
+
+}  // namespace gematria
@@ -0,0 +1,130 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Contains the memory backends used by the benchmarks for allocating their
+// data structures. Allocating the same data structure from different backends
+// separates the effects of the TLB from the effects of the caches: the data
+// layout stays the same, only the size of the pages changes.
+
+#ifndef GEMATRIA_EXPERIMENTS_ACCESS_PATTERN_BM_MEMORY_BACKEND_H_
+#define GEMATRIA_EXPERIMENTS_ACCESS_PATTERN_BM_MEMORY_BACKEND_H_
+
+#include <cstddef>
+#include <memory>
+#include <string_view>
+
+namespace gematria {
+
+// The values of the enum are used as benchmark arguments.
+enum class MemoryBackend {
+  // Memory allocated with std::malloc(), i.e. whatever the default allocator
+  // does for the given size.
+  kMalloc = 0,
+  // A private anonymous mapping backed by 4 KiB pages; transparent huge pages
+  // are disabled for the mapping.
+  kArena = 1,
+  // A private anonymous mapping aligned to 2 MiB and marked for transparent
+  // huge pages with madvise(). The kernel may still back parts of it with
+  // 4 KiB pages when it can't find free huge pages.
+  kTransparentHugePages = 2,
+  // A mapping backed by 1 GiB pages from hugetlbfs. Requires 1 GiB pages to be
+  // reserved on the machine, e.g. with hugepagesz=1G hugepages=N on the kernel
+  // command line.
+  kHugeTlbFs = 3,
+};
+
+// Returns the name of `backend`, used in benchmark labels.
+std::string_view MemoryBackendName(MemoryBackend backend);
+
+// Releases memory allocated by AllocateMemory().
+struct MemoryDeleter {
+  void operator()(void *ptr) const;
+
+  MemoryBackend backend = MemoryBackend::kMalloc;
+  // The size of the mapping; used only by the mmap-based backends.
+  std::size_t mapped_size = 0;
+};
+
+template <typename T>
+using BackedArray = std::unique_ptr<T[], MemoryDeleter>;
+
+// Allocates `size` bytes of zero-initialized memory from `backend`. The memory
+// is aligned to at least the page size for the mmap-based backends. Returns
+// nullptr when the allocation fails, e.g. when there are no free 1 GiB pages.
+BackedArray<char> AllocateMemory(std::size_t size, MemoryBackend backend);
+
+// Converts memory allocated by AllocateMemory() to an array of `T`. The memory
+// must be large enough and suitably aligned for the elements.
+template <typename T>
+BackedArray<T> CastBackedArray(BackedArray<char> memory) {
+  const MemoryDeleter deleter = memory.get_deleter();
+  return BackedArray<T>(reinterpret_cast<T *>(memory.release()), deleter);
+}
+
+// A bump allocator over a block of memory allocated from a memory backend.
+// Deallocation is a no-op; the memory is released when the arena is destroyed.
+class Arena {
+ public:
+  // Allocates `capacity` bytes for the arena from `backend`. Check ok() before
+  // using the arena.
+  Arena(std::size_t capacity, MemoryBackend backend);
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+
+  // Returns true when the memory of the arena was allocated.
+  bool ok() const { return memory_ != nullptr; }
+
+  // Returns `size` bytes aligned to `alignment`, which must be a power of two.
+  // Aborts when the arena is full.
+  void *Allocate(std::size_t size, std::size_t alignment);
+
+ private:
+  BackedArray<char> memory_;
+  const std::size_t capacity_;
+  std::size_t used_ = 0;
+};
+
+// An STL allocator that allocates from an Arena. The arena must outlive all
+// containers that use it.
+template <typename T>
+class ArenaAllocator {
+ public:
+  using value_type = T;
+
+  explicit ArenaAllocator(Arena *arena) : arena_(arena) {}
+  template <typename U>
+  ArenaAllocator(const ArenaAllocator<U> &other) : arena_(other.arena()) {}
+
+  T *allocate(std::size_t n) {
+    return static_cast<T *>(arena_->Allocate(n * sizeof(T), alignof(T)));
+  }
+  void deallocate(T *, std::size_t) {}
+
+  Arena *arena() const { return arena_; }
+
+  friend bool operator==(const ArenaAllocator &a, const ArenaAllocator &b) {
+    return a.arena_ == b.arena_;
+  }
+  friend bool operator!=(const ArenaAllocator &a, const ArenaAllocator &b) {
+    return a.arena_ != b.arena_;
+  }
+
+ private:
+  Arena *arena_;
+};
+
+}  // namespace gematria
+
+#endif  // GEMATRIA_EXPERIMENTS_ACCESS_PATTERN_BM_MEMORY_BACKEND_H_
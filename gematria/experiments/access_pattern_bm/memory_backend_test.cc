@@ -0,0 +1,84 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "gematria/experiments/access_pattern_bm/memory_backend.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <numeric>
+
+#include "gtest/gtest.h"
+
+namespace gematria {
+namespace {
+
+TEST(MemoryBackendTest, AllocateMemory) {
+  constexpr std::size_t kSize = 3 << 20;
+  for (const MemoryBackend backend :
+       {MemoryBackend::kMalloc, MemoryBackend::kArena,
+        MemoryBackend::kTransparentHugePages}) {
+    SCOPED_TRACE(MemoryBackendName(backend));
+    const BackedArray<char> memory = AllocateMemory(kSize, backend);
+    ASSERT_NE(memory, nullptr);
+    EXPECT_EQ(memory[0], 0);
+    EXPECT_EQ(memory[kSize - 1], 0);
+    memory[0] = 1;
+    memory[kSize - 1] = 1;
+    if (backend == MemoryBackend::kTransparentHugePages) {
+      EXPECT_EQ(reinterpret_cast<std::uintptr_t>(memory.get()) % (1 << 21), 0);
+    }
+  }
+}
+
+TEST(MemoryBackendTest, AllocateHugeTlbFs) {
+  // 1 GiB pages are usually not reserved on test machines; the allocation must
+  // either fail cleanly or return usable memory.
+  const BackedArray<char> memory =
+      AllocateMemory(4096, MemoryBackend::kHugeTlbFs);
+  if (memory == nullptr) GTEST_SKIP() << "No 1 GiB huge pages available";
+  EXPECT_EQ(reinterpret_cast<std::uintptr_t>(memory.get()) % (1 << 30), 0);
+  memory[4095] = 1;
+}
+
+TEST(MemoryBackendTest, CastBackedArray) {
+  BackedArray<int> array = CastBackedArray<int>(
+      AllocateMemory(10 * sizeof(int), MemoryBackend::kArena));
+  ASSERT_NE(array, nullptr);
+  std::iota(array.get(), array.get() + 10, 0);
+  EXPECT_EQ(array[9], 9);
+}
+
+TEST(ArenaTest, Allocate) {
+  Arena arena(1024, MemoryBackend::kArena);
+  ASSERT_TRUE(arena.ok());
+  char *const first = static_cast<char *>(arena.Allocate(1, 1));
+  void *const second = arena.Allocate(8, 8);
+  EXPECT_EQ(reinterpret_cast<std::uintptr_t>(second) % 8, 0);
+  EXPECT_EQ(static_cast<char *>(second), first + 8);
+}
+
+TEST(ArenaTest, ArenaAllocator) {
+  constexpr int kSize = 100;
+  Arena arena(1 << 16, MemoryBackend::kArena);
+  ASSERT_TRUE(arena.ok());
+  std::list<int, ArenaAllocator<int>> list((ArenaAllocator<int>(&arena)));
+  for (int i = 0; i < kSize; ++i) list.push_back(i);
+  EXPECT_EQ(std::accumulate(list.begin(), list.end(), 0),
+            kSize * (kSize - 1) / 2);
+}
+
+}  // namespace
+}  // namespace gematria
@@ -0,0 +1,86 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/experiments/access_pattern_bm/numa.h"
+
+#include <sched.h>
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace gematria {
+
+std::vector<int> GetNumaNodeCpus(const int node) {
+  if (node < 0) return {};
+  std::ifstream cpulist_file("/sys/devices/system/node/node" +
+                             std::to_string(node) + "/cpulist");
+  std::string cpulist;
+  if (!std::getline(cpulist_file, cpulist)) return {};
+
+  // The CPU list is a comma-separated list of CPUs and ranges of CPUs, e.g.
+  // "0-3,8-11,16".
+  std::vector<int> cpus;
+  std::stringstream ranges(cpulist);
+  std::string range;
+  while (std::getline(ranges, range, ',')) {
+    int first = 0;
+    int last = 0;
+    const int num_parsed = std::sscanf(range.c_str(), "%d-%d", &first, &last);
+    if (num_parsed < 1) continue;
+    if (num_parsed == 1) last = first;
+    for (int cpu = first; cpu <= last; ++cpu) cpus.push_back(cpu);
+  }
+  return cpus;
+}
+
+bool HasNumaNodes(const int node) {
+  switch (node) {
+    case kNoNumaNode:
+      return true;
+    case kAlternateNumaNodes:
+      return !GetNumaNodeCpus(0).empty() && !GetNumaNodeCpus(1).empty();
+    default:
+      return !GetNumaNodeCpus(node).empty();
+  }
+}
+
+ScopedNumaNodeAffinity::ScopedNumaNodeAffinity(const int node) {
+  if (node == kNoNumaNode) return;
+  ok_ = false;
+  const std::vector<int> cpus = GetNumaNodeCpus(node);
+  if (cpus.empty()) return;
+  if (sched_getaffinity(0, sizeof(original_affinity_), &original_affinity_) !=
+      0) {
+    return;
+  }
+  cpu_set_t affinity;
+  CPU_ZERO(&affinity);
+  for (const int cpu : cpus) {
+    if (cpu < CPU_SETSIZE) CPU_SET(cpu, &affinity);
+  }
+  if (sched_setaffinity(0, sizeof(affinity), &affinity) != 0) return;
+  restore_affinity_ = true;
+  ok_ = true;
+}
+
+ScopedNumaNodeAffinity::~ScopedNumaNodeAffinity() {
+  if (restore_affinity_) {
+    sched_setaffinity(0, sizeof(original_affinity_), &original_affinity_);
+  }
+}
+
+}  // namespace gematria
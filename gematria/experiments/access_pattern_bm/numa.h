@@ -0,0 +1,75 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Contains helpers for running the multi-threaded benchmarks on the CPUs of a
+// given NUMA node, and for placing their data on a given NUMA node. The data
+// placement relies on the first-touch policy of Linux: a page is allocated on
+// the node of the CPU that first writes to it, so data created by a thread
+// pinned to a node lives on that node.
+
+#ifndef GEMATRIA_EXPERIMENTS_ACCESS_PATTERN_BM_NUMA_H_
+#define GEMATRIA_EXPERIMENTS_ACCESS_PATTERN_BM_NUMA_H_
+
+#include <sched.h>
+
+#include <vector>
+
+namespace gematria {
+
+// A NUMA node argument of the benchmarks that leaves the placement of the
+// threads or the data to the operating system.
+inline constexpr int kNoNumaNode = -1;
+// A NUMA node argument of the benchmarks that runs the threads with an even
+// index on node 0 and the threads with an odd index on node 1.
+inline constexpr int kAlternateNumaNodes = -2;
+
+// Returns the CPUs of NUMA node `node` as listed in sysfs. Returns an empty
+// vector when the node does not exist.
+std::vector<int> GetNumaNodeCpus(int node);
+
+// Returns the NUMA node on which the thread `thread_index` of a benchmark runs,
+// given the NUMA node argument `node` of the benchmark.
+inline int NumaNodeForThread(int node, int thread_index) {
+  return node == kAlternateNumaNodes ? thread_index % 2 : node;
+}
+
+// Returns true when all the NUMA nodes needed by the NUMA node argument `node`
+// exist on this machine.
+bool HasNumaNodes(int node);
+
+// Pins the calling thread to the CPUs of a NUMA node for the lifetime of the
+// object, and restores the original CPU affinity of the thread in the
+// destructor.
+class ScopedNumaNodeAffinity {
+ public:
+  // Pins the calling thread to the CPUs of `node`. Does nothing when `node` is
+  // kNoNumaNode.
+  explicit ScopedNumaNodeAffinity(int node);
+  ScopedNumaNodeAffinity(const ScopedNumaNodeAffinity &) = delete;
+  ScopedNumaNodeAffinity &operator=(const ScopedNumaNodeAffinity &) = delete;
+  ~ScopedNumaNodeAffinity();
+
+  // Returns true when the thread runs on the requested node; always true for
+  // kNoNumaNode.
+  bool ok() const { return ok_; }
+
+ private:
+  cpu_set_t original_affinity_;
+  bool restore_affinity_ = false;
+  bool ok_ = true;
+};
+
+}  // namespace gematria
+
+#endif  // GEMATRIA_EXPERIMENTS_ACCESS_PATTERN_BM_NUMA_H_
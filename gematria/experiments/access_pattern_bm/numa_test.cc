@@ -0,0 +1,63 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/experiments/access_pattern_bm/numa.h"
+
+#include <sched.h>
+
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace gematria {
+namespace {
+
+using ::testing::Contains;
+
+TEST(NumaTest, NumaNodeForThread) {
+  EXPECT_EQ(NumaNodeForThread(kNoNumaNode, 3), kNoNumaNode);
+  EXPECT_EQ(NumaNodeForThread(1, 4), 1);
+  EXPECT_EQ(NumaNodeForThread(kAlternateNumaNodes, 4), 0);
+  EXPECT_EQ(NumaNodeForThread(kAlternateNumaNodes, 5), 1);
+}
+
+TEST(NumaTest, MissingNode) {
+  EXPECT_TRUE(GetNumaNodeCpus(-5).empty());
+  EXPECT_TRUE(GetNumaNodeCpus(1 << 20).empty());
+  EXPECT_TRUE(HasNumaNodes(kNoNumaNode));
+  EXPECT_FALSE(HasNumaNodes(1 << 20));
+  ScopedNumaNodeAffinity affinity(1 << 20);
+  EXPECT_FALSE(affinity.ok());
+}
+
+TEST(NumaTest, PinToNode) {
+  const std::vector<int> cpus = GetNumaNodeCpus(0);
+  if (cpus.empty()) GTEST_SKIP() << "The machine has no NUMA node 0";
+  cpu_set_t original_affinity;
+  ASSERT_EQ(sched_getaffinity(0, sizeof(original_affinity), &original_affinity),
+            0);
+  {
+    ScopedNumaNodeAffinity affinity(0);
+    ASSERT_TRUE(affinity.ok());
+    EXPECT_THAT(cpus, Contains(sched_getcpu()));
+  }
+  cpu_set_t restored_affinity;
+  ASSERT_EQ(sched_getaffinity(0, sizeof(restored_affinity), &restored_affinity),
+            0);
+  EXPECT_TRUE(CPU_EQUAL(&original_affinity, &restored_affinity));
+}
+
+}  // namespace
+}  // namespace gematria
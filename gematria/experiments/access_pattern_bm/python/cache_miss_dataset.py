@@ -0,0 +1,198 @@
+# Copyright 2023 Google Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#    http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""Creates basic blocks labelled with cache misses from microbenchmarks.
+
+The access pattern microbenchmarks report hardware performance counters
+collected through libpfm by Google Benchmark (when built with --define pfm=1 and
+run with --benchmark_perf_counters). This module runs the benchmarks, and
+combines the per-iteration counters with the machine code of the hot basic
+block of each benchmark kernel into BasicBlockWithThroughputProtos.
+
+The counters are normalized per execution of the hot block, using the
+"block_executions" counter reported by the benchmark (the number of executions
+of the block per benchmark iteration). When a benchmark doesn't report it, the
+counters are used as they are, i.e. per benchmark iteration.
+"""
+
+from collections.abc import Iterable, Iterator, Mapping, Sequence
+import dataclasses
+import json
+import re
+import subprocess
+from typing import Any
+
+from gematria.datasets.python import bhive_importer
+from gematria.proto import throughput_pb2
+
+# The name of the benchmark counter with the number of executions of the hot
+# block per benchmark iteration.
+BLOCK_EXECUTIONS_COUNTER = 'block_executions'
+
+# The perf counter used as the inverse throughput of the blocks.
+CYCLES_COUNTER = 'CYCLES'
+
+# The default set of counters collected from the benchmarks. These are generic
+# perf events; microarchitecture-specific events (e.g. L2 misses) can be added
+# using their libpfm names.
+DEFAULT_PERF_COUNTERS = (
+    CYCLES_COUNTER,
+    'L1-DCACHE-LOAD-MISSES',
+    'LLC-LOAD-MISSES',
+)
+
+
+@dataclasses.dataclass(frozen=True)
+class HotBlock:
+  """The hot basic block of a benchmark kernel.
+
+  Attributes:
+    benchmark_regex: A regular expression that must match the whole name of a
+      benchmark run, e.g. "BM_AccessLinkedList_Flush/.*", for the block to be
+      used for the run.
+    machine_code_hex: The machine code of the basic block in the hex format
+      used by the BHive data set.
+  """
+
+  benchmark_regex: re.Pattern[str]
+  machine_code_hex: str
+
+
+def read_hot_blocks(lines: Iterable[str]) -> list[HotBlock]:
+  """Parses hot blocks from a CSV file.
+
+  Each line of the file has the format "{benchmark_regex},{machine_code_hex}".
+  The hot blocks can be extracted for example with `perf annotate` or `objdump`
+  from the innermost loop of the benchmark kernel. Empty lines and lines that
+  start with '#' are ignored.
+
+  Args:
+    lines: The lines of the CSV file.
+
+  Returns:
+    The list of hot blocks, in the order of the input.
+
+  Raises:
+    ValueError: When a line does not have the expected format.
+  """
+  hot_blocks = []
+  for line in lines:
+    line = line.strip()
+    if not line or line.startswith('#'):
+      continue
+    benchmark_regex, separator, machine_code_hex = line.rpartition(',')
+    if not separator or not benchmark_regex or not machine_code_hex:
+      raise ValueError(f'Invalid hot block line: "{line}"')
+    hot_blocks.append(
+        HotBlock(
+            benchmark_regex=re.compile(benchmark_regex),
+            machine_code_hex=machine_code_hex,
+        )
+    )
+  return hot_blocks
+
+
+def run_benchmark(
+    binary: str,
+    perf_counters: Sequence[str] = DEFAULT_PERF_COUNTERS,
+    benchmark_filter: str = '',
+) -> dict[str, Any]:
+  """Runs a benchmark binary and returns its results.
+
+  Args:
+    binary: The path of the benchmark binary.
+    perf_counters: The libpfm names of the perf counters to collect.
+    benchmark_filter: An optional regular expression for selecting the
+      benchmarks to run.
+
+  Returns:
+    The results of the benchmarks parsed from the JSON output of Google
+    Benchmark.
+
+  Raises:
+    subprocess.CalledProcessError: When the benchmark binary fails.
+  """
+  command = [
+      binary,
+      '--benchmark_format=json',
+      f'--benchmark_perf_counters={",".join(perf_counters)}',
+  ]
+  if benchmark_filter:
+    command.append(f'--benchmark_filter={benchmark_filter}')
+  output = subprocess.run(
+      command, check=True, capture_output=True, text=True
+  ).stdout
+  return json.loads(output)
+
+
+def protos_from_benchmark_results(
+    importer: bhive_importer.BHiveImporter,
+    benchmark_results: Mapping[str, Any],
+    hot_blocks: Sequence[HotBlock],
+    perf_counters: Sequence[str] = DEFAULT_PERF_COUNTERS,
+    source_name: str = 'access_pattern_bm',
+) -> Iterator[throughput_pb2.BasicBlockWithThroughputProto]:
+  """Creates basic blocks with cache miss labels from benchmark results.
+
+  Creates one proto for each pair of a benchmark run and a hot block that
+  matches the name of the run. Runs that are aggregates of other runs, e.g.
+  means of repetitions, are skipped.
+
+  Args:
+    importer: The importer used to disassemble the hot blocks.
+    benchmark_results: The results of the benchmarks in the JSON format of
+      Google Benchmark, e.g. as returned by `run_benchmark`.
+    hot_blocks: The hot blocks of the benchmark kernels.
+    perf_counters: The names of the perf counters added to the protos. The
+      counters missing in a run are ignored.
+    source_name: The prefix of the throughput source name. The source name of
+      each proto is "{source_name}: {benchmark run name}".
+
+  Yields:
+    The basic blocks with the inverse throughput in cycles and the perf
+    counters, both per execution of the block.
+
+  Raises:
+    StatusNotOk: When the machine code of a hot block can't be disassembled.
+  """
+  block_protos = {}
+  for run in benchmark_results.get('benchmarks', ()):
+    if run.get('run_type') == 'aggregate':
+      continue
+    name = run['name']
+    block_executions = run.get(BLOCK_EXECUTIONS_COUNTER) or 1
+    for hot_block in hot_blocks:
+      if not hot_block.benchmark_regex.fullmatch(name):
+        continue
+      block_proto = block_protos.get(hot_block.machine_code_hex)
+      if block_proto is None:
+        block_proto = importer.basic_block_proto_from_hex(
+            hot_block.machine_code_hex
+        )
+        block_protos[hot_block.machine_code_hex] = block_proto
+
+      throughput = throughput_pb2.ThroughputWithSourceProto(
+          source=f'{source_name}: {name}'
+      )
+      if CYCLES_COUNTER in run:
+        throughput.inverse_throughput_cycles.append(
+            run[CYCLES_COUNTER] / block_executions
+        )
+      for counter in perf_counters:
+        if counter in run:
+          throughput.perf_counters[counter] = run[counter] / block_executions
+      proto = throughput_pb2.BasicBlockWithThroughputProto(
+          inverse_throughputs=(throughput,)
+      )
+      proto.basic_block.CopyFrom(block_proto)
+      yield proto
@@ -0,0 +1,159 @@
+# Copyright 2023 Google Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#    http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+import json
+import subprocess
+from unittest import mock
+
+from absl.testing import absltest
+from gematria.datasets.python import bhive_importer
+from gematria.experiments.access_pattern_bm.python import cache_miss_dataset
+from gematria.llvm.python import canonicalizer
+from gematria.llvm.python import llvm_architecture_support
+from gematria.proto import throughput_pb2
+
+# subq %rdx, %r10
+_HOT_BLOCK_HEX = '4929d2'
+
+
+class ReadHotBlocksTest(absltest.TestCase):
+
+  def test_read_hot_blocks(self):
+    hot_blocks = cache_miss_dataset.read_hot_blocks((
+        '# A comment.\n',
+        'BM_AccessLinkedList_.*,4929d2\n',
+        '\n',
+        'BM_Foo/[0-9]+,4829d3\n',
+    ))
+    self.assertLen(hot_blocks, 2)
+    self.assertEqual(
+        hot_blocks[0].benchmark_regex.pattern, 'BM_AccessLinkedList_.*'
+    )
+    self.assertEqual(hot_blocks[0].machine_code_hex, '4929d2')
+    self.assertEqual(hot_blocks[1].benchmark_regex.pattern, 'BM_Foo/[0-9]+')
+    self.assertEqual(hot_blocks[1].machine_code_hex, '4829d3')
+
+  def test_invalid_line(self):
+    with self.assertRaises(ValueError):
+      cache_miss_dataset.read_hot_blocks(('BM_Foo',))
+    with self.assertRaises(ValueError):
+      cache_miss_dataset.read_hot_blocks(('BM_Foo,',))
+
+
+class RunBenchmarkTest(absltest.TestCase):
+
+  @mock.patch.object(subprocess, 'run')
+  def test_run_benchmark(self, mock_run):
+    results = {'benchmarks': [{'name': 'BM_Foo/16', 'CYCLES': 10.0}]}
+    mock_run.return_value = subprocess.CompletedProcess(
+        args=(), returncode=0, stdout=json.dumps(results)
+    )
+    self.assertEqual(
+        cache_miss_dataset.run_benchmark(
+            '/bin/benchmark', ('CYCLES', 'LLC-LOAD-MISSES'), 'BM_Foo'
+        ),
+        results,
+    )
+    command = mock_run.call_args.args[0]
+    self.assertEqual(
+        command,
+        [
+            '/bin/benchmark',
+            '--benchmark_format=json',
+            '--benchmark_perf_counters=CYCLES,LLC-LOAD-MISSES',
+            '--benchmark_filter=BM_Foo',
+        ],
+    )
+
+
+class ProtosFromBenchmarkResultsTest(absltest.TestCase):
+
+  def setUp(self):
+    super().setUp()
+    self._llvm = llvm_architecture_support.LlvmArchitectureSupport.x86_64()
+    self._canonicalizer = canonicalizer.Canonicalizer.x86_64(self._llvm)
+    self._importer = bhive_importer.BHiveImporter(self._canonicalizer)
+
+  def test_protos_from_benchmark_results(self):
+    results = {
+        'benchmarks': [
+            {
+                'name': 'BM_AccessLinkedList_Flush/16',
+                'run_type': 'iteration',
+                'block_executions': 16.0,
+                'CYCLES': 320.0,
+                'L1-DCACHE-LOAD-MISSES': 8.0,
+            },
+            {
+                'name': 'BM_AccessLinkedList_Flush/16_mean',
+                'run_type': 'aggregate',
+                'block_executions': 16.0,
+                'CYCLES': 320.0,
+            },
+            {
+                'name': 'BM_Other/16',
+                'run_type': 'iteration',
+                'CYCLES': 10.0,
+            },
+            {
+                'name': 'BM_AccessLinkedList_NoFlush/16',
+                'run_type': 'iteration',
+                'CYCLES': 48.0,
+            },
+        ]
+    }
+    hot_blocks = cache_miss_dataset.read_hot_blocks(
+        (f'BM_AccessLinkedList_.*,{_HOT_BLOCK_HEX}',)
+    )
+    protos = list(
+        cache_miss_dataset.protos_from_benchmark_results(
+            self._importer,
+            results,
+            hot_blocks,
+            perf_counters=('CYCLES', 'L1-DCACHE-LOAD-MISSES'),
+            source_name='test',
+        )
+    )
+    expected_block = self._importer.basic_block_proto_from_hex(_HOT_BLOCK_HEX)
+    self.assertSequenceEqual(
+        protos,
+        (
+            throughput_pb2.BasicBlockWithThroughputProto(
+                basic_block=expected_block,
+                inverse_throughputs=(
+                    throughput_pb2.ThroughputWithSourceProto(
+                        source='test: BM_AccessLinkedList_Flush/16',
+                        inverse_throughput_cycles=(20.0,),
+                        perf_counters={
+                            'CYCLES': 20.0,
+                            'L1-DCACHE-LOAD-MISSES': 0.5,
+                        },
+                    ),
+                ),
+            ),
+            throughput_pb2.BasicBlockWithThroughputProto(
+                basic_block=expected_block,
+                inverse_throughputs=(
+                    throughput_pb2.ThroughputWithSourceProto(
+                        source='test: BM_AccessLinkedList_NoFlush/16',
+                        inverse_throughput_cycles=(48.0,),
+                        perf_counters={'CYCLES': 48.0},
+                    ),
+                ),
+            ),
+        ),
+    )
+
+
+if __name__ == '__main__':
+  absltest.main()
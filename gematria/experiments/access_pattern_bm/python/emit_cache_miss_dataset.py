@@ -0,0 +1,116 @@
+# Copyright 2023 Google Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#    http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+r"""Creates a Gematria data set with cache miss labels from microbenchmarks.
+
+Runs the access pattern benchmarks with perf counters, and writes the hot basic
+blocks of their kernels with the cycles and the perf counters per execution of
+the block to a TFRecord file of BasicBlockWithThroughputProtos. The benchmarks
+must be built with --define pfm=1, so that Google Benchmark can collect the perf
+counters through libpfm.
+
+Usage:
+  emit_cache_miss_dataset \
+      --benchmark_binaries=bazel-bin/.../linked_list_test \
+      --hot_blocks_csv=/tmp/hot_blocks.csv \
+      --output_tfrecord=/tmp/cache_misses.tfrecord
+"""
+
+from collections.abc import Sequence
+
+from absl import app
+from absl import flags
+from absl import logging
+from gematria.datasets.python import bhive_importer
+from gematria.experiments.access_pattern_bm.python import cache_miss_dataset
+from gematria.llvm.python import canonicalizer
+from gematria.llvm.python import llvm_architecture_support
+import tensorflow as tf
+
+
+_BENCHMARK_BINARIES = flags.DEFINE_list(
+    'benchmark_binaries',
+    None,
+    'The benchmark binaries to run.',
+    required=True,
+)
+_BENCHMARK_FILTER = flags.DEFINE_string(
+    'benchmark_filter',
+    '',
+    'An optional regular expression that selects the benchmarks to run.',
+)
+_HOT_BLOCKS_CSV = flags.DEFINE_string(
+    'hot_blocks_csv',
+    None,
+    'The CSV file with the hot blocks of the benchmark kernels; each line has'
+    ' the format "{benchmark_regex},{machine_code_hex}".',
+    required=True,
+)
+_PERF_COUNTERS = flags.DEFINE_list(
+    'perf_counters',
+    list(cache_miss_dataset.DEFAULT_PERF_COUNTERS),
+    'The libpfm names of the perf counters collected from the benchmarks.'
+    f' "{cache_miss_dataset.CYCLES_COUNTER}" is used as the inverse'
+    ' throughput.',
+)
+_OUTPUT_TFRECORD_FILE = flags.DEFINE_string(
+    'output_tfrecord',
+    None,
+    'The name of the TFRecord file to write the data to.',
+    required=True,
+)
+_SOURCE_NAME = flags.DEFINE_string(
+    'source_name',
+    'access_pattern_bm',
+    'The prefix of the throughput source name in the output protos.',
+)
+_LLVM_TRIPLE = flags.DEFINE_string(
+    'llvm_triple',
+    'x86_64',
+    'The LLVM triple used for disassembling the hot blocks.',
+)
+
+
+def main(argv: Sequence[str]) -> None:
+  if len(argv) > 1:
+    raise app.UsageError('Too many command-line arguments.')
+  llvm = llvm_architecture_support.LlvmArchitectureSupport.from_triple(
+      _LLVM_TRIPLE.value
+  )
+  importer = bhive_importer.BHiveImporter(
+      canonicalizer.Canonicalizer.x86_64(llvm)
+  )
+  with tf.io.gfile.GFile(_HOT_BLOCKS_CSV.value, 'r') as hot_blocks_file:
+    hot_blocks = cache_miss_dataset.read_hot_blocks(hot_blocks_file)
+
+  num_blocks = 0
+  with tf.io.TFRecordWriter(_OUTPUT_TFRECORD_FILE.value) as writer:
+    for binary in _BENCHMARK_BINARIES.value:
+      logging.info('Running %s', binary)
+      results = cache_miss_dataset.run_benchmark(
+          binary, _PERF_COUNTERS.value, _BENCHMARK_FILTER.value
+      )
+      for proto in cache_miss_dataset.protos_from_benchmark_results(
+          importer,
+          results,
+          hot_blocks,
+          _PERF_COUNTERS.value,
+          _SOURCE_NAME.value,
+      ):
+        writer.write(proto.SerializeToString())
+        num_blocks += 1
+  logging.info('Wrote %d blocks.', num_blocks)
+
+
+if __name__ == '__main__':
+  app.run(main)
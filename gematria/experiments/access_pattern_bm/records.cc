@@ -0,0 +1,75 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/experiments/access_pattern_bm/records.h"
+
+#include <cstddef>
+#include <memory>
+#include <random>
+
+#include "gematria/experiments/access_pattern_bm/flush.h"
+
+namespace gematria {
+
+// Creates `size` records with random fields.
+std::unique_ptr<Record[]> CreateRandomRecordsAoS(const std::size_t size) {
+  std::default_random_engine generator;
+  std::uniform_int_distribution<int> distribution(0, 1023);
+
+  auto records = std::make_unique<Record[]>(size);
+  for (int i = 0; i < size; ++i) {
+    for (int field = 0; field < kNumRecordFields; ++field) {
+      records[i].fields[field] = distribution(generator);
+    }
+  }
+
+  return records;
+}
+
+// Creates `size` records with random fields, in the SoA layout.
+RecordsSoA CreateRandomRecordsSoA(const std::size_t size) {
+  std::default_random_engine generator;
+  std::uniform_int_distribution<int> distribution(0, 1023);
+
+  RecordsSoA records;
+  for (auto &field : records.fields) {
+    field = std::make_unique<int[]>(size);
+  }
+  // Fill the fields record by record, in the same order as in
+  // CreateRandomRecordsAoS(), so that both layouts contain the same values.
+  for (int i = 0; i < size; ++i) {
+    for (int field = 0; field < kNumRecordFields; ++field) {
+      records.fields[field][i] = distribution(generator);
+    }
+  }
+
+  return records;
+}
+
+void FlushRecordsAoSFromCache(const Record *records, const std::size_t size) {
+  CacheFlusher flusher;
+  if (!flusher.needs_elements()) return;
+  flusher.FlushRange(records, size * sizeof(Record));
+}
+
+void FlushRecordsSoAFromCache(const RecordsSoA &records,
+                              const std::size_t size) {
+  CacheFlusher flusher;
+  if (!flusher.needs_elements()) return;
+  for (const auto &field : records.fields) {
+    flusher.FlushRange(field.get(), size * sizeof(int));
+  }
+}
+
+}  // namespace gematria
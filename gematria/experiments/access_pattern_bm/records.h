@@ -0,0 +1,46 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef GEMATRIA_EXPERIMENTS_ACCESS_PATTERN_BM_RECORDS_H_
+#define GEMATRIA_EXPERIMENTS_ACCESS_PATTERN_BM_RECORDS_H_
+
+#include <array>
+#include <cstddef>
+#include <memory>
+
+namespace gematria {
+
+inline constexpr int kNumRecordFields = 8;
+
+// A record with `kNumRecordFields` integer fields. An array of records is the
+// array-of-structs (AoS) layout.
+struct Record {
+  int fields[kNumRecordFields];
+};
+
+// The same records in the struct-of-arrays (SoA) layout: `fields[i]` is the
+// array of the i-th fields of all records.
+struct RecordsSoA {
+  std::array<std::unique_ptr<int[]>, kNumRecordFields> fields;
+};
+
+std::unique_ptr<Record[]> CreateRandomRecordsAoS(std::size_t size);
+RecordsSoA CreateRandomRecordsSoA(std::size_t size);
+
+void FlushRecordsAoSFromCache(const Record *records, std::size_t size);
+void FlushRecordsSoAFromCache(const RecordsSoA &records, std::size_t size);
+
+}  // namespace gematria
+
+#endif  // GEMATRIA_EXPERIMENTS_ACCESS_PATTERN_BM_RECORDS_H_
@@ -0,0 +1,114 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/experiments/access_pattern_bm/records.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "benchmark/benchmark.h"
+#include "gematria/experiments/access_pattern_bm/configuration.h"
+
+namespace gematria {
+namespace {
+
+// Sums the first `num_fields` fields of all records in the AoS layout.
+int64_t SumFields(const Record *records, std::size_t size, int num_fields) {
+  int64_t sum = 0;
+  for (int i = 0; i < size; ++i) {
+    for (int field = 0; field < num_fields; ++field) {
+      sum += records[i].fields[field];
+    }
+  }
+  return sum;
+}
+
+// Sums the first `num_fields` fields of all records in the SoA layout.
+int64_t SumFields(const RecordsSoA &records, std::size_t size,
+                  int num_fields) {
+  int64_t sum = 0;
+  for (int i = 0; i < size; ++i) {
+    for (int field = 0; field < num_fields; ++field) {
+      sum += records.fields[field][i];
+    }
+  }
+  return sum;
+}
+
+// Reads the first `state.range(1)` fields of `state.range(0)` records in the
+// AoS layout. When only a few fields are used, most of each loaded cache line
+// is wasted.
+void BM_RecordsAoS(benchmark::State &state, bool flush) {
+  const std::size_t size = state.range(0);
+  const int num_fields = state.range(1);
+
+  // Create random records.
+  auto records = CreateRandomRecordsAoS(size);
+  std::unique_ptr<Record[]> mock;
+  if (!flush && kBalanceFlushingTime) {
+    mock = CreateRandomRecordsAoS(size);
+  }
+
+  for (auto _ : state) {
+    if (flush || kBalanceFlushingTime) {
+      state.PauseTiming();
+      FlushRecordsAoSFromCache(flush ? records.get() : mock.get(), size);
+      state.ResumeTiming();
+    }
+
+    benchmark::DoNotOptimize(SumFields(records.get(), size, num_fields));
+  }
+}
+
+BENCHMARK_CAPTURE(BM_RecordsAoS, NoFlush, false)
+    ->ArgsProduct({benchmark::CreateRange(1 << 10, 1 << 22, 16),
+                   {1, 2, kNumRecordFields}});
+BENCHMARK_CAPTURE(BM_RecordsAoS, Flush, true)
+    ->ArgsProduct({benchmark::CreateRange(1 << 10, 1 << 22, 16),
+                   {1, 2, kNumRecordFields}});
+
+// Reads the first `state.range(1)` fields of `state.range(0)` records in the
+// SoA layout. Each used field is a separate sequential stream.
+void BM_RecordsSoA(benchmark::State &state, bool flush) {
+  const std::size_t size = state.range(0);
+  const int num_fields = state.range(1);
+
+  // Create random records.
+  const RecordsSoA records = CreateRandomRecordsSoA(size);
+  RecordsSoA mock;
+  if (!flush && kBalanceFlushingTime) {
+    mock = CreateRandomRecordsSoA(size);
+  }
+
+  for (auto _ : state) {
+    if (flush || kBalanceFlushingTime) {
+      state.PauseTiming();
+      FlushRecordsSoAFromCache(flush ? records : mock, size);
+      state.ResumeTiming();
+    }
+
+    benchmark::DoNotOptimize(SumFields(records, size, num_fields));
+  }
+}
+
+BENCHMARK_CAPTURE(BM_RecordsSoA, NoFlush, false)
+    ->ArgsProduct({benchmark::CreateRange(1 << 10, 1 << 22, 16),
+                   {1, 2, kNumRecordFields}});
+BENCHMARK_CAPTURE(BM_RecordsSoA, Flush, true)
+    ->ArgsProduct({benchmark::CreateRange(1 << 10, 1 << 22, 16),
+                   {1, 2, kNumRecordFields}});
+
+}  // namespace
+}  // namespace gematria
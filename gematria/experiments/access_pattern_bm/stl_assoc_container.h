@@ -15,11 +15,11 @@
 #ifndef GEMATRIA_EXPERIMENTS_ACCESS_PATTERN_BM_STL_ASSOC_CONTAINER_H_
 #define GEMATRIA_EXPERIMENTS_ACCESS_PATTERN_BM_STL_ASSOC_CONTAINER_H_
 
-#include <immintrin.h>
-
 #include <memory>
 #include <random>
 
+#include "gematria/experiments/access_pattern_bm/flush.h"
+
 namespace gematria {
 
 static std::default_random_engine generator;
@@ -44,12 +44,12 @@ std::unique_ptr<Container> CreateRandomSTLAssocContainer(
 
 template <typename Container>
 void FlushSTLAssocContainerFromCache(const Container *container) {
-  _mm_mfence();
+  CacheFlusher flusher;
+  if (!flusher.needs_elements()) return;
   for (const auto &[key, value] : *container) {
-    _mm_clflushopt(&key);
-    _mm_clflushopt(&value);
+    flusher.Flush(&key);
+    flusher.Flush(&value);
   }
-  _mm_mfence();
 }
 
 }  // namespace gematria
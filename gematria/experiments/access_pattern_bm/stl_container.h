@@ -15,23 +15,27 @@
 #ifndef GEMATRIA_EXPERIMENTS_ACCESS_PATTERN_BM_STL_CONTAINER_H_
 #define GEMATRIA_EXPERIMENTS_ACCESS_PATTERN_BM_STL_CONTAINER_H_
 
-#include <immintrin.h>
-
 #include <memory>
 #include <random>
 #include <vector>
 
+#include "gematria/experiments/access_pattern_bm/flush.h"
+
 namespace gematria {
 
 static std::default_random_engine generator;
 static std::uniform_int_distribution<int> distribution(0, 1023);
 
+// Creates a container of `size` random integers that allocates its memory with
+// `allocator`, e.g. an ArenaAllocator.
 template <typename Container>
-std::unique_ptr<Container> CreateRandomSTLContainer(const std::size_t size) {
+std::unique_ptr<Container> CreateRandomSTLContainer(
+    const std::size_t size,
+    const typename Container::allocator_type &allocator) {
   static_assert(std::is_same<typename Container::value_type, int>::value,
                 "Container must hold `int`s.");
 
-  auto container = std::make_unique<Container>();
+  auto container = std::make_unique<Container>(allocator);
   auto inserter = std::inserter(*(container.get()), container.get()->end());
   for (int i = 0; i < size; ++i, ++inserter) {
     *inserter = distribution(generator);
@@ -40,13 +44,19 @@ std::unique_ptr<Container> CreateRandomSTLContainer(const std::size_t size) {
   return container;
 }
 
+template <typename Container>
+std::unique_ptr<Container> CreateRandomSTLContainer(const std::size_t size) {
+  return CreateRandomSTLContainer<Container>(
+      size, typename Container::allocator_type());
+}
+
 template <typename Container>
 void FlushSTLContainerFromCache(const Container *container) {
-  _mm_mfence();
+  CacheFlusher flusher;
+  if (!flusher.needs_elements()) return;
   for (auto &element : *container) {
-    _mm_clflushopt(&element);
+    flusher.Flush(&element);
   }
-  _mm_mfence();
 }
 
 }  // namespace gematria
@@ -14,13 +14,18 @@
 
 #include "gematria/experiments/access_pattern_bm/stl_container.h"
 
+#include <cstddef>
 #include <deque>
+#include <functional>
 #include <list>
 #include <memory>
 #include <set>
+#include <string>
 
 #include "benchmark/benchmark.h"
 #include "gematria/experiments/access_pattern_bm/configuration.h"
+#include "gematria/experiments/access_pattern_bm/memory_backend.h"
+#include "gematria/experiments/access_pattern_bm/numa.h"
 
 namespace gematria {
 namespace {
@@ -104,5 +109,125 @@ BENCHMARK(BM_STLContainer_Flush<std::multiset<int>>)->Range(1 << 4, 1 << 16);
 BENCHMARK(BM_STLContainer_Flush<std::list<int>>)->Range(1 << 4, 1 << 16);
 BENCHMARK(BM_STLContainer_Flush<std::deque<int>>)->Range(1 << 4, 1 << 16);
 
+// The size of the arena used by BM_STLContainer_Arena per element of the
+// container; this is more than the size of a node of any of the containers.
+constexpr std::size_t kArenaBytesPerElement = 64;
+// The size of the arena used by BM_STLContainer_Arena for the allocations that
+// do not depend on the number of elements, e.g. the block map of std::deque.
+constexpr std::size_t kArenaOverhead = 1 << 20;
+
+// Loops over a container whose nodes are bump-allocated from an arena backed by
+// the memory backend `state.range(1)`, after flushing it from the caches.
+// Unlike the default allocator, the arena places consecutively created nodes
+// next to each other regardless of the state of the heap.
+template <typename Container>
+void BM_STLContainer_Arena(benchmark::State &state) {
+  const std::size_t size = state.range(0);
+  const auto backend = static_cast<MemoryBackend>(state.range(1));
+
+  Arena arena(size * kArenaBytesPerElement + kArenaOverhead, backend);
+  if (!arena.ok()) {
+    state.SkipWithError("Could not allocate the arena");
+    return;
+  }
+  state.SetLabel(std::string(MemoryBackendName(backend)));
+  auto container = CreateRandomSTLContainer<Container>(
+      size, typename Container::allocator_type(&arena));
+
+  for (auto _ : state) {
+    int sum = 0;
+    state.PauseTiming();
+    FlushSTLContainerFromCache(container.get());
+    state.ResumeTiming();
+
+    for (auto element : *container) {
+      sum += element;
+    }
+
+    benchmark::DoNotOptimize(sum);
+  }
+}
+
+BENCHMARK(
+    BM_STLContainer_Arena<std::multiset<int, std::less<int>,
+                                        ArenaAllocator<int>>>)
+    ->ArgsProduct({benchmark::CreateRange(1 << 4, 1 << 16, 8), {1, 2, 3}});
+BENCHMARK(BM_STLContainer_Arena<std::list<int, ArenaAllocator<int>>>)
+    ->ArgsProduct({benchmark::CreateRange(1 << 4, 1 << 16, 8), {1, 2, 3}});
+BENCHMARK(BM_STLContainer_Arena<std::deque<int, ArenaAllocator<int>>>)
+    ->ArgsProduct({benchmark::CreateRange(1 << 4, 1 << 16, 8), {1, 2, 3}});
+
+// The container shared by all threads of BM_STLContainer_Shared<Container>.
+template <typename Container>
+std::unique_ptr<Container> shared_container;
+
+template <typename Container>
+void SetUpSharedSTLContainer(const benchmark::State &state) {
+  // The container is initialized on the CPUs of the data node, which places its
+  // pages on that node.
+  ScopedNumaNodeAffinity affinity(state.range(1));
+  shared_container<Container> =
+      CreateRandomSTLContainer<Container>(state.range(0));
+}
+
+template <typename Container>
+void TearDownSharedSTLContainer(const benchmark::State &state) {
+  shared_container<Container>.reset();
+}
+
+// Loops over a container shared by all threads of the benchmark.
+// `state.range(1)` is the NUMA node that holds the container and
+// `state.range(2)` the NUMA node on which the threads run.
+template <typename Container>
+void BM_STLContainer_Shared(benchmark::State &state) {
+  const int data_node = state.range(1);
+  const int thread_node = state.range(2);
+  if (!HasNumaNodes(data_node) || !HasNumaNodes(thread_node)) {
+    state.SkipWithError("The NUMA nodes are not available");
+    return;
+  }
+  ScopedNumaNodeAffinity affinity(
+      NumaNodeForThread(thread_node, state.thread_index()));
+  if (!affinity.ok()) {
+    state.SkipWithError("Could not run on the NUMA node");
+    return;
+  }
+  const Container &container = *shared_container<Container>;
+
+  for (auto _ : state) {
+    int sum = 0;
+
+    // Loop over the container, doing some dummy
+    // operations along the way.
+    for (auto element : container) {
+      sum += element;
+    }
+
+    benchmark::DoNotOptimize(sum);
+  }
+}
+
+BENCHMARK(BM_STLContainer_Shared<std::multiset<int>>)
+    ->Setup(SetUpSharedSTLContainer<std::multiset<int>>)
+    ->Teardown(TearDownSharedSTLContainer<std::multiset<int>>)
+    ->ArgsProduct({benchmark::CreateRange(1 << 6, 1 << 16, 8),
+                   {kNoNumaNode, 0},
+                   {kNoNumaNode, 0, 1, kAlternateNumaNodes}})
+    ->ThreadRange(1, 8);
+BENCHMARK(BM_STLContainer_Shared<std::list<int>>)
+    ->Setup(SetUpSharedSTLContainer<std::list<int>>)
+    ->Teardown(TearDownSharedSTLContainer<std::list<int>>)
+    ->ArgsProduct({benchmark::CreateRange(1 << 6, 1 << 16, 8),
+                   {kNoNumaNode, 0},
+                   {kNoNumaNode, 0, 1, kAlternateNumaNodes}})
+    ->ThreadRange(1, 8);
+BENCHMARK(BM_STLContainer_Shared<std::deque<int>>)
+    ->Setup(SetUpSharedSTLContainer<std::deque<int>>)
+    ->Teardown(TearDownSharedSTLContainer<std::deque<int>>)
+    ->ArgsProduct({benchmark::CreateRange(1 << 6, 1 << 16, 8),
+                   {kNoNumaNode, 0},
+                   {kNoNumaNode, 0, 1, kAlternateNumaNodes}})
+    ->ThreadRange(1, 8);
+
 }  // namespace
 }  // namespace gematria
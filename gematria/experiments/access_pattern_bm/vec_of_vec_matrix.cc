@@ -12,13 +12,11 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
-#include <immintrin.h>
-
 #include <memory>
 #include <random>
 #include <vector>
 
-#include "absl/base/optimization.h"
+#include "gematria/experiments/access_pattern_bm/flush.h"
 
 namespace gematria {
 
@@ -40,16 +38,11 @@ std::unique_ptr<std::vector<std::vector<int>>> CreateRandomVecOfVecMatrix(
 }
 
 void FlushVecOfVecMatrixFromCache(const std::vector<std::vector<int>> *matrix) {
-  const std::size_t size = matrix->size();
-  constexpr int line_size = ABSL_CACHELINE_SIZE;
-
-  _mm_mfence();
-  for (int i = 0; i < size; ++i) {
-    for (int j = 0; j < size; j += line_size / sizeof(int)) {
-      _mm_clflushopt(&(*matrix)[i][j]);
-    }
+  CacheFlusher flusher;
+  if (!flusher.needs_elements()) return;
+  for (const std::vector<int> &row : *matrix) {
+    flusher.FlushRange(row.data(), row.size() * sizeof(int));
   }
-  _mm_mfence();
 }
 
 }  // namespace gematria
@@ -21,6 +21,7 @@
 
 #include "benchmark/benchmark.h"
 #include "gematria/experiments/access_pattern_bm/configuration.h"
+#include "gematria/experiments/access_pattern_bm/numa.h"
 
 namespace gematria {
 namespace {
@@ -96,5 +97,61 @@ void BM_VecOfVecMatrix_Flush(benchmark::State &state) {
 
 BENCHMARK(BM_VecOfVecMatrix_Flush)->Range(1 << 4, 1 << 12);
 
+// The matrix shared by all threads of BM_VecOfVecMatrix_Shared.
+std::unique_ptr<std::vector<std::vector<int>>> shared_matrix;
+
+void SetUpSharedVecOfVecMatrix(const benchmark::State &state) {
+  // The matrix is initialized on the CPUs of the data node, which places its
+  // pages on that node.
+  ScopedNumaNodeAffinity affinity(state.range(1));
+  shared_matrix = CreateRandomVecOfVecMatrix(state.range(0));
+}
+
+void TearDownSharedVecOfVecMatrix(const benchmark::State &state) {
+  shared_matrix.reset();
+}
+
+// Loops over a matrix shared by all threads of the benchmark. `state.range(1)`
+// is the NUMA node that holds the matrix and `state.range(2)` the NUMA node on
+// which the threads run.
+void BM_VecOfVecMatrix_Shared(benchmark::State &state) {
+  const std::size_t size = state.range(0);
+  const int data_node = state.range(1);
+  const int thread_node = state.range(2);
+  if (!HasNumaNodes(data_node) || !HasNumaNodes(thread_node)) {
+    state.SkipWithError("The NUMA nodes are not available");
+    return;
+  }
+  ScopedNumaNodeAffinity affinity(
+      NumaNodeForThread(thread_node, state.thread_index()));
+  if (!affinity.ok()) {
+    state.SkipWithError("Could not run on the NUMA node");
+    return;
+  }
+  const std::vector<std::vector<int>> &matrix = *shared_matrix;
+
+  for (auto _ : state) {
+    int64_t sum = 0;
+
+    // Loop over the matrix, doing some dummy
+    // operations along the way.
+    for (int i = 0; i < size; ++i) {
+      for (int j = 0; j < size; ++j) {
+        sum += matrix[i][j];
+      }
+    }
+
+    benchmark::DoNotOptimize(sum);
+  }
+}
+
+BENCHMARK(BM_VecOfVecMatrix_Shared)
+    ->Setup(SetUpSharedVecOfVecMatrix)
+    ->Teardown(TearDownSharedVecOfVecMatrix)
+    ->ArgsProduct({benchmark::CreateRange(1 << 6, 1 << 12, 8),
+                   {kNoNumaNode, 0},
+                   {kNoNumaNode, 0, 1, kAlternateNumaNodes}})
+    ->ThreadRange(1, 8);
+
 }  // namespace
 }  // namespace gematria
@@ -0,0 +1,220 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "gematria/granite/batch_size_autotuner.h"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/granite/graph_builder_model_inference.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Errc.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/ErrorOr.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+namespace gematria {
+namespace {
+
+// The first token of the autotuning files. Bump the version when the format of
+// the file changes.
+constexpr llvm::StringLiteral kAutotuneFileMagic = "gematria_batch_autotune_v1";
+
+}  // namespace
+
+BatchSizeAutotuner::BatchSizeAutotuner(BatchSizeAutotunerOptions options)
+    : options_(std::move(options)) {
+  assert(std::is_sorted(options_.candidate_node_budgets.begin(),
+                        options_.candidate_node_budgets.end()));
+  assert(options_.num_measured_batches > 0);
+  candidates_.reserve(options_.candidate_node_budgets.size());
+  for (const int node_budget : options_.candidate_node_budgets) {
+    candidates_.push_back({.node_budget = node_budget});
+  }
+}
+
+int BatchSizeAutotuner::current_node_budget() const {
+  assert(!done());
+  return candidates_[current_candidate_].node_budget;
+}
+
+void BatchSizeAutotuner::AddMeasurement(int num_nodes,
+                                        std::chrono::nanoseconds invoke_time) {
+  assert(!done());
+  Candidate& candidate = candidates_[current_candidate_];
+  if (candidate.num_batches++ >= options_.num_warmup_batches) {
+    candidate.num_measured_nodes += num_nodes;
+    candidate.measured_time += invoke_time;
+    candidate.max_batch_time = std::max(candidate.max_batch_time, invoke_time);
+  }
+  candidate.underfilled |= num_nodes < candidate.node_budget;
+  if (candidate.num_batches <
+      options_.num_warmup_batches + options_.num_measured_batches) {
+    return;
+  }
+  // The batches of the larger candidates would be the same as the batches of
+  // an underfilled candidate, and they would be at least as slow as the batches
+  // of a candidate that is over the latency ceiling.
+  if (candidate.underfilled || !MeetsLatencyCeiling(candidate)) {
+    current_candidate_ = candidates_.size();
+  } else {
+    ++current_candidate_;
+  }
+}
+
+double BatchSizeAutotuner::Candidate::nodes_per_second() const {
+  const double seconds =
+      std::chrono::duration<double>(measured_time).count();
+  return seconds > 0 ? num_measured_nodes / seconds : 0.0;
+}
+
+bool BatchSizeAutotuner::MeetsLatencyCeiling(const Candidate& candidate) const {
+  return options_.max_batch_latency.count() <= 0 ||
+         candidate.max_batch_time <= options_.max_batch_latency;
+}
+
+std::optional<int> BatchSizeAutotuner::best_node_budget() const {
+  const Candidate* best = nullptr;
+  for (const Candidate& candidate : candidates_) {
+    if (!candidate.measured() || !MeetsLatencyCeiling(candidate)) continue;
+    if (best == nullptr ||
+        candidate.nodes_per_second() > best->nodes_per_second()) {
+      best = &candidate;
+    }
+  }
+  if (best != nullptr) return best->node_budget;
+  // None of the candidates meets the latency ceiling. The smallest one is the
+  // closest to it.
+  if (!candidates_.empty() && candidates_.front().measured()) {
+    return candidates_.front().node_budget;
+  }
+  return std::nullopt;
+}
+
+std::string BatchSizeAutotuner::FormatResults() const {
+  std::string results;
+  llvm::raw_string_ostream out(results);
+  for (const Candidate& candidate : candidates_) {
+    if (!candidate.measured()) continue;
+    const double ns_per_node =
+        static_cast<double>(candidate.measured_time.count()) /
+        candidate.num_measured_nodes;
+    out << llvm::format(
+        "node budget %d: %.1f ns/node, %.0f nodes/s, slowest batch %.3f ms%s\n",
+        candidate.node_budget, ns_per_node, candidate.nodes_per_second(),
+        std::chrono::duration<double, std::milli>(candidate.max_batch_time)
+            .count(),
+        candidate.underfilled ? " (underfilled)" : "");
+  }
+  out.flush();
+  return results;
+}
+
+llvm::Error RunBatchSizeAutotuner(GraphBuilderModelInference& inference,
+                                  llvm::ArrayRef<BasicBlock> blocks,
+                                  BatchSizeAutotuner& autotuner) {
+  size_t next_block = 0;
+  while (!autotuner.done() && !blocks.empty()) {
+    const int node_budget = autotuner.current_node_budget();
+    inference.Reset();
+    // Each block is tried at most once per batch; a block added twice would be
+    // deduplicated and it would not make the batch bigger.
+    for (size_t i = 0;
+         i < blocks.size() && inference.num_nodes_in_batch() < node_budget;
+         ++i) {
+      inference.AddBasicBlockToBatch(blocks[next_block]);
+      next_block = (next_block + 1) % blocks.size();
+    }
+    const int num_nodes = inference.num_nodes_in_batch();
+    // None of the blocks could be added to the batch.
+    if (num_nodes == 0) break;
+
+    const std::chrono::nanoseconds invoke_time_before =
+        inference.run_inference_times().invoke;
+    // Only the time of the inference is measured; the predictions are not
+    // needed, so they are not copied out of the interpreter.
+    llvm::Expected<GraphBuilderModelInference::PredictionsView> predictions =
+        inference.RunInferenceView();
+    if (llvm::Error error = predictions.takeError()) return error;
+    autotuner.AddMeasurement(
+        num_nodes, inference.run_inference_times().invoke - invoke_time_before);
+  }
+  inference.Reset();
+  return llvm::Error::success();
+}
+
+llvm::Error SaveAutotunedNodeBudget(const std::string& file_name,
+                                    std::string_view model_id,
+                                    int node_budget) {
+  std::error_code error_code;
+  llvm::raw_fd_ostream out(file_name, error_code, llvm::sys::fs::OF_Text);
+  if (error_code) {
+    return llvm::createStringError(error_code, "Could not open %s: %s",
+                                   file_name.c_str(),
+                                   error_code.message().c_str());
+  }
+  out << kAutotuneFileMagic << " " << model_id << " " << node_budget << "\n";
+  out.flush();
+  if (out.has_error()) {
+    return llvm::createStringError(out.error(), "Could not write %s",
+                                   file_name.c_str());
+  }
+  return llvm::Error::success();
+}
+
+llvm::Expected<std::optional<int>> LoadAutotunedNodeBudget(
+    const std::string& file_name, std::string_view model_id) {
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer =
+      llvm::MemoryBuffer::getFile(file_name, /*IsText=*/true);
+  if (std::error_code error_code = buffer.getError()) {
+    if (error_code == std::errc::no_such_file_or_directory) {
+      return std::nullopt;
+    }
+    return llvm::createStringError(error_code, "Could not read %s: %s",
+                                   file_name.c_str(),
+                                   error_code.message().c_str());
+  }
+
+  const llvm::StringRef line = (*buffer)->getBuffer().split('\n').first;
+  const auto [magic, rest] = line.split(' ');
+  const auto [file_model_id, node_budget_str] = rest.split(' ');
+  int node_budget = 0;
+  if (magic != kAutotuneFileMagic ||
+      node_budget_str.trim().getAsInteger(10, node_budget) ||
+      node_budget <= 0) {
+    return llvm::createStringError(llvm::errc::invalid_argument,
+                                   "%s is not a batch size autotuning file",
+                                   file_name.c_str());
+  }
+  if (file_model_id != model_id) return std::nullopt;
+  return node_budget;
+}
+
+}  // namespace gematria
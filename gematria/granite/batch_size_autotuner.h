@@ -0,0 +1,136 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_BATCH_SIZE_AUTOTUNER_H_
+#define THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_BATCH_SIZE_AUTOTUNER_H_
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/granite/graph_builder_model_inference.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/Support/Error.h"
+
+namespace gematria {
+
+// Options of BatchSizeAutotuner.
+struct BatchSizeAutotunerOptions {
+  // The node budgets tried by the autotuner, in increasing order.
+  std::vector<int> candidate_node_budgets = {256,  512,   1024,  2048, 4096,
+                                             8192, 16384, 32768, 65536};
+  // The number of batches run for each candidate before the measurement
+  // starts. The first batch of a new size resizes the input tensors and
+  // reallocates the tensor arena.
+  int num_warmup_batches = 1;
+  // The number of batches measured for each candidate.
+  int num_measured_batches = 3;
+  // When positive, candidates whose slowest measured batch took longer than
+  // this are not chosen, and the larger candidates are not tried.
+  std::chrono::nanoseconds max_batch_latency{0};
+};
+
+// Picks the node budget of the batches (--gematria_max_nodes_per_batch) that
+// maximizes the throughput of the model on the current host. The caller runs
+// batches of about current_node_budget() nodes and reports their Invoke()
+// times; the autotuner moves through the candidates from the smallest one, and
+// stops early when a candidate violates the latency ceiling or when the sample
+// of basic blocks is too small to fill the batches of the larger candidates.
+//
+// Typical usage:
+//   BatchSizeAutotuner autotuner(options);
+//   while (!autotuner.done()) {
+//     // Build a batch with about autotuner.current_node_budget() nodes.
+//     autotuner.AddMeasurement(num_nodes, invoke_time);
+//   }
+//   std::optional<int> node_budget = autotuner.best_node_budget();
+class BatchSizeAutotuner {
+ public:
+  explicit BatchSizeAutotuner(BatchSizeAutotunerOptions options = {});
+
+  // Returns true when all candidates that are worth trying were measured.
+  bool done() const { return current_candidate_ >= candidates_.size(); }
+
+  // Returns the node budget of the next batch. Must not be called when done()
+  // is true.
+  int current_node_budget() const;
+
+  // Records a batch built for current_node_budget() that has `num_nodes` nodes
+  // and whose Invoke() took `invoke_time`. A batch with fewer nodes than the
+  // budget means that there were not enough basic blocks to fill it, and the
+  // larger candidates are not tried.
+  void AddMeasurement(int num_nodes, std::chrono::nanoseconds invoke_time);
+
+  // Returns the measured candidate with the highest throughput in nodes per
+  // second that meets the latency ceiling; when none of them does, returns the
+  // smallest candidate. Returns std::nullopt when no candidate was measured.
+  std::optional<int> best_node_budget() const;
+
+  // Returns a human-readable summary of the measurements, one line per
+  // measured candidate.
+  std::string FormatResults() const;
+
+ private:
+  struct Candidate {
+    int node_budget = 0;
+    int num_batches = 0;
+    // The totals over the measured batches, i.e. without the warm-up batches.
+    int64_t num_measured_nodes = 0;
+    std::chrono::nanoseconds measured_time{0};
+    std::chrono::nanoseconds max_batch_time{0};
+    // True when at least one batch had fewer nodes than the budget.
+    bool underfilled = false;
+
+    bool measured() const { return num_measured_nodes > 0; }
+    double nodes_per_second() const;
+  };
+
+  // Returns true when `candidate` meets the latency ceiling.
+  bool MeetsLatencyCeiling(const Candidate& candidate) const;
+
+  const BatchSizeAutotunerOptions options_;
+  std::vector<Candidate> candidates_;
+  size_t current_candidate_ = 0;
+};
+
+// Runs `autotuner` to the end on batches built from `blocks` by `inference`.
+// The blocks are taken in a round-robin fashion, so that consecutive batches
+// have different blocks; the predictions are discarded. Leaves the batch of
+// `inference` empty. Returns an error when the inference fails.
+llvm::Error RunBatchSizeAutotuner(GraphBuilderModelInference& inference,
+                                  llvm::ArrayRef<BasicBlock> blocks,
+                                  BatchSizeAutotuner& autotuner);
+
+// Saves `node_budget` chosen for the model identified by `model_id` (see
+// PredictionCache::ModelIdFromTfLiteModel()) to `file_name`, so that later runs
+// on the same host can skip the autotuning. Overwrites the file if it exists.
+llvm::Error SaveAutotunedNodeBudget(const std::string& file_name,
+                                    std::string_view model_id,
+                                    int node_budget);
+
+// Loads a node budget saved by SaveAutotunedNodeBudget(). Returns std::nullopt
+// when the file does not exist or when it was created for a different model.
+// Returns an error when the file can't be read or parsed.
+llvm::Expected<std::optional<int>> LoadAutotunedNodeBudget(
+    const std::string& file_name, std::string_view model_id);
+
+}  // namespace gematria
+
+#endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_BATCH_SIZE_AUTOTUNER_H_
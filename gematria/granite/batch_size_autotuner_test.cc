@@ -0,0 +1,213 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/granite/batch_size_autotuner.h"
+
+#include <chrono>
+#include <memory>
+#include <optional>
+#include <string>
+#include <system_error>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/ErrorOr.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FileUtilities.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Testing/Support/Error.h"
+
+namespace gematria {
+namespace {
+
+using ::std::chrono::nanoseconds;
+using ::testing::Eq;
+using ::testing::HasSubstr;
+using ::testing::Optional;
+
+BatchSizeAutotunerOptions TestOptions() {
+  BatchSizeAutotunerOptions options;
+  options.candidate_node_budgets = {100, 200, 400};
+  options.num_warmup_batches = 1;
+  options.num_measured_batches = 2;
+  return options;
+}
+
+// Adds one warm-up batch and the measured batches for the current candidate
+// of `autotuner`. Each batch has `num_nodes` nodes and takes `batch_time`. The
+// warm-up batch is much slower, so that the tests fail when it is measured.
+void MeasureCandidate(BatchSizeAutotuner& autotuner, int num_nodes,
+                      nanoseconds batch_time) {
+  autotuner.AddMeasurement(num_nodes, batch_time * 100);
+  for (int i = 0; i < TestOptions().num_measured_batches; ++i) {
+    ASSERT_FALSE(autotuner.done());
+    autotuner.AddMeasurement(num_nodes, batch_time);
+  }
+}
+
+TEST(BatchSizeAutotunerTest, NoMeasurements) {
+  BatchSizeAutotuner autotuner(TestOptions());
+  EXPECT_FALSE(autotuner.done());
+  EXPECT_EQ(autotuner.current_node_budget(), 100);
+  EXPECT_EQ(autotuner.best_node_budget(), std::nullopt);
+  EXPECT_EQ(autotuner.FormatResults(), "");
+}
+
+TEST(BatchSizeAutotunerTest, PicksHighestThroughput) {
+  BatchSizeAutotuner autotuner(TestOptions());
+  // 1 node/ns.
+  MeasureCandidate(autotuner, 100, nanoseconds(100));
+  EXPECT_EQ(autotuner.current_node_budget(), 200);
+  // 2 nodes/ns.
+  MeasureCandidate(autotuner, 200, nanoseconds(100));
+  EXPECT_EQ(autotuner.current_node_budget(), 400);
+  // 1 node/ns.
+  MeasureCandidate(autotuner, 400, nanoseconds(400));
+  EXPECT_TRUE(autotuner.done());
+  EXPECT_THAT(autotuner.best_node_budget(), Optional(200));
+}
+
+TEST(BatchSizeAutotunerTest, WarmupBatchesAreNotMeasured) {
+  BatchSizeAutotuner autotuner(TestOptions());
+  // The warm-up batch of the first candidate is very fast. With the warm-up
+  // batch, the candidate would have the highest throughput; without it, it
+  // has 0.67 nodes/ns while the second candidate has 0.8 nodes/ns.
+  autotuner.AddMeasurement(100, nanoseconds(1));
+  autotuner.AddMeasurement(100, nanoseconds(150));
+  autotuner.AddMeasurement(100, nanoseconds(150));
+  MeasureCandidate(autotuner, 200, nanoseconds(250));
+  MeasureCandidate(autotuner, 400, nanoseconds(4000));
+  EXPECT_TRUE(autotuner.done());
+  EXPECT_THAT(autotuner.best_node_budget(), Optional(200));
+}
+
+TEST(BatchSizeAutotunerTest, StopsWhenUnderfilled) {
+  BatchSizeAutotuner autotuner(TestOptions());
+  MeasureCandidate(autotuner, 100, nanoseconds(100));
+  // There are not enough basic blocks to fill a batch of 200 nodes; the
+  // batches of 400 nodes would be the same, so they are not tried.
+  MeasureCandidate(autotuner, 150, nanoseconds(50));
+  EXPECT_TRUE(autotuner.done());
+  EXPECT_THAT(autotuner.best_node_budget(), Optional(200));
+  EXPECT_THAT(autotuner.FormatResults(), HasSubstr("(underfilled)"));
+}
+
+TEST(BatchSizeAutotunerTest, StopsAtLatencyCeiling) {
+  BatchSizeAutotunerOptions options = TestOptions();
+  options.max_batch_latency = nanoseconds(150);
+  BatchSizeAutotuner autotuner(options);
+  MeasureCandidate(autotuner, 100, nanoseconds(100));
+  // The candidate has a higher throughput, but it is over the ceiling.
+  MeasureCandidate(autotuner, 200, nanoseconds(160));
+  EXPECT_TRUE(autotuner.done());
+  EXPECT_THAT(autotuner.best_node_budget(), Optional(100));
+}
+
+TEST(BatchSizeAutotunerTest, NoCandidateMeetsLatencyCeiling) {
+  BatchSizeAutotunerOptions options = TestOptions();
+  options.max_batch_latency = nanoseconds(10);
+  BatchSizeAutotuner autotuner(options);
+  MeasureCandidate(autotuner, 100, nanoseconds(100));
+  EXPECT_TRUE(autotuner.done());
+  // The smallest candidate is the closest to the ceiling.
+  EXPECT_THAT(autotuner.best_node_budget(), Optional(100));
+}
+
+TEST(BatchSizeAutotunerTest, FormatResults) {
+  BatchSizeAutotunerOptions options = TestOptions();
+  options.candidate_node_budgets = {100};
+  BatchSizeAutotuner autotuner(options);
+  MeasureCandidate(autotuner, 100, std::chrono::milliseconds(1));
+  EXPECT_EQ(autotuner.FormatResults(),
+            "node budget 100: 10000.0 ns/node, 100000 nodes/s, slowest batch "
+            "1.000 ms\n");
+}
+
+class AutotunedNodeBudgetFileTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_FALSE(
+        llvm::sys::fs::createTemporaryFile("autotune", "txt", file_name_));
+    file_remover_ = std::make_unique<llvm::FileRemover>(file_name_);
+  }
+
+  std::string file_name() const { return std::string(file_name_); }
+
+  void WriteFile(const std::string& contents) {
+    std::error_code error_code;
+    llvm::raw_fd_ostream out(file_name(), error_code);
+    ASSERT_FALSE(error_code) << error_code.message();
+    out << contents;
+  }
+
+ private:
+  llvm::SmallString<128> file_name_;
+  std::unique_ptr<llvm::FileRemover> file_remover_;
+};
+
+TEST_F(AutotunedNodeBudgetFileTest, SaveAndLoad) {
+  ASSERT_THAT_ERROR(SaveAutotunedNodeBudget(file_name(), "model_a", 2048),
+                    llvm::Succeeded());
+  EXPECT_THAT_EXPECTED(LoadAutotunedNodeBudget(file_name(), "model_a"),
+                       llvm::HasValue(Optional(2048)));
+  // The budget is specific to the model.
+  EXPECT_THAT_EXPECTED(LoadAutotunedNodeBudget(file_name(), "model_b"),
+                       llvm::HasValue(Eq(std::nullopt)));
+}
+
+TEST_F(AutotunedNodeBudgetFileTest, FileFormat) {
+  ASSERT_THAT_ERROR(SaveAutotunedNodeBudget(file_name(), "model_a", 2048),
+                    llvm::Succeeded());
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer =
+      llvm::MemoryBuffer::getFile(file_name());
+  ASSERT_TRUE(buffer) << buffer.getError().message();
+  EXPECT_EQ((*buffer)->getBuffer(),
+            "gematria_batch_autotune_v1 model_a 2048\n");
+}
+
+TEST_F(AutotunedNodeBudgetFileTest, SaveOverwritesFile) {
+  ASSERT_THAT_ERROR(SaveAutotunedNodeBudget(file_name(), "model_a", 2048),
+                    llvm::Succeeded());
+  ASSERT_THAT_ERROR(SaveAutotunedNodeBudget(file_name(), "model_b", 512),
+                    llvm::Succeeded());
+  EXPECT_THAT_EXPECTED(LoadAutotunedNodeBudget(file_name(), "model_a"),
+                       llvm::HasValue(Eq(std::nullopt)));
+  EXPECT_THAT_EXPECTED(LoadAutotunedNodeBudget(file_name(), "model_b"),
+                       llvm::HasValue(Optional(512)));
+}
+
+TEST_F(AutotunedNodeBudgetFileTest, MissingFile) {
+  EXPECT_THAT_EXPECTED(
+      LoadAutotunedNodeBudget(file_name() + ".missing", "model_a"),
+      llvm::HasValue(Eq(std::nullopt)));
+}
+
+TEST_F(AutotunedNodeBudgetFileTest, InvalidFiles) {
+  for (const char* const contents :
+       {"", "gematria_batch_autotune_v0 model_a 2048\n",
+        "gematria_batch_autotune_v1 model_a\n",
+        "gematria_batch_autotune_v1 model_a many\n",
+        "gematria_batch_autotune_v1 model_a 0\n",
+        "gematria_batch_autotune_v1 model_a -16\n"}) {
+    SCOPED_TRACE(contents);
+    ASSERT_NO_FATAL_FAILURE(WriteFile(contents));
+    EXPECT_THAT_EXPECTED(LoadAutotunedNodeBudget(file_name(), "model_a"),
+                         llvm::Failed());
+  }
+}
+
+}  // namespace
+}  // namespace gematria
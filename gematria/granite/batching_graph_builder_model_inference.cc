@@ -0,0 +1,192 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/granite/batching_graph_builder_model_inference.h"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <future>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/granite/graph_builder_model_inference.h"
+#include "llvm/Support/Errc.h"
+#include "llvm/Support/Error.h"
+
+namespace gematria {
+
+llvm::Expected<std::unique_ptr<BatchingGraphBuilderModelInference>>
+BatchingGraphBuilderModelInference::Create(
+    const GraphBuilderModelInference& inference,
+    const BatchingOptions& options) {
+  llvm::Expected<std::unique_ptr<GraphBuilderModelInference>> clone =
+      inference.Clone();
+  if (llvm::Error error = clone.takeError()) return error;
+
+  // We can't use std::make_unique<BatchingGraphBuilderModelInference>(),
+  // because std::make_unique<>() requires a public constructor.
+  return std::unique_ptr<BatchingGraphBuilderModelInference>(
+      new BatchingGraphBuilderModelInference(std::move(*clone), options));
+}
+
+BatchingGraphBuilderModelInference::BatchingGraphBuilderModelInference(
+    std::unique_ptr<GraphBuilderModelInference> inference,
+    const BatchingOptions& options)
+    : inference_(std::move(inference)), options_(options) {
+  assert(inference_ != nullptr);
+  batching_thread_ = std::thread([this]() { BatchingLoop(); });
+}
+
+BatchingGraphBuilderModelInference::~BatchingGraphBuilderModelInference() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    shutting_down_ = true;
+  }
+  requests_available_.notify_all();
+  batching_thread_.join();
+}
+
+BatchingGraphBuilderModelInference::FutureType
+BatchingGraphBuilderModelInference::Submit(std::vector<BasicBlock> blocks) {
+  Request request{std::move(blocks), std::promise<ResultType>(),
+                  std::chrono::steady_clock::now()};
+  FutureType future = request.result.get_future();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    assert(!shutting_down_);
+    requests_.push_back(std::move(request));
+  }
+  requests_available_.notify_one();
+  return future;
+}
+
+int BatchingGraphBuilderModelInference::num_batches() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return num_batches_;
+}
+
+int BatchingGraphBuilderModelInference::num_requests() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return num_requests_;
+}
+
+void BatchingGraphBuilderModelInference::BatchingLoop() {
+  const auto batch_is_full = [this]() {
+    return (options_.max_blocks_per_batch > 0 &&
+            inference_->num_blocks_in_batch() >=
+                options_.max_blocks_per_batch) ||
+           (options_.max_nodes_per_batch > 0 &&
+            inference_->num_nodes_in_batch() >= options_.max_nodes_per_batch);
+  };
+  const auto has_room_for = [this](const Request& request) {
+    return options_.max_blocks_per_batch <= 0 ||
+           inference_->num_blocks_in_batch() == 0 ||
+           inference_->num_blocks_in_batch() +
+                   static_cast<int>(request.blocks.size()) <=
+               options_.max_blocks_per_batch;
+  };
+
+  while (true) {
+    std::vector<Request> batch;
+    std::vector<int> first_block;
+    inference_->Reset();
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      requests_available_.wait(
+          lock, [this]() { return shutting_down_ || !requests_.empty(); });
+      // Drain the queue before shutting down, so that all futures returned by
+      // Submit() eventually receive a value.
+      if (requests_.empty()) return;
+      const std::chrono::steady_clock::time_point deadline =
+          requests_.front().submit_time + options_.max_batch_delay;
+      while (true) {
+        while (!requests_.empty() && !batch_is_full() &&
+               has_room_for(requests_.front())) {
+          batch.push_back(std::move(requests_.front()));
+          requests_.pop_front();
+          // Build the graphs without holding the lock, so that other threads
+          // can submit requests in the meantime.
+          lock.unlock();
+          const Request& request = batch.back();
+          int request_first_block = inference_->num_blocks_in_batch();
+          for (const BasicBlock& block : request.blocks) {
+            if (!inference_->AddBasicBlockToBatch(block)) {
+              request_first_block = -1;
+              break;
+            }
+          }
+          first_block.push_back(request_first_block);
+          lock.lock();
+        }
+        if (shutting_down_ || batch_is_full() ||
+            (!requests_.empty() && !has_room_for(requests_.front()))) {
+          break;
+        }
+        if (!requests_available_.wait_until(lock, deadline, [this]() {
+              return shutting_down_ || !requests_.empty();
+            })) {
+          break;
+        }
+      }
+      ++num_batches_;
+      num_requests_ += batch.size();
+    }
+    RunBatch(batch, first_block);
+  }
+}
+
+void BatchingGraphBuilderModelInference::RunBatch(
+    std::vector<Request>& requests, const std::vector<int>& first_block) {
+  assert(requests.size() == first_block.size());
+  for (int i = 0; i < requests.size(); ++i) {
+    if (first_block[i] < 0) {
+      requests[i].result.set_value(llvm::createStringError(
+          llvm::errc::invalid_argument,
+          "Basic block could not be added to the batch"));
+    }
+  }
+  if (std::none_of(first_block.begin(), first_block.end(),
+                   [](int block) { return block >= 0; })) {
+    return;
+  }
+
+  ResultType predictions = inference_->RunInference();
+  if (!predictions) {
+    // The error can be consumed only once; each request gets a copy of its
+    // message.
+    const std::string message = llvm::toString(predictions.takeError());
+    for (int i = 0; i < requests.size(); ++i) {
+      if (first_block[i] < 0) continue;
+      requests[i].result.set_value(
+          llvm::createStringError(llvm::inconvertibleErrorCode(), message));
+    }
+    return;
+  }
+  for (int i = 0; i < requests.size(); ++i) {
+    if (first_block[i] < 0) continue;
+    const auto begin = predictions->begin() + first_block[i];
+    requests[i].result.set_value(std::vector<OutputType>(
+        std::make_move_iterator(begin),
+        std::make_move_iterator(begin + requests[i].blocks.size())));
+  }
+}
+
+}  // namespace gematria
@@ -0,0 +1,136 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_BATCHING_GRAPH_BUILDER_MODEL_INFERENCE_H_
+#define THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_BATCHING_GRAPH_BUILDER_MODEL_INFERENCE_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/granite/graph_builder_model_inference.h"
+#include "llvm/Support/Error.h"
+
+namespace gematria {
+
+// Options for the dynamic batching of BatchingGraphBuilderModelInference.
+struct BatchingOptions {
+  // The maximal number of basic blocks in a batch. When not positive, the
+  // number of blocks is not limited.
+  int max_blocks_per_batch = 0;
+  // A batch is closed as soon as the graphs of its basic blocks have at least
+  // this many nodes. When not positive, the number of nodes is not limited.
+  int max_nodes_per_batch = 0;
+  // The maximal time a request waits for more requests to join its batch. With
+  // zero, a batch contains only the requests that are already waiting when the
+  // previous batch finishes.
+  std::chrono::microseconds max_batch_delay{0};
+};
+
+// Runs inference with a trained GRANITE model on requests submitted by any
+// number of threads, and merges concurrent requests into shared batches. A
+// batch is closed when it reaches one of the limits from BatchingOptions or
+// when its oldest request waited for `max_batch_delay`; the requests are never
+// split between batches.
+//
+// This serves use cases with many small requests, e.g. a server answering
+// cost queries from compiler jobs, where running the model on each request
+// separately would leave most of the batch capacity of the model unused.
+//
+// Typical usage:
+//   auto batching = BatchingGraphBuilderModelInference::Create(
+//       *inference, options);
+//   // On any thread:
+//   BatchingGraphBuilderModelInference::FutureType future =
+//       (*batching)->Submit(std::move(blocks));
+//   llvm::Expected<std::vector<OutputType>> predictions = future.get();
+class BatchingGraphBuilderModelInference {
+ public:
+  using OutputType = GraphBuilderModelInference::OutputType;
+  // The result of a single request. Contains either the predictions for all
+  // basic blocks of the request in the order in which they were submitted, or
+  // an error.
+  using ResultType = llvm::Expected<std::vector<OutputType>>;
+  using FutureType = std::future<ResultType>;
+
+  // Creates the batching wrapper. The batches are processed by a clone of
+  // `inference`, see GraphBuilderModelInference::Clone(); `inference` itself is
+  // not used afterwards. Returns an error when the clone can't be created.
+  static llvm::Expected<std::unique_ptr<BatchingGraphBuilderModelInference>>
+  Create(const GraphBuilderModelInference& inference,
+         const BatchingOptions& options);
+
+  // Finishes processing of all submitted requests and stops the background
+  // thread.
+  ~BatchingGraphBuilderModelInference();
+
+  // Schedules inference for `blocks`. Returns a future that receives the
+  // predictions for all basic blocks in `blocks`. The future receives an error
+  // when the inference fails or when one of the basic blocks can't be added to
+  // the batch. Thread-safe.
+  FutureType Submit(std::vector<BasicBlock> blocks);
+
+  // Returns the number of batches and requests processed so far.
+  int num_batches() const;
+  int num_requests() const;
+
+ private:
+  // A request waiting for inference.
+  struct Request {
+    std::vector<BasicBlock> blocks;
+    std::promise<ResultType> result;
+    std::chrono::steady_clock::time_point submit_time;
+  };
+
+  BatchingGraphBuilderModelInference(
+      std::unique_ptr<GraphBuilderModelInference> inference,
+      const BatchingOptions& options);
+
+  // The main loop of the background thread. Forms batches from the requests in
+  // `requests_` and runs the inference for them.
+  void BatchingLoop();
+
+  // Runs inference for `requests` whose blocks were added to the batch of
+  // `inference_`, and delivers the results. `first_block` contains the index of
+  // the first block of each request in the batch, or -1 when the request could
+  // not be added.
+  void RunBatch(std::vector<Request>& requests,
+                const std::vector<int>& first_block);
+
+  const std::unique_ptr<GraphBuilderModelInference> inference_;
+  const BatchingOptions options_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable requests_available_;
+  // The submitted requests that were not added to a batch yet. Guarded by
+  // `mutex_`.
+  std::deque<Request> requests_;
+  // Set to true when the object is being destroyed. Guarded by `mutex_`.
+  bool shutting_down_ = false;
+  // Statistics; guarded by `mutex_`.
+  int num_batches_ = 0;
+  int num_requests_ = 0;
+
+  std::thread batching_thread_;
+};
+
+}  // namespace gematria
+
+#endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_BATCHING_GRAPH_BUILDER_MODEL_INFERENCE_H_
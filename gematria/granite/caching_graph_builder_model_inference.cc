@@ -0,0 +1,270 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/granite/caching_graph_builder_model_inference.h"
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/granite/graph_builder_model_inference.h"
+#include "gematria/utils/tracing.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Errc.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/ErrorOr.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "tensorflow/lite/model_builder.h"
+
+namespace gematria {
+namespace {
+
+// The first token of the header line of the cache files. Bump the version when
+// the format of the file or the format of the keys changes.
+constexpr llvm::StringLiteral kCacheFileMagic = "gematria_prediction_cache_v4";
+
+}  // namespace
+
+PredictionCache::PredictionCache(size_t max_size, std::string model_id)
+    : max_size_(max_size), model_id_(std::move(model_id)) {
+  assert(max_size_ > 0);
+}
+
+std::string PredictionCache::ModelIdFromTfLiteModel(
+    const tflite::FlatBufferModel& tflite_model) {
+  const tflite::Allocation* const allocation = tflite_model.allocation();
+  assert(allocation != nullptr);
+  llvm::MD5 md5;
+  md5.update(llvm::ArrayRef<uint8_t>(
+      static_cast<const uint8_t*>(allocation->base()), allocation->bytes()));
+  llvm::MD5::MD5Result hash;
+  md5.final(hash);
+  return std::string(hash.digest().str());
+}
+
+std::string PredictionCache::KeyForFragmentHashes(
+    llvm::ArrayRef<uint64_t> fragment_hashes) {
+  // The fragment hashes are stable across processes for a given vocabulary,
+  // and the vocabulary is a part of the model, so the keys can be stored in
+  // cache files. Each hash is written with a fixed width, so that the key is
+  // unambiguous.
+  std::string key;
+  key.reserve(fragment_hashes.size() * 16);
+  llvm::raw_string_ostream out(key);
+  for (const uint64_t fragment_hash : fragment_hashes) {
+    out << llvm::format_hex_no_prefix(fragment_hash, 16, /*Upper=*/false);
+  }
+  return out.str();
+}
+
+std::optional<PredictionCache::OutputType> PredictionCache::Lookup(
+    std::string_view key) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto it = index_.find(key);
+  if (it == index_.end()) return std::nullopt;
+  // Move the entry to the front of the list; splice() does not invalidate the
+  // iterators and the key views in `index_`.
+  entries_.splice(entries_.begin(), entries_, it->second);
+  return it->second->predictions;
+}
+
+void PredictionCache::Insert(std::string key, OutputType predictions) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  InsertLocked(std::move(key), std::move(predictions));
+}
+
+void PredictionCache::InsertLocked(std::string key, OutputType predictions) {
+  if (const auto it = index_.find(key); it != index_.end()) {
+    it->second->predictions = std::move(predictions);
+    entries_.splice(entries_.begin(), entries_, it->second);
+    return;
+  }
+  if (entries_.size() == max_size_) {
+    index_.erase(entries_.back().key);
+    entries_.pop_back();
+  }
+  entries_.push_front(Entry{std::move(key), std::move(predictions)});
+  index_.emplace(entries_.front().key, entries_.begin());
+}
+
+size_t PredictionCache::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return entries_.size();
+}
+
+llvm::Error PredictionCache::SaveToFile(const std::string& file_name) const {
+  std::error_code error_code;
+  llvm::raw_fd_ostream out(file_name, error_code, llvm::sys::fs::OF_Text);
+  if (error_code) {
+    return llvm::createStringError(error_code, "Could not open %s: %s",
+                                   file_name.c_str(),
+                                   error_code.message().c_str());
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  out << kCacheFileMagic << " " << model_id_ << "\n";
+  // Write the entries from the least recently used, so that LoadFromFile()
+  // restores the order of the entries.
+  for (auto it = entries_.rbegin(); it != entries_.rend(); ++it) {
+    for (int i = 0; i < it->predictions.size(); ++i) {
+      if (i > 0) out << ",";
+      out << llvm::format("%.9g", it->predictions[i]);
+    }
+    out << "\t" << it->key << "\n";
+  }
+  out.flush();
+  if (out.has_error()) {
+    return llvm::createStringError(out.error(), "Could not write %s",
+                                   file_name.c_str());
+  }
+  return llvm::Error::success();
+}
+
+llvm::Error PredictionCache::LoadFromFile(const std::string& file_name) {
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer =
+      llvm::MemoryBuffer::getFile(file_name, /*IsText=*/true);
+  if (std::error_code error_code = buffer.getError()) {
+    if (error_code == std::errc::no_such_file_or_directory) {
+      return llvm::Error::success();
+    }
+    return llvm::createStringError(error_code, "Could not read %s: %s",
+                                   file_name.c_str(),
+                                   error_code.message().c_str());
+  }
+
+  llvm::StringRef contents = (*buffer)->getBuffer();
+  llvm::StringRef header;
+  std::tie(header, contents) = contents.split('\n');
+  const auto [magic, file_model_id] = header.split(' ');
+  if (magic != kCacheFileMagic) {
+    return llvm::createStringError(llvm::errc::invalid_argument,
+                                   "%s is not a prediction cache file",
+                                   file_name.c_str());
+  }
+  if (file_model_id != model_id_) return llvm::Error::success();
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  int line_number = 1;
+  while (!contents.empty()) {
+    llvm::StringRef line;
+    std::tie(line, contents) = contents.split('\n');
+    ++line_number;
+    if (line.empty()) continue;
+    auto [predictions_str, key] = line.split('\t');
+    OutputType predictions;
+    while (!predictions_str.empty()) {
+      llvm::StringRef prediction_str;
+      std::tie(prediction_str, predictions_str) = predictions_str.split(',');
+      double prediction = 0;
+      if (prediction_str.getAsDouble(prediction)) {
+        return llvm::createStringError(
+            llvm::errc::invalid_argument, "Invalid prediction at %s:%d",
+            file_name.c_str(), line_number);
+      }
+      predictions.push_back(static_cast<float>(prediction));
+    }
+    if (key.empty() || predictions.empty()) {
+      return llvm::createStringError(llvm::errc::invalid_argument,
+                                     "Invalid cache entry at %s:%d",
+                                     file_name.c_str(), line_number);
+    }
+    InsertLocked(key.str(), std::move(predictions));
+  }
+  return llvm::Error::success();
+}
+
+CachingGraphBuilderModelInference::CachingGraphBuilderModelInference(
+    GraphBuilderModelInference* inference, PredictionCache* cache)
+    : inference_(*inference), cache_(*cache) {
+  assert(inference != nullptr);
+  assert(cache != nullptr);
+}
+
+bool CachingGraphBuilderModelInference::AddBasicBlockToBatch(
+    const BasicBlock& block) {
+  if (!inference_.ComputeGraphHash(block, &fragment_hashes_).has_value()) {
+    return inference_.AddBasicBlockToBatch(block);
+  }
+  std::string key = PredictionCache::KeyForFragmentHashes(fragment_hashes_);
+  if (std::optional<OutputType> predictions = cache_.Lookup(key)) {
+    ++num_cache_hits_;
+    GEMATRIA_TRACE_COUNTER(kCacheHits, 1);
+    batch_predictions_.push_back(std::move(predictions));
+    return true;
+  }
+  if (!inference_.AddBasicBlockToBatch(block)) return false;
+  ++num_cache_misses_;
+  GEMATRIA_TRACE_COUNTER(kCacheMisses, 1);
+  batch_predictions_.emplace_back();
+  batch_missing_keys_.push_back(std::move(key));
+  return true;
+}
+
+llvm::Expected<std::vector<CachingGraphBuilderModelInference::OutputType>>
+CachingGraphBuilderModelInference::RunInference() {
+  std::vector<OutputType> model_predictions;
+  if (!batch_missing_keys_.empty()) {
+    llvm::Expected<std::vector<OutputType>> predictions =
+        inference_.RunInference();
+    if (llvm::Error error = predictions.takeError()) return error;
+    if (predictions->size() != batch_missing_keys_.size()) {
+      return llvm::createStringError(
+          llvm::errc::result_out_of_range,
+          "Unexpected number of predictions. Expected %d, found %d",
+          static_cast<int>(batch_missing_keys_.size()),
+          static_cast<int>(predictions->size()));
+    }
+    model_predictions = std::move(*predictions);
+    for (int i = 0; i < model_predictions.size(); ++i) {
+      cache_.Insert(batch_missing_keys_[i], model_predictions[i]);
+    }
+  }
+
+  std::vector<OutputType> output;
+  output.reserve(batch_predictions_.size());
+  int model_prediction_index = 0;
+  for (const std::optional<OutputType>& predictions : batch_predictions_) {
+    if (predictions.has_value()) {
+      output.push_back(*predictions);
+    } else {
+      output.push_back(std::move(model_predictions[model_prediction_index++]));
+    }
+  }
+  return output;
+}
+
+void CachingGraphBuilderModelInference::Reset() {
+  inference_.Reset();
+  batch_predictions_.clear();
+  batch_missing_keys_.clear();
+}
+
+}  // namespace gematria
@@ -0,0 +1,175 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_CACHING_GRAPH_BUILDER_MODEL_INFERENCE_H_
+#define THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_CACHING_GRAPH_BUILDER_MODEL_INFERENCE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/granite/graph_builder_model_inference.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/Support/Error.h"
+#include "tensorflow/lite/model_builder.h"
+
+namespace gematria {
+
+// A bounded cache of predictions of a GRANITE model, keyed by the graph of the
+// basic block.
+// When the cache is full, inserting a new entry evicts the least recently used
+// one. All methods are thread-safe, so a single cache can be shared by several
+// inference objects running on different threads.
+//
+// The cache can be saved to a file and loaded back in a later run. The file
+// records an identifier of the model that produced the predictions, and the
+// cache ignores files created for a different model.
+class PredictionCache {
+ public:
+  using OutputType = GraphBuilderModelInference::OutputType;
+
+  // Creates an empty cache that holds at most `max_size` entries. `model_id`
+  // identifies the model whose predictions are stored in the cache; see
+  // ModelIdFromTfLiteModel().
+  PredictionCache(size_t max_size, std::string model_id);
+
+  // Returns an identifier of `tflite_model`, computed as a hash of the contents
+  // of the model.
+  static std::string ModelIdFromTfLiteModel(
+      const tflite::FlatBufferModel& tflite_model);
+
+  // Returns the key under which predictions for basic blocks with the
+  // instruction fragment hashes `fragment_hashes` are stored; see
+  // BasicBlockGraphBuilder::ComputeGraphHash(). The graph of a basic block is
+  // fully determined by its fragments, so basic blocks with the same graph,
+  // e.g. blocks that differ only in immediate values, share the key, while
+  // blocks with different graphs never do, even when their graph hashes
+  // collide.
+  static std::string KeyForFragmentHashes(
+      llvm::ArrayRef<uint64_t> fragment_hashes);
+
+  // Returns the cached predictions for the basic block with the given key, or
+  // std::nullopt when there are none. Marks the entry as recently used.
+  std::optional<OutputType> Lookup(std::string_view key);
+
+  // Adds predictions for the basic block with the given key to the cache. When
+  // the key is already in the cache, replaces the predictions.
+  void Insert(std::string key, OutputType predictions);
+
+  // Saves the contents of the cache to `file_name`. Overwrites the file if it
+  // exists.
+  llvm::Error SaveToFile(const std::string& file_name) const;
+
+  // Loads entries from a file created by SaveToFile(). Does nothing when the
+  // file does not exist or when it was created for a different model. Returns
+  // an error when the file can't be read or parsed.
+  llvm::Error LoadFromFile(const std::string& file_name);
+
+  // Returns the number of entries in the cache.
+  size_t size() const;
+
+  const std::string& model_id() const { return model_id_; }
+
+ private:
+  struct Entry {
+    std::string key;
+    OutputType predictions;
+  };
+
+  // Inserts a new entry; requires that `mutex_` is held by the caller.
+  void InsertLocked(std::string key, OutputType predictions);
+
+  const size_t max_size_;
+  const std::string model_id_;
+
+  mutable std::mutex mutex_;
+  // The entries ordered from the most recently used to the least recently
+  // used. Guarded by `mutex_`.
+  std::list<Entry> entries_;
+  // Maps keys to entries in `entries_`; the keys point to `Entry::key` of the
+  // entry. Guarded by `mutex_`.
+  std::unordered_map<std::string_view, std::list<Entry>::iterator> index_;
+};
+
+// A wrapper around GraphBuilderModelInference that looks up predictions in a
+// PredictionCache, and runs the model only for basic blocks that are not in the
+// cache. The class has the same batching API as GraphBuilderModelInference.
+//
+// Typical usage:
+//   PredictionCache cache(/* max_size = */ 100000,
+//                         PredictionCache::ModelIdFromTfLiteModel(*model));
+//   CachingGraphBuilderModelInference caching_inference(inference.get(),
+//                                                       &cache);
+//   for (const BasicBlock& block : input_basic_blocks) {
+//     caching_inference.AddBasicBlockToBatch(block);
+//   }
+//   const auto predictions = caching_inference.RunInference();
+class CachingGraphBuilderModelInference {
+ public:
+  using OutputType = GraphBuilderModelInference::OutputType;
+
+  // Creates the wrapper. Does not take ownership of `inference` and `cache`;
+  // both must remain alive for the whole lifetime of the wrapper. The cache
+  // must be used only with predictions of the model used by `inference`.
+  CachingGraphBuilderModelInference(GraphBuilderModelInference* inference,
+                                    PredictionCache* cache);
+
+  // Adds a basic block to the current batch. Returns true when the predictions
+  // for the basic block were found in the cache or when the block was
+  // successfully added to the batch of the underlying model; otherwise, returns
+  // false.
+  bool AddBasicBlockToBatch(const BasicBlock& block);
+
+  // Returns predictions for all basic blocks in the current batch in the order
+  // in which they were added. Runs the underlying model only when at least one
+  // basic block was not found in the cache, and adds the new predictions to the
+  // cache.
+  llvm::Expected<std::vector<OutputType>> RunInference();
+
+  // Removes all basic blocks from the current batch.
+  void Reset();
+
+  // Returns the number of cache hits and misses since the wrapper was created.
+  int num_cache_hits() const { return num_cache_hits_; }
+  int num_cache_misses() const { return num_cache_misses_; }
+
+ private:
+  GraphBuilderModelInference& inference_;
+  PredictionCache& cache_;
+
+  // Predictions for the basic blocks in the current batch. Contains
+  // std::nullopt for blocks that were not found in the cache.
+  std::vector<std::optional<OutputType>> batch_predictions_;
+  // The cache keys of the blocks that were not found in the cache, in the order
+  // in which they were added to the batch of `inference_`.
+  std::vector<std::string> batch_missing_keys_;
+  // The fragment hashes of the basic block being added. Reused across calls
+  // to avoid reallocations.
+  std::vector<uint64_t> fragment_hashes_;
+
+  int num_cache_hits_ = 0;
+  int num_cache_misses_ = 0;
+};
+
+}  // namespace gematria
+
+#endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_CACHING_GRAPH_BUILDER_MODEL_INFERENCE_H_
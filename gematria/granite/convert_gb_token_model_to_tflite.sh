@@ -26,6 +26,18 @@
 #     --gematria_output_tflite /tmp/gnn.tflite \
 #     --gematria_export_as_seq2seq
 #
+# With --gematria_fuse_gather_segment_sum, the script also replaces each pair of
+# GATHER + UnsortedSegmentSum ops produced from the message passing code of the
+# graph network with a single GatherSegmentSum custom op; see
+# gematria/granite/python/fuse_gather_segment_sum.py.
+#
+# With --gematria_quantization, the script quantizes the weights of the model:
+#   - float16 stores the weights as float16,
+#   - dynamic_range stores the weights as int8 and uses hybrid kernels.
+# The inputs and outputs of the model remain unchanged. Models with full integer
+# quantization need a representative data set and must be converted using the
+# Python API; the C++ inference API supports them too.
+#
 # See g3doc/granite-inference-api.md for more details on exporting models to the
 # .tflite format.
 
@@ -37,6 +49,8 @@ function print_error_and_exit() {
 # Parse command-line flags.
 # TODO(ondrasej): Consider using getopt instead of parsing the flags manually.
 gematria_export_as_seq2seq=0
+gematria_fuse_gather_segment_sum=0
+gematria_quantization="none"
 gematria_input_graphdef=""
 gematria_output_tflite=""
 while [[ "$#" -gt 0 ]]; do
@@ -58,6 +72,16 @@ while [[ "$#" -gt 0 ]]; do
     --gematria_export_as_seq2seq)
       gematria_export_as_seq2seq=1
       ;;
+    --gematria_fuse_gather_segment_sum)
+      gematria_fuse_gather_segment_sum=1
+      ;;
+    --gematria_quantization)
+      gematria_quantization="$2"
+      shift
+      ;;
+    --gematria_quantization=*)
+      gematria_quantization="${1:24}"
+      ;;
     *)
       print_error_and_exit "Unexpected command-line argument: $1"
   esac
@@ -71,6 +95,22 @@ if [[ -z "${gematria_output_tflite}" ]]; then
   print_error_and_exit "Flag --gematria_output_tflite is missing."
 fi
 
+QUANTIZATION_FLAGS=()
+case "${gematria_quantization}" in
+  none)
+    ;;
+  float16)
+    QUANTIZATION_FLAGS=(--post_training_quantize --quantize_to_float16)
+    ;;
+  dynamic_range)
+    QUANTIZATION_FLAGS=(--post_training_quantize)
+    ;;
+  *)
+    print_error_and_exit \
+      "Unexpected value of --gematria_quantization: ${gematria_quantization}"
+esac
+readonly QUANTIZATION_FLAGS
+
 # Prints its arguments joined by a comma.
 function str_join() {
   local IFS=","
@@ -128,4 +168,11 @@ tflite_convert \
   --experimental_new_converter \
   --output_arrays="${OUTPUT_TENSORS}" \
   --input_arrays="${INPUT_TENSORS}" \
-  --target_ops="${TARGET_OPS}"
+  --target_ops="${TARGET_OPS}" \
+  "${QUANTIZATION_FLAGS[@]}"
+
+if (( gematria_fuse_gather_segment_sum )); then
+  python3 -m gematria.granite.python.fuse_gather_segment_sum \
+    --gematria_input_tflite="${gematria_output_tflite}" \
+    --gematria_output_tflite="${gematria_output_tflite}"
+fi
@@ -0,0 +1,439 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/granite/graph_batch_cache.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <ios>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "gematria/granite/graph_builder.h"
+
+// The columns are written and read in the byte order of the host.
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__,
+              "The graph batch cache format requires a little-endian host");
+// The int columns of the graph builder are stored as int32_t.
+static_assert(sizeof(int) == sizeof(int32_t));
+
+namespace gematria {
+namespace {
+
+constexpr char kMagic[8] = {'G', 'M', 'G', 'R', 'B', 'T', 'C', 'H'};
+constexpr uint64_t kVersion = 1;
+constexpr size_t kAlignment = 8;
+
+// The header of the cache file. The sizes of all columns are derived from
+// these values.
+struct Header {
+  char magic[sizeof(kMagic)];
+  uint64_t version;
+  uint64_t vocabulary_hash;
+  uint64_t num_node_tokens;
+  uint64_t num_batches;
+  uint64_t num_graphs;
+  uint64_t num_nodes;
+  uint64_t num_edges;
+  uint64_t num_global_features;
+};
+static_assert(sizeof(Header) % kAlignment == 0);
+
+size_t AlignedSize(size_t size) {
+  return (size + kAlignment - 1) / kAlignment * kAlignment;
+}
+
+// Writes the contents of `column` to `file`, and pads it to the alignment of
+// the columns.
+template <typename T>
+void WriteColumn(std::ofstream& file, const std::vector<T>& column) {
+  constexpr char kPadding[kAlignment] = {};
+  const size_t size = column.size() * sizeof(T);
+  file.write(reinterpret_cast<const char*>(column.data()), size);
+  file.write(kPadding, AlignedSize(size) - size);
+}
+
+// Takes the columns from the mapped file one by one, in the order in which
+// they were written.
+class ColumnReader {
+ public:
+  ColumnReader(const char* data, size_t size, size_t offset)
+      : data_(data), size_(size), offset_(offset) {}
+
+  template <typename T>
+  absl::Status Read(uint64_t num_elements, const T*& column) {
+    if (num_elements > (size_ - offset_) / sizeof(T)) {
+      return absl::DataLossError("The graph batch cache file is truncated");
+    }
+    column = reinterpret_cast<const T*>(data_ + offset_);
+    offset_ += AlignedSize(num_elements * sizeof(T));
+    if (offset_ > size_) offset_ = size_;
+    return absl::OkStatus();
+  }
+
+ private:
+  const char* const data_;
+  const size_t size_;
+  size_t offset_;
+};
+
+// Checks that `offsets[0..num_offsets)` is a non-decreasing sequence starting
+// at zero and ending at `end`.
+absl::Status CheckOffsets(const uint64_t* offsets, uint64_t num_offsets,
+                          uint64_t end, std::string_view column) {
+  if (offsets[0] != 0 || offsets[num_offsets - 1] != end) {
+    return absl::DataLossError(absl::StrCat("Invalid range of ", column));
+  }
+  for (uint64_t i = 1; i < num_offsets; ++i) {
+    if (offsets[i] < offsets[i - 1]) {
+      return absl::DataLossError(absl::StrCat("Invalid offsets of ", column));
+    }
+  }
+  return absl::OkStatus();
+}
+
+// Checks that all elements of `values[0..num_values)` are in the range
+// [0, limit).
+template <typename T>
+absl::Status CheckRange(const T* values, uint64_t num_values, int64_t limit,
+                        std::string_view column) {
+  for (uint64_t i = 0; i < num_values; ++i) {
+    if (values[i] < 0 || values[i] >= limit) {
+      return absl::DataLossError(absl::StrCat("Invalid value of ", column));
+    }
+  }
+  return absl::OkStatus();
+}
+
+// Checks that the elements of `counts[0..num_counts)` are non-negative and add
+// up to `total`.
+absl::Status CheckCounts(const int32_t* counts, uint64_t num_counts,
+                         uint64_t total, std::string_view column) {
+  uint64_t sum = 0;
+  for (uint64_t i = 0; i < num_counts; ++i) {
+    if (counts[i] < 0) {
+      return absl::DataLossError(absl::StrCat("Invalid value of ", column));
+    }
+    sum += counts[i];
+  }
+  if (sum != total) {
+    return absl::DataLossError(absl::StrCat("Inconsistent ", column));
+  }
+  return absl::OkStatus();
+}
+
+// Replaces the contents of `to` with `from[begin..end)`, converting the values
+// to the element type of `to`.
+template <typename T, typename U>
+void AssignColumn(const U* from, uint64_t begin, uint64_t end,
+                  std::vector<T>& to) {
+  to.resize(end - begin);
+  for (uint64_t i = begin; i < end; ++i) {
+    to[i - begin] = static_cast<T>(from[i]);
+  }
+}
+
+}  // namespace
+
+GraphBatchCacheWriter::GraphBatchCacheWriter(uint64_t vocabulary_hash,
+                                             int num_node_tokens)
+    : vocabulary_hash_(vocabulary_hash),
+      num_node_tokens_(num_node_tokens),
+      batch_graphs_({0}),
+      batch_nodes_({0}),
+      batch_edges_({0}),
+      batch_global_features_({0}) {}
+
+size_t GraphBatchCacheWriter::AddBatch(
+    const BasicBlockGraphBuilder& graph_builder) {
+  assert(graph_builder.VocabularyHash() == vocabulary_hash_);
+  assert(graph_builder.num_node_tokens() == num_node_tokens_);
+  const auto append = [](auto& to, const auto& from) {
+    to.insert(to.end(), from.begin(), from.end());
+  };
+
+  append(num_nodes_per_block_, graph_builder.num_nodes_per_block());
+  append(num_edges_per_block_, graph_builder.num_edges_per_block());
+  append(num_global_features_per_block_,
+         graph_builder.num_global_features_per_block());
+
+  for (const NodeType node_type : graph_builder.node_types()) {
+    node_types_.push_back(static_cast<uint8_t>(node_type));
+  }
+  append(node_features_, graph_builder.node_features());
+
+  append(edge_senders_, graph_builder.edge_senders());
+  append(edge_receivers_, graph_builder.edge_receivers());
+  for (const EdgeType edge_type : graph_builder.edge_types()) {
+    edge_types_.push_back(static_cast<uint8_t>(edge_type));
+  }
+
+  append(sparse_global_feature_tokens_,
+         graph_builder.sparse_global_feature_tokens());
+  append(sparse_global_feature_counts_,
+         graph_builder.sparse_global_feature_counts());
+
+  batch_graphs_.push_back(num_nodes_per_block_.size());
+  batch_nodes_.push_back(node_types_.size());
+  batch_edges_.push_back(edge_types_.size());
+  batch_global_features_.push_back(sparse_global_feature_tokens_.size());
+  return num_batches() - 1;
+}
+
+absl::Status GraphBatchCacheWriter::Write(const std::string& path) const {
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  if (!file.is_open()) {
+    return absl::NotFoundError(absl::StrCat("Could not open ", path));
+  }
+
+  Header header = {};
+  std::memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.vocabulary_hash = vocabulary_hash_;
+  header.num_node_tokens = num_node_tokens_;
+  header.num_batches = num_batches();
+  header.num_graphs = num_nodes_per_block_.size();
+  header.num_nodes = node_types_.size();
+  header.num_edges = edge_types_.size();
+  header.num_global_features = sparse_global_feature_tokens_.size();
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+  // The order of the columns must match GraphBatchCache::Initialize().
+  WriteColumn(file, batch_graphs_);
+  WriteColumn(file, batch_nodes_);
+  WriteColumn(file, batch_edges_);
+  WriteColumn(file, batch_global_features_);
+  WriteColumn(file, num_nodes_per_block_);
+  WriteColumn(file, num_edges_per_block_);
+  WriteColumn(file, num_global_features_per_block_);
+  WriteColumn(file, node_types_);
+  WriteColumn(file, node_features_);
+  WriteColumn(file, edge_senders_);
+  WriteColumn(file, edge_receivers_);
+  WriteColumn(file, edge_types_);
+  WriteColumn(file, sparse_global_feature_tokens_);
+  WriteColumn(file, sparse_global_feature_counts_);
+
+  file.close();
+  if (file.fail()) {
+    return absl::InternalError(absl::StrCat("Could not write to ", path));
+  }
+  return absl::OkStatus();
+}
+
+absl::StatusOr<std::unique_ptr<GraphBatchCache>> GraphBatchCache::Open(
+    const std::string& path, uint64_t vocabulary_hash) {
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return absl::NotFoundError(absl::StrCat("Could not open ", path));
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0) {
+    close(fd);
+    return absl::InternalError(absl::StrCat("Could not stat ", path));
+  }
+  const size_t size = file_stat.st_size;
+  if (size < sizeof(Header)) {
+    close(fd);
+    return absl::DataLossError(absl::StrCat(
+        "The file is too small to be a graph batch cache file: ", path));
+  }
+  void* const data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping remains valid after the file is closed.
+  close(fd);
+  if (data == MAP_FAILED) {
+    return absl::InternalError(absl::StrCat("Could not map ", path));
+  }
+  // We can't use std::make_unique<GraphBatchCache>(), because
+  // std::make_unique<>() requires a public constructor.
+  std::unique_ptr<GraphBatchCache> cache(
+      new GraphBatchCache(path, static_cast<const char*>(data), size));
+  if (absl::Status status = cache->Initialize(vocabulary_hash); !status.ok()) {
+    return status;
+  }
+  return cache;
+}
+
+GraphBatchCache::GraphBatchCache(std::string path, const char* data,
+                                 size_t size)
+    : path_(std::move(path)), data_(data), size_(size) {}
+
+GraphBatchCache::~GraphBatchCache() { munmap(const_cast<char*>(data_), size_); }
+
+absl::Status GraphBatchCache::Initialize(uint64_t vocabulary_hash) {
+  Header header;
+  std::memcpy(&header, data_, sizeof(header));
+  if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0) {
+    return absl::DataLossError(
+        absl::StrCat("Not a graph batch cache file: ", path_));
+  }
+  if (header.version != kVersion) {
+    return absl::DataLossError(absl::StrCat(
+        "Unsupported graph batch cache version ", header.version, " in ",
+        path_));
+  }
+  if (header.vocabulary_hash != vocabulary_hash) {
+    return absl::FailedPreconditionError(absl::StrCat(
+        "The graph batch cache was built with a different vocabulary: ",
+        path_));
+  }
+  // Each element of each column takes at least one byte. Rejecting larger
+  // counts early also rules out overflows in the computations below.
+  for (const uint64_t count :
+       {header.num_node_tokens, header.num_batches, header.num_graphs,
+        header.num_nodes, header.num_edges, header.num_global_features}) {
+    if (count > size_) {
+      return absl::DataLossError(
+          absl::StrCat("The graph batch cache file is truncated: ", path_));
+    }
+  }
+  num_batches_ = header.num_batches;
+  num_node_tokens_ = static_cast<int>(header.num_node_tokens);
+
+  ColumnReader reader(data_, size_, sizeof(Header));
+  // The order of the columns must match GraphBatchCacheWriter::Write().
+  for (absl::Status status : {
+           reader.Read(header.num_batches + 1, batch_graphs_),
+           reader.Read(header.num_batches + 1, batch_nodes_),
+           reader.Read(header.num_batches + 1, batch_edges_),
+           reader.Read(header.num_batches + 1, batch_global_features_),
+           reader.Read(header.num_graphs, num_nodes_per_block_),
+           reader.Read(header.num_graphs, num_edges_per_block_),
+           reader.Read(header.num_graphs, num_global_features_per_block_),
+           reader.Read(header.num_nodes, node_types_),
+           reader.Read(header.num_nodes, node_features_),
+           reader.Read(header.num_edges, edge_senders_),
+           reader.Read(header.num_edges, edge_receivers_),
+           reader.Read(header.num_edges, edge_types_),
+           reader.Read(header.num_global_features,
+                       sparse_global_feature_tokens_),
+           reader.Read(header.num_global_features,
+                       sparse_global_feature_counts_),
+       }) {
+    if (!status.ok()) return status;
+  }
+
+  // Verify all ranges and values, so that LoadBatch() always produces a valid
+  // state of the graph builder.
+  for (absl::Status status : {
+           CheckOffsets(batch_graphs_, header.num_batches + 1,
+                        header.num_graphs, "batch graphs"),
+           CheckOffsets(batch_nodes_, header.num_batches + 1, header.num_nodes,
+                        "batch nodes"),
+           CheckOffsets(batch_edges_, header.num_batches + 1, header.num_edges,
+                        "batch edges"),
+           CheckOffsets(batch_global_features_, header.num_batches + 1,
+                        header.num_global_features, "batch global features"),
+           CheckRange(node_types_, header.num_nodes,
+                      static_cast<int>(NodeType::kPrefix) + 1, "node types"),
+           CheckRange(node_features_, header.num_nodes,
+                      header.num_node_tokens, "node features"),
+           CheckRange(edge_types_, header.num_edges,
+                      static_cast<int>(EdgeType::kInstructionPrefix) + 1,
+                      "edge types"),
+           CheckRange(sparse_global_feature_tokens_,
+                      header.num_global_features, header.num_node_tokens,
+                      "global feature tokens"),
+       }) {
+    if (!status.ok()) return status;
+  }
+  for (size_t i = 0; i < num_batches_; ++i) {
+    if (absl::Status status = CheckBatch(i); !status.ok()) {
+      return absl::DataLossError(
+          absl::StrCat(status.message(), " in batch ", i, " of ", path_));
+    }
+  }
+  return absl::OkStatus();
+}
+
+absl::Status GraphBatchCache::CheckBatch(size_t batch_index) const {
+  const uint64_t graphs_begin = batch_graphs_[batch_index];
+  const uint64_t num_graphs = this->num_graphs(batch_index);
+  const uint64_t edges_begin = batch_edges_[batch_index];
+  const uint64_t num_edges = this->num_edges(batch_index);
+  for (absl::Status status : {
+           CheckCounts(num_nodes_per_block_ + graphs_begin, num_graphs,
+                       num_nodes(batch_index), "node counts"),
+           CheckCounts(num_edges_per_block_ + graphs_begin, num_graphs,
+                       num_edges, "edge counts"),
+           CheckCounts(num_global_features_per_block_ + graphs_begin,
+                       num_graphs,
+                       batch_global_features_[batch_index + 1] -
+                           batch_global_features_[batch_index],
+                       "global feature counts"),
+           CheckRange(edge_senders_ + edges_begin, num_edges,
+                      num_nodes(batch_index), "edge senders"),
+           CheckRange(edge_receivers_ + edges_begin, num_edges,
+                      num_nodes(batch_index), "edge receivers"),
+       }) {
+    if (!status.ok()) return status;
+  }
+  return absl::OkStatus();
+}
+
+void GraphBatchCache::LoadBatch(size_t batch_index,
+                                BasicBlockGraphBuilder& graph_builder) const {
+  assert(batch_index < num_batches_);
+  assert(graph_builder.num_node_tokens() == num_node_tokens_);
+  const uint64_t graphs_begin = batch_graphs_[batch_index];
+  const uint64_t graphs_end = batch_graphs_[batch_index + 1];
+  AssignColumn(num_nodes_per_block_, graphs_begin, graphs_end,
+               graph_builder.num_nodes_per_block_);
+  AssignColumn(num_edges_per_block_, graphs_begin, graphs_end,
+               graph_builder.num_edges_per_block_);
+  AssignColumn(num_global_features_per_block_, graphs_begin, graphs_end,
+               graph_builder.num_global_features_per_block_);
+
+  const uint64_t nodes_begin = batch_nodes_[batch_index];
+  const uint64_t nodes_end = batch_nodes_[batch_index + 1];
+  AssignColumn(node_types_, nodes_begin, nodes_end, graph_builder.node_types_);
+  AssignColumn(node_features_, nodes_begin, nodes_end,
+               graph_builder.node_features_);
+  int num_instructions = 0;
+  for (const NodeType node_type : graph_builder.node_types_) {
+    num_instructions += node_type == NodeType::kInstruction;
+  }
+  graph_builder.num_instructions_ = num_instructions;
+
+  const uint64_t edges_begin = batch_edges_[batch_index];
+  const uint64_t edges_end = batch_edges_[batch_index + 1];
+  AssignColumn(edge_senders_, edges_begin, edges_end,
+               graph_builder.edge_senders_);
+  AssignColumn(edge_receivers_, edges_begin, edges_end,
+               graph_builder.edge_receivers_);
+  AssignColumn(edge_types_, edges_begin, edges_end, graph_builder.edge_types_);
+
+  const uint64_t features_begin = batch_global_features_[batch_index];
+  const uint64_t features_end = batch_global_features_[batch_index + 1];
+  AssignColumn(sparse_global_feature_tokens_, features_begin, features_end,
+               graph_builder.sparse_global_feature_tokens_);
+  AssignColumn(sparse_global_feature_counts_, features_begin, features_end,
+               graph_builder.sparse_global_feature_counts_);
+}
+
+}  // namespace gematria
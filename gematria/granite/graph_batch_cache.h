@@ -0,0 +1,187 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Contains a file format for caching batches of basic block graphs built by
+// BasicBlockGraphBuilder, and its reader and writer. Training and evaluation
+// loops process the same basic blocks with the same vocabulary many times; with
+// the cache, the graphs are built once, and the later passes only copy them
+// from a memory-mapped file to the graph builder.
+//
+// A cache file contains a header with the vocabulary hash of the graph builder
+// (see BasicBlockGraphBuilder::VocabularyHash()) and the total sizes of all
+// columns, followed by the columns in a fixed order:
+//  - the ranges of graphs, nodes, edges, and sparse global features of each
+//    batch,
+//  - the per-graph columns: the number of nodes, edges, and sparse global
+//    features of each graph,
+//  - the node columns (type and feature), and the edge columns (sender,
+//    receiver, and type); node indices are relative to the first node of the
+//    batch,
+//  - the sparse global feature columns (token and count).
+// All columns are aligned to 8 bytes and stored in little-endian byte order.
+// The format must be versioned together with the graphs produced by the graph
+// builder: any change to the graphs requires a new version of the format.
+
+#ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_GRAPH_BATCH_CACHE_H_
+#define THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_GRAPH_BATCH_CACHE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "gematria/granite/graph_builder.h"
+
+namespace gematria {
+
+// Collects batches of graphs in memory, and writes them to a cache file.
+//
+// Typical usage:
+//   GraphBatchCacheWriter writer(graph_builder.VocabularyHash(),
+//                                graph_builder.num_node_tokens());
+//   for (const auto& batch : batches) {
+//     graph_builder.Reset();
+//     for (const BasicBlock& block : batch) graph_builder.AddBasicBlock(block);
+//     writer.AddBatch(graph_builder);
+//   }
+//   absl::Status status = writer.Write(path);
+class GraphBatchCacheWriter {
+ public:
+  GraphBatchCacheWriter(uint64_t vocabulary_hash, int num_node_tokens);
+
+  // Adds the current batch of `graph_builder` to the cache. Returns the index
+  // of the batch. The graph builder must use the vocabulary passed to the
+  // constructor.
+  size_t AddBatch(const BasicBlockGraphBuilder& graph_builder);
+
+  // Returns the number of batches added so far.
+  size_t num_batches() const { return batch_graphs_.size() - 1; }
+
+  // Writes the batches added so far to `path`. Overwrites the file when it
+  // already exists.
+  absl::Status Write(const std::string& path) const;
+
+ private:
+  const uint64_t vocabulary_hash_;
+  const int num_node_tokens_;
+
+  std::vector<uint64_t> batch_graphs_;
+  std::vector<uint64_t> batch_nodes_;
+  std::vector<uint64_t> batch_edges_;
+  std::vector<uint64_t> batch_global_features_;
+
+  std::vector<int32_t> num_nodes_per_block_;
+  std::vector<int32_t> num_edges_per_block_;
+  std::vector<int32_t> num_global_features_per_block_;
+
+  std::vector<uint8_t> node_types_;
+  std::vector<int32_t> node_features_;
+
+  std::vector<int32_t> edge_senders_;
+  std::vector<int32_t> edge_receivers_;
+  std::vector<uint8_t> edge_types_;
+
+  std::vector<int32_t> sparse_global_feature_tokens_;
+  std::vector<int32_t> sparse_global_feature_counts_;
+};
+
+// A read-only, memory-mapped cache file. All methods are thread-safe; separate
+// threads may load batches into separate graph builders at the same time.
+//
+// Typical usage:
+//   absl::StatusOr<std::unique_ptr<GraphBatchCache>> cache =
+//       GraphBatchCache::Open(path, graph_builder.VocabularyHash());
+//   for (size_t i = 0; i < (*cache)->num_batches(); ++i) {
+//     (*cache)->LoadBatch(i, graph_builder);
+//     ...
+//   }
+class GraphBatchCache {
+ public:
+  // Maps the cache file at `path` to memory, and verifies its structure.
+  // Returns an error when the file can't be mapped or when it is not a valid
+  // cache file. Returns a FAILED_PRECONDITION error when the file was created
+  // with a vocabulary hash different from `vocabulary_hash`, i.e. when the
+  // cache is stale and the graphs must be rebuilt.
+  static absl::StatusOr<std::unique_ptr<GraphBatchCache>> Open(
+      const std::string& path, uint64_t vocabulary_hash);
+
+  GraphBatchCache(const GraphBatchCache&) = delete;
+  GraphBatchCache& operator=(const GraphBatchCache&) = delete;
+
+  ~GraphBatchCache();
+
+  size_t num_batches() const { return num_batches_; }
+
+  // Returns the number of graphs, nodes, and edges of batch `batch_index`.
+  size_t num_graphs(size_t batch_index) const {
+    return batch_graphs_[batch_index + 1] - batch_graphs_[batch_index];
+  }
+  size_t num_nodes(size_t batch_index) const {
+    return batch_nodes_[batch_index + 1] - batch_nodes_[batch_index];
+  }
+  size_t num_edges(size_t batch_index) const {
+    return batch_edges_[batch_index + 1] - batch_edges_[batch_index];
+  }
+
+  // Replaces the current batch of `graph_builder` with the batch
+  // `batch_index`. The graph builder then behaves as if the basic blocks of the
+  // batch were added to it after a call to Reset(). Reuses the memory of the
+  // graph builder. The graph builder must have the vocabulary hash passed to
+  // Open().
+  void LoadBatch(size_t batch_index,
+                 BasicBlockGraphBuilder& graph_builder) const;
+
+ private:
+  GraphBatchCache(std::string path, const char* data, size_t size);
+
+  // Sets the column pointers from the header, and verifies that the file is a
+  // valid cache file created with `vocabulary_hash`.
+  absl::Status Initialize(uint64_t vocabulary_hash);
+  // Verifies that the graphs of batch `batch_index` are consistent, and that
+  // all their nodes and edges are within the batch.
+  absl::Status CheckBatch(size_t batch_index) const;
+
+  const std::string path_;
+  const char* const data_;
+  const size_t size_;
+
+  size_t num_batches_ = 0;
+  int num_node_tokens_ = 0;
+
+  const uint64_t* batch_graphs_ = nullptr;
+  const uint64_t* batch_nodes_ = nullptr;
+  const uint64_t* batch_edges_ = nullptr;
+  const uint64_t* batch_global_features_ = nullptr;
+
+  const int32_t* num_nodes_per_block_ = nullptr;
+  const int32_t* num_edges_per_block_ = nullptr;
+  const int32_t* num_global_features_per_block_ = nullptr;
+
+  const uint8_t* node_types_ = nullptr;
+  const int32_t* node_features_ = nullptr;
+
+  const int32_t* edge_senders_ = nullptr;
+  const int32_t* edge_receivers_ = nullptr;
+  const uint8_t* edge_types_ = nullptr;
+
+  const int32_t* sparse_global_feature_tokens_ = nullptr;
+  const int32_t* sparse_global_feature_counts_ = nullptr;
+};
+
+}  // namespace gematria
+
+#endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_GRAPH_BATCH_CACHE_H_
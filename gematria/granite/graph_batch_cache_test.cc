@@ -0,0 +1,364 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/granite/graph_batch_cache.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <ios>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/basic_block/basic_block_protos.h"
+#include "gematria/granite/graph_builder.h"
+#include "gematria/model/oov_token_behavior.h"
+#include "gematria/testing/matchers.h"
+#include "gematria/testing/parse_proto.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace gematria {
+namespace {
+
+using ::testing::HasSubstr;
+
+constexpr std::string_view kImmediateToken = "_IMMEDIATE_";
+constexpr std::string_view kFpImmediateToken = "_FP_IMMEDIATE_";
+constexpr std::string_view kAddressToken = "_ADDRESS_";
+constexpr std::string_view kMemoryToken = "_MEMORY_";
+constexpr std::string_view kUnknownToken = "_UNKNOWN_";
+constexpr std::string_view kTokens[] = {
+    kImmediateToken, kFpImmediateToken, kAddressToken, kMemoryToken, "LEA",
+    "MOV",           "NOT",             "R15",         "RAX",        "RBX",
+    "RCX",           "RDI",             kUnknownToken};
+
+// The layout of the cache file; see graph_batch_cache.cc. The header is a
+// sequence of uint64_t fields, and the columns follow it in the order of
+// `Column`, each column padded to kAlignment bytes.
+constexpr size_t kAlignment = 8;
+constexpr size_t kVersionField = 1;
+constexpr size_t kNumBatchesField = 4;
+constexpr size_t kNumGraphsField = 5;
+constexpr size_t kNumNodesField = 6;
+constexpr size_t kNumEdgesField = 7;
+constexpr size_t kNumGlobalFeaturesField = 8;
+constexpr size_t kHeaderSize = 9 * sizeof(uint64_t);
+
+enum Column {
+  kBatchGraphsColumn,
+  kBatchNodesColumn,
+  kBatchEdgesColumn,
+  kBatchGlobalFeaturesColumn,
+  kNumNodesPerBlockColumn,
+  kNumEdgesPerBlockColumn,
+  kNumGlobalFeaturesPerBlockColumn,
+  kNodeTypesColumn,
+  kNodeFeaturesColumn,
+  kEdgeSendersColumn,
+  kEdgeReceiversColumn,
+  kEdgeTypesColumn,
+  kGlobalFeatureTokensColumn,
+  kGlobalFeatureCountsColumn,
+};
+
+// The header field with the number of elements of each column, and the size
+// of an element. The batch range columns have one more element than the
+// number of batches.
+struct ColumnLayout {
+  size_t num_elements_field;
+  size_t element_size;
+};
+constexpr ColumnLayout kColumnLayouts[] = {
+    {kNumBatchesField, sizeof(uint64_t)},
+    {kNumBatchesField, sizeof(uint64_t)},
+    {kNumBatchesField, sizeof(uint64_t)},
+    {kNumBatchesField, sizeof(uint64_t)},
+    {kNumGraphsField, sizeof(int32_t)},
+    {kNumGraphsField, sizeof(int32_t)},
+    {kNumGraphsField, sizeof(int32_t)},
+    {kNumNodesField, sizeof(uint8_t)},
+    {kNumNodesField, sizeof(int32_t)},
+    {kNumEdgesField, sizeof(int32_t)},
+    {kNumEdgesField, sizeof(int32_t)},
+    {kNumEdgesField, sizeof(uint8_t)},
+    {kNumGlobalFeaturesField, sizeof(int32_t)},
+    {kNumGlobalFeaturesField, sizeof(int32_t)},
+};
+
+uint64_t GetHeaderField(const std::string& data, size_t field) {
+  uint64_t value;
+  std::memcpy(&value, &data[field * sizeof(uint64_t)], sizeof(value));
+  return value;
+}
+
+void SetHeaderField(std::string& data, size_t field, uint64_t value) {
+  std::memcpy(&data[field * sizeof(uint64_t)], &value, sizeof(value));
+}
+
+// Returns the offset of the first element of `column` in the cache file
+// `data`.
+size_t ColumnOffset(const std::string& data, Column column) {
+  size_t offset = kHeaderSize;
+  for (int i = 0; i < column; ++i) {
+    const ColumnLayout& layout = kColumnLayouts[i];
+    uint64_t num_elements = GetHeaderField(data, layout.num_elements_field);
+    if (layout.num_elements_field == kNumBatchesField) ++num_elements;
+    const size_t size = num_elements * layout.element_size;
+    offset += (size + kAlignment - 1) / kAlignment * kAlignment;
+  }
+  return offset;
+}
+
+// Sets the element `index` of the batch range column `column` to `value`.
+void SetBatchOffset(std::string& data, Column column, size_t index,
+                    uint64_t value) {
+  std::memcpy(&data[ColumnOffset(data, column) + index * sizeof(uint64_t)],
+              &value, sizeof(value));
+}
+
+// Checks that the batches in the two graph builders are the same.
+void ExpectSameBatch(const BasicBlockGraphBuilder& actual,
+                     const BasicBlockGraphBuilder& expected) {
+  EXPECT_EQ(actual.num_graphs(), expected.num_graphs());
+  EXPECT_EQ(actual.num_nodes(), expected.num_nodes());
+  EXPECT_EQ(actual.num_edges(), expected.num_edges());
+  EXPECT_EQ(actual.num_instructions(), expected.num_instructions());
+  EXPECT_EQ(actual.num_nodes_per_block(), expected.num_nodes_per_block());
+  EXPECT_EQ(actual.num_edges_per_block(), expected.num_edges_per_block());
+  EXPECT_EQ(actual.node_types(), expected.node_types());
+  EXPECT_EQ(actual.node_features(), expected.node_features());
+  EXPECT_EQ(actual.edge_senders(), expected.edge_senders());
+  EXPECT_EQ(actual.edge_receivers(), expected.edge_receivers());
+  EXPECT_EQ(actual.edge_types(), expected.edge_types());
+  EXPECT_EQ(actual.num_global_features_per_block(),
+            expected.num_global_features_per_block());
+  EXPECT_EQ(actual.sparse_global_feature_tokens(),
+            expected.sparse_global_feature_tokens());
+  EXPECT_EQ(actual.sparse_global_feature_counts(),
+            expected.sparse_global_feature_counts());
+  EXPECT_EQ(actual.DeltaBlockIndex(), expected.DeltaBlockIndex());
+}
+
+class GraphBatchCacheTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    path_ = ::testing::TempDir() + "/batches.gmgb";
+    builder_ = CreateBuilder(OutOfVocabularyTokenBehavior::ReplaceWithToken(
+        std::string(kUnknownToken)));
+    blocks_.push_back(BasicBlockFromProto(ParseTextProto(R"pb(
+      canonicalized_instructions {
+        mnemonic: "LEA"
+        llvm_mnemonic: "LEA64r"
+        output_operands { register_name: "RDI" }
+        input_operands {
+          address { base_register: "RBX" index_register: "RCX" scaling: 2 }
+        }
+      }
+      canonicalized_instructions {
+        mnemonic: "NOT"
+        llvm_mnemonic: "NOT64m"
+        output_operands { memory { alias_group_id: 1 } }
+        input_operands { memory { alias_group_id: 1 } }
+        input_operands { address { base_register: "R15" scaling: 1 } }
+      })pb")));
+    blocks_.push_back(BasicBlockFromProto(ParseTextProto(R"pb(
+      canonicalized_instructions {
+        mnemonic: "MOV"
+        llvm_mnemonic: "MOV64ri"
+        output_operands { register_name: "RAX" }
+        input_operands { immediate_value: 1 }
+      })pb")));
+    blocks_.push_back(BasicBlockFromProto(ParseTextProto(R"pb(
+      canonicalized_instructions {
+        mnemonic: "NOT"
+        llvm_mnemonic: "NOT64r"
+        output_operands { register_name: "RCX" }
+        input_operands { register_name: "RCX" }
+      })pb")));
+  }
+
+  static std::unique_ptr<BasicBlockGraphBuilder> CreateBuilder(
+      OutOfVocabularyTokenBehavior out_of_vocabulary_behavior) {
+    return std::make_unique<BasicBlockGraphBuilder>(
+        std::vector<std::string>(std::begin(kTokens), std::end(kTokens)),
+        kImmediateToken, kFpImmediateToken, kAddressToken, kMemoryToken,
+        out_of_vocabulary_behavior);
+  }
+
+  // Builds the graph of each block in `blocks_` and writes them to the cache,
+  // and returns the graph builders with the batches. The first batch contains
+  // the first block, the second batch the remaining blocks.
+  std::vector<std::unique_ptr<BasicBlockGraphBuilder>> WriteCache() {
+    GraphBatchCacheWriter writer(builder_->VocabularyHash(),
+                                 builder_->num_node_tokens());
+    std::vector<std::unique_ptr<BasicBlockGraphBuilder>> batches;
+    for (const auto& [begin, end] : {std::pair<size_t, size_t>(0, 1),
+                                     std::pair<size_t, size_t>(1, 3)}) {
+      auto& batch = batches.emplace_back(
+          std::make_unique<BasicBlockGraphBuilder>(*builder_));
+      for (size_t i = begin; i < end; ++i) {
+        EXPECT_TRUE(batch->AddBasicBlock(blocks_[i]));
+      }
+      EXPECT_EQ(writer.AddBatch(*batch), batches.size() - 1);
+    }
+    EXPECT_EQ(writer.num_batches(), batches.size());
+    EXPECT_OK(writer.Write(path_));
+    return batches;
+  }
+
+  std::string ReadCacheFile() const {
+    std::ifstream file(path_, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(file), {});
+  }
+
+  void WriteCacheFile(const std::string& data) const {
+    std::ofstream file(path_, std::ios::binary | std::ios::trunc);
+    file.write(data.data(), data.size());
+  }
+
+  std::string path_;
+  std::unique_ptr<BasicBlockGraphBuilder> builder_;
+  std::vector<BasicBlock> blocks_;
+};
+
+TEST_F(GraphBatchCacheTest, RoundTrip) {
+  const std::vector<std::unique_ptr<BasicBlockGraphBuilder>> batches =
+      WriteCache();
+  auto cache = GraphBatchCache::Open(path_, builder_->VocabularyHash());
+  ASSERT_OK(cache);
+  ASSERT_EQ((*cache)->num_batches(), 2);
+  EXPECT_EQ((*cache)->num_graphs(0), 1);
+  EXPECT_EQ((*cache)->num_graphs(1), 2);
+  EXPECT_EQ((*cache)->num_nodes(1), batches[1]->num_nodes());
+  EXPECT_EQ((*cache)->num_edges(1), batches[1]->num_edges());
+
+  // Load the batches in reverse order into a builder that already contains a
+  // batch, to check that LoadBatch() replaces the whole batch.
+  ASSERT_TRUE(builder_->AddBasicBlock(blocks_[0]));
+  for (int i = 1; i >= 0; --i) {
+    (*cache)->LoadBatch(i, *builder_);
+    ExpectSameBatch(*builder_, *batches[i]);
+  }
+
+  // The builder remains usable after loading a batch.
+  ASSERT_TRUE(builder_->AddBasicBlock(blocks_[1]));
+  ASSERT_TRUE(batches[0]->AddBasicBlock(blocks_[1]));
+  ExpectSameBatch(*builder_, *batches[0]);
+}
+
+TEST_F(GraphBatchCacheTest, EmptyCache) {
+  GraphBatchCacheWriter writer(builder_->VocabularyHash(),
+                               builder_->num_node_tokens());
+  ASSERT_OK(writer.Write(path_));
+  auto cache = GraphBatchCache::Open(path_, builder_->VocabularyHash());
+  ASSERT_OK(cache);
+  EXPECT_EQ((*cache)->num_batches(), 0);
+}
+
+TEST_F(GraphBatchCacheTest, DifferentVocabulary) {
+  WriteCache();
+  const std::unique_ptr<BasicBlockGraphBuilder> other_builder =
+      CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  EXPECT_THAT(GraphBatchCache::Open(path_, other_builder->VocabularyHash()),
+              StatusIs(absl::StatusCode::kFailedPrecondition));
+}
+
+TEST_F(GraphBatchCacheTest, NotACacheFile) {
+  WriteCache();
+  std::string data = ReadCacheFile();
+  data[0] ^= 1;
+  WriteCacheFile(data);
+  EXPECT_THAT(GraphBatchCache::Open(path_, builder_->VocabularyHash()),
+              StatusIs(absl::StatusCode::kDataLoss,
+                       HasSubstr("Not a graph batch cache file")));
+}
+
+TEST_F(GraphBatchCacheTest, DifferentVersion) {
+  WriteCache();
+  std::string data = ReadCacheFile();
+  SetHeaderField(data, kVersionField, GetHeaderField(data, kVersionField) + 1);
+  WriteCacheFile(data);
+  EXPECT_THAT(GraphBatchCache::Open(path_, builder_->VocabularyHash()),
+              StatusIs(absl::StatusCode::kDataLoss,
+                       HasSubstr("Unsupported graph batch cache version 2")));
+}
+
+TEST_F(GraphBatchCacheTest, InvalidBatchRange) {
+  WriteCache();
+  const std::string data = ReadCacheFile();
+  const uint64_t num_nodes = GetHeaderField(data, kNumNodesField);
+  // The first batch does not start at the first node, or the second batch
+  // starts after the last node.
+  for (const auto& [batch_index, first_node] :
+       {std::pair<size_t, uint64_t>(0, 1),
+        std::pair<size_t, uint64_t>(1, num_nodes + 1)}) {
+    SCOPED_TRACE(batch_index);
+    std::string corrupted = data;
+    SetBatchOffset(corrupted, kBatchNodesColumn, batch_index, first_node);
+    WriteCacheFile(corrupted);
+    EXPECT_THAT(GraphBatchCache::Open(path_, builder_->VocabularyHash()),
+                StatusIs(absl::StatusCode::kDataLoss,
+                         HasSubstr("batch nodes")));
+  }
+}
+
+TEST_F(GraphBatchCacheTest, EdgeOutsideOfBatch) {
+  const std::vector<std::unique_ptr<BasicBlockGraphBuilder>> batches =
+      WriteCache();
+  std::string data = ReadCacheFile();
+  // Make the first edge of the first batch point to the first node of the
+  // second batch. The node exists in the file, but not in the batch of the
+  // edge.
+  const int32_t sender = batches[0]->num_nodes();
+  std::memcpy(&data[ColumnOffset(data, kEdgeSendersColumn)], &sender,
+              sizeof(sender));
+  WriteCacheFile(data);
+  EXPECT_THAT(GraphBatchCache::Open(path_, builder_->VocabularyHash()),
+              StatusIs(absl::StatusCode::kDataLoss,
+                       HasSubstr("edge senders in batch 0")));
+}
+
+TEST_F(GraphBatchCacheTest, BatchPastEndOfFile) {
+  WriteCache();
+  const std::string data = ReadCacheFile();
+  const uint64_t num_edges = GetHeaderField(data, kNumEdgesField);
+  {
+    // The edges of the last batch, and the columns after them, are past the
+    // end of the file.
+    std::string corrupted = data;
+    SetHeaderField(corrupted, kNumEdgesField, num_edges + data.size() / 8);
+    SetBatchOffset(corrupted, kBatchEdgesColumn, 2,
+                   num_edges + data.size() / 8);
+    WriteCacheFile(corrupted);
+    EXPECT_THAT(GraphBatchCache::Open(path_, builder_->VocabularyHash()),
+                StatusIs(absl::StatusCode::kDataLoss, HasSubstr("truncated")));
+  }
+  {
+    // The file ends in the middle of the last column.
+    WriteCacheFile(data.substr(0, data.size() - kAlignment));
+    EXPECT_THAT(GraphBatchCache::Open(path_, builder_->VocabularyHash()),
+                StatusIs(absl::StatusCode::kDataLoss, HasSubstr("truncated")));
+  }
+}
+
+}  // namespace
+}  // namespace gematria
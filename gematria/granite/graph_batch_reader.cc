@@ -0,0 +1,384 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/granite/graph_batch_reader.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/basic_block/basic_block_protos.h"
+#include "gematria/granite/graph_builder.h"
+#include "gematria/io/tfrecord_reader.h"
+#include "gematria/proto/canonicalized_instruction.pb.h"
+#include "gematria/proto/throughput.pb.h"
+
+namespace gematria {
+namespace {
+
+absl::Status CheckHasToken(const std::vector<std::string>& tokens,
+                           std::string_view token) {
+  if (std::find(tokens.begin(), tokens.end(), token) == tokens.end()) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Token not found in node_tokens: ", token));
+  }
+  return absl::OkStatus();
+}
+
+absl::Status ValidateOptions(const GraphBatchReaderOptions& options) {
+  if (options.max_blocks_per_batch <= 0) {
+    return absl::InvalidArgumentError("max_blocks_per_batch must be positive");
+  }
+  if (options.num_tasks <= 0) {
+    return absl::InvalidArgumentError("num_tasks must be positive");
+  }
+  if (options.num_prefetched_batches <= 0) {
+    return absl::InvalidArgumentError(
+        "num_prefetched_batches must be positive");
+  }
+  if (options.pad_batches &&
+      (options.max_nodes_per_batch <= 1 || options.max_edges_per_batch <= 0)) {
+    return absl::InvalidArgumentError(
+        "pad_batches requires max_nodes_per_batch > 1 and "
+        "max_edges_per_batch > 0");
+  }
+  for (std::string_view token :
+       {options.immediate_token, options.fp_immediate_token,
+        options.address_token, options.memory_token}) {
+    if (absl::Status status = CheckHasToken(options.node_tokens, token);
+        !status.ok()) {
+      return status;
+    }
+  }
+  if (options.out_of_vocabulary_behavior.behavior_type() ==
+      OutOfVocabularyTokenBehavior::BehaviorType::kReplaceToken) {
+    if (absl::Status status = CheckHasToken(
+            options.node_tokens,
+            options.out_of_vocabulary_behavior.replacement_token());
+        !status.ok()) {
+      return status;
+    }
+  }
+  return absl::OkStatus();
+}
+
+BasicBlockGraphBuilder MakeGraphBuilder(
+    const GraphBatchReaderOptions& options) {
+  return BasicBlockGraphBuilder(
+      options.node_tokens, options.immediate_token, options.fp_immediate_token,
+      options.address_token, options.memory_token,
+      options.out_of_vocabulary_behavior);
+}
+
+}  // namespace
+
+absl::StatusOr<std::unique_ptr<GraphBatchReader>> GraphBatchReader::Create(
+    const GraphBatchReaderOptions& options) {
+  if (absl::Status status = ValidateOptions(options); !status.ok()) {
+    return status;
+  }
+  // Check that all files can be opened before starting the threads, so that
+  // the most common errors are reported early. The files are opened again one
+  // by one by the reading thread.
+  for (const std::string& path : options.input_files) {
+    absl::StatusOr<std::unique_ptr<TFRecordReader>> reader =
+        TFRecordReader::Open(path);
+    if (!reader.ok()) return reader.status();
+  }
+  const int num_threads =
+      options.num_threads > 0
+          ? options.num_threads
+          : static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+  // We can't use std::make_unique<GraphBatchReader>(), because
+  // std::make_unique<>() requires a public constructor.
+  return std::unique_ptr<GraphBatchReader>(
+      new GraphBatchReader(options, num_threads));
+}
+
+GraphBatchReader::GraphBatchReader(const GraphBatchReaderOptions& options,
+                                   int num_threads)
+    : options_(options) {
+  reading_thread_ = std::thread([this]() { ReadLoop(); });
+  worker_threads_.reserve(num_threads);
+  for (int i = 0; i < num_threads; ++i) {
+    worker_threads_.emplace_back([this]() { WorkerLoop(); });
+  }
+}
+
+GraphBatchReader::~GraphBatchReader() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    shutting_down_ = true;
+  }
+  state_changed_.notify_all();
+  reading_thread_.join();
+  for (std::thread& thread : worker_threads_) thread.join();
+}
+
+absl::StatusOr<std::optional<GraphBatch>> GraphBatchReader::Next() {
+  while (true) {
+    if (!final_status_.ok()) return final_status_;
+    if (next_pending_batch_ < pending_batches_.size()) {
+      return std::move(pending_batches_[next_pending_batch_++]);
+    }
+    pending_batches_.clear();
+    next_pending_batch_ = 0;
+
+    ChunkResult result;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      state_changed_.wait(lock, [this]() {
+        return results_.count(next_result_) > 0 ||
+               (reading_done_ && next_result_ >= num_chunks_);
+      });
+      const auto it = results_.find(next_result_);
+      if (it == results_.end()) return std::nullopt;
+      result = std::move(it->second);
+      results_.erase(it);
+      ++next_result_;
+      num_skipped_blocks_ += result.num_skipped_blocks;
+    }
+    // Consuming a result makes room for a new chunk.
+    state_changed_.notify_all();
+    final_status_ = std::move(result.status);
+    pending_batches_ = std::move(result.batches);
+  }
+}
+
+int64_t GraphBatchReader::num_skipped_blocks() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return num_skipped_blocks_;
+}
+
+void GraphBatchReader::ReadLoop() {
+  // Marks the end of the input. When `status` is an error, it is added as the
+  // last result, so that Next() returns it after all preceding batches.
+  const auto finish = [this](absl::Status status) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!status.ok()) {
+        ChunkResult result;
+        result.status = std::move(status);
+        results_[num_chunks_++] = std::move(result);
+      }
+      reading_done_ = true;
+    }
+    state_changed_.notify_all();
+  };
+
+  Chunk chunk;
+  // Moves `chunk` to the queue. Returns false when the reader is shutting
+  // down.
+  const auto submit_chunk = [this, &chunk]() {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      state_changed_.wait(lock, [this]() {
+        return shutting_down_ ||
+               num_chunks_ - next_result_ < options_.num_prefetched_batches;
+      });
+      if (shutting_down_) return false;
+      chunks_[num_chunks_++] = std::move(chunk);
+    }
+    state_changed_.notify_all();
+    chunk = Chunk();
+    chunk.records.reserve(options_.max_blocks_per_batch);
+    return true;
+  };
+
+  chunk.records.reserve(options_.max_blocks_per_batch);
+  std::string record;
+  for (const std::string& path : options_.input_files) {
+    absl::StatusOr<std::unique_ptr<TFRecordReader>> reader =
+        TFRecordReader::Open(path);
+    if (!reader.ok()) return finish(reader.status());
+    while (true) {
+      absl::StatusOr<bool> has_record = (*reader)->Read(record);
+      if (!has_record.ok()) {
+        // Process the records read before the error, so that the error is
+        // reported after them.
+        if (!chunk.records.empty() && !submit_chunk()) return;
+        return finish(has_record.status());
+      }
+      if (!*has_record) break;
+      chunk.records.push_back(std::move(record));
+      if (chunk.records.size() == options_.max_blocks_per_batch &&
+          !submit_chunk()) {
+        return;
+      }
+    }
+  }
+  if (!chunk.records.empty() && !submit_chunk()) return;
+  finish(absl::OkStatus());
+}
+
+void GraphBatchReader::WorkerLoop() {
+  BasicBlockGraphBuilder batch_builder = MakeGraphBuilder(options_);
+  BasicBlockGraphBuilder block_builder = MakeGraphBuilder(options_);
+  while (true) {
+    int64_t index = 0;
+    Chunk chunk;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      state_changed_.wait(lock, [this]() {
+        return shutting_down_ || reading_done_ || !chunks_.empty();
+      });
+      if (shutting_down_ || chunks_.empty()) return;
+      const auto it = chunks_.begin();
+      index = it->first;
+      chunk = std::move(it->second);
+      chunks_.erase(it);
+    }
+    ChunkResult result = ProcessChunk(chunk, batch_builder, block_builder);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      results_[index] = std::move(result);
+    }
+    state_changed_.notify_all();
+  }
+}
+
+GraphBatchReader::ChunkResult GraphBatchReader::ProcessChunk(
+    const Chunk& chunk, BasicBlockGraphBuilder& batch_builder,
+    BasicBlockGraphBuilder& block_builder) const {
+  const int num_tasks = options_.num_tasks;
+  // One node of each batch is reserved for the padding graph.
+  const int max_nodes =
+      options_.max_nodes_per_batch - (options_.pad_batches ? 1 : 0);
+  const int max_edges = options_.max_edges_per_batch;
+  const auto fits = [&](const BasicBlockGraphBuilder& builder, int num_nodes,
+                        int num_edges) {
+    return (options_.max_nodes_per_batch <= 0 ||
+            builder.num_nodes() + num_nodes <= max_nodes) &&
+           (max_edges <= 0 || builder.num_edges() + num_edges <= max_edges);
+  };
+
+  ChunkResult result;
+  std::vector<double> expected_outputs;
+  std::vector<uint8_t> expected_outputs_mask;
+  const auto finish_batch = [&]() {
+    if (batch_builder.num_graphs() == 0) return;
+    result.batches.push_back(MakeBatch(batch_builder,
+                                       std::move(expected_outputs),
+                                       std::move(expected_outputs_mask)));
+    batch_builder.Reset();
+    expected_outputs.clear();
+    expected_outputs_mask.clear();
+  };
+
+  batch_builder.Reset();
+  BasicBlockWithThroughputProto proto;
+  // The graphs are built directly from the instruction protos, without
+  // creating a BasicBlock for each record.
+  std::vector<InstructionProtoView> instructions;
+  for (const std::string& record : chunk.records) {
+    if (!proto.ParseFromString(record)) {
+      result.status = absl::DataLossError(
+          "Could not parse a BasicBlockWithThroughputProto record");
+      return result;
+    }
+    if (proto.inverse_throughputs_size() < num_tasks) {
+      ++result.num_skipped_blocks;
+      continue;
+    }
+    instructions.clear();
+    for (const CanonicalizedInstructionProto& instruction :
+         proto.basic_block().canonicalized_instructions()) {
+      instructions.emplace_back(instruction);
+    }
+    block_builder.Reset();
+    if (!block_builder.AddBasicBlockFromInstructionViews(instructions) ||
+        !fits(block_builder, 0, 0)) {
+      ++result.num_skipped_blocks;
+      continue;
+    }
+    if (!fits(batch_builder, block_builder.num_nodes(),
+              block_builder.num_edges())) {
+      finish_batch();
+    }
+    batch_builder.Append(block_builder);
+    for (int task = 0; task < num_tasks; ++task) {
+      const auto& cycles =
+          proto.inverse_throughputs(task).inverse_throughput_cycles();
+      expected_outputs.push_back(cycles.empty() ? 0.0 : cycles[0]);
+      expected_outputs_mask.push_back(cycles.empty() ? 0 : 1);
+    }
+  }
+  finish_batch();
+  return result;
+}
+
+GraphBatch GraphBatchReader::MakeBatch(
+    const BasicBlockGraphBuilder& builder, std::vector<double> expected_outputs,
+    std::vector<uint8_t> expected_outputs_mask) const {
+  GraphBatch batch;
+  batch.num_blocks = builder.num_graphs();
+  batch.num_graphs = builder.num_graphs();
+  batch.num_nodes = builder.num_nodes();
+  batch.num_edges = builder.num_edges();
+  batch.node_features = builder.node_features();
+  batch.edge_features = builder.EdgeFeatures();
+  batch.edge_senders = builder.edge_senders();
+  batch.edge_receivers = builder.edge_receivers();
+  batch.num_nodes_per_block = builder.num_nodes_per_block();
+  batch.num_edges_per_block = builder.num_edges_per_block();
+  batch.global_features.resize(builder.num_graphs() *
+                               builder.num_node_tokens());
+  builder.FillGlobalFeatures(batch.global_features.data());
+  batch.instruction_node_mask.reserve(builder.num_nodes());
+  for (const NodeType node_type : builder.node_types()) {
+    batch.instruction_node_mask.push_back(
+        node_type == NodeType::kInstruction ? 1 : 0);
+  }
+  batch.expected_outputs = std::move(expected_outputs);
+  batch.expected_outputs_mask = std::move(expected_outputs_mask);
+
+  if (options_.pad_batches) {
+    const int num_padding_nodes =
+        options_.max_nodes_per_batch - batch.num_nodes;
+    const int num_padding_edges =
+        options_.max_edges_per_batch - batch.num_edges;
+    const int padding_node = batch.num_nodes;
+    // The padding graph uses the immediate token for all its nodes; any valid
+    // token would do, because its outputs are never used.
+    batch.node_features.resize(options_.max_nodes_per_batch,
+                               builder.immediate_token());
+    batch.instruction_node_mask.resize(options_.max_nodes_per_batch, 0);
+    batch.edge_features.resize(
+        options_.max_edges_per_batch,
+        static_cast<int>(EdgeType::kStructuralDependency));
+    batch.edge_senders.resize(options_.max_edges_per_batch, padding_node);
+    batch.edge_receivers.resize(options_.max_edges_per_batch, padding_node);
+    batch.num_nodes_per_block.push_back(num_padding_nodes);
+    batch.num_edges_per_block.push_back(num_padding_edges);
+    batch.global_features.resize(
+        (batch.num_graphs + 1) * builder.num_node_tokens(), 0);
+    ++batch.num_graphs;
+    batch.num_nodes = options_.max_nodes_per_batch;
+    batch.num_edges = options_.max_edges_per_batch;
+  }
+  return batch;
+}
+
+}  // namespace gematria
@@ -0,0 +1,216 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Contains a prefetching reader that turns TFRecord files of
+// BasicBlockWithThroughputProto into batches of basic block graphs ready to be
+// fed to a GRANITE model. The graphs are built on background threads, so that
+// the training loop does not need to wait for them.
+
+#ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_GRAPH_BATCH_READER_H_
+#define THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_GRAPH_BATCH_READER_H_
+
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "gematria/granite/graph_builder.h"
+#include "gematria/model/oov_token_behavior.h"
+
+namespace gematria {
+
+struct GraphBatchReaderOptions {
+  // The TFRecord files with BasicBlockWithThroughputProto records. The files
+  // are read in this order.
+  std::vector<std::string> input_files;
+
+  // The parameters of the BasicBlockGraphBuilder used to build the graphs.
+  std::vector<std::string> node_tokens;
+  std::string immediate_token;
+  std::string fp_immediate_token;
+  std::string address_token;
+  std::string memory_token;
+  OutOfVocabularyTokenBehavior out_of_vocabulary_behavior =
+      OutOfVocabularyTokenBehavior::ReturnError();
+
+  // The number of tasks of the model. Blocks with fewer inverse throughputs
+  // are skipped.
+  int num_tasks = 1;
+
+  // The maximal number of basic blocks in a batch. Must be positive.
+  int max_blocks_per_batch = 100;
+  // The maximal number of nodes and edges in a batch. When not positive, the
+  // number is not limited. A batch is closed before the block that would
+  // exceed one of the limits; blocks that exceed them on their own are
+  // skipped.
+  int max_nodes_per_batch = 0;
+  int max_edges_per_batch = 0;
+  // When true, each batch is padded with one extra graph, so that it has
+  // exactly `max_nodes_per_batch` nodes and `max_edges_per_batch` edges. This
+  // keeps the shapes of the tensors static across batches. The padding graph
+  // is the last graph of the batch; its nodes are not instruction nodes and
+  // its edges are self-loops. Requires both limits to be positive; one node of
+  // each batch is reserved for the padding graph.
+  bool pad_batches = false;
+
+  // The number of threads that parse the protos and build the graphs. When not
+  // positive, uses one thread per hardware thread.
+  int num_threads = 0;
+  // The maximal number of batches being built or waiting to be consumed.
+  int num_prefetched_batches = 16;
+};
+
+// A batch of basic block graphs along with the expected outputs. The arrays
+// use the layout of the BasicBlockGraphBuilder accessors of the same name; the
+// two-dimensional arrays are stored in row-major order.
+struct GraphBatch {
+  int num_graphs = 0;
+  int num_nodes = 0;
+  int num_edges = 0;
+
+  std::vector<int> node_features;
+  std::vector<int> edge_features;
+  std::vector<int> edge_senders;
+  std::vector<int> edge_receivers;
+  std::vector<int> num_nodes_per_block;
+  std::vector<int> num_edges_per_block;
+  // Shape: (num_graphs, num_node_tokens).
+  std::vector<int> global_features;
+  // One value per node, 1 for instruction nodes and 0 for other nodes.
+  std::vector<uint8_t> instruction_node_mask;
+
+  // The number of basic blocks in the batch, not counting the padding graph.
+  int num_blocks = 0;
+  // The first inverse throughput of each block and task. Shape: (num_blocks,
+  // num_tasks). Entries that have no value in the proto are zero, and their
+  // entry in `expected_outputs_mask` is 0.
+  std::vector<double> expected_outputs;
+  std::vector<uint8_t> expected_outputs_mask;
+};
+
+// Reads basic blocks from TFRecord files and builds batches of their graphs on
+// a pool of background threads. The batches are returned in the order of the
+// input files, and each block appears in at most one batch. Blocks that can't
+// be added to the graph (e.g. because of an unknown token with
+// OutOfVocabularyTokenBehavior::ReturnError()) or that have fewer than
+// `num_tasks` throughputs are skipped.
+//
+// Typical usage:
+//   auto reader = GraphBatchReader::Create(options);
+//   while (true) {
+//     absl::StatusOr<std::optional<GraphBatch>> batch = (*reader)->Next();
+//     if (!batch.ok()) { ... }
+//     if (!batch->has_value()) break;
+//     ...
+//   }
+class GraphBatchReader {
+ public:
+  // Creates the reader and starts building the first batches. Returns an error
+  // when the options are not valid or when one of the input files can't be
+  // opened.
+  static absl::StatusOr<std::unique_ptr<GraphBatchReader>> Create(
+      const GraphBatchReaderOptions& options);
+
+  // Stops the background threads; the batches that were not consumed yet are
+  // discarded.
+  ~GraphBatchReader();
+
+  // Returns the next batch; blocks until it is ready. Returns std::nullopt when
+  // all input files were consumed, and an error when an input file is corrupted
+  // or contains a record that is not a valid proto. An error is final: all
+  // subsequent calls return the same error. Must not be called concurrently
+  // from multiple threads.
+  absl::StatusOr<std::optional<GraphBatch>> Next();
+
+  // Returns the number of blocks skipped in the batches returned so far.
+  int64_t num_skipped_blocks() const;
+
+ private:
+  // A group of consecutive records processed by a single thread. It contains
+  // at most `max_blocks_per_batch` records, and it produces one or more
+  // batches depending on the node and edge limits.
+  struct Chunk {
+    std::vector<std::string> records;
+  };
+  // The result of processing a chunk.
+  struct ChunkResult {
+    absl::Status status;
+    std::vector<GraphBatch> batches;
+    int64_t num_skipped_blocks = 0;
+  };
+
+  GraphBatchReader(const GraphBatchReaderOptions& options, int num_threads);
+
+  // The main loop of the thread that reads the input files and creates the
+  // chunks.
+  void ReadLoop();
+  // The main loop of the threads that build the graphs.
+  void WorkerLoop();
+  // Builds the batches for a single chunk. `batch_builder` and
+  // `block_builder` are used as scratch space; their state is discarded.
+  ChunkResult ProcessChunk(const Chunk& chunk,
+                           BasicBlockGraphBuilder& batch_builder,
+                           BasicBlockGraphBuilder& block_builder) const;
+  // Creates a GraphBatch from the graphs in `builder`, and pads it when
+  // requested by the options.
+  GraphBatch MakeBatch(const BasicBlockGraphBuilder& builder,
+                       std::vector<double> expected_outputs,
+                       std::vector<uint8_t> expected_outputs_mask) const;
+
+  const GraphBatchReaderOptions options_;
+
+  mutable std::mutex mutex_;
+  // Notified when a chunk is added to `chunks_`, when a result is added to
+  // `results_`, when a result is consumed, and when the reader is shutting
+  // down.
+  std::condition_variable state_changed_;
+  // The chunks waiting for a worker thread, ordered by their index. Guarded by
+  // `mutex_`.
+  std::map<int64_t, Chunk> chunks_;
+  // The results of the processed chunks that were not consumed yet, by the
+  // index of the chunk. Guarded by `mutex_`.
+  std::map<int64_t, ChunkResult> results_;
+  // The number of chunks created by the reading thread. Guarded by `mutex_`.
+  int64_t num_chunks_ = 0;
+  // The index of the chunk whose results are returned by the next call to
+  // Next(). Guarded by `mutex_`.
+  int64_t next_result_ = 0;
+  // Set to true when the reading thread reached the end of the input files or
+  // failed to read them. Guarded by `mutex_`.
+  bool reading_done_ = false;
+  // Set to true when the object is being destroyed. Guarded by `mutex_`.
+  bool shutting_down_ = false;
+  // Guarded by `mutex_`.
+  int64_t num_skipped_blocks_ = 0;
+
+  // The batches of the current chunk that were not returned yet, and the final
+  // status of the reader. Accessed only from Next().
+  std::vector<GraphBatch> pending_batches_;
+  int next_pending_batch_ = 0;
+  absl::Status final_status_;
+
+  std::thread reading_thread_;
+  std::vector<std::thread> worker_threads_;
+};
+
+}  // namespace gematria
+
+#endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_GRAPH_BATCH_READER_H_
@@ -0,0 +1,289 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/granite/graph_batch_reader.h"
+
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "gematria/io/tfrecord_writer.h"
+#include "gematria/model/oov_token_behavior.h"
+#include "gematria/proto/throughput.pb.h"
+#include "gematria/testing/matchers.h"
+#include "gematria/testing/parse_proto.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace gematria {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::IsEmpty;
+
+// Tokens used in the basic blocks in tests. For simplicity, we do not use the
+// full set of x86-64 tokens.
+constexpr std::string_view kImmediateToken = "_IMMEDIATE_";
+constexpr std::string_view kFpImmediateToken = "_FP_IMMEDIATE_";
+constexpr std::string_view kAddressToken = "_ADDRESS_";
+constexpr std::string_view kMemoryToken = "_MEMORY_";
+constexpr std::string_view kTokens[] = {
+    // 0
+    kImmediateToken, kFpImmediateToken, kAddressToken, kMemoryToken, "LEA",
+    // 5
+    "MOV", "RAX", "RBX", "RDI"};
+
+// A block with one instruction; its graph has three nodes and two edges.
+BasicBlockWithThroughputProto MovBlock(double throughput) {
+  BasicBlockWithThroughputProto proto = ParseTextProto(R"pb(
+    basic_block {
+      canonicalized_instructions: {
+        mnemonic: "MOV"
+        llvm_mnemonic: "MOV64rr"
+        output_operands: { register_name: "RAX" }
+        input_operands: { register_name: "RBX" }
+      }
+    })pb");
+  proto.add_inverse_throughputs()->add_inverse_throughput_cycles(throughput);
+  return proto;
+}
+
+// A block with one instruction; its graph has five nodes and four edges.
+BasicBlockWithThroughputProto LeaBlock(double throughput) {
+  BasicBlockWithThroughputProto proto = ParseTextProto(R"pb(
+    basic_block {
+      canonicalized_instructions: {
+        mnemonic: "LEA"
+        llvm_mnemonic: "LEA64r"
+        output_operands: { register_name: "RDI" }
+        input_operands: {
+          address: { base_register: "RBX" displacement: 8 scaling: 1 }
+        }
+      }
+    })pb");
+  proto.add_inverse_throughputs()->add_inverse_throughput_cycles(throughput);
+  return proto;
+}
+
+class GraphBatchReaderTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    options_.node_tokens.assign(std::begin(kTokens), std::end(kTokens));
+    options_.immediate_token = kImmediateToken;
+    options_.fp_immediate_token = kFpImmediateToken;
+    options_.address_token = kAddressToken;
+    options_.memory_token = kMemoryToken;
+    options_.num_threads = 3;
+    options_.num_prefetched_batches = 2;
+  }
+
+  // Writes `records` to a new TFRecord file, and adds it to the input files.
+  void WriteFile(const std::vector<std::string>& records) {
+    const std::string path =
+        absl::StrCat(::testing::TempDir(), "/blocks-",
+                     options_.input_files.size(), ".tfrecord");
+    auto writer = TFRecordWriter::Open(path);
+    ASSERT_OK(writer);
+    for (const std::string& record : records) {
+      ASSERT_OK((*writer)->Write(record));
+    }
+    ASSERT_OK((*writer)->Close());
+    options_.input_files.push_back(path);
+  }
+  void WriteFile(const std::vector<BasicBlockWithThroughputProto>& protos) {
+    std::vector<std::string> records;
+    for (const BasicBlockWithThroughputProto& proto : protos) {
+      records.push_back(proto.SerializeAsString());
+    }
+    WriteFile(records);
+  }
+
+  // Reads all batches from a reader created with `options_`.
+  std::vector<GraphBatch> ReadAll() {
+    auto reader = GraphBatchReader::Create(options_);
+    EXPECT_OK(reader);
+    if (!reader.ok()) return {};
+    std::vector<GraphBatch> batches;
+    while (true) {
+      absl::StatusOr<std::optional<GraphBatch>> batch = (*reader)->Next();
+      EXPECT_OK(batch);
+      if (!batch.ok() || !batch->has_value()) break;
+      batches.push_back(std::move(**batch));
+    }
+    num_skipped_blocks_ = (*reader)->num_skipped_blocks();
+    return batches;
+  }
+
+  GraphBatchReaderOptions options_;
+  int64_t num_skipped_blocks_ = 0;
+};
+
+TEST_F(GraphBatchReaderTest, ReadsBlocksInOrder) {
+  WriteFile({MovBlock(1), MovBlock(2), MovBlock(3)});
+  WriteFile({MovBlock(4), MovBlock(5)});
+  WriteFile(std::vector<std::string>());
+  options_.max_blocks_per_batch = 2;
+
+  const std::vector<GraphBatch> batches = ReadAll();
+  ASSERT_EQ(batches.size(), 3);
+  EXPECT_THAT(batches[0].expected_outputs, ElementsAre(1, 2));
+  EXPECT_THAT(batches[1].expected_outputs, ElementsAre(3, 4));
+  EXPECT_THAT(batches[2].expected_outputs, ElementsAre(5));
+  EXPECT_EQ(num_skipped_blocks_, 0);
+
+  const GraphBatch& batch = batches[0];
+  EXPECT_EQ(batch.num_blocks, 2);
+  EXPECT_EQ(batch.num_graphs, 2);
+  EXPECT_EQ(batch.num_nodes, 6);
+  EXPECT_EQ(batch.num_edges, 4);
+  EXPECT_THAT(batch.node_features, ElementsAre(5, 7, 6, 5, 7, 6));
+  EXPECT_THAT(batch.instruction_node_mask, ElementsAre(1, 0, 0, 1, 0, 0));
+  EXPECT_THAT(batch.edge_senders, ElementsAre(1, 0, 4, 3));
+  EXPECT_THAT(batch.edge_receivers, ElementsAre(0, 2, 3, 5));
+  EXPECT_THAT(batch.edge_features, ElementsAre(1, 2, 1, 2));
+  EXPECT_THAT(batch.num_nodes_per_block, ElementsAre(3, 3));
+  EXPECT_THAT(batch.num_edges_per_block, ElementsAre(2, 2));
+  EXPECT_THAT(batch.global_features,
+              ElementsAre(0, 0, 0, 0, 0, 1, 1, 1, 0,  // Block 0.
+                          0, 0, 0, 0, 0, 1, 1, 1, 0));
+  EXPECT_THAT(batch.expected_outputs_mask, ElementsAre(1, 1));
+}
+
+TEST_F(GraphBatchReaderTest, SkipsBlocks) {
+  BasicBlockWithThroughputProto unknown_token = MovBlock(2);
+  unknown_token.mutable_basic_block()
+      ->mutable_canonicalized_instructions(0)
+      ->set_mnemonic("ADD");
+  BasicBlockWithThroughputProto no_throughput = MovBlock(3);
+  no_throughput.clear_inverse_throughputs();
+  WriteFile({MovBlock(1), unknown_token, no_throughput, MovBlock(4)});
+  options_.max_blocks_per_batch = 10;
+
+  const std::vector<GraphBatch> batches = ReadAll();
+  ASSERT_EQ(batches.size(), 1);
+  EXPECT_THAT(batches[0].expected_outputs, ElementsAre(1, 4));
+  EXPECT_EQ(num_skipped_blocks_, 2);
+}
+
+TEST_F(GraphBatchReaderTest, MultipleTasks) {
+  BasicBlockWithThroughputProto block = MovBlock(1);
+  block.add_inverse_throughputs();
+  block.add_inverse_throughputs()->add_inverse_throughput_cycles(3);
+  WriteFile({block});
+  options_.num_tasks = 3;
+
+  const std::vector<GraphBatch> batches = ReadAll();
+  ASSERT_EQ(batches.size(), 1);
+  EXPECT_THAT(batches[0].expected_outputs, ElementsAre(1, 0, 3));
+  EXPECT_THAT(batches[0].expected_outputs_mask, ElementsAre(1, 0, 1));
+}
+
+TEST_F(GraphBatchReaderTest, NodeAndEdgeLimits) {
+  WriteFile({MovBlock(1), MovBlock(2), LeaBlock(3), MovBlock(4)});
+  options_.max_blocks_per_batch = 10;
+  options_.max_nodes_per_batch = 6;
+  options_.max_edges_per_batch = 4;
+
+  const std::vector<GraphBatch> batches = ReadAll();
+  ASSERT_EQ(batches.size(), 3);
+  EXPECT_THAT(batches[0].expected_outputs, ElementsAre(1, 2));
+  EXPECT_THAT(batches[1].expected_outputs, ElementsAre(3));
+  EXPECT_THAT(batches[2].expected_outputs, ElementsAre(4));
+
+  // The LEA block does not fit into a batch on its own.
+  options_.max_nodes_per_batch = 4;
+  const std::vector<GraphBatch> small_batches = ReadAll();
+  ASSERT_EQ(small_batches.size(), 3);
+  EXPECT_THAT(small_batches[0].expected_outputs, ElementsAre(1));
+  EXPECT_THAT(small_batches[1].expected_outputs, ElementsAre(2));
+  EXPECT_THAT(small_batches[2].expected_outputs, ElementsAre(4));
+  EXPECT_EQ(num_skipped_blocks_, 1);
+}
+
+TEST_F(GraphBatchReaderTest, PadsBatches) {
+  WriteFile({MovBlock(1), MovBlock(2), MovBlock(3)});
+  options_.max_blocks_per_batch = 10;
+  options_.max_nodes_per_batch = 8;
+  options_.max_edges_per_batch = 6;
+  options_.pad_batches = true;
+
+  const std::vector<GraphBatch> batches = ReadAll();
+  ASSERT_EQ(batches.size(), 2);
+  const GraphBatch& batch = batches[0];
+  EXPECT_EQ(batch.num_blocks, 2);
+  EXPECT_EQ(batch.num_graphs, 3);
+  EXPECT_EQ(batch.num_nodes, 8);
+  EXPECT_EQ(batch.num_edges, 6);
+  EXPECT_THAT(batch.node_features, ElementsAre(5, 7, 6, 5, 7, 6, 0, 0));
+  EXPECT_THAT(batch.instruction_node_mask,
+              ElementsAre(1, 0, 0, 1, 0, 0, 0, 0));
+  EXPECT_THAT(batch.edge_senders, ElementsAre(1, 0, 4, 3, 6, 6));
+  EXPECT_THAT(batch.edge_receivers, ElementsAre(0, 2, 3, 5, 6, 6));
+  EXPECT_THAT(batch.num_nodes_per_block, ElementsAre(3, 3, 2));
+  EXPECT_THAT(batch.num_edges_per_block, ElementsAre(2, 2, 2));
+  EXPECT_EQ(batch.global_features.size(), 3 * std::size(kTokens));
+  EXPECT_THAT(batch.expected_outputs, ElementsAre(1, 2));
+
+  EXPECT_EQ(batches[1].num_blocks, 1);
+  EXPECT_EQ(batches[1].num_nodes, 8);
+  EXPECT_EQ(batches[1].num_edges, 6);
+  EXPECT_THAT(batches[1].num_nodes_per_block, ElementsAre(3, 5));
+}
+
+TEST_F(GraphBatchReaderTest, NoInput) {
+  EXPECT_THAT(ReadAll(), IsEmpty());
+}
+
+TEST_F(GraphBatchReaderTest, InvalidRecord) {
+  WriteFile({MovBlock(1).SerializeAsString(), std::string("\xff\xff\xff")});
+  options_.max_blocks_per_batch = 1;
+
+  auto reader = GraphBatchReader::Create(options_);
+  ASSERT_OK(reader);
+  absl::StatusOr<std::optional<GraphBatch>> batch = (*reader)->Next();
+  ASSERT_OK(batch);
+  EXPECT_TRUE(batch->has_value());
+  EXPECT_THAT((*reader)->Next(), StatusIs(absl::StatusCode::kDataLoss));
+  EXPECT_THAT((*reader)->Next(), StatusIs(absl::StatusCode::kDataLoss));
+}
+
+TEST_F(GraphBatchReaderTest, InvalidOptions) {
+  options_.max_blocks_per_batch = 0;
+  EXPECT_THAT(GraphBatchReader::Create(options_),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+
+  options_.max_blocks_per_batch = 10;
+  options_.pad_batches = true;
+  EXPECT_THAT(GraphBatchReader::Create(options_),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+
+  options_.pad_batches = false;
+  options_.memory_token = "_UNKNOWN_";
+  EXPECT_THAT(GraphBatchReader::Create(options_),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+
+  options_.memory_token = kMemoryToken;
+  options_.input_files.push_back("/this/file/does/not/exist.tfrecord");
+  EXPECT_THAT(GraphBatchReader::Create(options_),
+              StatusIs(absl::StatusCode::kNotFound));
+}
+
+}  // namespace
+}  // namespace gematria
@@ -16,10 +16,18 @@
 
 #include <algorithm>
 #include <cassert>
+#include <cstddef>
+#include <cstdint>
 #include <cstdlib>
 #include <iostream>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <ostream>
 #include <sstream>
+#include <stdexcept>
 #include <string>
 #include <string_view>
 #include <unordered_map>
@@ -27,40 +35,23 @@
 #include <vector>
 
 #include "gematria/basic_block/basic_block.h"
+#include "gematria/basic_block/token_interner.h"
 #include "gematria/model/oov_token_behavior.h"
+#include "gematria/utils/tracing.h"
 
 namespace gematria {
 namespace {
 
-constexpr BasicBlockGraphBuilder::NodeIndex kInvalidNode(-1);
 constexpr BasicBlockGraphBuilder::TokenIndex kInvalidTokenIndex(-1);
 
-std::unordered_map<std::string, BasicBlockGraphBuilder::TokenIndex> MakeIndex(
-    std::vector<std::string> items) {
-  std::unordered_map<std::string, BasicBlockGraphBuilder::TokenIndex> result;
-  for (BasicBlockGraphBuilder::TokenIndex i = 0; i < items.size(); ++i) {
-    const auto insertion_result = result.emplace(std::move(items[i]), i);
-    if (!insertion_result.second) {
-      // TODO(ondrasej): Make this return a status.
-      std::cerr << "Duplicate item: '" << insertion_result.first->first << "'";
-      std::abort();
-    }
-  }
-  return result;
-}
-
 BasicBlockGraphBuilder::TokenIndex FindTokenOrDie(
-    const std::unordered_map<std::string, BasicBlockGraphBuilder::TokenIndex>&
-        tokens,
-    const std::string& token) {
-  return tokens.at(token);
-}
-
-template <typename MapType, typename KeyType, typename DefaultType>
-typename MapType::mapped_type& LookupOrInsert(
-    MapType& map, const KeyType& key, const DefaultType& default_value) {
-  const auto [it, inserted] = map.insert({key, default_value});
-  return it->second;
+    const TokenVocabulary& vocabulary, std::string_view token) {
+  const BasicBlockGraphBuilder::TokenIndex token_index =
+      vocabulary.IndexOf(token);
+  if (token_index == kInvalidTokenIndex) {
+    throw std::out_of_range("Unknown token: '" + std::string(token) + "'");
+  }
+  return token_index;
 }
 
 }  // namespace
@@ -112,7 +103,13 @@ BasicBlockGraphBuilder::AddBasicBlockTransaction::AddBasicBlockTransaction(
       prev_edge_senders_size_(graph_builder->edge_senders_.size()),
       prev_edge_receivers_size_(graph_builder->edge_receivers_.size()),
       prev_edge_types_size_(graph_builder->edge_receivers_.size()),
-      prev_global_features_size_(graph_builder->global_features_.size()) {}
+      prev_num_global_features_per_block_size_(
+          graph_builder->num_global_features_per_block_.size()),
+      prev_sparse_global_feature_tokens_size_(
+          graph_builder->sparse_global_feature_tokens_.size()),
+      prev_sparse_global_feature_counts_size_(
+          graph_builder->sparse_global_feature_counts_.size()),
+      prev_graph_hashes_size_(graph_builder->graph_hashes_.size()) {}
 
 BasicBlockGraphBuilder::AddBasicBlockTransaction::~AddBasicBlockTransaction() {
   if (!is_committed_) Rollback();
@@ -140,11 +137,44 @@ void BasicBlockGraphBuilder::AddBasicBlockTransaction::Rollback() {
   GEMATRIA_CHECK_AND_RESIZE(edge_senders_);
   GEMATRIA_CHECK_AND_RESIZE(edge_receivers_);
   GEMATRIA_CHECK_AND_RESIZE(edge_types_);
-  GEMATRIA_CHECK_AND_RESIZE(global_features_);
+  GEMATRIA_CHECK_AND_RESIZE(num_global_features_per_block_);
+  GEMATRIA_CHECK_AND_RESIZE(sparse_global_feature_tokens_);
+  GEMATRIA_CHECK_AND_RESIZE(sparse_global_feature_counts_);
+  GEMATRIA_CHECK_AND_RESIZE(graph_hashes_);
 }
 
 #undef GEMATRIA_CHECK_AND_RESIZE
 
+bool OutOfVocabularyTokenCounts::Add(std::string_view token) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  ++total_;
+  return ++counts_[std::string(token)] == 1;
+}
+
+std::vector<std::pair<std::string, int64_t>>
+OutOfVocabularyTokenCounts::GetCounts() const {
+  std::vector<std::pair<std::string, int64_t>> counts;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    counts.assign(counts_.begin(), counts_.end());
+  }
+  std::sort(counts.begin(), counts.end(), [](const auto& a, const auto& b) {
+    return a.second != b.second ? a.second > b.second : a.first < b.first;
+  });
+  return counts;
+}
+
+int64_t OutOfVocabularyTokenCounts::total() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return total_;
+}
+
+void OutOfVocabularyTokenCounts::Clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  counts_.clear();
+  total_ = 0;
+}
+
 BasicBlockGraphBuilder::BasicBlockGraphBuilder(
     std::vector<std::string> node_tokens, std::string_view immediate_token,
     std::string_view fp_immediate_token, std::string_view address_token,
@@ -152,98 +182,293 @@ BasicBlockGraphBuilder::BasicBlockGraphBuilder(
     OutOfVocabularyTokenBehavior
         out_of_vocabulary_behavior /* = ReturnError() */
     )
-    : node_tokens_(MakeIndex(std::move(node_tokens))),
-      // TODO(ondrasej): Remove the std::string conversions once we switch to
-      // C++20 and std::unordered_map gains templated lookup functions.
-      immediate_token_(
-          FindTokenOrDie(node_tokens_, std::string(immediate_token))),
-      fp_immediate_token_(
-          FindTokenOrDie(node_tokens_, std::string(fp_immediate_token))),
-      address_token_(FindTokenOrDie(node_tokens_, std::string(address_token))),
-      memory_token_(FindTokenOrDie(node_tokens_, std::string(memory_token))),
-      out_of_vocabulary_behavior_(out_of_vocabulary_behavior),
+    : BasicBlockGraphBuilder(
+          std::make_shared<const TokenVocabulary>(std::move(node_tokens)),
+          immediate_token,
+          fp_immediate_token, address_token, memory_token,
+          std::move(out_of_vocabulary_behavior)) {}
+
+BasicBlockGraphBuilder::BasicBlockGraphBuilder(
+    std::shared_ptr<const TokenVocabulary> vocabulary,
+    std::string_view immediate_token, std::string_view fp_immediate_token,
+    std::string_view address_token, std::string_view memory_token,
+    OutOfVocabularyTokenBehavior
+        out_of_vocabulary_behavior /* = ReturnError() */
+    )
+    : vocabulary_(std::move(vocabulary)),
+      immediate_token_(FindTokenOrDie(*vocabulary_, immediate_token)),
+      fp_immediate_token_(FindTokenOrDie(*vocabulary_, fp_immediate_token)),
+      address_token_(FindTokenOrDie(*vocabulary_, address_token)),
+      memory_token_(FindTokenOrDie(*vocabulary_, memory_token)),
       replacement_token_(
           out_of_vocabulary_behavior.behavior_type() ==
                   OutOfVocabularyTokenBehavior::BehaviorType::kReturnError
               ? kInvalidTokenIndex
               : FindTokenOrDie(
-                    node_tokens_,
-                    out_of_vocabulary_behavior.replacement_token())) {}
+                    *vocabulary_,
+                    out_of_vocabulary_behavior.replacement_token())) {
+  assert(vocabulary_ != nullptr);
+}
 
 bool BasicBlockGraphBuilder::AddBasicBlockFromInstructions(
     const std::vector<Instruction>& instructions) {
+  GEMATRIA_TRACE_SCOPE("BasicBlockGraphBuilder::AddBasicBlock");
   if (instructions.empty()) return false;
   AddBasicBlockTransaction transaction(this);
 
-  // Clear the maps that are maintained per basic block.
-  register_nodes_.clear();
-  alias_group_nodes_.clear();
+  const int prev_num_nodes = num_nodes();
+  const int prev_num_edges = num_edges();
+  const std::optional<uint64_t> graph_hash =
+      AddInstructions(instructions, /*prefix_graphs=*/nullptr);
+  if (!graph_hash.has_value()) return false;
+  FinishGraph(prev_num_nodes, prev_num_edges,
+              static_cast<int>(instructions.size()), *graph_hash);
+
+  transaction.Commit();
+  return true;
+}
+
+bool BasicBlockGraphBuilder::AddBasicBlockPrefixesFromInstructions(
+    const std::vector<Instruction>& instructions) {
+  GEMATRIA_TRACE_SCOPE("BasicBlockGraphBuilder::AddBasicBlockPrefixes");
+  if (instructions.empty()) return false;
+  AddBasicBlockTransaction transaction(this);
 
   const int prev_num_nodes = num_nodes();
   const int prev_num_edges = num_edges();
+  std::vector<PrefixGraph> prefix_graphs;
+  prefix_graphs.reserve(instructions.size());
+  if (!AddInstructions(instructions, &prefix_graphs).has_value()) return false;
+
+  // The instructions only add nodes and edges to the graph, so the graph of
+  // each prefix of the basic block consists of the first nodes and edges of
+  // the graph of the whole basic block. Move the graph of the whole basic block
+  // out of the batch, and add the graphs of the prefixes by copying from it.
+  const std::vector<NodeType> block_node_types(
+      node_types_.begin() + prev_num_nodes, node_types_.end());
+  const std::vector<TokenIndex> block_node_features(
+      node_features_.begin() + prev_num_nodes, node_features_.end());
+  const std::vector<NodeIndex> block_edge_senders(
+      edge_senders_.begin() + prev_num_edges, edge_senders_.end());
+  const std::vector<NodeIndex> block_edge_receivers(
+      edge_receivers_.begin() + prev_num_edges, edge_receivers_.end());
+  const std::vector<EdgeType> block_edge_types(
+      edge_types_.begin() + prev_num_edges, edge_types_.end());
+  node_types_.resize(prev_num_nodes);
+  node_features_.resize(prev_num_nodes);
+  edge_senders_.resize(prev_num_edges);
+  edge_receivers_.resize(prev_num_edges);
+  edge_types_.resize(prev_num_edges);
+
+  for (int i = 0; i < prefix_graphs.size(); ++i) {
+    const auto [prefix_num_nodes, prefix_num_edges, prefix_graph_hash] =
+        prefix_graphs[i];
+    const NodeIndex graph_begin = num_nodes();
+    const int graph_edges_begin = num_edges();
+    node_types_.insert(node_types_.end(), block_node_types.begin(),
+                       block_node_types.begin() + prefix_num_nodes);
+    node_features_.insert(node_features_.end(), block_node_features.begin(),
+                          block_node_features.begin() + prefix_num_nodes);
+    // The node indices in the copied edges are relative to the beginning of
+    // the graph of the whole basic block.
+    const NodeIndex node_offset = graph_begin - prev_num_nodes;
+    for (int edge = 0; edge < prefix_num_edges; ++edge) {
+      edge_senders_.push_back(block_edge_senders[edge] + node_offset);
+      edge_receivers_.push_back(block_edge_receivers[edge] + node_offset);
+    }
+    edge_types_.insert(edge_types_.end(), block_edge_types.begin(),
+                       block_edge_types.begin() + prefix_num_edges);
+    FinishGraph(graph_begin, graph_edges_begin, i + 1, prefix_graph_hash);
+  }
+
+  transaction.Commit();
+  return true;
+}
 
+void BasicBlockGraphBuilder::StartBasicBlock() {
+  // Clear the maps that are maintained per basic block. Only the entries of
+  // `register_nodes_` used by the previous basic block need to be reset.
+  for (const TokenId register_id : used_register_ids_) {
+    register_nodes_[register_id] = kInvalidNode;
+  }
+  used_register_ids_.clear();
+  alias_group_nodes_.clear();
+}
+
+std::optional<uint64_t> BasicBlockGraphBuilder::AddInstructions(
+    const std::vector<Instruction>& instructions,
+    std::vector<PrefixGraph>* prefix_graphs) {
+  StartBasicBlock();
+
+  const int prev_num_nodes = num_nodes();
+  const int prev_num_edges = num_edges();
   NodeIndex previous_instruction_node = kInvalidNode;
+  StableHasher graph_hasher;
   for (const Instruction& instruction : instructions) {
-    // Add the instruction node.
-    const NodeIndex instruction_node =
-        AddNode(NodeType::kInstruction, instruction.mnemonic);
-    if (instruction_node == kInvalidNode) {
-      return false;
+    const InstructionFragment* const fragment =
+        GetInstructionFragment(instruction);
+    if (fragment == nullptr) {
+      // Instructions that can't be compiled are never cached, and the
+      // unknown token that stopped their compilation is in the scratch
+      // fragment.
+      CountOutOfVocabularyTokens(scratch_fragment_);
+      return std::nullopt;
     }
-
-    // Add nodes for prefixes of the instruction.
-    for (const std::string& prefix : instruction.prefixes) {
-      const NodeIndex prefix_node = AddNode(NodeType::kPrefix, prefix);
-      if (prefix_node == kInvalidNode) {
-        return false;
-      }
-      AddEdge(EdgeType::kInstructionPrefix, prefix_node, instruction_node);
+    if (!fragment->out_of_vocabulary_tokens.empty()) {
+      CountOutOfVocabularyTokens(*fragment);
     }
-
-    // Add a structural dependency edge from the previous instruction.
-    if (previous_instruction_node >= 0) {
-      AddEdge(EdgeType::kStructuralDependency, previous_instruction_node,
-              instruction_node);
+    previous_instruction_node =
+        AddFragment(*fragment, previous_instruction_node);
+    graph_hasher.AddInt(fragment->hash);
+    if (prefix_graphs != nullptr) {
+      prefix_graphs->push_back({num_nodes() - prev_num_nodes,
+                                num_edges() - prev_num_edges,
+                                graph_hasher.Finish()});
     }
+  }
+  return graph_hasher.Finish();
+}
 
-    // Add edges for input operands. And nodes too, if necessary.
-    for (const InstructionOperand& operand : instruction.input_operands) {
-      if (!AddInputOperand(instruction_node, operand)) return false;
-    }
-    for (const InstructionOperand& operand :
-         instruction.implicit_input_operands) {
-      if (!AddInputOperand(instruction_node, operand)) return false;
+std::optional<uint64_t> BasicBlockGraphBuilder::ComputeGraphHash(
+    const BasicBlock& block, std::vector<uint64_t>* prefix_graph_hashes,
+    std::vector<uint64_t>* fragment_hashes) {
+  if (block.instructions.empty()) return std::nullopt;
+  if (prefix_graph_hashes != nullptr) prefix_graph_hashes->clear();
+  if (fragment_hashes != nullptr) fragment_hashes->clear();
+  StableHasher graph_hasher;
+  for (const Instruction& instruction : block.instructions) {
+    const InstructionFragment* const fragment =
+        GetInstructionFragment(instruction);
+    if (fragment == nullptr) return std::nullopt;
+    graph_hasher.AddInt(fragment->hash);
+    if (prefix_graph_hashes != nullptr) {
+      prefix_graph_hashes->push_back(graph_hasher.Finish());
     }
+    if (fragment_hashes != nullptr) fragment_hashes->push_back(fragment->hash);
+  }
+  return graph_hasher.Finish();
+}
 
-    // Add edges and nodes for output operands.
-    for (const InstructionOperand& operand : instruction.output_operands) {
-      if (!AddOutputOperand(instruction_node, operand)) return false;
+void BasicBlockGraphBuilder::CountOutOfVocabularyTokens(
+    const BasicBlock& block) {
+  for (const Instruction& instruction : block.instructions) {
+    const InstructionFragment* const fragment =
+        GetInstructionFragment(instruction);
+    if (fragment == nullptr) {
+      // Same as in AddInstructions(): the block would be rejected at this
+      // instruction.
+      CountOutOfVocabularyTokens(scratch_fragment_);
+      return;
     }
-    for (const InstructionOperand& operand :
-         instruction.implicit_output_operands) {
-      if (!AddOutputOperand(instruction_node, operand)) return false;
+    if (!fragment->out_of_vocabulary_tokens.empty()) {
+      CountOutOfVocabularyTokens(*fragment);
     }
-
-    previous_instruction_node = instruction_node;
   }
+}
 
-  global_features_.emplace_back(num_node_tokens(), 0);
-  std::vector<int>& global_features = global_features_.back();
-  for (NodeIndex i = prev_num_nodes; i < node_features_.size(); ++i) {
-    ++global_features[node_features_[i]];
+void BasicBlockGraphBuilder::FinishGraph(NodeIndex graph_begin,
+                                         int graph_edges_begin,
+                                         int num_instructions,
+                                         uint64_t graph_hash) {
+  // Compute the global features in the sparse format: sort the tokens of the
+  // nodes of the new graph and count the runs of equal tokens. This is
+  // proportional to the size of the graph rather than to the size of the
+  // vocabulary.
+  const size_t sparse_begin = sparse_global_feature_tokens_.size();
+  std::vector<TokenIndex>& tokens = sparse_global_feature_tokens_;
+  tokens.insert(tokens.end(), node_features_.begin() + graph_begin,
+                node_features_.end());
+  std::sort(tokens.begin() + sparse_begin, tokens.end());
+  size_t num_unique_tokens = sparse_begin;
+  for (size_t run_begin = sparse_begin; run_begin < tokens.size();) {
+    size_t run_end = run_begin + 1;
+    while (run_end < tokens.size() && tokens[run_end] == tokens[run_begin]) {
+      ++run_end;
+    }
+    tokens[num_unique_tokens++] = tokens[run_begin];
+    sparse_global_feature_counts_.push_back(
+        static_cast<int>(run_end - run_begin));
+    run_begin = run_end;
   }
+  tokens.resize(num_unique_tokens);
+  num_global_features_per_block_.push_back(
+      static_cast<int>(num_unique_tokens - sparse_begin));
 
   // Record the number of nodes and edges created for this graph.
-  num_nodes_per_block_.push_back(num_nodes() - prev_num_nodes);
-  num_edges_per_block_.push_back(num_edges() - prev_num_edges);
+  num_nodes_per_block_.push_back(num_nodes() - graph_begin);
+  num_edges_per_block_.push_back(num_edges() - graph_edges_begin);
+  num_instructions_ += num_instructions;
+  graph_hashes_.push_back(graph_hash);
+  GEMATRIA_TRACE_COUNTER(kBlocks, 1);
+  GEMATRIA_TRACE_COUNTER(kNodes, num_nodes() - graph_begin);
+  GEMATRIA_TRACE_COUNTER(kEdges, num_edges() - graph_edges_begin);
+}
 
-  transaction.Commit();
-  return true;
+void BasicBlockGraphBuilder::Append(const BasicBlockGraphBuilder& other) {
+  assert(vocabulary_ == other.vocabulary_ ||
+         vocabulary_->tokens() == other.vocabulary_->tokens());
+  assert(immediate_token_ == other.immediate_token_);
+  assert(fp_immediate_token_ == other.fp_immediate_token_);
+  assert(address_token_ == other.address_token_);
+  assert(memory_token_ == other.memory_token_);
+  assert(replacement_token_ == other.replacement_token_);
+
+  const NodeIndex node_offset = num_nodes();
+  const auto append = [](auto& to, const auto& from) {
+    to.insert(to.end(), from.begin(), from.end());
+  };
+
+  append(num_nodes_per_block_, other.num_nodes_per_block_);
+  append(num_edges_per_block_, other.num_edges_per_block_);
+  num_instructions_ += other.num_instructions_;
+
+  append(node_types_, other.node_types_);
+  append(node_features_, other.node_features_);
+
+  // The nodes of `other` are shifted by the number of nodes already in the
+  // batch; the edges must be updated accordingly.
+  edge_senders_.reserve(edge_senders_.size() + other.edge_senders_.size());
+  for (const NodeIndex sender : other.edge_senders_) {
+    edge_senders_.push_back(sender + node_offset);
+  }
+  edge_receivers_.reserve(edge_receivers_.size() +
+                          other.edge_receivers_.size());
+  for (const NodeIndex receiver : other.edge_receivers_) {
+    edge_receivers_.push_back(receiver + node_offset);
+  }
+  append(edge_types_, other.edge_types_);
+
+  // The global features are stored per graph and they do not depend on the
+  // position of the graph in the batch.
+  append(num_global_features_per_block_,
+         other.num_global_features_per_block_);
+  append(sparse_global_feature_tokens_, other.sparse_global_feature_tokens_);
+  append(sparse_global_feature_counts_, other.sparse_global_feature_counts_);
+  append(graph_hashes_, other.graph_hashes_);
+}
+
+void BasicBlockGraphBuilder::Reserve(int num_blocks, int num_nodes,
+                                     int num_edges) {
+  num_nodes_per_block_.reserve(num_blocks);
+  num_edges_per_block_.reserve(num_blocks);
+  num_global_features_per_block_.reserve(num_blocks);
+  graph_hashes_.reserve(num_blocks);
+
+  node_types_.reserve(num_nodes);
+  node_features_.reserve(num_nodes);
+  // Each node contributes at most one element of the sparse global features.
+  sparse_global_feature_tokens_.reserve(num_nodes);
+  sparse_global_feature_counts_.reserve(num_nodes);
+
+  edge_senders_.reserve(num_edges);
+  edge_receivers_.reserve(num_edges);
+  edge_types_.reserve(num_edges);
 }
 
 void BasicBlockGraphBuilder::Reset() {
   num_nodes_per_block_.clear();
   num_edges_per_block_.clear();
+  num_instructions_ = 0;
 
   node_types_.clear();
   node_features_.clear();
@@ -252,68 +477,249 @@ void BasicBlockGraphBuilder::Reset() {
   edge_receivers_.clear();
   edge_types_.clear();
 
-  global_features_.clear();
+  num_global_features_per_block_.clear();
+  sparse_global_feature_tokens_.clear();
+  sparse_global_feature_counts_.clear();
+
+  graph_hashes_.clear();
+}
+
+BasicBlockGraphBuilder::InstructionFragmentCache&
+BasicBlockGraphBuilder::InstructionFragmentCache::operator=(
+    const InstructionFragmentCache& other) {
+  if (this != &other) {
+    entries_.clear();
+    index_.clear();
+    max_size_ = other.max_size_;
+  }
+  return *this;
+}
+
+void BasicBlockGraphBuilder::InstructionFragmentCache::SetMaxSize(
+    size_t max_size) {
+  max_size_ = max_size;
+  while (entries_.size() > max_size_) {
+    index_.erase(entries_.back().key);
+    entries_.pop_back();
+  }
+}
+
+const BasicBlockGraphBuilder::InstructionFragment*
+BasicBlockGraphBuilder::InstructionFragmentCache::Insert(
+    uint64_t key, const Instruction& instruction,
+    const InstructionFragment& fragment) {
+  assert(max_size_ > 0);
+  auto [it, inserted] = index_.try_emplace(key);
+  if (inserted) {
+    if (entries_.size() < max_size_) {
+      entries_.emplace_front();
+    } else {
+      // Reuse the least recently used entry, together with the memory of its
+      // instruction and fragment.
+      index_.erase(entries_.back().key);
+      entries_.splice(entries_.begin(), entries_, std::prev(entries_.end()));
+    }
+    it->second = entries_.begin();
+  } else {
+    // Another instruction with the same hash; the new one replaces it.
+    entries_.splice(entries_.begin(), entries_, it->second);
+  }
+  Entry& entry = *it->second;
+  entry.key = key;
+  entry.instruction = instruction;
+  entry.fragment = fragment;
+  return &entry.fragment;
+}
+
+void BasicBlockGraphBuilder::SetInstructionFragmentCacheSize(size_t max_size) {
+  fragment_cache_.SetMaxSize(max_size);
+}
+
+const BasicBlockGraphBuilder::InstructionFragment*
+BasicBlockGraphBuilder::GetInstructionFragment(const Instruction& instruction) {
+  if (fragment_cache_.max_size() == 0) {
+    if (!CompileInstruction(instruction, scratch_fragment_)) return nullptr;
+    return &scratch_fragment_;
+  }
+  const uint64_t key = instruction.Hash();
+  if (const InstructionFragment* const fragment = fragment_cache_.Find(
+          key,
+          [&](const Instruction& cached) { return cached == instruction; })) {
+    return fragment;
+  }
+  return CompileAndCacheInstructionFragment(key, instruction);
+}
+
+const BasicBlockGraphBuilder::InstructionFragment*
+BasicBlockGraphBuilder::CompileAndCacheInstructionFragment(
+    uint64_t key, const Instruction& instruction) {
+  if (!CompileInstruction(instruction, scratch_fragment_)) return nullptr;
+  return fragment_cache_.Insert(key, instruction, scratch_fragment_);
+}
+
+bool BasicBlockGraphBuilder::CompileInstruction(
+    const Instruction& instruction, InstructionFragment& fragment) const {
+  fragment.ops.clear();
+  fragment.num_nodes = 0;
+  fragment.out_of_vocabulary_tokens.clear();
+
+  // Add the instruction node.
+  const TokenIndex mnemonic_token =
+      FindTokenIndex(instruction.mnemonic, fragment);
+  if (mnemonic_token == kInvalidTokenIndex) return false;
+  const int instruction_node =
+      AddFragmentNode(fragment, NodeType::kInstruction, mnemonic_token);
+
+  // Add nodes for prefixes of the instruction.
+  for (const std::string& prefix : instruction.prefixes) {
+    const TokenIndex prefix_token = FindTokenIndex(prefix, fragment);
+    if (prefix_token == kInvalidTokenIndex) return false;
+    AddFragmentEdge(fragment, EdgeType::kInstructionPrefix,
+                    AddFragmentNode(fragment, NodeType::kPrefix, prefix_token),
+                    instruction_node);
+  }
+
+  // Add a structural dependency edge from the previous instruction.
+  FragmentOp& previous_op = fragment.ops.emplace_back();
+  previous_op.type = FragmentOp::Type::kPreviousInstructionEdge;
+  previous_op.receiver = instruction_node;
+
+  // Add edges for input operands. And nodes too, if necessary.
+  for (const InstructionOperand& operand : instruction.input_operands) {
+    if (!CompileInputOperand(instruction_node, operand, fragment)) return false;
+  }
+  for (const InstructionOperand& operand :
+       instruction.implicit_input_operands) {
+    if (!CompileInputOperand(instruction_node, operand, fragment)) return false;
+  }
+
+  // Add edges and nodes for output operands.
+  for (const InstructionOperand& operand : instruction.output_operands) {
+    if (!CompileOutputOperand(instruction_node, operand, fragment)) {
+      return false;
+    }
+  }
+  for (const InstructionOperand& operand :
+       instruction.implicit_output_operands) {
+    if (!CompileOutputOperand(instruction_node, operand, fragment)) {
+      return false;
+    }
+  }
+  fragment.hash = HashInstructionFragment(fragment);
+  return true;
 }
 
-bool BasicBlockGraphBuilder::AddInputOperand(
-    NodeIndex instruction_node, const InstructionOperand& operand) {
+uint64_t BasicBlockGraphBuilder::HashInstructionFragment(
+    const InstructionFragment& fragment) {
+  StableHasher hasher;
+  hasher.AddInt(fragment.num_nodes);
+  for (const FragmentOp& op : fragment.ops) {
+    hasher.AddInt(static_cast<uint64_t>(op.type));
+    hasher.AddInt(static_cast<uint64_t>(op.node_type));
+    hasher.AddInt(static_cast<uint64_t>(op.edge_type));
+    hasher.AddInt(op.token_index);
+    hasher.AddInt(op.sender);
+    hasher.AddInt(op.receiver);
+    switch (op.type) {
+      case FragmentOp::Type::kInputRegister:
+      case FragmentOp::Type::kOutputRegister:
+        hasher.AddString(TokenInterner::Global().token(op.key));
+        break;
+      default:
+        // The alias group IDs come from the input and do not depend on the
+        // process.
+        hasher.AddInt(op.key);
+        break;
+    }
+  }
+  return hasher.Finish();
+}
+
+bool BasicBlockGraphBuilder::CompileInputOperand(
+    int instruction_node, const InstructionOperand& operand,
+    InstructionFragment& fragment) const {
   assert(instruction_node >= 0);
-  assert(instruction_node < num_nodes());
+  assert(instruction_node < fragment.num_nodes);
+
+  // Adds a dependency of `dependent_node` on a register. The register node is
+  // added when the fragment is added to the graph, if it doesn't exist there.
+  const auto add_dependency_on_register = [this, &fragment](
+                                              int dependent_node,
+                                              TokenId register_id,
+                                              EdgeType edge_type) {
+    const TokenIndex token_index =
+        FindTokenIndexForTokenId(register_id, fragment);
+    if (token_index == kInvalidTokenIndex) return false;
+    FragmentOp& op = fragment.ops.emplace_back();
+    op.type = FragmentOp::Type::kInputRegister;
+    op.edge_type = edge_type;
+    op.token_index = token_index;
+    op.key = register_id;
+    op.receiver = dependent_node;
+    return true;
+  };
 
   switch (operand.type()) {
     case OperandType::kRegister: {
-      if (!AddDependencyOnRegister(instruction_node, operand.register_name(),
-                                   EdgeType::kInputOperands)) {
+      if (!add_dependency_on_register(instruction_node, operand.register_id(),
+                                      EdgeType::kInputOperands)) {
         return false;
       }
     } break;
     case OperandType::kImmediateValue: {
-      AddEdge(EdgeType::kInputOperands,
-              AddNode(NodeType::kImmediate, immediate_token_),
-              instruction_node);
+      AddFragmentEdge(
+          fragment, EdgeType::kInputOperands,
+          AddFragmentNode(fragment, NodeType::kImmediate, immediate_token_),
+          instruction_node);
     } break;
     case OperandType::kFpImmediateValue: {
-      AddEdge(EdgeType::kInputOperands,
-              AddNode(NodeType::kFpImmediate, fp_immediate_token_),
-              instruction_node);
+      AddFragmentEdge(fragment, EdgeType::kInputOperands,
+                      AddFragmentNode(fragment, NodeType::kFpImmediate,
+                                      fp_immediate_token_),
+                      instruction_node);
     } break;
     case OperandType::kAddress: {
-      const NodeIndex address_node =
-          AddNode(NodeType::kAddressOperand, address_token_);
+      const int address_node =
+          AddFragmentNode(fragment, NodeType::kAddressOperand, address_token_);
       const AddressTuple& address_tuple = operand.address();
+      TokenInterner& interner = TokenInterner::Global();
       if (!address_tuple.base_register.empty()) {
-        if (!AddDependencyOnRegister(address_node, address_tuple.base_register,
-                                     EdgeType::kAddressBaseRegister)) {
+        if (!add_dependency_on_register(
+                address_node, interner.Intern(address_tuple.base_register),
+                EdgeType::kAddressBaseRegister)) {
           return false;
         }
       }
       if (!address_tuple.index_register.empty()) {
-        if (!AddDependencyOnRegister(address_node, address_tuple.index_register,
-                                     EdgeType::kAddressIndexRegister)) {
+        if (!add_dependency_on_register(
+                address_node, interner.Intern(address_tuple.index_register),
+                EdgeType::kAddressIndexRegister)) {
           return false;
         }
       }
       if (!address_tuple.segment_register.empty()) {
-        if (!AddDependencyOnRegister(address_node,
-                                     address_tuple.segment_register,
-                                     EdgeType::kAddressSegmentRegister)) {
+        if (!add_dependency_on_register(
+                address_node, interner.Intern(address_tuple.segment_register),
+                EdgeType::kAddressSegmentRegister)) {
           return false;
         }
       }
       if (address_tuple.displacement != 0) {
-        AddEdge(EdgeType::kAddressDisplacement,
-                AddNode(NodeType::kImmediate, immediate_token_), address_node);
+        AddFragmentEdge(
+            fragment, EdgeType::kAddressDisplacement,
+            AddFragmentNode(fragment, NodeType::kImmediate, immediate_token_),
+            address_node);
       }
       // NOTE(ondrasej): For now, we explicitly ignore the scaling.
-      AddEdge(EdgeType::kInputOperands, address_node, instruction_node);
+      AddFragmentEdge(fragment, EdgeType::kInputOperands, address_node,
+                      instruction_node);
     } break;
     case OperandType::kMemory: {
-      NodeIndex& alias_group_node = LookupOrInsert(
-          alias_group_nodes_, operand.alias_group_id(), kInvalidNode);
-      if (alias_group_node == kInvalidNode) {
-        alias_group_node = AddNode(NodeType::kMemoryOperand, memory_token_);
-      }
-      AddEdge(EdgeType::kInputOperands, alias_group_node, instruction_node);
+      FragmentOp& op = fragment.ops.emplace_back();
+      op.type = FragmentOp::Type::kInputMemory;
+      op.edge_type = EdgeType::kInputOperands;
+      op.key = operand.alias_group_id();
+      op.receiver = instruction_node;
     } break;
     case OperandType::kUnknown:
       // TODO(ondrasej): Return an error instead.
@@ -323,18 +729,25 @@ bool BasicBlockGraphBuilder::AddInputOperand(
   return true;
 }
 
-bool BasicBlockGraphBuilder::AddOutputOperand(
-    NodeIndex instruction_node, const InstructionOperand& operand) {
+bool BasicBlockGraphBuilder::CompileOutputOperand(
+    int instruction_node, const InstructionOperand& operand,
+    InstructionFragment& fragment) const {
   assert(instruction_node >= 0);
-  assert(instruction_node < num_nodes());
+  assert(instruction_node < fragment.num_nodes);
 
   switch (operand.type()) {
     case OperandType::kRegister: {
-      const NodeIndex register_node =
-          AddNode(NodeType::kRegister, operand.register_name());
-      if (register_node == kInvalidNode) return false;
-      AddEdge(EdgeType::kOutputOperands, instruction_node, register_node);
-      register_nodes_[operand.register_name()] = register_node;
+      const TokenIndex token_index =
+          FindTokenIndexForTokenId(operand.register_id(), fragment);
+      if (token_index == kInvalidTokenIndex) return false;
+      const int register_node =
+          AddFragmentNode(fragment, NodeType::kRegister, token_index);
+      AddFragmentEdge(fragment, EdgeType::kOutputOperands, instruction_node,
+                      register_node);
+      FragmentOp& op = fragment.ops.emplace_back();
+      op.type = FragmentOp::Type::kOutputRegister;
+      op.key = operand.register_id();
+      op.sender = register_node;
     } break;
     case OperandType::kImmediateValue:
     case OperandType::kFpImmediateValue:
@@ -344,10 +757,14 @@ bool BasicBlockGraphBuilder::AddOutputOperand(
       std::abort();
       break;
     case OperandType::kMemory: {
-      const NodeIndex alias_group_node =
-          AddNode(NodeType::kMemoryOperand, memory_token_);
-      alias_group_nodes_[operand.alias_group_id()] = alias_group_node;
-      AddEdge(EdgeType::kOutputOperands, instruction_node, alias_group_node);
+      const int alias_group_node =
+          AddFragmentNode(fragment, NodeType::kMemoryOperand, memory_token_);
+      FragmentOp& op = fragment.ops.emplace_back();
+      op.type = FragmentOp::Type::kOutputMemory;
+      op.key = operand.alias_group_id();
+      op.sender = alias_group_node;
+      AddFragmentEdge(fragment, EdgeType::kOutputOperands, instruction_node,
+                      alias_group_node);
     } break;
     case OperandType::kUnknown:
       // TODO(ondrasej): Return an error.
@@ -357,19 +774,75 @@ bool BasicBlockGraphBuilder::AddOutputOperand(
   return true;
 }
 
-bool BasicBlockGraphBuilder::AddDependencyOnRegister(
-    NodeIndex dependent_node, const std::string& register_name,
-    EdgeType edge_type) {
-  NodeIndex& operand_node =
-      LookupOrInsert(register_nodes_, register_name, kInvalidNode);
-  if (operand_node == kInvalidNode) {
-    // Add a node for the register if it doesn't exist. This also updates the
-    // node index in `node_by_register`.
-    operand_node = AddNode(NodeType::kRegister, register_name);
+int BasicBlockGraphBuilder::AddFragmentNode(InstructionFragment& fragment,
+                                            NodeType node_type,
+                                            TokenIndex token_index) {
+  FragmentOp& op = fragment.ops.emplace_back();
+  op.type = FragmentOp::Type::kNode;
+  op.node_type = node_type;
+  op.token_index = token_index;
+  return fragment.num_nodes++;
+}
+
+void BasicBlockGraphBuilder::AddFragmentEdge(InstructionFragment& fragment,
+                                             EdgeType edge_type, int sender,
+                                             int receiver) {
+  assert(sender >= 0);
+  assert(sender < fragment.num_nodes);
+  assert(receiver >= 0);
+  assert(receiver < fragment.num_nodes);
+  FragmentOp& op = fragment.ops.emplace_back();
+  op.type = FragmentOp::Type::kEdge;
+  op.edge_type = edge_type;
+  op.sender = sender;
+  op.receiver = receiver;
+}
+
+BasicBlockGraphBuilder::NodeIndex BasicBlockGraphBuilder::AddFragment(
+    const InstructionFragment& fragment, NodeIndex previous_instruction_node) {
+  assert(fragment.num_nodes > 0);
+  fragment_nodes_.clear();
+  for (const FragmentOp& op : fragment.ops) {
+    switch (op.type) {
+      case FragmentOp::Type::kNode:
+        fragment_nodes_.push_back(AddNode(op.node_type, op.token_index));
+        break;
+      case FragmentOp::Type::kEdge:
+        AddEdge(op.edge_type, fragment_nodes_[op.sender],
+                fragment_nodes_[op.receiver]);
+        break;
+      case FragmentOp::Type::kPreviousInstructionEdge:
+        if (previous_instruction_node != kInvalidNode) {
+          AddEdge(EdgeType::kStructuralDependency, previous_instruction_node,
+                  fragment_nodes_[op.receiver]);
+        }
+        break;
+      case FragmentOp::Type::kInputRegister: {
+        // Add a node for the register if it doesn't exist. This also updates
+        // the node index in `register_nodes_`.
+        NodeIndex& register_node = RegisterNode(op.key);
+        if (register_node == kInvalidNode) {
+          register_node = AddNode(NodeType::kRegister, op.token_index);
+        }
+        AddEdge(op.edge_type, register_node, fragment_nodes_[op.receiver]);
+      } break;
+      case FragmentOp::Type::kInputMemory: {
+        NodeIndex& alias_group_node = AliasGroupNode(op.key);
+        if (alias_group_node == kInvalidNode) {
+          alias_group_node = AddNode(NodeType::kMemoryOperand, memory_token_);
+        }
+        AddEdge(op.edge_type, alias_group_node, fragment_nodes_[op.receiver]);
+      } break;
+      case FragmentOp::Type::kOutputRegister:
+        RegisterNode(op.key) = fragment_nodes_[op.sender];
+        break;
+      case FragmentOp::Type::kOutputMemory:
+        AliasGroupNode(op.key) = fragment_nodes_[op.sender];
+        break;
+    }
   }
-  if (operand_node == kInvalidNode) return false;
-  AddEdge(edge_type, operand_node, dependent_node);
-  return true;
+  // The instruction node is always the first node of the fragment.
+  return fragment_nodes_.front();
 }
 
 BasicBlockGraphBuilder::NodeIndex BasicBlockGraphBuilder::AddNode(
@@ -380,23 +853,58 @@ BasicBlockGraphBuilder::NodeIndex BasicBlockGraphBuilder::AddNode(
   return new_node_index;
 }
 
-BasicBlockGraphBuilder::NodeIndex BasicBlockGraphBuilder::AddNode(
-    NodeType node_type, const std::string& token) {
-  const auto it = node_tokens_.find(token);
-  TokenIndex token_index = kInvalidTokenIndex;
-  if (it != node_tokens_.end()) {
-    token_index = it->second;
-  } else {
-    // TODO(ondrasej): Make this error message optional.
-    std::cerr << "Unexpected node token: '" << token << "'";
-    switch (out_of_vocabulary_behavior_.behavior_type()) {
-      case OutOfVocabularyTokenBehavior::BehaviorType::kReturnError:
-        return kInvalidNode;
-      case OutOfVocabularyTokenBehavior::BehaviorType::kReplaceToken:
-        token_index = replacement_token_;
+BasicBlockGraphBuilder::TokenIndex BasicBlockGraphBuilder::FindTokenIndex(
+    std::string_view token, InstructionFragment& fragment) const {
+  const TokenIndex token_index = vocabulary_->IndexOf(token);
+  if (token_index != kInvalidTokenIndex) return token_index;
+  fragment.out_of_vocabulary_tokens.emplace_back(token);
+  // `replacement_token_` is kInvalidTokenIndex for kReturnError.
+  return replacement_token_;
+}
+
+BasicBlockGraphBuilder::TokenIndex
+BasicBlockGraphBuilder::FindTokenIndexForTokenId(
+    TokenId token_id, InstructionFragment& fragment) const {
+  assert(token_id >= 0);
+  const TokenIndex token_index = vocabulary_->IndexOf(token_id);
+  if (token_index != kInvalidTokenIndex) return token_index;
+  // The token is not in the vocabulary. Use the slow path that handles the
+  // out-of-vocabulary behavior.
+  return FindTokenIndex(TokenInterner::Global().token(token_id), fragment);
+}
+
+void BasicBlockGraphBuilder::CountOutOfVocabularyTokens(
+    const InstructionFragment& fragment) {
+  for (const std::string& token : fragment.out_of_vocabulary_tokens) {
+    // Report each token only once, so that a block set with a frequent
+    // unknown token does not flood stderr.
+    if (out_of_vocabulary_token_counts_->Add(token)) {
+      std::cerr << "Unexpected node token: '" << token << "'\n";
     }
   }
-  return AddNode(node_type, token_index);
+  if (replacement_token_ != kInvalidTokenIndex) {
+    GEMATRIA_TRACE_COUNTER(kOovReplacements,
+                           fragment.out_of_vocabulary_tokens.size());
+  }
+}
+
+BasicBlockGraphBuilder::NodeIndex& BasicBlockGraphBuilder::RegisterNode(
+    TokenId register_id) {
+  assert(register_id >= 0);
+  if (register_id >= register_nodes_.size()) {
+    register_nodes_.resize(register_id + 1, kInvalidNode);
+  }
+  NodeIndex& node = register_nodes_[register_id];
+  if (node == kInvalidNode) used_register_ids_.push_back(register_id);
+  return node;
+}
+
+BasicBlockGraphBuilder::NodeIndex& BasicBlockGraphBuilder::AliasGroupNode(
+    int alias_group_id) {
+  for (auto& [group_id, node] : alias_group_nodes_) {
+    if (group_id == alias_group_id) return node;
+  }
+  return alias_group_nodes_.emplace_back(alias_group_id, kInvalidNode).second;
 }
 
 void BasicBlockGraphBuilder::AddEdge(EdgeType edge_type, NodeIndex sender,
@@ -412,10 +920,14 @@ void BasicBlockGraphBuilder::AddEdge(EdgeType edge_type, NodeIndex sender,
 
 std::vector<int> BasicBlockGraphBuilder::EdgeFeatures() const {
   std::vector<int> edge_features(num_edges());
+  FillEdgeFeatures(edge_features.data());
+  return edge_features;
+}
+
+void BasicBlockGraphBuilder::FillEdgeFeatures(int* edge_features) const {
   for (int i = 0; i < num_edges(); ++i) {
     edge_features[i] = static_cast<int>(edge_types_[i]);
   }
-  return edge_features;
 }
 
 std::vector<bool> BasicBlockGraphBuilder::InstructionNodeMask() const {
@@ -426,25 +938,62 @@ std::vector<bool> BasicBlockGraphBuilder::InstructionNodeMask() const {
   return instruction_node_mask;
 }
 
+void BasicBlockGraphBuilder::FillInstructionNodeMask(
+    bool* instruction_node_mask) const {
+  for (NodeIndex i = 0; i < num_nodes(); ++i) {
+    instruction_node_mask[i] = node_types_[i] == NodeType::kInstruction;
+  }
+}
+
 std::vector<int> BasicBlockGraphBuilder::DeltaBlockIndex() const {
-  const int num_instructions = static_cast<int>(std::count(
-      node_types_.begin(), node_types_.end(), NodeType::kInstruction));
-  std::vector<int> delta_block_index;
-  delta_block_index.reserve(num_instructions);
-  int block = -1;
-  int block_end = 0;
-  for (int node = 0; node < node_types_.size(); ++node) {
-    if (node_types_[node] != NodeType::kInstruction) continue;
-    while (node >= block_end && block < num_graphs()) {
-      block++;
-      block_end += num_nodes_per_block_[block];
+  std::vector<int> delta_block_index(num_instructions());
+  FillDeltaBlockIndex(delta_block_index.data());
+  return delta_block_index;
+}
+
+void BasicBlockGraphBuilder::FillDeltaBlockIndex(int* delta_block_index) const {
+  int num_written = 0;
+  NodeIndex block_begin = 0;
+  for (int block = 0; block < num_graphs(); ++block) {
+    const NodeIndex block_end = block_begin + num_nodes_per_block_[block];
+    for (NodeIndex node = block_begin; node < block_end; ++node) {
+      if (node_types_[node] == NodeType::kInstruction) {
+        delta_block_index[num_written++] = block;
+      }
     }
-    delta_block_index.push_back(block);
+    block_begin = block_end;
   }
-  assert(block == num_graphs() - 1);
-  assert(block_end == num_nodes());
-  assert(delta_block_index.size() == num_instructions);
-  return delta_block_index;
+  assert(block_begin == num_nodes());
+  assert(num_written == num_instructions());
+}
+
+std::vector<std::vector<int>> BasicBlockGraphBuilder::global_features()
+    const {
+  const int row_size = num_node_tokens();
+  std::vector<int> flat_global_features(num_graphs() * row_size);
+  FillGlobalFeatures(flat_global_features.data());
+  std::vector<std::vector<int>> global_features;
+  global_features.reserve(num_graphs());
+  for (int block = 0; block < num_graphs(); ++block) {
+    const auto row_begin = flat_global_features.begin() + block * row_size;
+    global_features.emplace_back(row_begin, row_begin + row_size);
+  }
+  return global_features;
+}
+
+void BasicBlockGraphBuilder::FillGlobalFeatures(int* global_features) const {
+  const int row_size = num_node_tokens();
+  std::fill_n(global_features, num_graphs() * row_size, 0);
+  int sparse_index = 0;
+  for (int block = 0; block < num_graphs(); ++block) {
+    int* const block_features = global_features + block * row_size;
+    for (int i = 0; i < num_global_features_per_block_[block]; ++i) {
+      block_features[sparse_global_feature_tokens_[sparse_index]] =
+          sparse_global_feature_counts_[sparse_index];
+      ++sparse_index;
+    }
+  }
+  assert(sparse_index == sparse_global_feature_tokens_.size());
 }
 
 namespace {
@@ -464,6 +1013,20 @@ void StrAppendList(std::stringstream& buffer, std::string_view list_name,
 }
 }  // namespace
 
+uint64_t BasicBlockGraphBuilder::VocabularyHash() const {
+  StableHasher hasher;
+  hasher.AddInt(vocabulary_->size());
+  for (const std::string& token : vocabulary_->tokens()) {
+    hasher.AddString(token);
+  }
+  for (const TokenIndex token : {immediate_token_, fp_immediate_token_,
+                                 address_token_, memory_token_,
+                                 replacement_token_}) {
+    hasher.AddInt(static_cast<uint64_t>(token));
+  }
+  return hasher.Finish();
+}
+
 std::string BasicBlockGraphBuilder::DebugString() const {
   std::stringstream buffer;
 
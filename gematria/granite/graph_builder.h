@@ -90,13 +90,21 @@
 #define GEMATRIA_GRANITE_GRAPH_BUILDER_H_
 
 #include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <ostream>
 #include <string>
 #include <string_view>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "gematria/basic_block/basic_block.h"
+#include "gematria/basic_block/token_interner.h"
 #include "gematria/model/oov_token_behavior.h"
 
 namespace gematria {
@@ -136,6 +144,32 @@ enum class EdgeType {
 std::ostream& operator<<(std::ostream& os, NodeType node_type);
 std::ostream& operator<<(std::ostream& os, EdgeType edge_type);
 
+// Counts the occurrences of out-of-vocabulary tokens seen by a graph builder.
+// The counts are shared by all copies of the graph builder, e.g. the
+// per-thread copies used for parallel inference, so all methods are
+// thread-safe. The lock is taken only for out-of-vocabulary tokens, which are
+// rare in practice.
+class OutOfVocabularyTokenCounts {
+ public:
+  // Records one occurrence of `token`. Returns true when this is the first
+  // occurrence of the token since the creation or the last Clear().
+  bool Add(std::string_view token);
+
+  // Returns the tokens and their numbers of occurrences, sorted by the number
+  // of occurrences in decreasing order.
+  std::vector<std::pair<std::string, int64_t>> GetCounts() const;
+
+  // Returns the total number of occurrences of all tokens.
+  int64_t total() const;
+
+  void Clear();
+
+ private:
+  mutable std::mutex mutex_;
+  std::unordered_map<std::string, int64_t> counts_;
+  int64_t total_ = 0;
+};
+
 // The basic block graph builder class. See the top-level comment for more
 // information on the format of the graphs produced by this file.
 class BasicBlockGraphBuilder {
@@ -173,6 +207,15 @@ class BasicBlockGraphBuilder {
       std::string_view memory_token,
       OutOfVocabularyTokenBehavior out_of_vocabulary_behavior =
           OutOfVocabularyTokenBehavior::ReturnError());
+  // A version of the constructor that uses a prebuilt vocabulary, e.g. one
+  // shared with graph builders for other instances of the same model. The
+  // out-of-vocabulary index of `vocabulary` must be -1.
+  BasicBlockGraphBuilder(
+      std::shared_ptr<const TokenVocabulary> vocabulary,
+      std::string_view immediate_token, std::string_view fp_immediate_token,
+      std::string_view address_token, std::string_view memory_token,
+      OutOfVocabularyTokenBehavior out_of_vocabulary_behavior =
+          OutOfVocabularyTokenBehavior::ReturnError());
 
   // Adds a basic block to the graph builder.
   //
@@ -188,11 +231,119 @@ class BasicBlockGraphBuilder {
   // block instead of the basic block object itself.
   bool AddBasicBlockFromInstructions(
       const std::vector<Instruction>& instructions);
+  // A version of AddBasicBlock that takes read-only views of the instructions,
+  // e.g. InstructionProtoView from basic_block_protos.h, instead of Instruction
+  // objects. This lets callers build graphs directly from their own
+  // representation of the basic blocks. `instruction_views` is a range of
+  // objects with the methods:
+  //  - uint64_t Hash() const: returns Instruction::Hash() of the instruction.
+  //  - bool Equals(const Instruction& instruction) const: returns true when
+  //    the viewed instruction is equal to `instruction`.
+  //  - void AssignTo(Instruction& instruction) const: replaces the contents of
+  //    `instruction` with the viewed instruction.
+  // The instructions are materialized one at a time in a scratch Instruction,
+  // and only when their fragment is not in the instruction fragment cache.
+  template <typename InstructionViews>
+  bool AddBasicBlockFromInstructionViews(
+      const InstructionViews& instruction_views);
+
+  // Adds all prefixes of a basic block to the graph builder, as if
+  // AddBasicBlock() was called for each prefix, from the shortest one to the
+  // whole basic block. Adds block.instructions.size() graphs to the batch. The
+  // graphs are built in a single pass over the instructions: the graph of each
+  // prefix is a prefix of the nodes and edges of the graph of the whole basic
+  // block.
+  //
+  // Returns true when the prefixes were successfully added; otherwise, returns
+  // false and leaves the graph builder in the previous state, under the same
+  // conditions as AddBasicBlock().
+  bool AddBasicBlockPrefixes(const BasicBlock& block) {
+    return AddBasicBlockPrefixesFromInstructions(block.instructions);
+  }
+  // A version of AddBasicBlockPrefixes that takes the list of instructions in
+  // the basic block instead of the basic block object itself.
+  bool AddBasicBlockPrefixesFromInstructions(
+      const std::vector<Instruction>& instructions);
+
+  // Computes the hash of the graph that AddBasicBlock() would add for `block`,
+  // without adding anything to the batch. The hash is computed from the tokens
+  // and the structure of the graph, so basic blocks that differ only in values
+  // that are not part of the graph, e.g. immediate values or displacements in
+  // addresses, have the same hash. For a given vocabulary, the hash is stable
+  // across processes, and it can be used as a key of persistent caches.
+  // When `prefix_graph_hashes` is not null, replaces its contents with the
+  // hashes of the graphs added by AddBasicBlockPrefixes(); the last one is the
+  // hash of the whole basic block.
+  // When `fragment_hashes` is not null, replaces its contents with the hashes
+  // of the instruction fragments of the basic block. The graph is fully
+  // determined by this sequence, so unlike the graph hash, it can be used to
+  // check that two basic blocks with the same graph hash have the same graph.
+  //
+  // Returns std::nullopt when AddBasicBlock() would return false for the block.
+  // Out-of-vocabulary tokens are not counted; they are counted when the block
+  // is added or by CountOutOfVocabularyTokens(). The instructions are looked up
+  // in and added to the instruction fragment cache, so with the cache enabled,
+  // adding the block after computing its hash does not compile the
+  // instructions again.
+  std::optional<uint64_t> ComputeGraphHash(
+      const BasicBlock& block,
+      std::vector<uint64_t>* prefix_graph_hashes = nullptr,
+      std::vector<uint64_t>* fragment_hashes = nullptr);
+
+  // Counts the out-of-vocabulary tokens of `block` as if it was added to the
+  // batch, without adding it. This keeps out_of_vocabulary_token_counts()
+  // complete for callers that reuse the graph of an earlier basic block
+  // instead of adding the block again.
+  void CountOutOfVocabularyTokens(const BasicBlock& block);
+
+  // Appends all graphs from `other` to the current batch of this graph builder,
+  // as if the basic blocks added to `other` were added to this builder after
+  // the basic blocks already in the batch. This allows building the graphs for
+  // a large batch in parallel, using one graph builder per thread, and then
+  // merging them into a single batch.
+  // `other` must be created with the same node tokens and the same special
+  // tokens as this graph builder, e.g. as a copy of this graph builder.
+  void Append(const BasicBlockGraphBuilder& other);
 
   // Resets the graph builder so that it can be used to create a new graph from
-  // scratch.
+  // scratch. Keeps the capacity of all internal buffers, so that batches of a
+  // similar size can be built without new allocations.
   void Reset();
 
+  // Reserves capacity for a batch with the given number of basic blocks, nodes
+  // and edges. This is only a hint to avoid reallocations while the batch is
+  // built; the batch can still grow beyond the given sizes.
+  void Reserve(int num_blocks, int num_nodes, int num_edges);
+
+  // Enables caching of instruction fragments. The nodes and edges added for an
+  // instruction depend only on the instruction, except for the dependencies on
+  // values produced by earlier instructions. When the cache is enabled, the
+  // graph builder compiles each distinct instruction into a fragment only
+  // once, and it adds subsequent occurrences of the instruction by replaying
+  // the fragment. The cache holds at most `max_size` instructions; when it is
+  // full, the least recently used instruction is evicted. Setting `max_size`
+  // to zero disables the cache and releases the cached fragments. Copies of the
+  // graph builder start with an empty cache of the same size.
+  void SetInstructionFragmentCacheSize(size_t max_size);
+
+  // Returns the number of instructions that have a cached fragment.
+  size_t num_cached_instruction_fragments() const {
+    return fragment_cache_.size();
+  }
+
+  // Returns the counts of the out-of-vocabulary tokens found in the basic
+  // blocks added to this graph builder or any of its copies. With
+  // kReplaceToken, each occurrence is a token that was replaced by the
+  // replacement token; with kReturnError, each occurrence is the token that
+  // caused a basic block to be rejected. The counts are not affected by
+  // Reset(); they are cleared by ResetOutOfVocabularyTokenCounts().
+  const OutOfVocabularyTokenCounts& out_of_vocabulary_token_counts() const {
+    return *out_of_vocabulary_token_counts_;
+  }
+  void ResetOutOfVocabularyTokenCounts() {
+    out_of_vocabulary_token_counts_->Clear();
+  }
+
   // Returns the number of graphs in the batch. This corresponds to the number
   // of successful calls to AddBasicBlock() since the last call to Reset().
   int num_graphs() const {
@@ -205,8 +356,18 @@ class BasicBlockGraphBuilder {
   // Returns the number of edges in the current batch.
   int num_edges() const { return static_cast<int>(edge_senders_.size()); }
 
+  // Returns the number of instructions in all basic blocks in the current
+  // batch. This is the size of DeltaBlockIndex().
+  int num_instructions() const { return num_instructions_; }
+
   // Returns the number of different tokens corresponding to nodes of the graph.
-  int num_node_tokens() const { return static_cast<int>(node_tokens_.size()); }
+  int num_node_tokens() const { return vocabulary_->size(); }
+
+  // Returns the vocabulary of the graph builder. The vocabulary is shared by
+  // all copies of the graph builder.
+  const std::shared_ptr<const TokenVocabulary>& vocabulary() const {
+    return vocabulary_;
+  }
 
   // The following getters provide access to the graphs in the current batch.
   // The data structures and the format of the data match the format used by the
@@ -229,6 +390,8 @@ class BasicBlockGraphBuilder {
   const std::vector<int>& num_edges_per_block() const {
     return num_edges_per_block_;
   }
+  // The hash of each graph in the batch, as computed by ComputeGraphHash().
+  const std::vector<uint64_t>& graph_hashes() const { return graph_hashes_; }
 
   // The types of the nodes in the batch.
   const std::vector<NodeType>& node_types() const { return node_types_; }
@@ -251,10 +414,29 @@ class BasicBlockGraphBuilder {
   const std::vector<EdgeType>& edge_types() const { return edge_types_; }
 
   // Returns the matrix of global features of the graphs in the batch. This is a
-  // 2D matrix of shape (num_nodes(), num_node_tokens()), in the row-major
+  // 2D matrix of shape (num_graphs(), num_node_tokens()), in the row-major
   // format. Corresponds to `GraphsTuple.globals`.
-  const std::vector<std::vector<int>>& global_features() const {
-    return global_features_;
+  // The matrix is materialized from the sparse representation on each call;
+  // prefer the sparse accessors below in performance-sensitive code.
+  std::vector<std::vector<int>> global_features() const;
+
+  // The global features of the graphs in the batch in a sparse (CSR-like)
+  // format. The global feature of a graph is a vector of size
+  // num_node_tokens(), where the i-th element is the number of nodes with
+  // token i in the graph. The sparse format stores only the non-zero elements:
+  // the i-th graph in the batch has num_global_features_per_block()[i]
+  // non-zero elements; their token indices and counts are stored in
+  // sparse_global_feature_tokens() and sparse_global_feature_counts(), right
+  // after the elements of the (i-1)-th graph. The elements of each graph are
+  // sorted by the token index.
+  const std::vector<int>& num_global_features_per_block() const {
+    return num_global_features_per_block_;
+  }
+  const std::vector<TokenIndex>& sparse_global_feature_tokens() const {
+    return sparse_global_feature_tokens_;
+  }
+  const std::vector<int>& sparse_global_feature_counts() const {
+    return sparse_global_feature_counts_;
   }
 
   // Returns a vector of node features. The feature of each node is the index of
@@ -278,8 +460,19 @@ class BasicBlockGraphBuilder {
   // model_base.ModelBase._delta_block_index_tensor.
   std::vector<int> DeltaBlockIndex() const;
 
-  // TODO(ondrasej): Consider adding methods that directly create NumPy arrays
-  // from the data in this class to avoid the extra conversion.
+  // Versions of EdgeFeatures(), InstructionNodeMask(), and DeltaBlockIndex()
+  // that write the data directly to a buffer provided by the caller instead of
+  // allocating a new vector, e.g. to the memory of an input tensor of a model.
+  // The sizes of the buffers are given by the sizes of the current batch:
+  //  - FillEdgeFeatures: num_edges() elements,
+  //  - FillInstructionNodeMask: num_nodes() elements,
+  //  - FillDeltaBlockIndex: num_instructions() elements.
+  //  - FillGlobalFeatures: num_graphs() * num_node_tokens() elements, in the
+  //    same row-major format as global_features().
+  void FillEdgeFeatures(int* edge_features) const;
+  void FillInstructionNodeMask(bool* instruction_node_mask) const;
+  void FillDeltaBlockIndex(int* delta_block_index) const;
+  void FillGlobalFeatures(int* global_features) const;
 
   // Methods for accessing the indices of the special tokens in the graph
   // builder. When they return a non-negative value, this value is the index of
@@ -291,11 +484,21 @@ class BasicBlockGraphBuilder {
   TokenIndex memory_token() const { return memory_token_; }
   TokenIndex replacement_token() const { return replacement_token_; }
 
+  // Returns a stable hash of the vocabulary of the graph builder: the list of
+  // node tokens, the special tokens, and the replacement token. Two graph
+  // builders with the same vocabulary hash produce the same graphs for the same
+  // basic blocks, e.g. when restoring graphs from a GraphBatchCache.
+  uint64_t VocabularyHash() const;
+
   // Converts the contents of the graph builder to a human-readable string
   // representation.
   std::string DebugString() const;
 
  private:
+  // GraphBatchCache restores the batches of the builder directly from the
+  // mapped cache file.
+  friend class GraphBatchCache;
+
   // Keeps track of the state of the basic block graph builder, and allows
   // reverting it to a state before adding a basic block to the current batch.
   // The class is intended to be used as an RAII object - it is created at the
@@ -338,35 +541,214 @@ class BasicBlockGraphBuilder {
     size_t prev_edge_senders_size_;
     size_t prev_edge_receivers_size_;
     size_t prev_edge_types_size_;
-    size_t prev_global_features_size_;
+    size_t prev_num_global_features_per_block_size_;
+    size_t prev_sparse_global_feature_tokens_size_;
+    size_t prev_sparse_global_feature_counts_size_;
+    size_t prev_graph_hashes_size_;
   };
 
-  // Adds nodes and edges for a single input operand of an instruction.
-  bool AddInputOperand(NodeIndex instruction_node,
-                       const InstructionOperand& operand);
-  // Adds nodes and edges for a single output operand of an instruction.
-  bool AddOutputOperand(NodeIndex instruction_node,
-                        const InstructionOperand& operand);
+  // A node index that does not refer to any node.
+  static constexpr NodeIndex kInvalidNode = -1;
+
+  // Resets the state maintained for the basic block being added. Must be called
+  // before adding the instructions of a new basic block.
+  void StartBasicBlock();
+  // The size and the hash of the graph of a prefix of a basic block.
+  struct PrefixGraph {
+    int num_nodes;
+    int num_edges;
+    uint64_t graph_hash;
+  };
+  // Adds the nodes and edges of `instructions` to the batch, without adding a
+  // new graph. When `prefix_graphs` is not null, appends to it the number of
+  // nodes and edges added for and the graph hash of each prefix of
+  // `instructions`. Returns the graph hash of all instructions, or
+  // std::nullopt when an instruction can't be added.
+  std::optional<uint64_t> AddInstructions(
+      const std::vector<Instruction>& instructions,
+      std::vector<PrefixGraph>* prefix_graphs);
+  // Adds a graph made of the nodes starting at `graph_begin` and the edges
+  // starting at `graph_edges_begin` to the batch. Computes the global features
+  // of the graph and updates the per-block data.
+  void FinishGraph(NodeIndex graph_begin, int graph_edges_begin,
+                   int num_instructions, uint64_t graph_hash);
+
+  // A single operation of an instruction fragment. An instruction fragment is
+  // a precompiled sequence of operations that adds the nodes and edges of one
+  // instruction to the graph. The operations depend only on the instruction;
+  // the dependencies on values produced by earlier instructions are resolved
+  // when the fragment is added to the graph. Nodes created by the fragment are
+  // referred to by their index in the fragment, in the order of creation; the
+  // instruction node always has index 0.
+  struct FragmentOp {
+    enum class Type {
+      // Adds a node of type `node_type` with feature `token_index`.
+      kNode,
+      // Adds an edge of type `edge_type` from `sender` to `receiver`.
+      kEdge,
+      // Adds a structural dependency edge from the previous instruction to
+      // `receiver`, if there is a previous instruction.
+      kPreviousInstructionEdge,
+      // Adds an edge of type `edge_type` from the node holding the value of
+      // register `key` to `receiver`. Adds a node for the register with feature
+      // `token_index` if there is none.
+      kInputRegister,
+      // Adds an edge of type `edge_type` from the node holding the value of
+      // alias group `key` to `receiver`. Adds a node for the alias group if
+      // there is none.
+      kInputMemory,
+      // Records that `sender` holds the value of register `key`.
+      kOutputRegister,
+      // Records that `sender` holds the value of alias group `key`.
+      kOutputMemory,
+    };
+
+    Type type;
+    NodeType node_type = NodeType::kInstruction;
+    EdgeType edge_type = EdgeType::kStructuralDependency;
+    TokenIndex token_index = -1;
+    // The ID of the register name or the alias group ID.
+    int key = -1;
+    int sender = -1;
+    int receiver = -1;
+  };
+  struct InstructionFragment {
+    std::vector<FragmentOp> ops;
+    // The number of nodes created by the fragment.
+    int num_nodes = 0;
+    // The out-of-vocabulary tokens of the instruction, in the order in which
+    // they were found. Empty for almost all instructions.
+    std::vector<std::string> out_of_vocabulary_tokens;
+    // A hash of `ops` and `num_nodes`. The graph hash of a basic block is
+    // computed from the hashes of the fragments of its instructions: the graph
+    // is fully determined by the sequence of the fragments.
+    uint64_t hash = 0;
+  };
+
+  // Returns the value of InstructionFragment::hash for `fragment`. Registers
+  // are hashed by their names rather than by their token IDs, which depend on
+  // the order in which the names were interned.
+  static uint64_t HashInstructionFragment(const InstructionFragment& fragment);
+
+  // A bounded cache of instruction fragments keyed by Instruction::Hash().
+  // Each entry keeps a copy of its instruction, and a lookup returns the
+  // fragment only when the cached instruction is equal to the looked up one,
+  // so a hash collision can't replay the fragment of another instruction. When
+  // the cache is full, adding a fragment evicts the least recently used one.
+  //
+  // Copies of the cache are empty and have the same maximal size, so that
+  // copying a graph builder, e.g. for a per-thread clone of an inference
+  // object, does not copy all the cached fragments.
+  class InstructionFragmentCache {
+   public:
+    InstructionFragmentCache() = default;
+    InstructionFragmentCache(const InstructionFragmentCache& other)
+        : max_size_(other.max_size_) {}
+    InstructionFragmentCache& operator=(const InstructionFragmentCache& other);
+
+    // Sets the maximal number of entries. Evicts the least recently used
+    // entries that do not fit.
+    void SetMaxSize(size_t max_size);
+    size_t max_size() const { return max_size_; }
+    size_t size() const { return entries_.size(); }
+
+    // Returns the fragment of the instruction with the hash `key`, or nullptr
+    // when it is not in the cache. `equals(instruction)` must return true when
+    // `instruction` is the looked up instruction. Marks the entry as recently
+    // used.
+    template <typename Equals>
+    const InstructionFragment* Find(uint64_t key, const Equals& equals);
+
+    // Adds `fragment` of `instruction`, whose hash is `key`, to the cache and
+    // returns the cached copy. Replaces the entry of another instruction with
+    // the same hash. Must not be called when max_size() is zero.
+    const InstructionFragment* Insert(uint64_t key,
+                                      const Instruction& instruction,
+                                      const InstructionFragment& fragment);
+
+   private:
+    struct Entry {
+      uint64_t key;
+      Instruction instruction;
+      InstructionFragment fragment;
+    };
+
+    size_t max_size_ = 0;
+    // The entries ordered from the most recently used to the least recently
+    // used.
+    std::list<Entry> entries_;
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> index_;
+  };
 
-  // Adds dependency of a node (instruction or an address computation node) on
-  // a register. Adds the register node if it doesn't exist in the graph.
-  bool AddDependencyOnRegister(NodeIndex dependent_node,
-                               const std::string& register_name,
-                               EdgeType edge_type);
+  // Returns the fragment for `instruction`, either from the cache or by
+  // compiling it. Returns nullptr when the instruction can't be compiled. The
+  // returned pointer remains valid until the next call to this method.
+  const InstructionFragment* GetInstructionFragment(
+      const Instruction& instruction);
+  // Compiles `instruction`, whose Instruction::Hash() is `key`, and adds the
+  // fragment to the cache. Returns nullptr when the instruction can't be
+  // compiled. The returned pointer remains valid until the next call to one of
+  // the fragment lookup methods.
+  const InstructionFragment* CompileAndCacheInstructionFragment(
+      uint64_t key, const Instruction& instruction);
+  // Compiles `instruction` into `fragment`. Returns false when the instruction
+  // contains an unknown token and the out-of-vocabulary behavior is not
+  // kReplaceToken.
+  bool CompileInstruction(const Instruction& instruction,
+                          InstructionFragment& fragment) const;
+  // Compiles a single input or output operand of the instruction whose node
+  // has index `instruction_node` in `fragment`.
+  bool CompileInputOperand(int instruction_node,
+                           const InstructionOperand& operand,
+                           InstructionFragment& fragment) const;
+  bool CompileOutputOperand(int instruction_node,
+                            const InstructionOperand& operand,
+                            InstructionFragment& fragment) const;
+  // Helper functions for CompileInstruction(). AddFragmentNode() returns the
+  // index of the new node in the fragment.
+  static int AddFragmentNode(InstructionFragment& fragment, NodeType node_type,
+                             TokenIndex token_index);
+  static void AddFragmentEdge(InstructionFragment& fragment,
+                              EdgeType edge_type, int sender, int receiver);
+  // Adds the nodes and edges of `fragment` to the graph. Returns the index of
+  // the instruction node.
+  NodeIndex AddFragment(const InstructionFragment& fragment,
+                        NodeIndex previous_instruction_node);
+
+  // Returns the index of the given token in the vocabulary. When the token is
+  // not in the vocabulary, adds it to the out-of-vocabulary tokens of
+  // `fragment` and applies the out-of-vocabulary behavior; returns
+  // kInvalidTokenIndex when the behavior is kReturnError.
+  TokenIndex FindTokenIndex(std::string_view token,
+                            InstructionFragment& fragment) const;
+  // A version of FindTokenIndex() that takes the ID of the token in
+  // TokenInterner::Global(). The token is looked up by the ID without hashing
+  // the token.
+  TokenIndex FindTokenIndexForTokenId(TokenId token_id,
+                                      InstructionFragment& fragment) const;
+  // Records the out-of-vocabulary tokens of `fragment` in
+  // `out_of_vocabulary_token_counts_`. Called each time the fragment is used,
+  // so that instructions replayed from the fragment cache are counted too.
+  void CountOutOfVocabularyTokens(const InstructionFragment& fragment);
 
   // Adds a new node to the batch; the feature of the node is given directly by
   // the caller.
   NodeIndex AddNode(NodeType node_type, TokenIndex token_index);
-  // Adds a new edge to the batch; the feature of the node is determined from
-  // the token associated with the node. Returns kInvalidNode when the node was
-  // not added.
-  NodeIndex AddNode(NodeType node_type, const std::string& token);
   // Adds a new edge to the batch.
   void AddEdge(EdgeType edge_type, NodeIndex sender, NodeIndex receiver);
 
-  // Mapping from string node tokens to indices of embedding vectors used in
-  // the models.
-  const std::unordered_map<std::string, TokenIndex> node_tokens_;
+  // Returns a reference to the entry of `register_nodes_` for the given
+  // register. The entry is kInvalidNode when the register was not used in the
+  // basic block being added.
+  NodeIndex& RegisterNode(TokenId register_id);
+  // Returns a reference to the entry of `alias_group_nodes_` for the given
+  // alias group. The entry is kInvalidNode when the alias group was not used in
+  // the basic block being added.
+  NodeIndex& AliasGroupNode(int alias_group_id);
+
+  // The node tokens and their indices. The vocabulary is immutable and shared
+  // by all copies of the graph builder.
+  const std::shared_ptr<const TokenVocabulary> vocabulary_;
   // Tokens corresponding to nodes in the batch that are not associated directly
   // with a token of the assembly language.
   const TokenIndex immediate_token_;
@@ -374,11 +756,21 @@ class BasicBlockGraphBuilder {
   const TokenIndex address_token_;
   const TokenIndex memory_token_;
 
-  const OutOfVocabularyTokenBehavior out_of_vocabulary_behavior_;
+  // The token index used for out-of-vocabulary tokens: the index of the
+  // replacement token for kReplaceToken, and kInvalidTokenIndex for
+  // kReturnError. The out-of-vocabulary behavior is fully resolved into this
+  // value in the constructor, so that FindTokenIndex() does not need to check
+  // the behavior for each unknown token.
   const TokenIndex replacement_token_;
 
+  // Shared by all copies of the graph builder.
+  const std::shared_ptr<OutOfVocabularyTokenCounts>
+      out_of_vocabulary_token_counts_ =
+          std::make_shared<OutOfVocabularyTokenCounts>();
+
   std::vector<int> num_nodes_per_block_;
   std::vector<int> num_edges_per_block_;
+  int num_instructions_ = 0;
 
   std::vector<NodeType> node_types_;
   std::vector<TokenIndex> node_features_;
@@ -387,12 +779,98 @@ class BasicBlockGraphBuilder {
   std::vector<NodeIndex> edge_receivers_;
   std::vector<EdgeType> edge_types_;
 
-  std::vector<std::vector<int>> global_features_;
-
-  std::unordered_map<std::string_view, NodeIndex> register_nodes_;
-  std::unordered_map<int, NodeIndex> alias_group_nodes_;
+  std::vector<int> num_global_features_per_block_;
+  std::vector<TokenIndex> sparse_global_feature_tokens_;
+  std::vector<int> sparse_global_feature_counts_;
+
+  std::vector<uint64_t> graph_hashes_;
+
+  // Maps IDs of register names to the node that holds the current value of the
+  // register in the basic block being added; contains kInvalidNode for
+  // registers that were not used in the basic block. The vector is indexed by
+  // the token ID and it grows as needed. Only the entries in
+  // `used_register_ids_` are reset between basic blocks.
+  std::vector<NodeIndex> register_nodes_;
+  std::vector<TokenId> used_register_ids_;
+  // Maps alias group IDs to the node that holds the current value of the alias
+  // group in the basic block being added. A basic block uses only a handful of
+  // alias groups, so a linear search is faster than a hash map.
+  std::vector<std::pair<int, NodeIndex>> alias_group_nodes_;
+
+  InstructionFragmentCache fragment_cache_;
+  // Scratch space for instructions that are not in the cache.
+  InstructionFragment scratch_fragment_;
+  // Scratch space for instructions materialized from instruction views by
+  // AddBasicBlockFromInstructionViews().
+  Instruction scratch_instruction_;
+  // The indices of the nodes created by the fragment being added to the graph.
+  std::vector<NodeIndex> fragment_nodes_;
 };
 
+template <typename Equals>
+const BasicBlockGraphBuilder::InstructionFragment*
+BasicBlockGraphBuilder::InstructionFragmentCache::Find(uint64_t key,
+                                                       const Equals& equals) {
+  const auto it = index_.find(key);
+  if (it == index_.end() || !equals(it->second->instruction)) return nullptr;
+  // splice() does not invalidate the iterators in `index_`.
+  entries_.splice(entries_.begin(), entries_, it->second);
+  return &it->second->fragment;
+}
+
+template <typename InstructionViews>
+bool BasicBlockGraphBuilder::AddBasicBlockFromInstructionViews(
+    const InstructionViews& instruction_views) {
+  if (std::begin(instruction_views) == std::end(instruction_views)) {
+    return false;
+  }
+  AddBasicBlockTransaction transaction(this);
+
+  const int prev_num_nodes = num_nodes();
+  const int prev_num_edges = num_edges();
+  StartBasicBlock();
+  NodeIndex previous_instruction_node = kInvalidNode;
+  int num_instructions = 0;
+  StableHasher graph_hasher;
+  for (const auto& instruction_view : instruction_views) {
+    const InstructionFragment* fragment = nullptr;
+    if (fragment_cache_.max_size() == 0) {
+      instruction_view.AssignTo(scratch_instruction_);
+      if (!CompileInstruction(scratch_instruction_, scratch_fragment_)) {
+        CountOutOfVocabularyTokens(scratch_fragment_);
+        return false;
+      }
+      fragment = &scratch_fragment_;
+    } else {
+      const uint64_t key = instruction_view.Hash();
+      fragment = fragment_cache_.Find(key, [&](const Instruction& cached) {
+        return instruction_view.Equals(cached);
+      });
+      if (fragment == nullptr) {
+        instruction_view.AssignTo(scratch_instruction_);
+        fragment =
+            CompileAndCacheInstructionFragment(key, scratch_instruction_);
+        if (fragment == nullptr) {
+          CountOutOfVocabularyTokens(scratch_fragment_);
+          return false;
+        }
+      }
+    }
+    if (!fragment->out_of_vocabulary_tokens.empty()) {
+      CountOutOfVocabularyTokens(*fragment);
+    }
+    previous_instruction_node =
+        AddFragment(*fragment, previous_instruction_node);
+    graph_hasher.AddInt(fragment->hash);
+    ++num_instructions;
+  }
+  FinishGraph(prev_num_nodes, prev_num_edges, num_instructions,
+              graph_hasher.Finish());
+
+  transaction.Commit();
+  return true;
+}
+
 }  // namespace gematria
 
 #endif  // GEMATRIA_GRANITE_GRAPH_BUILDER_H_
@@ -15,31 +15,45 @@
 #include "gematria/granite/graph_builder_model_inference.h"
 
 #include <algorithm>
+#include <array>
 #include <cassert>
+#include <cmath>
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
+#include <initializer_list>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
 #include <string_view>
+#include <type_traits>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
 #include "gematria/basic_block/basic_block.h"
+#include "gematria/basic_block/token_interner.h"
 #include "gematria/granite/graph_builder.h"
 #include "gematria/model/oov_token_behavior.h"
+#include "gematria/tflite/gather_segment_sum_op.h"
 #include "gematria/tflite/unsorted_segment_sum_op.h"
 #include "gematria/utils/string.h"
+#include "gematria/utils/tracing.h"
 #include "llvm/ADT/ArrayRef.h"
 #include "llvm/ADT/Twine.h"
 #include "llvm/Support/Errc.h"
 #include "llvm/Support/Error.h"
 #include "tensorflow/lite/c/c_api_types.h"
 #include "tensorflow/lite/c/common.h"
+#include "tensorflow/lite/delegates/xnnpack/xnnpack_delegate.h"
 #include "tensorflow/lite/interpreter.h"
 #include "tensorflow/lite/interpreter_builder.h"
 #include "tensorflow/lite/kernels/register.h"
 #include "tensorflow/lite/model_builder.h"
 #include "tensorflow/lite/portable_type_to_tflitetype.h"
+#include "tensorflow/lite/schema/schema_generated.h"
 
 namespace gematria {
 namespace {
@@ -180,52 +194,131 @@ llvm::Error FillTensorFromStdVector(
   return llvm::Error::success();
 }
 
-// Fills a 2D tensor at the given index in `interpreter` from a given matrix
-// represented as a vector of vectors. The data are added to the tensor in the
-// natural ordering (the inner vectors of the matrix are concatenated into the
-// flat tensor buffer).
-// Returns an error if the tensor shape does not match the shape of the matrix
-// or the type of the tensor does not match the requested tensor element type.
-template <typename TensorElementType, typename InputElementType>
-llvm::Error FillTensorFromStdVectorMatrix(
-    tflite::Interpreter* interpreter,
-    const std::vector<std::vector<InputElementType>>& input_matrix,
-    int tensor_index) {
+// Returns a pointer to the data of the 1D tensor at the given index in
+// `interpreter`, so that the caller can fill it in place. Returns an error if
+// the tensor does not have `size` elements or the type of the tensor does not
+// match the requested tensor element type.
+template <typename TensorElementType>
+llvm::Expected<TensorElementType*> GetTensorDataForWriting(
+    tflite::Interpreter* interpreter, int tensor_index, int size) {
   const TfLiteTensor* const tensor = interpreter->input_tensor(tensor_index);
   if (llvm::Error error = CheckTensorTypeAndDimensions(
           tensor_index, tensor, tflite::typeToTfLiteType<TensorElementType>(),
-          input_matrix.size(), input_matrix[0].size())) {
+          size)) {
     return error;
   }
+  return interpreter->typed_input_tensor<TensorElementType>(tensor_index);
+}
 
-  const int expected_size = tensor->dims->data[1];
-  auto* const tensor_data =
-      interpreter->typed_input_tensor<TensorElementType>(tensor_index);
-  for (int row = 0; row < input_matrix.size(); ++row) {
-    const std::vector<TensorElementType>& row_data = input_matrix[row];
-    if (expected_size != row_data.size()) {
+// Fills the 2D global features tensor at the given index in `interpreter` from
+// the sparse global features in `graph_builder`.
+// Returns an error if the tensor shape does not match the shape of the global
+// feature matrix or the type of the tensor is not int32.
+llvm::Error FillGlobalsTensorFromSparseGlobalFeatures(
+    tflite::Interpreter* interpreter,
+    const BasicBlockGraphBuilder& graph_builder, int tensor_index) {
+  const TfLiteTensor* const tensor = interpreter->input_tensor(tensor_index);
+  if (llvm::Error error = CheckTensorTypeAndDimensions(
+          tensor_index, tensor, tflite::typeToTfLiteType<int32_t>(),
+          graph_builder.num_graphs(), graph_builder.num_node_tokens())) {
+    return error;
+  }
+
+  static_assert(std::is_same_v<int32_t, int>);
+  graph_builder.FillGlobalFeatures(
+      interpreter->typed_input_tensor<int32_t>(tensor_index));
+  return llvm::Error::success();
+}
+
+// Converts an IEEE 754 half precision value to float.
+float HalfToFloat(uint16_t half) {
+  const uint32_t sign = static_cast<uint32_t>(half & 0x8000u) << 16;
+  const uint32_t exponent = (half >> 10) & 0x1fu;
+  const uint32_t mantissa = half & 0x3ffu;
+  if (exponent == 0) {
+    // Zero or a subnormal number.
+    const float magnitude = std::ldexp(static_cast<float>(mantissa), -24);
+    return sign != 0 ? -magnitude : magnitude;
+  }
+  uint32_t bits = sign | (mantissa << 13);
+  if (exponent == 0x1fu) {
+    // Infinity or NaN.
+    bits |= 0x7f800000u;
+  } else {
+    bits |= (exponent + (127 - 15)) << 23;
+  }
+  float value;
+  std::memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+// Converts the values of `tensor` to float and stores them in `values`.
+// Supports float16 tensors and int8 and uint8 tensors with per-tensor
+// quantization.
+// Returns an error when the tensor has a different type.
+llvm::Error DequantizeTensor(const TfLiteTensor& tensor,
+                             std::vector<float>& values) {
+  int num_elements = 1;
+  for (int i = 0; i < tensor.dims->size; ++i) {
+    num_elements *= tensor.dims->data[i];
+  }
+  values.resize(num_elements);
+  const float scale = tensor.params.scale;
+  const int32_t zero_point = tensor.params.zero_point;
+  switch (tensor.type) {
+    case kTfLiteFloat16: {
+      const TfLiteFloat16* const data = tensor.data.f16;
+      for (int i = 0; i < num_elements; ++i) {
+        values[i] = HalfToFloat(data[i].data);
+      }
+      return llvm::Error::success();
+    }
+    case kTfLiteInt8: {
+      const int8_t* const data = tensor.data.int8;
+      for (int i = 0; i < num_elements; ++i) {
+        values[i] = scale * static_cast<float>(data[i] - zero_point);
+      }
+      return llvm::Error::success();
+    }
+    case kTfLiteUInt8: {
+      const uint8_t* const data = tensor.data.uint8;
+      for (int i = 0; i < num_elements; ++i) {
+        values[i] = scale * static_cast<float>(data[i] - zero_point);
+      }
+      return llvm::Error::success();
+    }
+    default:
       return llvm::createStringError(
           llvm::errc::invalid_argument,
-          "Unexpected row data size. Expected %d, found %d", expected_size,
-          row_data.size());
-    }
-    std::copy(row_data.begin(), row_data.end(),
-              tensor_data + expected_size * row);
+          "Unsupported type of the output tensor: %s",
+          TfLiteTypeGetName(tensor.type));
   }
-  return llvm::Error::success();
+}
+
+// Returns true when the current shape of `tensor` is `dims`.
+bool TensorHasShape(const TfLiteTensor& tensor,
+                    std::initializer_list<int> dims) {
+  if (tensor.dims == nullptr ||
+      tensor.dims->size != static_cast<int>(dims.size())) {
+    return false;
+  }
+  return std::equal(dims.begin(), dims.end(), tensor.dims->data);
 }
 
 // Resizes a 1D tensor at the given index in `interpreter` to a given size.
 // Requires that the tensor is a 1D variable size tensor, i.e. its
-// dims_signature is [-1].
+// dims_signature is [-1]. Does not touch the tensor when it already has the
+// desired size; otherwise, sets `tensors_resized` to true.
 llvm::Error Resize1DTensor(tflite::Interpreter* interpreter, int tensor_index,
-                           int desired_size) {
+                           int desired_size, bool& tensors_resized) {
   assert(interpreter != nullptr);
   const TfLiteTensor* const tensor = interpreter->input_tensor(tensor_index);
   if (llvm::Error error = CheckTensorSignature(tensor_index, tensor, -1)) {
     return error;
   }
+  if (TensorHasShape(*tensor, {desired_size})) return llvm::Error::success();
 
+  tensors_resized = true;
   const TfLiteStatus status =
       interpreter->ResizeInputTensor(tensor_index, {desired_size});
   if (status != kTfLiteOk) {
@@ -239,15 +332,24 @@ llvm::Error Resize1DTensor(tflite::Interpreter* interpreter, int tensor_index,
 // Resizes a 2D tensor at the given index in `interpreter` to a given batch
 // size. Requires that the tensor is a 2D tensor where the first dimension has a
 // variable size, i.e. its dims_signature is [-1, expected_second_dimension].
+// Does not touch the tensor when it already has the desired shape; otherwise,
+// sets `tensors_resized` to true.
 llvm::Error Resize2DTensor(tflite::Interpreter* interpreter, int tensor_index,
                            int desired_first_dimension_size,
-                           int expected_second_dimension_size) {
+                           int expected_second_dimension_size,
+                           bool& tensors_resized) {
   assert(interpreter != nullptr);
   const TfLiteTensor* const tensor = interpreter->input_tensor(tensor_index);
   if (llvm::Error error = CheckTensorSignature(
           tensor_index, tensor, -1, expected_second_dimension_size)) {
     return error;
   }
+  if (TensorHasShape(*tensor, {desired_first_dimension_size,
+                               expected_second_dimension_size})) {
+    return llvm::Error::success();
+  }
+
+  tensors_resized = true;
   const TfLiteStatus status = interpreter->ResizeInputTensor(
       tensor_index,
       {desired_first_dimension_size, expected_second_dimension_size});
@@ -276,13 +378,29 @@ llvm::Expected<int> TensorIndexByName(const tflite::Interpreter& interpreter,
       llvm::Twine("Tensor was not found") + name, llvm::errc::invalid_argument);
 }
 
-// Creates a new interpreter for `tflite_model`. Returns an error when the
+// Returns a null delegate pointer. TfLiteDelegatePtr uses a function pointer as
+// the deleter, and it can't be default-constructed.
+tflite::Interpreter::TfLiteDelegatePtr NoDelegate() {
+  return tflite::Interpreter::TfLiteDelegatePtr(nullptr,
+                                                [](TfLiteDelegate*) {});
+}
+
+// Creates a new interpreter for `tflite_model` using `options`. When
+// `options.delegate_factory` is set, creates a delegate and applies it to the
+// interpreter; the delegate is stored in `delegate`. When the delegate can't be
+// applied to the model, the interpreter is left in the state before applying
+// the delegate, and `delegate` is reset to nullptr. Returns an error when the
 // interpreter can't be created, e.g. when the model uses unsupported TensorFlow
-// ops.
+// ops, or when applying the delegate left the interpreter in an unusable state.
 llvm::Expected<std::unique_ptr<tflite::Interpreter>> CreateInterpreter(
-    const FlatBufferModel& tflite_model) {
-  tflite::ops::builtin::BuiltinOpResolver resolver;
+    const FlatBufferModel& tflite_model,
+    const GraphBuilderModelInferenceOptions& options,
+    tflite::Interpreter::TfLiteDelegatePtr& delegate) {
+  // The delegates are applied explicitly below; we do not want TensorFlow Lite
+  // to apply its default delegates on top of them.
+  tflite::ops::builtin::BuiltinOpResolverWithoutDefaultDelegates resolver;
   resolver.AddCustom(kUnsortedSegmentSumOpName, RegisterUnsortedSegmentSumOp());
+  resolver.AddCustom(kGatherSegmentSumOpName, RegisterGatherSegmentSumOp());
   std::unique_ptr<tflite::Interpreter> interpreter;
   const TfLiteStatus status =
       tflite::InterpreterBuilder(tflite_model, resolver)(&interpreter);
@@ -291,16 +409,103 @@ llvm::Expected<std::unique_ptr<tflite::Interpreter>> CreateInterpreter(
         "Could not create the interpreter.", llvm::errc::not_supported);
   }
   assert(interpreter != nullptr);
+  if (interpreter->SetNumThreads(options.num_threads) != kTfLiteOk) {
+    return llvm::createStringError(llvm::errc::invalid_argument,
+                                   "Invalid number of threads: %d",
+                                   options.num_threads);
+  }
+
+  delegate = NoDelegate();
+  if (options.delegate_factory) {
+    delegate = options.delegate_factory();
+  }
+  if (delegate != nullptr) {
+    switch (interpreter->ModifyGraphWithDelegate(delegate.get())) {
+      case kTfLiteOk:
+        break;
+      case kTfLiteDelegateError:
+      case kTfLiteApplicationError:
+        // The delegate could not be applied, but TensorFlow Lite restored the
+        // interpreter to its previous state. Fall back to the built-in
+        // kernels.
+        delegate.reset();
+        break;
+      default:
+        return llvm::make_error<llvm::StringError>(
+            "Could not apply the delegate to the interpreter.",
+            llvm::errc::not_supported);
+    }
+  }
   return interpreter;
 }
 
-// Extracts the list of node tokens from the model. The token list should be a
-// Const tensor, and as such, it should be readable without providing any
-// inputs.
+// Returns the data of the output tensor `name` of the main subgraph of
+// `tflite_model` when the tensor is backed by a constant buffer stored directly
+// in the flatbuffer. Returns std::nullopt when the tensor is not an output of
+// the model, when the tensor does not have `type`, or when its value is not
+// stored in the flatbuffer; the caller can then read the tensor through an
+// interpreter. The returned view points to the memory of `tflite_model`. This
+// avoids creating an interpreter or copying the data just to read the
+// constants, and with a model loaded by FlatBufferModel::BuildFromFile(), which
+// maps the file into memory, only the pages of the buffer are read from disk.
+std::optional<std::string_view> GetConstantOutputTensorData(
+    const FlatBufferModel& tflite_model, std::string_view name,
+    tflite::TensorType type) {
+  const tflite::Model* const model = tflite_model.GetModel();
+  if (model == nullptr || model->subgraphs() == nullptr ||
+      model->subgraphs()->size() == 0 || model->buffers() == nullptr) {
+    return std::nullopt;
+  }
+  const tflite::SubGraph* const subgraph = model->subgraphs()->Get(0);
+  if (subgraph->outputs() == nullptr || subgraph->tensors() == nullptr) {
+    return std::nullopt;
+  }
+  for (const int32_t tensor_index : *subgraph->outputs()) {
+    if (tensor_index < 0 || tensor_index >= subgraph->tensors()->size()) {
+      continue;
+    }
+    const tflite::Tensor* const tensor = subgraph->tensors()->Get(tensor_index);
+    if (tensor->name() == nullptr ||
+        std::string_view(tensor->name()->c_str(), tensor->name()->size()) !=
+            name) {
+      continue;
+    }
+    if (tensor->type() != type ||
+        tensor->buffer() >= model->buffers()->size()) {
+      return std::nullopt;
+    }
+    // Buffer 0 is the empty sentinel buffer used by non-constant tensors.
+    // Models larger than 2 GiB store the buffers outside of the flatbuffer;
+    // these are read through the interpreter.
+    const tflite::Buffer* const buffer =
+        model->buffers()->Get(tensor->buffer());
+    if (buffer == nullptr || buffer->data() == nullptr ||
+        buffer->data()->size() == 0) {
+      return std::nullopt;
+    }
+    return std::string_view(
+        reinterpret_cast<const char*>(buffer->data()->data()),
+        buffer->data()->size());
+  }
+  return std::nullopt;
+}
+
+// Returns the raw data of the node token list tensor of the model. The tokens
+// in the data are separated by NUL characters. Reads the data directly from
+// the flatbuffer when possible; otherwise, reads it through `interpreter`.
+// The token list should be a Const tensor, and as such, it should be readable
+// without providing any inputs.
 // Returns an error when the token list tensor is not found or when it is not
 // readable.
-llvm::Expected<std::vector<std::string>> GetNodeTokenList(
+llvm::Expected<std::string_view> GetNodeTokenListData(
+    const FlatBufferModel& tflite_model,
     const tflite::Interpreter& interpreter) {
+  if (const std::optional<std::string_view> token_list_data =
+          GetConstantOutputTensorData(tflite_model, kNodeTokensTensorName,
+                                      tflite::TensorType_UINT8);
+      token_list_data.has_value()) {
+    return *token_list_data;
+  }
   llvm::Expected<int> token_list_tensor_index = TensorIndexByName(
       interpreter, interpreter.outputs(), kNodeTokensTensorName);
   if (auto error = token_list_tensor_index.takeError()) return error;
@@ -317,15 +522,83 @@ llvm::Expected<std::vector<std::string>> GetNodeTokenList(
     return llvm::createStringError(llvm::errc::invalid_argument,
                                    "The token list could not be read");
   }
-  const std::string_view token_list_data(token_list_raw_data,
-                                         token_list_size_bytes);
-  return StrSplitAsCopy(token_list_data, '\0');
+  return std::string_view(token_list_raw_data, token_list_size_bytes);
+}
+
+// Reads the indices of the special node tokens from the model. Reads the data
+// directly from the flatbuffer when possible; otherwise, reads it through
+// `interpreter`. Returns an error when the tensor is not found or when it does
+// not have the expected type and shape.
+llvm::Expected<std::array<int32_t, kNumSpecialNodeTokens>> GetSpecialTokens(
+    const FlatBufferModel& tflite_model,
+    const tflite::Interpreter& interpreter) {
+  std::array<int32_t, kNumSpecialNodeTokens> special_tokens;
+  constexpr size_t kSpecialTokensSizeBytes = sizeof(special_tokens);
+  if (const std::optional<std::string_view> special_tokens_data =
+          GetConstantOutputTensorData(tflite_model, kSpecialTokensTensorName,
+                                      tflite::TensorType_INT32);
+      special_tokens_data.has_value() &&
+      special_tokens_data->size() == kSpecialTokensSizeBytes) {
+    // The buffers in the flatbuffer are not guaranteed to be aligned.
+    std::memcpy(special_tokens.data(), special_tokens_data->data(),
+                kSpecialTokensSizeBytes);
+    return special_tokens;
+  }
+
+  llvm::Expected<int> special_tokens_tensor_index = TensorIndexByName(
+      interpreter, interpreter.outputs(), kSpecialTokensTensorName);
+  if (llvm::Error error = special_tokens_tensor_index.takeError()) {
+    return error;
+  }
+  const TfLiteTensor* const special_tokens_tensor =
+      interpreter.tensor(*special_tokens_tensor_index);
+  if (llvm::Error error = CheckTensorTypeAndDimensions(
+          *special_tokens_tensor_index, special_tokens_tensor,
+          tflite::typeToTfLiteType<int32_t>(), kNumSpecialNodeTokens)) {
+    return error;
+  }
+  const int32_t* const special_tokens_tensor_data =
+      interpreter.typed_tensor<int32_t>(*special_tokens_tensor_index);
+  if (special_tokens_tensor_data == nullptr) {
+    return llvm::createStringError(
+        llvm::errc::invalid_argument,
+        "The special token index tensor could not be read");
+  }
+  std::copy_n(special_tokens_tensor_data, kNumSpecialNodeTokens,
+              special_tokens.begin());
+  return special_tokens;
 }
 
-// Returns token name from `node_token_list` at `token_index`. Returns an error
+// Returns the vocabulary for the node token list data `token_list_data`.
+// Vocabularies are shared by all inference objects for models with the same
+// token list, so that loading the same model again, e.g. in another pool of
+// inference objects, does not split, hash, and intern all the tokens again.
+// The vocabularies are held only by the graph builders that use them; the
+// cache keeps just weak references.
+std::shared_ptr<const TokenVocabulary> GetOrCreateVocabulary(
+    std::string_view token_list_data) {
+  static std::mutex mutex;
+  static auto* const vocabularies = new std::unordered_map<
+      std::string, std::weak_ptr<const TokenVocabulary>>();
+  std::lock_guard<std::mutex> lock(mutex);
+  std::weak_ptr<const TokenVocabulary>& cached_vocabulary =
+      (*vocabularies)[std::string(token_list_data)];
+  std::shared_ptr<const TokenVocabulary> vocabulary =
+      cached_vocabulary.lock();
+  if (vocabulary == nullptr) {
+    GEMATRIA_TRACE_SCOPE("GraphBuilderModelInference::CreateVocabulary");
+    vocabulary = std::make_shared<const TokenVocabulary>(
+        StrSplitAsCopy(token_list_data, '\0'));
+    cached_vocabulary = vocabulary;
+  }
+  return vocabulary;
+}
+
+// Returns token name from `vocabulary` at `token_index`. Returns an error
 // when the token index is out of range.
 llvm::Expected<std::string> GetNodeTokenAtIndex(
-    const std::vector<std::string>& node_token_list, int token_index) {
+    const TokenVocabulary& vocabulary, int token_index) {
+  const std::vector<std::string>& node_token_list = vocabulary.tokens();
   if (token_index < 0 || token_index >= node_token_list.size()) {
     return llvm::createStringError(llvm::errc::invalid_argument,
                                    "The token index is out of range: %d"
@@ -337,59 +610,64 @@ llvm::Expected<std::string> GetNodeTokenAtIndex(
 
 }  // namespace
 
+GraphBuilderModelInferenceOptions::DelegateFactory
+GraphBuilderModelInferenceOptions::XnnpackDelegateFactory(int num_threads) {
+  return [num_threads]() {
+    TfLiteXNNPackDelegateOptions xnnpack_options =
+        TfLiteXNNPackDelegateOptionsDefault();
+    xnnpack_options.num_threads = std::max(num_threads, 0);
+    return tflite::Interpreter::TfLiteDelegatePtr(
+        TfLiteXNNPackDelegateCreate(&xnnpack_options),
+        TfLiteXNNPackDelegateDelete);
+  };
+}
+
 llvm::Expected<std::unique_ptr<GraphBuilderModelInference>>
 GraphBuilderModelInference::FromTfLiteModel(
-    const tflite::FlatBufferModel* tflite_model) {
+    const tflite::FlatBufferModel* tflite_model,
+    const GraphBuilderModelInferenceOptions& options) {
   if (tflite_model == nullptr) {
     return llvm::make_error<llvm::StringError>(
         "tflite_model must not be nullptr", llvm::errc::invalid_argument);
   }
+  tflite::Interpreter::TfLiteDelegatePtr delegate = NoDelegate();
   llvm::Expected<std::unique_ptr<tflite::Interpreter>> interpreter =
-      CreateInterpreter(*tflite_model);
+      CreateInterpreter(*tflite_model, options, delegate);
   if (auto error = interpreter.takeError()) return error;
 
-  // Get the list of node tokens used in the model.
-  llvm::Expected<std::vector<std::string>> node_token_list =
-      GetNodeTokenList(**interpreter);
-  if (llvm::Error error = node_token_list.takeError()) return error;
-
-  // Get the values of the special tensors used in the model.
-  llvm::Expected<int> special_tokens_tensor_index = TensorIndexByName(
-      **interpreter, (*interpreter)->outputs(), kSpecialTokensTensorName);
-  if (llvm::Error error = special_tokens_tensor_index.takeError()) {
-    return error;
-  }
-  const TfLiteTensor* const special_tokens_tensor =
-      (*interpreter)->tensor(*special_tokens_tensor_index);
-  if (llvm::Error error = CheckTensorTypeAndDimensions(
-          *special_tokens_tensor_index, special_tokens_tensor,
-          tflite::typeToTfLiteType<int32_t>(), kNumSpecialNodeTokens)) {
-    return error;
-  }
-  const int32_t* const special_tokens_tensor_data =
-      (*interpreter)->typed_tensor<int32_t>(*special_tokens_tensor_index);
-  if (special_tokens_tensor_data == nullptr) {
+  if ((*interpreter)->inputs().size() != kNumInputTensors) {
     return llvm::createStringError(
         llvm::errc::invalid_argument,
-        "The special token index tensor could not be read");
+        "Unexpected number of input tensors. Expected %d, found %d.",
+        kNumInputTensors, (*interpreter)->inputs().size());
   }
-  // We'll be std::move()-ing the node list vector in the same function call
-  // where we use the token names. To be safe from any move effects, we make a
-  // copy of all the tokens instead of taking a const reference.
+
+  // Get the list of node tokens used in the model.
+  llvm::Expected<std::string_view> token_list_data =
+      GetNodeTokenListData(*tflite_model, **interpreter);
+  if (llvm::Error error = token_list_data.takeError()) return error;
+  const std::shared_ptr<const TokenVocabulary> vocabulary =
+      GetOrCreateVocabulary(*token_list_data);
+
+  // Get the values of the special tensors used in the model.
+  llvm::Expected<std::array<int32_t, kNumSpecialNodeTokens>> special_tokens =
+      GetSpecialTokens(*tflite_model, **interpreter);
+  if (llvm::Error error = special_tokens.takeError()) return error;
+  const int32_t* const special_tokens_tensor_data = special_tokens->data();
+
   llvm::Expected<std::string> immediate_token = GetNodeTokenAtIndex(
-      *node_token_list, special_tokens_tensor_data[kSpecialNodeTokenImmediate]);
+      *vocabulary, special_tokens_tensor_data[kSpecialNodeTokenImmediate]);
   if (llvm::Error error = immediate_token.takeError()) return error;
 
   llvm::Expected<std::string> fp_immediate_token = GetNodeTokenAtIndex(
-      *node_token_list,
-      special_tokens_tensor_data[kSpecialNodeTokenFpImmediate]);
+      *vocabulary, special_tokens_tensor_data[kSpecialNodeTokenFpImmediate]);
   if (llvm::Error error = fp_immediate_token.takeError()) return error;
   llvm::Expected<std::string> address_token = GetNodeTokenAtIndex(
-      *node_token_list, special_tokens_tensor_data[kSpecialNodeTokenAddress]);
+      *vocabulary, special_tokens_tensor_data[kSpecialNodeTokenAddress]);
   if (llvm::Error error = address_token.takeError()) return error;
 
   llvm::Expected<std::string> memory_token = GetNodeTokenAtIndex(
-      *node_token_list, special_tokens_tensor_data[kSpecialNodeTokenMemory]);
+      *vocabulary, special_tokens_tensor_data[kSpecialNodeTokenMemory]);
   if (llvm::Error error = memory_token.takeError()) return error;
   const int32_t replacement_token_index =
       special_tokens_tensor_data[kSpecialNodeTokenReplacement];
@@ -402,34 +680,163 @@ GraphBuilderModelInference::FromTfLiteModel(
       OutOfVocabularyTokenBehavior::ReturnError();
   if (replacement_token_index >= 0) {
     llvm::Expected<std::string> replacement_token =
-        GetNodeTokenAtIndex(*node_token_list, replacement_token_index);
+        GetNodeTokenAtIndex(*vocabulary, replacement_token_index);
     if (llvm::Error error = replacement_token.takeError()) return error;
     out_of_vocabulary_behavior = OutOfVocabularyTokenBehavior::ReplaceWithToken(
         *std::move(replacement_token));
   }
 
   auto graph_builder = std::make_unique<BasicBlockGraphBuilder>(
-      *std::move(node_token_list), /* immediate_token = */ *immediate_token,
+      vocabulary, /* immediate_token = */ *immediate_token,
       /* fp_immediate_token = */ *fp_immediate_token,
       /* address_token = */ *address_token, /* memory_token = */ *memory_token,
       /* out_of_vocabulary_behavior = */ out_of_vocabulary_behavior);
+  graph_builder->SetInstructionFragmentCacheSize(
+      options.instruction_fragment_cache_size);
 
   // We can't use std::make_unique<GraphBuilderModelInference>(), because
   // std::make_unique<>() requires a public constructor.
   return std::unique_ptr<GraphBuilderModelInference>(
-      new GraphBuilderModelInference(std::move(graph_builder), tflite_model));
+      new GraphBuilderModelInference(
+          std::move(graph_builder), std::move(delegate),
+          std::move(*interpreter), tflite_model, options));
 }
 
 GraphBuilderModelInference::GraphBuilderModelInference(
     std::unique_ptr<BasicBlockGraphBuilder> graph_builder,
-    const FlatBufferModel* tflite_model)
-    : graph_builder_(std::move(graph_builder)), tflite_model_(*tflite_model) {
+    tflite::Interpreter::TfLiteDelegatePtr delegate,
+    std::unique_ptr<tflite::Interpreter> interpreter,
+    const FlatBufferModel* tflite_model,
+    GraphBuilderModelInferenceOptions options)
+    : graph_builder_(std::move(graph_builder)),
+      delegate_(std::move(delegate)),
+      interpreter_(std::move(interpreter)),
+      tflite_model_(*tflite_model),
+      options_(std::move(options)),
+      vocabulary_hash_(graph_builder_->VocabularyHash()) {
   assert(tflite_model != nullptr);
   assert(graph_builder_ != nullptr);
+  assert(interpreter_ != nullptr);
+}
+
+GraphBuilderModelInference::~GraphBuilderModelInference() = default;
+
+llvm::Expected<std::unique_ptr<GraphBuilderModelInference>>
+GraphBuilderModelInference::Clone() const {
+  tflite::Interpreter::TfLiteDelegatePtr delegate = NoDelegate();
+  llvm::Expected<std::unique_ptr<tflite::Interpreter>> interpreter =
+      CreateInterpreter(tflite_model_, options_, delegate);
+  if (llvm::Error error = interpreter.takeError()) return error;
+
+  // The copy of the graph builder shares the vocabulary and the special tokens
+  // with the original, and it starts with an empty instruction fragment cache;
+  // we just need to drop the basic blocks in the batch.
+  auto graph_builder =
+      std::make_unique<BasicBlockGraphBuilder>(*graph_builder_);
+  graph_builder->Reset();
+
+  return std::unique_ptr<GraphBuilderModelInference>(
+      new GraphBuilderModelInference(
+          std::move(graph_builder), std::move(delegate),
+          std::move(*interpreter), &tflite_model_, options_));
+}
+
+bool GraphBuilderModelInference::GraphHasFragmentHashes(
+    int graph_index, llvm::ArrayRef<uint64_t> fragment_hashes) const {
+  const auto [begin, size] = graph_fragment_hash_ranges_[graph_index];
+  return llvm::ArrayRef<uint64_t>(graph_fragment_hashes_)
+             .slice(begin, size)
+             .equals(fragment_hashes);
 }
 
 bool GraphBuilderModelInference::AddBasicBlockToBatch(const BasicBlock& block) {
-  return graph_builder_->AddBasicBlock(block);
+  GEMATRIA_TRACE_SCOPE("GraphBuilderModelInference::AddBasicBlockToBatch");
+  const std::optional<uint64_t> graph_hash =
+      graph_builder_->ComputeGraphHash(block, /*prefix_graph_hashes=*/nullptr,
+                                       &fragment_hashes_);
+  // When the block can't be added, let the graph builder reject it, so that
+  // its out-of-vocabulary tokens are counted.
+  if (!graph_hash.has_value()) return graph_builder_->AddBasicBlock(block);
+  if (const auto it = graph_index_by_graph_hash_.find(*graph_hash);
+      it != graph_index_by_graph_hash_.end() &&
+      GraphHasFragmentHashes(it->second, fragment_hashes_)) {
+    GEMATRIA_TRACE_COUNTER(kCacheHits, 1);
+    // The block is not added to the graph builder, so its out-of-vocabulary
+    // tokens must be counted explicitly.
+    graph_builder_->CountOutOfVocabularyTokens(block);
+    graph_index_by_batch_index_.push_back(it->second);
+    return true;
+  }
+  if (!graph_builder_->AddBasicBlock(block)) return false;
+  assert(graph_builder_->graph_hashes().back() == *graph_hash);
+  const int graph_index = graph_builder_->num_graphs() - 1;
+  graph_fragment_hash_ranges_.emplace_back(graph_fragment_hashes_.size(),
+                                           fragment_hashes_.size());
+  graph_fragment_hashes_.insert(graph_fragment_hashes_.end(),
+                                fragment_hashes_.begin(),
+                                fragment_hashes_.end());
+  // On a collision, the graph already in the map is kept.
+  graph_index_by_graph_hash_.try_emplace(*graph_hash, graph_index);
+  graph_index_by_batch_index_.push_back(graph_index);
+  return true;
+}
+
+bool GraphBuilderModelInference::AddBasicBlockPrefixesToBatch(
+    const BasicBlock& block) {
+  GEMATRIA_TRACE_SCOPE(
+      "GraphBuilderModelInference::AddBasicBlockPrefixesToBatch");
+  std::vector<uint64_t> prefix_hashes;
+  if (!graph_builder_
+           ->ComputeGraphHash(block, &prefix_hashes, &fragment_hashes_)
+           .has_value()) {
+    // Let the graph builder reject the block; see AddBasicBlockToBatch().
+    return graph_builder_->AddBasicBlockPrefixes(block);
+  }
+  // When all prefixes are already in the batch, e.g. because the same block
+  // was added before, reuse their graphs. The graphs of the prefixes are built
+  // together in a single pass, so when at least one of them is missing, all of
+  // them are added again.
+  std::vector<int> prefix_graph_indices;
+  prefix_graph_indices.reserve(prefix_hashes.size());
+  for (int i = 0; i < prefix_hashes.size(); ++i) {
+    const auto it = graph_index_by_graph_hash_.find(prefix_hashes[i]);
+    if (it == graph_index_by_graph_hash_.end() ||
+        !GraphHasFragmentHashes(
+            it->second,
+            llvm::ArrayRef<uint64_t>(fragment_hashes_).take_front(i + 1))) {
+      break;
+    }
+    prefix_graph_indices.push_back(it->second);
+  }
+  if (!prefix_hashes.empty() &&
+      prefix_graph_indices.size() == prefix_hashes.size()) {
+    GEMATRIA_TRACE_COUNTER(kCacheHits, 1);
+    graph_builder_->CountOutOfVocabularyTokens(block);
+    graph_index_by_batch_index_.insert(graph_index_by_batch_index_.end(),
+                                       prefix_graph_indices.begin(),
+                                       prefix_graph_indices.end());
+    return true;
+  }
+
+  const int first_graph_index = graph_builder_->num_graphs();
+  if (!graph_builder_->AddBasicBlockPrefixes(block)) return false;
+  assert(graph_builder_->num_graphs() - first_graph_index ==
+         prefix_hashes.size());
+  const size_t fragment_hashes_begin = graph_fragment_hashes_.size();
+  graph_fragment_hashes_.insert(graph_fragment_hashes_.end(),
+                                fragment_hashes_.begin(),
+                                fragment_hashes_.end());
+  for (int i = 0; i < prefix_hashes.size(); ++i) {
+    const int graph_index = first_graph_index + i;
+    graph_index_by_batch_index_.push_back(graph_index);
+    graph_fragment_hash_ranges_.emplace_back(fragment_hashes_begin, i + 1);
+    // Each prefix graph is the graph of a basic block that consists of the
+    // first i + 1 instructions of `block`, and it can be reused by
+    // AddBasicBlockToBatch() for blocks with the same graph. Graphs that were
+    // already in the batch are kept.
+    graph_index_by_graph_hash_.try_emplace(prefix_hashes[i], graph_index);
+  }
+  return true;
 }
 
 #define GEMATRIA_RETURN_IF_ERROR(statement)            \
@@ -439,103 +846,150 @@ bool GraphBuilderModelInference::AddBasicBlockToBatch(const BasicBlock& block) {
 
 llvm::Expected<std::vector<GraphBuilderModelInference::OutputType>>
 GraphBuilderModelInference::RunInference() {
-  if (graph_builder_->num_graphs() == 0) {
-    return std::vector<GraphBuilderModelInference::OutputType>();
+  llvm::Expected<PredictionsView> predictions = RunInferenceView();
+  if (llvm::Error error = predictions.takeError()) return error;
+
+  std::vector<OutputType> output;
+  output.reserve(predictions->num_blocks());
+  for (int i = 0; i < predictions->num_blocks(); ++i) {
+    const llvm::ArrayRef<float> block_predictions = (*predictions)[i];
+    output.emplace_back(block_predictions.begin(), block_predictions.end());
   }
+  return output;
+}
 
-  // TODO(ondrasej): Reuse the interpreter across RunInference() calls. The
-  // graph builder class is already stateful, so this should not be an issue
-  // and it could save us some loading time.
-  llvm::Expected<std::unique_ptr<tflite::Interpreter>> interpreter =
-      CreateInterpreter(tflite_model_);
-  if (llvm::Error error = interpreter.takeError()) return error;
+llvm::Expected<GraphBuilderModelInference::PredictionsView>
+GraphBuilderModelInference::RunInferenceView() {
+  return RunInferenceOnGraphs(*graph_builder_, graph_index_by_batch_index_);
+}
 
-  // TODO(ondrasej): Move all the checks of the model format to the
-  // initialization of the class.
-  if ((*interpreter)->inputs().size() != kNumInputTensors) {
+llvm::Expected<GraphBuilderModelInference::PredictionsView>
+GraphBuilderModelInference::RunInferenceViewOnBatchOf(
+    const GraphBuilderModelInference& batch_source) {
+  if (&batch_source != this &&
+      batch_source.vocabulary_hash_ != vocabulary_hash_) {
     return llvm::createStringError(
         llvm::errc::invalid_argument,
-        "Unexpected number of input tensors. Expected %d, found %d.",
-        kNumInputTensors, (*interpreter)->inputs().size());
+        "The models do not use the same node tokens and special tokens");
   }
+  return RunInferenceOnGraphs(*batch_source.graph_builder_,
+                              batch_source.graph_index_by_batch_index_);
+}
 
-  const std::vector<bool> instruction_node_mask =
-      graph_builder_->InstructionNodeMask();
-  const std::vector<int> delta_block_index = graph_builder_->DeltaBlockIndex();
+llvm::Expected<GraphBuilderModelInference::PredictionsView>
+GraphBuilderModelInference::RunInferenceOnGraphs(
+    const BasicBlockGraphBuilder& graph_builder,
+    llvm::ArrayRef<int> graph_index_by_batch_index) {
+  GEMATRIA_TRACE_SCOPE("GraphBuilderModelInference::RunInference");
+  if (graph_builder.num_graphs() == 0) return PredictionsView();
 
-  // Resize the input tensors according to the size of the input data.
-  // TODO(ondrasej): Replace the index-based lookups with name-based lookups.
+  tflite::Interpreter* const interpreter = interpreter_.get();
+  const auto fill_start_time = std::chrono::steady_clock::now();
 
-  GEMATRIA_RETURN_IF_ERROR(
-      Resize1DTensor(interpreter->get(), kDeltaBlockIndexTensor,
-                     static_cast<int>(delta_block_index.size())));
-  GEMATRIA_RETURN_IF_ERROR(Resize1DTensor(interpreter->get(), kGraphNodesTensor,
-                                          graph_builder_->num_nodes()));
-  GEMATRIA_RETURN_IF_ERROR(Resize1DTensor(interpreter->get(), kGraphEdgesTensor,
-                                          graph_builder_->num_edges()));
+  // Resize the input tensors according to the size of the input data. The
+  // interpreter is reused across batches; the tensors are resized only when the
+  // shape of the batch changes, and the tensor arena is reallocated only when
+  // at least one of the tensors was resized.
+  // TODO(ondrasej): Replace the index-based lookups with name-based lookups.
+  bool tensors_resized = false;
+  GEMATRIA_RETURN_IF_ERROR(Resize1DTensor(
+      interpreter, kDeltaBlockIndexTensor, graph_builder.num_instructions(),
+      tensors_resized));
+  GEMATRIA_RETURN_IF_ERROR(Resize1DTensor(interpreter, kGraphNodesTensor,
+                                          graph_builder.num_nodes(),
+                                          tensors_resized));
+  GEMATRIA_RETURN_IF_ERROR(Resize1DTensor(interpreter, kGraphEdgesTensor,
+                                          graph_builder.num_edges(),
+                                          tensors_resized));
   GEMATRIA_RETURN_IF_ERROR(Resize1DTensor(
-      interpreter->get(), kGraphReceiversTensor,
-      static_cast<int>(graph_builder_->edge_receivers().size())));
-  GEMATRIA_RETURN_IF_ERROR(
-      Resize1DTensor(interpreter->get(), kGraphSendersTensor,
-                     static_cast<int>(graph_builder_->edge_senders().size())));
+      interpreter, kGraphReceiversTensor,
+      static_cast<int>(graph_builder.edge_receivers().size()),
+      tensors_resized));
   GEMATRIA_RETURN_IF_ERROR(Resize1DTensor(
-      interpreter->get(), kGraphNEdgeTensor,
-      static_cast<int>(graph_builder_->num_nodes_per_block().size())));
+      interpreter, kGraphSendersTensor,
+      static_cast<int>(graph_builder.edge_senders().size()),
+      tensors_resized));
   GEMATRIA_RETURN_IF_ERROR(Resize1DTensor(
-      interpreter->get(), kGraphNNodeTensor,
-      static_cast<int>(graph_builder_->num_edges_per_block().size())));
-  GEMATRIA_RETURN_IF_ERROR(
-      Resize1DTensor(interpreter->get(), kInstructionNodeMaskTensor,
-                     static_cast<int>(instruction_node_mask.size())));
+      interpreter, kGraphNEdgeTensor,
+      static_cast<int>(graph_builder.num_nodes_per_block().size()),
+      tensors_resized));
+  GEMATRIA_RETURN_IF_ERROR(Resize1DTensor(
+      interpreter, kGraphNNodeTensor,
+      static_cast<int>(graph_builder.num_edges_per_block().size()),
+      tensors_resized));
+  GEMATRIA_RETURN_IF_ERROR(Resize1DTensor(interpreter,
+                                          kInstructionNodeMaskTensor,
+                                          graph_builder.num_nodes(),
+                                          tensors_resized));
   GEMATRIA_RETURN_IF_ERROR(Resize2DTensor(
-      interpreter->get(), kGraphGlobalsTensor,
-      /* desired_first_dimension_size = */ graph_builder_->num_graphs(),
+      interpreter, kGraphGlobalsTensor,
+      /* desired_first_dimension_size = */ graph_builder.num_graphs(),
       /* expected_second_dimension_size = */
-      graph_builder_->num_node_tokens()));
+      graph_builder.num_node_tokens(), tensors_resized));
 
-  if (const TfLiteStatus status = (*interpreter)->AllocateTensors();
-      status != kTfLiteOk) {
-    return llvm::make_error<llvm::StringError>(
-        "Could not allocate memory for tensors", llvm::errc::not_enough_memory);
+  if (tensors_resized || !tensors_allocated_) {
+    GEMATRIA_TRACE_SCOPE("GraphBuilderModelInference::AllocateTensors");
+    GEMATRIA_TRACE_COUNTER(kInterpreterResizes, 1);
+    if (const TfLiteStatus status = interpreter->AllocateTensors();
+        status != kTfLiteOk) {
+      tensors_allocated_ = false;
+      return llvm::make_error<llvm::StringError>(
+          "Could not allocate memory for tensors",
+          llvm::errc::not_enough_memory);
+    }
+    tensors_allocated_ = true;
   }
 
-  // Fill in the input tensors.
-  if (llvm::Error error = FillTensorFromStdVector<int32_t>(
-          interpreter->get(), delta_block_index, kDeltaBlockIndexTensor)) {
-    return error;
-  }
-  GEMATRIA_RETURN_IF_ERROR(FillTensorFromStdVector<int32_t>(
-      interpreter->get(), graph_builder_->node_features(), kGraphNodesTensor));
+  // Fill in the input tensors. The tensors that are derived from the graph
+  // (edge features, instruction node mask and delta block index) are written by
+  // the graph builder directly to the tensor buffers, without creating
+  // temporary vectors.
+  static_assert(std::is_same_v<int32_t, BasicBlockGraphBuilder::NodeIndex>);
+  static_assert(std::is_same_v<int32_t, BasicBlockGraphBuilder::TokenIndex>);
+  llvm::Expected<int32_t*> delta_block_index =
+      GetTensorDataForWriting<int32_t>(interpreter, kDeltaBlockIndexTensor,
+                                       graph_builder.num_instructions());
+  if (llvm::Error error = delta_block_index.takeError()) return error;
+  graph_builder.FillDeltaBlockIndex(*delta_block_index);
+  llvm::Expected<int32_t*> edge_features = GetTensorDataForWriting<int32_t>(
+      interpreter, kGraphEdgesTensor, graph_builder.num_edges());
+  if (llvm::Error error = edge_features.takeError()) return error;
+  graph_builder.FillEdgeFeatures(*edge_features);
+  llvm::Expected<bool*> instruction_node_mask = GetTensorDataForWriting<bool>(
+      interpreter, kInstructionNodeMaskTensor, graph_builder.num_nodes());
+  if (llvm::Error error = instruction_node_mask.takeError()) return error;
+  graph_builder.FillInstructionNodeMask(*instruction_node_mask);
+
   GEMATRIA_RETURN_IF_ERROR(FillTensorFromStdVector<int32_t>(
-      interpreter->get(), graph_builder_->EdgeFeatures(), kGraphEdgesTensor));
+      interpreter, graph_builder.node_features(), kGraphNodesTensor));
   GEMATRIA_RETURN_IF_ERROR(FillTensorFromStdVector<int32_t>(
-      interpreter->get(), graph_builder_->edge_receivers(),
-      kGraphReceiversTensor));
+      interpreter, graph_builder.edge_receivers(), kGraphReceiversTensor));
   GEMATRIA_RETURN_IF_ERROR(FillTensorFromStdVector<int32_t>(
-      interpreter->get(), graph_builder_->edge_senders(), kGraphSendersTensor));
+      interpreter, graph_builder.edge_senders(), kGraphSendersTensor));
   GEMATRIA_RETURN_IF_ERROR(FillTensorFromStdVector<int32_t>(
-      interpreter->get(), graph_builder_->num_nodes_per_block(),
-      kGraphNNodeTensor));
+      interpreter, graph_builder.num_nodes_per_block(), kGraphNNodeTensor));
   GEMATRIA_RETURN_IF_ERROR(FillTensorFromStdVector<int32_t>(
-      interpreter->get(), graph_builder_->num_edges_per_block(),
-      kGraphNEdgeTensor));
-  GEMATRIA_RETURN_IF_ERROR(FillTensorFromStdVector<bool>(
-      interpreter->get(), instruction_node_mask, kInstructionNodeMaskTensor));
-  if (auto error = FillTensorFromStdVectorMatrix<int32_t>(
-          interpreter->get(), graph_builder_->global_features(),
-          kGraphGlobalsTensor)) {
-    return error;
-  }
+      interpreter, graph_builder.num_edges_per_block(), kGraphNEdgeTensor));
+  GEMATRIA_RETURN_IF_ERROR(FillGlobalsTensorFromSparseGlobalFeatures(
+      interpreter, graph_builder, kGraphGlobalsTensor));
 
-  if (const TfLiteStatus status = (*interpreter)->Invoke();
-      status != kTfLiteOk) {
+  const auto invoke_start_time = std::chrono::steady_clock::now();
+  run_inference_times_.fill_input_tensors +=
+      invoke_start_time - fill_start_time;
+  TfLiteStatus invoke_status;
+  {
+    GEMATRIA_TRACE_SCOPE("GraphBuilderModelInference::Invoke");
+    invoke_status = interpreter->Invoke();
+  }
+  run_inference_times_.invoke +=
+      std::chrono::steady_clock::now() - invoke_start_time;
+  if (invoke_status != kTfLiteOk) {
     return llvm::make_error<llvm::StringError>(
         "Invoking the TensorFlow Lite interpreter failed",
         llvm::errc::io_error);
   }
 
-  const TfLiteTensor* const output_tensor = (*interpreter)->output_tensor(0);
+  const TfLiteTensor* const output_tensor = interpreter->output_tensor(0);
   if (output_tensor == nullptr) {
     return llvm::createStringError(llvm::errc::invalid_argument,
                                    "No output tensor at index 0.");
@@ -546,29 +1000,40 @@ GraphBuilderModelInference::RunInference() {
                                    "output tensor. Expected 2, found %d",
                                    output_tensor->dims->size);
   }
-  if (output_tensor->dims->data[0] != graph_builder_->num_graphs()) {
+  if (output_tensor->dims->data[0] != graph_builder.num_graphs()) {
     return llvm::createStringError(llvm::errc::result_out_of_range,
                                    "Unexpected number of rows in the output "
                                    "tensor. Expected %d, found %d.",
-                                   graph_builder_->num_graphs(),
+                                   graph_builder.num_graphs(),
                                    output_tensor->dims->data[0]);
   }
   const int num_tasks = output_tensor->dims->data[1];
-  auto* const output_tensor_data =
-      (*interpreter)->typed_output_tensor<float>(0);
+  // Quantized models may produce the output in a different type; we return
+  // the dequantized values.
+  const float* output_tensor_data = nullptr;
+  if (output_tensor->type == kTfLiteFloat32) {
+    output_tensor_data = interpreter->typed_output_tensor<float>(0);
+  } else {
+    GEMATRIA_RETURN_IF_ERROR(
+        DequantizeTensor(*output_tensor, dequantized_output_));
+    output_tensor_data = dequantized_output_.data();
+  }
   assert(output_tensor_data != nullptr);
 
-  std::vector<OutputType> output;
-  output.reserve(graph_builder_->num_graphs());
-  for (int i = 0; i < graph_builder_->num_graphs(); ++i) {
-    output.emplace_back(output_tensor_data + i * num_tasks,
-                        output_tensor_data + (i + 1) * num_tasks);
-  }
-  return output;
+  // The view fans out the predictions for the unique basic blocks to all basic
+  // blocks in the batch.
+  return PredictionsView(output_tensor_data, num_tasks,
+                         graph_index_by_batch_index);
 }
 
 #undef GEMATRIA_RETURN_IF_ERROR
 
-void GraphBuilderModelInference::Reset() { graph_builder_->Reset(); }
+void GraphBuilderModelInference::Reset() {
+  graph_builder_->Reset();
+  graph_index_by_graph_hash_.clear();
+  graph_fragment_hashes_.clear();
+  graph_fragment_hash_ranges_.clear();
+  graph_index_by_batch_index_.clear();
+}
 
 }  // namespace gematria
@@ -15,17 +15,57 @@
 #ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_GRAPH_BUILDER_MODEL_INFERENCE_H_
 #define THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_GRAPH_BUILDER_MODEL_INFERENCE_H_
 
+#include <cassert>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
 #include <memory>
+#include <optional>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "gematria/basic_block/basic_block.h"
 #include "gematria/granite/graph_builder.h"
+#include "llvm/ADT/ArrayRef.h"
 #include "llvm/ADT/SmallVector.h"
 #include "llvm/Support/Error.h"
+#include "tensorflow/lite/interpreter.h"
 #include "tensorflow/lite/model_builder.h"
 
 namespace gematria {
 
+// Options for the TensorFlow Lite interpreter of GraphBuilderModelInference.
+struct GraphBuilderModelInferenceOptions {
+  // Creates a TensorFlow Lite delegate.
+  using DelegateFactory =
+      std::function<tflite::Interpreter::TfLiteDelegatePtr()>;
+
+  // Returns a factory that creates XNNPACK delegates that use `num_threads`
+  // threads; when `num_threads` is not positive, XNNPACK runs on the calling
+  // thread.
+  static DelegateFactory XnnpackDelegateFactory(int num_threads);
+
+  // The number of threads used by the interpreter, including the custom ops.
+  // When -1, the number of threads is chosen by TensorFlow Lite.
+  int num_threads = -1;
+
+  // When set, each interpreter gets its own delegate created by this factory.
+  // TensorFlow Lite keeps the ops that are not supported by the delegate, e.g.
+  // the custom segment sum ops, on the CPU. When the delegate can't be applied
+  // to the model at all, the interpreter falls back to the built-in kernels;
+  // see GraphBuilderModelInference::delegate_applied().
+  DelegateFactory delegate_factory;
+
+  // The maximal number of instruction fragments cached by the graph builder;
+  // see BasicBlockGraphBuilder::SetInstructionFragmentCacheSize(). The batch
+  // deduplication computes the graph hash of each block before adding it, and
+  // the cache lets the graph builder reuse the fragments compiled for the
+  // hash. Zero disables the cache.
+  size_t instruction_fragment_cache_size = 16384;
+};
+
 // Runs inference with a trained GRANITE model. The class uses TensorFlow Lite
 // and a model stored in the .tflite format to do the inference in-process.
 //
@@ -51,33 +91,178 @@ class GraphBuilderModelInference {
   // definition of this type may change in the future.
   using OutputType = llvm::SmallVector<float, 4>;
 
+  // A read-only view of the predictions for the basic blocks in a batch. The
+  // view points to the output buffer of the interpreter (or to the dequantized
+  // output), so getting the predictions does not copy them. Duplicate basic
+  // blocks in the batch share the same row of the output buffer.
+  // The view is valid until the next call to RunInference(),
+  // RunInferenceView(), AddBasicBlockToBatch() or Reset() on the inference
+  // object that returned it.
+  class PredictionsView {
+   public:
+    PredictionsView() = default;
+
+    // Returns the number of basic blocks in the batch.
+    int num_blocks() const {
+      return static_cast<int>(graph_index_by_batch_index_.size());
+    }
+    // Returns the number of tasks of the model, i.e. the number of predictions
+    // for each basic block.
+    int num_tasks() const { return num_tasks_; }
+
+    // Returns the predictions for all tasks for the basic block at position
+    // `block_index` in the batch.
+    llvm::ArrayRef<float> operator[](int block_index) const {
+      assert(block_index >= 0 && block_index < num_blocks());
+      return llvm::ArrayRef<float>(
+          data_ + graph_index_by_batch_index_[block_index] * num_tasks_,
+          num_tasks_);
+    }
+
+   private:
+    friend class GraphBuilderModelInference;
+
+    PredictionsView(const float* data, int num_tasks,
+                    llvm::ArrayRef<int> graph_index_by_batch_index)
+        : data_(data),
+          num_tasks_(num_tasks),
+          graph_index_by_batch_index_(graph_index_by_batch_index) {}
+
+    const float* data_ = nullptr;
+    int num_tasks_ = 0;
+    llvm::ArrayRef<int> graph_index_by_batch_index_;
+  };
+
+  // The cumulative wall time spent in the phases of RunInference(). Filling the
+  // input tensors includes resizing them and reallocating the tensor arena.
+  struct RunInferenceTimes {
+    std::chrono::nanoseconds fill_input_tensors{0};
+    std::chrono::nanoseconds invoke{0};
+  };
+
   // Creates the inference object from a model stored in the .tflite format.
   // Expects that the .tflite model contains also the definitions of node tokens
   // and creates a graph builder internally based on these definitions. Returns
   // an error when the model can't be loaded or it does not have all components
   // including the node token definitions.
+  // The node tokens are read directly from the constant buffers of the
+  // flatbuffer when possible, and the vocabulary built from them is shared with
+  // all other inference objects for models with the same node tokens.
   // Does not take ownership of `tflite_model`; the object must remain alive for
   // the whole lifetime of the inference object.
   static llvm::Expected<std::unique_ptr<GraphBuilderModelInference>>
-  FromTfLiteModel(const tflite::FlatBufferModel* tflite_model);
+  FromTfLiteModel(const tflite::FlatBufferModel* tflite_model,
+                  const GraphBuilderModelInferenceOptions& options = {});
+
+  ~GraphBuilderModelInference();
+
+  // Creates a new inference object for the same model as this object. The new
+  // object reuses the token vocabulary and the configuration of the graph
+  // builder of this object, but it has its own interpreter and its own empty
+  // batch, so that it can be used from a different thread than this object.
+  // The new interpreter is created with the same options as the interpreter of
+  // this object. Returns an error when the interpreter can't be created.
+  llvm::Expected<std::unique_ptr<GraphBuilderModelInference>> Clone() const;
 
   // Adds a basic block to the current batch. Returns true when the basic block
   // was successfully added, otherwise false.
+  // Basic blocks with the same graph in the same batch are deduplicated: only
+  // the first one is added to the graph, and the other ones reuse its
+  // predictions. This includes blocks that differ only in immediate values or
+  // address displacements; see BasicBlockGraphBuilder::ComputeGraphHash().
   // TODO(ondrasej): Add API that would allow rejecting blocks with unknown
   // tokens even if a replacement token was specified.
   bool AddBasicBlockToBatch(const BasicBlock& block);
 
+  // Adds all prefixes of a basic block to the current batch, from the shortest
+  // one to the whole basic block, as if AddBasicBlockToBatch() was called for
+  // each prefix. RunInference() returns a separate prediction for each prefix.
+  // The graphs of the prefixes are built in a single pass over the basic block;
+  // see BasicBlockGraphBuilder::AddBasicBlockPrefixes(). Returns true when the
+  // prefixes were successfully added, otherwise false.
+  // The prefixes take part in the deduplication of basic blocks: a later basic
+  // block with the same graph as one of the prefixes reuses the graph of the
+  // prefix, and when all prefixes are already in the batch, no new graphs are
+  // added.
+  bool AddBasicBlockPrefixesToBatch(const BasicBlock& block);
+
+  // Returns the number of basic blocks, nodes, and edges in the current batch.
+  // These can be used to keep the size of the input tensors of the model within
+  // a given budget. The number of blocks includes duplicate blocks, while the
+  // numbers of nodes and edges count only the unique blocks.
+  int num_blocks_in_batch() const {
+    return static_cast<int>(graph_index_by_batch_index_.size());
+  }
+  int num_nodes_in_batch() const { return graph_builder_->num_nodes(); }
+  int num_edges_in_batch() const { return graph_builder_->num_edges(); }
+
+  // Returns the graph hash of `block`, or std::nullopt when the block can't be
+  // added to a batch. When `fragment_hashes` is not null, replaces its contents
+  // with the hashes of the instruction fragments of the block. Basic blocks with
+  // the same fragment hashes have the same graph and get the same predictions;
+  // see BasicBlockGraphBuilder::ComputeGraphHash().
+  std::optional<uint64_t> ComputeGraphHash(
+      const BasicBlock& block,
+      std::vector<uint64_t>* fragment_hashes = nullptr) {
+    return graph_builder_->ComputeGraphHash(
+        block, /*prefix_graph_hashes=*/nullptr, fragment_hashes);
+  }
+
+  // Returns the counts of the out-of-vocabulary tokens in all basic blocks
+  // added to this object or any of its clones.
+  const OutOfVocabularyTokenCounts& out_of_vocabulary_token_counts() const {
+    return graph_builder_->out_of_vocabulary_token_counts();
+  }
+
   // Runs inference on the current batch. Returns a vector that contains
   // predictions for all basic blocks from the current batch in the order in
   // which they are added. The output for each basic block are the predictions
-  // from all heads of the model.
+  // from all heads of the model. When the output tensor of a quantized model is
+  // float16, int8, or uint8, the predictions are dequantized to float.
+  // The TensorFlow Lite interpreter is created once and reused by all calls.
+  // The input tensors are resized and the tensor arena is reallocated only when
+  // the shape of the batch differs from the shape of the previous batch.
   llvm::Expected<std::vector<OutputType>> RunInference();
 
+  // A version of RunInference() that returns a view of the output buffer
+  // instead of copying the predictions for each basic block. Use this when the
+  // predictions are consumed before the batch is modified or reset.
+  llvm::Expected<PredictionsView> RunInferenceView();
+
+  // Runs the model of this object on the current batch of `batch_source`,
+  // without building the graphs again. This lets multiple models that use the
+  // same node tokens, e.g. models for different microarchitectures, share the
+  // graphs of a single batch; see MultiModelGraphBuilderModelInference. The
+  // batch of this object is not used or modified. The returned view is valid
+  // until the batch of `batch_source` is modified or reset, or until the next
+  // inference with this object. Returns an error when the models do not have
+  // the same node tokens and special tokens.
+  // `batch_source` is only read, so multiple objects may run inference on the
+  // batch of the same `batch_source` concurrently, as long as the batch is not
+  // modified at the same time.
+  llvm::Expected<PredictionsView> RunInferenceViewOnBatchOf(
+      const GraphBuilderModelInference& batch_source);
+
   // Removes all basic blocks from the current batch. Note that RunInference()
   // does not call this method automatically.
   // TODO(ondrasej): See if this method could be removed from the API.
   void Reset();
 
+  // Returns the time spent in RunInference() since this object was created.
+  // This is used by benchmarks to split the inference time between the
+  // preparation of the inputs and the model itself.
+  const RunInferenceTimes& run_inference_times() const {
+    return run_inference_times_;
+  }
+
+  // Returns BasicBlockGraphBuilder::VocabularyHash() of the graph builder of
+  // this object. Two inference objects with the same vocabulary hash can run
+  // inference on each other's batches; see RunInferenceViewOnBatchOf().
+  uint64_t vocabulary_hash() const { return vocabulary_hash_; }
+
+  // Returns true when the interpreter uses the delegate from the options.
+  bool delegate_applied() const { return delegate_ != nullptr; }
+
  private:
   // Creates the inference object for the given graph builder object and the
   // given model in the .tflite format. Note that `graph_builder` is a property
@@ -85,12 +270,68 @@ class GraphBuilderModelInference {
   // training of the model.
   // Causes a CHECK-failure if the model inputs and outputs do not match the
   // structure of a model based on the BasicBlockGraphBuilder class.
+  // `interpreter` must be an interpreter created for `tflite_model` using
+  // `options`, and `delegate` is the delegate used by `interpreter` or nullptr.
   GraphBuilderModelInference(
       std::unique_ptr<BasicBlockGraphBuilder> graph_builder,
-      const tflite::FlatBufferModel* tflite_model);
+      tflite::Interpreter::TfLiteDelegatePtr delegate,
+      std::unique_ptr<tflite::Interpreter> interpreter,
+      const tflite::FlatBufferModel* tflite_model,
+      GraphBuilderModelInferenceOptions options);
+
+  // Runs inference on the graphs in `graph_builder`.
+  // `graph_index_by_batch_index` maps the basic blocks in the batch to the
+  // graphs in `graph_builder`.
+  llvm::Expected<PredictionsView> RunInferenceOnGraphs(
+      const BasicBlockGraphBuilder& graph_builder,
+      llvm::ArrayRef<int> graph_index_by_batch_index);
 
   std::unique_ptr<BasicBlockGraphBuilder> graph_builder_;
+  // The delegate used by `interpreter_`, or nullptr when the interpreter does
+  // not use a delegate. Must be declared before `interpreter_`, so that it is
+  // destroyed after the interpreter.
+  tflite::Interpreter::TfLiteDelegatePtr delegate_;
+  // The interpreter used for all batches processed by this object.
+  std::unique_ptr<tflite::Interpreter> interpreter_;
+  // True when the tensors of `interpreter_` were allocated for the current
+  // shapes of the input tensors.
+  bool tensors_allocated_ = false;
+
+  RunInferenceTimes run_inference_times_;
+
+  // The dequantized values of the output tensor of a quantized model. Reused
+  // across batches to avoid reallocations.
+  std::vector<float> dequantized_output_;
+
+  // Returns true when the graph with index `graph_index` in `graph_builder_`
+  // was built from instruction fragments with the hashes `fragment_hashes`.
+  bool GraphHasFragmentHashes(int graph_index,
+                              llvm::ArrayRef<uint64_t> fragment_hashes) const;
+
+  // Maps the graph hashes of the unique graphs in the current batch to the
+  // index of the graph in `graph_builder_`. A graph is reused only when its
+  // fragment hashes match those of the new basic block, so a collision of the
+  // graph hashes adds a new graph instead of reusing a different one.
+  std::unordered_map<uint64_t, int> graph_index_by_graph_hash_;
+  // The fragment hashes of all graphs in the current batch; see
+  // BasicBlockGraphBuilder::ComputeGraphHash(). The graph with index i was built
+  // from the fragments with hashes `graph_fragment_hashes_[begin, begin+size)`,
+  // where `{begin, size}` is `graph_fragment_hash_ranges_[i]`. Graphs of the
+  // prefixes of a basic block share the fragment hashes of the whole block.
+  std::vector<uint64_t> graph_fragment_hashes_;
+  std::vector<std::pair<size_t, size_t>> graph_fragment_hash_ranges_;
+  // The fragment hashes of the basic block being added. Reused across calls
+  // to avoid reallocations.
+  std::vector<uint64_t> fragment_hashes_;
+  // The index of the graph in `graph_builder_` for each basic block added to
+  // the current batch, in the order in which they were added.
+  std::vector<int> graph_index_by_batch_index_;
+
   const tflite::FlatBufferModel& tflite_model_;
+  const GraphBuilderModelInferenceOptions options_;
+  // BasicBlockGraphBuilder::VocabularyHash() of `graph_builder_`. Used to check
+  // that the graphs from another inference object can be used with this model.
+  const uint64_t vocabulary_hash_;
 };
 
 }  // namespace gematria
@@ -0,0 +1,264 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// End-to-end benchmarks of GraphBuilderModelInference. The benchmarks run the
+// model on synthetic basic blocks composed of common x86-64 instructions, and
+// report the throughput in blocks per second, and the time per batch spent in
+// building the graphs, filling the input tensors, and invoking the model.
+//
+// Typical usage:
+//   graph_builder_model_inference_benchmark \
+//     --gematria_tflite_file \
+//         llvm_cm/test/X86/Inputs/gb-token-mit-2022_12_02.tflite
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/granite/graph_builder_model_inference.h"
+#include "gematria/llvm/canonicalizer.h"
+#include "gematria/llvm/disassembler.h"
+#include "gematria/llvm/llvm_architecture_support.h"
+#include "gematria/utils/string.h"
+#include "llvm/MC/MCInst.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Errc.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/raw_ostream.h"
+#include "tensorflow/lite/model_builder.h"
+
+namespace gematria {
+namespace {
+
+namespace cl = llvm::cl;
+
+cl::opt<std::string> tflite_file(
+    "gematria_tflite_file", cl::value_desc("tflite_file"),
+    cl::desc("The path to the .tflite file that contains the trained model."));
+cl::opt<int> num_distinct_blocks(
+    "gematria_num_distinct_blocks", cl::init(4096),
+    cl::value_desc("num_blocks"),
+    cl::desc("The number of distinct synthetic basic blocks used by the"
+             " benchmarks."));
+cl::opt<int> num_threads(
+    "gematria_num_threads", cl::init(1), cl::value_desc("num_threads"),
+    cl::desc("The number of threads used by the TensorFlow Lite interpreter."));
+cl::opt<bool> use_xnnpack(
+    "gematria_use_xnnpack", cl::init(false),
+    cl::desc("Run the ops supported by XNNPACK using the XNNPACK delegate."));
+
+// Machine code of single x86-64 instructions, in the hex format used by the
+// BHive data set. The synthetic basic blocks are random sequences of these.
+constexpr const char* kInstructionsHex[] = {
+    "4829d3",          // sub rbx, rdx
+    "8b44246c",        // mov eax, dword ptr [rsp + 108]
+    "48c1fb03",        // sar rbx, 3
+    "4839c3",          // cmp rbx, rax
+    "4889c3",          // mov rbx, rax
+    "4801d8",          // add rax, rbx
+    "488b07",          // mov rax, qword ptr [rdi]
+    "4883c701",        // add rdi, 1
+    "85c0",            // test eax, eax
+    "0fafc1",          // imul eax, ecx
+    "f30f58c1",        // addss xmm0, xmm1
+    "c5fc58c1",        // vaddps ymm0, ymm0, ymm1
+    "48890e",          // mov qword ptr [rsi], rcx
+    "31c0",            // xor eax, eax
+    "4c8d0c8e",        // lea r9, [rsi + 4*rcx]
+    "488b4708",        // mov rax, qword ptr [rdi + 8]
+    "48395008",        // cmp qword ptr [rax + 8], rdx
+    "c5fa100487",      // vmovss xmm0, dword ptr [rdi + 4*rax]
+    "c5fa580496",      // vaddss xmm0, xmm0, dword ptr [rsi + 4*rdx]
+    "4883c010",        // add rax, 16
+};
+
+// The input data shared by all benchmarks. Created in main() from the
+// command-line flags.
+struct BenchmarkEnvironment {
+  std::unique_ptr<tflite::FlatBufferModel> model;
+  std::vector<BasicBlock> blocks;
+};
+BenchmarkEnvironment* environment = nullptr;
+
+// Creates `num_blocks` distinct basic blocks with 3 to 20 instructions each.
+// Uses a fixed seed so that all runs of the benchmark use the same blocks.
+llvm::Expected<std::vector<BasicBlock>> CreateBasicBlocks(int num_blocks) {
+  constexpr char kLlvmTriple[] = "x86_64-unknown-unknown";
+  llvm::Expected<std::unique_ptr<LlvmArchitectureSupport>> llvm_support =
+      LlvmArchitectureSupport::FromTriple(kLlvmTriple, "", "");
+  if (llvm::Error error = llvm_support.takeError()) return error;
+  X86Canonicalizer canonicalizer(&(*llvm_support)->target_machine());
+
+  std::vector<llvm::MCInst> instructions;
+  for (const char* const instruction_hex : kInstructionsHex) {
+    const auto machine_code = ParseHexString(instruction_hex);
+    if (!machine_code.has_value()) {
+      return llvm::createStringError(llvm::errc::invalid_argument,
+                                     "Invalid hex string: %s", instruction_hex);
+    }
+    llvm::Expected<std::vector<llvm::MCInst>> disassembled =
+        DisassembleAllMCInsts((*llvm_support)->mc_disassembler(),
+                              *machine_code);
+    if (llvm::Error error = disassembled.takeError()) return error;
+    std::move(disassembled->begin(), disassembled->end(),
+              std::back_inserter(instructions));
+  }
+
+  // A simple linear congruential generator; the exact sequence of the blocks
+  // does not matter, but it must be the same on all platforms.
+  uint64_t state = 1;
+  auto next_random = [&state](int bound) {
+    state = state * 6364136223846793005ull + 1442695040888963407ull;
+    return static_cast<int>((state >> 33) % bound);
+  };
+
+  std::vector<BasicBlock> blocks(num_blocks);
+  std::vector<llvm::MCInst> block_instructions;
+  for (BasicBlock& block : blocks) {
+    block_instructions.clear();
+    const int num_instructions = 3 + next_random(18);
+    for (int i = 0; i < num_instructions; ++i) {
+      block_instructions.push_back(
+          instructions[next_random(static_cast<int>(instructions.size()))]);
+    }
+    canonicalizer.AssignBasicBlockFromMCInst(block_instructions, block);
+  }
+  return blocks;
+}
+
+// Runs the model on batches of basic blocks. The argument of the benchmark is
+// the number of basic blocks in a batch. Consecutive batches use different
+// blocks from the environment. When `use_view` is true, the predictions are
+// read through RunInferenceView() instead of being copied by RunInference().
+void BM_GraphBuilderModelInference(benchmark::State& state, bool use_view) {
+  const int batch_size = static_cast<int>(state.range(0));
+  GraphBuilderModelInferenceOptions options;
+  options.num_threads = num_threads;
+  if (use_xnnpack) {
+    options.delegate_factory =
+        GraphBuilderModelInferenceOptions::XnnpackDelegateFactory(num_threads);
+  }
+  llvm::Expected<std::unique_ptr<GraphBuilderModelInference>> inference =
+      GraphBuilderModelInference::FromTfLiteModel(environment->model.get(),
+                                                  options);
+  if (llvm::Error error = inference.takeError()) {
+    state.SkipWithError(llvm::toString(std::move(error)).c_str());
+    return;
+  }
+  if (use_xnnpack && !(*inference)->delegate_applied()) {
+    state.SkipWithError("Could not apply the XNNPACK delegate");
+    return;
+  }
+
+  const std::vector<BasicBlock>& blocks = environment->blocks;
+  int next_block = 0;
+  std::chrono::nanoseconds graph_build_time{0};
+  for (auto _ : state) {
+    const auto graph_build_start_time = std::chrono::steady_clock::now();
+    for (int i = 0; i < batch_size; ++i) {
+      (*inference)->AddBasicBlockToBatch(blocks[next_block]);
+      next_block = (next_block + 1) % blocks.size();
+    }
+    graph_build_time +=
+        std::chrono::steady_clock::now() - graph_build_start_time;
+
+    if (use_view) {
+      llvm::Expected<GraphBuilderModelInference::PredictionsView> predictions =
+          (*inference)->RunInferenceView();
+      if (llvm::Error error = predictions.takeError()) {
+        state.SkipWithError(llvm::toString(std::move(error)).c_str());
+        return;
+      }
+      for (int i = 0; i < predictions->num_blocks(); ++i) {
+        benchmark::DoNotOptimize((*predictions)[i].data());
+      }
+    } else {
+      llvm::Expected<std::vector<GraphBuilderModelInference::OutputType>>
+          predictions = (*inference)->RunInference();
+      if (llvm::Error error = predictions.takeError()) {
+        state.SkipWithError(llvm::toString(std::move(error)).c_str());
+        return;
+      }
+      benchmark::DoNotOptimize(predictions->data());
+    }
+    (*inference)->Reset();
+  }
+
+  const GraphBuilderModelInference::RunInferenceTimes& times =
+      (*inference)->run_inference_times();
+  auto seconds_per_iteration = [](std::chrono::nanoseconds time) {
+    return benchmark::Counter(std::chrono::duration<double>(time).count(),
+                              benchmark::Counter::kAvgIterations);
+  };
+  state.counters["blocks_per_second"] = benchmark::Counter(
+      static_cast<double>(state.iterations() * batch_size),
+      benchmark::Counter::kIsRate);
+  state.counters["graph_build_s"] = seconds_per_iteration(graph_build_time);
+  state.counters["fill_tensors_s"] =
+      seconds_per_iteration(times.fill_input_tensors);
+  state.counters["invoke_s"] = seconds_per_iteration(times.invoke);
+}
+
+BENCHMARK_CAPTURE(BM_GraphBuilderModelInference, Copy, false)
+    ->ArgName("batch_size")
+    ->Arg(1)
+    ->Arg(10)
+    ->Arg(100)
+    ->Arg(1000)
+    ->UseRealTime();
+BENCHMARK_CAPTURE(BM_GraphBuilderModelInference, View, true)
+    ->ArgName("batch_size")
+    ->Arg(1)
+    ->Arg(10)
+    ->Arg(100)
+    ->Arg(1000)
+    ->UseRealTime();
+
+}  // namespace
+}  // namespace gematria
+
+int main(int argc, char* argv[]) {
+  // benchmark::Initialize() removes the flags of the benchmark library from
+  // `argv`, the remaining flags are parsed by LLVM.
+  benchmark::Initialize(&argc, argv);
+  llvm::cl::ParseCommandLineOptions(argc, argv);
+
+  gematria::BenchmarkEnvironment environment;
+  environment.model =
+      tflite::FlatBufferModel::BuildFromFile(gematria::tflite_file.c_str());
+  if (environment.model == nullptr) {
+    llvm::errs() << "Could not load the TfLite model from "
+                 << gematria::tflite_file << "\n";
+    return 1;
+  }
+  llvm::Expected<std::vector<gematria::BasicBlock>> blocks =
+      gematria::CreateBasicBlocks(gematria::num_distinct_blocks);
+  if (llvm::Error error = blocks.takeError()) {
+    llvm::errs() << error;
+    return 1;
+  }
+  environment.blocks = std::move(*blocks);
+  gematria::environment = &environment;
+
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return 0;
+}
@@ -19,27 +19,38 @@
 //     --gematria_tflite_file models/granite_model.tflite \
 //     --gematria_basic_block_hex_file /dev/stdin
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <fstream>
 #include <iostream>
 #include <limits>
 #include <memory>
+#include <optional>
 #include <ostream>
 #include <string>
+#include <thread>
+#include <tuple>
 #include <utility>
 #include <vector>
 
 #include "gematria/basic_block/basic_block.h"
+#include "gematria/granite/batch_size_autotuner.h"
+#include "gematria/granite/caching_graph_builder_model_inference.h"
 #include "gematria/granite/graph_builder_model_inference.h"
+#include "gematria/granite/pipelined_graph_builder_model_inference.h"
 #include "gematria/llvm/canonicalizer.h"
 #include "gematria/llvm/disassembler.h"
 #include "gematria/llvm/llvm_architecture_support.h"
 #include "gematria/utils/string.h"
-#include "llvm/MC/MCContext.h"
+#include "gematria/utils/tracing.h"
+#include "llvm/ADT/ArrayRef.h"
 #include "llvm/MC/MCInst.h"
-#include "llvm/MC/MCInstPrinter.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Errc.h"
 #include "llvm/Support/Error.h"
+#include "llvm/Support/Format.h"
 #include "llvm/Support/raw_ostream.h"
 #include "tensorflow/lite/model_builder.h"
 
@@ -61,114 +72,603 @@ cl::opt<int> max_blocks_per_batch(
     cl::value_desc("num_blocks"),
     cl::desc("The maximal number of blocks per batch. When non-positive, all"
              " blocks are put into the same batch."));
+cl::opt<int> max_nodes_per_batch(
+    "gematria_max_nodes_per_batch", cl::init(0), cl::value_desc("num_nodes"),
+    cl::desc("The maximal total number of graph nodes of all blocks in a"
+             " batch. A block that alone exceeds the limit is put into a"
+             " batch of its own. When non-positive, the number of nodes is"
+             " not limited."));
+cl::opt<int> max_edges_per_batch(
+    "gematria_max_edges_per_batch", cl::init(0), cl::value_desc("num_edges"),
+    cl::desc("The maximal total number of graph edges of all blocks in a"
+             " batch. A block that alone exceeds the limit is put into a"
+             " batch of its own. When non-positive, the number of edges is"
+             " not limited."));
+cl::opt<int> input_window_size(
+    "gematria_input_window_size", cl::init(16384),
+    cl::value_desc("num_blocks"),
+    cl::desc("The maximal number of blocks read from the input before they are"
+             " sent to the model. This bounds the memory used by the tool"
+             " regardless of the size of the input. The blocks are still split"
+             " into batches by the per-batch limits. When non-positive, the"
+             " number of blocks is limited only by"
+             " --gematria_max_blocks_per_batch. Ignored with"
+             " --gematria_batch_sort_window."));
+cl::opt<int> batch_sort_window(
+    "gematria_batch_sort_window", cl::init(0), cl::value_desc("num_blocks"),
+    cl::desc("When positive, the tool reads the input in windows of this many"
+             " blocks and sorts the blocks in each window by the size of their"
+             " graphs before splitting them into batches, so that blocks in"
+             " the same batch have similar sizes. The predictions are still"
+             " printed in the order of the input."));
+cl::opt<int> prediction_cache_size(
+    "gematria_prediction_cache_size", cl::init(0), cl::value_desc("num_blocks"),
+    cl::desc("The maximal number of basic blocks whose predictions are cached."
+             " Blocks found in the cache are not sent to the model. When"
+             " non-positive, the cache is disabled."));
+cl::opt<std::string> prediction_cache_file(
+    "gematria_prediction_cache_file", cl::value_desc("cache_file"),
+    cl::desc("When set, the prediction cache is loaded from this file at"
+             " startup and saved to it at exit. Entries created for a"
+             " different model are ignored. Requires"
+             " --gematria_prediction_cache_size."));
+cl::opt<int> num_decoder_threads(
+    "gematria_num_decoder_threads", cl::init(0), cl::value_desc("num_threads"),
+    cl::desc("The number of threads used to parse, disassemble, and"
+             " canonicalize the input blocks. The predictions are printed in"
+             " the order of the input regardless of the number of threads."
+             " When non-positive, uses one thread per hardware thread."));
+cl::opt<int> pipeline_depth(
+    "gematria_pipeline_depth", cl::init(2), cl::value_desc("num_batches"),
+    cl::desc("The number of batches that can be in the inference pipeline at"
+             " the same time: while the model runs on one batch, the tool"
+             " reads the next blocks and builds their graphs. With 1, the"
+             " graphs are built only after the previous batch finishes."));
+cl::opt<int> num_threads(
+    "gematria_num_threads", cl::init(-1), cl::value_desc("num_threads"),
+    cl::desc("The number of threads used by the TensorFlow Lite interpreter."
+             " When -1, the number of threads is chosen by TensorFlow Lite."));
+cl::opt<bool> use_xnnpack(
+    "gematria_use_xnnpack", cl::init(false),
+    cl::desc("Run the ops supported by XNNPACK using the XNNPACK delegate."
+             " The remaining ops, including the custom ops, run on the"
+             " built-in kernels."));
+cl::opt<std::string> trace_file(
+    "gematria_trace_file", cl::value_desc("trace_file"),
+    cl::desc("When not empty, records the time spent in the hot paths of the"
+             " inference and writes it to this file in the Chrome trace JSON"
+             " format, which can be loaded in Perfetto."));
+cl::opt<bool> print_trace_stats(
+    "gematria_print_trace_stats", cl::init(false),
+    cl::desc("Print the counters (blocks, nodes, edges, cache hits, ...) and"
+             " the total time of the hot paths of the inference to stderr at"
+             " the end of the run."));
+cl::opt<bool> autotune_batch_size(
+    "gematria_autotune_batch_size", cl::init(false),
+    cl::desc("Pick --gematria_max_nodes_per_batch automatically: before the"
+             " first window is processed, run the model on batches of"
+             " different sizes made of its blocks and use the node budget with"
+             " the highest throughput. The limit on the number of blocks per"
+             " batch still applies."));
+cl::opt<double> autotune_max_batch_latency_ms(
+    "gematria_autotune_max_batch_latency_ms", cl::init(0),
+    cl::value_desc("milliseconds"),
+    cl::desc("When positive, --gematria_autotune_batch_size picks only node"
+             " budgets whose batches run at most this long."));
+cl::opt<std::string> autotune_file(
+    "gematria_autotune_file", cl::value_desc("autotune_file"),
+    cl::desc("When set with --gematria_autotune_batch_size, the node budget is"
+             " loaded from this file if it was created for the same model, and"
+             " the autotuning is skipped; otherwise, the chosen node budget is"
+             " saved to it. The best budget depends on the host, so the file"
+             " should not be shared between different machines."));
+cl::opt<int> num_oov_tokens_to_print(
+    "gematria_num_oov_tokens_to_print", cl::init(10),
+    cl::value_desc("num_tokens"),
+    cl::desc("The number of the most frequent out-of-vocabulary tokens printed"
+             " to stderr at the end of the run, when the input contained any."
+             " When non-positive, only their total count is printed."));
 
 void PrintPredictionsToStdout(
     const GraphBuilderModelInference::OutputType& predictions) {
   for (int i = 0; i < predictions.size(); ++i) {
-    if (i > 0) std::cout << ",";
-    std::cout << predictions[i];
+    if (i > 0) llvm::outs() << ",";
+    // Use the same format as std::ostream uses for floats by default.
+    llvm::outs() << llvm::format("%g", predictions[i]);
   }
 }
 
-llvm::Error ProcessBasicBlocksFromCommandLineFlags() {
-  constexpr char kLlvmTriple[] = "x86_64-unknown-unknown";
-  llvm::Expected<std::unique_ptr<LlvmArchitectureSupport>> llvm_support =
-      LlvmArchitectureSupport::FromTriple(kLlvmTriple, "", "");
-  if (llvm::Error error = llvm_support.takeError()) return error;
+// Returns true if `value` is within `limit`; a non-positive limit means that
+// the value is not limited.
+bool IsWithinLimit(int value, int limit) {
+  return limit <= 0 || value <= limit;
+}
 
-  const std::unique_ptr<tflite::FlatBufferModel> model =
-      tflite::FlatBufferModel::BuildFromFile(tflite_file.c_str());
-  if (model == nullptr) {
-    return llvm::createStringError(llvm::errc::io_error,
-                                   "Could not load the TfLite model.");
+// Decodes basic blocks from the hex format used in the BHive data set. Each
+// decoder has its own LLVM thread context, so that different decoders can be
+// used from different threads; the architecture support and the canonicalizer
+// are shared by all decoders.
+class BlockDecoder {
+ public:
+  BlockDecoder(const LlvmArchitectureSupport& llvm_support,
+               const Canonicalizer& canonicalizer)
+      : thread_context_(llvm_support.CreateThreadContext()),
+        canonicalizer_(canonicalizer) {}
+
+  // Decodes the basic block from `line` into `block`. Reuses the memory
+  // allocated by `block`.
+  llvm::Error Decode(const std::string& line, BasicBlock& block) {
+    if (!ParseHexString(line, machine_code_)) {
+      return llvm::createStringError(llvm::errc::invalid_argument,
+                                     "Can't parse input line: %s",
+                                     line.c_str());
+    }
+    llvm::Expected<std::vector<llvm::MCInst>> mc_insts =
+        DisassembleAllMCInsts(thread_context_->mc_disassembler(),
+                              machine_code_);
+    if (llvm::Error error = mc_insts.takeError()) return error;
+    canonicalizer_.AssignBasicBlockFromMCInst(*mc_insts, block);
+    return llvm::Error::success();
   }
-  llvm::Expected<std::unique_ptr<GraphBuilderModelInference>>
-      expected_inference =
-          GraphBuilderModelInference::FromTfLiteModel(model.get());
-  if (llvm::Error error = expected_inference.takeError()) return error;
-  GraphBuilderModelInference& inference = **expected_inference;
 
-  X86Canonicalizer canonicalizer(&(*llvm_support)->target_machine());
+ private:
+  const std::unique_ptr<LlvmThreadContext> thread_context_;
+  const Canonicalizer& canonicalizer_;
+  // The machine code of the last decoded block; reused between the calls to
+  // avoid an allocation per block.
+  std::vector<uint8_t> machine_code_;
+};
 
-  std::unique_ptr<llvm::MCInstPrinter> inst_printer =
-      (*llvm_support)->CreateMCInstPrinter(0);
+// Decodes the basic blocks from `lines` into the first `lines.size()` elements
+// of `window`, using one thread per decoder. The blocks are assigned to the
+// threads dynamically in small chunks; the order of the blocks in `window` is
+// always the order of `lines`. When some lines can't be decoded, returns the
+// error for the first one.
+llvm::Error DecodeWindow(llvm::ArrayRef<std::string> lines,
+                         std::vector<std::unique_ptr<BlockDecoder>>& decoders,
+                         std::vector<BasicBlock>& window) {
+  constexpr int kChunkSize = 64;
+  if (window.size() < lines.size()) window.resize(lines.size());
 
-  const auto run_inference_for_batch =
-      [&](const std::vector<BasicBlock>& batch) -> llvm::Error {
-    inference.Reset();
-    std::vector<bool> is_valid_block;
-    is_valid_block.reserve(batch.size());
-    for (const BasicBlock& block : batch) {
-      is_valid_block.push_back(inference.AddBasicBlockToBatch(block));
-      if (!is_valid_block.back()) {
-        std::cerr << "Invalid basic block:\n" << block.ToString() << "\n";
+  struct DecodeError {
+    int index = std::numeric_limits<int>::max();
+    std::string message;
+  };
+  // The chunks are taken in the order of the lines, and each thread stops at
+  // the first block it can't decode. The first error among all threads is thus
+  // the error for the first invalid line.
+  std::atomic<int> next_chunk_begin = 0;
+  std::atomic<bool> failed = false;
+  std::vector<DecodeError> errors(decoders.size());
+  const auto decode_chunks = [&](int thread) {
+    while (!failed) {
+      const int chunk_begin = next_chunk_begin.fetch_add(kChunkSize);
+      if (chunk_begin >= lines.size()) return;
+      const int chunk_end =
+          std::min<int>(chunk_begin + kChunkSize, lines.size());
+      for (int i = chunk_begin; i < chunk_end; ++i) {
+        if (llvm::Error error = decoders[thread]->Decode(lines[i], window[i])) {
+          errors[thread] = {i, llvm::toString(std::move(error))};
+          failed = true;
+          return;
+        }
+      }
+    }
+  };
+
+  const int num_chunks = (lines.size() + kChunkSize - 1) / kChunkSize;
+  const int num_threads = std::min<int>(decoders.size(), num_chunks);
+  std::vector<std::thread> threads;
+  for (int thread = 1; thread < num_threads; ++thread) {
+    threads.emplace_back(decode_chunks, thread);
+  }
+  if (num_threads > 0) decode_chunks(0);
+  for (std::thread& thread : threads) thread.join();
+
+  const DecodeError& first_error = *std::min_element(
+      errors.begin(), errors.end(),
+      [](const DecodeError& left, const DecodeError& right) {
+        return left.index < right.index;
+      });
+  if (first_error.index < lines.size()) {
+    return llvm::createStringError(llvm::errc::invalid_argument, "%s",
+                                   first_error.message.c_str());
+  }
+  return llvm::Error::success();
+}
+
+// A window of basic blocks whose batches were submitted to the inference
+// pipeline, but whose predictions were not printed yet.
+struct PendingWindow {
+  // A batch of blocks from the window submitted to the pipeline.
+  struct Batch {
+    // The indices of the blocks of the batch in the window.
+    std::vector<int> block_indices;
+    PipelinedGraphBuilderModelInference::FutureType predictions;
+  };
+
+  // Predictions for the blocks in the window. Remains empty for invalid blocks
+  // until the batches are finished.
+  std::vector<std::optional<GraphBuilderModelInference::OutputType>>
+      predictions;
+  // The keys of the blocks in the prediction cache; empty when there is no
+  // cache.
+  std::vector<std::string> cache_keys;
+  std::vector<Batch> batches;
+};
+
+// Submits inference for all basic blocks in `window` to `pipeline`. Splits the
+// blocks into batches that respect the limits set by
+// --gematria_max_blocks_per_batch, --gematria_max_nodes_per_batch, and
+// --gematria_max_edges_per_batch. When `sort_by_size` is true, the blocks are
+// sorted by the size of their graphs before they are split into batches. When
+// `cache` is not null, the blocks found in the cache are not sent to the model.
+// `inference` is used to measure the sizes of the graphs of the blocks.
+// The blocks in `window` may be modified or destroyed as soon as this function
+// returns; the predictions are collected by FinishWindow().
+llvm::Expected<PendingWindow> SubmitWindow(
+    GraphBuilderModelInference& inference,
+    PipelinedGraphBuilderModelInference& pipeline,
+    llvm::ArrayRef<BasicBlock> window, bool sort_by_size,
+    PredictionCache* cache) {
+  struct BlockSize {
+    int index;
+    int num_nodes;
+    int num_edges;
+  };
+
+  PendingWindow pending;
+  pending.predictions.resize(window.size());
+  if (cache != nullptr) pending.cache_keys.resize(window.size());
+
+  // Compute the sizes of the graphs of all blocks in the window by adding them
+  // to the graph builder one by one. Building the graphs is cheap compared to
+  // the inference itself, and it lets us know the exact size of the input
+  // tensors before forming the batches. Each block is added to an empty batch,
+  // so that duplicate blocks are not measured as empty by the deduplication in
+  // GraphBuilderModelInference.
+  std::vector<BlockSize> block_sizes;
+  block_sizes.reserve(window.size());
+  std::vector<uint64_t> fragment_hashes;
+  for (int i = 0; i < window.size(); ++i) {
+    if (cache != nullptr) {
+      if (inference.ComputeGraphHash(window[i], &fragment_hashes)
+              .has_value()) {
+        pending.cache_keys[i] =
+            PredictionCache::KeyForFragmentHashes(fragment_hashes);
+        pending.predictions[i] = cache->Lookup(pending.cache_keys[i]);
+        if (pending.predictions[i].has_value()) continue;
       }
     }
-    llvm::Expected<std::vector<GraphBuilderModelInference::OutputType>>
-        predictions = inference.RunInference();
-    if (llvm::Error error = predictions.takeError()) return error;
+    inference.Reset();
+    if (!inference.AddBasicBlockToBatch(window[i])) {
+      std::cerr << "Invalid basic block:\n" << window[i].ToString() << "\n";
+      continue;
+    }
+    block_sizes.push_back(
+        {i, inference.num_nodes_in_batch(), inference.num_edges_in_batch()});
+  }
+  if (sort_by_size) {
+    std::stable_sort(block_sizes.begin(), block_sizes.end(),
+                     [](const BlockSize& left, const BlockSize& right) {
+                       return std::tie(left.num_nodes, left.num_edges) <
+                              std::tie(right.num_nodes, right.num_edges);
+                     });
+  }
 
-    int prediction_index = 0;
-    for (const bool is_valid : is_valid_block) {
-      if (is_valid) {
-        PrintPredictionsToStdout((*predictions)[prediction_index++]);
-      } else {
-        std::cout << "Invalid block";
+  // Builds the graphs for the blocks of `batch` in the pipeline, and submits
+  // them for inference.
+  const auto submit_batch =
+      [&](llvm::ArrayRef<BlockSize> batch) -> llvm::Error {
+    PendingWindow::Batch pending_batch;
+    pending_batch.block_indices.reserve(batch.size());
+    for (const BlockSize& block : batch) {
+      if (!pipeline.AddBasicBlockToBatch(window[block.index])) {
+        return llvm::createStringError(
+            llvm::errc::invalid_argument,
+            "Basic block %d was accepted and then rejected by the model",
+            block.index);
       }
-      std::cout << std::endl;
+      pending_batch.block_indices.push_back(block.index);
     }
+    pending_batch.predictions = pipeline.SubmitBatch();
+    pending.batches.push_back(std::move(pending_batch));
     return llvm::Error::success();
   };
 
-  std::vector<BasicBlock> batch;
+  const llvm::ArrayRef<BlockSize> blocks(block_sizes);
+  int batch_begin = 0;
+  int batch_num_nodes = 0;
+  int batch_num_edges = 0;
+  for (int i = 0; i < blocks.size(); ++i) {
+    const int batch_size = i - batch_begin;
+    const bool fits_in_batch =
+        batch_size == 0 ||
+        (IsWithinLimit(batch_size + 1, max_blocks_per_batch) &&
+         IsWithinLimit(batch_num_nodes + blocks[i].num_nodes,
+                       max_nodes_per_batch) &&
+         IsWithinLimit(batch_num_edges + blocks[i].num_edges,
+                       max_edges_per_batch));
+    if (!fits_in_batch) {
+      if (llvm::Error error =
+              submit_batch(blocks.slice(batch_begin, batch_size))) {
+        return error;
+      }
+      batch_begin = i;
+      batch_num_nodes = 0;
+      batch_num_edges = 0;
+    }
+    batch_num_nodes += blocks[i].num_nodes;
+    batch_num_edges += blocks[i].num_edges;
+  }
+  if (batch_begin < blocks.size()) {
+    if (llvm::Error error = submit_batch(blocks.drop_front(batch_begin))) {
+      return error;
+    }
+  }
+  return pending;
+}
 
-  std::ifstream hex_file(basic_block_hex_file);
-  while (!hex_file.eof()) {
-    std::string line;
-    std::getline(hex_file, line);
-    StripAsciiWhitespace(&line);
-    if (line.empty()) continue;
+// Waits for the predictions for all batches of `pending`, and prints them to
+// stdout in the order of the blocks in the window. When `cache` is not null,
+// adds the new predictions to the cache.
+llvm::Error FinishWindow(PendingWindow& pending, PredictionCache* cache) {
+  for (PendingWindow::Batch& batch : pending.batches) {
+    PipelinedGraphBuilderModelInference::ResultType batch_predictions =
+        batch.predictions.get();
+    if (llvm::Error error = batch_predictions.takeError()) return error;
+    for (int i = 0; i < batch.block_indices.size(); ++i) {
+      const int index = batch.block_indices[i];
+      if (cache != nullptr) {
+        cache->Insert(pending.cache_keys[index], (*batch_predictions)[i]);
+      }
+      pending.predictions[index] = std::move((*batch_predictions)[i]);
+    }
+  }
 
-    auto machine_code = ParseHexString(line);
-    if (!machine_code.has_value()) {
-      return llvm::createStringError(llvm::errc::invalid_argument,
-                                     "Can't parse input line: %s",
-                                     line.c_str());
+  for (const std::optional<GraphBuilderModelInference::OutputType>&
+           block_predictions : pending.predictions) {
+    if (block_predictions.has_value()) {
+      PrintPredictionsToStdout(*block_predictions);
+    } else {
+      llvm::outs() << "Invalid block";
     }
+    // llvm::outs() is buffered, and it is flushed only when the buffer is full
+    // or at exit, not after each block.
+    llvm::outs() << "\n";
+  }
+  return llvm::Error::success();
+}
 
-    llvm::Expected<std::vector<DisassembledInstruction>>
-        disassembled_instructions =
-            DisassembleAllInstructions((*llvm_support)->mc_disassembler(),
-                                       (*llvm_support)->mc_instr_info(),
-                                       (*llvm_support)->mc_register_info(),
-                                       (*llvm_support)->mc_subtarget_info(),
-                                       *inst_printer, 0, *machine_code);
-    if (llvm::Error error = disassembled_instructions.takeError()) {
-      return error;
+// Prints the number of out-of-vocabulary tokens found in the input and the
+// most frequent ones to stderr. Prints nothing when all tokens were in the
+// vocabulary of the model.
+void PrintOutOfVocabularyTokenSummary(
+    const OutOfVocabularyTokenCounts& oov_token_counts) {
+  const std::vector<std::pair<std::string, int64_t>> counts =
+      oov_token_counts.GetCounts();
+  if (counts.empty()) return;
+  llvm::errs() << "Out-of-vocabulary tokens: " << oov_token_counts.total()
+               << " occurrences of " << counts.size() << " unique tokens\n";
+  const size_t num_to_print = std::min<size_t>(
+      counts.size(), std::max(0, num_oov_tokens_to_print.getValue()));
+  for (size_t i = 0; i < num_to_print; ++i) {
+    llvm::errs() << "  " << counts[i].first << ": " << counts[i].second
+                 << "\n";
+  }
+}
+
+// Picks the node budget of the batches for `inference` using the blocks in
+// `window`, or loads it from --gematria_autotune_file, and stores it in
+// --gematria_max_nodes_per_batch. Keeps the flag when none of the blocks can be
+// added to a batch.
+llvm::Error AutotuneNodeBudget(GraphBuilderModelInference& inference,
+                               llvm::ArrayRef<BasicBlock> window,
+                               const std::string& model_id) {
+  if (!autotune_file.empty()) {
+    llvm::Expected<std::optional<int>> saved_node_budget =
+        LoadAutotunedNodeBudget(autotune_file, model_id);
+    if (llvm::Error error = saved_node_budget.takeError()) return error;
+    if (saved_node_budget->has_value()) {
+      max_nodes_per_batch = **saved_node_budget;
+      return llvm::Error::success();
     }
-    std::vector<llvm::MCInst> mc_insts;
-    mc_insts.reserve(disassembled_instructions->size());
-    for (const DisassembledInstruction& disassembled_instruction :
-         *disassembled_instructions) {
-      mc_insts.push_back(std::move(disassembled_instruction.mc_inst));
+  }
+
+  BatchSizeAutotunerOptions options;
+  options.max_batch_latency =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::duration<double, std::milli>(
+              autotune_max_batch_latency_ms.getValue()));
+  BatchSizeAutotuner autotuner(options);
+  if (llvm::Error error = RunBatchSizeAutotuner(inference, window, autotuner)) {
+    return error;
+  }
+  llvm::errs() << autotuner.FormatResults();
+  const std::optional<int> node_budget = autotuner.best_node_budget();
+  if (!node_budget.has_value()) return llvm::Error::success();
+  llvm::errs() << "Using --gematria_max_nodes_per_batch=" << *node_budget
+               << "\n";
+  max_nodes_per_batch = *node_budget;
+  if (!autotune_file.empty()) {
+    return SaveAutotunedNodeBudget(autotune_file, model_id, *node_budget);
+  }
+  return llvm::Error::success();
+}
+
+// Writes the data collected by the tracing to the outputs requested by the
+// command-line flags.
+llvm::Error WriteTracingOutputs() {
+  if (print_trace_stats) llvm::errs() << FormatTracingStats();
+  if (!trace_file.empty()) {
+    std::ofstream trace(trace_file);
+    trace << FormatChromeTraceJson();
+    if (!trace) {
+      return llvm::createStringError(llvm::errc::io_error,
+                                     "Could not write the trace to %s",
+                                     trace_file.c_str());
     }
+  }
+  return llvm::Error::success();
+}
+
+llvm::Error ProcessBasicBlocksFromCommandLineFlags() {
+  if (!trace_file.empty()) {
+    SetTracingMode(TracingMode::kEvents);
+  } else if (print_trace_stats) {
+    SetTracingMode(TracingMode::kStats);
+  }
+  const std::unique_ptr<tflite::FlatBufferModel> model =
+      tflite::FlatBufferModel::BuildFromFile(tflite_file.c_str());
+  if (model == nullptr) {
+    return llvm::createStringError(llvm::errc::io_error,
+                                   "Could not load the TfLite model.");
+  }
+  GraphBuilderModelInferenceOptions inference_options;
+  inference_options.num_threads = num_threads;
+  if (use_xnnpack) {
+    inference_options.delegate_factory =
+        GraphBuilderModelInferenceOptions::XnnpackDelegateFactory(num_threads);
+  }
+  llvm::Expected<std::unique_ptr<GraphBuilderModelInference>>
+      expected_inference = GraphBuilderModelInference::FromTfLiteModel(
+          model.get(), inference_options);
+  if (llvm::Error error = expected_inference.takeError()) return error;
+  GraphBuilderModelInference& inference = **expected_inference;
+  if (use_xnnpack && !inference.delegate_applied()) {
+    llvm::errs() << "Could not apply the XNNPACK delegate, using the built-in"
+                    " kernels.\n";
+  }
 
-    if (batch.size() == max_blocks_per_batch) {
-      if (llvm::Error error = run_inference_for_batch(batch)) {
+  const std::string model_id = PredictionCache::ModelIdFromTfLiteModel(*model);
+  std::unique_ptr<PredictionCache> cache;
+  if (prediction_cache_size > 0) {
+    cache = std::make_unique<PredictionCache>(prediction_cache_size, model_id);
+    if (!prediction_cache_file.empty()) {
+      if (llvm::Error error = cache->LoadFromFile(prediction_cache_file)) {
         return error;
       }
-      batch.clear();
     }
-    batch.push_back(canonicalizer.BasicBlockFromMCInst(mc_insts));
+  }
+
+  const int num_decoders =
+      num_decoder_threads > 0
+          ? num_decoder_threads.getValue()
+          : static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+  constexpr char kLlvmTriple[] = "x86_64-unknown-unknown";
+  llvm::Expected<std::shared_ptr<const LlvmArchitectureSupport>> llvm_support =
+      LlvmArchitectureSupport::Shared(kLlvmTriple, "", "");
+  if (llvm::Error error = llvm_support.takeError()) return error;
+  const X86Canonicalizer canonicalizer(&(*llvm_support)->target_machine());
+  std::vector<std::unique_ptr<BlockDecoder>> decoders;
+  decoders.reserve(num_decoders);
+  for (int i = 0; i < num_decoders; ++i) {
+    decoders.push_back(
+        std::make_unique<BlockDecoder>(**llvm_support, canonicalizer));
+  }
+
+  // When sorting is not requested, each window corresponds to a batch by the
+  // number of blocks, unless that would exceed --gematria_input_window_size;
+  // the node and edge limits may split it further.
+  const bool sort_by_size = batch_sort_window > 0;
+  int window_size = batch_sort_window;
+  if (!sort_by_size) {
+    window_size = max_blocks_per_batch > 0
+                      ? max_blocks_per_batch.getValue()
+                      : std::numeric_limits<int>::max();
+    if (input_window_size > 0) {
+      window_size = std::min(window_size, input_window_size.getValue());
+    }
+  }
+  // The lines of the current window are lines[0..num_blocks_in_window), and
+  // their blocks are decoded into window[0..num_blocks_in_window). The strings
+  // and the block objects are reused across windows, so that they can keep
+  // their allocated memory.
+  std::vector<std::string> lines;
+  std::vector<BasicBlock> window;
+  int num_blocks_in_window = 0;
+  // The pipeline overlaps reading and decoding of the next window and building
+  // the graphs of its blocks with the inference for the previous window. The
+  // predictions for a window are printed after the next window is submitted.
+  llvm::Expected<std::unique_ptr<PipelinedGraphBuilderModelInference>>
+      pipeline = PipelinedGraphBuilderModelInference::Create(
+          inference, pipeline_depth);
+  if (llvm::Error error = pipeline.takeError()) return error;
+  std::optional<PendingWindow> pending_window;
+  bool needs_autotuning = autotune_batch_size;
+  auto process_window = [&]() -> llvm::Error {
+    if (llvm::Error error = DecodeWindow(
+            llvm::ArrayRef<std::string>(lines).take_front(num_blocks_in_window),
+            decoders, window)) {
+      return error;
+    }
+    if (needs_autotuning) {
+      // The pipeline is still idle, so the measurements are not disturbed by
+      // the inference for other batches.
+      needs_autotuning = false;
+      if (llvm::Error error = AutotuneNodeBudget(
+              inference,
+              llvm::ArrayRef<BasicBlock>(window).take_front(
+                  num_blocks_in_window),
+              model_id)) {
+        return error;
+      }
+    }
+    llvm::Expected<PendingWindow> submitted_window =
+        SubmitWindow(inference, **pipeline,
+                     llvm::ArrayRef<BasicBlock>(window).take_front(
+                         num_blocks_in_window),
+                     sort_by_size, cache.get());
+    if (llvm::Error error = submitted_window.takeError()) return error;
+    if (pending_window.has_value()) {
+      if (llvm::Error error = FinishWindow(*pending_window, cache.get())) {
+        return error;
+      }
+    }
+    pending_window = std::move(*submitted_window);
+    return llvm::Error::success();
+  };
+
+  // The input is read in large chunks. The blocks are decoded when the
+  // window is full, in parallel on --gematria_num_decoder_threads threads.
+  constexpr int kInputBufferSize = 1 << 20;
+  std::vector<char> input_buffer(kInputBufferSize);
+  std::ifstream hex_file;
+  hex_file.rdbuf()->pubsetbuf(input_buffer.data(), input_buffer.size());
+  hex_file.open(basic_block_hex_file);
+  if (!hex_file.is_open()) {
+    return llvm::createStringError(llvm::errc::io_error, "Could not open %s",
+                                   basic_block_hex_file.c_str());
+  }
+  while (true) {
+    if (num_blocks_in_window == window_size) {
+      if (llvm::Error error = process_window()) return error;
+      num_blocks_in_window = 0;
+    }
+    if (num_blocks_in_window == lines.size()) lines.emplace_back();
+    std::string& line = lines[num_blocks_in_window];
+    if (!std::getline(hex_file, line)) break;
+    StripAsciiWhitespace(&line);
+    if (!line.empty()) ++num_blocks_in_window;
   }
   // Process all remaining blocks.
-  if (!batch.empty()) {
-    if (llvm::Error error = run_inference_for_batch(batch)) {
+  if (num_blocks_in_window > 0) {
+    if (llvm::Error error = process_window()) return error;
+  }
+  if (pending_window.has_value()) {
+    if (llvm::Error error = FinishWindow(*pending_window, cache.get())) {
       return error;
     }
   }
 
-  return llvm::Error::success();
+  if (cache != nullptr && !prediction_cache_file.empty()) {
+    if (llvm::Error error = cache->SaveToFile(prediction_cache_file)) {
+      return error;
+    }
+  }
+
+  PrintOutOfVocabularyTokenSummary(inference.out_of_vocabulary_token_counts());
+  return WriteTracingOutputs();
 }
 
 }  // namespace
@@ -0,0 +1,135 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/granite/graph_builder_model_inference_pool.h"
+
+#include <algorithm>
+#include <cassert>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/granite/graph_builder_model_inference.h"
+#include "llvm/Support/Errc.h"
+#include "llvm/Support/Error.h"
+#include "tensorflow/lite/model_builder.h"
+
+namespace gematria {
+
+llvm::Expected<std::unique_ptr<GraphBuilderModelInferencePool>>
+GraphBuilderModelInferencePool::FromTfLiteModel(
+    const tflite::FlatBufferModel* tflite_model, int num_workers,
+    const GraphBuilderModelInferenceOptions& options) {
+  if (num_workers <= 0) {
+    num_workers = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  // The first inference object parses the vocabulary from the model; the other
+  // workers reuse it.
+  llvm::Expected<std::unique_ptr<GraphBuilderModelInference>> first_inference =
+      GraphBuilderModelInference::FromTfLiteModel(tflite_model, options);
+  if (llvm::Error error = first_inference.takeError()) return error;
+
+  std::vector<std::unique_ptr<GraphBuilderModelInference>> inferences;
+  inferences.reserve(num_workers);
+  inferences.push_back(std::move(*first_inference));
+  while (static_cast<int>(inferences.size()) < num_workers) {
+    llvm::Expected<std::unique_ptr<GraphBuilderModelInference>> inference =
+        inferences.front()->Clone();
+    if (llvm::Error error = inference.takeError()) return error;
+    inferences.push_back(std::move(*inference));
+  }
+
+  // We can't use std::make_unique<GraphBuilderModelInferencePool>(), because
+  // std::make_unique<>() requires a public constructor.
+  return std::unique_ptr<GraphBuilderModelInferencePool>(
+      new GraphBuilderModelInferencePool(std::move(inferences)));
+}
+
+GraphBuilderModelInferencePool::GraphBuilderModelInferencePool(
+    std::vector<std::unique_ptr<GraphBuilderModelInference>> inferences)
+    : inferences_(std::move(inferences)) {
+  assert(!inferences_.empty());
+  workers_.reserve(inferences_.size());
+  for (const std::unique_ptr<GraphBuilderModelInference>& inference :
+       inferences_) {
+    workers_.emplace_back(
+        [this, &inference = *inference]() { WorkerLoop(inference); });
+  }
+}
+
+GraphBuilderModelInferencePool::~GraphBuilderModelInferencePool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    shutting_down_ = true;
+  }
+  tasks_available_.notify_all();
+  for (std::thread& worker : workers_) {
+    worker.join();
+  }
+}
+
+GraphBuilderModelInferencePool::FutureType
+GraphBuilderModelInferencePool::Submit(std::vector<BasicBlock> batch) {
+  Task task{std::move(batch), std::promise<ResultType>()};
+  FutureType future = task.result.get_future();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    assert(!shutting_down_);
+    tasks_.push_back(std::move(task));
+  }
+  tasks_available_.notify_one();
+  return future;
+}
+
+void GraphBuilderModelInferencePool::WorkerLoop(
+    GraphBuilderModelInference& inference) {
+  while (true) {
+    Task task;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      tasks_available_.wait(
+          lock, [this]() { return shutting_down_ || !tasks_.empty(); });
+      // Drain the queue before shutting down, so that all futures returned by
+      // Submit() eventually receive a value.
+      if (tasks_.empty()) return;
+      task = std::move(tasks_.front());
+      tasks_.pop_front();
+    }
+    task.result.set_value(ProcessBatch(inference, task.batch));
+  }
+}
+
+GraphBuilderModelInferencePool::ResultType
+GraphBuilderModelInferencePool::ProcessBatch(
+    GraphBuilderModelInference& inference,
+    const std::vector<BasicBlock>& batch) {
+  inference.Reset();
+  for (int i = 0; i < batch.size(); ++i) {
+    if (!inference.AddBasicBlockToBatch(batch[i])) {
+      inference.Reset();
+      return llvm::createStringError(
+          llvm::errc::invalid_argument,
+          "Basic block at index %d could not be added to the batch", i);
+    }
+  }
+  ResultType predictions = inference.RunInference();
+  inference.Reset();
+  return predictions;
+}
+
+}  // namespace gematria
@@ -0,0 +1,120 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_GRAPH_BUILDER_MODEL_INFERENCE_POOL_H_
+#define THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_GRAPH_BUILDER_MODEL_INFERENCE_POOL_H_
+
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/granite/graph_builder_model_inference.h"
+#include "llvm/Support/Error.h"
+#include "tensorflow/lite/model_builder.h"
+
+namespace gematria {
+
+// Runs inference with a trained GRANITE model on a fixed number of worker
+// threads. Each worker has its own GraphBuilderModelInference object (and thus
+// its own TensorFlow Lite interpreter and graph builder); all workers share the
+// same tflite::FlatBufferModel and the token vocabulary parsed from it.
+//
+// Unlike GraphBuilderModelInference, the pool is thread-safe: Submit() may be
+// called concurrently from any number of threads.
+//
+// Typical usage:
+//   auto tflite_model = tflite::FlatBufferModel::BuildFromFile(...);
+//   auto pool = GraphBuilderModelInferencePool::FromTfLiteModel(
+//       tflite_model.get(), /* num_workers = */ 8);
+//   std::vector<GraphBuilderModelInferencePool::FutureType> futures;
+//   for (std::vector<BasicBlock>& batch : batches) {
+//     futures.push_back((*pool)->Submit(std::move(batch)));
+//   }
+//   for (auto& future : futures) {
+//     llvm::Expected<std::vector<OutputType>> predictions = future.get();
+//     ...
+//   }
+class GraphBuilderModelInferencePool {
+ public:
+  using OutputType = GraphBuilderModelInference::OutputType;
+  // The result of processing a single batch. Contains either the predictions
+  // for all basic blocks in the batch, in the order in which they were
+  // submitted, or an error.
+  using ResultType = llvm::Expected<std::vector<OutputType>>;
+  using FutureType = std::future<ResultType>;
+
+  // Creates the pool from a model stored in the .tflite format. Creates
+  // `num_workers` workers; when `num_workers` is not positive, uses one worker
+  // per hardware thread. The interpreters of all workers are created with
+  // `options`. Returns an error when the model can't be loaded; see
+  // GraphBuilderModelInference::FromTfLiteModel() for details.
+  // Does not take ownership of `tflite_model`; the object must remain alive for
+  // the whole lifetime of the pool.
+  static llvm::Expected<std::unique_ptr<GraphBuilderModelInferencePool>>
+  FromTfLiteModel(const tflite::FlatBufferModel* tflite_model, int num_workers,
+                  const GraphBuilderModelInferenceOptions& options = {});
+
+  // Finishes processing of all submitted batches and stops the workers.
+  ~GraphBuilderModelInferencePool();
+
+  // Schedules inference for `batch` on one of the workers. Returns a future
+  // that receives the predictions for all basic blocks in `batch`. The future
+  // receives an error when the inference fails or when one of the basic blocks
+  // can't be added to the batch.
+  FutureType Submit(std::vector<BasicBlock> batch);
+
+  // Returns the number of workers in the pool.
+  int num_workers() const { return static_cast<int>(workers_.size()); }
+
+ private:
+  // A batch waiting for a worker.
+  struct Task {
+    std::vector<BasicBlock> batch;
+    std::promise<ResultType> result;
+  };
+
+  explicit GraphBuilderModelInferencePool(
+      std::vector<std::unique_ptr<GraphBuilderModelInference>> inferences);
+
+  // The main loop of a worker thread. Takes tasks from `tasks_` and processes
+  // them using `inference` until the pool is destroyed.
+  void WorkerLoop(GraphBuilderModelInference& inference);
+
+  // Runs inference for `batch` using `inference`.
+  static ResultType ProcessBatch(GraphBuilderModelInference& inference,
+                                 const std::vector<BasicBlock>& batch);
+
+  // The inference objects owned by the workers. `inferences_[i]` is used only
+  // by `workers_[i]`.
+  std::vector<std::unique_ptr<GraphBuilderModelInference>> inferences_;
+
+  std::mutex mutex_;
+  std::condition_variable tasks_available_;
+  // The tasks that were submitted, but not picked up by a worker yet. Guarded
+  // by `mutex_`.
+  std::deque<Task> tasks_;
+  // Set to true when the pool is being destroyed. Guarded by `mutex_`.
+  bool shutting_down_ = false;
+
+  std::vector<std::thread> workers_;
+};
+
+}  // namespace gematria
+
+#endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_GRAPH_BUILDER_MODEL_INFERENCE_POOL_H_
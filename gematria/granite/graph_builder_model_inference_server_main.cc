@@ -0,0 +1,317 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A long-running server that keeps a Gematria model loaded and answers
+// inference requests over a Unix domain socket. Concurrent requests from all
+// clients are merged into shared batches.
+//
+// The protocol is line-based. Each request is a single line that contains one
+// or more basic blocks in the hex format used in the BHive data set, separated
+// by whitespace. The response is a single line that contains the predictions
+// for the basic blocks separated by spaces; the predictions for a basic block
+// are the outputs of all tasks of the model separated by commas. When the
+// request can't be processed, the response is a single line starting with
+// "error: ". A client may send any number of requests over a connection.
+//
+// Typical usage:
+//   llvm-granite-server \
+//     --gematria_tflite_file models/granite_model.tflite \
+//     --gematria_socket_path /tmp/granite.sock
+//   echo "4889de4889c24c89ff" | socat - UNIX-CONNECT:/tmp/granite.sock
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/granite/batching_graph_builder_model_inference.h"
+#include "gematria/granite/graph_builder_model_inference.h"
+#include "gematria/llvm/canonicalizer.h"
+#include "gematria/llvm/disassembler.h"
+#include "gematria/llvm/llvm_architecture_support.h"
+#include "gematria/utils/string.h"
+#include "llvm/MC/MCInst.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Errc.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+#include "tensorflow/lite/model_builder.h"
+
+namespace gematria {
+namespace {
+
+namespace cl = llvm::cl;
+
+cl::opt<std::string> tflite_file(
+    "gematria_tflite_file", cl::value_desc("tflite_file"),
+    cl::desc("The path to the .tflite file that contains the trained model."));
+cl::opt<std::string> socket_path(
+    "gematria_socket_path", cl::value_desc("path"),
+    cl::desc("The path of the Unix domain socket on which the server listens."
+             " An existing file at this path is removed."));
+cl::opt<int> max_blocks_per_batch(
+    "gematria_max_blocks_per_batch", cl::init(0), cl::value_desc("num_blocks"),
+    cl::desc("The maximal number of blocks per batch. A request is never split"
+             " between batches; a request that alone exceeds the limit is put"
+             " into a batch of its own. When non-positive, the number of"
+             " blocks is not limited."));
+cl::opt<int> max_nodes_per_batch(
+    "gematria_max_nodes_per_batch", cl::init(100000),
+    cl::value_desc("num_nodes"),
+    cl::desc("A batch is closed as soon as the graphs of its blocks have at"
+             " least this many nodes. When non-positive, the number of nodes is"
+             " not limited."));
+cl::opt<int> max_batch_delay_us(
+    "gematria_max_batch_delay_us", cl::init(1000),
+    cl::value_desc("microseconds"),
+    cl::desc("The maximal time a request waits for other requests to join its"
+             " batch. Larger values give larger batches and higher throughput"
+             " under load, at the cost of latency."));
+cl::opt<int> num_threads(
+    "gematria_num_threads", cl::init(-1), cl::value_desc("num_threads"),
+    cl::desc("The number of threads used by the TensorFlow Lite interpreter."
+             " When -1, the number of threads is chosen by TensorFlow Lite."));
+cl::opt<bool> use_xnnpack(
+    "gematria_use_xnnpack", cl::init(false),
+    cl::desc("Run the ops supported by XNNPACK using the XNNPACK delegate."
+             " The remaining ops, including the custom ops, run on the"
+             " built-in kernels."));
+
+// Returns an error for the current value of `errno`.
+llvm::Error ErrorFromErrno(const char* operation) {
+  const std::error_code error_code(errno, std::generic_category());
+  return llvm::createStringError(error_code, "%s failed: %s", operation,
+                                 error_code.message().c_str());
+}
+
+// Writes all of `data` to `fd`. Returns false when the connection was closed.
+bool WriteAll(int fd, std::string_view data) {
+  while (!data.empty()) {
+    const ssize_t written = send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    data.remove_prefix(written);
+  }
+  return true;
+}
+
+// Handles a single client connection: reads requests from `fd` until the
+// client closes the connection and sends back the responses. Each connection
+// has its own LLVM thread context, so that the requests can be decoded in
+// parallel; the architecture support, the canonicalizer and the inference are
+// shared by all connections.
+class Connection {
+ public:
+  Connection(int fd, const LlvmArchitectureSupport& llvm_support,
+             const Canonicalizer& canonicalizer,
+             BatchingGraphBuilderModelInference& inference)
+      : fd_(fd),
+        thread_context_(llvm_support.CreateThreadContext()),
+        canonicalizer_(canonicalizer),
+        inference_(inference) {}
+
+  ~Connection() { close(fd_); }
+
+  void Run() {
+    std::string buffer;
+    char chunk[4096];
+    while (true) {
+      const ssize_t num_read = read(fd_, chunk, sizeof(chunk));
+      if (num_read < 0 && errno == EINTR) continue;
+      if (num_read <= 0) return;
+      buffer.append(chunk, num_read);
+      size_t line_begin = 0;
+      for (size_t line_end = buffer.find('\n'); line_end != std::string::npos;
+           line_end = buffer.find('\n', line_begin)) {
+        const std::string response = ProcessRequest(
+            std::string_view(buffer).substr(line_begin, line_end - line_begin));
+        if (!WriteAll(fd_, response)) return;
+        line_begin = line_end + 1;
+      }
+      buffer.erase(0, line_begin);
+    }
+  }
+
+ private:
+  // Returns the response for a single request line, including the trailing
+  // newline.
+  std::string ProcessRequest(std::string_view line) {
+    llvm::Expected<std::vector<BasicBlock>> blocks = ParseRequest(line);
+    if (llvm::Error error = blocks.takeError()) {
+      return "error: " + llvm::toString(std::move(error)) + "\n";
+    }
+    if (blocks->empty()) return "\n";
+    BatchingGraphBuilderModelInference::ResultType predictions =
+        inference_.Submit(std::move(*blocks)).get();
+    if (llvm::Error error = predictions.takeError()) {
+      return "error: " + llvm::toString(std::move(error)) + "\n";
+    }
+    std::string response;
+    llvm::raw_string_ostream out(response);
+    for (int i = 0; i < predictions->size(); ++i) {
+      if (i > 0) out << " ";
+      const GraphBuilderModelInference::OutputType& block_predictions =
+          (*predictions)[i];
+      for (int j = 0; j < block_predictions.size(); ++j) {
+        if (j > 0) out << ",";
+        out << llvm::format("%g", block_predictions[j]);
+      }
+    }
+    out << "\n";
+    out.flush();
+    return response;
+  }
+
+  // Parses and canonicalizes the basic blocks from a request line.
+  llvm::Expected<std::vector<BasicBlock>> ParseRequest(std::string_view line) {
+    std::vector<BasicBlock> blocks;
+    std::istringstream tokens{std::string(line)};
+    std::string hex;
+    while (tokens >> hex) {
+      auto machine_code = ParseHexString(hex);
+      if (!machine_code.has_value()) {
+        return llvm::createStringError(llvm::errc::invalid_argument,
+                                       "Can't parse basic block: %s",
+                                       hex.c_str());
+      }
+      llvm::Expected<std::vector<llvm::MCInst>> mc_insts =
+          DisassembleAllMCInsts(thread_context_->mc_disassembler(),
+                                *machine_code);
+      if (llvm::Error error = mc_insts.takeError()) return error;
+      blocks.push_back(canonicalizer_.BasicBlockFromMCInst(*mc_insts));
+    }
+    return blocks;
+  }
+
+  const int fd_;
+  const std::unique_ptr<LlvmThreadContext> thread_context_;
+  const Canonicalizer& canonicalizer_;
+  BatchingGraphBuilderModelInference& inference_;
+};
+
+// Creates a Unix domain socket listening at `path`.
+llvm::Expected<int> CreateListeningSocket(const std::string& path) {
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+    return llvm::createStringError(llvm::errc::invalid_argument,
+                                   "Invalid socket path: '%s'", path.c_str());
+  }
+  std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+
+  const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) return ErrorFromErrno("socket()");
+  unlink(path.c_str());
+  if (bind(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) <
+      0) {
+    llvm::Error error = ErrorFromErrno("bind()");
+    close(fd);
+    return error;
+  }
+  if (listen(fd, SOMAXCONN) < 0) {
+    llvm::Error error = ErrorFromErrno("listen()");
+    close(fd);
+    return error;
+  }
+  return fd;
+}
+
+llvm::Error ServeFromCommandLineFlags() {
+  const std::unique_ptr<tflite::FlatBufferModel> model =
+      tflite::FlatBufferModel::BuildFromFile(tflite_file.c_str());
+  if (model == nullptr) {
+    return llvm::createStringError(llvm::errc::io_error,
+                                   "Could not load the TfLite model.");
+  }
+  GraphBuilderModelInferenceOptions inference_options;
+  inference_options.num_threads = num_threads;
+  if (use_xnnpack) {
+    inference_options.delegate_factory =
+        GraphBuilderModelInferenceOptions::XnnpackDelegateFactory(num_threads);
+  }
+  llvm::Expected<std::unique_ptr<GraphBuilderModelInference>> inference =
+      GraphBuilderModelInference::FromTfLiteModel(model.get(),
+                                                  inference_options);
+  if (llvm::Error error = inference.takeError()) return error;
+  if (use_xnnpack && !(*inference)->delegate_applied()) {
+    llvm::errs() << "Could not apply the XNNPACK delegate, using the built-in"
+                    " kernels.\n";
+  }
+
+  BatchingOptions batching_options;
+  batching_options.max_blocks_per_batch = max_blocks_per_batch;
+  batching_options.max_nodes_per_batch = max_nodes_per_batch;
+  batching_options.max_batch_delay =
+      std::chrono::microseconds(max_batch_delay_us);
+  llvm::Expected<std::unique_ptr<BatchingGraphBuilderModelInference>>
+      batching_inference = BatchingGraphBuilderModelInference::Create(
+          **inference, batching_options);
+  if (llvm::Error error = batching_inference.takeError()) return error;
+
+  const std::shared_ptr<const LlvmArchitectureSupport> llvm_support =
+      LlvmArchitectureSupport::SharedX86_64();
+  const X86Canonicalizer canonicalizer(&llvm_support->target_machine());
+
+  llvm::Expected<int> listening_fd = CreateListeningSocket(socket_path);
+  if (llvm::Error error = listening_fd.takeError()) return error;
+  llvm::errs() << "Listening on " << socket_path << "\n";
+
+  while (true) {
+    const int fd = accept(*listening_fd, nullptr, nullptr);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      llvm::Error error = ErrorFromErrno("accept()");
+      close(*listening_fd);
+      return error;
+    }
+    // The connections are independent and the server runs until it is
+    // killed, so the connection threads are never joined.
+    std::thread([fd, &llvm_support = *llvm_support, &canonicalizer,
+                 &inference = **batching_inference]() {
+      Connection(fd, llvm_support, canonicalizer, inference).Run();
+    }).detach();
+  }
+}
+
+}  // namespace
+}  // namespace gematria
+
+int main(int argc, char* argv[]) {
+  llvm::cl::ParseCommandLineOptions(argc, argv);
+  // Clients may disconnect at any time; errors when writing to a closed
+  // socket are handled by the connection.
+  std::signal(SIGPIPE, SIG_IGN);
+  llvm::Error error = gematria::ServeFromCommandLineFlags();
+  if (error) {
+    llvm::errs() << error;
+    return 1;
+  }
+  return 0;
+}
@@ -14,124 +14,450 @@
 
 #include "gematria/granite/graph_builder_model_inference.h"
 
-#include <cassert>
-#include <cstddef>
-#include <cstdlib>
-#include <iostream>
-#include <iterator>
+#include <cstdint>
+#include <cstring>
+#include <functional>
 #include <memory>
 #include <string>
+#include <string_view>
 #include <utility>
 #include <vector>
 
-#include "absl/flags/flag.h"
-#include "absl/random/distributions.h"
-#include "absl/random/random.h"
-#include "absl/status/statusor.h"
-#include "absl/strings/string_view.h"
-#include "absl/types/source_location.h"
-#include "file/base/path.h"
+#include "flatbuffers/flatbuffers.h"
 #include "gematria/basic_block/basic_block.h"
-#include "gematria/basic_block/basic_block_protos.h"
-#include "gematria/llvm/llvm_to_absl.h"
-#include "gematria/testing/parse_proto.h"
+#include "gematria/granite/caching_graph_builder_model_inference.h"
+#include "gematria/granite/multi_model_graph_builder_model_inference.h"
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
-#include "llvm/Support/Debug.h"
+#include "llvm/ADT/SmallString.h"
 #include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FileUtilities.h"
+#include "llvm/Testing/Support/Error.h"
 #include "tensorflow/lite/model_builder.h"
-#include "testing/base/public/googletest.h"
+#include "tensorflow/lite/schema/schema_generated.h"
+
+#ifndef GEMATRIA_TEST_GRANITE_MODEL_PATH
+#error "GEMATRIA_TEST_GRANITE_MODEL_PATH must be defined by the build."
+#endif
 
 namespace gematria {
 namespace {
 
-using ::testing::ElementsAre;
 using ::testing::ElementsAreArray;
 using ::testing::FloatNear;
 using ::testing::Matcher;
+using ::testing::Not;
 using ::testing::SizeIs;
-using ::testing::status::IsOkAndHolds;
-
-// The tolerance used when matching the output of the model with the expected
-// results. Note that the output of the model is always the same, the tolerance
-// here is used to make the floating point literals in the matchers shorter and
-// more readable.
-constexpr float kTolerance = 1e-3;
-
-void AbortOnError(llvm::Error error) {
-  if (error) {
-    llvm::dbgs() << "Fatal error: " << error << "\n";
-    std::abort();
-  }
+
+// The path to a trained GRANITE model in the .tflite format.
+constexpr std::string_view kModelPath = GEMATRIA_TEST_GRANITE_MODEL_PATH;
+
+// The name of the special token tensor of the model, and the index of the
+// replacement token in the tensor; see graph_builder_model_inference.cc.
+constexpr std::string_view kSpecialTokensTensorName =
+    "GraphBuilderModelBase.special_tokens";
+constexpr int kSpecialNodeTokenReplacement = 4;
+
+// The quantization parameters of the quantized variant of the model. The
+// predictions of the test basic blocks are all within the range of the
+// quantized values.
+constexpr float kOutputScale = 2.0f;
+constexpr int kOutputZeroPoint = -128;
+
+Instruction MakeInstruction(std::string mnemonic, std::string llvm_mnemonic,
+                            std::vector<InstructionOperand> input_operands,
+                            std::vector<InstructionOperand> output_operands) {
+  return Instruction(std::move(mnemonic), std::move(llvm_mnemonic),
+                     /*prefixes=*/{}, std::move(input_operands),
+                     /*implicit_input_operands=*/{}, std::move(output_operands),
+                     /*implicit_output_operands=*/{});
 }
 
 // Basic blocks used in the tests.
-constexpr absl::string_view kBasicBlocks[] = {
-    R"pb(
-      canonicalized_instructions {
-        mnemonic: "MOV"
-        llvm_mnemonic: "MOV64rr"
-        output_operands { register_name: "RSI" }
-        input_operands { register_name: "RBX" }
-      }
-      canonicalized_instructions {
-        mnemonic: "MOV"
-        llvm_mnemonic: "MOV64rr"
-        output_operands { register_name: "RDX" }
-        input_operands { register_name: "RAX" }
-      }
-      canonicalized_instructions {
-        mnemonic: "MOV"
-        llvm_mnemonic: "MOV64rr"
-        output_operands { register_name: "RDI" }
-        input_operands { register_name: "R15" }
-      })pb",
-    R"pb(
-      canonicalized_instructions: {
-        mnemonic: "LEA"
-        llvm_mnemonic: "LEA64r"  # size=6
-        output_operands: { register_name: "RDI" }
-        input_operands: {
-          address: { base_register: "RBX" displacement: 8 scaling: 1 }
-        }
-      })pb",
-};
+BasicBlock ThreeMovs() {
+  return BasicBlock(
+      {MakeInstruction("MOV", "MOV64rr", {InstructionOperand::Register("RBX")},
+                       {InstructionOperand::Register("RSI")}),
+       MakeInstruction("MOV", "MOV64rr", {InstructionOperand::Register("RAX")},
+                       {InstructionOperand::Register("RDX")}),
+       MakeInstruction("MOV", "MOV64rr", {InstructionOperand::Register("R15")},
+                       {InstructionOperand::Register("RDI")})});
+}
+
+BasicBlock Lea(int64_t displacement) {
+  return BasicBlock({MakeInstruction(
+      "LEA", "LEA64r",
+      {InstructionOperand::Address(/*base_register=*/"RBX", displacement,
+                                   /*index_register=*/"", /*scaling=*/1,
+                                   /*segment_register=*/"")},
+      {InstructionOperand::Register("RDI")})});
+}
 
 // A basic block that uses an invalid token `SomeUnknownInstruction`. This token
 // should be recognized by the model and handled according to the way how the
 // model was constructed (i.e. the basic block should be ignored or the unknown
 // token should be replaced with a special replacement token).
-constexpr absl::string_view kBasicBlockWithInvalidToken = R"pb(
-  canonicalized_instructions: {
-    mnemonic: "SomeUnknownInstruction"
-    llvm_mnemonic: "LEA64r"  # size=6
-    output_operands: { register_name: "RDI" }
-    input_operands: {
-      address: { base_register: "RBX" displacement: 8 scaling: 1 }
+BasicBlock BlockWithInvalidToken() {
+  return BasicBlock({MakeInstruction(
+      "SomeUnknownInstruction", "LEA64r",
+      {InstructionOperand::Address(/*base_register=*/"RBX", /*displacement=*/8,
+                                   /*index_register=*/"", /*scaling=*/1,
+                                   /*segment_register=*/"")},
+      {InstructionOperand::Register("RDI")})});
+}
+
+// Returns a matcher that matches predictions that are within `tolerance` from
+// `expected`.
+Matcher<llvm::ArrayRef<float>> PredictionsNear(llvm::ArrayRef<float> expected,
+                                               float tolerance = 1e-5f) {
+  std::vector<Matcher<float>> element_matchers;
+  for (const float value : expected) {
+    element_matchers.push_back(FloatNear(value, tolerance));
+  }
+  return ElementsAreArray(element_matchers);
+}
+
+// Returns a copy of `model_data` modified by `modify`. The model is unpacked to
+// the object API of the TFLite schema, so that `modify` can change its tensors,
+// buffers, and operators.
+std::string ModifyModel(std::string_view model_data,
+                        const std::function<void(tflite::ModelT&)>& modify) {
+  std::unique_ptr<tflite::ModelT> model(
+      tflite::GetModel(model_data.data())->UnPack());
+  modify(*model);
+  flatbuffers::FlatBufferBuilder builder;
+  tflite::FinishModelBuffer(builder, tflite::Model::Pack(builder, model.get()));
+  return std::string(reinterpret_cast<const char*>(builder.GetBufferPointer()),
+                     builder.GetSize());
+}
+
+// Removes the replacement token from `model`, so that the model rejects basic
+// blocks with out-of-vocabulary tokens.
+void RemoveReplacementToken(tflite::ModelT& model) {
+  for (const std::unique_ptr<tflite::TensorT>& tensor :
+       model.subgraphs[0]->tensors) {
+    if (tensor->name != kSpecialTokensTensorName) continue;
+    std::vector<uint8_t>& data = model.buffers[tensor->buffer]->data;
+    ASSERT_GE(data.size(),
+              (kSpecialNodeTokenReplacement + 1) * sizeof(int32_t));
+    const int32_t no_replacement_token = -1;
+    std::memcpy(&data[kSpecialNodeTokenReplacement * sizeof(int32_t)],
+                &no_replacement_token, sizeof(no_replacement_token));
+    return;
+  }
+  FAIL() << "The special token tensor was not found";
+}
+
+// Adds a QUANTIZE op after the output of `model`, so that the output tensor of
+// the model has type int8.
+void QuantizeOutput(tflite::ModelT& model) {
+  tflite::SubGraphT& subgraph = *model.subgraphs[0];
+  const int32_t float_output = subgraph.outputs[0];
+  tflite::TensorT& float_output_tensor = *subgraph.tensors[float_output];
+
+  auto quantized_output_tensor = std::make_unique<tflite::TensorT>();
+  quantized_output_tensor->name = float_output_tensor.name;
+  quantized_output_tensor->type = tflite::TensorType_INT8;
+  quantized_output_tensor->shape = float_output_tensor.shape;
+  quantized_output_tensor->shape_signature =
+      float_output_tensor.shape_signature;
+  quantized_output_tensor->quantization =
+      std::make_unique<tflite::QuantizationParametersT>();
+  quantized_output_tensor->quantization->scale = {kOutputScale};
+  quantized_output_tensor->quantization->zero_point = {kOutputZeroPoint};
+  float_output_tensor.name += "_float";
+  subgraph.tensors.push_back(std::move(quantized_output_tensor));
+  const int32_t quantized_output =
+      static_cast<int32_t>(subgraph.tensors.size() - 1);
+
+  auto quantize_code = std::make_unique<tflite::OperatorCodeT>();
+  quantize_code->deprecated_builtin_code =
+      static_cast<int8_t>(tflite::BuiltinOperator_QUANTIZE);
+  quantize_code->builtin_code = tflite::BuiltinOperator_QUANTIZE;
+  quantize_code->version = 1;
+  model.operator_codes.push_back(std::move(quantize_code));
+
+  auto quantize = std::make_unique<tflite::OperatorT>();
+  quantize->opcode_index =
+      static_cast<uint32_t>(model.operator_codes.size() - 1);
+  quantize->inputs = {float_output};
+  quantize->outputs = {quantized_output};
+  subgraph.operators.push_back(std::move(quantize));
+  subgraph.outputs[0] = quantized_output;
+}
+
+class GraphBuilderModelInferenceTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    model_ = tflite::FlatBufferModel::BuildFromFile(kModelPath.data());
+    ASSERT_NE(model_, nullptr) << "Could not load " << kModelPath;
+    inference_ = CreateInference(*model_);
+  }
+
+  static std::unique_ptr<GraphBuilderModelInference> CreateInference(
+      const tflite::FlatBufferModel& model) {
+    llvm::Expected<std::unique_ptr<GraphBuilderModelInference>> inference =
+        GraphBuilderModelInference::FromTfLiteModel(&model);
+    EXPECT_THAT_EXPECTED(inference, llvm::Succeeded());
+    if (!inference) return nullptr;
+    return std::move(*inference);
+  }
+
+  // Loads a modified version of the model; see ModifyModel(). The model data
+  // is kept alive by the test fixture.
+  const tflite::FlatBufferModel* LoadModifiedModel(
+      const std::function<void(tflite::ModelT&)>& modify) {
+    const tflite::Allocation* const allocation = model_->allocation();
+    modified_model_data_.push_back(std::make_unique<std::string>(ModifyModel(
+        std::string_view(static_cast<const char*>(allocation->base()),
+                         allocation->bytes()),
+        modify)));
+    const std::string& data = *modified_model_data_.back();
+    modified_models_.push_back(
+        tflite::FlatBufferModel::BuildFromBuffer(data.data(), data.size()));
+    return modified_models_.back().get();
+  }
+
+  // Returns the predictions of `inference_` for `blocks`, computed in a
+  // single batch.
+  std::vector<GraphBuilderModelInference::OutputType> Predict(
+      const std::vector<BasicBlock>& blocks) {
+    inference_->Reset();
+    for (const BasicBlock& block : blocks) {
+      EXPECT_TRUE(inference_->AddBasicBlockToBatch(block));
     }
-  })pb";
-
-// Returns matchers for the expected outputs of the inference for the basic
-// blocks from kBasicBlocks.
-std::vector<Matcher<GraphBuilderModelInference::OutputType>>
-BasicBlockOutputMatchers() {
-  return {
-      ElementsAre(FloatNear(88.2726, kTolerance),
-                  FloatNear(101.896561, kTolerance),
-                  FloatNear(86.6651535, kTolerance)),
-      ElementsAre(FloatNear(37.455822, kTolerance),
-                  FloatNear(35.8950844, kTolerance),
-                  FloatNear(35.4254227, kTolerance)),
-  };
-}
-
-// Returns matchers for the expected output of the inference for
-// kBasicBlockWithInvalidToken.
-Matcher<GraphBuilderModelInference::OutputType>
-BasicBlockWithInvalidTokenOutputMatcher() {
-  return ElementsAre(FloatNear(37.6083946, kTolerance),
-                     FloatNear(36.3878174, kTolerance),
-                     FloatNear(36.2444115, kTolerance));
+    llvm::Expected<std::vector<GraphBuilderModelInference::OutputType>>
+        predictions = inference_->RunInference();
+    EXPECT_THAT_EXPECTED(predictions, llvm::Succeeded());
+    inference_->Reset();
+    if (!predictions) return {};
+    return std::move(*predictions);
+  }
+
+  std::unique_ptr<tflite::FlatBufferModel> model_;
+  std::unique_ptr<GraphBuilderModelInference> inference_;
+
+  std::vector<std::unique_ptr<std::string>> modified_model_data_;
+  std::vector<std::unique_ptr<tflite::FlatBufferModel>> modified_models_;
+};
+
+TEST_F(GraphBuilderModelInferenceTest, NoModel) {
+  EXPECT_THAT_EXPECTED(GraphBuilderModelInference::FromTfLiteModel(nullptr),
+                       llvm::Failed());
+}
+
+TEST_F(GraphBuilderModelInferenceTest, RunInference) {
+  const std::vector<GraphBuilderModelInference::OutputType> predictions =
+      Predict({ThreeMovs(), Lea(8)});
+  ASSERT_THAT(predictions, SizeIs(2));
+  EXPECT_THAT(predictions[0], Not(SizeIs(0)));
+  EXPECT_THAT(predictions[1], SizeIs(predictions[0].size()));
+
+  // The predictions do not depend on the other blocks in the batch.
+  const std::vector<GraphBuilderModelInference::OutputType> single =
+      Predict({Lea(8)});
+  ASSERT_THAT(single, SizeIs(1));
+  EXPECT_THAT(single[0], PredictionsNear(predictions[1]));
+}
+
+TEST_F(GraphBuilderModelInferenceTest, RejectsOutOfVocabularyToken) {
+  const tflite::FlatBufferModel* const model =
+      LoadModifiedModel(RemoveReplacementToken);
+  ASSERT_NE(model, nullptr);
+  std::unique_ptr<GraphBuilderModelInference> inference =
+      CreateInference(*model);
+  ASSERT_NE(inference, nullptr);
+  EXPECT_FALSE(inference->AddBasicBlockToBatch(BlockWithInvalidToken()));
+  EXPECT_EQ(inference->num_blocks_in_batch(), 0);
+  EXPECT_EQ(inference->num_nodes_in_batch(), 0);
+}
+
+TEST_F(GraphBuilderModelInferenceTest, DeduplicatesBlocks) {
+  ASSERT_TRUE(inference_->AddBasicBlockToBatch(ThreeMovs()));
+  ASSERT_TRUE(inference_->AddBasicBlockToBatch(Lea(8)));
+  const int num_nodes = inference_->num_nodes_in_batch();
+  const int num_edges = inference_->num_edges_in_batch();
+
+  // Duplicates, including blocks that differ only in address displacements,
+  // are counted as blocks, but they do not add any nodes or edges.
+  ASSERT_TRUE(inference_->AddBasicBlockToBatch(ThreeMovs()));
+  ASSERT_TRUE(inference_->AddBasicBlockToBatch(Lea(16)));
+  EXPECT_EQ(inference_->num_blocks_in_batch(), 4);
+  EXPECT_EQ(inference_->num_nodes_in_batch(), num_nodes);
+  EXPECT_EQ(inference_->num_edges_in_batch(), num_edges);
+
+  llvm::Expected<std::vector<GraphBuilderModelInference::OutputType>>
+      predictions = inference_->RunInference();
+  ASSERT_THAT_EXPECTED(predictions, llvm::Succeeded());
+  ASSERT_THAT(*predictions, SizeIs(4));
+  EXPECT_THAT((*predictions)[2], PredictionsNear((*predictions)[0]));
+  EXPECT_THAT((*predictions)[3], PredictionsNear((*predictions)[1]));
+}
+
+TEST_F(GraphBuilderModelInferenceTest, CountsOutOfVocabularyTokensOnDedupHits) {
+  // The model under test replaces out-of-vocabulary tokens.
+  ASSERT_TRUE(inference_->AddBasicBlockToBatch(BlockWithInvalidToken()));
+  EXPECT_EQ(inference_->out_of_vocabulary_token_counts().total(), 1);
+  const int num_nodes = inference_->num_nodes_in_batch();
+
+  // The second block reuses the graph of the first one, but its
+  // out-of-vocabulary token is still counted.
+  ASSERT_TRUE(inference_->AddBasicBlockToBatch(BlockWithInvalidToken()));
+  EXPECT_EQ(inference_->num_blocks_in_batch(), 2);
+  EXPECT_EQ(inference_->num_nodes_in_batch(), num_nodes);
+  EXPECT_EQ(inference_->out_of_vocabulary_token_counts().total(), 2);
+  EXPECT_THAT(inference_->out_of_vocabulary_token_counts().GetCounts(),
+              ::testing::ElementsAre(
+                  std::pair<std::string, int64_t>("SomeUnknownInstruction",
+                                                  2)));
+}
+
+TEST_F(GraphBuilderModelInferenceTest, PredictionsView) {
+  const std::vector<GraphBuilderModelInference::OutputType> expected =
+      Predict({ThreeMovs(), Lea(8)});
+  ASSERT_THAT(expected, SizeIs(2));
+
+  ASSERT_TRUE(inference_->AddBasicBlockToBatch(ThreeMovs()));
+  ASSERT_TRUE(inference_->AddBasicBlockToBatch(Lea(8)));
+  ASSERT_TRUE(inference_->AddBasicBlockToBatch(ThreeMovs()));
+  llvm::Expected<GraphBuilderModelInference::PredictionsView> view =
+      inference_->RunInferenceView();
+  ASSERT_THAT_EXPECTED(view, llvm::Succeeded());
+  ASSERT_EQ(view->num_blocks(), 3);
+  EXPECT_EQ(view->num_tasks(), static_cast<int>(expected[0].size()));
+  EXPECT_THAT((*view)[0], PredictionsNear(expected[0]));
+  EXPECT_THAT((*view)[1], PredictionsNear(expected[1]));
+  // The duplicate block shares the row of the output buffer.
+  EXPECT_EQ((*view)[2].data(), (*view)[0].data());
+}
+
+TEST_F(GraphBuilderModelInferenceTest, QuantizedOutput) {
+  const std::vector<GraphBuilderModelInference::OutputType> expected =
+      Predict({ThreeMovs(), Lea(8)});
+  ASSERT_THAT(expected, SizeIs(2));
+
+  const tflite::FlatBufferModel* const model =
+      LoadModifiedModel(QuantizeOutput);
+  ASSERT_NE(model, nullptr);
+  std::unique_ptr<GraphBuilderModelInference> inference =
+      CreateInference(*model);
+  ASSERT_NE(inference, nullptr);
+  ASSERT_TRUE(inference->AddBasicBlockToBatch(ThreeMovs()));
+  ASSERT_TRUE(inference->AddBasicBlockToBatch(Lea(8)));
+  llvm::Expected<std::vector<GraphBuilderModelInference::OutputType>>
+      predictions = inference->RunInference();
+  ASSERT_THAT_EXPECTED(predictions, llvm::Succeeded());
+  ASSERT_THAT(*predictions, SizeIs(2));
+  // The quantized values are rounded to the nearest multiple of the scale.
+  for (int i = 0; i < 2; ++i) {
+    EXPECT_THAT((*predictions)[i],
+                PredictionsNear(expected[i], kOutputScale / 2 + 1e-3f));
+  }
+}
+
+TEST_F(GraphBuilderModelInferenceTest, PredictionCache) {
+  const std::vector<GraphBuilderModelInference::OutputType> expected =
+      Predict({ThreeMovs(), Lea(8)});
+  ASSERT_THAT(expected, SizeIs(2));
+
+  PredictionCache cache(/*max_size=*/16,
+                        PredictionCache::ModelIdFromTfLiteModel(*model_));
+  CachingGraphBuilderModelInference caching_inference(inference_.get(),
+                                                      &cache);
+  EXPECT_TRUE(caching_inference.AddBasicBlockToBatch(ThreeMovs()));
+  EXPECT_TRUE(caching_inference.AddBasicBlockToBatch(Lea(8)));
+  llvm::Expected<std::vector<GraphBuilderModelInference::OutputType>>
+      predictions = caching_inference.RunInference();
+  ASSERT_THAT_EXPECTED(predictions, llvm::Succeeded());
+  ASSERT_THAT(*predictions, SizeIs(2));
+  EXPECT_THAT((*predictions)[0], PredictionsNear(expected[0]));
+  EXPECT_THAT((*predictions)[1], PredictionsNear(expected[1]));
+  EXPECT_EQ(caching_inference.num_cache_hits(), 0);
+  EXPECT_EQ(caching_inference.num_cache_misses(), 2);
+  EXPECT_EQ(cache.size(), 2);
+
+  // All blocks of the second batch are in the cache, including the block that
+  // differs only in the displacement.
+  caching_inference.Reset();
+  EXPECT_TRUE(caching_inference.AddBasicBlockToBatch(Lea(16)));
+  EXPECT_TRUE(caching_inference.AddBasicBlockToBatch(ThreeMovs()));
+  predictions = caching_inference.RunInference();
+  ASSERT_THAT_EXPECTED(predictions, llvm::Succeeded());
+  ASSERT_THAT(*predictions, SizeIs(2));
+  EXPECT_THAT((*predictions)[0], PredictionsNear(expected[1]));
+  EXPECT_THAT((*predictions)[1], PredictionsNear(expected[0]));
+  EXPECT_EQ(caching_inference.num_cache_hits(), 2);
+  EXPECT_EQ(caching_inference.num_cache_misses(), 2);
+}
+
+TEST_F(GraphBuilderModelInferenceTest, PredictionCacheFile) {
+  llvm::SmallString<128> file_name;
+  ASSERT_FALSE(
+      llvm::sys::fs::createTemporaryFile("prediction_cache", "bin", file_name));
+  llvm::FileRemover file_remover(file_name);
+
+  const std::string model_id = PredictionCache::ModelIdFromTfLiteModel(*model_);
+  PredictionCache cache(/*max_size=*/16, model_id);
+  CachingGraphBuilderModelInference caching_inference(inference_.get(),
+                                                      &cache);
+  EXPECT_TRUE(caching_inference.AddBasicBlockToBatch(ThreeMovs()));
+  EXPECT_TRUE(caching_inference.AddBasicBlockToBatch(Lea(8)));
+  ASSERT_THAT_EXPECTED(caching_inference.RunInference(), llvm::Succeeded());
+  ASSERT_THAT_ERROR(cache.SaveToFile(std::string(file_name)),
+                    llvm::Succeeded());
+
+  PredictionCache loaded_cache(/*max_size=*/16, model_id);
+  ASSERT_THAT_ERROR(loaded_cache.LoadFromFile(std::string(file_name)),
+                    llvm::Succeeded());
+  EXPECT_EQ(loaded_cache.size(), 2);
+
+  // The file is ignored by a cache for a different model.
+  PredictionCache other_model_cache(/*max_size=*/16, model_id + "_other");
+  ASSERT_THAT_ERROR(other_model_cache.LoadFromFile(std::string(file_name)),
+                    llvm::Succeeded());
+  EXPECT_EQ(other_model_cache.size(), 0);
+}
+
+TEST_F(GraphBuilderModelInferenceTest, MultiModel) {
+  const std::vector<GraphBuilderModelInference::OutputType> expected =
+      Predict({ThreeMovs(), Lea(8)});
+  ASSERT_THAT(expected, SizeIs(2));
+
+  const tflite::FlatBufferModel* const quantized_model =
+      LoadModifiedModel(QuantizeOutput);
+  ASSERT_NE(quantized_model, nullptr);
+  llvm::Expected<std::unique_ptr<MultiModelGraphBuilderModelInference>>
+      multi_model = MultiModelGraphBuilderModelInference::FromTfLiteModels(
+          {model_.get(), quantized_model});
+  ASSERT_THAT_EXPECTED(multi_model, llvm::Succeeded());
+  EXPECT_EQ((*multi_model)->num_models(), 2);
+
+  EXPECT_TRUE((*multi_model)->AddBasicBlockToBatch(ThreeMovs()));
+  EXPECT_TRUE((*multi_model)->AddBasicBlockToBatch(Lea(8)));
+  llvm::Expected<std::vector<
+      std::vector<MultiModelGraphBuilderModelInference::OutputType>>>
+      predictions = (*multi_model)->RunInference();
+  ASSERT_THAT_EXPECTED(predictions, llvm::Succeeded());
+  ASSERT_THAT(*predictions, SizeIs(2));
+  for (int model = 0; model < 2; ++model) {
+    SCOPED_TRACE(model);
+    const float tolerance = model == 0 ? 1e-5f : kOutputScale / 2 + 1e-3f;
+    ASSERT_THAT((*predictions)[model], SizeIs(2));
+    EXPECT_THAT((*predictions)[model][0],
+                PredictionsNear(expected[0], tolerance));
+    EXPECT_THAT((*predictions)[model][1],
+                PredictionsNear(expected[1], tolerance));
+  }
+}
+
+TEST_F(GraphBuilderModelInferenceTest, MultiModelRejectsDifferentTokens) {
+  const tflite::FlatBufferModel* const model_without_replacement =
+      LoadModifiedModel(RemoveReplacementToken);
+  ASSERT_NE(model_without_replacement, nullptr);
+  EXPECT_THAT_EXPECTED(MultiModelGraphBuilderModelInference::FromTfLiteModels(
+                           {model_.get(), model_without_replacement}),
+                       llvm::Failed());
 }
 
 }  // namespace
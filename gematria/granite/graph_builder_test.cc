@@ -15,8 +15,10 @@
 #include "gematria/granite/graph_builder.h"
 
 #include <algorithm>
+#include <cstdint>
 #include <iterator>
 #include <memory>
+#include <optional>
 #include <string>
 #include <utility>
 #include <vector>
@@ -24,6 +26,7 @@
 #include "absl/strings/string_view.h"
 #include "gematria/basic_block/basic_block.h"
 #include "gematria/basic_block/basic_block_protos.h"
+#include "gematria/basic_block/token_interner.h"
 #include "gematria/model/oov_token_behavior.h"
 #include "gematria/proto/basic_block.pb.h"
 #include "gematria/testing/parse_proto.h"
@@ -35,6 +38,7 @@ namespace {
 
 using ::testing::ElementsAre;
 using ::testing::IsEmpty;
+using ::testing::Pair;
 
 // Tokens used in the basic blocks in tests. For simplicity, we do not use the
 // full set of x86-64 tokens.
@@ -508,6 +512,547 @@ TEST_F(BasicBlockGraphBuilderTest, MultipleBasicBlocks) {
   EXPECT_THAT(builder_->DeltaBlockIndex(), ElementsAre(0, 1));
 }
 
+TEST_F(BasicBlockGraphBuilderTest, CopyOutlivesOriginal) {
+  CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  BasicBlockGraphBuilder builder_copy(*builder_);
+  builder_.reset();
+
+  const BasicBlock block = BasicBlockFromProto(ParseTextProto(R"pb(
+    canonicalized_instructions: {
+      mnemonic: "NOT"
+      llvm_mnemonic: "NOT64r"
+      output_operands: { register_name: "RCX" }
+      input_operands: { register_name: "RCX" }
+    })pb"));
+  ASSERT_TRUE(builder_copy.AddBasicBlock(block));
+  EXPECT_EQ(builder_copy.num_node_tokens(), std::size(kTokens));
+  EXPECT_THAT(
+      builder_copy.node_features(),
+      ElementsAre(TokenIndex("NOT"), TokenIndex("RCX"), TokenIndex("RCX")));
+}
+
+TEST_F(BasicBlockGraphBuilderTest, SparseGlobalFeatures) {
+  CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  ASSERT_TRUE(builder_->AddBasicBlock(BasicBlockFromProto(ParseTextProto(R"pb(
+    canonicalized_instructions: {
+      mnemonic: "NOT"
+      llvm_mnemonic: "NOT64r"
+      output_operands: { register_name: "RCX" }
+      input_operands: { register_name: "RCX" }
+    })pb"))));
+  // This block is rejected; it must not leave any global features behind.
+  ASSERT_FALSE(builder_->AddBasicBlock(BasicBlockFromProto(ParseTextProto(R"pb(
+    canonicalized_instructions: {
+      mnemonic: "NOT"
+      llvm_mnemonic: "NOT64r"
+      output_operands: { register_name: "RCX" }
+      input_operands: { register_name: "ThisRegisterDoesNotExist" }
+    })pb"))));
+  ASSERT_TRUE(builder_->AddBasicBlock(BasicBlockFromProto(ParseTextProto(R"pb(
+    canonicalized_instructions: {
+      mnemonic: "LEA"
+      llvm_mnemonic: "LEA64r"
+      output_operands: { register_name: "RDI" }
+      input_operands: {
+        address: { base_register: "RBX" displacement: 8 scaling: 1 }
+      }
+    })pb"))));
+
+  EXPECT_EQ(builder_->num_graphs(), 2);
+  EXPECT_THAT(builder_->num_global_features_per_block(), ElementsAre(2, 5));
+  EXPECT_THAT(builder_->sparse_global_feature_tokens(),
+              ElementsAre(TokenIndex("NOT"), TokenIndex("RCX"),
+                          TokenIndex(kImmediateToken),
+                          TokenIndex(kAddressToken), TokenIndex("LEA"),
+                          TokenIndex("RBX"), TokenIndex("RDI")));
+  EXPECT_THAT(builder_->sparse_global_feature_counts(),
+              ElementsAre(1, 2, 1, 1, 1, 1, 1));
+  EXPECT_THAT(
+      builder_->global_features(),
+      ElementsAre(ElementsAre(0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 2, 0, 0, 0, 0),
+                  ElementsAre(1, 0, 1, 0, 1, 0, 0, 0, 0, 0, 1, 0, 1, 0, 0, 0)));
+
+  builder_->Reset();
+  EXPECT_THAT(builder_->num_global_features_per_block(), IsEmpty());
+  EXPECT_THAT(builder_->sparse_global_feature_tokens(), IsEmpty());
+  EXPECT_THAT(builder_->sparse_global_feature_counts(), IsEmpty());
+  EXPECT_THAT(builder_->global_features(), IsEmpty());
+}
+
+TEST_F(BasicBlockGraphBuilderTest, FillMethods) {
+  CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  builder_->Reserve(/*num_blocks=*/2, /*num_nodes=*/16, /*num_edges=*/16);
+  ASSERT_TRUE(builder_->AddBasicBlock(BasicBlockFromProto(ParseTextProto(R"pb(
+    canonicalized_instructions: {
+      mnemonic: "NOT"
+      llvm_mnemonic: "NOT64r"
+      output_operands: { register_name: "RCX" }
+      input_operands: { register_name: "RCX" }
+    }
+    canonicalized_instructions: {
+      mnemonic: "LEA"
+      llvm_mnemonic: "LEA64r"
+      output_operands: { register_name: "RDI" }
+      input_operands: {
+        address: { base_register: "RBX" displacement: 8 scaling: 1 }
+      }
+    })pb"))));
+  ASSERT_TRUE(builder_->AddBasicBlock(BasicBlockFromProto(ParseTextProto(R"pb(
+    canonicalized_instructions: { mnemonic: "NOP" llvm_mnemonic: "NOOP" }
+  )pb"))));
+  EXPECT_EQ(builder_->num_instructions(), 3);
+
+  std::vector<int> edge_features(builder_->num_edges());
+  builder_->FillEdgeFeatures(edge_features.data());
+  EXPECT_EQ(edge_features, builder_->EdgeFeatures());
+
+  std::unique_ptr<bool[]> instruction_node_mask(
+      new bool[builder_->num_nodes()]);
+  builder_->FillInstructionNodeMask(instruction_node_mask.get());
+  EXPECT_EQ(std::vector<bool>(
+                instruction_node_mask.get(),
+                instruction_node_mask.get() + builder_->num_nodes()),
+            builder_->InstructionNodeMask());
+
+  std::vector<int> delta_block_index(builder_->num_instructions());
+  builder_->FillDeltaBlockIndex(delta_block_index.data());
+  EXPECT_THAT(delta_block_index, ElementsAre(0, 0, 1));
+  EXPECT_EQ(delta_block_index, builder_->DeltaBlockIndex());
+
+  std::vector<int> global_features(builder_->num_graphs() *
+                                   builder_->num_node_tokens());
+  builder_->FillGlobalFeatures(global_features.data());
+  std::vector<int> expected_global_features;
+  for (const std::vector<int>& row : builder_->global_features()) {
+    expected_global_features.insert(expected_global_features.end(),
+                                    row.begin(), row.end());
+  }
+  EXPECT_EQ(global_features, expected_global_features);
+
+  builder_->Reset();
+  EXPECT_EQ(builder_->num_instructions(), 0);
+}
+
+TEST_F(BasicBlockGraphBuilderTest, Append) {
+  CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  const std::vector<BasicBlock> blocks = {
+      BasicBlockFromProto(ParseTextProto(R"pb(
+        canonicalized_instructions: {
+          mnemonic: "NOT"
+          llvm_mnemonic: "NOT64r"
+          output_operands: { register_name: "RCX" }
+          input_operands: { register_name: "RCX" }
+        })pb")),
+      BasicBlockFromProto(ParseTextProto(R"pb(
+        canonicalized_instructions: {
+          mnemonic: "LEA"
+          llvm_mnemonic: "LEA64r"
+          output_operands: { register_name: "RDI" }
+          input_operands: {
+            address: { base_register: "RBX" displacement: 8 scaling: 1 }
+          }
+        })pb")),
+      BasicBlockFromProto(ParseTextProto(R"pb(
+        canonicalized_instructions: { mnemonic: "NOP" llvm_mnemonic: "NOOP" }
+      )pb"))};
+
+  // Add the first block to `builder_`, and the remaining blocks to a copy of
+  // the builder, then append the copy to `builder_`.
+  BasicBlockGraphBuilder shard(*builder_);
+  ASSERT_TRUE(builder_->AddBasicBlock(blocks[0]));
+  ASSERT_TRUE(shard.AddBasicBlock(blocks[1]));
+  ASSERT_TRUE(shard.AddBasicBlock(blocks[2]));
+  builder_->Append(shard);
+
+  BasicBlockGraphBuilder expected(shard);
+  expected.Reset();
+  for (const BasicBlock& block : blocks) {
+    ASSERT_TRUE(expected.AddBasicBlock(block));
+  }
+
+  EXPECT_EQ(builder_->num_graphs(), expected.num_graphs());
+  EXPECT_EQ(builder_->num_instructions(), expected.num_instructions());
+  EXPECT_EQ(builder_->num_nodes_per_block(), expected.num_nodes_per_block());
+  EXPECT_EQ(builder_->num_edges_per_block(), expected.num_edges_per_block());
+  EXPECT_EQ(builder_->node_types(), expected.node_types());
+  EXPECT_EQ(builder_->node_features(), expected.node_features());
+  EXPECT_EQ(builder_->edge_senders(), expected.edge_senders());
+  EXPECT_EQ(builder_->edge_receivers(), expected.edge_receivers());
+  EXPECT_EQ(builder_->edge_types(), expected.edge_types());
+  EXPECT_EQ(builder_->num_global_features_per_block(),
+            expected.num_global_features_per_block());
+  EXPECT_EQ(builder_->sparse_global_feature_tokens(),
+            expected.sparse_global_feature_tokens());
+  EXPECT_EQ(builder_->sparse_global_feature_counts(),
+            expected.sparse_global_feature_counts());
+  EXPECT_EQ(builder_->DeltaBlockIndex(), expected.DeltaBlockIndex());
+}
+
+TEST_F(BasicBlockGraphBuilderTest, SharedVocabulary) {
+  CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  const BasicBlock block = BasicBlockFromProto(ParseTextProto(R"pb(
+    canonicalized_instructions: {
+      mnemonic: "NOT"
+      llvm_mnemonic: "NOT64r"
+      output_operands: { register_name: "RCX" }
+      input_operands: { register_name: "RCX" }
+    })pb"));
+
+  // A copy of the graph builder and a graph builder created from the same
+  // vocabulary share it with the original graph builder.
+  const BasicBlockGraphBuilder copy(*builder_);
+  EXPECT_EQ(copy.vocabulary(), builder_->vocabulary());
+  BasicBlockGraphBuilder shared(builder_->vocabulary(), kImmediateToken,
+                                kFpImmediateToken, kAddressToken, kMemoryToken,
+                                OutOfVocabularyTokenBehavior::ReturnError());
+  EXPECT_EQ(shared.vocabulary(), builder_->vocabulary());
+  EXPECT_EQ(shared.num_node_tokens(), std::size(kTokens));
+  EXPECT_EQ(shared.VocabularyHash(), builder_->VocabularyHash());
+
+  ASSERT_TRUE(builder_->AddBasicBlock(block));
+  ASSERT_TRUE(shared.AddBasicBlock(block));
+  EXPECT_EQ(shared.node_features(), builder_->node_features());
+  EXPECT_EQ(shared.graph_hashes(), builder_->graph_hashes());
+  builder_->Append(shared);
+  EXPECT_EQ(builder_->num_graphs(), 2);
+
+  const TokenVocabulary& vocabulary = *builder_->vocabulary();
+  EXPECT_EQ(vocabulary.IndexOf("MOV"), TokenIndex("MOV"));
+  EXPECT_EQ(vocabulary.IndexOf("ADD"), -1);
+  EXPECT_EQ(vocabulary.IndexOf(TokenInterner::Global().Intern("RAX")),
+            TokenIndex("RAX"));
+  EXPECT_EQ(vocabulary.IndexOf(TokenInterner::Global().Intern("XMM0")), -1);
+}
+
+TEST_F(BasicBlockGraphBuilderTest, InstructionFragmentCache) {
+  CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  const BasicBlock block = BasicBlockFromProto(ParseTextProto(R"pb(
+    canonicalized_instructions: {
+      mnemonic: "MOV"
+      llvm_mnemonic: "MOV64rm"
+      output_operands: { register_name: "R14" }
+      input_operands: { memory: { alias_group_id: 1 } }
+      input_operands: { address: { base_register: "R15" scaling: 1 } }
+    }
+    canonicalized_instructions: {
+      mnemonic: "NOT"
+      llvm_mnemonic: "NOT64r"
+      output_operands: { register_name: "R14" }
+      input_operands: { register_name: "R14" }
+    }
+    canonicalized_instructions: {
+      mnemonic: "NOT"
+      llvm_mnemonic: "NOT64r"
+      output_operands: { register_name: "R14" }
+      input_operands: { register_name: "R14" }
+    }
+    canonicalized_instructions: {
+      mnemonic: "MOV"
+      llvm_mnemonic: "MOV64mr"
+      output_operands: { memory: { alias_group_id: 1 } }
+      input_operands: { register_name: "R14" }
+      input_operands: { address: { base_register: "R15" scaling: 1 } }
+    })pb"));
+
+  BasicBlockGraphBuilder expected(*builder_);
+  ASSERT_TRUE(expected.AddBasicBlock(block));
+  ASSERT_TRUE(expected.AddBasicBlock(block));
+
+  builder_->SetInstructionFragmentCacheSize(2);
+  ASSERT_TRUE(builder_->AddBasicBlock(block));
+  ASSERT_TRUE(builder_->AddBasicBlock(block));
+  // The cache is full after the first two distinct instructions.
+  EXPECT_EQ(builder_->num_cached_instruction_fragments(), 2);
+
+  // The graphs must be the same as the graphs created without the cache.
+  EXPECT_EQ(builder_->num_nodes_per_block(), expected.num_nodes_per_block());
+  EXPECT_EQ(builder_->num_edges_per_block(), expected.num_edges_per_block());
+  EXPECT_EQ(builder_->node_types(), expected.node_types());
+  EXPECT_EQ(builder_->node_features(), expected.node_features());
+  EXPECT_EQ(builder_->edge_senders(), expected.edge_senders());
+  EXPECT_EQ(builder_->edge_receivers(), expected.edge_receivers());
+  EXPECT_EQ(builder_->edge_types(), expected.edge_types());
+  EXPECT_EQ(builder_->sparse_global_feature_tokens(),
+            expected.sparse_global_feature_tokens());
+  EXPECT_EQ(builder_->sparse_global_feature_counts(),
+            expected.sparse_global_feature_counts());
+
+  builder_->SetInstructionFragmentCacheSize(0);
+  EXPECT_EQ(builder_->num_cached_instruction_fragments(), 0);
+}
+
+TEST_F(BasicBlockGraphBuilderTest, InstructionFragmentCache_Eviction) {
+  CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  const BasicBlock mov_block = BasicBlockFromProto(ParseTextProto(R"pb(
+    canonicalized_instructions: {
+      mnemonic: "MOV"
+      llvm_mnemonic: "MOV64rr"
+      output_operands: { register_name: "R14" }
+      input_operands: { register_name: "R15" }
+    })pb"));
+  const BasicBlock not_block = BasicBlockFromProto(ParseTextProto(R"pb(
+    canonicalized_instructions: {
+      mnemonic: "NOT"
+      llvm_mnemonic: "NOT64r"
+      output_operands: { register_name: "R14" }
+      input_operands: { register_name: "R14" }
+    })pb"));
+
+  BasicBlockGraphBuilder expected(*builder_);
+  for (const BasicBlock* block : {&mov_block, &not_block, &mov_block}) {
+    ASSERT_TRUE(expected.AddBasicBlock(*block));
+  }
+
+  // Each new instruction evicts the previous one, and the evicted MOV is
+  // compiled again.
+  builder_->SetInstructionFragmentCacheSize(1);
+  for (const BasicBlock* block : {&mov_block, &not_block, &mov_block}) {
+    ASSERT_TRUE(builder_->AddBasicBlock(*block));
+    EXPECT_EQ(builder_->num_cached_instruction_fragments(), 1);
+  }
+  EXPECT_EQ(builder_->node_types(), expected.node_types());
+  EXPECT_EQ(builder_->node_features(), expected.node_features());
+  EXPECT_EQ(builder_->edge_senders(), expected.edge_senders());
+  EXPECT_EQ(builder_->edge_receivers(), expected.edge_receivers());
+  EXPECT_EQ(builder_->edge_types(), expected.edge_types());
+
+  // Shrinking the cache evicts the entries that do not fit.
+  builder_->SetInstructionFragmentCacheSize(2);
+  ASSERT_TRUE(builder_->AddBasicBlock(not_block));
+  EXPECT_EQ(builder_->num_cached_instruction_fragments(), 2);
+  builder_->SetInstructionFragmentCacheSize(1);
+  EXPECT_EQ(builder_->num_cached_instruction_fragments(), 1);
+}
+
+TEST_F(BasicBlockGraphBuilderTest, InstructionFragmentCache_Copy) {
+  CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  const BasicBlock block = BasicBlockFromProto(ParseTextProto(R"pb(
+    canonicalized_instructions: {
+      mnemonic: "NOT"
+      llvm_mnemonic: "NOT64r"
+      output_operands: { register_name: "R14" }
+      input_operands: { register_name: "R14" }
+    })pb"));
+  builder_->SetInstructionFragmentCacheSize(16);
+  ASSERT_TRUE(builder_->AddBasicBlock(block));
+  EXPECT_EQ(builder_->num_cached_instruction_fragments(), 1);
+
+  // Copies start with an empty cache of the same size.
+  BasicBlockGraphBuilder copy(*builder_);
+  EXPECT_EQ(copy.num_cached_instruction_fragments(), 0);
+  copy.Reset();
+  ASSERT_TRUE(copy.AddBasicBlock(block));
+  EXPECT_EQ(copy.num_cached_instruction_fragments(), 1);
+  EXPECT_EQ(copy.node_features(), builder_->node_features());
+}
+
+TEST_F(BasicBlockGraphBuilderTest, InstructionViews) {
+  CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  const BasicBlockProto proto = ParseTextProto(R"pb(
+    canonicalized_instructions: {
+      mnemonic: "MOV"
+      llvm_mnemonic: "MOV64rm"
+      prefixes: "LOCK"
+      output_operands: { register_name: "R14" }
+      input_operands: { address: { base_register: "R15" scaling: 1 } }
+      input_operands: { memory: { alias_group_id: 1 } }
+    }
+    canonicalized_instructions: {
+      mnemonic: "NOT"
+      llvm_mnemonic: "NOT64r"
+      output_operands: { register_name: "R14" }
+      input_operands: { register_name: "R14" }
+    }
+    canonicalized_instructions: {
+      mnemonic: "NOT"
+      llvm_mnemonic: "NOT64r"
+      output_operands: { register_name: "R14" }
+      input_operands: { register_name: "R14" }
+    })pb");
+  const std::vector<InstructionProtoView> views = InstructionProtoViews(proto);
+
+  BasicBlockGraphBuilder expected(*builder_);
+  ASSERT_TRUE(expected.AddBasicBlock(BasicBlockFromProto(proto)));
+  ASSERT_TRUE(expected.AddBasicBlock(BasicBlockFromProto(proto)));
+
+  // Add the block once without the cache, and once with the cache, where the
+  // second NOT is replayed from the cache.
+  ASSERT_TRUE(builder_->AddBasicBlockFromInstructionViews(views));
+  builder_->SetInstructionFragmentCacheSize(16);
+  ASSERT_TRUE(builder_->AddBasicBlockFromInstructionViews(views));
+  EXPECT_EQ(builder_->num_cached_instruction_fragments(), 2);
+
+  EXPECT_EQ(builder_->num_instructions(), expected.num_instructions());
+  EXPECT_EQ(builder_->num_nodes_per_block(), expected.num_nodes_per_block());
+  EXPECT_EQ(builder_->num_edges_per_block(), expected.num_edges_per_block());
+  EXPECT_EQ(builder_->node_types(), expected.node_types());
+  EXPECT_EQ(builder_->node_features(), expected.node_features());
+  EXPECT_EQ(builder_->edge_senders(), expected.edge_senders());
+  EXPECT_EQ(builder_->edge_receivers(), expected.edge_receivers());
+  EXPECT_EQ(builder_->edge_types(), expected.edge_types());
+  EXPECT_EQ(builder_->sparse_global_feature_tokens(),
+            expected.sparse_global_feature_tokens());
+  EXPECT_EQ(builder_->sparse_global_feature_counts(),
+            expected.sparse_global_feature_counts());
+
+  EXPECT_FALSE(builder_->AddBasicBlockFromInstructionViews(
+      std::vector<InstructionProtoView>()));
+}
+
+TEST_F(BasicBlockGraphBuilderTest, InstructionFragmentCache_InvalidMnemonic) {
+  CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  builder_->SetInstructionFragmentCacheSize(16);
+  const BasicBlock block = BasicBlockFromProto(ParseTextProto(R"pb(
+    canonicalized_instructions: { mnemonic: "NOP" llvm_mnemonic: "NOOP" }
+    canonicalized_instructions: {
+      mnemonic: "ThisInstructionDoesNotExist"
+      llvm_mnemonic: "FOOBAR"
+    })pb"));
+  EXPECT_FALSE(builder_->AddBasicBlock(block));
+  EXPECT_FALSE(builder_->AddBasicBlock(block));
+  EXPECT_EQ(builder_->num_graphs(), 0);
+  EXPECT_EQ(builder_->num_nodes(), 0);
+  EXPECT_EQ(builder_->num_cached_instruction_fragments(), 1);
+}
+
+TEST_F(BasicBlockGraphBuilderTest, OutOfVocabularyTokenCounts) {
+  CreateBuilder(OutOfVocabularyTokenBehavior::ReplaceWithToken(
+      std::string(kUnknownToken)));
+  builder_->SetInstructionFragmentCacheSize(16);
+  const BasicBlock block = BasicBlockFromProto(ParseTextProto(R"pb(
+    canonicalized_instructions: {
+      mnemonic: "ThisInstructionDoesNotExist"
+      llvm_mnemonic: "FOOBAR"
+      output_operands: { register_name: "NOT_A_REGISTER" }
+    }
+    canonicalized_instructions: { mnemonic: "NOP" llvm_mnemonic: "NOOP" }
+    canonicalized_instructions: {
+      mnemonic: "ThisInstructionDoesNotExist"
+      llvm_mnemonic: "FOOBAR"
+    })pb"));
+  ASSERT_TRUE(builder_->AddBasicBlock(block));
+  // The second block is built from the fragment cache, and its tokens must be
+  // counted too.
+  ASSERT_TRUE(builder_->AddBasicBlock(block));
+
+  EXPECT_EQ(builder_->out_of_vocabulary_token_counts().total(), 6);
+  EXPECT_THAT(builder_->out_of_vocabulary_token_counts().GetCounts(),
+              ElementsAre(Pair("ThisInstructionDoesNotExist", 4),
+                          Pair("NOT_A_REGISTER", 2)));
+
+  // Copies of the builder share the counts, and Reset() does not clear them.
+  BasicBlockGraphBuilder copy = *builder_;
+  copy.Reset();
+  ASSERT_TRUE(copy.AddBasicBlock(block));
+  EXPECT_EQ(builder_->out_of_vocabulary_token_counts().total(), 9);
+
+  builder_->ResetOutOfVocabularyTokenCounts();
+  EXPECT_EQ(copy.out_of_vocabulary_token_counts().total(), 0);
+  EXPECT_THAT(copy.out_of_vocabulary_token_counts().GetCounts(), IsEmpty());
+}
+
+TEST_F(BasicBlockGraphBuilderTest,
+       OutOfVocabularyTokenCounts_InstructionViews) {
+  CreateBuilder(OutOfVocabularyTokenBehavior::ReplaceWithToken(
+      std::string(kUnknownToken)));
+  builder_->SetInstructionFragmentCacheSize(16);
+  const BasicBlockProto proto = ParseTextProto(R"pb(
+    canonicalized_instructions: {
+      mnemonic: "ThisInstructionDoesNotExist"
+      llvm_mnemonic: "FOOBAR"
+    })pb");
+  const std::vector<InstructionProtoView> views = InstructionProtoViews(proto);
+  ASSERT_TRUE(builder_->AddBasicBlockFromInstructionViews(views));
+  ASSERT_TRUE(builder_->AddBasicBlockFromInstructionViews(views));
+  EXPECT_THAT(builder_->out_of_vocabulary_token_counts().GetCounts(),
+              ElementsAre(Pair("ThisInstructionDoesNotExist", 2)));
+}
+
+TEST_F(BasicBlockGraphBuilderTest, OutOfVocabularyTokenCounts_ReturnError) {
+  CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  const BasicBlock block = BasicBlockFromProto(ParseTextProto(R"pb(
+    canonicalized_instructions: { mnemonic: "NOP" llvm_mnemonic: "NOOP" }
+    canonicalized_instructions: {
+      mnemonic: "ThisInstructionDoesNotExist"
+      llvm_mnemonic: "FOOBAR"
+      output_operands: { register_name: "NOT_A_REGISTER" }
+    })pb"));
+  EXPECT_FALSE(builder_->AddBasicBlock(block));
+  // Only the token that caused the block to be rejected is counted.
+  EXPECT_THAT(builder_->out_of_vocabulary_token_counts().GetCounts(),
+              ElementsAre(Pair("ThisInstructionDoesNotExist", 1)));
+}
+
+TEST_F(BasicBlockGraphBuilderTest, AddBasicBlockPrefixes) {
+  CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  const BasicBlock block = BasicBlockFromProto(ParseTextProto(R"pb(
+    canonicalized_instructions: {
+      mnemonic: "MOV"
+      llvm_mnemonic: "MOV64rm"
+      output_operands: { register_name: "R14" }
+      input_operands: { memory: { alias_group_id: 1 } }
+      input_operands: { address: { base_register: "R15" scaling: 1 } }
+    }
+    canonicalized_instructions: {
+      mnemonic: "NOT"
+      llvm_mnemonic: "NOT64r"
+      output_operands: { register_name: "R14" }
+      input_operands: { register_name: "R14" }
+    }
+    canonicalized_instructions: {
+      mnemonic: "LEA"
+      llvm_mnemonic: "LEA64r"
+      output_operands: { register_name: "RDI" }
+      input_operands: {
+        address: { base_register: "R14" displacement: 8 scaling: 1 }
+      }
+    })pb"));
+
+  BasicBlockGraphBuilder expected(*builder_);
+  ASSERT_TRUE(expected.AddBasicBlock(block));
+  for (int prefix_size = 1; prefix_size <= block.instructions.size();
+       ++prefix_size) {
+    ASSERT_TRUE(expected.AddBasicBlockFromInstructions(
+        std::vector<Instruction>(block.instructions.begin(),
+                                 block.instructions.begin() + prefix_size)));
+  }
+
+  ASSERT_TRUE(builder_->AddBasicBlock(block));
+  ASSERT_TRUE(builder_->AddBasicBlockPrefixes(block));
+
+  EXPECT_EQ(builder_->num_graphs(), 4);
+  EXPECT_EQ(builder_->num_instructions(), expected.num_instructions());
+  EXPECT_EQ(builder_->num_nodes_per_block(), expected.num_nodes_per_block());
+  EXPECT_EQ(builder_->num_edges_per_block(), expected.num_edges_per_block());
+  EXPECT_EQ(builder_->node_types(), expected.node_types());
+  EXPECT_EQ(builder_->node_features(), expected.node_features());
+  EXPECT_EQ(builder_->edge_senders(), expected.edge_senders());
+  EXPECT_EQ(builder_->edge_receivers(), expected.edge_receivers());
+  EXPECT_EQ(builder_->edge_types(), expected.edge_types());
+  EXPECT_EQ(builder_->num_global_features_per_block(),
+            expected.num_global_features_per_block());
+  EXPECT_EQ(builder_->sparse_global_feature_tokens(),
+            expected.sparse_global_feature_tokens());
+  EXPECT_EQ(builder_->sparse_global_feature_counts(),
+            expected.sparse_global_feature_counts());
+  EXPECT_EQ(builder_->DeltaBlockIndex(), expected.DeltaBlockIndex());
+}
+
+TEST_F(BasicBlockGraphBuilderTest, AddBasicBlockPrefixes_InvalidMnemonic) {
+  CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  EXPECT_FALSE(builder_->AddBasicBlockPrefixes(BasicBlock()));
+  EXPECT_FALSE(
+      builder_->AddBasicBlockPrefixes(BasicBlockFromProto(ParseTextProto(R"pb(
+        canonicalized_instructions: { mnemonic: "NOP" llvm_mnemonic: "NOOP" }
+        canonicalized_instructions: {
+          mnemonic: "ThisInstructionDoesNotExist"
+          llvm_mnemonic: "FOOBAR"
+        })pb"))));
+  EXPECT_EQ(builder_->num_graphs(), 0);
+  EXPECT_EQ(builder_->num_nodes(), 0);
+  EXPECT_EQ(builder_->num_edges(), 0);
+}
+
 TEST_F(BasicBlockGraphBuilderTest, TwoNops) {
   CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
   ASSERT_TRUE(builder_->AddBasicBlock(BasicBlockFromProto(ParseTextProto(R"pb(
@@ -516,5 +1061,162 @@ TEST_F(BasicBlockGraphBuilderTest, TwoNops) {
   )pb"))));
 }
 
+TEST_F(BasicBlockGraphBuilderTest, GraphHash) {
+  CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  const BasicBlock block = BasicBlockFromProto(ParseTextProto(R"pb(
+    canonicalized_instructions: {
+      mnemonic: "LEA"
+      llvm_mnemonic: "LEA64r"
+      output_operands: { register_name: "RDI" }
+      input_operands: {
+        address: { base_register: "RBX" displacement: 8 scaling: 1 }
+      }
+    }
+    canonicalized_instructions: {
+      mnemonic: "MOV"
+      llvm_mnemonic: "MOV64ri"
+      output_operands: { register_name: "RAX" }
+      input_operands: { immediate_value: 1 }
+    })pb"));
+  // The same graph as `block`, only the displacement and the immediate value
+  // are different.
+  const BasicBlock same_graph_block = BasicBlockFromProto(ParseTextProto(R"pb(
+    canonicalized_instructions: {
+      mnemonic: "LEA"
+      llvm_mnemonic: "LEA64r"
+      output_operands: { register_name: "RDI" }
+      input_operands: {
+        address: { base_register: "RBX" displacement: 16 scaling: 1 }
+      }
+    }
+    canonicalized_instructions: {
+      mnemonic: "MOV"
+      llvm_mnemonic: "MOV64ri"
+      output_operands: { register_name: "RAX" }
+      input_operands: { immediate_value: 42 }
+    })pb"));
+  const BasicBlock different_graph_block =
+      BasicBlockFromProto(ParseTextProto(R"pb(
+        canonicalized_instructions: {
+          mnemonic: "LEA"
+          llvm_mnemonic: "LEA64r"
+          output_operands: { register_name: "RDI" }
+          input_operands: {
+            address: { base_register: "RDI" displacement: 8 scaling: 1 }
+          }
+        }
+        canonicalized_instructions: {
+          mnemonic: "MOV"
+          llvm_mnemonic: "MOV64ri"
+          output_operands: { register_name: "RAX" }
+          input_operands: { immediate_value: 1 }
+        })pb"));
+  ASSERT_NE(block.Hash(), same_graph_block.Hash());
+
+  std::vector<uint64_t> prefix_graph_hashes;
+  std::vector<uint64_t> fragment_hashes;
+  const std::optional<uint64_t> hash = builder_->ComputeGraphHash(
+      block, &prefix_graph_hashes, &fragment_hashes);
+  ASSERT_TRUE(hash.has_value());
+  std::vector<uint64_t> same_graph_fragment_hashes;
+  EXPECT_EQ(builder_->ComputeGraphHash(same_graph_block, nullptr,
+                                       &same_graph_fragment_hashes),
+            hash);
+  EXPECT_EQ(same_graph_fragment_hashes, fragment_hashes);
+  std::vector<uint64_t> different_graph_fragment_hashes;
+  EXPECT_NE(builder_->ComputeGraphHash(different_graph_block, nullptr,
+                                       &different_graph_fragment_hashes),
+            hash);
+  ASSERT_EQ(different_graph_fragment_hashes.size(), 2);
+  EXPECT_NE(different_graph_fragment_hashes[0], fragment_hashes[0]);
+  EXPECT_EQ(different_graph_fragment_hashes[1], fragment_hashes[1]);
+  ASSERT_EQ(prefix_graph_hashes.size(), 2);
+  EXPECT_EQ(prefix_graph_hashes[1], *hash);
+  // Computing the hash does not add anything to the batch.
+  EXPECT_EQ(builder_->num_graphs(), 0);
+
+  // The hashes of the graphs in the batch are the same as the hashes computed
+  // in advance, regardless of the instruction fragment cache.
+  ASSERT_TRUE(builder_->AddBasicBlock(block));
+  builder_->SetInstructionFragmentCacheSize(16);
+  ASSERT_TRUE(builder_->AddBasicBlock(same_graph_block));
+  ASSERT_TRUE(builder_->AddBasicBlockPrefixes(block));
+  EXPECT_EQ(builder_->ComputeGraphHash(block), hash);
+  EXPECT_THAT(builder_->graph_hashes(),
+              ElementsAre(*hash, *hash, prefix_graph_hashes[0], *hash));
+  // The first two graphs are the same.
+  const int num_nodes = builder_->num_nodes_per_block()[0];
+  ASSERT_EQ(builder_->num_nodes_per_block()[1], num_nodes);
+  EXPECT_TRUE(std::equal(builder_->node_features().begin(),
+                         builder_->node_features().begin() + num_nodes,
+                         builder_->node_features().begin() + num_nodes));
+
+  builder_->Reset();
+  EXPECT_THAT(builder_->graph_hashes(), IsEmpty());
+}
+
+TEST_F(BasicBlockGraphBuilderTest, GraphHash_InvalidMnemonic) {
+  CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  const BasicBlock block = BasicBlockFromProto(ParseTextProto(R"pb(
+    canonicalized_instructions: {
+      mnemonic: "ThisInstructionDoesNotExist"
+      llvm_mnemonic: "FOOBAR"
+    })pb"));
+  EXPECT_EQ(builder_->ComputeGraphHash(block), std::nullopt);
+  EXPECT_EQ(builder_->ComputeGraphHash(BasicBlock()), std::nullopt);
+  // The tokens are counted only when the block is added.
+  EXPECT_EQ(builder_->out_of_vocabulary_token_counts().total(), 0);
+  builder_->CountOutOfVocabularyTokens(block);
+  EXPECT_THAT(builder_->out_of_vocabulary_token_counts().GetCounts(),
+              ElementsAre(Pair("ThisInstructionDoesNotExist", 1)));
+  EXPECT_EQ(builder_->num_graphs(), 0);
+}
+
+TEST_F(BasicBlockGraphBuilderTest, CountOutOfVocabularyTokens) {
+  CreateBuilder(OutOfVocabularyTokenBehavior::ReplaceWithToken(
+      std::string(kUnknownToken)));
+  builder_->SetInstructionFragmentCacheSize(16);
+  const BasicBlock block = BasicBlockFromProto(ParseTextProto(R"pb(
+    canonicalized_instructions: {
+      mnemonic: "ThisInstructionDoesNotExist"
+      llvm_mnemonic: "FOOBAR"
+      output_operands: { register_name: "NOT_A_REGISTER" }
+    }
+    canonicalized_instructions: { mnemonic: "NOP" llvm_mnemonic: "NOOP" }
+  )pb"));
+
+  // The tokens are counted the same way as when the block is added, but the
+  // block is not added to the batch.
+  ASSERT_TRUE(builder_->AddBasicBlock(block));
+  builder_->CountOutOfVocabularyTokens(block);
+  EXPECT_EQ(builder_->num_graphs(), 1);
+  EXPECT_THAT(builder_->out_of_vocabulary_token_counts().GetCounts(),
+              ElementsAre(Pair("NOT_A_REGISTER", 2),
+                          Pair("ThisInstructionDoesNotExist", 2)));
+}
+
+TEST_F(BasicBlockGraphBuilderTest, VocabularyHash) {
+  CreateBuilder(OutOfVocabularyTokenBehavior::ReturnError());
+  const uint64_t hash = builder_->VocabularyHash();
+  // The hash depends only on the vocabulary, not on the graphs in the batch.
+  BasicBlockGraphBuilder builder_copy(*builder_);
+  ASSERT_TRUE(
+      builder_copy.AddBasicBlock(BasicBlockFromProto(ParseTextProto(R"pb(
+        canonicalized_instructions: { mnemonic: "NOP" llvm_mnemonic: "NOOP" }
+      )pb"))));
+  EXPECT_EQ(builder_copy.VocabularyHash(), hash);
+
+  CreateBuilder(OutOfVocabularyTokenBehavior::ReplaceWithToken(
+      std::string(kUnknownToken)));
+  EXPECT_NE(builder_->VocabularyHash(), hash);
+
+  std::vector<std::string> tokens(std::begin(kTokens), std::end(kTokens));
+  std::swap(tokens[4], tokens[5]);
+  const BasicBlockGraphBuilder reordered_builder(
+      std::move(tokens), kImmediateToken, kFpImmediateToken, kAddressToken,
+      kMemoryToken);
+  EXPECT_NE(reordered_builder.VocabularyHash(), hash);
+}
+
 }  // namespace
 }  // namespace gematria
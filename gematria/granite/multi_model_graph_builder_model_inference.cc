@@ -0,0 +1,148 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/granite/multi_model_graph_builder_model_inference.h"
+
+#include <cassert>
+#include <memory>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "gematria/granite/graph_builder_model_inference.h"
+#include "gematria/utils/tracing.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/Support/Errc.h"
+#include "llvm/Support/Error.h"
+#include "tensorflow/lite/model_builder.h"
+
+namespace gematria {
+namespace {
+
+using OutputType = MultiModelGraphBuilderModelInference::OutputType;
+
+// Runs `inference` on the batch of `batch_source` and copies the predictions
+// out of the interpreter of `inference`.
+llvm::Expected<std::vector<OutputType>> RunModelOnBatch(
+    GraphBuilderModelInference& inference,
+    const GraphBuilderModelInference& batch_source) {
+  llvm::Expected<GraphBuilderModelInference::PredictionsView> predictions =
+      inference.RunInferenceViewOnBatchOf(batch_source);
+  if (llvm::Error error = predictions.takeError()) return error;
+  std::vector<OutputType> output;
+  output.reserve(predictions->num_blocks());
+  for (int i = 0; i < predictions->num_blocks(); ++i) {
+    const llvm::ArrayRef<float> block_predictions = (*predictions)[i];
+    output.emplace_back(block_predictions.begin(), block_predictions.end());
+  }
+  return output;
+}
+
+}  // namespace
+
+llvm::Expected<std::unique_ptr<MultiModelGraphBuilderModelInference>>
+MultiModelGraphBuilderModelInference::FromTfLiteModels(
+    const std::vector<const tflite::FlatBufferModel*>& models,
+    const GraphBuilderModelInferenceOptions& options, bool run_in_parallel) {
+  std::vector<std::unique_ptr<GraphBuilderModelInference>> inferences;
+  inferences.reserve(models.size());
+  for (const tflite::FlatBufferModel* const model : models) {
+    llvm::Expected<std::unique_ptr<GraphBuilderModelInference>> inference =
+        GraphBuilderModelInference::FromTfLiteModel(model, options);
+    if (llvm::Error error = inference.takeError()) return error;
+    inferences.push_back(std::move(*inference));
+  }
+  return Create(std::move(inferences), run_in_parallel);
+}
+
+llvm::Expected<std::unique_ptr<MultiModelGraphBuilderModelInference>>
+MultiModelGraphBuilderModelInference::Create(
+    std::vector<std::unique_ptr<GraphBuilderModelInference>> inferences,
+    bool run_in_parallel) {
+  if (inferences.empty()) {
+    return llvm::createStringError(llvm::errc::invalid_argument,
+                                   "At least one model is required");
+  }
+  for (int i = 0; i < inferences.size(); ++i) {
+    if (inferences[i] == nullptr) {
+      return llvm::createStringError(llvm::errc::invalid_argument,
+                                     "The inference object %d is nullptr", i);
+    }
+    if (inferences[i]->vocabulary_hash() !=
+        inferences.front()->vocabulary_hash()) {
+      return llvm::createStringError(
+          llvm::errc::invalid_argument,
+          "Model %d does not use the same node tokens and special tokens as "
+          "model 0",
+          i);
+    }
+  }
+  // We can't use std::make_unique<MultiModelGraphBuilderModelInference>(),
+  // because std::make_unique<>() requires a public constructor.
+  return std::unique_ptr<MultiModelGraphBuilderModelInference>(
+      new MultiModelGraphBuilderModelInference(std::move(inferences),
+                                               run_in_parallel));
+}
+
+MultiModelGraphBuilderModelInference::MultiModelGraphBuilderModelInference(
+    std::vector<std::unique_ptr<GraphBuilderModelInference>> inferences,
+    bool run_in_parallel)
+    : inferences_(std::move(inferences)), run_in_parallel_(run_in_parallel) {
+  assert(!inferences_.empty());
+}
+
+llvm::Expected<std::vector<std::vector<OutputType>>>
+MultiModelGraphBuilderModelInference::RunInference() {
+  GEMATRIA_TRACE_SCOPE("MultiModelGraphBuilderModelInference::RunInference");
+  const GraphBuilderModelInference& batch_source = *inferences_.front();
+  // llvm::Expected<> can't be default-constructed, so each model fills its
+  // slot in `results` when it is done.
+  std::vector<std::optional<llvm::Expected<std::vector<OutputType>>>> results(
+      inferences_.size());
+  auto run_model = [&](int model_index) {
+    results[model_index].emplace(
+        RunModelOnBatch(*inferences_[model_index], batch_source));
+  };
+  if (run_in_parallel_) {
+    // The batch is only read by the models, so they can all run at the same
+    // time; the first one runs on the calling thread.
+    std::vector<std::thread> threads;
+    threads.reserve(inferences_.size() - 1);
+    for (int i = 1; i < inferences_.size(); ++i) {
+      threads.emplace_back(run_model, i);
+    }
+    run_model(0);
+    for (std::thread& thread : threads) thread.join();
+  } else {
+    for (int i = 0; i < inferences_.size(); ++i) run_model(i);
+  }
+
+  std::vector<std::vector<OutputType>> output;
+  output.reserve(results.size());
+  llvm::Error errors = llvm::Error::success();
+  for (std::optional<llvm::Expected<std::vector<OutputType>>>& result :
+       results) {
+    assert(result.has_value());
+    if (llvm::Error error = result->takeError()) {
+      errors = llvm::joinErrors(std::move(errors), std::move(error));
+      continue;
+    }
+    output.push_back(std::move(**result));
+  }
+  if (errors) return errors;
+  return output;
+}
+
+}  // namespace gematria
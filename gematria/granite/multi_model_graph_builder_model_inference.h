@@ -0,0 +1,114 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_MULTI_MODEL_GRAPH_BUILDER_MODEL_INFERENCE_H_
+#define THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_MULTI_MODEL_GRAPH_BUILDER_MODEL_INFERENCE_H_
+
+#include <memory>
+#include <vector>
+
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/granite/graph_builder_model_inference.h"
+#include "llvm/Support/Error.h"
+#include "tensorflow/lite/model_builder.h"
+
+namespace gematria {
+
+// Runs inference with several trained GRANITE models that use the same node
+// tokens, e.g. one model per target microarchitecture, on the same basic
+// blocks. The graphs of the basic blocks are built only once, in the batch of
+// the first model, and all models run on this batch; each model has only its
+// own interpreter and input tensors. The cost of building the graphs thus does
+// not grow with the number of models.
+//
+// The class is not thread-safe. When `run_in_parallel` is set, RunInference()
+// runs the models on separate threads; each interpreter still uses the number
+// of threads from its options.
+//
+// Typical usage:
+//   auto inference = MultiModelGraphBuilderModelInference::FromTfLiteModels(
+//       {skylake_model.get(), zen2_model.get()});
+//   for (const BasicBlock& block : input_basic_blocks) {
+//     (*inference)->AddBasicBlockToBatch(block);
+//   }
+//   // predictions[i][j] is the prediction of the i-th model for the j-th
+//   // basic block.
+//   const auto predictions = (*inference)->RunInference();
+class MultiModelGraphBuilderModelInference {
+ public:
+  using OutputType = GraphBuilderModelInference::OutputType;
+
+  // Creates the inference object from models stored in the .tflite format.
+  // The interpreters of all models are created with `options`. Returns an
+  // error when `tflite_models` is empty, when one of the models can't be
+  // loaded (see GraphBuilderModelInference::FromTfLiteModel() for details), or
+  // when the models do not use the same node tokens and special tokens.
+  // Does not take ownership of the models; they must remain alive for the
+  // whole lifetime of the inference object.
+  static llvm::Expected<std::unique_ptr<MultiModelGraphBuilderModelInference>>
+  FromTfLiteModels(const std::vector<const tflite::FlatBufferModel*>& models,
+                   const GraphBuilderModelInferenceOptions& options = {},
+                   bool run_in_parallel = true);
+
+  // Creates the inference object from existing inference objects, one per
+  // model. Returns an error when `inferences` is empty or when the models do
+  // not use the same node tokens and special tokens.
+  static llvm::Expected<std::unique_ptr<MultiModelGraphBuilderModelInference>>
+  Create(std::vector<std::unique_ptr<GraphBuilderModelInference>> inferences,
+         bool run_in_parallel = true);
+
+  // Adds a basic block to the current batch of all models. Returns false when
+  // the basic block can't be added; see
+  // GraphBuilderModelInference::AddBasicBlockToBatch() for details.
+  bool AddBasicBlockToBatch(const BasicBlock& block) {
+    return inferences_.front()->AddBasicBlockToBatch(block);
+  }
+
+  // Returns the number of models.
+  int num_models() const { return static_cast<int>(inferences_.size()); }
+
+  // Returns the number of basic blocks in the current batch.
+  int num_blocks_in_batch() const {
+    return inferences_.front()->num_blocks_in_batch();
+  }
+
+  // Returns the number of nodes in the graphs of the current batch.
+  int num_nodes_in_batch() const {
+    return inferences_.front()->num_nodes_in_batch();
+  }
+
+  // Runs all models on the current batch. Returns one vector per model, in the
+  // order in which the models were passed to the factory function; each vector
+  // contains the predictions of the model for all basic blocks in the batch in
+  // the order in which they were added. Returns an error when running any of
+  // the models fails.
+  llvm::Expected<std::vector<std::vector<OutputType>>> RunInference();
+
+  // Removes all basic blocks from the current batch.
+  void Reset() { inferences_.front()->Reset(); }
+
+ private:
+  MultiModelGraphBuilderModelInference(
+      std::vector<std::unique_ptr<GraphBuilderModelInference>> inferences,
+      bool run_in_parallel);
+
+  // The inference objects for the models. The batch is built only in the
+  // first one; the other ones use it through RunInferenceViewOnBatchOf().
+  std::vector<std::unique_ptr<GraphBuilderModelInference>> inferences_;
+  const bool run_in_parallel_;
+};
+
+}  // namespace gematria
+
+#endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_MULTI_MODEL_GRAPH_BUILDER_MODEL_INFERENCE_H_
@@ -0,0 +1,114 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/granite/pipelined_graph_builder_model_inference.h"
+
+#include <cassert>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "gematria/granite/graph_builder_model_inference.h"
+#include "llvm/Support/Errc.h"
+#include "llvm/Support/Error.h"
+
+namespace gematria {
+
+llvm::Expected<std::unique_ptr<PipelinedGraphBuilderModelInference>>
+PipelinedGraphBuilderModelInference::Create(
+    const GraphBuilderModelInference& inference, int num_buffers) {
+  if (num_buffers <= 0) {
+    return llvm::createStringError(llvm::errc::invalid_argument,
+                                   "Invalid number of buffers: %d",
+                                   num_buffers);
+  }
+  std::vector<std::unique_ptr<GraphBuilderModelInference>> buffers;
+  buffers.reserve(num_buffers);
+  for (int i = 0; i < num_buffers; ++i) {
+    llvm::Expected<std::unique_ptr<GraphBuilderModelInference>> buffer =
+        inference.Clone();
+    if (llvm::Error error = buffer.takeError()) return error;
+    buffers.push_back(std::move(*buffer));
+  }
+
+  // We can't use std::make_unique<PipelinedGraphBuilderModelInference>(),
+  // because std::make_unique<>() requires a public constructor.
+  return std::unique_ptr<PipelinedGraphBuilderModelInference>(
+      new PipelinedGraphBuilderModelInference(std::move(buffers)));
+}
+
+PipelinedGraphBuilderModelInference::PipelinedGraphBuilderModelInference(
+    std::vector<std::unique_ptr<GraphBuilderModelInference>> buffers)
+    : buffers_(std::move(buffers)) {
+  assert(!buffers_.empty());
+  current_ = buffers_.front().get();
+  for (int i = 1; i < buffers_.size(); ++i) {
+    free_buffers_.push_back(buffers_[i].get());
+  }
+  inference_thread_ = std::thread([this]() { InferenceLoop(); });
+}
+
+PipelinedGraphBuilderModelInference::~PipelinedGraphBuilderModelInference() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    shutting_down_ = true;
+  }
+  tasks_available_.notify_all();
+  inference_thread_.join();
+}
+
+PipelinedGraphBuilderModelInference::FutureType
+PipelinedGraphBuilderModelInference::SubmitBatch() {
+  Task task{current_, std::promise<ResultType>()};
+  FutureType future = task.result.get_future();
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    assert(!shutting_down_);
+    tasks_.push_back(std::move(task));
+    tasks_available_.notify_one();
+    buffer_available_.wait(lock, [this]() { return !free_buffers_.empty(); });
+    current_ = free_buffers_.back();
+    free_buffers_.pop_back();
+  }
+  return future;
+}
+
+void PipelinedGraphBuilderModelInference::InferenceLoop() {
+  while (true) {
+    Task task;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      tasks_available_.wait(
+          lock, [this]() { return shutting_down_ || !tasks_.empty(); });
+      // Drain the queue before shutting down, so that all futures returned by
+      // SubmitBatch() eventually receive a value.
+      if (tasks_.empty()) return;
+      task = std::move(tasks_.front());
+      tasks_.pop_front();
+    }
+    ResultType predictions = task.inference->RunInference();
+    task.inference->Reset();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      free_buffers_.push_back(task.inference);
+    }
+    buffer_available_.notify_one();
+    task.result.set_value(std::move(predictions));
+  }
+}
+
+}  // namespace gematria
@@ -0,0 +1,135 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_PIPELINED_GRAPH_BUILDER_MODEL_INFERENCE_H_
+#define THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_PIPELINED_GRAPH_BUILDER_MODEL_INFERENCE_H_
+
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/granite/graph_builder_model_inference.h"
+#include "llvm/Support/Error.h"
+
+namespace gematria {
+
+// Runs inference with a trained GRANITE model as a two-stage pipeline: the
+// caller builds the graph of the next batch, while a background thread runs
+// the model on the previous batches. The batches are held in a fixed number of
+// buffers, each with its own GraphBuilderModelInference object; when all
+// buffers are waiting for the model, SubmitBatch() blocks until one of them is
+// free. This keeps the memory used by the pipeline bounded.
+//
+// The class is not thread-safe: AddBasicBlockToBatch() and SubmitBatch() must
+// be called from the same thread. The batches are processed in the order in
+// which they were submitted.
+//
+// Typical usage:
+//   auto pipeline = PipelinedGraphBuilderModelInference::Create(
+//       *inference, /* num_buffers = */ 2);
+//   std::vector<PipelinedGraphBuilderModelInference::FutureType> futures;
+//   for (const std::vector<BasicBlock>& batch : batches) {
+//     for (const BasicBlock& block : batch) {
+//       (*pipeline)->AddBasicBlockToBatch(block);
+//     }
+//     futures.push_back((*pipeline)->SubmitBatch());
+//   }
+//   for (auto& future : futures) {
+//     llvm::Expected<std::vector<OutputType>> predictions = future.get();
+//     ...
+//   }
+class PipelinedGraphBuilderModelInference {
+ public:
+  using OutputType = GraphBuilderModelInference::OutputType;
+  // The result of processing a single batch; see GraphBuilderModelInference::
+  // RunInference().
+  using ResultType = llvm::Expected<std::vector<OutputType>>;
+  using FutureType = std::future<ResultType>;
+
+  // Creates a pipeline with `num_buffers` buffers for `inference`. The buffers
+  // are created using GraphBuilderModelInference::Clone(), and `inference` is
+  // not used by the pipeline afterwards. With a single buffer, the graph of a
+  // batch is built only after the inference for the previous batch finishes.
+  // Returns an error when `num_buffers` is not positive or when the inference
+  // objects can't be created.
+  static llvm::Expected<std::unique_ptr<PipelinedGraphBuilderModelInference>>
+  Create(const GraphBuilderModelInference& inference, int num_buffers);
+
+  // Finishes processing of all submitted batches and stops the background
+  // thread. Discards the basic blocks added after the last SubmitBatch().
+  ~PipelinedGraphBuilderModelInference();
+
+  // Adds a basic block to the current batch and builds its graph on the calling
+  // thread. Returns true when the basic block was successfully added.
+  bool AddBasicBlockToBatch(const BasicBlock& block) {
+    return current_->AddBasicBlockToBatch(block);
+  }
+
+  // Returns the number of basic blocks, nodes, and edges in the current batch.
+  // See the methods of the same name of GraphBuilderModelInference.
+  int num_blocks_in_batch() const { return current_->num_blocks_in_batch(); }
+  int num_nodes_in_batch() const { return current_->num_nodes_in_batch(); }
+  int num_edges_in_batch() const { return current_->num_edges_in_batch(); }
+
+  // Schedules inference for the current batch and starts a new empty batch.
+  // Returns a future that receives the predictions for the blocks in the batch
+  // in the order in which they were added. Blocks while all buffers are
+  // waiting for inference.
+  FutureType SubmitBatch();
+
+  // Returns the number of buffers of the pipeline.
+  int num_buffers() const { return static_cast<int>(buffers_.size()); }
+
+ private:
+  // A batch waiting for inference.
+  struct Task {
+    GraphBuilderModelInference* inference;
+    std::promise<ResultType> result;
+  };
+
+  explicit PipelinedGraphBuilderModelInference(
+      std::vector<std::unique_ptr<GraphBuilderModelInference>> buffers);
+
+  // The main loop of the background thread. Takes tasks from `tasks_`, runs
+  // the inference, and returns the buffers to `free_buffers_`.
+  void InferenceLoop();
+
+  // The inference objects used as the buffers of the pipeline.
+  std::vector<std::unique_ptr<GraphBuilderModelInference>> buffers_;
+  // The buffer that receives the blocks of the current batch. Used only by the
+  // thread that calls AddBasicBlockToBatch() and SubmitBatch().
+  GraphBuilderModelInference* current_ = nullptr;
+
+  std::mutex mutex_;
+  std::condition_variable tasks_available_;
+  std::condition_variable buffer_available_;
+  // The submitted batches that were not processed yet. Guarded by `mutex_`.
+  std::deque<Task> tasks_;
+  // The buffers that are neither the current batch nor waiting for inference.
+  // Guarded by `mutex_`.
+  std::vector<GraphBuilderModelInference*> free_buffers_;
+  // Set to true when the pipeline is being destroyed. Guarded by `mutex_`.
+  bool shutting_down_ = false;
+
+  std::thread inference_thread_;
+};
+
+}  // namespace gematria
+
+#endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_GRANITE_PIPELINED_GRAPH_BUILDER_MODEL_INFERENCE_H_
@@ -0,0 +1,217 @@
+# Copyright 2023 Google Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#    http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""Fuses gather + unsorted segment sum in a .tflite model into a single op.
+
+The message passing in graph_nets models gathers the features of the sender
+(or receiver) nodes of each edge with tf.gather() and then aggregates them with
+tf.math.unsorted_segment_sum(). The TensorFlow Lite converter exports these as
+a GATHER op followed by the UnsortedSegmentSum custom op, and the result of the
+GATHER op is an [num_edges, feature_size] tensor that is used only as the input
+of the segment sum.
+
+This tool rewrites each such pair of ops into a single GatherSegmentSum custom
+op implemented in gematria/tflite/gather_segment_sum_op.cc, which computes the
+same result without materializing the gathered tensor. The rewrite is done
+only when the GATHER op gathers along the first axis with int32 indices, and
+when its output is not used by any other op or as an output of the model.
+
+Typical use:
+  fuse_gather_segment_sum \
+    --gematria_input_tflite /tmp/gnn.tflite \
+    --gematria_output_tflite /tmp/gnn_fused.tflite
+"""
+
+from typing import Optional
+
+from absl import app
+from absl import flags
+from absl import logging
+from tensorflow.lite.python import schema_py_generated as schema_fb
+from tensorflow.lite.tools import flatbuffer_utils
+
+_INPUT_TFLITE = flags.DEFINE_string(
+    'gematria_input_tflite',
+    None,
+    'The path to the input model in the .tflite format.',
+    required=True,
+)
+_OUTPUT_TFLITE = flags.DEFINE_string(
+    'gematria_output_tflite',
+    None,
+    (
+        'The path to the output model in the .tflite format. Can be the same'
+        ' as --gematria_input_tflite.'
+    ),
+    required=True,
+)
+
+# The names of the custom ops. These must match the names used in the C++ code
+# in gematria/tflite.
+_UNSORTED_SEGMENT_SUM_OP_NAME = b'UnsortedSegmentSum'
+_GATHER_SEGMENT_SUM_OP_NAME = b'GatherSegmentSum'
+
+
+def _builtin_code(operator_code: schema_fb.OperatorCodeT) -> int:
+  """Returns the builtin code of an operator code.
+
+  Models may store the builtin code in either of the two fields depending on
+  the version of the schema used to create them.
+
+  Args:
+    operator_code: The operator code from the model.
+
+  Returns:
+    The builtin code of the operator.
+  """
+  return max(operator_code.builtinCode, operator_code.deprecatedBuiltinCode)
+
+
+def _custom_code(operator_code: schema_fb.OperatorCodeT) -> Optional[bytes]:
+  """Returns the custom code of an operator code as bytes, or None."""
+  custom_code = operator_code.customCode
+  if isinstance(custom_code, str):
+    return custom_code.encode()
+  return custom_code
+
+
+def _get_or_add_custom_operator_code(
+    model: schema_fb.ModelT, custom_code: bytes
+) -> int:
+  """Returns the index of the operator code of a custom op.
+
+  Adds the operator code to the model when it is not there yet.
+
+  Args:
+    model: The model to look up or add the operator code in.
+    custom_code: The name of the custom op.
+
+  Returns:
+    The index of the operator code in `model.operatorCodes`.
+  """
+  for index, operator_code in enumerate(model.operatorCodes):
+    if (
+        _builtin_code(operator_code) == schema_fb.BuiltinOperator.CUSTOM
+        and _custom_code(operator_code) == custom_code
+    ):
+      return index
+  operator_code = schema_fb.OperatorCodeT()
+  operator_code.builtinCode = schema_fb.BuiltinOperator.CUSTOM
+  operator_code.deprecatedBuiltinCode = schema_fb.BuiltinOperator.CUSTOM
+  operator_code.customCode = custom_code
+  operator_code.version = 1
+  model.operatorCodes.append(operator_code)
+  return len(model.operatorCodes) - 1
+
+
+def _is_fusable_gather(
+    model: schema_fb.ModelT,
+    subgraph: schema_fb.SubGraphT,
+    operator: schema_fb.OperatorT,
+) -> bool:
+  """Checks that `operator` is a GATHER op that can be fused."""
+  operator_code = model.operatorCodes[operator.opcodeIndex]
+  if _builtin_code(operator_code) != schema_fb.BuiltinOperator.GATHER:
+    return False
+  if len(operator.inputs) != 2 or len(operator.outputs) != 1:
+    return False
+  options = operator.builtinOptions
+  if options is not None and (options.axis != 0 or options.batchDims != 0):
+    return False
+  params = subgraph.tensors[operator.inputs[0]]
+  indices = subgraph.tensors[operator.inputs[1]]
+  return (
+      params.type == schema_fb.TensorType.FLOAT32
+      and indices.type == schema_fb.TensorType.INT32
+  )
+
+
+def fuse_gather_segment_sum(model: schema_fb.ModelT) -> int:
+  """Fuses gather + unsorted segment sum in all subgraphs of `model`.
+
+  Modifies the model in place.
+
+  Args:
+    model: The model to transform.
+
+  Returns:
+    The number of fused pairs of ops.
+  """
+  num_fused = 0
+  fused_opcode_index = None
+  for subgraph in model.subgraphs:
+    producers = {}
+    num_consumers = {}
+    for operator_index, operator in enumerate(subgraph.operators):
+      for tensor in operator.outputs:
+        producers[tensor] = operator_index
+      for tensor in operator.inputs:
+        num_consumers[tensor] = num_consumers.get(tensor, 0) + 1
+    subgraph_outputs = set(subgraph.outputs)
+
+    removed_operators = set()
+    for operator in subgraph.operators:
+      operator_code = model.operatorCodes[operator.opcodeIndex]
+      if (
+          _builtin_code(operator_code) != schema_fb.BuiltinOperator.CUSTOM
+          or _custom_code(operator_code) != _UNSORTED_SEGMENT_SUM_OP_NAME
+          or len(operator.inputs) != 3
+      ):
+        continue
+      data, segment_ids, num_segments = operator.inputs
+      gather_index = producers.get(data)
+      if (
+          gather_index is None
+          or gather_index in removed_operators
+          or num_consumers.get(data, 0) != 1
+          or data in subgraph_outputs
+      ):
+        continue
+      gather = subgraph.operators[gather_index]
+      if not _is_fusable_gather(model, subgraph, gather):
+        continue
+      if subgraph.tensors[segment_ids].type != schema_fb.TensorType.INT32:
+        continue
+
+      if fused_opcode_index is None:
+        fused_opcode_index = _get_or_add_custom_operator_code(
+            model, _GATHER_SEGMENT_SUM_OP_NAME
+        )
+      params, indices = gather.inputs
+      operator.opcodeIndex = fused_opcode_index
+      operator.inputs = [params, indices, segment_ids, num_segments]
+      removed_operators.add(gather_index)
+      num_fused += 1
+
+    # The output tensors of the removed GATHER ops are left in the tensor list
+    # of the subgraph; they are not used by any op and TFLite does not allocate
+    # memory for them.
+    subgraph.operators = [
+        operator
+        for operator_index, operator in enumerate(subgraph.operators)
+        if operator_index not in removed_operators
+    ]
+  return num_fused
+
+
+def main(argv):
+  if len(argv) > 1:
+    raise app.UsageError('Too many command-line arguments.')
+  model = flatbuffer_utils.read_model(_INPUT_TFLITE.value)
+  num_fused = fuse_gather_segment_sum(model)
+  logging.info('Fused %d gather + segment sum pairs.', num_fused)
+  flatbuffer_utils.write_model(model, _OUTPUT_TFLITE.value)
+
+
+if __name__ == '__main__':
+  app.run(main)
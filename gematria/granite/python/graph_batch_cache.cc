@@ -0,0 +1,81 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/granite/graph_batch_cache.h"
+
+#include <cstddef>
+#include <cstdint>
+
+#include "gematria/granite/graph_builder.h"
+#include "pybind11/cast.h"
+#include "pybind11/pybind11.h"
+#include "pybind11_abseil/import_status_module.h"
+#include "pybind11_abseil/status_casters.h"
+
+namespace gematria {
+namespace {
+
+namespace py = ::pybind11;
+
+constexpr const char* const kModuleDocstring =
+    R"(A memory-mapped cache of basic block graph batches.
+
+See the comments in the C++ version of the classes for more details on the file
+format. The batches are loaded into BasicBlockGraphBuilder objects from the
+graph_builder module.)";
+
+PYBIND11_MODULE(graph_batch_cache, m) {
+  m.doc() = kModuleDocstring;
+
+  py::google::ImportStatusModule();
+  // Registers the BasicBlockGraphBuilder type used by the methods below.
+  py::module::import("gematria.granite.python.graph_builder");
+
+  py::class_<GraphBatchCacheWriter>(m, "GraphBatchCacheWriter")
+      .def(py::init<uint64_t /* vocabulary_hash */, int /* num_node_tokens */
+                    >(),
+           py::arg("vocabulary_hash"), py::arg("num_node_tokens"))
+      .def("add_batch", &GraphBatchCacheWriter::AddBatch,
+           py::arg("graph_builder"))
+      .def("write", &GraphBatchCacheWriter::Write, py::arg("path"),
+           py::call_guard<py::gil_scoped_release>())
+      .def_property_readonly("num_batches",
+                             &GraphBatchCacheWriter::num_batches);
+
+  py::class_<GraphBatchCache>(m, "GraphBatchCache")
+      .def_static("open", &GraphBatchCache::Open, py::arg("path"),
+                  py::arg("vocabulary_hash"),
+                  py::call_guard<py::gil_scoped_release>(),
+                  R"(Maps the cache file to memory.
+
+          Raises:
+            StatusNotOk: When the file is not a valid cache file, or when it was
+              created with a different vocabulary hash.)")
+      .def_property_readonly("num_batches", &GraphBatchCache::num_batches)
+      .def(
+          "load_batch",
+          [](const GraphBatchCache& self, size_t batch_index,
+             BasicBlockGraphBuilder& graph_builder) {
+            if (batch_index >= self.num_batches()) {
+              throw py::index_error("Batch index out of range");
+            }
+            py::gil_scoped_release release_gil;
+            self.LoadBatch(batch_index, graph_builder);
+          },
+          py::arg("batch_index"), py::arg("graph_builder"),
+          R"(Replaces the batch of `graph_builder` with a cached batch.)");
+}
+
+}  // namespace
+}  // namespace gematria
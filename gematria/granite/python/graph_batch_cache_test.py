@@ -0,0 +1,96 @@
+# Copyright 2023 Google Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#    http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import os
+
+from absl.testing import absltest
+from gematria.basic_block.python import tokens
+from gematria.granite.python import graph_batch_cache
+from gematria.granite.python import graph_builder
+from gematria.model.python import oov_token_behavior
+from gematria.testing.python import basic_blocks_with_throughput
+import numpy as np
+from pybind11_abseil import status
+
+_OutOfVocabularyTokenBehavior = oov_token_behavior.OutOfVocabularyTokenBehavior
+
+
+class GraphBatchCacheTest(
+    basic_blocks_with_throughput.TestCase, absltest.TestCase
+):
+  """Test for the GraphBatchCache class wrapper.
+
+  Most of the functionality is tested in the corresponding cc_test(). Here we
+  test just that the batches survive a round trip through the cache.
+  """
+
+  def setUp(self):
+    self.num_blocks = 10
+    super().setUp()
+    self.path = os.path.join(self.create_tempdir().full_path, 'batches.gmgb')
+
+  def create_builder(self):
+    return graph_builder.BasicBlockGraphBuilder(
+        node_tokens=self.tokens,
+        immediate_token=tokens.IMMEDIATE,
+        fp_immediate_token=tokens.IMMEDIATE,
+        address_token=tokens.ADDRESS,
+        memory_token=tokens.MEMORY,
+        out_of_vocabulary_behavior=_OutOfVocabularyTokenBehavior.return_error(),
+    )
+
+  def test_round_trip(self):
+    builder = self.create_builder()
+    writer = graph_batch_cache.GraphBatchCacheWriter(
+        builder.vocabulary_hash, builder.num_node_tokens
+    )
+    self.assertTrue(all(builder.add_basic_blocks(self.blocks[:4])))
+    writer.add_batch(builder)
+    expected_node_features = np.array(builder.node_features)
+    expected_edge_senders = np.array(builder.edge_senders)
+    builder.reset()
+    self.assertTrue(all(builder.add_basic_blocks(self.blocks[4:])))
+    writer.add_batch(builder)
+    self.assertEqual(writer.num_batches, 2)
+    writer.write(self.path)
+
+    cache = graph_batch_cache.GraphBatchCache.open(
+        self.path, builder.vocabulary_hash
+    )
+    self.assertEqual(cache.num_batches, 2)
+    loaded_builder = self.create_builder()
+    cache.load_batch(0, loaded_builder)
+    self.assertEqual(loaded_builder.num_graphs, 4)
+    np.testing.assert_array_equal(
+        loaded_builder.node_features, expected_node_features
+    )
+    np.testing.assert_array_equal(
+        loaded_builder.edge_senders, expected_edge_senders
+    )
+    with self.assertRaises(IndexError):
+      cache.load_batch(2, loaded_builder)
+
+  def test_different_vocabulary(self):
+    builder = self.create_builder()
+    graph_batch_cache.GraphBatchCacheWriter(
+        builder.vocabulary_hash, builder.num_node_tokens
+    ).write(self.path)
+    with self.assertRaises(status.StatusNotOk):
+      graph_batch_cache.GraphBatchCache.open(
+          self.path, builder.vocabulary_hash + 1
+      )
+
+
+if __name__ == '__main__':
+  absltest.main()
@@ -0,0 +1,154 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/granite/graph_batch_reader.h"
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "absl/status/statusor.h"
+#include "pybind11/cast.h"
+#include "pybind11/detail/common.h"
+#include "pybind11/numpy.h"
+#include "pybind11/pybind11.h"
+#include "pybind11/stl.h"
+#include "pybind11_abseil/import_status_module.h"
+#include "pybind11_abseil/status_casters.h"
+
+namespace gematria {
+namespace {
+
+namespace py = ::pybind11;
+
+constexpr const char* const kModuleDocstring =
+    R"(A prefetching reader of basic block graph batches.
+
+See the comments in the C++ version of the class for more details on the
+batching and padding of the graphs. The batches are returned as dicts of NumPy
+arrays that use the names of the corresponding BasicBlockGraphBuilder
+properties.)";
+
+// Returns a NumPy array of the given shape that takes ownership of `values`
+// without copying them. `ArrayType` may differ from `T` only in the type name,
+// not in the representation, e.g. bool and uint8_t.
+template <typename ArrayType, typename T>
+py::array_t<ArrayType> ToArray(std::vector<T> values,
+                               std::vector<py::ssize_t> shape) {
+  static_assert(sizeof(ArrayType) == sizeof(T));
+  auto owned = std::make_unique<std::vector<T>>(std::move(values));
+  const ArrayType* const data =
+      reinterpret_cast<const ArrayType*>(owned->data());
+  py::capsule owner(owned.get(), [](void* vector) {
+    delete static_cast<std::vector<T>*>(vector);
+  });
+  owned.release();
+  return py::array_t<ArrayType>(std::move(shape), data, owner);
+}
+
+py::dict BatchToDict(GraphBatch batch) {
+  const py::ssize_t num_node_tokens =
+      batch.num_graphs == 0 ? 0
+                            : batch.global_features.size() / batch.num_graphs;
+  const py::ssize_t num_tasks =
+      batch.num_blocks == 0 ? 0
+                            : batch.expected_outputs.size() / batch.num_blocks;
+  py::dict result;
+  result["num_graphs"] = batch.num_graphs;
+  result["num_nodes"] = batch.num_nodes;
+  result["num_edges"] = batch.num_edges;
+  result["num_blocks"] = batch.num_blocks;
+  result["node_features"] =
+      ToArray<int>(std::move(batch.node_features), {batch.num_nodes});
+  result["edge_features"] =
+      ToArray<int>(std::move(batch.edge_features), {batch.num_edges});
+  result["edge_senders"] =
+      ToArray<int>(std::move(batch.edge_senders), {batch.num_edges});
+  result["edge_receivers"] =
+      ToArray<int>(std::move(batch.edge_receivers), {batch.num_edges});
+  result["num_nodes_per_block"] =
+      ToArray<int>(std::move(batch.num_nodes_per_block), {batch.num_graphs});
+  result["num_edges_per_block"] =
+      ToArray<int>(std::move(batch.num_edges_per_block), {batch.num_graphs});
+  result["global_features"] = ToArray<int>(std::move(batch.global_features),
+                                           {batch.num_graphs, num_node_tokens});
+  result["instruction_node_mask"] = ToArray<bool>(
+      std::move(batch.instruction_node_mask), {batch.num_nodes});
+  result["expected_outputs"] = ToArray<double>(
+      std::move(batch.expected_outputs), {batch.num_blocks, num_tasks});
+  result["expected_outputs_mask"] = ToArray<bool>(
+      std::move(batch.expected_outputs_mask), {batch.num_blocks, num_tasks});
+  return result;
+}
+
+PYBIND11_MODULE(graph_batch_reader, m) {
+  m.doc() = kModuleDocstring;
+
+  py::google::ImportStatusModule();
+
+  py::class_<GraphBatchReaderOptions>(m, "GraphBatchReaderOptions")
+      .def(py::init<>())
+      .def_readwrite("input_files", &GraphBatchReaderOptions::input_files)
+      .def_readwrite("node_tokens", &GraphBatchReaderOptions::node_tokens)
+      .def_readwrite("immediate_token",
+                     &GraphBatchReaderOptions::immediate_token)
+      .def_readwrite("fp_immediate_token",
+                     &GraphBatchReaderOptions::fp_immediate_token)
+      .def_readwrite("address_token", &GraphBatchReaderOptions::address_token)
+      .def_readwrite("memory_token", &GraphBatchReaderOptions::memory_token)
+      .def_readwrite("out_of_vocabulary_behavior",
+                     &GraphBatchReaderOptions::out_of_vocabulary_behavior)
+      .def_readwrite("num_tasks", &GraphBatchReaderOptions::num_tasks)
+      .def_readwrite("max_blocks_per_batch",
+                     &GraphBatchReaderOptions::max_blocks_per_batch)
+      .def_readwrite("max_nodes_per_batch",
+                     &GraphBatchReaderOptions::max_nodes_per_batch)
+      .def_readwrite("max_edges_per_batch",
+                     &GraphBatchReaderOptions::max_edges_per_batch)
+      .def_readwrite("pad_batches", &GraphBatchReaderOptions::pad_batches)
+      .def_readwrite("num_threads", &GraphBatchReaderOptions::num_threads)
+      .def_readwrite("num_prefetched_batches",
+                     &GraphBatchReaderOptions::num_prefetched_batches);
+
+  py::class_<GraphBatchReader>(m, "GraphBatchReader",
+                               R"(Reads batches of basic block graphs.
+
+      The graphs are built on background threads. Iterating over the reader
+      releases the GIL while waiting for the next batch.)")
+      .def_static("create", &GraphBatchReader::Create, py::arg("options"),
+                  R"(Creates the reader and starts building the first batches.
+
+          Raises:
+            StatusNotOk: When the options are not valid or when one of the
+              input files can't be opened.)")
+      .def("__iter__", [](py::object self) { return self; })
+      .def("__next__",
+           [](GraphBatchReader& self) -> absl::StatusOr<py::dict> {
+             absl::StatusOr<std::optional<GraphBatch>> batch;
+             {
+               py::gil_scoped_release release_gil;
+               batch = self.Next();
+             }
+             if (!batch.ok()) return batch.status();
+             if (!batch->has_value()) throw py::stop_iteration();
+             return BatchToDict(std::move(**batch));
+           })
+      .def_property_readonly("num_skipped_blocks",
+                             &GraphBatchReader::num_skipped_blocks);
+}
+
+}  // namespace
+}  // namespace gematria
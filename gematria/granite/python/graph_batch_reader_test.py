@@ -0,0 +1,121 @@
+# Copyright 2023 Google Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#    http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import os
+
+from absl.testing import absltest
+from gematria.basic_block.python import tokens
+from gematria.granite.python import graph_batch_reader
+from gematria.model.python import oov_token_behavior
+from gematria.testing.python import basic_blocks_with_throughput
+import tensorflow.compat.v1 as tf
+
+_OutOfVocabularyTokenBehavior = oov_token_behavior.OutOfVocabularyTokenBehavior
+
+
+class GraphBatchReaderTest(
+    basic_blocks_with_throughput.TestCase, absltest.TestCase
+):
+  """Test for the GraphBatchReader class wrapper.
+
+  Most of the functionality is tested in the corresponding cc_test(). Here we
+  test just that the batches have the expected shapes.
+  """
+
+  def setUp(self):
+    self.num_blocks = 10
+    super().setUp()
+    self.input_file = os.path.join(
+        self.create_tempdir().full_path, 'blocks.tfrecord'
+    )
+    with tf.io.TFRecordWriter(self.input_file) as writer:
+      for proto in self.block_protos:
+        writer.write(proto.SerializeToString())
+
+  def create_options(self):
+    options = graph_batch_reader.GraphBatchReaderOptions()
+    options.input_files = [self.input_file]
+    options.node_tokens = self.tokens
+    options.immediate_token = tokens.IMMEDIATE
+    options.fp_immediate_token = tokens.IMMEDIATE
+    options.address_token = tokens.ADDRESS
+    options.memory_token = tokens.MEMORY
+    options.out_of_vocabulary_behavior = (
+        _OutOfVocabularyTokenBehavior.return_error()
+    )
+    options.max_blocks_per_batch = 4
+    options.num_threads = 2
+    return options
+
+  def assertBatchIsSelfConsistent(self, batch):
+    num_graphs = batch['num_graphs']
+    num_nodes = batch['num_nodes']
+    num_edges = batch['num_edges']
+    self.assertEqual(batch['node_features'].shape, (num_nodes,))
+    self.assertEqual(batch['instruction_node_mask'].shape, (num_nodes,))
+    self.assertEqual(batch['edge_features'].shape, (num_edges,))
+    self.assertEqual(batch['edge_senders'].shape, (num_edges,))
+    self.assertEqual(batch['edge_receivers'].shape, (num_edges,))
+    self.assertEqual(batch['num_nodes_per_block'].sum(), num_nodes)
+    self.assertEqual(batch['num_edges_per_block'].sum(), num_edges)
+    self.assertEqual(
+        batch['global_features'].shape, (num_graphs, len(self.tokens))
+    )
+    self.assertEqual(batch['expected_outputs'].shape, (batch['num_blocks'], 1))
+    self.assertEqual(
+        batch['expected_outputs_mask'].shape, (batch['num_blocks'], 1)
+    )
+
+  def test_read_all_blocks(self):
+    reader = graph_batch_reader.GraphBatchReader.create(self.create_options())
+    batches = list(reader)
+    self.assertLen(batches, 3)
+    for batch in batches:
+      self.assertBatchIsSelfConsistent(batch)
+      self.assertEqual(batch['num_graphs'], batch['num_blocks'])
+    expected_outputs = [
+        output.tolist()
+        for batch in batches
+        for output in batch['expected_outputs']
+    ]
+    self.assertEqual(
+        expected_outputs,
+        [
+            [proto.inverse_throughputs[0].inverse_throughput_cycles[0]]
+            for proto in self.block_protos
+        ],
+    )
+    self.assertEqual(reader.num_skipped_blocks, 0)
+
+  def test_padding(self):
+    options = self.create_options()
+    options.max_nodes_per_batch = 1000
+    options.max_edges_per_batch = 1000
+    options.pad_batches = True
+    reader = graph_batch_reader.GraphBatchReader.create(options)
+    for batch in reader:
+      self.assertBatchIsSelfConsistent(batch)
+      self.assertEqual(batch['num_graphs'], batch['num_blocks'] + 1)
+      self.assertEqual(batch['num_nodes'], 1000)
+      self.assertEqual(batch['num_edges'], 1000)
+
+  def test_invalid_file(self):
+    options = self.create_options()
+    options.input_files = ['/this/file/does/not/exist.tfrecord']
+    with self.assertRaises(Exception):
+      graph_batch_reader.GraphBatchReader.create(options)
+
+
+if __name__ == '__main__':
+  absltest.main()
@@ -14,14 +14,19 @@
 
 #include "gematria/granite/graph_builder.h"
 
+#include <cstddef>
+#include <cstdint>
+#include <optional>
 #include <string>
 #include <vector>
 
 #include "absl/strings/string_view.h"
+#include "gematria/basic_block/basic_block.h"
 #include "gematria/model/oov_token_behavior.h"
 #include "gematria/proto/canonicalized_instruction.pb.h"
 #include "pybind11/cast.h"
 #include "pybind11/detail/common.h"
+#include "pybind11/numpy.h"
 #include "pybind11/pybind11.h"
 #include "pybind11/stl.h"
 #include "pybind11_protobuf/native_proto_caster.h"
@@ -35,7 +40,37 @@ constexpr const char* const kModuleDocstring =
     R"(Conversion of basic blocks to a graph representation.
 
 See the comments in the C++ version of the class for more details on the graph
-representation and the conversion process.)";
+representation and the conversion process.
+
+The array properties of BasicBlockGraphBuilder are NumPy arrays. Properties
+backed directly by the data of the builder, e.g. `node_features` or
+`edge_senders`, are read-only views that share memory with the builder; they
+remain valid only until the builder is modified, and must be copied (e.g. with
+`np.array()`) when the data is needed longer. The remaining properties are
+computed into a new array on each access.)";
+
+// Returns a read-only NumPy array that shares memory with `values`. The array
+// keeps `owner`, the Python object that owns `values`, alive. Modifying the
+// vector invalidates the array.
+template <typename T>
+py::array_t<T> ReadOnlyView(const std::vector<T>& values, py::handle owner) {
+  py::array_t<T> array(static_cast<py::ssize_t>(values.size()), values.data(),
+                       owner);
+  array.attr("flags").attr("writeable") = false;
+  return array;
+}
+
+// Creates a binding for a property of BasicBlockGraphBuilder that returns a
+// read-only view of the vector returned by `getter`.
+template <typename T>
+auto ViewProperty(const std::vector<T>& (BasicBlockGraphBuilder::*getter)()
+                      const) {
+  return [getter](py::object self) {
+    const BasicBlockGraphBuilder& builder =
+        self.cast<const BasicBlockGraphBuilder&>();
+    return ReadOnlyView((builder.*getter)(), self);
+  };
+}
 
 PYBIND11_MODULE(graph_builder, m) {
   m.doc() = kModuleDocstring;
@@ -75,33 +110,119 @@ PYBIND11_MODULE(graph_builder, m) {
           py::arg("node_tokens"), py::arg("immediate_token"),
           py::arg("fp_immediate_token"), py::arg("address_token"),
           py::arg("memory_token"), py::arg("out_of_vocabulary_behavior"))
+      // The methods that add basic blocks release the GIL while building the
+      // graphs. A single builder must still be used from one thread at a time.
       .def("add_basic_block", &BasicBlockGraphBuilder::AddBasicBlock,
-           py::arg("block"))
+           py::arg("block"), py::call_guard<py::gil_scoped_release>())
+      .def(
+          "add_basic_blocks",
+          [](BasicBlockGraphBuilder& self,
+             const std::vector<const BasicBlock*>& blocks) {
+            py::gil_scoped_release release_gil;
+            std::vector<bool> added(blocks.size());
+            for (size_t i = 0; i < blocks.size(); ++i) {
+              added[i] = self.AddBasicBlock(*blocks[i]);
+            }
+            return added;
+          },
+          py::arg("blocks"),
+          R"(Adds a list of basic blocks to the batch.
+
+          A batch version of `add_basic_block`. Processes all blocks in a single
+          call without holding the GIL.
+
+          Args:
+            blocks: The basic blocks to add.
+
+          Returns:
+            A list of booleans, one for each block in `blocks`. The value is
+            True when the block was added to the batch, and False when it was
+            skipped in the same way as by `add_basic_block`.)")
       .def("add_basic_block_from_instructions",
            &BasicBlockGraphBuilder::AddBasicBlockFromInstructions,
-           py::arg("instructions"))
+           py::arg("instructions"), py::call_guard<py::gil_scoped_release>())
+      .def("add_basic_block_prefixes",
+           &BasicBlockGraphBuilder::AddBasicBlockPrefixes, py::arg("block"),
+           py::call_guard<py::gil_scoped_release>())
+      .def(
+          "compute_graph_hash",
+          [](BasicBlockGraphBuilder& self, const BasicBlock& block) {
+            return self.ComputeGraphHash(block);
+          },
+          py::arg("block"), py::call_guard<py::gil_scoped_release>(),
+          R"(Computes the hash of the graph of a basic block.
+
+          Does not add the block to the batch. Basic blocks that differ only in
+          values that are not a part of the graph, e.g. immediate values, have
+          the same hash.
+
+          Args:
+            block: The basic block.
+
+          Returns:
+            The hash of the graph that `add_basic_block` would add for `block`,
+            or None when `add_basic_block` would reject the block.)")
+      .def("append", &BasicBlockGraphBuilder::Append, py::arg("other"))
       .def("reset", &BasicBlockGraphBuilder::Reset)
+      .def("set_instruction_fragment_cache_size",
+           &BasicBlockGraphBuilder::SetInstructionFragmentCacheSize,
+           py::arg("max_size"))
+      .def("reset_out_of_vocabulary_token_counts",
+           &BasicBlockGraphBuilder::ResetOutOfVocabularyTokenCounts)
+      .def_property_readonly(
+          "out_of_vocabulary_token_counts",
+          [](const BasicBlockGraphBuilder& self) {
+            return self.out_of_vocabulary_token_counts().GetCounts();
+          },
+          R"(The out-of-vocabulary tokens found in the added basic blocks.
+
+          A list of (token, count) tuples sorted by the count in decreasing
+          order. The counts are not cleared by `reset`; use
+          `reset_out_of_vocabulary_token_counts` to clear them.)")
       .def_property_readonly("num_node_tokens",
                              &BasicBlockGraphBuilder::num_node_tokens)
       .def_property_readonly("num_graphs", &BasicBlockGraphBuilder::num_graphs)
       .def_property_readonly("num_nodes", &BasicBlockGraphBuilder::num_nodes)
       .def_property_readonly("num_edges", &BasicBlockGraphBuilder::num_edges)
-      .def_property_readonly("num_nodes_per_block",
-                             &BasicBlockGraphBuilder::num_nodes_per_block)
-      .def_property_readonly("num_edges_per_block",
-                             &BasicBlockGraphBuilder::num_edges_per_block)
-      .def_property_readonly("node_features",
-                             &BasicBlockGraphBuilder::node_features)
-      .def_property_readonly("instruction_node_mask",
-                             &BasicBlockGraphBuilder::InstructionNodeMask)
-      .def_property_readonly("edge_senders",
-                             &BasicBlockGraphBuilder::edge_senders)
-      .def_property_readonly("edge_receivers",
-                             &BasicBlockGraphBuilder::edge_receivers)
+      .def_property_readonly(
+          "num_nodes_per_block",
+          ViewProperty(&BasicBlockGraphBuilder::num_nodes_per_block))
+      .def_property_readonly(
+          "num_edges_per_block",
+          ViewProperty(&BasicBlockGraphBuilder::num_edges_per_block))
+      .def_property_readonly(
+          "graph_hashes", ViewProperty(&BasicBlockGraphBuilder::graph_hashes))
+      .def_property_readonly(
+          "node_features", ViewProperty(&BasicBlockGraphBuilder::node_features))
+      .def_property_readonly(
+          "instruction_node_mask",
+          [](const BasicBlockGraphBuilder& self) {
+            py::array_t<bool> mask(self.num_nodes());
+            self.FillInstructionNodeMask(mask.mutable_data());
+            return mask;
+          })
+      .def_property_readonly(
+          "edge_senders", ViewProperty(&BasicBlockGraphBuilder::edge_senders))
+      .def_property_readonly(
+          "edge_receivers",
+          ViewProperty(&BasicBlockGraphBuilder::edge_receivers))
       .def_property_readonly("edge_features",
-                             &BasicBlockGraphBuilder::EdgeFeatures)
-      .def_property_readonly("global_features",
-                             &BasicBlockGraphBuilder::global_features)
+                             [](const BasicBlockGraphBuilder& self) {
+                               py::array_t<int> features(self.num_edges());
+                               self.FillEdgeFeatures(features.mutable_data());
+                               return features;
+                             })
+      .def_property_readonly(
+          "global_features",
+          [](const BasicBlockGraphBuilder& self) {
+            // A contiguous row-major matrix of shape
+            // (num_graphs, num_node_tokens).
+            py::array_t<int> features(
+                {static_cast<py::ssize_t>(self.num_graphs()),
+                 static_cast<py::ssize_t>(self.num_node_tokens())});
+            self.FillGlobalFeatures(features.mutable_data());
+            return features;
+          })
       .def_property_readonly("immediate_token",
                              &BasicBlockGraphBuilder::immediate_token)
       .def_property_readonly("fp_immediate_token",
@@ -111,7 +232,9 @@ PYBIND11_MODULE(graph_builder, m) {
       .def_property_readonly("memory_token",
                              &BasicBlockGraphBuilder::memory_token)
       .def_property_readonly("replacement_token",
-                             &BasicBlockGraphBuilder::replacement_token);
+                             &BasicBlockGraphBuilder::replacement_token)
+      .def_property_readonly("vocabulary_hash",
+                             &BasicBlockGraphBuilder::VocabularyHash);
 }
 
 }  // namespace
@@ -204,13 +204,17 @@ class GraphBuilderModelBase(
   # @Override
   def _make_batch_feed_dict(self) -> model_base.FeedDict:
     feed_dict = super()._make_batch_feed_dict()
-    feed_dict[self._instruction_node_mask] = np.array(
+    feed_dict[self._instruction_node_mask] = np.asarray(
         self._batch_graph_builder.instruction_node_mask, dtype=bool
     )
     return feed_dict
 
   # @Override
   def _make_batch_graphs_tuple(self):
+    # The node features, senders, receivers and the numbers of nodes and edges
+    # are views of the memory of the graph builder that are invalidated when the
+    # builder is reset; np.array() copies them in a single memcpy. The edge
+    # features and the globals are new arrays that can be used directly.
     node_features = np.array(
         self._batch_graph_builder.node_features,
         dtype=self._graph_node_feature_spec.dtype.as_numpy_dtype,
@@ -228,14 +232,14 @@ class GraphBuilderModelBase(
       node_features[injection_mask] = self._oov_token
     return graph_nets.graphs.GraphsTuple(
         nodes=node_features,
-        edges=np.array(
+        edges=np.asarray(
             self._batch_graph_builder.edge_features,
             dtype=self._graph_edge_feature_spec.dtype.as_numpy_dtype,
         ),
         # NOTE(ondrasej): The graph globals are not normalized by the number of
         # nodes in the graph. We could do it here, but we can also do it by
         # introducing a LayerNorm layer in the first graph network module.
-        globals=np.array(
+        globals=np.asarray(
             self._batch_graph_builder.global_features,
             dtype=self._graph_global_feature_spec.dtype.as_numpy_dtype,
         ),
@@ -19,6 +19,7 @@ from gematria.basic_block.python import tokens
 from gematria.granite.python import graph_builder
 from gematria.model.python import oov_token_behavior
 from gematria.testing.python import basic_blocks_with_throughput
+import numpy as np
 
 # A list of tokens that contains all the "helper" tokens used by the graph
 # builder but no tokens for the actual assembly code. Transforming a non-empty
@@ -121,6 +122,27 @@ class BasicBlockGraphBuilderTest(
 
     self.assertBuilderIsSelfConsistent(builder, 2)
 
+  def test_graph_hashes(self):
+    builder = graph_builder.BasicBlockGraphBuilder(
+        node_tokens=self.tokens,
+        immediate_token=tokens.IMMEDIATE,
+        fp_immediate_token=tokens.IMMEDIATE,
+        address_token=tokens.ADDRESS,
+        memory_token=tokens.MEMORY,
+        out_of_vocabulary_behavior=_OutOfVocabularyTokenBehavior.return_error(),
+    )
+
+    expected_hashes = [
+        builder.compute_graph_hash(block) for block in self.blocks[:2]
+    ]
+    self.assertEqual(builder.num_graphs, 0)
+    self.assertTrue(builder.add_basic_block(self.blocks[0]))
+    self.assertTrue(builder.add_basic_block(self.blocks[1]))
+    self.assertSequenceEqual(builder.graph_hashes.tolist(), expected_hashes)
+
+    builder.reset()
+    self.assertEmpty(builder.graph_hashes)
+
   def test_many_blocks(self):
     builder = graph_builder.BasicBlockGraphBuilder(
         node_tokens=self.tokens,
@@ -137,6 +159,77 @@ class BasicBlockGraphBuilderTest(
 
     self.assertBuilderIsSelfConsistent(builder, num_blocks)
 
+  def test_add_basic_blocks(self):
+    builder = graph_builder.BasicBlockGraphBuilder(
+        node_tokens=self.tokens,
+        immediate_token=tokens.IMMEDIATE,
+        fp_immediate_token=tokens.IMMEDIATE,
+        address_token=tokens.ADDRESS,
+        memory_token=tokens.MEMORY,
+        out_of_vocabulary_behavior=_OutOfVocabularyTokenBehavior.return_error(),
+    )
+
+    self.assertEqual(
+        builder.add_basic_blocks(self.blocks), [True] * len(self.blocks)
+    )
+    self.assertBuilderIsSelfConsistent(builder, len(self.blocks))
+
+  def test_add_basic_blocks_out_of_vocabulary_tokens(self):
+    builder = graph_builder.BasicBlockGraphBuilder(
+        node_tokens=_STRUCTURAL_TOKENS,
+        immediate_token=tokens.IMMEDIATE,
+        fp_immediate_token=tokens.IMMEDIATE,
+        address_token=tokens.ADDRESS,
+        memory_token=tokens.MEMORY,
+        out_of_vocabulary_behavior=_OutOfVocabularyTokenBehavior.return_error(),
+    )
+
+    self.assertEqual(builder.add_basic_blocks(self.blocks[:2]), [False, False])
+    self.assertEqual(builder.num_graphs, 0)
+
+  def test_numpy_arrays(self):
+    builder = graph_builder.BasicBlockGraphBuilder(
+        node_tokens=self.tokens,
+        immediate_token=tokens.IMMEDIATE,
+        fp_immediate_token=tokens.IMMEDIATE,
+        address_token=tokens.ADDRESS,
+        memory_token=tokens.MEMORY,
+        out_of_vocabulary_behavior=_OutOfVocabularyTokenBehavior.return_error(),
+    )
+    self.assertTrue(builder.add_basic_block(self.blocks[0]))
+    self.assertTrue(builder.add_basic_block(self.blocks[1]))
+
+    # The views of the builder data are read-only.
+    for view in (
+        builder.node_features,
+        builder.edge_senders,
+        builder.edge_receivers,
+        builder.num_nodes_per_block,
+        builder.num_edges_per_block,
+    ):
+      self.assertIsInstance(view, np.ndarray)
+      self.assertFalse(view.flags.writeable)
+      with self.assertRaises(ValueError):
+        view[0] = 1
+
+    global_features = builder.global_features
+    self.assertIsInstance(global_features, np.ndarray)
+    self.assertEqual(global_features.shape, (2, builder.num_node_tokens))
+    self.assertTrue(global_features.flags.c_contiguous)
+    # Each global feature vector counts the tokens of the nodes of the graph.
+    num_nodes_0 = builder.num_nodes_per_block[0]
+    self.assertEqual(
+        global_features[0].tolist(),
+        np.bincount(
+            builder.node_features[:num_nodes_0],
+            minlength=builder.num_node_tokens,
+        ).tolist(),
+    )
+
+    self.assertEqual(builder.instruction_node_mask.dtype, bool)
+    self.assertLen(builder.instruction_node_mask, builder.num_nodes)
+    self.assertLen(builder.edge_features, builder.num_edges)
+
   def test_out_of_vocabulary_tokens_return_error(self):
     builder = graph_builder.BasicBlockGraphBuilder(
         node_tokens=_STRUCTURAL_TOKENS,
@@ -172,6 +265,33 @@ class BasicBlockGraphBuilderTest(
 
     self.assertLen(self.blocks, builder.num_graphs)
 
+  def test_out_of_vocabulary_token_counts(self):
+    builder = graph_builder.BasicBlockGraphBuilder(
+        node_tokens=_STRUCTURAL_TOKENS,
+        immediate_token=tokens.IMMEDIATE,
+        fp_immediate_token=tokens.IMMEDIATE,
+        address_token=tokens.ADDRESS,
+        memory_token=tokens.MEMORY,
+        out_of_vocabulary_behavior=(
+            _OutOfVocabularyTokenBehavior.replace_with_token(tokens.UNKNOWN)
+        ),
+    )
+    self.assertEmpty(builder.out_of_vocabulary_token_counts)
+
+    for block in self.blocks:
+      self.assertTrue(builder.add_basic_block(block))
+    counts = builder.out_of_vocabulary_token_counts
+    self.assertNotEmpty(counts)
+    self.assertEqual(
+        counts, sorted(counts, key=lambda item: (-item[1], item[0]))
+    )
+
+    # The counts are kept by `reset` and cleared only explicitly.
+    builder.reset()
+    self.assertEqual(builder.out_of_vocabulary_token_counts, counts)
+    builder.reset_out_of_vocabulary_token_counts()
+    self.assertEmpty(builder.out_of_vocabulary_token_counts)
+
 
 if __name__ == '__main__':
   absltest.main()
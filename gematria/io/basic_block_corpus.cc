@@ -0,0 +1,558 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/io/basic_block_corpus.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <ios>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/types/span.h"
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/basic_block/basic_block_protos.h"
+#include "gematria/basic_block/token_interner.h"
+#include "gematria/proto/throughput.pb.h"
+
+// The columns are written and read in the byte order of the host.
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__,
+              "The corpus format requires a little-endian host");
+
+namespace gematria {
+namespace {
+
+constexpr char kMagic[8] = {'G', 'M', 'B', 'B', 'C', 'O', 'R', 'P'};
+constexpr uint64_t kVersion = 1;
+constexpr size_t kAlignment = 8;
+
+// The header of the corpus file. The sizes of all columns are derived from
+// these values.
+struct Header {
+  char magic[sizeof(kMagic)];
+  uint64_t version;
+  uint64_t num_tokens;
+  uint64_t token_data_size;
+  uint64_t num_blocks;
+  uint64_t num_instructions;
+  uint64_t num_prefixes;
+  uint64_t num_operands;
+  uint64_t num_addresses;
+  uint64_t num_throughputs;
+  uint64_t num_throughput_values;
+};
+static_assert(sizeof(Header) % kAlignment == 0);
+
+size_t AlignedSize(size_t size) {
+  return (size + kAlignment - 1) / kAlignment * kAlignment;
+}
+
+// Writes the contents of `column` to `file`, and pads it to the alignment of
+// the columns.
+template <typename T>
+void WriteColumn(std::ofstream& file, absl::Span<const T> column) {
+  constexpr char kPadding[kAlignment] = {};
+  const size_t size = column.size() * sizeof(T);
+  file.write(reinterpret_cast<const char*>(column.data()), size);
+  file.write(kPadding, AlignedSize(size) - size);
+}
+
+// Takes the columns from the mapped file one by one, in the order in which
+// they were written.
+class ColumnReader {
+ public:
+  ColumnReader(const char* data, size_t size, size_t offset)
+      : data_(data), size_(size), offset_(offset) {}
+
+  template <typename T>
+  absl::Status Read(uint64_t num_elements, const T*& column) {
+    if (num_elements > (size_ - offset_) / sizeof(T)) {
+      return absl::DataLossError("The corpus file is truncated");
+    }
+    column = reinterpret_cast<const T*>(data_ + offset_);
+    offset_ += AlignedSize(num_elements * sizeof(T));
+    if (offset_ > size_) offset_ = size_;
+    return absl::OkStatus();
+  }
+
+ private:
+  const char* const data_;
+  const size_t size_;
+  size_t offset_;
+};
+
+// Checks that `offsets[0..num_offsets)` is a non-decreasing sequence starting
+// at zero and ending at `end`.
+absl::Status CheckOffsets(const uint64_t* offsets, uint64_t num_offsets,
+                          uint64_t end, std::string_view column) {
+  if (offsets[0] != 0 || offsets[num_offsets - 1] != end) {
+    return absl::DataLossError(absl::StrCat("Invalid range of ", column));
+  }
+  for (uint64_t i = 1; i < num_offsets; ++i) {
+    if (offsets[i] < offsets[i - 1]) {
+      return absl::DataLossError(absl::StrCat("Invalid offsets of ", column));
+    }
+  }
+  return absl::OkStatus();
+}
+
+// Checks that all elements of `indices[0..num_indices)` are smaller than
+// `limit`.
+template <typename T>
+absl::Status CheckIndices(const T* indices, uint64_t num_indices,
+                          uint64_t limit, std::string_view column) {
+  for (uint64_t i = 0; i < num_indices; ++i) {
+    if (indices[i] >= limit) {
+      return absl::DataLossError(absl::StrCat("Invalid index in ", column));
+    }
+  }
+  return absl::OkStatus();
+}
+
+}  // namespace
+
+BasicBlockCorpusWriter::BasicBlockCorpusWriter()
+    : block_instructions_{0},
+      block_throughputs_{0},
+      instruction_prefixes_{0},
+      instruction_operands_{0},
+      throughput_values_begin_{0} {}
+
+uint32_t BasicBlockCorpusWriter::AddToken(std::string_view token) {
+  const auto [it, inserted] =
+      token_indices_.try_emplace(std::string(token), tokens_.size());
+  if (inserted) tokens_.emplace_back(token);
+  return it->second;
+}
+
+void BasicBlockCorpusWriter::AddOperands(
+    const std::vector<InstructionOperand>& operands) {
+  for (const InstructionOperand& operand : operands) {
+    uint64_t value = 0;
+    switch (operand.type()) {
+      case OperandType::kUnknown:
+        break;
+      case OperandType::kRegister:
+        value = AddToken(operand.register_name());
+        break;
+      case OperandType::kImmediateValue:
+        value = operand.immediate_value();
+        break;
+      case OperandType::kFpImmediateValue: {
+        const double fp_immediate_value = operand.fp_immediate_value();
+        std::memcpy(&value, &fp_immediate_value, sizeof(value));
+        break;
+      }
+      case OperandType::kAddress: {
+        const AddressTuple& address = operand.address();
+        value = address_base_registers_.size();
+        address_base_registers_.push_back(AddToken(address.base_register));
+        address_index_registers_.push_back(AddToken(address.index_register));
+        address_segment_registers_.push_back(
+            AddToken(address.segment_register));
+        address_scalings_.push_back(address.scaling);
+        address_displacements_.push_back(address.displacement);
+        break;
+      }
+      case OperandType::kMemory:
+        value = static_cast<uint64_t>(
+            static_cast<int64_t>(operand.alias_group_id()));
+        break;
+    }
+    operand_types_.push_back(static_cast<uint8_t>(operand.type()));
+    operand_values_.push_back(value);
+  }
+  instruction_operands_.push_back(operand_types_.size());
+}
+
+size_t BasicBlockCorpusWriter::AddBasicBlock(const BasicBlock& block) {
+  for (const Instruction& instruction : block.instructions) {
+    instruction_mnemonics_.push_back(AddToken(instruction.mnemonic));
+    instruction_llvm_mnemonics_.push_back(AddToken(instruction.llvm_mnemonic));
+    instruction_addresses_.push_back(instruction.address);
+    instruction_sizes_.push_back(instruction.size);
+    for (const std::string& prefix : instruction.prefixes) {
+      prefixes_.push_back(AddToken(prefix));
+    }
+    instruction_prefixes_.push_back(prefixes_.size());
+    AddOperands(instruction.input_operands);
+    AddOperands(instruction.implicit_input_operands);
+    AddOperands(instruction.output_operands);
+    AddOperands(instruction.implicit_output_operands);
+  }
+  block_instructions_.push_back(instruction_mnemonics_.size());
+  block_throughputs_.push_back(throughput_sources_.size());
+  return num_blocks() - 1;
+}
+
+void BasicBlockCorpusWriter::AddInverseThroughput(
+    std::string_view source,
+    absl::Span<const double> inverse_throughput_cycles) {
+  assert(num_blocks() > 0);
+  throughput_sources_.push_back(AddToken(source));
+  throughput_values_.insert(throughput_values_.end(),
+                            inverse_throughput_cycles.begin(),
+                            inverse_throughput_cycles.end());
+  throughput_values_begin_.push_back(throughput_values_.size());
+  block_throughputs_.back() = throughput_sources_.size();
+}
+
+size_t BasicBlockCorpusWriter::AddBasicBlockWithThroughputProto(
+    const BasicBlockWithThroughputProto& proto) {
+  const size_t block_index =
+      AddBasicBlock(BasicBlockFromProto(proto.basic_block()));
+  for (const ThroughputWithSourceProto& throughput :
+       proto.inverse_throughputs()) {
+    AddInverseThroughput(throughput.source(),
+                         throughput.inverse_throughput_cycles());
+  }
+  return block_index;
+}
+
+absl::Status BasicBlockCorpusWriter::Write(const std::string& path) const {
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  if (!file.is_open()) {
+    return absl::NotFoundError(absl::StrCat("Could not open ", path));
+  }
+
+  std::vector<uint64_t> token_offsets = {0};
+  std::string token_data;
+  for (const std::string& token : tokens_) {
+    token_data.append(token);
+    token_offsets.push_back(token_data.size());
+  }
+
+  Header header = {};
+  std::memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.num_tokens = tokens_.size();
+  header.token_data_size = token_data.size();
+  header.num_blocks = num_blocks();
+  header.num_instructions = instruction_mnemonics_.size();
+  header.num_prefixes = prefixes_.size();
+  header.num_operands = operand_types_.size();
+  header.num_addresses = address_base_registers_.size();
+  header.num_throughputs = throughput_sources_.size();
+  header.num_throughput_values = throughput_values_.size();
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+  // The order of the columns must match BasicBlockCorpus::Initialize().
+  WriteColumn<uint64_t>(file, token_offsets);
+  WriteColumn<char>(file, token_data);
+  WriteColumn<uint64_t>(file, block_instructions_);
+  WriteColumn<uint64_t>(file, block_throughputs_);
+  WriteColumn<uint32_t>(file, instruction_mnemonics_);
+  WriteColumn<uint32_t>(file, instruction_llvm_mnemonics_);
+  WriteColumn<uint64_t>(file, instruction_addresses_);
+  WriteColumn<uint64_t>(file, instruction_sizes_);
+  WriteColumn<uint64_t>(file, instruction_prefixes_);
+  WriteColumn<uint64_t>(file, instruction_operands_);
+  WriteColumn<uint32_t>(file, prefixes_);
+  WriteColumn<uint8_t>(file, operand_types_);
+  WriteColumn<uint64_t>(file, operand_values_);
+  WriteColumn<uint32_t>(file, address_base_registers_);
+  WriteColumn<uint32_t>(file, address_index_registers_);
+  WriteColumn<uint32_t>(file, address_segment_registers_);
+  WriteColumn<int32_t>(file, address_scalings_);
+  WriteColumn<int64_t>(file, address_displacements_);
+  WriteColumn<uint32_t>(file, throughput_sources_);
+  WriteColumn<uint64_t>(file, throughput_values_begin_);
+  WriteColumn<double>(file, throughput_values_);
+
+  file.close();
+  if (file.fail()) {
+    return absl::InternalError(absl::StrCat("Could not write to ", path));
+  }
+  return absl::OkStatus();
+}
+
+absl::StatusOr<std::unique_ptr<BasicBlockCorpus>> BasicBlockCorpus::Open(
+    const std::string& path) {
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return absl::NotFoundError(absl::StrCat("Could not open ", path));
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0) {
+    close(fd);
+    return absl::InternalError(absl::StrCat("Could not stat ", path));
+  }
+  const size_t size = file_stat.st_size;
+  if (size < sizeof(Header)) {
+    close(fd);
+    return absl::DataLossError(
+        absl::StrCat("The file is too small to be a corpus file: ", path));
+  }
+  void* const data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping remains valid after the file is closed.
+  close(fd);
+  if (data == MAP_FAILED) {
+    return absl::InternalError(absl::StrCat("Could not map ", path));
+  }
+  // We can't use std::make_unique<BasicBlockCorpus>(), because
+  // std::make_unique<>() requires a public constructor.
+  std::unique_ptr<BasicBlockCorpus> corpus(
+      new BasicBlockCorpus(path, static_cast<const char*>(data), size));
+  if (absl::Status status = corpus->Initialize(); !status.ok()) return status;
+  return corpus;
+}
+
+BasicBlockCorpus::BasicBlockCorpus(std::string path, const char* data,
+                                   size_t size)
+    : path_(std::move(path)), data_(data), size_(size) {}
+
+BasicBlockCorpus::~BasicBlockCorpus() {
+  munmap(const_cast<char*>(data_), size_);
+}
+
+absl::Status BasicBlockCorpus::Initialize() {
+  Header header;
+  std::memcpy(&header, data_, sizeof(header));
+  if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0) {
+    return absl::DataLossError(
+        absl::StrCat("Not a basic block corpus file: ", path_));
+  }
+  if (header.version != kVersion) {
+    return absl::DataLossError(absl::StrCat(
+        "Unsupported corpus version ", header.version, " in ", path_));
+  }
+  // Each element of each column takes at least one byte. Rejecting larger
+  // counts early also rules out overflows in the computations below.
+  for (const uint64_t count :
+       {header.num_tokens, header.token_data_size, header.num_blocks,
+        header.num_instructions, header.num_prefixes, header.num_operands,
+        header.num_addresses, header.num_throughputs,
+        header.num_throughput_values}) {
+    if (count > size_) {
+      return absl::DataLossError(
+          absl::StrCat("The corpus file is truncated: ", path_));
+    }
+  }
+  num_blocks_ = header.num_blocks;
+  num_instructions_ = header.num_instructions;
+
+  ColumnReader reader(data_, size_, sizeof(Header));
+  const uint64_t num_operand_offsets =
+      header.num_instructions * kNumOperandLists + 1;
+  // The order of the columns must match BasicBlockCorpusWriter::Write().
+  for (absl::Status status : {
+           reader.Read(header.num_tokens + 1, token_offsets_),
+           reader.Read(header.token_data_size, token_data_),
+           reader.Read(header.num_blocks + 1, block_instructions_),
+           reader.Read(header.num_blocks + 1, block_throughputs_),
+           reader.Read(header.num_instructions, instruction_mnemonics_),
+           reader.Read(header.num_instructions, instruction_llvm_mnemonics_),
+           reader.Read(header.num_instructions, instruction_addresses_),
+           reader.Read(header.num_instructions, instruction_sizes_),
+           reader.Read(header.num_instructions + 1, instruction_prefixes_),
+           reader.Read(num_operand_offsets, instruction_operands_),
+           reader.Read(header.num_prefixes, prefixes_),
+           reader.Read(header.num_operands, operand_types_),
+           reader.Read(header.num_operands, operand_values_),
+           reader.Read(header.num_addresses, address_base_registers_),
+           reader.Read(header.num_addresses, address_index_registers_),
+           reader.Read(header.num_addresses, address_segment_registers_),
+           reader.Read(header.num_addresses, address_scalings_),
+           reader.Read(header.num_addresses, address_displacements_),
+           reader.Read(header.num_throughputs, throughput_sources_),
+           reader.Read(header.num_throughputs + 1, throughput_values_begin_),
+           reader.Read(header.num_throughput_values, throughput_values_),
+       }) {
+    if (!status.ok()) return status;
+  }
+
+  // Verify all ranges and indices, so that the accessors never read outside
+  // of the mapped file.
+  for (absl::Status status : {
+           CheckOffsets(token_offsets_, header.num_tokens + 1,
+                        header.token_data_size, "token data"),
+           CheckOffsets(block_instructions_, header.num_blocks + 1,
+                        header.num_instructions, "block instructions"),
+           CheckOffsets(block_throughputs_, header.num_blocks + 1,
+                        header.num_throughputs, "block throughputs"),
+           CheckOffsets(instruction_prefixes_, header.num_instructions + 1,
+                        header.num_prefixes, "instruction prefixes"),
+           CheckOffsets(instruction_operands_, num_operand_offsets,
+                        header.num_operands, "instruction operands"),
+           CheckOffsets(throughput_values_begin_, header.num_throughputs + 1,
+                        header.num_throughput_values, "throughput values"),
+           CheckIndices(instruction_mnemonics_, header.num_instructions,
+                        header.num_tokens, "mnemonics"),
+           CheckIndices(instruction_llvm_mnemonics_, header.num_instructions,
+                        header.num_tokens, "LLVM mnemonics"),
+           CheckIndices(prefixes_, header.num_prefixes, header.num_tokens,
+                        "prefixes"),
+           CheckIndices(address_base_registers_, header.num_addresses,
+                        header.num_tokens, "base registers"),
+           CheckIndices(address_index_registers_, header.num_addresses,
+                        header.num_tokens, "index registers"),
+           CheckIndices(address_segment_registers_, header.num_addresses,
+                        header.num_tokens, "segment registers"),
+           CheckIndices(throughput_sources_, header.num_throughputs,
+                        header.num_tokens, "throughput sources"),
+           CheckIndices(operand_types_, header.num_operands,
+                        static_cast<int>(OperandType::kMemory) + 1,
+                        "operand types"),
+       }) {
+    if (!status.ok()) return status;
+  }
+  for (uint64_t i = 0; i < header.num_operands; ++i) {
+    const uint64_t value = operand_values_[i];
+    const auto type = static_cast<OperandType>(operand_types_[i]);
+    if ((type == OperandType::kRegister && value >= header.num_tokens) ||
+        (type == OperandType::kAddress && value >= header.num_addresses)) {
+      return absl::DataLossError(
+          absl::StrCat("Invalid operand value in ", path_));
+    }
+  }
+
+  TokenInterner& interner = TokenInterner::Global();
+  token_ids_.reserve(header.num_tokens);
+  for (uint32_t i = 0; i < header.num_tokens; ++i) {
+    token_ids_.push_back(interner.Intern(token(i)));
+  }
+  return absl::OkStatus();
+}
+
+void BasicBlockCorpus::AssignOperand(uint64_t operand_index,
+                                     InstructionOperand& operand) const {
+  const uint64_t value = operand_values_[operand_index];
+  switch (static_cast<OperandType>(operand_types_[operand_index])) {
+    case OperandType::kUnknown:
+      operand = InstructionOperand();
+      break;
+    case OperandType::kRegister:
+      operand = InstructionOperand::RegisterFromId(token_ids_[value]);
+      break;
+    case OperandType::kImmediateValue:
+      operand = InstructionOperand::ImmediateValue(value);
+      break;
+    case OperandType::kFpImmediateValue: {
+      double fp_immediate_value;
+      std::memcpy(&fp_immediate_value, &value, sizeof(value));
+      operand = InstructionOperand::FpImmediateValue(fp_immediate_value);
+      break;
+    }
+    case OperandType::kAddress:
+      operand = InstructionOperand::Address(
+          /* base_register = */ std::string(
+              token(address_base_registers_[value])),
+          /* displacement = */ address_displacements_[value],
+          /* index_register = */
+          std::string(token(address_index_registers_[value])),
+          /* scaling = */ address_scalings_[value],
+          /* segment_register = */
+          std::string(token(address_segment_registers_[value])));
+      break;
+    case OperandType::kMemory:
+      operand = InstructionOperand::MemoryLocation(
+          static_cast<int>(static_cast<int64_t>(value)));
+      break;
+  }
+}
+
+void BasicBlockCorpus::AssignBasicBlock(size_t block_index,
+                                        BasicBlock& block) const {
+  assert(block_index < num_blocks_);
+  const uint64_t begin = block_instructions_[block_index];
+  const uint64_t end = block_instructions_[block_index + 1];
+  // Note that resize() keeps the existing instructions, and the memory they
+  // allocated is reused by the assignments below.
+  block.instructions.resize(end - begin);
+  for (uint64_t i = begin; i < end; ++i) {
+    Instruction& instruction = block.instructions[i - begin];
+    instruction.mnemonic.assign(token(instruction_mnemonics_[i]));
+    instruction.llvm_mnemonic.assign(token(instruction_llvm_mnemonics_[i]));
+    instruction.address = instruction_addresses_[i];
+    instruction.size = instruction_sizes_[i];
+
+    const uint64_t prefixes_begin = instruction_prefixes_[i];
+    instruction.prefixes.resize(instruction_prefixes_[i + 1] - prefixes_begin);
+    for (size_t j = 0; j < instruction.prefixes.size(); ++j) {
+      instruction.prefixes[j].assign(token(prefixes_[prefixes_begin + j]));
+    }
+
+    std::vector<InstructionOperand>* const operand_lists[kNumOperandLists] = {
+        &instruction.input_operands, &instruction.implicit_input_operands,
+        &instruction.output_operands, &instruction.implicit_output_operands};
+    for (int list = 0; list < kNumOperandLists; ++list) {
+      const uint64_t operands_begin =
+          instruction_operands_[i * kNumOperandLists + list];
+      const uint64_t operands_end =
+          instruction_operands_[i * kNumOperandLists + list + 1];
+      std::vector<InstructionOperand>& operands = *operand_lists[list];
+      operands.resize(operands_end - operands_begin);
+      for (uint64_t j = operands_begin; j < operands_end; ++j) {
+        AssignOperand(j, operands[j - operands_begin]);
+      }
+    }
+  }
+}
+
+BasicBlock BasicBlockCorpus::GetBasicBlock(size_t block_index) const {
+  BasicBlock block;
+  AssignBasicBlock(block_index, block);
+  return block;
+}
+
+std::vector<BasicBlockCorpus::InverseThroughput>
+BasicBlockCorpus::inverse_throughputs(size_t block_index) const {
+  assert(block_index < num_blocks_);
+  std::vector<InverseThroughput> throughputs;
+  for (uint64_t i = block_throughputs_[block_index];
+       i < block_throughputs_[block_index + 1]; ++i) {
+    const uint64_t values_begin = throughput_values_begin_[i];
+    throughputs.push_back(
+        {token(throughput_sources_[i]),
+         absl::MakeConstSpan(throughput_values_ + values_begin,
+                             throughput_values_begin_[i + 1] - values_begin)});
+  }
+  return throughputs;
+}
+
+BasicBlockWithThroughputProto
+BasicBlockCorpus::GetBasicBlockWithThroughputProto(size_t block_index) const {
+  BasicBlockWithThroughputProto proto;
+  const BasicBlock block = GetBasicBlock(block_index);
+  for (const Instruction& instruction : block.instructions) {
+    *proto.mutable_basic_block()->add_canonicalized_instructions() =
+        ProtoFromInstruction(instruction);
+  }
+  for (const InverseThroughput& throughput :
+       inverse_throughputs(block_index)) {
+    ThroughputWithSourceProto& throughput_proto =
+        *proto.add_inverse_throughputs();
+    throughput_proto.set_source(std::string(throughput.source));
+    throughput_proto.mutable_inverse_throughput_cycles()->Add(
+        throughput.inverse_throughput_cycles.begin(),
+        throughput.inverse_throughput_cycles.end());
+  }
+  return proto;
+}
+
+}  // namespace gematria
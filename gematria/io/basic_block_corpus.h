@@ -0,0 +1,237 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Contains a columnar file format for basic blocks with throughputs, and its
+// reader and writer. Unlike TFRecord files of BasicBlockWithThroughputProto,
+// the corpus files are memory-mapped and need no parsing: the reader verifies
+// the structure of the file once when it is opened, and then provides random
+// access to the blocks by their index.
+//
+// A corpus file contains a header with the sizes of all columns, followed by
+// the columns in a fixed order:
+//  - a table of the distinct strings used in the corpus (mnemonics, prefixes,
+//    register names, throughput sources); all other columns refer to strings
+//    by their index in this table,
+//  - the range of instructions and throughputs of each block,
+//  - the instruction columns (mnemonic, LLVM mnemonic, address, size, and the
+//    ranges of prefixes and operands),
+//  - the operand columns (type and value), and the address tuple columns,
+//  - the throughput columns (source and the range of values), and the values.
+// All columns are aligned to 8 bytes and stored in little-endian byte order.
+// The prefix inverse throughputs are not stored.
+
+#ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_IO_BASIC_BLOCK_CORPUS_H_
+#define THIRD_PARTY_GEMATRIA_GEMATRIA_IO_BASIC_BLOCK_CORPUS_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/types/span.h"
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/basic_block/token_interner.h"
+#include "gematria/proto/throughput.pb.h"
+
+namespace gematria {
+
+// Collects basic blocks in memory, and writes them to a corpus file.
+//
+// Typical usage:
+//   BasicBlockCorpusWriter writer;
+//   for (const BasicBlockWithThroughputProto& proto : protos) {
+//     writer.AddBasicBlockWithThroughputProto(proto);
+//   }
+//   absl::Status status = writer.Write(path);
+class BasicBlockCorpusWriter {
+ public:
+  BasicBlockCorpusWriter();
+
+  // Adds `block` to the corpus. Returns the index of the block.
+  size_t AddBasicBlock(const BasicBlock& block);
+
+  // Adds an inverse throughput from `source` to the last block added to the
+  // corpus. Requires that at least one block was added.
+  void AddInverseThroughput(std::string_view source,
+                            absl::Span<const double> inverse_throughput_cycles);
+
+  // Adds the block and the inverse throughputs from `proto` to the corpus.
+  // Returns the index of the block.
+  size_t AddBasicBlockWithThroughputProto(
+      const BasicBlockWithThroughputProto& proto);
+
+  // Returns the number of blocks added so far.
+  size_t num_blocks() const { return block_instructions_.size() - 1; }
+
+  // Writes the blocks added so far to `path`. Overwrites the file when it
+  // already exists.
+  absl::Status Write(const std::string& path) const;
+
+ private:
+  // Returns the index of `token` in the string table; adds the token to the
+  // table when it is not there yet.
+  uint32_t AddToken(std::string_view token);
+  void AddOperands(const std::vector<InstructionOperand>& operands);
+
+  // The string table, and the index of each string in it.
+  std::vector<std::string> tokens_;
+  std::unordered_map<std::string, uint32_t> token_indices_;
+
+  std::vector<uint64_t> block_instructions_;
+  std::vector<uint64_t> block_throughputs_;
+
+  std::vector<uint32_t> instruction_mnemonics_;
+  std::vector<uint32_t> instruction_llvm_mnemonics_;
+  std::vector<uint64_t> instruction_addresses_;
+  std::vector<uint64_t> instruction_sizes_;
+  std::vector<uint64_t> instruction_prefixes_;
+  std::vector<uint64_t> instruction_operands_;
+
+  std::vector<uint32_t> prefixes_;
+
+  std::vector<uint8_t> operand_types_;
+  std::vector<uint64_t> operand_values_;
+
+  std::vector<uint32_t> address_base_registers_;
+  std::vector<uint32_t> address_index_registers_;
+  std::vector<uint32_t> address_segment_registers_;
+  std::vector<int32_t> address_scalings_;
+  std::vector<int64_t> address_displacements_;
+
+  std::vector<uint32_t> throughput_sources_;
+  std::vector<uint64_t> throughput_values_begin_;
+  std::vector<double> throughput_values_;
+};
+
+// A read-only, memory-mapped corpus file. All methods are thread-safe.
+//
+// Typical usage:
+//   absl::StatusOr<std::unique_ptr<BasicBlockCorpus>> corpus =
+//       BasicBlockCorpus::Open(path);
+//   BasicBlock block;
+//   for (size_t i = 0; i < (*corpus)->num_blocks(); ++i) {
+//     (*corpus)->AssignBasicBlock(i, block);
+//     ...
+//   }
+class BasicBlockCorpus {
+ public:
+  // The number of operand lists of each instruction, in the order in which
+  // they are stored: input, implicit input, output, implicit output.
+  static constexpr int kNumOperandLists = 4;
+
+  // A view of one inverse throughput of a block. Points to the memory of the
+  // corpus, and remains valid for the lifetime of the corpus.
+  struct InverseThroughput {
+    std::string_view source;
+    absl::Span<const double> inverse_throughput_cycles;
+  };
+
+  // Maps the corpus file at `path` to memory, and verifies its structure.
+  // Returns an error when the file can't be mapped or when it is not a valid
+  // corpus file.
+  static absl::StatusOr<std::unique_ptr<BasicBlockCorpus>> Open(
+      const std::string& path);
+
+  BasicBlockCorpus(const BasicBlockCorpus&) = delete;
+  BasicBlockCorpus& operator=(const BasicBlockCorpus&) = delete;
+
+  ~BasicBlockCorpus();
+
+  size_t num_blocks() const { return num_blocks_; }
+  size_t num_instructions() const { return num_instructions_; }
+
+  // Returns the number of instructions of block `block_index`.
+  size_t num_instructions(size_t block_index) const {
+    return block_instructions_[block_index + 1] -
+           block_instructions_[block_index];
+  }
+
+  // Replaces the contents of `block` with the block `block_index`. Reuses the
+  // memory allocated by `block`, so that no allocations are needed when
+  // `block` is reused for blocks of similar size. The register operands are
+  // created directly from their TokenId without a lookup.
+  void AssignBasicBlock(size_t block_index, BasicBlock& block) const;
+
+  // Returns the block `block_index` as a new BasicBlock.
+  BasicBlock GetBasicBlock(size_t block_index) const;
+
+  // Returns the inverse throughputs of block `block_index`.
+  std::vector<InverseThroughput> inverse_throughputs(size_t block_index) const;
+
+  // Returns the block `block_index` and its throughputs as a proto.
+  BasicBlockWithThroughputProto GetBasicBlockWithThroughputProto(
+      size_t block_index) const;
+
+  // Returns the string with the given index from the string table.
+  std::string_view token(uint32_t token_index) const {
+    return std::string_view(token_data_ + token_offsets_[token_index],
+                            token_offsets_[token_index + 1] -
+                                token_offsets_[token_index]);
+  }
+
+ private:
+  BasicBlockCorpus(std::string path, const char* data, size_t size);
+
+  // Sets the column pointers from the header, and verifies that the file is a
+  // valid corpus file.
+  absl::Status Initialize();
+  void AssignOperand(uint64_t operand_index, InstructionOperand& operand) const;
+
+  const std::string path_;
+  const char* const data_;
+  const size_t size_;
+
+  size_t num_blocks_ = 0;
+  size_t num_instructions_ = 0;
+
+  const uint64_t* token_offsets_ = nullptr;
+  const char* token_data_ = nullptr;
+  // The IDs of the tokens in TokenInterner::Global(), by their index in the
+  // string table. Filled by Initialize().
+  std::vector<TokenId> token_ids_;
+
+  const uint64_t* block_instructions_ = nullptr;
+  const uint64_t* block_throughputs_ = nullptr;
+
+  const uint32_t* instruction_mnemonics_ = nullptr;
+  const uint32_t* instruction_llvm_mnemonics_ = nullptr;
+  const uint64_t* instruction_addresses_ = nullptr;
+  const uint64_t* instruction_sizes_ = nullptr;
+  const uint64_t* instruction_prefixes_ = nullptr;
+  const uint64_t* instruction_operands_ = nullptr;
+
+  const uint32_t* prefixes_ = nullptr;
+
+  const uint8_t* operand_types_ = nullptr;
+  const uint64_t* operand_values_ = nullptr;
+
+  const uint32_t* address_base_registers_ = nullptr;
+  const uint32_t* address_index_registers_ = nullptr;
+  const uint32_t* address_segment_registers_ = nullptr;
+  const int32_t* address_scalings_ = nullptr;
+  const int64_t* address_displacements_ = nullptr;
+
+  const uint32_t* throughput_sources_ = nullptr;
+  const uint64_t* throughput_values_begin_ = nullptr;
+  const double* throughput_values_ = nullptr;
+};
+
+}  // namespace gematria
+
+#endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_IO_BASIC_BLOCK_CORPUS_H_
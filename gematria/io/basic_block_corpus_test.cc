@@ -0,0 +1,200 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/io/basic_block_corpus.h"
+
+#include <cstdint>
+#include <fstream>
+#include <ios>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/basic_block/basic_block_protos.h"
+#include "gematria/proto/throughput.pb.h"
+#include "gematria/testing/matchers.h"
+#include "gematria/testing/parse_proto.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace gematria {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::IsEmpty;
+
+class BasicBlockCorpusTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    path_ = ::testing::TempDir() + "/corpus.gmbb";
+    protos_.push_back(ParseTextProto(R"pb(
+      basic_block {
+        canonicalized_instructions {
+          mnemonic: "LEA"
+          llvm_mnemonic: "LEA64r"
+          output_operands { register_name: "RDI" }
+          input_operands {
+            address {
+              base_register: "RBX"
+              index_register: "RCX"
+              displacement: -8
+              scaling: 2
+            }
+          }
+        }
+        canonicalized_instructions {
+          mnemonic: "NOT"
+          llvm_mnemonic: "NOT64m"
+          prefixes: "LOCK"
+          output_operands { memory { alias_group_id: 1 } }
+          input_operands { memory { alias_group_id: 1 } }
+          input_operands { address { base_register: "R15" scaling: 1 } }
+          implicit_output_operands { register_name: "EFLAGS" }
+        }
+      }
+      inverse_throughputs {
+        source: "hsw"
+        inverse_throughput_cycles: 1.5
+        inverse_throughput_cycles: 1.25
+      }
+      inverse_throughputs { source: "skl" inverse_throughput_cycles: 2 })pb"));
+    protos_.push_back(ParseTextProto(R"pb(
+      basic_block {
+        canonicalized_instructions {
+          mnemonic: "MOV"
+          llvm_mnemonic: "MOV64ri"
+          output_operands { register_name: "RAX" }
+          input_operands { immediate_value: 12345678901 }
+        }
+        canonicalized_instructions {
+          mnemonic: "MOVSD"
+          llvm_mnemonic: "MOVSDrm"
+          output_operands { register_name: "XMM0" }
+          input_operands { fp_immediate_value: 0.5 }
+          implicit_input_operands { register_name: "RAX" }
+        }
+      })pb"));
+  }
+
+  void WriteCorpus() {
+    BasicBlockCorpusWriter writer;
+    for (const BasicBlockWithThroughputProto& proto : protos_) {
+      writer.AddBasicBlockWithThroughputProto(proto);
+    }
+    EXPECT_EQ(writer.num_blocks(), protos_.size());
+    ASSERT_OK(writer.Write(path_));
+  }
+
+  std::string path_;
+  std::vector<BasicBlockWithThroughputProto> protos_;
+};
+
+TEST_F(BasicBlockCorpusTest, RoundTrip) {
+  WriteCorpus();
+  auto corpus = BasicBlockCorpus::Open(path_);
+  ASSERT_OK(corpus);
+  ASSERT_EQ((*corpus)->num_blocks(), 2);
+  EXPECT_EQ((*corpus)->num_instructions(), 4);
+  EXPECT_EQ((*corpus)->num_instructions(0), 2);
+
+  // Read the blocks in reverse order to check the random access, and reuse the
+  // block to check that AssignBasicBlock() replaces all its contents.
+  BasicBlock block;
+  for (int i = 1; i >= 0; --i) {
+    (*corpus)->AssignBasicBlock(i, block);
+    EXPECT_EQ(block, BasicBlockFromProto(protos_[i].basic_block()));
+    EXPECT_EQ((*corpus)->GetBasicBlock(i), block);
+    EXPECT_THAT((*corpus)->GetBasicBlockWithThroughputProto(i),
+                EqualsProto(protos_[i].DebugString()));
+  }
+}
+
+TEST_F(BasicBlockCorpusTest, InverseThroughputs) {
+  WriteCorpus();
+  auto corpus = BasicBlockCorpus::Open(path_);
+  ASSERT_OK(corpus);
+
+  const std::vector<BasicBlockCorpus::InverseThroughput> throughputs =
+      (*corpus)->inverse_throughputs(0);
+  ASSERT_EQ(throughputs.size(), 2);
+  EXPECT_EQ(throughputs[0].source, "hsw");
+  EXPECT_THAT(throughputs[0].inverse_throughput_cycles, ElementsAre(1.5, 1.25));
+  EXPECT_EQ(throughputs[1].source, "skl");
+  EXPECT_THAT(throughputs[1].inverse_throughput_cycles, ElementsAre(2));
+  EXPECT_THAT((*corpus)->inverse_throughputs(1), IsEmpty());
+}
+
+TEST_F(BasicBlockCorpusTest, EmptyCorpus) {
+  protos_.clear();
+  WriteCorpus();
+  auto corpus = BasicBlockCorpus::Open(path_);
+  ASSERT_OK(corpus);
+  EXPECT_EQ((*corpus)->num_blocks(), 0);
+}
+
+TEST_F(BasicBlockCorpusTest, TruncatedFile) {
+  WriteCorpus();
+  std::string data;
+  {
+    std::ifstream file(path_, std::ios::binary);
+    data.assign(std::istreambuf_iterator<char>(file), {});
+  }
+  for (const size_t size : {size_t{0}, size_t{20}, data.size() / 2,
+                            data.size() - 8}) {
+    std::ofstream file(path_, std::ios::binary | std::ios::trunc);
+    file.write(data.data(), size);
+    file.close();
+    EXPECT_THAT(BasicBlockCorpus::Open(path_),
+                StatusIs(absl::StatusCode::kDataLoss))
+        << "size = " << size;
+  }
+}
+
+TEST_F(BasicBlockCorpusTest, CorruptedFile) {
+  WriteCorpus();
+  {
+    std::fstream file(path_, std::ios::binary | std::ios::in | std::ios::out);
+    file.seekp(0);
+    file.put('X');
+  }
+  EXPECT_THAT(BasicBlockCorpus::Open(path_),
+              StatusIs(absl::StatusCode::kDataLoss));
+
+  WriteCorpus();
+  std::string data;
+  {
+    std::ifstream file(path_, std::ios::binary);
+    data.assign(std::istreambuf_iterator<char>(file), {});
+  }
+  // Make the token data size in the header inconsistent with the offsets.
+  constexpr int kTokenDataSizeOffset = 3 * sizeof(uint64_t);
+  data[kTokenDataSizeOffset] ^= 1;
+  {
+    std::ofstream file(path_, std::ios::binary | std::ios::trunc);
+    file.write(data.data(), data.size());
+  }
+  EXPECT_THAT(BasicBlockCorpus::Open(path_),
+              StatusIs(absl::StatusCode::kDataLoss));
+}
+
+TEST_F(BasicBlockCorpusTest, InvalidPath) {
+  EXPECT_THAT(BasicBlockCorpus::Open("/this/file/does/not/exist.gmbb"),
+              StatusIs(absl::StatusCode::kNotFound));
+}
+
+}  // namespace
+}  // namespace gematria
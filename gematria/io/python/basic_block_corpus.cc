@@ -0,0 +1,167 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/io/basic_block_corpus.h"
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "absl/types/span.h"
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/proto/throughput.pb.h"
+#include "pybind11/cast.h"
+#include "pybind11/detail/common.h"
+#include "pybind11/numpy.h"
+#include "pybind11/pybind11.h"
+#include "pybind11/stl.h"
+#include "pybind11_abseil/import_status_module.h"
+#include "pybind11_abseil/status_casters.h"
+#include "pybind11_protobuf/native_proto_caster.h"
+
+namespace gematria {
+namespace {
+
+namespace py = ::pybind11;
+
+// Raises IndexError when `block_index` is not a valid index of a block in
+// `corpus`.
+void CheckBlockIndex(const BasicBlockCorpus& corpus, size_t block_index) {
+  if (block_index >= corpus.num_blocks()) {
+    throw py::index_error("Block index out of range");
+  }
+}
+
+PYBIND11_MODULE(basic_block_corpus, m) {
+  m.doc() = R"(A columnar, memory-mapped file format for basic blocks.
+
+See the comments in the C++ version of the module for the description of the
+format.)";
+
+  py::google::ImportStatusModule();
+  pybind11_protobuf::ImportNativeProtoCasters();
+
+  py::class_<BasicBlockCorpusWriter>(m, "BasicBlockCorpusWriter",
+                                     R"(Writes basic blocks to a corpus file.
+
+      The blocks are collected in memory, and written to the file by write().)")
+      .def(py::init<>())
+      .def("add_basic_block", &BasicBlockCorpusWriter::AddBasicBlock,
+           py::arg("block"),
+           R"(Adds a basic block. Returns the index of the block.)")
+      .def(
+          "add_inverse_throughput",
+          [](BasicBlockCorpusWriter& self, std::string_view source,
+             const std::vector<double>& inverse_throughput_cycles) {
+            if (self.num_blocks() == 0) {
+              throw py::value_error("No basic block was added yet");
+            }
+            self.AddInverseThroughput(source, inverse_throughput_cycles);
+          },
+          py::arg("source"), py::arg("inverse_throughput_cycles"),
+          R"(Adds an inverse throughput to the last block.)")
+      .def("add_basic_block_with_throughput_proto",
+           &BasicBlockCorpusWriter::AddBasicBlockWithThroughputProto,
+           py::arg("proto"),
+           R"(Adds a basic block with throughputs from a proto.
+
+          Returns the index of the block.)")
+      .def_property_readonly("num_blocks", &BasicBlockCorpusWriter::num_blocks)
+      .def("write", &BasicBlockCorpusWriter::Write, py::arg("path"),
+           py::call_guard<py::gil_scoped_release>(),
+           R"(Writes the blocks added so far to `path`.
+
+          Raises:
+            StatusNotOk: When the file can't be written.)");
+
+  py::class_<BasicBlockCorpus>(m, "BasicBlockCorpus",
+                               R"(A read-only, memory-mapped corpus file.
+
+      The methods of the corpus release the GIL, and can be used from multiple
+      threads at the same time.)")
+      .def_static("open", &BasicBlockCorpus::Open, py::arg("path"),
+                  py::call_guard<py::gil_scoped_release>(),
+                  R"(Maps the corpus file at `path` to memory.
+
+          Raises:
+            StatusNotOk: When the file can't be mapped or when it is not a
+              valid corpus file.)")
+      .def_property_readonly("num_blocks", &BasicBlockCorpus::num_blocks)
+      .def("__len__", &BasicBlockCorpus::num_blocks)
+      .def(
+          "get_basic_block",
+          [](const BasicBlockCorpus& self, size_t block_index) {
+            CheckBlockIndex(self, block_index);
+            py::gil_scoped_release release_gil;
+            return self.GetBasicBlock(block_index);
+          },
+          py::arg("block_index"))
+      .def(
+          "get_basic_blocks",
+          [](const BasicBlockCorpus& self,
+             const std::vector<size_t>& block_indices) {
+            for (const size_t block_index : block_indices) {
+              CheckBlockIndex(self, block_index);
+            }
+            py::gil_scoped_release release_gil;
+            std::vector<BasicBlock> blocks(block_indices.size());
+            for (size_t i = 0; i < block_indices.size(); ++i) {
+              self.AssignBasicBlock(block_indices[i], blocks[i]);
+            }
+            return blocks;
+          },
+          py::arg("block_indices"),
+          R"(Returns the blocks with the given indices, in the same order.)")
+      .def(
+          "get_basic_block_with_throughput_proto",
+          [](const BasicBlockCorpus& self, size_t block_index) {
+            CheckBlockIndex(self, block_index);
+            py::gil_scoped_release release_gil;
+            return self.GetBasicBlockWithThroughputProto(block_index);
+          },
+          py::arg("block_index"))
+      .def(
+          "inverse_throughputs",
+          [](py::object self, size_t block_index) {
+            const BasicBlockCorpus& corpus =
+                self.cast<const BasicBlockCorpus&>();
+            CheckBlockIndex(corpus, block_index);
+            // The values are read-only views of the mapped file, and they keep
+            // the corpus alive.
+            py::list result;
+            for (const BasicBlockCorpus::InverseThroughput& throughput :
+                 corpus.inverse_throughputs(block_index)) {
+              const absl::Span<const double> values =
+                  throughput.inverse_throughput_cycles;
+              py::array_t<double> array(
+                  static_cast<py::ssize_t>(values.size()), values.data(), self);
+              array.attr("flags").attr("writeable") = false;
+              result.append(py::make_tuple(
+                  py::str(throughput.source.data(), throughput.source.size()),
+                  std::move(array)));
+            }
+            return result;
+          },
+          py::arg("block_index"),
+          R"(Returns the inverse throughputs of a block.
+
+          Returns:
+            A list of (source, inverse_throughput_cycles) tuples, where the
+            cycles are a read-only NumPy array backed by the corpus file.)");
+}
+
+}  // namespace
+}  // namespace gematria
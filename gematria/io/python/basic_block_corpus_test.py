@@ -0,0 +1,78 @@
+# Copyright 2023 Google Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#    http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import os
+
+from absl.testing import absltest
+from gematria.basic_block.python import basic_block_protos
+from gematria.io.python import basic_block_corpus
+from gematria.testing.python import basic_blocks_with_throughput
+from pybind11_abseil import status
+
+
+class BasicBlockCorpusTest(
+    basic_blocks_with_throughput.TestCase, absltest.TestCase
+):
+  """Test for the Python bindings of the corpus reader and writer.
+
+  Most of the functionality is tested in the corresponding cc_test(). Here we
+  test just that the bindings return the expected data.
+  """
+
+  def setUp(self):
+    self.num_blocks = 10
+    super().setUp()
+    self.path = os.path.join(self.create_tempdir().full_path, 'corpus.gmbb')
+    writer = basic_block_corpus.BasicBlockCorpusWriter()
+    for proto in self.block_protos:
+      writer.add_basic_block_with_throughput_proto(proto)
+    self.assertEqual(writer.num_blocks, self.num_blocks)
+    writer.write(self.path)
+
+  def test_read_blocks(self):
+    corpus = basic_block_corpus.BasicBlockCorpus.open(self.path)
+    self.assertLen(corpus, self.num_blocks)
+    for i, proto in enumerate(self.block_protos):
+      self.assertEqual(
+          corpus.get_basic_block(i),
+          basic_block_protos.basic_block_from_proto(proto.basic_block),
+      )
+    self.assertEqual(
+        corpus.get_basic_blocks([3, 1]),
+        [corpus.get_basic_block(3), corpus.get_basic_block(1)],
+    )
+    with self.assertRaises(IndexError):
+      corpus.get_basic_block(self.num_blocks)
+
+  def test_inverse_throughputs(self):
+    corpus = basic_block_corpus.BasicBlockCorpus.open(self.path)
+    for i, proto in enumerate(self.block_protos):
+      throughputs = corpus.inverse_throughputs(i)
+      self.assertLen(throughputs, len(proto.inverse_throughputs))
+      for (source, cycles), expected in zip(
+          throughputs, proto.inverse_throughputs
+      ):
+        self.assertEqual(source, expected.source)
+        self.assertSequenceEqual(
+            cycles.tolist(), expected.inverse_throughput_cycles
+        )
+        self.assertFalse(cycles.flags.writeable)
+
+  def test_invalid_file(self):
+    with self.assertRaises(status.StatusNotOk):
+      basic_block_corpus.BasicBlockCorpus.open('/this/file/does/not/exist')
+
+
+if __name__ == '__main__':
+  absltest.main()
@@ -0,0 +1,100 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/io/tfrecord_reader.h"
+
+#include <cstdint>
+#include <fstream>
+#include <ios>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "gematria/io/tfrecord_writer.h"
+
+namespace gematria {
+namespace {
+
+// The size of the buffer used for reading the file.
+constexpr int kBufferSize = 1 << 20;
+
+// Loads a little-endian integer from `buffer`.
+template <typename IntType>
+IntType LoadLittleEndian(const char* buffer) {
+  IntType value = 0;
+  for (int i = 0; i < sizeof(IntType); ++i) {
+    value |= static_cast<IntType>(static_cast<uint8_t>(buffer[i])) << (8 * i);
+  }
+  return value;
+}
+
+}  // namespace
+
+absl::StatusOr<std::unique_ptr<TFRecordReader>> TFRecordReader::Open(
+    const std::string& path) {
+  auto buffer = std::make_unique<std::vector<char>>(kBufferSize);
+  std::ifstream file;
+  file.rdbuf()->pubsetbuf(buffer->data(), buffer->size());
+  file.open(path, std::ios::binary);
+  if (!file.is_open()) {
+    return absl::NotFoundError(absl::StrCat("Could not open ", path));
+  }
+  // We can't use std::make_unique<TFRecordReader>(), because
+  // std::make_unique<>() requires a public constructor.
+  return std::unique_ptr<TFRecordReader>(
+      new TFRecordReader(path, std::move(file), std::move(buffer)));
+}
+
+TFRecordReader::TFRecordReader(std::string path, std::ifstream file,
+                               std::unique_ptr<std::vector<char>> buffer)
+    : path_(std::move(path)),
+      buffer_(std::move(buffer)),
+      file_(std::move(file)) {}
+
+absl::StatusOr<bool> TFRecordReader::Read(std::string& record) {
+  char header[sizeof(uint64_t) + sizeof(uint32_t)];
+  file_.read(header, sizeof(header));
+  if (file_.gcount() == 0 && file_.eof()) return false;
+  if (file_.gcount() != sizeof(header)) {
+    return absl::DataLossError(
+        absl::StrCat("Truncated record header in ", path_));
+  }
+  const std::string_view length_bytes(header, sizeof(uint64_t));
+  if (TFRecordMaskedCrc32c(length_bytes) !=
+      LoadLittleEndian<uint32_t>(header + sizeof(uint64_t))) {
+    return absl::DataLossError(
+        absl::StrCat("Corrupted record length in ", path_));
+  }
+  const uint64_t length = LoadLittleEndian<uint64_t>(header);
+
+  record.resize(length);
+  char footer[sizeof(uint32_t)];
+  file_.read(record.data(), length);
+  file_.read(footer, sizeof(footer));
+  if (!file_) {
+    return absl::DataLossError(absl::StrCat("Truncated record in ", path_));
+  }
+  if (TFRecordMaskedCrc32c(record) != LoadLittleEndian<uint32_t>(footer)) {
+    return absl::DataLossError(
+        absl::StrCat("Corrupted record data in ", path_));
+  }
+  return true;
+}
+
+}  // namespace gematria
@@ -0,0 +1,58 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Contains a minimal reader of uncompressed TFRecord files that does not
+// depend on TensorFlow. See tfrecord_writer.h for the description of the
+// format.
+
+#ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_IO_TFRECORD_READER_H_
+#define THIRD_PARTY_GEMATRIA_GEMATRIA_IO_TFRECORD_READER_H_
+
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+
+namespace gematria {
+
+// Reads records from an uncompressed TFRecord file, and verifies their
+// checksums.
+class TFRecordReader {
+ public:
+  // Opens `path` for reading. Returns an error when the file can't be opened.
+  static absl::StatusOr<std::unique_ptr<TFRecordReader>> Open(
+      const std::string& path);
+
+  // Reads the next record from the file into `record`; reuses the memory
+  // allocated by `record`. Returns true when a record was read and false at
+  // the end of the file. Returns an error when the file is truncated or a
+  // checksum does not match.
+  absl::StatusOr<bool> Read(std::string& record);
+
+ private:
+  TFRecordReader(std::string path, std::ifstream file,
+                 std::unique_ptr<std::vector<char>> buffer);
+
+  const std::string path_;
+  // The buffer of `file_`; declared first, so that it outlives the stream.
+  const std::unique_ptr<std::vector<char>> buffer_;
+  std::ifstream file_;
+};
+
+}  // namespace gematria
+
+#endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_IO_TFRECORD_READER_H_
@@ -0,0 +1,101 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/io/tfrecord_reader.h"
+
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "gematria/io/tfrecord_writer.h"
+#include "gematria/testing/matchers.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace gematria {
+namespace {
+
+using ::testing::ElementsAre;
+
+class TFRecordReaderTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    path_ = ::testing::TempDir() + "/records.tfrecord";
+  }
+
+  void WriteRecords(const std::vector<std::string>& records) {
+    auto writer = TFRecordWriter::Open(path_);
+    ASSERT_OK(writer);
+    for (const std::string& record : records) {
+      ASSERT_OK((*writer)->Write(record));
+    }
+    ASSERT_OK((*writer)->Close());
+  }
+
+  std::string path_;
+};
+
+TEST_F(TFRecordReaderTest, ReadRecords) {
+  WriteRecords({"abc", "", std::string(100000, 'x')});
+
+  auto reader = TFRecordReader::Open(path_);
+  ASSERT_OK(reader);
+  std::vector<std::string> records;
+  std::string record;
+  while (true) {
+    absl::StatusOr<bool> has_record = (*reader)->Read(record);
+    ASSERT_OK(has_record);
+    if (!*has_record) break;
+    records.push_back(record);
+  }
+  EXPECT_THAT(records, ElementsAre("abc", "", std::string(100000, 'x')));
+}
+
+TEST_F(TFRecordReaderTest, CorruptedData) {
+  WriteRecords({"abc"});
+  {
+    // Replace "abc" with "abd"; the record starts after the 12-byte header.
+    std::fstream file(path_, std::ios::in | std::ios::out | std::ios::binary);
+    file.seekp(14);
+    file.put('d');
+  }
+
+  auto reader = TFRecordReader::Open(path_);
+  ASSERT_OK(reader);
+  std::string record;
+  EXPECT_THAT((*reader)->Read(record), StatusIs(absl::StatusCode::kDataLoss));
+}
+
+TEST_F(TFRecordReaderTest, TruncatedFile) {
+  WriteRecords({"abc"});
+  {
+    std::ofstream file(path_, std::ios::binary | std::ios::trunc);
+    file.write("\x03\0\0", 3);
+  }
+
+  auto reader = TFRecordReader::Open(path_);
+  ASSERT_OK(reader);
+  std::string record;
+  EXPECT_THAT((*reader)->Read(record), StatusIs(absl::StatusCode::kDataLoss));
+}
+
+TEST_F(TFRecordReaderTest, InvalidPath) {
+  EXPECT_THAT(TFRecordReader::Open("/this/directory/does/not/exist.tfrecord"),
+              StatusIs(absl::StatusCode::kNotFound));
+}
+
+}  // namespace
+}  // namespace gematria
@@ -0,0 +1,94 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/io/tfrecord_writer.h"
+
+#include <cstdint>
+#include <fstream>
+#include <ios>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "absl/crc/crc32c.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+
+namespace gematria {
+namespace {
+
+// Stores `value` to `buffer` in the little-endian byte order.
+template <typename IntType>
+void StoreLittleEndian(IntType value, char* buffer) {
+  for (int i = 0; i < sizeof(IntType); ++i) {
+    buffer[i] = static_cast<char>(value >> (8 * i));
+  }
+}
+
+}  // namespace
+
+uint32_t TFRecordMaskedCrc32c(std::string_view data) {
+  static constexpr uint32_t kMaskDelta = 0xa282ead8;
+  const uint32_t crc = static_cast<uint32_t>(absl::ComputeCrc32c(data));
+  return ((crc >> 15) | (crc << 17)) + kMaskDelta;
+}
+
+absl::StatusOr<std::unique_ptr<TFRecordWriter>> TFRecordWriter::Open(
+    const std::string& path) {
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  if (!file.is_open()) {
+    return absl::NotFoundError(absl::StrCat("Could not open ", path));
+  }
+  // We can't use std::make_unique<TFRecordWriter>(), because
+  // std::make_unique<>() requires a public constructor.
+  return std::unique_ptr<TFRecordWriter>(
+      new TFRecordWriter(path, std::move(file)));
+}
+
+TFRecordWriter::TFRecordWriter(std::string path, std::ofstream file)
+    : path_(std::move(path)), file_(std::move(file)) {}
+
+TFRecordWriter::~TFRecordWriter() {
+  if (file_.is_open()) Close().IgnoreError();
+}
+
+absl::Status TFRecordWriter::Write(std::string_view record) {
+  char header[sizeof(uint64_t) + sizeof(uint32_t)];
+  StoreLittleEndian<uint64_t>(record.size(), header);
+  StoreLittleEndian<uint32_t>(
+      TFRecordMaskedCrc32c(std::string_view(header, sizeof(uint64_t))),
+      header + sizeof(uint64_t));
+  char footer[sizeof(uint32_t)];
+  StoreLittleEndian<uint32_t>(TFRecordMaskedCrc32c(record), footer);
+
+  file_.write(header, sizeof(header));
+  file_.write(record.data(), record.size());
+  file_.write(footer, sizeof(footer));
+  if (!file_) {
+    return absl::InternalError(absl::StrCat("Could not write to ", path_));
+  }
+  return absl::OkStatus();
+}
+
+absl::Status TFRecordWriter::Close() {
+  file_.close();
+  if (!file_) {
+    return absl::InternalError(absl::StrCat("Could not write to ", path_));
+  }
+  return absl::OkStatus();
+}
+
+}  // namespace gematria
@@ -0,0 +1,70 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Contains a minimal writer of TFRecord files that does not depend on
+// TensorFlow. The files can be read with tf.data.TFRecordDataset and with
+// gematria.io.python.tfrecord.
+
+#ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_IO_TFRECORD_WRITER_H_
+#define THIRD_PARTY_GEMATRIA_GEMATRIA_IO_TFRECORD_WRITER_H_
+
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+
+namespace gematria {
+
+// Returns the masked CRC32C checksum of `data`, as used in the TFRecord
+// format.
+uint32_t TFRecordMaskedCrc32c(std::string_view data);
+
+// Writes records to an uncompressed TFRecord file. Each record is stored as:
+//   uint64 length
+//   uint32 masked_crc32c(length)
+//   byte   data[length]
+//   uint32 masked_crc32c(data)
+// where the integers are little-endian.
+class TFRecordWriter {
+ public:
+  // Creates a new writer that writes to `path`. Overwrites the file when it
+  // already exists. Returns an error when the file can't be opened.
+  static absl::StatusOr<std::unique_ptr<TFRecordWriter>> Open(
+      const std::string& path);
+
+  // Closes the file if it was not closed yet. Errors are ignored; use Close()
+  // to check them.
+  ~TFRecordWriter();
+
+  // Appends `record` to the file.
+  absl::Status Write(std::string_view record);
+
+  // Flushes and closes the file. Returns an error when some of the data could
+  // not be written.
+  absl::Status Close();
+
+ private:
+  TFRecordWriter(std::string path, std::ofstream file);
+
+  const std::string path_;
+  std::ofstream file_;
+};
+
+}  // namespace gematria
+
+#endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_IO_TFRECORD_WRITER_H_
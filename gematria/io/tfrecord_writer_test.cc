@@ -0,0 +1,69 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/io/tfrecord_writer.h"
+
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+
+#include "absl/status/status.h"
+#include "gematria/testing/matchers.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace gematria {
+namespace {
+
+using ::testing::Eq;
+
+std::string ReadFile(const std::string& path) {
+  std::ifstream file(path, std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(file),
+                     std::istreambuf_iterator<char>());
+}
+
+TEST(TFRecordMaskedCrc32cTest, KnownValues) {
+  EXPECT_EQ(TFRecordMaskedCrc32c(""), 0xa282ead8);
+  EXPECT_EQ(TFRecordMaskedCrc32c("abc"), 0x21f1576e);
+  EXPECT_EQ(TFRecordMaskedCrc32c(std::string("\x03\0\0\0\0\0\0\0", 8)),
+            0x0e4999b0);
+}
+
+TEST(TFRecordWriterTest, WriteRecords) {
+  const std::string path = ::testing::TempDir() + "/records.tfrecord";
+  auto writer_or_status = TFRecordWriter::Open(path);
+  ASSERT_OK(writer_or_status);
+  std::unique_ptr<TFRecordWriter> writer = std::move(writer_or_status).value();
+  EXPECT_OK(writer->Write("abc"));
+  EXPECT_OK(writer->Write(""));
+  EXPECT_OK(writer->Close());
+
+  const std::string expected_data =
+      // The first record.
+      std::string("\x03\0\0\0\0\0\0\0", 8) + "\xb0\x99\x49\x0e" + "abc" +
+      "\x6e\x57\xf1\x21" +
+      // The second record.
+      std::string(8, '\0') + "\x29\x03\x98\x07" + "\xd8\xea\x82\xa2";
+  EXPECT_THAT(ReadFile(path), Eq(expected_data));
+}
+
+TEST(TFRecordWriterTest, InvalidPath) {
+  EXPECT_THAT(TFRecordWriter::Open("/this/directory/does/not/exist.tfrecord"),
+              StatusIs(absl::StatusCode::kNotFound));
+}
+
+}  // namespace
+}  // namespace gematria
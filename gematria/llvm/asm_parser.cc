@@ -15,20 +15,26 @@
 #include "gematria/llvm/asm_parser.h"
 
 #include <cstdint>
+#include <deque>
 #include <memory>
+#include <string>
+#include <string_view>
 #include <utility>
 #include <vector>
 
+#include "absl/functional/function_ref.h"
 #include "absl/status/status.h"
 #include "absl/status/statusor.h"
 #include "absl/strings/str_cat.h"
 #include "gematria/llvm/diagnostics.h"
+#include "llvm/ADT/StringRef.h"
 #include "llvm/BinaryFormat/ELF.h"
 #include "llvm/IR/InlineAsm.h"
 #include "llvm/MC/MCContext.h"
 #include "llvm/MC/MCDirectives.h"
 #include "llvm/MC/MCInst.h"
 #include "llvm/MC/MCObjectFileInfo.h"
+#include "llvm/MC/MCParser/MCAsmLexer.h"
 #include "llvm/MC/MCParser/MCAsmParser.h"
 #include "llvm/MC/MCParser/MCTargetAsmParser.h"
 #include "llvm/MC/MCSection.h"
@@ -47,27 +53,89 @@
 namespace gematria {
 namespace {
 
-// A streamer that puts MCInst's in a vector.
-class MCInstStreamer : public llvm::MCStreamer {
+// A streamer that puts MCInst's in blocks and passes the blocks to a callback.
+// It is also the comment consumer of the lexer, to find separator comments.
+//
+// The lexer reads one token ahead of the parser, and the target parser
+// consumes the end of the statement before the instruction is emitted, so the
+// comment on the line after an instruction may be seen before the instruction
+// itself. The starts of the blocks are thus queued and ordered by their
+// location in the buffer relative to the instructions.
+class MCInstStreamer : public llvm::MCStreamer,
+                       public llvm::AsmCommentConsumer {
  public:
-  explicit MCInstStreamer(llvm::MCContext* context)
+  MCInstStreamer(llvm::MCContext* context,
+                 const AsmBlockSplitOptions& split_options,
+                 absl::FunctionRef<void(AsmBlock)> callback)
       : llvm::MCStreamer(*context),
         section_(context->getELFNamedSection("", "fake_section",
-                                             llvm::ELF::SHT_PROGBITS, 0)) {}
+                                             llvm::ELF::SHT_PROGBITS, 0)),
+        split_options_(split_options),
+        callback_(callback) {}
 
   void emitInstruction(
       const llvm::MCInst& instruction,
       const llvm::MCSubtargetInfo& mc_subtarget_info) override {
-    instructions_.push_back(instruction);
+    StartPendingBlocks(instruction.getLoc());
+    current_block_.instructions.push_back(instruction);
+  }
+
+  void emitLabel(llvm::MCSymbol* symbol, llvm::SMLoc loc) override {
+    llvm::MCStreamer::emitLabel(symbol, loc);
+    // Labels created by the streamer itself, e.g. for CFI directives, do not
+    // have a location in the buffer and do not start a block.
+    if (!split_options_.split_at_labels || !loc.isValid()) return;
+    block_starts_.push_back({loc, symbol->getName().str()});
+  }
+
+  void HandleComment(llvm::SMLoc loc, llvm::StringRef comment_text) override {
+    if (split_options_.separator_comment.empty() ||
+        comment_text.trim() != split_options_.separator_comment) {
+      return;
+    }
+    block_starts_.push_back({loc, std::string()});
   }
 
   void initSections(bool, const llvm::MCSubtargetInfo&) override {
     switchSection(section_);
   }
 
-  std::vector<llvm::MCInst> Get() && { return std::move(instructions_); }
+  // Passes the last block to the callback. Must be called after the parser
+  // finishes.
+  void Finish() {
+    StartPendingBlocks(llvm::SMLoc());
+    EmitCurrentBlock();
+  }
 
  private:
+  // The start of a block that was seen by the parser, but that does not have
+  // any instructions yet.
+  struct BlockStart {
+    llvm::SMLoc loc;
+    std::string label;
+  };
+
+  // Starts all queued blocks that begin before `loc` in the buffer. When `loc`
+  // is not valid, starts all queued blocks.
+  void StartPendingBlocks(llvm::SMLoc loc) {
+    while (!block_starts_.empty() &&
+           (!loc.isValid() ||
+            block_starts_.front().loc.getPointer() <= loc.getPointer())) {
+      EmitCurrentBlock();
+      current_block_.label = std::move(block_starts_.front().label);
+      block_starts_.pop_front();
+    }
+  }
+
+  // Passes the current block to the callback if it has any instructions, and
+  // starts a new empty block.
+  void EmitCurrentBlock() {
+    if (!current_block_.instructions.empty()) {
+      callback_(std::move(current_block_));
+    }
+    current_block_ = AsmBlock();
+  }
+
   // We only care about instructions, we don't implement this part of the API.
   void emitCommonSymbol(llvm::MCSymbol* symbol, uint64_t size,
                         llvm::Align byte_alignment) override {}
@@ -82,16 +150,22 @@ class MCInstStreamer : public llvm::MCStreamer {
                     uint64_t size, llvm::Align byte_alignment,
                     llvm::SMLoc Loc) override {}
 
-  std::vector<llvm::MCInst> instructions_;
   llvm::MCSectionELF* const section_;
+  const AsmBlockSplitOptions& split_options_;
+  const absl::FunctionRef<void(AsmBlock)> callback_;
+
+  AsmBlock current_block_;
+  std::deque<BlockStart> block_starts_;
 };
 
 }  // namespace
 
-absl::StatusOr<std::vector<llvm::MCInst>> ParseAsmCodeFromBuffer(
+absl::Status ParseAsmBlocksFromBuffer(
     const llvm::TargetMachine& target_machine,
     std::unique_ptr<llvm::MemoryBuffer> buffer,
-    const llvm::InlineAsm::AsmDialect dialect) {
+    const llvm::InlineAsm::AsmDialect dialect,
+    const AsmBlockSplitOptions& split_options,
+    absl::FunctionRef<void(AsmBlock)> callback) {
   const llvm::Target& target = target_machine.getTarget();
 
   llvm::SourceMgr source_manager;
@@ -106,10 +180,13 @@ absl::StatusOr<std::vector<llvm::MCInst>> ParseAsmCodeFromBuffer(
   object_file_info.initMCObjectFileInfo(mc_context, /*PIC*/ true);
   mc_context.setObjectFileInfo(&object_file_info);
 
-  MCInstStreamer streamer(&mc_context);
+  MCInstStreamer streamer(&mc_context, split_options, callback);
   const std::unique_ptr<llvm::MCAsmParser> asm_parser(llvm::createMCAsmParser(
       source_manager, mc_context, streamer, *target_machine.getMCAsmInfo()));
   asm_parser->setAssemblerDialect(dialect);
+  if (!split_options.separator_comment.empty()) {
+    asm_parser->getLexer().setCommentConsumer(&streamer);
+  }
 
   const std::unique_ptr<llvm::MCTargetAsmParser> target_asm_parser(
       target.createMCAsmParser(*target_machine.getMCSubtargetInfo(),
@@ -123,11 +200,39 @@ absl::StatusOr<std::vector<llvm::MCInst>> ParseAsmCodeFromBuffer(
 
   // Intercept errors to put them in the returned status in case of failure.
   ScopedStringDiagnosticHandler errors(mc_context);
-  if (asm_parser->Run(false)) {
+  const bool has_errors = asm_parser->Run(false);
+  streamer.Finish();
+  if (has_errors) {
     return absl::InvalidArgumentError(
         absl::StrCat("cannot parse asm file:\n", errors.Get()));
   }
-  return std::move(streamer).Get();
+  return absl::OkStatus();
+}
+
+absl::Status ParseAsmBlocksFromString(
+    const llvm::TargetMachine& target_machine, std::string_view assembly,
+    llvm::InlineAsm::AsmDialect dialect,
+    const AsmBlockSplitOptions& split_options,
+    absl::FunctionRef<void(AsmBlock)> callback) {
+  std::unique_ptr<llvm::MemoryBuffer> buffer =
+      llvm::MemoryBuffer::getMemBuffer(assembly);
+  return ParseAsmBlocksFromBuffer(target_machine, std::move(buffer), dialect,
+                                  split_options, callback);
+}
+
+absl::StatusOr<std::vector<llvm::MCInst>> ParseAsmCodeFromBuffer(
+    const llvm::TargetMachine& target_machine,
+    std::unique_ptr<llvm::MemoryBuffer> buffer,
+    const llvm::InlineAsm::AsmDialect dialect) {
+  std::vector<llvm::MCInst> instructions;
+  const absl::Status status = ParseAsmBlocksFromBuffer(
+      target_machine, std::move(buffer), dialect, {.split_at_labels = false},
+      [&instructions](AsmBlock block) {
+        instructions.insert(instructions.end(), block.instructions.begin(),
+                            block.instructions.end());
+      });
+  if (!status.ok()) return status;
+  return instructions;
 }
 
 absl::StatusOr<std::vector<llvm::MCInst>> ParseAsmCodeFromString(
@@ -16,9 +16,12 @@
 #define THIRD_PARTY_GEMATRIA_GEMATRIA_LLVM_ASM_PARSER_H_
 
 #include <memory>
+#include <string>
 #include <string_view>
 #include <vector>
 
+#include "absl/functional/function_ref.h"
+#include "absl/status/status.h"
 #include "absl/status/statusor.h"
 #include "llvm/IR/InlineAsm.h"
 #include "llvm/MC/MCInst.h"
@@ -41,6 +44,54 @@ absl::StatusOr<std::vector<llvm::MCInst>> ParseAsmCodeFromBuffer(
     std::unique_ptr<llvm::MemoryBuffer> buffer,
     llvm::InlineAsm::AsmDialect dialect);
 
+// A block of instructions produced by ParseAsmBlocksFromBuffer().
+struct AsmBlock {
+  // The name of the label that starts the block. Empty when the block starts
+  // at the beginning of the buffer or at a separator comment.
+  std::string label;
+  std::vector<llvm::MCInst> instructions;
+};
+
+// Options that control where ParseAsmBlocksFromBuffer() splits the assembly
+// code into blocks.
+struct AsmBlockSplitOptions {
+  // When true, each label in the assembly code starts a new block.
+  bool split_at_labels = true;
+  // When not empty, each comment whose text is equal to `separator_comment`
+  // starts a new block. The comment marker and the whitespace around the text
+  // are not part of the comparison, i.e. "# --- " matches "---" for x86-64.
+  std::string separator_comment;
+};
+
+// Parses `buffer` once and splits the instructions into blocks at labels and
+// at separator comments as configured by `split_options`. Calls `callback` for
+// each block that contains at least one instruction, in the order in which the
+// blocks appear in the buffer, as soon as all instructions of the block are
+// parsed. Directives and other parts of the assembly language that are not
+// instructions or labels are ignored.
+//
+// The MC context, streamer and parsers are created once per call, so parsing a
+// whole corpus as a single buffer is much cheaper than one call of
+// ParseAsmCodeFromString() per block.
+//
+// Returns an error when the assembly can't be parsed. Note that the parser
+// recovers from errors at the end of each statement; the blocks parsed before
+// and after the error may already have been passed to `callback`.
+absl::Status ParseAsmBlocksFromBuffer(
+    const llvm::TargetMachine& target_machine,
+    std::unique_ptr<llvm::MemoryBuffer> buffer,
+    llvm::InlineAsm::AsmDialect dialect,
+    const AsmBlockSplitOptions& split_options,
+    absl::FunctionRef<void(AsmBlock)> callback);
+
+// A version of ParseAsmBlocksFromBuffer that takes a string instead of an
+// llvm::MemoryBuffer. The string must remain alive until the function returns.
+absl::Status ParseAsmBlocksFromString(
+    const llvm::TargetMachine& target_machine, std::string_view assembly,
+    llvm::InlineAsm::AsmDialect dialect,
+    const AsmBlockSplitOptions& split_options,
+    absl::FunctionRef<void(AsmBlock)> callback);
+
 }  // namespace gematria
 
 #endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_LLVM_ASM_PARSER_H_
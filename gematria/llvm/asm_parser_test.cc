@@ -16,10 +16,14 @@
 
 #include <cstdint>
 #include <memory>
+#include <string>
+#include <string_view>
 #include <tuple>
 #include <type_traits>
+#include <vector>
 
 #include "absl/status/status.h"
+#include "absl/status/statusor.h"
 #include "gematria/llvm/llvm_architecture_support.h"
 #include "gematria/testing/llvm.h"
 #include "gematria/testing/matchers.h"
@@ -34,6 +38,9 @@ namespace gematria {
 namespace {
 
 using ::testing::ElementsAre;
+using ::testing::Field;
+using ::testing::IsEmpty;
+using ::testing::SizeIs;
 
 class AsmParserTest : public testing::Test {
  protected:
@@ -91,5 +98,69 @@ TEST_F(AsmParserTest, AssemblyFailure) {
   EXPECT_THAT(result, StatusIs(absl::StatusCode::kInvalidArgument));
 }
 
+class AsmBlockParserTest : public AsmParserTest {
+ protected:
+  // Parses `assembly` with `split_options` and returns the parsed blocks.
+  absl::StatusOr<std::vector<AsmBlock>> ParseBlocks(
+      std::string_view assembly, llvm::InlineAsm::AsmDialect dialect,
+      const AsmBlockSplitOptions& split_options) {
+    std::vector<AsmBlock> blocks;
+    const absl::Status status = ParseAsmBlocksFromString(
+        llvm_x86_->target_machine(), assembly, dialect, split_options,
+        [&blocks](AsmBlock block) { blocks.push_back(std::move(block)); });
+    if (!status.ok()) return status;
+    return blocks;
+  }
+};
+
+auto IsAsmBlock(std::string_view label, int num_instructions) {
+  return testing::AllOf(
+      Field(&AsmBlock::label, label),
+      Field(&AsmBlock::instructions, SizeIs(num_instructions)));
+}
+
+TEST_F(AsmBlockParserTest, SplitAtLabels) {
+  static constexpr std::string_view kAssembly = R"asm(
+    xor eax, eax
+  .LBB0_1:
+    add eax, 1
+    add eax, 2
+  .LBB0_2:
+  .LBB0_3:
+    ret
+  )asm";
+  EXPECT_THAT(ParseBlocks(kAssembly, llvm::InlineAsm::AD_Intel, {}),
+              IsOkAndHolds(ElementsAre(IsAsmBlock("", 1),
+                                       IsAsmBlock(".LBB0_1", 2),
+                                       IsAsmBlock(".LBB0_3", 1))));
+}
+
+TEST_F(AsmBlockParserTest, SplitAtSeparatorComments) {
+  static constexpr std::string_view kAssembly = R"asm(
+    xorl %eax, %eax
+    # ---
+    addl $1, %eax
+  .LBB0_1:
+    addl $2, %eax  # ---
+    addl $3, %eax
+  )asm";
+  EXPECT_THAT(
+      ParseBlocks(kAssembly, llvm::InlineAsm::AD_ATT,
+                  {.split_at_labels = false, .separator_comment = "---"}),
+      IsOkAndHolds(ElementsAre(IsAsmBlock("", 1), IsAsmBlock("", 2),
+                               IsAsmBlock("", 1))));
+}
+
+TEST_F(AsmBlockParserTest, NoInstructions) {
+  EXPECT_THAT(ParseBlocks(".LBB0_1:\n", llvm::InlineAsm::AD_Intel, {}),
+              IsOkAndHolds(IsEmpty()));
+}
+
+TEST_F(AsmBlockParserTest, AssemblyFailure) {
+  EXPECT_THAT(ParseBlocks("this is not valid assembly",
+                          llvm::InlineAsm::AD_Intel, {}),
+              StatusIs(absl::StatusCode::kInvalidArgument));
+}
+
 }  // namespace
 }  // namespace gematria
@@ -14,14 +14,24 @@
 
 #include "gematria/llvm/canonicalizer.h"
 
+#include <atomic>
 #include <cassert>
+#include <cstdint>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <string_view>
+#include <utility>
+#include <vector>
 
 #include "gematria/basic_block/basic_block.h"
+#include "gematria/basic_block/token_interner.h"
+#include "gematria/utils/tracing.h"
 #include "lib/Target/X86/MCTargetDesc/X86BaseInfo.h"
 #include "llvm/ADT/ArrayRef.h"
 #include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringRef.h"
 #include "llvm/MC/MCInst.h"
 #include "llvm/MC/MCInstrDesc.h"
 #include "llvm/MC/MCInstrInfo.h"
@@ -41,6 +51,13 @@ namespace {
 // the binary code, e.g. addresses relative to labels or symbols. We can't
 // evaluate them without laying out the binary code, so we just replace them
 // with a constant.
+bool HasExprOperands(const llvm::MCInst& instruction) {
+  for (const llvm::MCOperand& operand : instruction) {
+    if (operand.isExpr()) return true;
+  }
+  return false;
+}
+
 void ReplaceExprOperands(llvm::MCInst& instruction) {
   for (int i = 0; i < instruction.getNumOperands(); ++i) {
     llvm::MCOperand& operand = instruction.getOperand(i);
@@ -59,24 +76,71 @@ void ReplaceExprOperands(llvm::MCInst& instruction) {
 Canonicalizer::Canonicalizer(const llvm::TargetMachine* target_machine)
     : target_machine_(*target_machine) {
   assert(target_machine != nullptr);
+  const llvm::MCRegisterInfo& register_info =
+      *target_machine_.getMCRegisterInfo();
+  TokenInterner& interner = TokenInterner::Global();
+  register_ids_.reserve(register_info.getNumRegs());
+  for (unsigned reg = 0; reg < register_info.getNumRegs(); ++reg) {
+    register_ids_.push_back(interner.Intern(register_info.getName(reg)));
+  }
 }
 
 Canonicalizer::~Canonicalizer() = default;
 
-Instruction Canonicalizer::InstructionFromMCInst(llvm::MCInst mcinst) const {
-  ReplaceExprOperands(mcinst);
-  return PlatformSpecificInstructionFromMCInst(mcinst);
+Instruction Canonicalizer::InstructionFromMCInst(
+    const llvm::MCInst& mcinst) const {
+  Instruction instruction;
+  AssignInstructionFromMCInst(mcinst, instruction);
+  return instruction;
 }
 
 BasicBlock Canonicalizer::BasicBlockFromMCInst(
     llvm::ArrayRef<llvm::MCInst> mcinsts) const {
   BasicBlock block;
-  for (const llvm::MCInst& mcinst : mcinsts) {
-    block.instructions.push_back(InstructionFromMCInst(mcinst));
-  }
+  AssignBasicBlockFromMCInst(mcinsts, block);
   return block;
 }
 
+std::vector<BasicBlock> Canonicalizer::BasicBlocksFromMCInsts(
+    llvm::ArrayRef<llvm::ArrayRef<llvm::MCInst>> blocks) const {
+  std::vector<BasicBlock> basic_blocks;
+  AssignBasicBlocksFromMCInsts(blocks, basic_blocks);
+  return basic_blocks;
+}
+
+void Canonicalizer::AssignInstructionFromMCInst(
+    const llvm::MCInst& mcinst, Instruction& instruction) const {
+  instruction.Clear();
+  // Expr operands are rare; copy the instruction only when it has some.
+  if (HasExprOperands(mcinst)) {
+    llvm::MCInst mcinst_without_exprs = mcinst;
+    ReplaceExprOperands(mcinst_without_exprs);
+    PlatformSpecificInstructionFromMCInst(mcinst_without_exprs, instruction);
+    return;
+  }
+  PlatformSpecificInstructionFromMCInst(mcinst, instruction);
+}
+
+void Canonicalizer::AssignBasicBlockFromMCInst(
+    llvm::ArrayRef<llvm::MCInst> mcinsts, BasicBlock& block) const {
+  GEMATRIA_TRACE_SCOPE("Canonicalizer::AssignBasicBlockFromMCInst");
+  // Note that resize() keeps the existing instructions, and the memory they
+  // allocated, when the new block is not longer than the previous one.
+  block.instructions.resize(mcinsts.size());
+  for (int i = 0; i < mcinsts.size(); ++i) {
+    AssignInstructionFromMCInst(mcinsts[i], block.instructions[i]);
+  }
+}
+
+void Canonicalizer::AssignBasicBlocksFromMCInsts(
+    llvm::ArrayRef<llvm::ArrayRef<llvm::MCInst>> blocks,
+    std::vector<BasicBlock>& basic_blocks) const {
+  basic_blocks.resize(blocks.size());
+  for (int i = 0; i < blocks.size(); ++i) {
+    AssignBasicBlockFromMCInst(blocks[i], basic_blocks[i]);
+  }
+}
+
 std::string Canonicalizer::GetRegisterNameOrEmpty(
     const llvm::MCOperand& operand) const {
   assert(operand.isReg());
@@ -116,23 +180,24 @@ void AddX86VendorMnemonicAndPrefixes(
 
   // If there is only one token, we treat it as the mnemonic no matter what.
   if (tokens.size() == 1) {
-    instruction.mnemonic = tokens[0];
+    instruction.mnemonic.assign(tokens[0]);
     return;
   }
 
   // Otherwise, we strip known prefixes and treat the first token that is not a
-  // prefix as the mnemonic.
+  // prefix as the mnemonic. The tokens are upper-cased directly in
+  // `instruction.mnemonic` to reuse its memory.
+  std::string& uppercased_token = instruction.mnemonic;
   for (const llvm::StringRef token : tokens) {
-    std::string uppercased_token = token.trim().upper();
+    const llvm::StringRef trimmed_token = token.trim();
+    uppercased_token.assign(trimmed_token.data(), trimmed_token.size());
+    for (char& c : uppercased_token) c = llvm::toUpper(c);
     const bool is_known_prefix =
         std::find(std::begin(kKnownPrefixes), std::end(kKnownPrefixes),
                   uppercased_token) != std::end(kKnownPrefixes);
-    if (is_known_prefix) {
-      instruction.prefixes.push_back(std::move(uppercased_token));
-    } else {
-      instruction.mnemonic = std::move(uppercased_token);
-      break;
-    }
+    if (!is_known_prefix) break;
+    instruction.prefixes.push_back(uppercased_token);
+    uppercased_token.clear();
   }
   assert(!instruction.mnemonic.empty());
 }
@@ -148,75 +213,283 @@ int GetX86MemoryOperandPosition(const llvm::MCInstrDesc& descriptor) {
 
 }  // namespace
 
+// The mnemonic and the prefixes of an instruction as printed by the
+// instruction printer.
+struct X86Canonicalizer::MnemonicAndPrefixes {
+  std::string mnemonic;
+  std::vector<std::string> prefixes;
+};
+
+// The part of the canonicalization of an instruction that depends only on its
+// opcode.
+struct X86Canonicalizer::OpcodePlan {
+  // The number of values of the immediate operand that affects the mnemonic for
+  // which the mnemonic is cached. This covers the condition codes of all X86
+  // instructions.
+  static constexpr int kNumCachedImmediateValues = 32;
+
+  struct OperandRole {
+    int operand_index;
+    bool is_output_operand;
+    bool is_address_computation_tuple;
+  };
+
+  OpcodePlan() {
+    for (std::atomic<const MnemonicAndPrefixes*>& mnemonic : mnemonics) {
+      mnemonic.store(nullptr, std::memory_order_relaxed);
+    }
+  }
+  ~OpcodePlan() {
+    for (std::atomic<const MnemonicAndPrefixes*>& mnemonic : mnemonics) {
+      delete mnemonic.load(std::memory_order_relaxed);
+    }
+  }
+
+  std::string_view llvm_mnemonic;
+  bool may_load = false;
+  bool may_store = false;
+  // The explicit operands, in the order in which they are added to the
+  // instruction. Contains a single entry for each memory 5-tuple.
+  llvm::SmallVector<OperandRole, 4> operands;
+  std::vector<InstructionOperand> implicit_input_operands;
+  std::vector<InstructionOperand> implicit_output_operands;
+
+  // True when the mnemonic and the prefixes of instructions without flags can
+  // be cached. This is the case when they depend only on the opcode, or on the
+  // opcode and the value of a single immediate operand, e.g. the condition code
+  // of a conditional jump.
+  bool mnemonic_is_cacheable = false;
+  // The index of the immediate operand that affects the mnemonic, or -1 when
+  // the mnemonic depends only on the opcode.
+  int mnemonic_immediate_index = -1;
+  // The cached mnemonics and prefixes, indexed by the value of the immediate
+  // operand at `mnemonic_immediate_index`, or just the first element when there
+  // is no such operand. Filled lazily; an entry never changes once it is set.
+  mutable std::atomic<const MnemonicAndPrefixes*>
+      mnemonics[kNumCachedImmediateValues];
+};
+
 X86Canonicalizer::X86Canonicalizer(const llvm::TargetMachine* target_machine)
-    : Canonicalizer(target_machine) {
-  static constexpr int kIntelSyntax = 1;
-  const llvm::Target& target = target_machine->getTarget();
-  mcinst_printer_.reset(target.createMCInstPrinter(
-      target_machine_.getTargetTriple(), kIntelSyntax,
-      *target_machine_.getMCAsmInfo(), *target_machine_.getMCInstrInfo(),
-      *target_machine_.getMCRegisterInfo()));
+    : Canonicalizer(target_machine),
+      num_opcodes_(target_machine->getMCInstrInfo()->getNumOpcodes()),
+      opcode_plans_(new std::atomic<const OpcodePlan*>[num_opcodes_]) {
+  for (unsigned opcode = 0; opcode < num_opcodes_; ++opcode) {
+    opcode_plans_[opcode].store(nullptr, std::memory_order_relaxed);
+  }
 }
 
-X86Canonicalizer::~X86Canonicalizer() = default;
+X86Canonicalizer::~X86Canonicalizer() {
+  for (unsigned opcode = 0; opcode < num_opcodes_; ++opcode) {
+    delete opcode_plans_[opcode].load(std::memory_order_relaxed);
+  }
+}
 
-Instruction X86Canonicalizer::PlatformSpecificInstructionFromMCInst(
+const X86Canonicalizer::OpcodePlan& X86Canonicalizer::GetOpcodePlan(
     const llvm::MCInst& mcinst) const {
-  // NOTE(ondrasej): For now, we assume that all memory references are aliased.
-  // This is an overly conservative but safe choice. Note that Ithemal chose the
-  // other extreme where no two memory accesses are aliased - we may want to
-  // support this use case too.
-  constexpr int kWholeMemoryAliasGroup = 1;
-
-  const llvm::MCRegisterInfo& register_info =
-      *target_machine_.getMCRegisterInfo();
-  const llvm::MCInstrInfo& instr_info = *target_machine_.getMCInstrInfo();
+  assert(mcinst.getOpcode() < num_opcodes_);
+  std::atomic<const OpcodePlan*>& plan_slot =
+      opcode_plans_[mcinst.getOpcode()];
+  const OpcodePlan* plan = plan_slot.load(std::memory_order_acquire);
+  if (plan != nullptr) return *plan;
+
+  // Another thread may be creating the plan for the same opcode at the same
+  // time; the first plan to be published wins, and the other is discarded.
+  std::unique_ptr<OpcodePlan> new_plan = CreateOpcodePlan(mcinst);
+  if (plan_slot.compare_exchange_strong(plan, new_plan.get(),
+                                        std::memory_order_acq_rel)) {
+    return *new_plan.release();
+  }
+  return *plan;
+}
 
-  Instruction instruction;
-  instruction.llvm_mnemonic =
+std::unique_ptr<X86Canonicalizer::OpcodePlan>
+X86Canonicalizer::CreateOpcodePlan(const llvm::MCInst& mcinst) const {
+  const llvm::MCInstrDesc& descriptor =
+      target_machine_.getMCInstrInfo()->get(mcinst.getOpcode());
+  auto plan = std::make_unique<OpcodePlan>();
+  plan->llvm_mnemonic =
       target_machine_.getMCInstrInfo()->getName(mcinst.getOpcode());
-  AddX86VendorMnemonicAndPrefixes(*mcinst_printer_,
-                                  *target_machine_.getMCSubtargetInfo(), mcinst,
-                                  instruction);
-
-  const llvm::MCInstrDesc& descriptor = instr_info.get(mcinst.getOpcode());
-  if (descriptor.mayLoad()) {
-    instruction.input_operands.push_back(
-        InstructionOperand::MemoryLocation(kWholeMemoryAliasGroup));
-  }
-  if (descriptor.mayStore()) {
-    instruction.output_operands.push_back(
-        InstructionOperand::MemoryLocation(kWholeMemoryAliasGroup));
-  }
+  plan->may_load = descriptor.mayLoad();
+  plan->may_store = descriptor.mayStore();
 
   const int memory_operand_index = GetX86MemoryOperandPosition(descriptor);
   for (int operand_index = 0; operand_index < descriptor.getNumOperands();
        ++operand_index) {
-    const bool is_output_operand = operand_index < descriptor.getNumDefs();
     const bool is_address_computation_tuple =
         operand_index == memory_operand_index;
-    AddOperand(mcinst, /*operand_index=*/operand_index,
-               /*is_output_operand=*/is_output_operand,
-               /*is_address_computation_tuple=*/is_address_computation_tuple,
-               instruction);
+    plan->operands.push_back(
+        {/*operand_index=*/operand_index,
+         /*is_output_operand=*/operand_index < descriptor.getNumDefs(),
+         /*is_address_computation_tuple=*/is_address_computation_tuple});
     if (is_address_computation_tuple) {
       // A memory reference is represented as a 5-tuple. The whole 5-tuple is
-      // processed in one CanonicalizeOperand() call and we need to skip the
-      // remaining 4 elements here.
+      // processed in one AddOperand() call and we need to skip the remaining 4
+      // elements here.
       operand_index += 4;
     }
   }
 
   for (llvm::MCPhysReg implicit_output_register : descriptor.implicit_defs()) {
-    instruction.implicit_output_operands.push_back(InstructionOperand::Register(
-        register_info.getName(implicit_output_register)));
+    plan->implicit_output_operands.push_back(
+        InstructionOperand::RegisterFromId(
+            GetRegisterId(implicit_output_register)));
   }
   for (llvm::MCPhysReg implicit_input_register : descriptor.implicit_uses()) {
-    instruction.implicit_input_operands.push_back(InstructionOperand::Register(
-        register_info.getName(implicit_input_register)));
+    plan->implicit_input_operands.push_back(
+        InstructionOperand::RegisterFromId(
+            GetRegisterId(implicit_input_register)));
   }
 
-  return instruction;
+  // Find the immediate operands that affect the printed mnemonic, e.g. the
+  // condition codes of conditional jumps or of vector comparisons, by printing
+  // the instruction with different values of each immediate operand. The
+  // memory 5-tuple is skipped; its immediates never affect the mnemonic, and
+  // not all values are valid for them.
+  llvm::MCInst probe = mcinst;
+  probe.setFlags(0);
+  Instruction probe_instruction;
+  const auto print_probe = [&](int operand_index, int64_t value) {
+    probe.getOperand(operand_index).setImm(value);
+    probe_instruction.Clear();
+    PrintMnemonicAndPrefixes(probe, probe_instruction);
+    return MnemonicAndPrefixes{probe_instruction.mnemonic,
+                               probe_instruction.prefixes};
+  };
+  int num_mnemonic_immediates = 0;
+  for (const OpcodePlan::OperandRole& role : plan->operands) {
+    if (role.is_address_computation_tuple ||
+        role.operand_index >= probe.getNumOperands() ||
+        !probe.getOperand(role.operand_index).isImm()) {
+      continue;
+    }
+    const int64_t original_value =
+        probe.getOperand(role.operand_index).getImm();
+    const MnemonicAndPrefixes with_zero = print_probe(role.operand_index, 0);
+    const MnemonicAndPrefixes with_one = print_probe(role.operand_index, 1);
+    probe.getOperand(role.operand_index).setImm(original_value);
+    if (with_zero.mnemonic != with_one.mnemonic ||
+        with_zero.prefixes != with_one.prefixes) {
+      ++num_mnemonic_immediates;
+      plan->mnemonic_immediate_index = role.operand_index;
+    }
+  }
+  plan->mnemonic_is_cacheable = num_mnemonic_immediates <= 1;
+  return plan;
+}
+
+std::unique_ptr<llvm::MCInstPrinter> X86Canonicalizer::AcquirePrinter()
+    const {
+  {
+    std::lock_guard<std::mutex> lock(printers_mutex_);
+    if (!free_printers_.empty()) {
+      std::unique_ptr<llvm::MCInstPrinter> printer =
+          std::move(free_printers_.back());
+      free_printers_.pop_back();
+      return printer;
+    }
+  }
+  static constexpr int kIntelSyntax = 1;
+  return std::unique_ptr<llvm::MCInstPrinter>(
+      target_machine_.getTarget().createMCInstPrinter(
+          target_machine_.getTargetTriple(), kIntelSyntax,
+          *target_machine_.getMCAsmInfo(), *target_machine_.getMCInstrInfo(),
+          *target_machine_.getMCRegisterInfo()));
+}
+
+void X86Canonicalizer::ReleasePrinter(
+    std::unique_ptr<llvm::MCInstPrinter> printer) const {
+  std::lock_guard<std::mutex> lock(printers_mutex_);
+  free_printers_.push_back(std::move(printer));
+}
+
+void X86Canonicalizer::PrintMnemonicAndPrefixes(
+    const llvm::MCInst& mcinst, Instruction& instruction) const {
+  std::unique_ptr<llvm::MCInstPrinter> printer = AcquirePrinter();
+  AddX86VendorMnemonicAndPrefixes(
+      *printer, *target_machine_.getMCSubtargetInfo(), mcinst, instruction);
+  ReleasePrinter(std::move(printer));
+}
+
+void X86Canonicalizer::AssignMnemonicAndPrefixes(
+    const OpcodePlan& plan, const llvm::MCInst& mcinst,
+    Instruction& instruction) const {
+  // The flags of the instruction, e.g. the REP prefix, are printed as prefixes;
+  // we cache only the mnemonics of instructions without flags, which are by far
+  // the most common.
+  int cache_index = -1;
+  if (plan.mnemonic_is_cacheable && mcinst.getFlags() == 0) {
+    cache_index = 0;
+    if (plan.mnemonic_immediate_index >= 0) {
+      const llvm::MCOperand& operand =
+          mcinst.getOperand(plan.mnemonic_immediate_index);
+      const bool is_cached_value =
+          operand.isImm() && operand.getImm() >= 0 &&
+          operand.getImm() < OpcodePlan::kNumCachedImmediateValues;
+      cache_index = is_cached_value ? static_cast<int>(operand.getImm()) : -1;
+    }
+  }
+  if (cache_index < 0) {
+    PrintMnemonicAndPrefixes(mcinst, instruction);
+    return;
+  }
+
+  std::atomic<const MnemonicAndPrefixes*>& cache_slot =
+      plan.mnemonics[cache_index];
+  const MnemonicAndPrefixes* cached =
+      cache_slot.load(std::memory_order_acquire);
+  if (cached != nullptr) {
+    instruction.mnemonic.assign(cached->mnemonic);
+    instruction.prefixes.assign(cached->prefixes.begin(),
+                                cached->prefixes.end());
+    return;
+  }
+
+  PrintMnemonicAndPrefixes(mcinst, instruction);
+  auto entry = std::make_unique<MnemonicAndPrefixes>(
+      MnemonicAndPrefixes{instruction.mnemonic, instruction.prefixes});
+  if (cache_slot.compare_exchange_strong(cached, entry.get(),
+                                         std::memory_order_acq_rel)) {
+    entry.release();
+  }
+}
+
+void X86Canonicalizer::PlatformSpecificInstructionFromMCInst(
+    const llvm::MCInst& mcinst, Instruction& instruction) const {
+  // NOTE(ondrasej): For now, we assume that all memory references are aliased.
+  // This is an overly conservative but safe choice. Note that Ithemal chose the
+  // other extreme where no two memory accesses are aliased - we may want to
+  // support this use case too.
+  constexpr int kWholeMemoryAliasGroup = 1;
+
+  const OpcodePlan& plan = GetOpcodePlan(mcinst);
+  instruction.llvm_mnemonic.assign(plan.llvm_mnemonic);
+  AssignMnemonicAndPrefixes(plan, mcinst, instruction);
+
+  if (plan.may_load) {
+    instruction.input_operands.push_back(
+        InstructionOperand::MemoryLocation(kWholeMemoryAliasGroup));
+  }
+  if (plan.may_store) {
+    instruction.output_operands.push_back(
+        InstructionOperand::MemoryLocation(kWholeMemoryAliasGroup));
+  }
+
+  for (const OpcodePlan::OperandRole& role : plan.operands) {
+    AddOperand(mcinst, /*operand_index=*/role.operand_index,
+               /*is_output_operand=*/role.is_output_operand,
+               /*is_address_computation_tuple=*/
+               role.is_address_computation_tuple,
+               instruction);
+  }
+
+  instruction.implicit_output_operands.insert(
+      instruction.implicit_output_operands.end(),
+      plan.implicit_output_operands.begin(),
+      plan.implicit_output_operands.end());
+  instruction.implicit_input_operands.insert(
+      instruction.implicit_input_operands.end(),
+      plan.implicit_input_operands.begin(),
+      plan.implicit_input_operands.end());
 }
 
 void X86Canonicalizer::AddOperand(const llvm::MCInst& mcinst, int operand_index,
@@ -256,7 +529,7 @@ void X86Canonicalizer::AddOperand(const llvm::MCInst& mcinst, int operand_index,
         /* segment_register= */ std::move(segment_register)));
   } else if (operand.isReg()) {
     operand_list.push_back(
-        InstructionOperand::Register(GetRegisterNameOrEmpty(operand)));
+        InstructionOperand::RegisterFromId(GetRegisterId(operand.getReg())));
   } else if (operand.isImm()) {
     operand_list.push_back(
         InstructionOperand::ImmediateValue(operand.getImm()));
@@ -19,10 +19,15 @@
 #ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_LLVM_CANONICALIZER_H_
 #define THIRD_PARTY_GEMATRIA_GEMATRIA_LLVM_CANONICALIZER_H_
 
+#include <atomic>
+#include <cassert>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
 
 #include "gematria/basic_block/basic_block.h"
+#include "gematria/basic_block/token_interner.h"
 #include "llvm/ADT/ArrayRef.h"
 #include "llvm/MC/MCInst.h"
 #include "llvm/MC/MCInstPrinter.h"
@@ -33,49 +38,124 @@ namespace gematria {
 // Abstract interface for code that extracts basic block data structures from
 // binary machine code. Each supported platform should provide its own subclass
 // that implements extraction for this specific platform.
+//
+// All methods of the canonicalizers in this file are thread-safe, so that a
+// single canonicalizer can be shared by all threads of a worker pool.
 class Canonicalizer {
  public:
   explicit Canonicalizer(const llvm::TargetMachine* target_machine);
   virtual ~Canonicalizer();
 
   // Extracts data from a single machine instruction.
-  virtual Instruction InstructionFromMCInst(llvm::MCInst mcinst) const;
+  virtual Instruction InstructionFromMCInst(const llvm::MCInst& mcinst) const;
   // Extracts data from a sequence of instructions.
   virtual BasicBlock BasicBlockFromMCInst(
       llvm::ArrayRef<llvm::MCInst> mcinsts) const;
+  // Extracts data from several sequences of instructions; the basic block at
+  // index `i` of the result is extracted from `blocks[i]`.
+  std::vector<BasicBlock> BasicBlocksFromMCInsts(
+      llvm::ArrayRef<llvm::ArrayRef<llvm::MCInst>> blocks) const;
+
+  // Versions of InstructionFromMCInst() and BasicBlockFromMCInst() that replace
+  // the contents of an existing object. They reuse the memory already allocated
+  // by the object where possible, so that a caller that processes a stream of
+  // basic blocks can reuse the same objects and avoid most memory allocations.
+  void AssignInstructionFromMCInst(const llvm::MCInst& mcinst,
+                                   Instruction& instruction) const;
+  void AssignBasicBlockFromMCInst(llvm::ArrayRef<llvm::MCInst> mcinsts,
+                                  BasicBlock& block) const;
+  void AssignBasicBlocksFromMCInsts(
+      llvm::ArrayRef<llvm::ArrayRef<llvm::MCInst>> blocks,
+      std::vector<BasicBlock>& basic_blocks) const;
 
   // Returns the target machine on which the canonicalizer is based.
   const llvm::TargetMachine& target_machine() const { return target_machine_; }
 
  protected:
   // The platform-specific code for instruction extraction. When called, this
-  // method can assume that `instruction` does not have any expression operands.
-  virtual Instruction PlatformSpecificInstructionFromMCInst(
-      const llvm::MCInst& instruction) const = 0;
+  // method can assume that `mcinst` does not have any expression operands and
+  // that `instruction` is empty; see Instruction::Clear().
+  virtual void PlatformSpecificInstructionFromMCInst(
+      const llvm::MCInst& mcinst, Instruction& instruction) const = 0;
 
   // Returns the name of a register in an operand. Returns an empty string when
   // the operand is an "undefined" operand.
   // This method must not be called when `operand.isReg()` is false.
   std::string GetRegisterNameOrEmpty(const llvm::MCOperand& operand) const;
 
+  // Returns the ID of the name of `reg` in TokenInterner::Global().
+  TokenId GetRegisterId(unsigned reg) const {
+    assert(reg < register_ids_.size());
+    return register_ids_[reg];
+  }
+
   const llvm::TargetMachine& target_machine_;
+
+ private:
+  // The IDs of the names of all registers of the target, indexed by the LLVM
+  // register number. The names are interned once in the constructor, so that
+  // register operands can be created without looking up their names.
+  std::vector<TokenId> register_ids_;
 };
 
 // A version of basic block extractor for X86-64.
+//
+// The parts of the canonicalization that depend only on the opcode of the
+// instruction (the LLVM mnemonic, the roles of the operands, the implicit
+// operands, and in most cases the mnemonic and the prefixes printed by the
+// instruction printer) are computed when the opcode is seen for the first time,
+// and stored in a per-opcode plan. The canonicalizer is thread-safe: the plans
+// are published atomically, and each thread that needs to print an instruction
+// takes its own instruction printer from a pool.
 class X86Canonicalizer final : public Canonicalizer {
  public:
   explicit X86Canonicalizer(const llvm::TargetMachine* target_machine);
   ~X86Canonicalizer() override;
 
  private:
-  Instruction PlatformSpecificInstructionFromMCInst(
-      const llvm::MCInst& mcinst) const override;
+  struct MnemonicAndPrefixes;
+  struct OpcodePlan;
+
+  void PlatformSpecificInstructionFromMCInst(
+      const llvm::MCInst& mcinst, Instruction& instruction) const override;
 
   void AddOperand(const llvm::MCInst& mcinst, int operand_index,
                   bool is_output_operand, bool is_address_computation_tuple,
                   Instruction& instruction) const;
 
-  std::unique_ptr<llvm::MCInstPrinter> mcinst_printer_;
+  // Returns the plan for the opcode of `mcinst`. Creates the plan when the
+  // opcode is seen for the first time.
+  const OpcodePlan& GetOpcodePlan(const llvm::MCInst& mcinst) const;
+  std::unique_ptr<OpcodePlan> CreateOpcodePlan(
+      const llvm::MCInst& mcinst) const;
+
+  // Fills in the mnemonic and the prefixes of `instruction`. Uses the cached
+  // values from `plan` when possible, otherwise prints `mcinst`.
+  void AssignMnemonicAndPrefixes(const OpcodePlan& plan,
+                                 const llvm::MCInst& mcinst,
+                                 Instruction& instruction) const;
+  // Fills in the mnemonic and the prefixes of `instruction` by printing
+  // `mcinst` with an instruction printer from the pool.
+  void PrintMnemonicAndPrefixes(const llvm::MCInst& mcinst,
+                                Instruction& instruction) const;
+
+  // Returns an instruction printer that is not used by any other thread.
+  // Creates a new printer when all existing printers are in use. The printer
+  // must be returned to the pool using ReleasePrinter().
+  std::unique_ptr<llvm::MCInstPrinter> AcquirePrinter() const;
+  void ReleasePrinter(std::unique_ptr<llvm::MCInstPrinter> printer) const;
+
+  // The pool of instruction printers; llvm::MCInstPrinter is not thread-safe,
+  // so each printer is used by at most one thread at a time. The pool holds at
+  // most as many printers as there were threads printing at the same time.
+  mutable std::mutex printers_mutex_;
+  mutable std::vector<std::unique_ptr<llvm::MCInstPrinter>> free_printers_;
+
+  // The plans for all opcodes of the target, indexed by the opcode. An entry is
+  // nullptr until the opcode is seen for the first time. The plans are owned by
+  // the canonicalizer and never change after they are published.
+  const unsigned num_opcodes_;
+  const std::unique_ptr<std::atomic<const OpcodePlan*>[]> opcode_plans_;
 };
 
 }  // namespace gematria
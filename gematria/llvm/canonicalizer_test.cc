@@ -16,6 +16,7 @@
 
 #include <memory>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "gematria/llvm/asm_parser.h"
@@ -111,6 +112,27 @@ TEST_F(X86BasicBlockExtractorTest, BasicBlockFromMCInst) {
               {InstructionOperand::Register("EFLAGS")})));
 }
 
+TEST_F(X86BasicBlockExtractorTest, AssignBasicBlockFromMCInst) {
+  const std::vector<llvm::MCInst> long_mcinsts = ParseAssemblyCode(R"(
+      LOCK ADD QWORD PTR[RCX], RAX
+      XOR QWORD PTR[RCX], RAX
+      NOT RBX
+  )");
+  const std::vector<llvm::MCInst> short_mcinsts = ParseAssemblyCode(R"(
+      ADD RAX, RBX
+  )");
+  ASSERT_THAT(long_mcinsts, Not(IsEmpty()));
+  ASSERT_THAT(short_mcinsts, Not(IsEmpty()));
+
+  BasicBlock block;
+  extractor_->AssignBasicBlockFromMCInst(long_mcinsts, block);
+  EXPECT_EQ(block, extractor_->BasicBlockFromMCInst(long_mcinsts));
+  extractor_->AssignBasicBlockFromMCInst(short_mcinsts, block);
+  EXPECT_EQ(block, extractor_->BasicBlockFromMCInst(short_mcinsts));
+  extractor_->AssignBasicBlockFromMCInst(long_mcinsts, block);
+  EXPECT_EQ(block, extractor_->BasicBlockFromMCInst(long_mcinsts));
+}
+
 TEST_F(X86BasicBlockExtractorTest, InstructionWithExprOperand) {
   const std::vector<llvm::MCInst> mcinsts = ParseAssemblyCode(R"(
     loop:
@@ -182,5 +204,93 @@ TEST_F(X86BasicBlockExtractorTest, LonePrefix) {
                 /* implicit_output_operands= */ {}));
 }
 
+TEST_F(X86BasicBlockExtractorTest, CachedMnemonicsWithConditionCodes) {
+  // The mnemonics of these instructions depend on the condition code operand,
+  // and they must not be shared through the per-opcode plan.
+  const std::vector<llvm::MCInst> mcinsts = ParseAssemblyCode(R"(
+      CMOVE RAX, RBX
+      CMOVNE RAX, RBX
+      CMOVE RAX, RBX
+      CMPEQPS XMM0, XMM1
+      CMPLTPS XMM0, XMM1
+  )");
+  ASSERT_EQ(mcinsts.size(), 5);
+
+  const BasicBlock block = extractor_->BasicBlockFromMCInst(mcinsts);
+  ASSERT_EQ(block.instructions.size(), 5);
+  EXPECT_EQ(block.instructions[0].mnemonic, "CMOVE");
+  EXPECT_EQ(block.instructions[1].mnemonic, "CMOVNE");
+  EXPECT_EQ(block.instructions[2].mnemonic, "CMOVE");
+  EXPECT_EQ(block.instructions[3].mnemonic, "CMPEQPS");
+  EXPECT_EQ(block.instructions[4].mnemonic, "CMPLTPS");
+}
+
+TEST_F(X86BasicBlockExtractorTest, CachedMnemonicsWithPrefixes) {
+  // The first instruction creates the plan for ADD64mr; the prefix of the
+  // second one must not be taken from the cache, and vice versa.
+  const std::vector<llvm::MCInst> mcinsts = ParseAssemblyCode(R"(
+      ADD QWORD PTR[RCX], RAX
+      LOCK ADD QWORD PTR[RCX], RAX
+      ADD QWORD PTR[RCX], RAX
+  )");
+  ASSERT_EQ(mcinsts.size(), 3);
+
+  const BasicBlock block = extractor_->BasicBlockFromMCInst(mcinsts);
+  ASSERT_EQ(block.instructions.size(), 3);
+  EXPECT_THAT(block.instructions[0].prefixes, IsEmpty());
+  EXPECT_THAT(block.instructions[1].prefixes, ElementsAre("LOCK"));
+  EXPECT_THAT(block.instructions[2].prefixes, IsEmpty());
+  EXPECT_EQ(block.instructions[0], block.instructions[2]);
+  EXPECT_EQ(block.instructions[1].mnemonic, "ADD");
+}
+
+TEST_F(X86BasicBlockExtractorTest, BasicBlocksFromMCInsts) {
+  const std::vector<llvm::MCInst> first_mcinsts = ParseAssemblyCode(R"(
+      ADD RAX, RBX
+      XOR QWORD PTR[RCX], RAX
+  )");
+  const std::vector<llvm::MCInst> second_mcinsts = ParseAssemblyCode(R"(
+      NOT RBX
+  )");
+  ASSERT_THAT(first_mcinsts, Not(IsEmpty()));
+  ASSERT_THAT(second_mcinsts, Not(IsEmpty()));
+
+  const std::vector<llvm::ArrayRef<llvm::MCInst>> blocks = {
+      first_mcinsts, second_mcinsts, first_mcinsts};
+  EXPECT_THAT(extractor_->BasicBlocksFromMCInsts(blocks),
+              ElementsAre(extractor_->BasicBlockFromMCInst(first_mcinsts),
+                          extractor_->BasicBlockFromMCInst(second_mcinsts),
+                          extractor_->BasicBlockFromMCInst(first_mcinsts)));
+}
+
+TEST_F(X86BasicBlockExtractorTest, SharedBetweenThreads) {
+  const std::vector<llvm::MCInst> mcinsts = ParseAssemblyCode(R"(
+      ADD RAX, RBX
+      XOR QWORD PTR[RCX], RAX
+      CMOVE RAX, RBX
+      LOCK ADD QWORD PTR[RCX], RAX
+  )");
+  ASSERT_THAT(mcinsts, Not(IsEmpty()));
+
+  // Create the expected block with a separate canonicalizer, so that the
+  // threads below start with no plans.
+  const BasicBlock expected_block =
+      X86Canonicalizer(&llvm_architecture_->target_machine())
+          .BasicBlockFromMCInst(mcinsts);
+
+  constexpr int kNumThreads = 8;
+  std::vector<BasicBlock> blocks(kNumThreads);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads.emplace_back([&, i]() {
+      blocks[i] = extractor_->BasicBlockFromMCInst(mcinsts);
+    });
+  }
+  for (std::thread& thread : threads) thread.join();
+  for (const BasicBlock& block : blocks) {
+    EXPECT_EQ(block, expected_block);
+  }
+}
+
 }  // namespace
 }  // namespace gematria
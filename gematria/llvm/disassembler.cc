@@ -30,6 +30,34 @@
 #include "llvm/Support/raw_ostream.h"
 
 namespace gematria {
+namespace {
+
+// Decodes the instruction at `offset` in `machine_code` into `instruction`.
+// Returns the size of the instruction in bytes.
+llvm::Expected<uint64_t> DecodeInstructionAt(
+    const llvm::MCDisassembler& disassembler,
+    llvm::ArrayRef<uint8_t> machine_code, uint64_t offset,
+    llvm::MCInst& instruction) {
+  const llvm::ArrayRef<uint8_t> data = machine_code.drop_front(offset);
+  std::string disassembler_output_buffer;
+  llvm::raw_string_ostream output(disassembler_output_buffer);
+  // See DisassembleOneInstruction() for the choice of the address.
+  const uint64_t instruction_address = reinterpret_cast<uint64_t>(data.data());
+  uint64_t instruction_size = 0;
+  const llvm::MCDisassembler::DecodeStatus status = disassembler.getInstruction(
+      instruction, instruction_size, data, instruction_address, output);
+  if (status != llvm::MCDisassembler::Success || instruction_size == 0 ||
+      instruction_size > data.size()) {
+    output.flush();
+    return llvm::createStringError(
+        llvm::errc::invalid_argument,
+        "Parsing of machine code failed at byte %d with error %s",
+        static_cast<int>(offset), disassembler_output_buffer.c_str());
+  }
+  return instruction_size;
+}
+
+}  // namespace
 
 std::string AssemblyFromMCInst(const llvm::MCInstrInfo& instruction_info,
                                const llvm::MCRegisterInfo& register_info,
@@ -126,4 +154,35 @@ llvm::Expected<std::vector<DisassembledInstruction>> DisassembleAllInstructions(
   return std::move(result);
 }
 
+llvm::Expected<std::vector<DecodedInstruction>> DecodeAllInstructions(
+    const llvm::MCDisassembler& disassembler,
+    llvm::ArrayRef<uint8_t> machine_code) {
+  std::vector<DecodedInstruction> result;
+  uint64_t offset = 0;
+  while (offset < machine_code.size()) {
+    DecodedInstruction& instruction = result.emplace_back();
+    llvm::Expected<uint64_t> size = DecodeInstructionAt(
+        disassembler, machine_code, offset, instruction.mc_inst);
+    if (llvm::Error error = size.takeError()) return error;
+    instruction.offset = offset;
+    instruction.size = *size;
+    offset += *size;
+  }
+  return std::move(result);
+}
+
+llvm::Expected<std::vector<llvm::MCInst>> DisassembleAllMCInsts(
+    const llvm::MCDisassembler& disassembler,
+    llvm::ArrayRef<uint8_t> machine_code) {
+  std::vector<llvm::MCInst> result;
+  uint64_t offset = 0;
+  while (offset < machine_code.size()) {
+    llvm::Expected<uint64_t> size = DecodeInstructionAt(
+        disassembler, machine_code, offset, result.emplace_back());
+    if (llvm::Error error = size.takeError()) return error;
+    offset += *size;
+  }
+  return std::move(result);
+}
+
 }  // namespace gematria
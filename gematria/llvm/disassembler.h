@@ -44,6 +44,18 @@ struct DisassembledInstruction {
   llvm::MCInst mc_inst;
 };
 
+// The result of decoding an instruction without printing it. Refers to the
+// machine code of the instruction by its position in the input buffer instead
+// of copying it.
+struct DecodedInstruction {
+  // The offset of the first byte of the instruction in the input buffer.
+  uint64_t offset = 0;
+  // The size of the instruction in bytes.
+  uint64_t size = 0;
+
+  llvm::MCInst mc_inst;
+};
+
 // Creates the assembly representation of an llvm::MCInst.
 std::string AssemblyFromMCInst(const llvm::MCInstrInfo& instruction_info,
                                const llvm::MCRegisterInfo& register_info,
@@ -76,6 +88,21 @@ llvm::Expected<std::vector<DisassembledInstruction>> DisassembleAllInstructions(
     const llvm::MCSubtargetInfo& subtarget_info, llvm::MCInstPrinter& printer,
     uint64_t base_address, llvm::ArrayRef<uint8_t> machine_code);
 
+// Decodes all instructions from `machine_code` like
+// DisassembleAllInstructions(), but does not print the assembly code and does
+// not copy the machine code of the instructions. This is the preferred API when
+// the caller needs only the llvm::MCInst objects, e.g. to pass them to the
+// canonicalizer.
+llvm::Expected<std::vector<DecodedInstruction>> DecodeAllInstructions(
+    const llvm::MCDisassembler& disassembler,
+    llvm::ArrayRef<uint8_t> machine_code);
+
+// A version of DecodeAllInstructions() that returns just the llvm::MCInst
+// objects, in the form expected by the canonicalizer.
+llvm::Expected<std::vector<llvm::MCInst>> DisassembleAllMCInsts(
+    const llvm::MCDisassembler& disassembler,
+    llvm::ArrayRef<uint8_t> machine_code);
+
 }  // namespace gematria
 
 #endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_LLVM_DISASSEMBLER_H_
@@ -17,6 +17,7 @@
 #include <cstdint>
 #include <iterator>
 #include <memory>
+#include <vector>
 
 #include "absl/status/status.h"
 #include "gematria/llvm/llvm_architecture_support.h"
@@ -282,5 +283,73 @@ TEST_F(DisassembleOneInstructionTest, X86_InvalidInstructionSequence) {
       StatusIs(absl::StatusCode::kInternal));
 }
 
+using DecodeAllInstructionsTest = DisassemblerTest;
+
+TEST_F(DecodeAllInstructionsTest, X86_NopMovRaxRbxNop) {
+  static constexpr uint8_t kInstructionData[] = {0x90, 0x48, 0x89, 0xd8, 0x90};
+
+  llvm::Expected<std::vector<DecodedInstruction>> instructions =
+      DecodeAllInstructions(llvm_x86_64_->mc_disassembler(), kInstructionData);
+  ASSERT_TRUE(static_cast<bool>(instructions));
+  ASSERT_EQ(instructions->size(), 3);
+  EXPECT_EQ((*instructions)[0].offset, 0);
+  EXPECT_EQ((*instructions)[0].size, 1);
+  EXPECT_EQ((*instructions)[1].offset, 1);
+  EXPECT_EQ((*instructions)[1].size, 3);
+  EXPECT_THAT((*instructions)[1].mc_inst,
+              IsMCInst(/*opcode_matcher=*/llvm::X86::MOV64rr,
+                       /*operands_matcher=*/ElementsAre(
+                           IsRegister(llvm::X86::RAX),
+                           IsRegister(llvm::X86::RBX))));
+  EXPECT_EQ((*instructions)[2].offset, 4);
+  EXPECT_EQ((*instructions)[2].size, 1);
+}
+
+TEST_F(DecodeAllInstructionsTest, X86_InvalidInstructionSequence) {
+  // kInstructionData contains one `nop` and then an incomplete prefix of
+  // `mov rax, rbx`.
+  static constexpr uint8_t kInstructionData[] = {0x90, 0x48, 0x89};
+
+  EXPECT_THAT(LlvmExpectedToStatusOr(DecodeAllInstructions(
+                  llvm_x86_64_->mc_disassembler(), kInstructionData)),
+              StatusIs(absl::StatusCode::kInternal));
+}
+
+using DisassembleAllMCInstsTest = DisassemblerTest;
+
+TEST_F(DisassembleAllMCInstsTest, NoInstructions) {
+  EXPECT_THAT(LlvmExpectedToStatusOr(DisassembleAllMCInsts(
+                  llvm_x86_64_->mc_disassembler(), {})),
+              IsOkAndHolds(IsEmpty()));
+}
+
+TEST_F(DisassembleAllMCInstsTest, X86_NopMovRaxRbxNop) {
+  static constexpr uint8_t kInstructionData[] = {0x90, 0x48, 0x89, 0xd8, 0x90};
+
+  const auto is_nop = IsMCInst(
+      /*opcode_matcher=*/ResultOf("llvm::X86::isNOP", &llvm::X86::isNOP,
+                                  testing::IsTrue()),
+      /*operands_matcher=*/IsEmpty());
+  EXPECT_THAT(
+      LlvmExpectedToStatusOr(DisassembleAllMCInsts(
+          llvm_x86_64_->mc_disassembler(), kInstructionData)),
+      IsOkAndHolds(ElementsAre(
+          is_nop,
+          IsMCInst(/*opcode_matcher=*/llvm::X86::MOV64rr,
+                   /*operands_matcher=*/ElementsAre(
+                       IsRegister(llvm::X86::RAX), IsRegister(llvm::X86::RBX))),
+          is_nop)));
+}
+
+TEST_F(DisassembleAllMCInstsTest, X86_InvalidInstructionSequence) {
+  // kInstructionData contains one `nop` and then an incomplete prefix of
+  // `mov rax, rbx`.
+  static constexpr uint8_t kInstructionData[] = {0x90, 0x48, 0x89};
+
+  EXPECT_THAT(LlvmExpectedToStatusOr(DisassembleAllMCInsts(
+                  llvm_x86_64_->mc_disassembler(), kInstructionData)),
+              StatusIs(absl::StatusCode::kInternal));
+}
+
 }  // namespace
 }  // namespace gematria
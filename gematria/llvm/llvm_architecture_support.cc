@@ -15,10 +15,13 @@
 #include "gematria/llvm/llvm_architecture_support.h"
 
 #include <cassert>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <string>
 #include <string_view>
+#include <tuple>
 #include <utility>
 
 #include "llvm-c/Target.h"
@@ -51,6 +54,15 @@ void InitializeLlvmOnce() {
 
 }  // namespace
 
+LlvmThreadContext::LlvmThreadContext(const llvm::Target& target,
+                                     const llvm::TargetMachine& target_machine)
+    : mc_context_(std::make_unique<llvm::MCContext>(
+          target_machine.getTargetTriple(), target_machine.getMCAsmInfo(),
+          target_machine.getMCRegisterInfo(),
+          target_machine.getMCSubtargetInfo())),
+      mc_disassembler_(target.createMCDisassembler(
+          *target_machine.getMCSubtargetInfo(), *mc_context_)) {}
+
 llvm::Expected<std::unique_ptr<LlvmArchitectureSupport>>
 LlvmArchitectureSupport::FromTriple(std::string_view llvm_triple,
                                     std::string_view cpu,
@@ -73,6 +85,28 @@ LlvmArchitectureSupport::FromTriple(std::string_view llvm_triple,
       new LlvmArchitectureSupport(llvm_triple, cpu, cpu_features, llvm_target));
 }
 
+llvm::Expected<std::shared_ptr<const LlvmArchitectureSupport>>
+LlvmArchitectureSupport::Shared(std::string_view llvm_triple,
+                                std::string_view cpu,
+                                std::string_view cpu_features) {
+  using Key = std::tuple<std::string, std::string, std::string>;
+  static std::mutex* const mutex = new std::mutex();
+  static auto* const instances =
+      new std::map<Key, std::shared_ptr<const LlvmArchitectureSupport>>();
+
+  Key key(llvm_triple, cpu, cpu_features);
+  std::lock_guard<std::mutex> lock(*mutex);
+  auto it = instances->find(key);
+  if (it != instances->end()) return it->second;
+
+  llvm::Expected<std::unique_ptr<LlvmArchitectureSupport>> instance =
+      FromTriple(llvm_triple, cpu, cpu_features);
+  if (llvm::Error error = instance.takeError()) return std::move(error);
+  std::shared_ptr<const LlvmArchitectureSupport> shared = std::move(*instance);
+  instances->emplace(std::move(key), shared);
+  return shared;
+}
+
 std::unique_ptr<LlvmArchitectureSupport> LlvmArchitectureSupport::X86_64() {
   auto x86_64_or_status = FromTriple("x86_64", "", "");
   if (!x86_64_or_status) {
@@ -83,6 +117,17 @@ std::unique_ptr<LlvmArchitectureSupport> LlvmArchitectureSupport::X86_64() {
   return std::move(*x86_64_or_status);
 }
 
+std::shared_ptr<const LlvmArchitectureSupport>
+LlvmArchitectureSupport::SharedX86_64() {
+  auto x86_64_or_status = Shared("x86_64", "", "");
+  if (!x86_64_or_status) {
+    llvm::errs() << x86_64_or_status.takeError();
+    assert(false);
+    return nullptr;
+  }
+  return std::move(*x86_64_or_status);
+}
+
 LlvmArchitectureSupport::LlvmArchitectureSupport(std::string_view llvm_triple,
                                                  std::string_view cpu,
                                                  std::string_view cpu_features,
@@ -92,13 +137,7 @@ LlvmArchitectureSupport::LlvmArchitectureSupport(std::string_view llvm_triple,
   target_machine_.reset(target_->createTargetMachine(
       /*TT=*/llvm_triple, /*CPU=*/cpu, /*Features=*/cpu_features,
       /*Options=*/target_options, /*RM=*/std::nullopt));
-
-  mc_context_ = std::make_unique<llvm::MCContext>(
-      target_machine_->getTargetTriple(), target_machine_->getMCAsmInfo(),
-      target_machine_->getMCRegisterInfo(),
-      target_machine_->getMCSubtargetInfo());
-  mc_disassembler_.reset(target_->createMCDisassembler(
-      *target_machine_->getMCSubtargetInfo(), *mc_context_));
+  default_thread_context_ = CreateThreadContext();
 }
 
 }  // namespace gematria
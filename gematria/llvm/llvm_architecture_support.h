@@ -31,8 +31,46 @@
 
 namespace gematria {
 
+class LlvmArchitectureSupport;
+
+// Holds the LLVM objects for an architecture that are not thread-safe. Unlike
+// LlvmArchitectureSupport, creating a thread context is cheap, so that each
+// thread of a worker pool can have its own. A thread context must be used
+// from one thread at a time, and it must not outlive the
+// LlvmArchitectureSupport from which it was created.
+//
+// Typical usage:
+//   std::shared_ptr<const LlvmArchitectureSupport> llvm_support = ...;
+//   // On each worker thread:
+//   std::unique_ptr<LlvmThreadContext> context =
+//       llvm_support->CreateThreadContext();
+//   DisassembleAllMCInsts(context->mc_disassembler(), machine_code);
+class LlvmThreadContext {
+ public:
+  llvm::MCContext& mc_context() { return *mc_context_; }
+
+  const llvm::MCDisassembler& mc_disassembler() const {
+    return *mc_disassembler_;
+  }
+
+ private:
+  friend class LlvmArchitectureSupport;
+
+  LlvmThreadContext(const llvm::Target& target,
+                    const llvm::TargetMachine& target_machine);
+
+  std::unique_ptr<llvm::MCContext> mc_context_;
+  std::unique_ptr<llvm::MCDisassembler> mc_disassembler_;
+};
+
 // Provides a single handle to all LLVM objects representing a given
 // architecture that can be passed around easily and shared with Python code.
+//
+// The const methods of this class are thread-safe, with the exception of
+// mc_disassembler(): the disassembler uses a MCContext that is not
+// thread-safe. Code that uses the architecture from multiple threads should
+// create a LlvmThreadContext for each thread instead. The expensive parts,
+// e.g. the target machine, are shared by all thread contexts.
 class LlvmArchitectureSupport {
  public:
   // Creates the architecture support from an LLVM triple. Returns an error when
@@ -41,10 +79,30 @@ class LlvmArchitectureSupport {
       std::string_view llvm_triple, std::string_view cpu,
       std::string_view cpu_features);
 
+  // Returns the architecture support for the given LLVM triple, CPU and CPU
+  // features that is shared by the whole process. The object is created on the
+  // first call with the given arguments, and all subsequent calls return the
+  // same object. Thread-safe. Returns an error when the architecture can't be
+  // created.
+  static llvm::Expected<std::shared_ptr<const LlvmArchitectureSupport>> Shared(
+      std::string_view llvm_triple, std::string_view cpu,
+      std::string_view cpu_features);
+
   // A convenience function that creates the architecture support for x86-64.
   // Calls the necessary LLVMInitializeX86*() functions on the first invocation.
   static std::unique_ptr<LlvmArchitectureSupport> X86_64();
 
+  // A convenience function that returns the process-wide architecture support
+  // for x86-64, see Shared().
+  static std::shared_ptr<const LlvmArchitectureSupport> SharedX86_64();
+
+  // Creates a new set of the LLVM objects that can't be shared between
+  // threads. This is much cheaper than creating a new LlvmArchitectureSupport.
+  std::unique_ptr<LlvmThreadContext> CreateThreadContext() const {
+    return std::unique_ptr<LlvmThreadContext>(
+        new LlvmThreadContext(*target_, *target_machine_));
+  }
+
   // Creates a new llvm::MCInstPriner. The value of `syntax_variant` is
   // architecture dependent, and corresponds to the same argument of
   // createMCInstPrinter.
@@ -72,8 +130,10 @@ class LlvmArchitectureSupport {
     return *target_machine_->getMCRegisterInfo();
   }
 
+  // Returns the disassembler of the default thread context of this object.
+  // This disassembler is not thread-safe.
   const llvm::MCDisassembler& mc_disassembler() const {
-    return *mc_disassembler_;
+    return default_thread_context_->mc_disassembler();
   }
 
   const llvm::MCSubtargetInfo& mc_subtarget_info() const {
@@ -87,8 +147,7 @@ class LlvmArchitectureSupport {
 
   const llvm::Target* target_;
   std::unique_ptr<llvm::TargetMachine> target_machine_;
-  std::unique_ptr<llvm::MCContext> mc_context_;
-  std::unique_ptr<llvm::MCDisassembler> mc_disassembler_;
+  std::unique_ptr<LlvmThreadContext> default_thread_context_;
 };
 
 }  // namespace gematria
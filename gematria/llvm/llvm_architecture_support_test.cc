@@ -15,12 +15,16 @@
 #include "gematria/llvm/llvm_architecture_support.h"
 
 #include <memory>
+#include <thread>
+#include <vector>
 
 #include "absl/status/status.h"
 #include "gematria/llvm/llvm_to_absl.h"
 #include "gematria/testing/matchers.h"
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
+#include "llvm/MC/MCDisassembler/MCDisassembler.h"
+#include "llvm/MC/MCInst.h"
 
 namespace gematria {
 namespace {
@@ -50,5 +54,56 @@ TEST(LlvmArchitectureSupportTest, FromTriple_Invalid) {
   EXPECT_THAT(x86_64_or_status, StatusIs(absl::StatusCode::kInternal));
 }
 
+TEST(LlvmArchitectureSupportTest, Shared) {
+  auto first_or_status = LlvmExpectedToStatusOr(
+      LlvmArchitectureSupport::Shared("x86_64", "", ""));
+  ASSERT_OK(first_or_status);
+  auto second_or_status = LlvmExpectedToStatusOr(
+      LlvmArchitectureSupport::Shared("x86_64", "", ""));
+  ASSERT_OK(second_or_status);
+  EXPECT_NE(*first_or_status, nullptr);
+  EXPECT_EQ(*first_or_status, *second_or_status);
+  EXPECT_EQ(*first_or_status, LlvmArchitectureSupport::SharedX86_64());
+
+  auto other_cpu_or_status = LlvmExpectedToStatusOr(
+      LlvmArchitectureSupport::Shared("x86_64", "skylake", ""));
+  ASSERT_OK(other_cpu_or_status);
+  EXPECT_NE(*first_or_status, *other_cpu_or_status);
+}
+
+TEST(LlvmArchitectureSupportTest, Shared_Invalid) {
+  auto x86_64_or_status =
+      LlvmExpectedToStatusOr(LlvmArchitectureSupport::Shared(
+          "an_architecture_that_does_not_exist", "", ""));
+  EXPECT_THAT(x86_64_or_status, StatusIs(absl::StatusCode::kInternal));
+}
+
+TEST(LlvmArchitectureSupportTest, ThreadContexts) {
+  // mov rax, rbx
+  static constexpr uint8_t kMachineCode[] = {0x48, 0x89, 0xd8};
+  const std::shared_ptr<const LlvmArchitectureSupport> x86_64 =
+      LlvmArchitectureSupport::SharedX86_64();
+  ASSERT_NE(x86_64, nullptr);
+
+  constexpr int kNumThreads = 8;
+  std::vector<int> decoded_sizes(kNumThreads);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads.emplace_back([&x86_64, &decoded_sizes, i]() {
+      std::unique_ptr<LlvmThreadContext> context =
+          x86_64->CreateThreadContext();
+      llvm::MCInst instruction;
+      uint64_t size = 0;
+      if (context->mc_disassembler().getInstruction(
+              instruction, size, kMachineCode, 0, llvm::nulls()) ==
+          llvm::MCDisassembler::Success) {
+        decoded_sizes[i] = size;
+      }
+    });
+  }
+  for (std::thread& thread : threads) thread.join();
+  EXPECT_THAT(decoded_sizes, testing::Each(sizeof(kMachineCode)));
+}
+
 }  // namespace
 }  // namespace gematria
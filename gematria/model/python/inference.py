@@ -13,16 +13,53 @@
 # limitations under the License.
 """Helper function for running inference with Gematria models."""
 
-from collections.abc import Iterable
-from typing import Optional
+from collections.abc import Iterable, Sequence
+from typing import Optional, Protocol
 
 from absl import logging
 from gematria.basic_block.python import throughput_protos
 from gematria.model.python import model_base
 from gematria.model.python import training
 from gematria.proto import throughput_pb2
+import numpy as np
 import tensorflow.compat.v1 as tf
 
+# The default number of protos passed to the native backend in one call by
+# predict_for_protos_with_native_backend().
+_DEFAULT_PROTOS_PER_NATIVE_CALL = 100_000
+
+
+class NativeInferenceBackend(Protocol):
+  """An inference backend that predicts through a compiled TFLite model.
+
+  The backend is provided by the caller, typically as a Python extension that
+  wraps GraphBuilderModelInferencePool from gematria/granite and runs the model
+  on a pool of C++ worker threads without holding the GIL. Such an extension
+  needs TFLite, which is available only in the CMake build, and it is not part
+  of this repository.
+  """
+
+  def predict_serialized(
+      self,
+      serialized_protos: Sequence[bytes],
+      max_blocks_in_batch: int,
+  ) -> tuple[np.ndarray, np.ndarray]:
+    """Predicts the inverse throughput of serialized protos.
+
+    Args:
+      serialized_protos: The basic blocks, as serialized
+        BasicBlockWithThroughputProtos.
+      max_blocks_in_batch: The maximal number of basic blocks in a batch passed
+        to the model.
+
+    Returns:
+      A tuple `(predictions, is_valid)`. `predictions` is a float array of shape
+      `(len(serialized_protos), num_tasks)`, and `is_valid` is a bool array of
+      shape `(len(serialized_protos),)` that is False for the protos that could
+      not be parsed or processed by the model; their rows of `predictions` are
+      NaN.
+    """
+
 
 def _get_num_instructions_in_block_with_throughput_proto(
     proto: throughput_pb2.BasicBlockWithThroughputProto,
@@ -105,3 +142,73 @@ def predict_for_protos(
                 inverse_throughput_cycles=prefix_predictions
             )
       yield proto
+
+
+def predict_for_protos_with_native_backend(
+    backend: NativeInferenceBackend,
+    basic_blocks: Iterable[throughput_pb2.BasicBlockWithThroughputProto],
+    source_names: Sequence[str],
+    max_blocks_in_batch: int,
+    protos_per_call: int = _DEFAULT_PROTOS_PER_NATIVE_CALL,
+) -> Iterable[throughput_pb2.BasicBlockWithThroughputProto]:
+  """Predicts the inverse throughput using a native inference backend.
+
+  A version of predict_for_protos() for offline scoring of large data sets.
+  Instead of converting the protos to basic blocks and running the model in
+  Python, the protos are serialized and passed to `backend` in chunks of
+  `protos_per_call`; parsing, batching and inference all happen in C++. As
+  with predict_for_protos(), the input sequence is iterated through only once.
+
+  The native backend predicts only the inverse throughput of the whole basic
+  block, so the output protos never have prefix inverse throughputs. Protos
+  that the backend rejects are passed through without a prediction, the same
+  way predict_for_protos() passes through blocks that fail validation.
+
+  Args:
+    backend: The native inference backend.
+    basic_blocks: The collection of basic blocks for which the inverse
+      throughput is predicted.
+    source_names: The source names of the predictions, one per task of the
+      model; use model.get_source_name() of the Python model to get the same
+      names as predict_for_protos().
+    max_blocks_in_batch: The maximal number of basic blocks in a batch passed
+      to the model by the backend.
+    protos_per_call: The maximal number of protos passed to the backend in a
+      single call.
+
+  Yields:
+    The basic blocks from basic_blocks. Each valid basic block has a new
+    inverse_throughputs value added to it with the prediction from the model.
+
+  Raises:
+    ValueError: When the number of tasks of the model is different from the
+      number of source names.
+  """
+  chunks = training.batches(
+      basic_blocks,
+      get_num_instructions=(
+          _get_num_instructions_in_block_with_throughput_proto
+      ),
+      max_blocks_in_batch=protos_per_call,
+  )
+  for chunk_index, protos in enumerate(chunks):
+    logging.info(
+        'Processing proto chunk %d (%d blocks).', chunk_index, len(protos)
+    )
+    predictions, is_valid = backend.predict_serialized(
+        [proto.SerializeToString() for proto in protos], max_blocks_in_batch
+    )
+    if predictions.shape[1] != len(source_names):
+      raise ValueError(
+          f'The model has {predictions.shape[1]} tasks, but'
+          f' {len(source_names)} source names were provided.'
+      )
+    for proto, block_predictions, block_is_valid in zip(
+        protos, predictions.tolist(), is_valid.tolist()
+    ):
+      if block_is_valid:
+        for source_name, prediction in zip(source_names, block_predictions):
+          proto.inverse_throughputs.add(
+              source=source_name, inverse_throughput_cycles=(prediction,)
+          )
+      yield proto
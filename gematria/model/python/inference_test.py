@@ -117,6 +117,43 @@ class TestModel(model_base.ModelBase):
     return super().schedule_batch(basic_blocks, *args, **kwargs)
 
 
+class FakeNativeBackend:
+  """A fake of inference.NativeInferenceBackend.
+
+  Predicts `index + 1 + task_index` for the proto at position `index` in the
+  input sequence (counted across calls), and rejects the protos whose basic
+  block has exactly `invalid_num_instructions` instructions.
+  """
+
+  def __init__(self, num_tasks, invalid_num_instructions=None):
+    self.num_tasks = num_tasks
+    self.invalid_num_instructions = invalid_num_instructions
+    self.num_visited_blocks = 0
+    self.call_sizes = []
+
+  def predict_serialized(self, serialized_protos, max_blocks_in_batch):
+    del max_blocks_in_batch  # Unused.
+    self.call_sizes.append(len(serialized_protos))
+    predictions = np.full(
+        (len(serialized_protos), self.num_tasks), np.nan, dtype=np.float32
+    )
+    is_valid = np.zeros(len(serialized_protos), dtype=bool)
+    for index, serialized_proto in enumerate(serialized_protos):
+      proto = throughput_pb2.BasicBlockWithThroughputProto.FromString(
+          serialized_proto
+      )
+      self.num_visited_blocks += 1
+      num_instructions = len(proto.basic_block.canonicalized_instructions)
+      if num_instructions == self.invalid_num_instructions:
+        continue
+      is_valid[index] = True
+      predictions[index] = [
+          self.num_visited_blocks + task_index
+          for task_index in range(self.num_tasks)
+      ]
+    return predictions, is_valid
+
+
 class PredictForProtosTest(model_test.TestCase):
   num_blocks = 10
 
@@ -284,6 +321,71 @@ class PredictForProtosTest(model_test.TestCase):
     self.check_predict_deltas(model)
 
 
+class PredictForProtosWithNativeBackendTest(model_test.TestCase):
+
+  def _check_predict(self, backend, source_names, protos_per_call):
+    input_protos = copy.deepcopy(self.block_protos)
+    output_protos = tuple(
+        inference.predict_for_protos_with_native_backend(
+            backend,
+            input_protos,
+            source_names,
+            max_blocks_in_batch=4,
+            protos_per_call=protos_per_call,
+        )
+    )
+    self.assertLen(output_protos, len(self.block_protos))
+    for index, (in_proto, out_proto) in enumerate(
+        zip(self.block_protos, output_protos)
+    ):
+      expected_inverse_throughputs = [*in_proto.inverse_throughputs]
+      num_instructions = len(in_proto.basic_block.canonicalized_instructions)
+      if num_instructions != backend.invalid_num_instructions:
+        for task_index, source_name in enumerate(source_names):
+          expected_inverse_throughputs.append(
+              throughput_pb2.ThroughputWithSourceProto(
+                  source=source_name,
+                  inverse_throughput_cycles=(index + 1 + task_index,),
+              )
+          )
+      self.assertEqual(in_proto.basic_block, out_proto.basic_block)
+      self.assertSequenceEqual(
+          tuple(out_proto.inverse_throughputs), expected_inverse_throughputs
+      )
+
+  def test_predict_single_call(self):
+    backend = FakeNativeBackend(num_tasks=1)
+    self._check_predict(backend, ('native',), protos_per_call=100)
+    self.assertSequenceEqual(backend.call_sizes, (len(self.block_protos),))
+
+  def test_predict_multiple_calls(self):
+    backend = FakeNativeBackend(num_tasks=1)
+    self._check_predict(backend, ('native',), protos_per_call=3)
+    num_blocks = len(self.block_protos)
+    self.assertSequenceEqual(
+        backend.call_sizes, [3] * (num_blocks // 3) + [num_blocks % 3]
+    )
+
+  def test_predict_multi_task(self):
+    backend = FakeNativeBackend(num_tasks=3)
+    self._check_predict(backend, ('task_1', 'task_2', 'task_3'), 100)
+
+  def test_predict_with_invalid_blocks(self):
+    # Lengths of blocks in self.blocks_with_throughput are:
+    # [1, 5, 1, 8, 3, 4, 1, 2, 9, 4].
+    backend = FakeNativeBackend(num_tasks=1, invalid_num_instructions=1)
+    self._check_predict(backend, ('native',), protos_per_call=4)
+
+  def test_predict_with_wrong_number_of_sources(self):
+    backend = FakeNativeBackend(num_tasks=2)
+    with self.assertRaises(ValueError):
+      tuple(
+          inference.predict_for_protos_with_native_backend(
+              backend, self.block_protos, ('native',), max_blocks_in_batch=4
+          )
+      )
+
+
 if __name__ == '__main__':
   tf.disable_v2_behavior()
   tf.test.main()
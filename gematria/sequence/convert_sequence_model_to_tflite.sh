@@ -0,0 +1,135 @@
+#!/bin/bash
+#
+# Copyright 2023 Google Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#    http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Converts a frozen TensorFlow graph to a model in the .tflite format. To be
+# processed with this script, the model must come from a Gematria model based on
+# the SequenceModelBase class from gematria/sequence/python/sequence_model.py
+# with no additional tf.placeholder tensors. The converted model can be used
+# with the C++ inference API in gematria/sequence/sequence_model_inference.h.
+#
+# Typical use:
+#   convert_sequence_model_to_tflite.sh \
+#     --gematria_input_graphdef /tmp/sequence_graph.pbtxt \
+#     --gematria_output_tflite /tmp/sequence.tflite \
+#     --gematria_export_as_seq2seq
+#
+# The tensor ModelBase.delta_block_index_tensor exists only in models that use
+# deltas or that were created with create_delta_block_index=True. It is exported
+# with --gematria_export_as_seq2seq or --gematria_with_delta_block_index; the
+# C++ inference API accepts models both with and without it.
+#
+# The converted model may use only the TensorFlow Lite built-in ops and the
+# custom ops from gematria/tflite; models that need TensorFlow ops through
+# SELECT_TF_OPS are not supported by the C++ inference API.
+
+function print_error_and_exit() {
+  echo "$1" > /dev/stderr
+  exit 1
+}
+
+gematria_export_as_seq2seq=0
+gematria_with_delta_block_index=0
+gematria_input_graphdef=""
+gematria_output_tflite=""
+while [[ "$#" -gt 0 ]]; do
+  case "$1" in
+    --gematria_input_graphdef)
+      gematria_input_graphdef="$2"
+      shift
+      ;;
+    --gematria_input_graphdef=*)
+      gematria_input_graphdef="${1:26}"
+      ;;
+    --gematria_output_tflite)
+      gematria_output_tflite="$2"
+      shift
+      ;;
+    --gematria_output_tflite=*)
+      gematria_output_tflite="${1:25}"
+      ;;
+    --gematria_export_as_seq2seq)
+      gematria_export_as_seq2seq=1
+      gematria_with_delta_block_index=1
+      ;;
+    --gematria_with_delta_block_index)
+      gematria_with_delta_block_index=1
+      ;;
+    *)
+      print_error_and_exit "Unexpected command-line argument: $1"
+  esac
+  shift
+done
+
+if [[ -z "${gematria_input_graphdef}" ]]; then
+  print_error_and_exit "Flag --gematria_input_graphdef is missing."
+fi
+if [[ -z "${gematria_output_tflite}" ]]; then
+  print_error_and_exit "Flag --gematria_output_tflite is missing."
+fi
+
+function str_join() {
+  local IFS=","
+  echo "$*"
+}
+
+# The C++ inference API looks up the input tensors by name. This must contain
+# an entry for each tf.placeholder tensor used in the Python code.
+INPUT_TENSORS_LIST=(
+  SequenceModelBase.token_sequence
+  SequenceModelBase.num_tokens_per_instruction
+  SequenceModelBase.num_instructions_per_block
+)
+if (( gematria_with_delta_block_index )); then
+  INPUT_TENSORS_LIST+=(ModelBase.delta_block_index_tensor)
+fi
+readonly INPUT_TENSORS_LIST
+INPUT_TENSORS=$(str_join "${INPUT_TENSORS_LIST[@]}")
+readonly INPUT_TENSORS
+
+# The list of TensorFlow ops used in the exported model.
+readonly TARGET_OPS_LIST=(
+  # The basic TensorFlow Lite ops.
+  TFLITE_BUILTINS
+)
+TARGET_OPS=$(str_join "${TARGET_OPS_LIST[@]}")
+readonly TARGET_OPS
+
+if (( gematria_export_as_seq2seq )); then
+  readonly OUTPUT_TENSOR_LIST=(
+    ModelBase.output_tensor
+    ModelBase.output_tensor_deltas
+    TokenModel.token_list
+    SequenceModelBase.special_tokens
+  )
+else
+  readonly OUTPUT_TENSOR_LIST=(
+    ModelBase.output_tensor
+    TokenModel.token_list
+    SequenceModelBase.special_tokens
+  )
+fi
+OUTPUT_TENSORS=$(str_join "${OUTPUT_TENSOR_LIST[@]}")
+readonly OUTPUT_TENSORS
+
+tflite_convert \
+  --graph_def_file="${gematria_input_graphdef}" \
+  --output_file="${gematria_output_tflite}" \
+  --enable_v1_converter \
+  --allow_custom_ops \
+  --experimental_new_converter \
+  --output_arrays="${OUTPUT_TENSORS}" \
+  --input_arrays="${INPUT_TENSORS}" \
+  --target_ops="${TARGET_OPS}"
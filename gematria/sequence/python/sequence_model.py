@@ -14,7 +14,7 @@
 """Base class for Gematria models that read basic blocks as sequences of tokens."""
 
 import abc
-from collections.abc import MutableSequence
+from collections.abc import MutableSequence, Sequence
 from typing import Optional
 
 from gematria.basic_block.python import basic_block
@@ -71,6 +71,9 @@ class SequenceModelBase(token_model.TokenModel, model_base.ModelBase):
   format described above, and returns a tensor with output values.
   """
 
+  # The name of SequenceModelBase.special_tokens_tensor in the TensorFlow graph.
+  SPECIAL_TOKENS_TENSOR_NAME = 'SequenceModelBase.special_tokens'
+
   # The model used for processing the data.
   _model: Optional[tf.keras.Model] = None
 
@@ -85,6 +88,10 @@ class SequenceModelBase(token_model.TokenModel, model_base.ModelBase):
   _num_tokens_per_instruction_placeholder: tf.Tensor
   _num_instructions_per_block_placeholder: tf.Tensor
 
+  # A 1D int32 tensor that contains the indices of the special tokens used by
+  # the model. See the docstring of self.special_tokens_tensor for details.
+  _special_tokens_tensor: tf.Tensor
+
   @abc.abstractmethod
   def _create_model(self) -> tf.keras.Model:
     """Creates the Keras model for this class.
@@ -100,8 +107,38 @@ class SequenceModelBase(token_model.TokenModel, model_base.ModelBase):
       The Keras model matching the input/output specification.
     """
 
+  @property
+  def special_tokens_tensor(self) -> tf.Tensor:
+    """Returns the indices of special tokens.
+
+    The returned tensor contains indices of the special tokens in the list
+    encoded in self.token_list_tensor. The indices of the special tokens are
+    stored in the following order:
+      1. replacement token used to replace out-of-vocabulary tokens. This index
+         is set to -1 when the model is not trained with replacement tokens.
+    The tensor is used by the C++ inference code to set up the tokenization of
+    the basic blocks in the same way as in the Python code.
+    """
+    return self._special_tokens_tensor
+
+  # @Override
+  @property
+  def output_tensor_names(self) -> Sequence[str]:
+    return (
+        *super().output_tensor_names,
+        SequenceModelBase.SPECIAL_TOKENS_TENSOR_NAME,
+    )
+
   def _create_tf_graph(self) -> None:
     super()._create_tf_graph()
+    self._special_tokens_tensor = tf.constant(
+        np.array(
+            (-1 if self._oov_token is None else self._oov_token,),
+            dtype=np.int32,
+        ),
+        dtype=tf.dtypes.int32,
+        name=SequenceModelBase.SPECIAL_TOKENS_TENSOR_NAME,
+    )
     self._model = self._create_model()
     self._token_sequence_placeholder = tf.placeholder(
         dtype=tf.dtypes.int32,
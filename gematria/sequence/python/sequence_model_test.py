@@ -103,6 +103,35 @@ class SequenceModelTest(parameterized.TestCase, model_test.TestCase):
         schedule[model._num_instructions_per_block_placeholder].shape, (3,)
     )
 
+  @parameterized.named_parameters(
+      ('return_error', _OutOfVocabularyTokenBehavior.return_error(), False),
+      (
+          'replace_token',
+          _OutOfVocabularyTokenBehavior.replace_with_token(tokens.UNKNOWN),
+          True,
+      ),
+  )
+  def test_special_tokens(self, out_of_vocabulary_behavior, has_replacement):
+    model = TestSequenceModel(
+        tokens=self.tokens,
+        out_of_vocabulary_behavior=out_of_vocabulary_behavior,
+    )
+    model.initialize()
+    self.assertIn(
+        token_model.TokenModel.TOKENS_TENSOR_NAME, model.output_tensor_names
+    )
+    self.assertIn(
+        sequence_model.SequenceModelBase.SPECIAL_TOKENS_TENSOR_NAME,
+        model.output_tensor_names,
+    )
+
+    with self.session() as sess:
+      special_tokens = sess.run(model.special_tokens_tensor)
+    expected_replacement_token = (
+        self.tokens.index(tokens.UNKNOWN) if has_replacement else -1
+    )
+    self.assertAllEqual(special_tokens, (expected_replacement_token,))
+
   def test_schedule_batch_with_invalid_block(self):
     model = TestSequenceModel(tokens=self.tokens)
     model.initialize()
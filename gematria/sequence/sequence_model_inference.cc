@@ -0,0 +1,399 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/sequence/sequence_model_inference.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/basic_block/token_interner.h"
+#include "gematria/tflite/gather_segment_sum_op.h"
+#include "gematria/tflite/unsorted_segment_sum_op.h"
+#include "gematria/utils/string.h"
+#include "gematria/utils/tracing.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/Twine.h"
+#include "llvm/Support/Errc.h"
+#include "llvm/Support/Error.h"
+#include "tensorflow/lite/c/c_api_types.h"
+#include "tensorflow/lite/c/common.h"
+#include "tensorflow/lite/interpreter.h"
+#include "tensorflow/lite/interpreter_builder.h"
+#include "tensorflow/lite/kernels/register.h"
+#include "tensorflow/lite/model_builder.h"
+
+namespace gematria {
+namespace {
+
+// The names of the input tensors of the model; see SequenceModelBase in
+// gematria/sequence/python/sequence_model.py.
+constexpr std::string_view kDeltaBlockIndexTensorName =
+    "ModelBase.delta_block_index_tensor";
+constexpr std::string_view kTokenSequenceTensorName =
+    "SequenceModelBase.token_sequence";
+constexpr std::string_view kNumTokensPerInstructionTensorName =
+    "SequenceModelBase.num_tokens_per_instruction";
+constexpr std::string_view kNumInstructionsPerBlockTensorName =
+    "SequenceModelBase.num_instructions_per_block";
+
+// The delta block index tensor is created only by models that use deltas or
+// that explicitly request it; the other input tensors are always present.
+constexpr int kMinNumInputTensors = 3;
+constexpr int kMaxNumInputTensors = 4;
+
+// The names of the output tensors of the model.
+constexpr std::string_view kOutputTensorName = "ModelBase.output_tensor";
+constexpr std::string_view kTokensTensorName = "TokenModel.token_list";
+constexpr std::string_view kSpecialTokensTensorName =
+    "SequenceModelBase.special_tokens";
+
+// The indices of the special tokens in the tensor
+// `SequenceModelBase.special_tokens`.
+constexpr int kSpecialTokenReplacement = 0;
+
+// The number of special tokens; this is also the expected size of the special
+// token tensor.
+constexpr int kNumSpecialTokens = 1;
+
+// Finds a tensor in the model by its name. `tensor_indices` is the list of
+// candidate tensor indices; typically, this is interpreter.inputs() or
+// interpreter.outputs(). Returns an error when the tensor is not found.
+llvm::Expected<int> TensorIndexByName(const tflite::Interpreter& interpreter,
+                                      llvm::ArrayRef<int> tensor_indices,
+                                      std::string_view name) {
+  for (const int tensor_index : tensor_indices) {
+    const TfLiteTensor* const tensor = interpreter.tensor(tensor_index);
+    if (name == tensor->name) return tensor_index;
+  }
+  return llvm::make_error<llvm::StringError>(
+      llvm::Twine("Tensor was not found: ") + name,
+      llvm::errc::invalid_argument);
+}
+
+// Resizes the 1D int32 input tensor at `tensor_index` to `desired_size`
+// elements. Does not touch the tensor when it already has the desired size;
+// otherwise, sets `tensors_resized` to true.
+llvm::Error Resize1DTensor(tflite::Interpreter& interpreter, int tensor_index,
+                           int desired_size, bool& tensors_resized) {
+  const TfLiteTensor* const tensor = interpreter.tensor(tensor_index);
+  assert(tensor != nullptr);
+  if (tensor->type != kTfLiteInt32 || tensor->dims_signature == nullptr ||
+      tensor->dims_signature->size != 1 ||
+      tensor->dims_signature->data[0] != -1) {
+    return llvm::createStringError(
+        llvm::errc::invalid_argument,
+        "Input tensor %s is not a variable-size 1D int32 tensor",
+        tensor->name);
+  }
+  if (tensor->dims->size == 1 && tensor->dims->data[0] == desired_size) {
+    return llvm::Error::success();
+  }
+  tensors_resized = true;
+  if (interpreter.ResizeInputTensor(tensor_index, {desired_size}) !=
+      kTfLiteOk) {
+    return llvm::createStringError(llvm::errc::invalid_argument,
+                                   "Resizing the tensor %s failed",
+                                   tensor->name);
+  }
+  return llvm::Error::success();
+}
+
+// Copies `values` to the 1D int32 tensor at `tensor_index`. The tensor must
+// have been resized to the size of `values`.
+void Fill1DTensor(tflite::Interpreter& interpreter, int tensor_index,
+                  const std::vector<int32_t>& values) {
+  int32_t* const tensor_data = interpreter.typed_tensor<int32_t>(tensor_index);
+  assert(tensor_data != nullptr);
+  std::copy(values.begin(), values.end(), tensor_data);
+}
+
+// Creates a new interpreter for `tflite_model` using `options`. Returns an
+// error when the interpreter can't be created, e.g. when the model uses
+// unsupported TensorFlow ops.
+llvm::Expected<std::unique_ptr<tflite::Interpreter>> CreateInterpreter(
+    const tflite::FlatBufferModel& tflite_model,
+    const SequenceModelInferenceOptions& options) {
+  tflite::ops::builtin::BuiltinOpResolverWithoutDefaultDelegates resolver;
+  resolver.AddCustom(kUnsortedSegmentSumOpName, RegisterUnsortedSegmentSumOp());
+  resolver.AddCustom(kGatherSegmentSumOpName, RegisterGatherSegmentSumOp());
+  std::unique_ptr<tflite::Interpreter> interpreter;
+  if (tflite::InterpreterBuilder(tflite_model, resolver)(&interpreter) !=
+      kTfLiteOk) {
+    return llvm::make_error<llvm::StringError>(
+        "Could not create the interpreter.", llvm::errc::not_supported);
+  }
+  assert(interpreter != nullptr);
+  if (interpreter->SetNumThreads(options.num_threads) != kTfLiteOk) {
+    return llvm::createStringError(llvm::errc::invalid_argument,
+                                   "Invalid number of threads: %d",
+                                   options.num_threads);
+  }
+  return interpreter;
+}
+
+// Extracts the list of tokens from the model. The token list is a Const
+// tensor, so it is readable without providing any inputs.
+llvm::Expected<std::vector<std::string>> GetTokenList(
+    const tflite::Interpreter& interpreter) {
+  llvm::Expected<int> tensor_index =
+      TensorIndexByName(interpreter, interpreter.outputs(), kTokensTensorName);
+  if (llvm::Error error = tensor_index.takeError()) return error;
+  const TfLiteTensor* const tensor = interpreter.tensor(*tensor_index);
+  const char* const raw_data = reinterpret_cast<const char*>(
+      interpreter.typed_tensor<uint8_t>(*tensor_index));
+  if (raw_data == nullptr) {
+    return llvm::createStringError(llvm::errc::invalid_argument,
+                                   "The token list could not be read");
+  }
+  return StrSplitAsCopy(std::string_view(raw_data, tensor->bytes), '\0');
+}
+
+// Returns the index of the replacement token of the model, or -1 when the model
+// does not have one. Returns an error when the special token tensor is not
+// found or does not have the expected type and shape, or when the index is out
+// of range.
+llvm::Expected<int> GetReplacementToken(const tflite::Interpreter& interpreter,
+                                        int num_tokens) {
+  llvm::Expected<int> tensor_index = TensorIndexByName(
+      interpreter, interpreter.outputs(), kSpecialTokensTensorName);
+  if (llvm::Error error = tensor_index.takeError()) return error;
+  const TfLiteTensor* const tensor = interpreter.tensor(*tensor_index);
+  if (tensor->type != kTfLiteInt32 || tensor->dims->size != 1 ||
+      tensor->dims->data[0] != kNumSpecialTokens) {
+    return llvm::createStringError(
+        llvm::errc::invalid_argument,
+        "The special token tensor has an unexpected type or shape");
+  }
+  const int32_t* const data = interpreter.typed_tensor<int32_t>(*tensor_index);
+  if (data == nullptr) {
+    return llvm::createStringError(
+        llvm::errc::invalid_argument,
+        "The special token tensor could not be read");
+  }
+  const int32_t replacement_token = data[kSpecialTokenReplacement];
+  if (replacement_token < -1 || replacement_token >= num_tokens) {
+    return llvm::createStringError(llvm::errc::invalid_argument,
+                                   "The replacement token is out of range: %d",
+                                   replacement_token);
+  }
+  return replacement_token;
+}
+
+}  // namespace
+
+llvm::Expected<std::unique_ptr<SequenceModelInference>>
+SequenceModelInference::FromTfLiteModel(
+    const tflite::FlatBufferModel* tflite_model,
+    const SequenceModelInferenceOptions& options) {
+  if (tflite_model == nullptr) {
+    return llvm::make_error<llvm::StringError>(
+        "tflite_model must not be nullptr", llvm::errc::invalid_argument);
+  }
+  llvm::Expected<std::unique_ptr<tflite::Interpreter>> interpreter =
+      CreateInterpreter(*tflite_model, options);
+  if (llvm::Error error = interpreter.takeError()) return error;
+  const tflite::Interpreter& interpreter_ref = **interpreter;
+
+  const int num_input_tensors =
+      static_cast<int>(interpreter_ref.inputs().size());
+  if (num_input_tensors < kMinNumInputTensors ||
+      num_input_tensors > kMaxNumInputTensors) {
+    return llvm::createStringError(
+        llvm::errc::invalid_argument,
+        "Unexpected number of input tensors. Expected %d to %d, found %d.",
+        kMinNumInputTensors, kMaxNumInputTensors, num_input_tensors);
+  }
+  TensorIndices tensor_indices;
+  tensor_indices.delta_block_index = -1;
+  if (num_input_tensors == kMaxNumInputTensors) {
+    llvm::Expected<int> index = TensorIndexByName(
+        interpreter_ref, interpreter_ref.inputs(), kDeltaBlockIndexTensorName);
+    if (llvm::Error error = index.takeError()) return error;
+    tensor_indices.delta_block_index = *index;
+  }
+  for (const auto& [tensor_index, name] :
+       {std::pair(&tensor_indices.token_sequence, kTokenSequenceTensorName),
+        std::pair(&tensor_indices.num_tokens_per_instruction,
+                  kNumTokensPerInstructionTensorName),
+        std::pair(&tensor_indices.num_instructions_per_block,
+                  kNumInstructionsPerBlockTensorName)}) {
+    llvm::Expected<int> index =
+        TensorIndexByName(interpreter_ref, interpreter_ref.inputs(), name);
+    if (llvm::Error error = index.takeError()) return error;
+    *tensor_index = *index;
+  }
+  llvm::Expected<int> output_index = TensorIndexByName(
+      interpreter_ref, interpreter_ref.outputs(), kOutputTensorName);
+  if (llvm::Error error = output_index.takeError()) return error;
+  tensor_indices.output = *output_index;
+
+  llvm::Expected<std::vector<std::string>> tokens =
+      GetTokenList(interpreter_ref);
+  if (llvm::Error error = tokens.takeError()) return error;
+  llvm::Expected<int> replacement_token =
+      GetReplacementToken(interpreter_ref, static_cast<int>(tokens->size()));
+  if (llvm::Error error = replacement_token.takeError()) return error;
+
+  // Out-of-vocabulary tokens are mapped directly to the replacement token; with
+  // no replacement token, they are mapped to -1 and the basic block is
+  // rejected.
+  TokenVocabulary vocabulary(std::move(*tokens), *replacement_token);
+
+  // We can't use std::make_unique<SequenceModelInference>(), because
+  // std::make_unique<>() requires a public constructor.
+  return std::unique_ptr<SequenceModelInference>(new SequenceModelInference(
+      std::move(*interpreter), tensor_indices, std::move(vocabulary),
+      *replacement_token >= 0));
+}
+
+SequenceModelInference::SequenceModelInference(
+    std::unique_ptr<tflite::Interpreter> interpreter,
+    const TensorIndices& tensor_indices, TokenVocabulary vocabulary,
+    bool has_replacement_token)
+    : interpreter_(std::move(interpreter)),
+      tensor_indices_(tensor_indices),
+      vocabulary_(std::move(vocabulary)),
+      has_replacement_token_(has_replacement_token) {
+  assert(interpreter_ != nullptr);
+}
+
+SequenceModelInference::~SequenceModelInference() = default;
+
+bool SequenceModelInference::AddBasicBlockToBatch(const BasicBlock& block) {
+  GEMATRIA_TRACE_SCOPE("SequenceModelInference::AddBasicBlockToBatch");
+  if (block.instructions.empty()) return false;
+  const size_t prev_num_tokens = token_sequence_.size();
+  const size_t prev_num_instructions = num_tokens_per_instruction_.size();
+  const int block_index = num_blocks_in_batch();
+  // The token indices are appended to `token_sequence_` directly; `int` and
+  // `int32_t` are the same type on all supported platforms.
+  static_assert(std::is_same_v<int, int32_t>);
+  for (const Instruction& instruction : block.instructions) {
+    const size_t instruction_begin = token_sequence_.size();
+    instruction.AddTokenIndicesToList(vocabulary_, token_sequence_);
+    num_tokens_per_instruction_.push_back(
+        static_cast<int32_t>(token_sequence_.size() - instruction_begin));
+    if (tensor_indices_.delta_block_index >= 0) {
+      delta_block_index_.push_back(block_index);
+    }
+  }
+  if (!has_replacement_token_ &&
+      std::find(token_sequence_.begin() + prev_num_tokens,
+                token_sequence_.end(), -1) != token_sequence_.end()) {
+    // The block has an out-of-vocabulary token; undo the changes.
+    token_sequence_.resize(prev_num_tokens);
+    num_tokens_per_instruction_.resize(prev_num_instructions);
+    if (tensor_indices_.delta_block_index >= 0) {
+      delta_block_index_.resize(prev_num_instructions);
+    }
+    return false;
+  }
+  num_instructions_per_block_.push_back(
+      static_cast<int32_t>(block.instructions.size()));
+  return true;
+}
+
+llvm::Expected<std::vector<SequenceModelInference::OutputType>>
+SequenceModelInference::RunInference() {
+  GEMATRIA_TRACE_SCOPE("SequenceModelInference::RunInference");
+  if (num_blocks_in_batch() == 0) return std::vector<OutputType>();
+  tflite::Interpreter& interpreter = *interpreter_;
+
+  llvm::SmallVector<std::pair<int, const std::vector<int32_t>*>,
+                    kMaxNumInputTensors>
+      inputs = {{tensor_indices_.token_sequence, &token_sequence_},
+                {tensor_indices_.num_tokens_per_instruction,
+                 &num_tokens_per_instruction_},
+                {tensor_indices_.num_instructions_per_block,
+                 &num_instructions_per_block_}};
+  if (tensor_indices_.delta_block_index >= 0) {
+    inputs.emplace_back(tensor_indices_.delta_block_index, &delta_block_index_);
+  }
+  bool tensors_resized = false;
+  for (const auto& [tensor_index, values] : inputs) {
+    if (llvm::Error error =
+            Resize1DTensor(interpreter, tensor_index,
+                           static_cast<int>(values->size()), tensors_resized)) {
+      return error;
+    }
+  }
+  if (tensors_resized || !tensors_allocated_) {
+    GEMATRIA_TRACE_SCOPE("SequenceModelInference::AllocateTensors");
+    if (interpreter.AllocateTensors() != kTfLiteOk) {
+      tensors_allocated_ = false;
+      return llvm::make_error<llvm::StringError>(
+          "Could not allocate memory for tensors",
+          llvm::errc::not_enough_memory);
+    }
+    tensors_allocated_ = true;
+  }
+  for (const auto& [tensor_index, values] : inputs) {
+    Fill1DTensor(interpreter, tensor_index, *values);
+  }
+
+  {
+    GEMATRIA_TRACE_SCOPE("SequenceModelInference::Invoke");
+    if (interpreter.Invoke() != kTfLiteOk) {
+      return llvm::make_error<llvm::StringError>(
+          "Invoking the TensorFlow Lite interpreter failed",
+          llvm::errc::io_error);
+    }
+  }
+
+  const TfLiteTensor* const output_tensor =
+      interpreter.tensor(tensor_indices_.output);
+  if (output_tensor == nullptr || output_tensor->type != kTfLiteFloat32 ||
+      output_tensor->dims->size != 2) {
+    return llvm::createStringError(
+        llvm::errc::invalid_argument,
+        "The output tensor is not a 2D float32 tensor");
+  }
+  if (output_tensor->dims->data[0] != num_blocks_in_batch()) {
+    return llvm::createStringError(llvm::errc::result_out_of_range,
+                                   "Unexpected number of rows in the output "
+                                   "tensor. Expected %d, found %d.",
+                                   num_blocks_in_batch(),
+                                   output_tensor->dims->data[0]);
+  }
+  const int num_tasks = output_tensor->dims->data[1];
+  const float* const output_data =
+      interpreter.typed_tensor<float>(tensor_indices_.output);
+  assert(output_data != nullptr);
+
+  std::vector<OutputType> output;
+  output.reserve(num_blocks_in_batch());
+  for (int i = 0; i < num_blocks_in_batch(); ++i) {
+    output.emplace_back(output_data + i * num_tasks,
+                        output_data + (i + 1) * num_tasks);
+  }
+  return output;
+}
+
+void SequenceModelInference::Reset() {
+  token_sequence_.clear();
+  num_tokens_per_instruction_.clear();
+  num_instructions_per_block_.clear();
+  delta_block_index_.clear();
+}
+
+}  // namespace gematria
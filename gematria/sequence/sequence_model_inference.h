@@ -0,0 +1,150 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Contains the C++ inference API for the sequence models based on
+// gematria/sequence/python/sequence_model.py. The API mirrors
+// GraphBuilderModelInference from gematria/granite.
+
+#ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_SEQUENCE_SEQUENCE_MODEL_INFERENCE_H_
+#define THIRD_PARTY_GEMATRIA_GEMATRIA_SEQUENCE_SEQUENCE_MODEL_INFERENCE_H_
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "gematria/basic_block/basic_block.h"
+#include "gematria/basic_block/token_interner.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/Error.h"
+#include "tensorflow/lite/interpreter.h"
+#include "tensorflow/lite/model_builder.h"
+
+namespace gematria {
+
+// Options for the TensorFlow Lite interpreter of SequenceModelInference.
+struct SequenceModelInferenceOptions {
+  // The number of threads used by the interpreter, including the custom ops.
+  // When -1, the number of threads is chosen by TensorFlow Lite.
+  int num_threads = -1;
+};
+
+// Runs inference with a trained sequence model, e.g. the hierarchical LSTM
+// model from gematria/sequence/python/sequence_model_hlstm.py. The class uses
+// TensorFlow Lite and a model stored in the .tflite format, converted with
+// gematria/sequence/convert_sequence_model_to_tflite.sh.
+//
+// The basic blocks are tokenized with Instruction::AddTokenIndicesToList(),
+// which looks up the tokens in the vocabulary of the model without creating
+// strings, and the token indices are written directly to the input tensors of
+// the model.
+//
+// Typical usage:
+//   auto tflite_model = tflite::FlatBufferModel::BuildFromFile(...);
+//   auto inference =
+//       SequenceModelInference::FromTfLiteModel(tflite_model.get());
+//   for (const BasicBlock& block : input_basic_blocks) {
+//     (*inference)->AddBasicBlockToBatch(block);
+//   }
+//   const auto predictions = (*inference)->RunInference();
+class SequenceModelInference {
+ public:
+  // The type used for predictions for a single basic block; see
+  // GraphBuilderModelInference::OutputType.
+  using OutputType = llvm::SmallVector<float, 4>;
+
+  // Creates the inference object from a model stored in the .tflite format.
+  // Expects that the .tflite model contains the token list and the special
+  // tokens of the model. The delta block index input tensor is optional; it is
+  // filled only when the model has it. Returns an error when the model can't be
+  // loaded or it does not have all the required input and output tensors of a
+  // sequence model.
+  // Does not take ownership of `tflite_model`; the object must remain alive for
+  // the whole lifetime of the inference object.
+  static llvm::Expected<std::unique_ptr<SequenceModelInference>>
+  FromTfLiteModel(const tflite::FlatBufferModel* tflite_model,
+                  const SequenceModelInferenceOptions& options = {});
+
+  ~SequenceModelInference();
+
+  // Adds a basic block to the current batch. Returns true when the basic block
+  // was added; returns false when the basic block is empty, or when it has an
+  // out-of-vocabulary token and the model does not have a replacement token. In
+  // that case, the batch is left unchanged.
+  bool AddBasicBlockToBatch(const BasicBlock& block);
+
+  // Returns the number of basic blocks in the current batch.
+  int num_blocks_in_batch() const {
+    return static_cast<int>(num_instructions_per_block_.size());
+  }
+
+  // Returns the number of tokens in all basic blocks in the current batch.
+  int num_tokens_in_batch() const {
+    return static_cast<int>(token_sequence_.size());
+  }
+
+  // Runs inference on the current batch. Returns a vector that contains
+  // predictions for all basic blocks from the current batch in the order in
+  // which they were added. The output for each basic block are the predictions
+  // from all heads of the model.
+  // The TensorFlow Lite interpreter is reused by all calls; the input tensors
+  // are resized and the tensor arena is reallocated only when the shape of the
+  // batch differs from the shape of the previous batch.
+  llvm::Expected<std::vector<OutputType>> RunInference();
+
+  // Removes all basic blocks from the current batch. Keeps the capacity of the
+  // internal buffers.
+  void Reset();
+
+ private:
+  // The indices of the input and output tensors of the model in the
+  // interpreter.
+  struct TensorIndices {
+    // -1 when the model does not have the delta block index tensor.
+    int delta_block_index;
+    int token_sequence;
+    int num_tokens_per_instruction;
+    int num_instructions_per_block;
+    int output;
+  };
+
+  SequenceModelInference(std::unique_ptr<tflite::Interpreter> interpreter,
+                         const TensorIndices& tensor_indices,
+                         TokenVocabulary vocabulary,
+                         bool has_replacement_token);
+
+  std::unique_ptr<tflite::Interpreter> interpreter_;
+  const TensorIndices tensor_indices_;
+  // True when the tensors of `interpreter_` were allocated for the current
+  // shapes of the input tensors.
+  bool tensors_allocated_ = false;
+
+  // Maps tokens to their indices in the token list of the model. Tokens that
+  // are not in the vocabulary are mapped to the replacement token, or to -1
+  // when the model does not have a replacement token.
+  const TokenVocabulary vocabulary_;
+  const bool has_replacement_token_;
+
+  // The contents of the input tensors for the current batch; see the docstring
+  // of SequenceModelBase for the format.
+  std::vector<int32_t> token_sequence_;
+  std::vector<int32_t> num_tokens_per_instruction_;
+  std::vector<int32_t> num_instructions_per_block_;
+  // The index of the basic block of each instruction in the batch. Used only
+  // when the model has the delta block index tensor.
+  std::vector<int32_t> delta_block_index_;
+};
+
+}  // namespace gematria
+
+#endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_SEQUENCE_SEQUENCE_MODEL_INFERENCE_H_
@@ -0,0 +1,291 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/sequence/sequence_model_inference.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "flatbuffers/flatbuffers.h"
+#include "gematria/basic_block/basic_block.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "llvm/Testing/Support/Error.h"
+#include "tensorflow/lite/model_builder.h"
+#include "tensorflow/lite/schema/schema_generated.h"
+
+namespace gematria {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::IsEmpty;
+
+// The tokens of the test model. Contains all tokens of the basic blocks used in
+// the tests, and a replacement token for out-of-vocabulary tokens.
+const std::vector<std::string>& TestTokens() {
+  static const auto* const tokens = new std::vector<std::string>{
+      std::string(kDelimiterToken),
+      std::string(kImmediateToken),
+      std::string(kAddressToken),
+      std::string(kMemoryToken),
+      std::string(kNoRegisterToken),
+      std::string(kDisplacementToken),
+      "_UNKNOWN_",
+      "MOV",
+      "RAX",
+      "RBX",
+      "RSI",
+      "RDI",
+  };
+  return *tokens;
+}
+constexpr int32_t kReplacementToken = 6;
+constexpr int32_t kNoReplacementToken = -1;
+
+// Builds a .tflite model with the input and output tensors of a sequence
+// model. The prediction of the model for a basic block is the number of
+// instructions in the basic block. This is sufficient to check that the basic
+// blocks are packed into the input tensors correctly, and it keeps the tests
+// independent of any trained model.
+std::string BuildTestModel(int32_t replacement_token,
+                           bool with_delta_block_index) {
+  flatbuffers::FlatBufferBuilder builder;
+
+  // Buffer 0 is the empty buffer used by all non-constant tensors.
+  std::vector<flatbuffers::Offset<tflite::Buffer>> buffers = {
+      tflite::CreateBuffer(builder)};
+  auto add_buffer = [&](const void* data, size_t size) {
+    buffers.push_back(tflite::CreateBuffer(
+        builder,
+        builder.CreateVector(static_cast<const uint8_t*>(data), size)));
+    return static_cast<uint32_t>(buffers.size() - 1);
+  };
+
+  std::vector<flatbuffers::Offset<tflite::Tensor>> tensors;
+  auto add_tensor = [&](std::string_view name, tflite::TensorType type,
+                        const std::vector<int32_t>& shape,
+                        const std::vector<int32_t>& shape_signature,
+                        uint32_t buffer = 0) {
+    tensors.push_back(tflite::CreateTensor(
+        builder, builder.CreateVector(shape), type, buffer,
+        builder.CreateString(name.data(), name.size()),
+        /*quantization=*/0, /*is_variable=*/false, /*sparsity=*/0,
+        builder.CreateVector(shape_signature)));
+    return static_cast<int32_t>(tensors.size() - 1);
+  };
+  auto add_input_tensor = [&](std::string_view name) {
+    return add_tensor(name, tflite::TensorType_INT32, {1}, {-1});
+  };
+
+  std::vector<int32_t> inputs = {
+      add_input_tensor("SequenceModelBase.token_sequence"),
+      add_input_tensor("SequenceModelBase.num_tokens_per_instruction"),
+      add_input_tensor("SequenceModelBase.num_instructions_per_block")};
+  const int32_t num_instructions_per_block = inputs.back();
+  if (with_delta_block_index) {
+    inputs.push_back(add_input_tensor("ModelBase.delta_block_index_tensor"));
+  }
+
+  const int32_t output_shape_data[] = {-1, 1};
+  const int32_t output_shape =
+      add_tensor("output_shape", tflite::TensorType_INT32, {2}, {2},
+                 add_buffer(output_shape_data, sizeof(output_shape_data)));
+  const int32_t num_instructions_as_float = add_tensor(
+      "num_instructions_as_float", tflite::TensorType_FLOAT32, {1}, {-1});
+  const int32_t output = add_tensor(
+      "ModelBase.output_tensor", tflite::TensorType_FLOAT32, {1, 1}, {-1, 1});
+
+  std::string token_list;
+  for (const std::string& token : TestTokens()) {
+    if (!token_list.empty()) token_list.push_back('\0');
+    token_list.append(token);
+  }
+  const int32_t token_list_tensor = add_tensor(
+      "TokenModel.token_list", tflite::TensorType_UINT8,
+      {static_cast<int32_t>(token_list.size())},
+      {static_cast<int32_t>(token_list.size())},
+      add_buffer(token_list.data(), token_list.size()));
+  const int32_t special_tokens = add_tensor(
+      "SequenceModelBase.special_tokens", tflite::TensorType_INT32, {1}, {1},
+      add_buffer(&replacement_token, sizeof(replacement_token)));
+
+  const std::vector<flatbuffers::Offset<tflite::OperatorCode>> operator_codes =
+      {tflite::CreateOperatorCode(
+           builder, static_cast<int8_t>(tflite::BuiltinOperator_CAST),
+           /*custom_code=*/0, /*version=*/1, tflite::BuiltinOperator_CAST),
+       tflite::CreateOperatorCode(
+           builder, static_cast<int8_t>(tflite::BuiltinOperator_RESHAPE),
+           /*custom_code=*/0, /*version=*/1, tflite::BuiltinOperator_RESHAPE)};
+  const std::vector<flatbuffers::Offset<tflite::Operator>> operators = {
+      tflite::CreateOperator(
+          builder, /*opcode_index=*/0,
+          builder.CreateVector<int32_t>({num_instructions_per_block}),
+          builder.CreateVector<int32_t>({num_instructions_as_float}),
+          tflite::BuiltinOptions_CastOptions,
+          tflite::CreateCastOptions(builder, tflite::TensorType_INT32,
+                                    tflite::TensorType_FLOAT32)
+              .Union()),
+      tflite::CreateOperator(
+          builder, /*opcode_index=*/1,
+          builder.CreateVector<int32_t>(
+              {num_instructions_as_float, output_shape}),
+          builder.CreateVector<int32_t>({output}))};
+
+  const std::vector<int32_t> outputs = {output, token_list_tensor,
+                                        special_tokens};
+  const flatbuffers::Offset<tflite::SubGraph> subgraph = tflite::CreateSubGraph(
+      builder, builder.CreateVector(tensors), builder.CreateVector(inputs),
+      builder.CreateVector(outputs), builder.CreateVector(operators));
+  tflite::FinishModelBuffer(
+      builder,
+      tflite::CreateModel(builder, TFLITE_SCHEMA_VERSION,
+                          builder.CreateVector(operator_codes),
+                          builder.CreateVector(&subgraph, 1),
+                          builder.CreateString("sequence model test"),
+                          builder.CreateVector(buffers)));
+  return std::string(reinterpret_cast<const char*>(builder.GetBufferPointer()),
+                     builder.GetSize());
+}
+
+Instruction MovInstruction(std::string_view destination,
+                           std::string_view source) {
+  return Instruction(
+      "MOV", "MOV64rr", /*prefixes=*/{},
+      /*input_operands=*/{InstructionOperand::Register(source)},
+      /*implicit_input_operands=*/{},
+      /*output_operands=*/{InstructionOperand::Register(destination)},
+      /*implicit_output_operands=*/{});
+}
+
+// Returns the number of tokens of all instructions in `block`.
+int NumTokens(const BasicBlock& block) {
+  std::vector<std::string> tokens;
+  for (const Instruction& instruction : block.instructions) {
+    instruction.AddTokensToList(tokens);
+  }
+  return static_cast<int>(tokens.size());
+}
+
+class SequenceModelInferenceTest : public ::testing::TestWithParam<bool> {
+ protected:
+  // Creates the model and the inference object. The parameter of the test
+  // determines whether the model has the delta block index input tensor.
+  void CreateInference(int32_t replacement_token) {
+    model_data_ = BuildTestModel(replacement_token, GetParam());
+    tflite_model_ = tflite::FlatBufferModel::BuildFromBuffer(
+        model_data_.data(), model_data_.size());
+    ASSERT_NE(tflite_model_, nullptr);
+    llvm::Expected<std::unique_ptr<SequenceModelInference>> inference =
+        SequenceModelInference::FromTfLiteModel(tflite_model_.get());
+    ASSERT_THAT_EXPECTED(inference, llvm::Succeeded());
+    inference_ = std::move(*inference);
+  }
+
+  const BasicBlock three_movs_{{MovInstruction("RSI", "RBX"),
+                                MovInstruction("RDI", "RAX"),
+                                MovInstruction("RAX", "RSI")}};
+  const BasicBlock one_mov_{{MovInstruction("RDI", "RBX")}};
+  const BasicBlock unknown_register_{{MovInstruction("R15", "RBX")}};
+
+  // The model data must outlive `tflite_model_`, and `tflite_model_` must
+  // outlive `inference_`.
+  std::string model_data_;
+  std::unique_ptr<tflite::FlatBufferModel> tflite_model_;
+  std::unique_ptr<SequenceModelInference> inference_;
+};
+
+TEST(SequenceModelInferenceErrorTest, NoModel) {
+  EXPECT_THAT_EXPECTED(SequenceModelInference::FromTfLiteModel(nullptr),
+                       llvm::Failed());
+}
+
+TEST_P(SequenceModelInferenceTest, RunInference) {
+  ASSERT_NO_FATAL_FAILURE(CreateInference(kNoReplacementToken));
+  EXPECT_TRUE(inference_->AddBasicBlockToBatch(three_movs_));
+  EXPECT_TRUE(inference_->AddBasicBlockToBatch(one_mov_));
+  EXPECT_EQ(inference_->num_blocks_in_batch(), 2);
+  EXPECT_EQ(inference_->num_tokens_in_batch(),
+            NumTokens(three_movs_) + NumTokens(one_mov_));
+
+  llvm::Expected<std::vector<SequenceModelInference::OutputType>> output =
+      inference_->RunInference();
+  ASSERT_THAT_EXPECTED(output, llvm::Succeeded());
+  EXPECT_THAT(*output, ElementsAre(ElementsAre(3.0f), ElementsAre(1.0f)));
+}
+
+TEST_P(SequenceModelInferenceTest, ResetAndRunWithDifferentShape) {
+  ASSERT_NO_FATAL_FAILURE(CreateInference(kNoReplacementToken));
+  EXPECT_TRUE(inference_->AddBasicBlockToBatch(three_movs_));
+  ASSERT_THAT_EXPECTED(inference_->RunInference(), llvm::Succeeded());
+
+  inference_->Reset();
+  EXPECT_EQ(inference_->num_blocks_in_batch(), 0);
+  EXPECT_EQ(inference_->num_tokens_in_batch(), 0);
+
+  EXPECT_TRUE(inference_->AddBasicBlockToBatch(one_mov_));
+  EXPECT_TRUE(inference_->AddBasicBlockToBatch(one_mov_));
+  EXPECT_TRUE(inference_->AddBasicBlockToBatch(three_movs_));
+  llvm::Expected<std::vector<SequenceModelInference::OutputType>> output =
+      inference_->RunInference();
+  ASSERT_THAT_EXPECTED(output, llvm::Succeeded());
+  EXPECT_THAT(*output, ElementsAre(ElementsAre(1.0f), ElementsAre(1.0f),
+                                   ElementsAre(3.0f)));
+}
+
+TEST_P(SequenceModelInferenceTest, EmptyBatch) {
+  ASSERT_NO_FATAL_FAILURE(CreateInference(kNoReplacementToken));
+  EXPECT_FALSE(inference_->AddBasicBlockToBatch(BasicBlock()));
+  llvm::Expected<std::vector<SequenceModelInference::OutputType>> output =
+      inference_->RunInference();
+  ASSERT_THAT_EXPECTED(output, llvm::Succeeded());
+  EXPECT_THAT(*output, IsEmpty());
+}
+
+TEST_P(SequenceModelInferenceTest, OutOfVocabularyTokenWithoutReplacement) {
+  ASSERT_NO_FATAL_FAILURE(CreateInference(kNoReplacementToken));
+  EXPECT_TRUE(inference_->AddBasicBlockToBatch(one_mov_));
+  EXPECT_FALSE(inference_->AddBasicBlockToBatch(unknown_register_));
+  // The rejected basic block must not leave anything in the batch.
+  EXPECT_EQ(inference_->num_blocks_in_batch(), 1);
+  EXPECT_EQ(inference_->num_tokens_in_batch(), NumTokens(one_mov_));
+
+  llvm::Expected<std::vector<SequenceModelInference::OutputType>> output =
+      inference_->RunInference();
+  ASSERT_THAT_EXPECTED(output, llvm::Succeeded());
+  EXPECT_THAT(*output, ElementsAre(ElementsAre(1.0f)));
+}
+
+TEST_P(SequenceModelInferenceTest, OutOfVocabularyTokenWithReplacement) {
+  ASSERT_NO_FATAL_FAILURE(CreateInference(kReplacementToken));
+  EXPECT_TRUE(inference_->AddBasicBlockToBatch(unknown_register_));
+  EXPECT_TRUE(inference_->AddBasicBlockToBatch(three_movs_));
+  EXPECT_EQ(inference_->num_tokens_in_batch(),
+            NumTokens(unknown_register_) + NumTokens(three_movs_));
+
+  llvm::Expected<std::vector<SequenceModelInference::OutputType>> output =
+      inference_->RunInference();
+  ASSERT_THAT_EXPECTED(output, llvm::Succeeded());
+  EXPECT_THAT(*output, ElementsAre(ElementsAre(1.0f), ElementsAre(3.0f)));
+}
+
+INSTANTIATE_TEST_SUITE_P(WithAndWithoutDeltaBlockIndex,
+                         SequenceModelInferenceTest, ::testing::Bool());
+
+}  // namespace
+}  // namespace gematria
@@ -0,0 +1,188 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/tflite/gather_segment_sum_op.h"
+
+#include <cstdint>
+
+#include "gematria/tflite/segment_sum_kernels.h"
+#include "tensorflow/lite/c/c_api_types.h"
+#include "tensorflow/lite/c/common.h"
+#include "tensorflow/lite/kernels/internal/runtime_shape.h"
+#include "tensorflow/lite/kernels/internal/tensor_ctypes.h"
+#include "tensorflow/lite/kernels/internal/types.h"
+#include "tensorflow/lite/kernels/kernel_util.h"
+
+namespace gematria {
+namespace {
+
+// The indices of the inputs and outputs of the op.
+constexpr int kInputParamsTensor = 0;
+constexpr int kInputIndicesTensor = 1;
+constexpr int kInputSegmentIdsTensor = 2;
+constexpr int kInputNumSegmentsTensor = 3;
+constexpr int kNumInputs = 4;
+
+constexpr int kOutputTensor = 0;
+constexpr int kNumOutputs = 1;
+
+// Resizes the output tensor based on the sizes of the input tensors. The shape
+// of the output is (num_segments, params.shape[1:]) where `num_segments` is the
+// value of `num_segments_tensor`.
+TfLiteStatus ResizeOutputTensor(TfLiteContext* context,
+                                const TfLiteTensor* params_tensor,
+                                const TfLiteTensor* num_segments_tensor,
+                                TfLiteTensor* output_tensor) {
+  const int num_segments =
+      tflite::GetTensorData<int32_t>(num_segments_tensor)[0];
+  TF_LITE_ENSURE(context, num_segments > 0);
+
+  const int num_dimensions = tflite::NumDimensions(params_tensor);
+  TfLiteIntArray* const output_size = TfLiteIntArrayCreate(num_dimensions);
+  output_size->data[0] = num_segments;
+  for (int i = 1; i < num_dimensions; ++i) {
+    output_size->data[i] = params_tensor->dims->data[i];
+  }
+  return context->ResizeTensor(context, output_tensor, output_size);
+}
+
+TfLiteStatus GatherSegmentSumPrepare(TfLiteContext* context,
+                                     TfLiteNode* node) {
+  TF_LITE_ENSURE_EQ(context, tflite::NumInputs(node), kNumInputs);
+  TF_LITE_ENSURE_EQ(context, tflite::NumOutputs(node), kNumOutputs);
+
+  const TfLiteTensor* params_tensor = nullptr;
+  TF_LITE_ENSURE_OK(
+      context,
+      tflite::GetInputSafe(context, node, kInputParamsTensor, &params_tensor));
+  const TfLiteTensor* indices_tensor = nullptr;
+  TF_LITE_ENSURE_OK(context,
+                    tflite::GetInputSafe(context, node, kInputIndicesTensor,
+                                         &indices_tensor));
+  const TfLiteTensor* segment_ids_tensor = nullptr;
+  TF_LITE_ENSURE_OK(context,
+                    tflite::GetInputSafe(context, node, kInputSegmentIdsTensor,
+                                         &segment_ids_tensor));
+  const TfLiteTensor* num_segments_tensor = nullptr;
+  TF_LITE_ENSURE_OK(context,
+                    tflite::GetInputSafe(context, node, kInputNumSegmentsTensor,
+                                         &num_segments_tensor));
+
+  // The data is either float32, or int8 with per-tensor quantization.
+  TF_LITE_ENSURE(context, params_tensor->type == kTfLiteFloat32 ||
+                              params_tensor->type == kTfLiteInt8);
+  TF_LITE_ENSURE(context, tflite::NumDimensions(params_tensor) >= 1);
+  TF_LITE_ENSURE_EQ(context, indices_tensor->type, kTfLiteInt32);
+  TF_LITE_ENSURE_EQ(context, segment_ids_tensor->type, kTfLiteInt32);
+
+  // The indices and the segment IDs must have the same shape.
+  const int num_index_dimensions = tflite::NumDimensions(indices_tensor);
+  TF_LITE_ENSURE_EQ(context, num_index_dimensions,
+                    tflite::NumDimensions(segment_ids_tensor));
+  for (int i = 0; i < num_index_dimensions; ++i) {
+    TF_LITE_ENSURE_EQ(context, indices_tensor->dims->data[i],
+                      segment_ids_tensor->dims->data[i]);
+  }
+
+  TF_LITE_ENSURE_EQ(context, num_segments_tensor->type, kTfLiteInt32);
+  TF_LITE_ENSURE_EQ(context, tflite::NumDimensions(num_segments_tensor), 0);
+  TF_LITE_ENSURE_EQ(context, num_segments_tensor->bytes, sizeof(int32_t));
+
+  TfLiteTensor* output_tensor = nullptr;
+  TF_LITE_ENSURE_OK(context, tflite::GetOutputSafe(context, node, kOutputTensor,
+                                                   &output_tensor));
+  TF_LITE_ENSURE_EQ(context, output_tensor->type, params_tensor->type);
+
+  if (!tflite::IsConstantTensor(num_segments_tensor) ||
+      !tflite::IsConstantTensor(params_tensor)) {
+    tflite::SetTensorToDynamic(output_tensor);
+    return kTfLiteOk;
+  }
+  return ResizeOutputTensor(context, /* params_tensor = */ params_tensor,
+                            /* num_segments_tensor = */ num_segments_tensor,
+                            /* output_tensor = */ output_tensor);
+}
+
+TfLiteStatus GatherSegmentSumInvoke(TfLiteContext* context, TfLiteNode* node) {
+  const TfLiteTensor* params_tensor = nullptr;
+  TF_LITE_ENSURE_OK(
+      context,
+      tflite::GetInputSafe(context, node, kInputParamsTensor, &params_tensor));
+  const TfLiteTensor* indices_tensor = nullptr;
+  TF_LITE_ENSURE_OK(context,
+                    tflite::GetInputSafe(context, node, kInputIndicesTensor,
+                                         &indices_tensor));
+  const TfLiteTensor* segment_ids_tensor = nullptr;
+  TF_LITE_ENSURE_OK(context,
+                    tflite::GetInputSafe(context, node, kInputSegmentIdsTensor,
+                                         &segment_ids_tensor));
+  const TfLiteTensor* num_segments_tensor = nullptr;
+  TF_LITE_ENSURE_OK(context,
+                    tflite::GetInputSafe(context, node, kInputNumSegmentsTensor,
+                                         &num_segments_tensor));
+  TfLiteTensor* output_tensor = nullptr;
+  TF_LITE_ENSURE_OK(context, tflite::GetOutputSafe(context, node, kOutputTensor,
+                                                   &output_tensor));
+
+  if (tflite::IsDynamicTensor(output_tensor)) {
+    TF_LITE_ENSURE_OK(
+        context,
+        ResizeOutputTensor(context, /* params_tensor = */ params_tensor,
+                           /* num_segments_tensor = */ num_segments_tensor,
+                           /* output_tensor = */ output_tensor));
+  }
+
+  const tflite::RuntimeShape params_shape =
+      tflite::GetTensorShape(params_tensor);
+  const int num_params_rows = params_shape.Dims(0);
+
+  const int num_indices = tflite::GetTensorShape(indices_tensor).FlatSize();
+  const auto* const indices = tflite::GetTensorData<int32_t>(indices_tensor);
+  const auto* const segment_ids =
+      tflite::GetTensorData<int32_t>(segment_ids_tensor);
+
+  const tflite::RuntimeShape output_shape =
+      tflite::GetTensorShape(output_tensor);
+  const int row_size = tflite::FlatSizeSkipDim(output_shape, 0);
+  const int num_output_rows = output_shape.Dims(0);
+
+  if (params_tensor->type == kTfLiteInt8) {
+    return QuantizedSegmentSum(
+        context, tflite::GetTensorData<int8_t>(params_tensor),
+        GetQuantizationParams(params_tensor), num_params_rows, indices,
+        segment_ids, num_indices, row_size, num_output_rows,
+        GetQuantizationParams(output_tensor),
+        tflite::GetTensorData<int8_t>(output_tensor));
+  }
+  return SegmentSum(context, tflite::GetTensorData<float>(params_tensor),
+                    num_params_rows, indices, segment_ids, num_indices,
+                    row_size, num_output_rows,
+                    tflite::GetTensorData<float>(output_tensor));
+}
+
+}  // namespace
+
+const char* kGatherSegmentSumOpName = "GatherSegmentSum";
+
+TfLiteRegistration* RegisterGatherSegmentSumOp() {
+  static TfLiteRegistration registration = {
+      .init = nullptr,
+      .free = nullptr,
+      .prepare = GatherSegmentSumPrepare,
+      .invoke = GatherSegmentSumInvoke,
+  };
+  return &registration;
+}
+
+}  // namespace gematria
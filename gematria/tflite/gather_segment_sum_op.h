@@ -0,0 +1,45 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Implements a fused gather + unsorted segment sum as a custom TensorFlow Lite
+// op. The op takes four inputs `params`, `indices`, `segment_ids`, and
+// `num_segments` and computes
+//   tf.math.unsorted_segment_sum(tf.gather(params, indices), segment_ids,
+//                                num_segments)
+// without materializing the result of tf.gather(). This is the pattern used by
+// the message passing in graph neural networks, where `indices` are the
+// senders and `segment_ids` are the receivers of the edges.
+//
+// `indices` and `segment_ids` must have the same shape, and the gather is
+// always done along the first axis of `params`. The op supports float32 and
+// int8 with per-tensor quantization as the data type, and int32 as the index
+// type.
+
+#ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_TFLITE_GATHER_SEGMENT_SUM_OP_H_
+#define THIRD_PARTY_GEMATRIA_GEMATRIA_TFLITE_GATHER_SEGMENT_SUM_OP_H_
+
+#include "tensorflow/lite/c/common.h"
+
+namespace gematria {
+
+// The name of the fused gather + segment sum op. Models using this op are
+// created by gematria/granite/python/fuse_gather_segment_sum.py.
+extern const char* kGatherSegmentSumOpName;
+
+// Creates a registration structure for the fused gather + segment sum op.
+TfLiteRegistration* RegisterGatherSegmentSumOp();
+
+}  // namespace gematria
+
+#endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_TFLITE_GATHER_SEGMENT_SUM_OP_H_
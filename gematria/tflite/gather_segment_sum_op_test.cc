@@ -0,0 +1,218 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/tflite/gather_segment_sum_op.h"
+
+#include <cstdint>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "tensorflow/lite/c/c_api_types.h"
+#include "tensorflow/lite/kernels/test_util.h"
+#include "tensorflow/lite/schema/schema_generated.h"
+#include "tensorflow/lite/string_type.h"
+
+namespace gematria {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::ElementsAreArray;
+
+class GatherSegmentSumOpModel : public tflite::SingleOpModel {
+ public:
+  GatherSegmentSumOpModel(const tflite::TensorData& params,
+                          const tflite::TensorData& indices,
+                          const tflite::TensorData& segment_ids,
+                          const tflite::TensorData& num_segments,
+                          const tflite::TensorData& output,
+                          int num_threads = -1) {
+    params_id_ = AddInput(params);
+    indices_id_ = AddInput(indices);
+    segment_ids_id_ = AddInput(segment_ids);
+    num_segments_id_ = AddInput(num_segments);
+    output_id_ = AddOutput(output);
+    SetCustomOp(tflite::string(kGatherSegmentSumOpName), {},
+                RegisterGatherSegmentSumOp);
+    BuildInterpreter({GetShape(params_id_), GetShape(indices_id_),
+                      GetShape(segment_ids_id_), GetShape(num_segments_id_)},
+                     num_threads, /* allow_fp32_relax_to_fp16 = */ false,
+                     /* apply_delegate = */ true);
+  }
+
+  int params() const { return params_id_; }
+  int indices() const { return indices_id_; }
+  int segment_ids() const { return segment_ids_id_; }
+  int num_segments() const { return num_segments_id_; }
+
+  std::vector<float> GetOutput() { return ExtractVector<float>(output_id_); }
+  std::vector<float> GetDequantizedOutput() {
+    return Dequantize<int8_t>(ExtractVector<int8_t>(output_id_),
+                              GetScale(output_id_), GetZeroPoint(output_id_));
+  }
+  std::vector<int32_t> GetOutputShape() { return GetTensorShape(output_id_); }
+
+ protected:
+  int params_id_;
+  int indices_id_;
+  int segment_ids_id_;
+  int num_segments_id_;
+  int output_id_;
+};
+
+TEST(GatherSegmentSumOpModelTest, Trivial1DMatrix) {
+  GatherSegmentSumOpModel model(
+      /* params = */ {tflite::TensorType_FLOAT32, {3}},
+      /* indices = */ {tflite::TensorType_INT32, {5}},
+      /* segment_ids = */ {tflite::TensorType_INT32, {5}},
+      /* num_segments = */ {tflite::TensorType_INT32, {}},
+      /* output = */ {tflite::TensorType_FLOAT32, {4}});
+  model.PopulateTensor<float>(model.params(), {1.0f, 2.0f, 4.0f});
+  model.PopulateTensor<int32_t>(model.indices(), {0, 2, 2, 1, 0});
+  model.PopulateTensor<int32_t>(model.segment_ids(), {0, 0, 1, 2, 2});
+  model.PopulateTensor<int32_t>(model.num_segments(), {4});
+  ASSERT_EQ(model.Invoke(), kTfLiteOk);
+
+  EXPECT_THAT(model.GetOutput(), ElementsAre(5.0f, 4.0f, 3.0f, 0.0f));
+  EXPECT_THAT(model.GetOutputShape(), ElementsAre(4));
+}
+
+TEST(GatherSegmentSumOpModelTest, Normal2DMatrix) {
+  GatherSegmentSumOpModel model(
+      /* params = */ {tflite::TensorType_FLOAT32, {3, 2}},
+      /* indices = */ {tflite::TensorType_INT32, {4}},
+      /* segment_ids = */ {tflite::TensorType_INT32, {4}},
+      /* num_segments = */ {tflite::TensorType_INT32, {}},
+      /* output = */ {tflite::TensorType_FLOAT32, {3, 2}});
+  model.PopulateTensor<float>(model.params(),
+                              {1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f});
+  model.PopulateTensor<int32_t>(model.indices(), {2, 0, 1, 1});
+  model.PopulateTensor<int32_t>(model.segment_ids(), {2, 0, 2, 0});
+  model.PopulateTensor<int32_t>(model.num_segments(), {3});
+  ASSERT_EQ(model.Invoke(), kTfLiteOk);
+
+  EXPECT_THAT(model.GetOutput(),
+              ElementsAre(4.0f, 6.0f, 0.0f, 0.0f, 8.0f, 10.0f));
+  EXPECT_THAT(model.GetOutputShape(), ElementsAre(3, 2));
+}
+
+TEST(GatherSegmentSumOpModelTest, LargeMatrixWithMultipleThreads) {
+  // The input is large enough to be processed by multiple threads.
+  constexpr int kNumParamsRows = 500;
+  constexpr int kNumIndices = 8192;
+  constexpr int kRowSize = 32;
+  constexpr int kNumSegments = 37;
+  GatherSegmentSumOpModel model(
+      /* params = */ {tflite::TensorType_FLOAT32, {kNumParamsRows, kRowSize}},
+      /* indices = */ {tflite::TensorType_INT32, {kNumIndices}},
+      /* segment_ids = */ {tflite::TensorType_INT32, {kNumIndices}},
+      /* num_segments = */ {tflite::TensorType_INT32, {}},
+      /* output = */ {tflite::TensorType_FLOAT32, {kNumSegments, kRowSize}},
+      /* num_threads = */ 4);
+  std::vector<float> params(kNumParamsRows * kRowSize);
+  for (int row = 0; row < kNumParamsRows; ++row) {
+    for (int i = 0; i < kRowSize; ++i) {
+      params[row * kRowSize + i] = static_cast<float>((row + i) % 5);
+    }
+  }
+  std::vector<int32_t> indices(kNumIndices);
+  std::vector<int32_t> segment_ids(kNumIndices);
+  std::vector<float> expected_output(kNumSegments * kRowSize, 0.0f);
+  for (int edge = 0; edge < kNumIndices; ++edge) {
+    indices[edge] = (edge * 11) % kNumParamsRows;
+    segment_ids[edge] = (edge * 7) % kNumSegments;
+    for (int i = 0; i < kRowSize; ++i) {
+      expected_output[segment_ids[edge] * kRowSize + i] +=
+          params[indices[edge] * kRowSize + i];
+    }
+  }
+  model.PopulateTensor<float>(model.params(), params);
+  model.PopulateTensor<int32_t>(model.indices(), indices);
+  model.PopulateTensor<int32_t>(model.segment_ids(), segment_ids);
+  model.PopulateTensor<int32_t>(model.num_segments(), {kNumSegments});
+  ASSERT_EQ(model.Invoke(), kTfLiteOk);
+
+  EXPECT_EQ(model.GetOutput(), expected_output);
+  EXPECT_THAT(model.GetOutputShape(), ElementsAre(kNumSegments, kRowSize));
+}
+
+TEST(GatherSegmentSumOpModelTest, QuantizedInt8) {
+  GatherSegmentSumOpModel model(
+      /* params = */ {tflite::TensorType_INT8, {3, 2}, -8.0f, 8.0f},
+      /* indices = */ {tflite::TensorType_INT32, {4}},
+      /* segment_ids = */ {tflite::TensorType_INT32, {4}},
+      /* num_segments = */ {tflite::TensorType_INT32, {}},
+      /* output = */ {tflite::TensorType_INT8, {3, 2}, -16.0f, 16.0f});
+  model.QuantizeAndPopulate<int8_t>(model.params(),
+                                    {1.0f, 2.0f, 3.0f, -4.0f, 5.0f, 6.0f});
+  model.PopulateTensor<int32_t>(model.indices(), {2, 0, 1, 1});
+  model.PopulateTensor<int32_t>(model.segment_ids(), {2, 0, 2, 0});
+  model.PopulateTensor<int32_t>(model.num_segments(), {3});
+  ASSERT_EQ(model.Invoke(), kTfLiteOk);
+
+  // The tolerance accounts for the quantization of the inputs and the output.
+  EXPECT_THAT(model.GetDequantizedOutput(),
+              ElementsAreArray(tflite::ArrayFloatNear(
+                  {4.0f, -2.0f, 0.0f, 0.0f, 8.0f, 2.0f},
+                  /* max_abs_error = */ 0.25f)));
+  EXPECT_THAT(model.GetOutputShape(), ElementsAre(3, 2));
+}
+
+TEST(GatherSegmentSumOpModelTest, NotMatchingShapes) {
+  GatherSegmentSumOpModel model(
+      /* params = */ {tflite::TensorType_FLOAT32, {3}},
+      /* indices = */ {tflite::TensorType_INT32, {4}},
+      /* segment_ids = */ {tflite::TensorType_INT32, {3}},
+      /* num_segments = */ {tflite::TensorType_INT32, {}},
+      /* output = */ {tflite::TensorType_FLOAT32, {3}});
+  model.PopulateTensor<float>(model.params(), {4.0f, 5.0f, 6.0f});
+  model.PopulateTensor<int32_t>(model.indices(), {0, 1, 2, 1});
+  model.PopulateTensor<int32_t>(model.segment_ids(), {0, 0, 2});
+  model.PopulateTensor<int32_t>(model.num_segments(), {3});
+
+  EXPECT_EQ(model.Invoke(), kTfLiteError);
+}
+
+TEST(GatherSegmentSumOpModelTest, IndexOverflow) {
+  GatherSegmentSumOpModel model(
+      /* params = */ {tflite::TensorType_FLOAT32, {3}},
+      /* indices = */ {tflite::TensorType_INT32, {3}},
+      /* segment_ids = */ {tflite::TensorType_INT32, {3}},
+      /* num_segments = */ {tflite::TensorType_INT32, {}},
+      /* output = */ {tflite::TensorType_FLOAT32, {3}});
+  model.PopulateTensor<float>(model.params(), {4.0f, 5.0f, 6.0f});
+  model.PopulateTensor<int32_t>(model.indices(), {0, 3, 1});
+  model.PopulateTensor<int32_t>(model.segment_ids(), {0, 0, 2});
+  model.PopulateTensor<int32_t>(model.num_segments(), {3});
+
+  EXPECT_EQ(model.Invoke(), kTfLiteError);
+}
+
+TEST(GatherSegmentSumOpModelTest, SegmentIdOverflow) {
+  GatherSegmentSumOpModel model(
+      /* params = */ {tflite::TensorType_FLOAT32, {3}},
+      /* indices = */ {tflite::TensorType_INT32, {3}},
+      /* segment_ids = */ {tflite::TensorType_INT32, {3}},
+      /* num_segments = */ {tflite::TensorType_INT32, {}},
+      /* output = */ {tflite::TensorType_FLOAT32, {3}});
+  model.PopulateTensor<float>(model.params(), {4.0f, 5.0f, 6.0f});
+  model.PopulateTensor<int32_t>(model.indices(), {0, 1, 2});
+  model.PopulateTensor<int32_t>(model.segment_ids(), {0, -1, 2});
+  model.PopulateTensor<int32_t>(model.num_segments(), {3});
+
+  EXPECT_EQ(model.Invoke(), kTfLiteError);
+}
+
+}  // namespace
+}  // namespace gematria
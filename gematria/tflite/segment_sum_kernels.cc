@@ -0,0 +1,284 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gematria/tflite/segment_sum_kernels.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <thread>
+#include <vector>
+
+#include "tensorflow/lite/c/common.h"
+
+namespace gematria {
+namespace {
+
+// The minimal number of input elements processed by a single thread. Smaller
+// inputs are processed on the calling thread, because the cost of starting the
+// threads would outweigh the gains.
+constexpr int kMinNumElementsPerThread = 1 << 16;
+
+// Adds `size` elements from `input` to `output`. The two arrays never overlap,
+// which allows the compiler to vectorize the loop.
+template <typename InputType, typename AccumulatorType>
+inline void AddRow(const InputType* __restrict input,
+                   AccumulatorType* __restrict output, int size) {
+  for (int i = 0; i < size; ++i) {
+    output[i] += input[i];
+  }
+}
+
+// The input of the segment sum kernels. `row_indices` may be nullptr; see
+// SegmentSum() for details.
+template <typename InputType>
+struct SegmentSumInput {
+  // Returns a pointer to the data row used for the given segment ID.
+  const InputType* Row(int segment_index) const {
+    const int row =
+        row_indices == nullptr ? segment_index : row_indices[segment_index];
+    return data + static_cast<int64_t>(row) * row_size;
+  }
+
+  const InputType* data;
+  const int32_t* row_indices;
+  const int32_t* segment_ids;
+  int num_segment_ids;
+  int row_size;
+};
+
+// Computes the rows [begin_row, end_row) of the output of the segment sum. The
+// rows of the output are accumulated in the order of the input rows, so that
+// the result does not depend on the way the output is partitioned.
+template <typename InputType, typename AccumulatorType>
+void SegmentSumRows(const SegmentSumInput<InputType>& input, int begin_row,
+                    int end_row, AccumulatorType* output_data) {
+  const int row_size = input.row_size;
+  std::fill(output_data + static_cast<int64_t>(begin_row) * row_size,
+            output_data + static_cast<int64_t>(end_row) * row_size,
+            AccumulatorType{0});
+  for (int segment_index = 0; segment_index < input.num_segment_ids;
+       ++segment_index) {
+    const int segment = input.segment_ids[segment_index];
+    if (segment < begin_row || segment >= end_row) continue;
+    AddRow(input.Row(segment_index),
+           output_data + static_cast<int64_t>(segment) * row_size, row_size);
+  }
+}
+
+// Computes the segment sum for the input rows [begin_index, end_index) when the
+// segment IDs are sorted. Writes the output rows [begin_row, end_row); these
+// must contain the segments of all the input rows, and they must not contain
+// segments of any other input rows. The segments are accumulated one by one,
+// so each output row is written only while it is hot in the cache, and no
+// output row is touched twice.
+template <typename InputType, typename AccumulatorType>
+void SortedSegmentSumRows(const SegmentSumInput<InputType>& input,
+                          int begin_index, int end_index, int begin_row,
+                          int end_row, AccumulatorType* output_data) {
+  const int row_size = input.row_size;
+  const auto output_row = [output_data, row_size](int row) {
+    return output_data + static_cast<int64_t>(row) * row_size;
+  };
+  int next_row = begin_row;
+  int index = begin_index;
+  while (index < end_index) {
+    const int segment = input.segment_ids[index];
+    // Zero the rows of segments that do not appear in the input.
+    std::fill(output_row(next_row), output_row(segment), AccumulatorType{0});
+    AccumulatorType* const segment_row = output_row(segment);
+    std::copy_n(input.Row(index), row_size, segment_row);
+    for (++index; index < end_index && input.segment_ids[index] == segment;
+         ++index) {
+      AddRow(input.Row(index), segment_row, row_size);
+    }
+    next_row = segment + 1;
+  }
+  std::fill(output_row(next_row), output_row(end_row), AccumulatorType{0});
+}
+
+// Calls `fn(partition)` for all partitions in [0, num_partitions). Each
+// partition runs on a separate thread; partition 0 runs on the calling thread.
+template <typename Function>
+void RunPartitionsInParallel(int num_partitions, const Function& fn) {
+  std::vector<std::thread> threads;
+  threads.reserve(num_partitions - 1);
+  for (int partition = 1; partition < num_partitions; ++partition) {
+    threads.emplace_back([&fn, partition]() { fn(partition); });
+  }
+  fn(0);
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+}
+
+// Implements SegmentSum() for the given input type. The output rows are
+// accumulated in `AccumulatorType`.
+template <typename InputType, typename AccumulatorType>
+TfLiteStatus SegmentSumImpl(TfLiteContext* context, const InputType* data,
+                            int num_data_rows, const int32_t* row_indices,
+                            const int32_t* segment_ids, int num_segment_ids,
+                            int row_size, int num_output_rows,
+                            AccumulatorType* output_data) {
+  // Validate the inputs once, so that the inner loops do not need any bounds
+  // checks. At the same time, check whether the segment IDs are sorted; this is
+  // often the case in GRANITE models, where the graph builder emits the nodes
+  // and edges block by block.
+  if (row_indices == nullptr) {
+    TF_LITE_ENSURE(context, num_segment_ids <= num_data_rows);
+  }
+  bool segment_ids_are_sorted = true;
+  for (int segment_index = 0; segment_index < num_segment_ids;
+       ++segment_index) {
+    if (row_indices != nullptr) {
+      TF_LITE_ENSURE(context, row_indices[segment_index] >= 0);
+      TF_LITE_ENSURE(context, row_indices[segment_index] < num_data_rows);
+    }
+    const int segment = segment_ids[segment_index];
+    TF_LITE_ENSURE(context, segment >= 0);
+    // NOTE(ondrasej): This should also catch the case where the `num_segments`
+    // input is smaller than the largest segment ID in `segment_ids`.
+    TF_LITE_ENSURE(context, segment < num_output_rows);
+    if (segment_index > 0 && segment < segment_ids[segment_index - 1]) {
+      segment_ids_are_sorted = false;
+    }
+  }
+
+  const SegmentSumInput<InputType> input = {.data = data,
+                                            .row_indices = row_indices,
+                                            .segment_ids = segment_ids,
+                                            .num_segment_ids = num_segment_ids,
+                                            .row_size = row_size};
+  const int64_t num_input_elements =
+      static_cast<int64_t>(num_segment_ids) * row_size;
+  const int num_threads = static_cast<int>(std::clamp<int64_t>(
+      std::min<int64_t>(num_input_elements / kMinNumElementsPerThread,
+                        std::max(context->recommended_num_threads, 1)),
+      1, std::max(num_output_rows, 1)));
+
+  if (segment_ids_are_sorted) {
+    if (num_threads == 1) {
+      SortedSegmentSumRows(input, 0, num_segment_ids, 0, num_output_rows,
+                           output_data);
+      return kTfLiteOk;
+    }
+    // Large inputs are partitioned by the input rows. The partitions are
+    // aligned to the boundaries of the segments, so that each output row is
+    // computed by exactly one thread.
+    const auto input_begin = [num_segment_ids, segment_ids,
+                              num_threads](int partition) {
+      int index = static_cast<int>(static_cast<int64_t>(num_segment_ids) *
+                                   partition / num_threads);
+      while (index > 0 && index < num_segment_ids &&
+             segment_ids[index] == segment_ids[index - 1]) {
+        ++index;
+      }
+      return index;
+    };
+    const auto row_begin = [&input_begin, num_segment_ids, segment_ids,
+                            num_output_rows](int partition) {
+      if (partition == 0) return 0;
+      const int index = input_begin(partition);
+      return index < num_segment_ids ? segment_ids[index] : num_output_rows;
+    };
+    RunPartitionsInParallel(num_threads, [&](int partition) {
+      SortedSegmentSumRows(input, input_begin(partition),
+                           input_begin(partition + 1), row_begin(partition),
+                           row_begin(partition + 1), output_data);
+    });
+    return kTfLiteOk;
+  }
+
+  // The segment IDs are not sorted. Large inputs are partitioned by the output
+  // rows; each thread scans all segment IDs, but it accumulates only the rows
+  // in its partition. This needs no synchronization between the threads, and
+  // the result is the same as with a single thread.
+  if (num_threads == 1) {
+    SegmentSumRows(input, 0, num_output_rows, output_data);
+    return kTfLiteOk;
+  }
+  const auto row_begin = [num_output_rows, num_threads](int partition) {
+    return static_cast<int>(static_cast<int64_t>(num_output_rows) * partition /
+                            num_threads);
+  };
+  RunPartitionsInParallel(num_threads, [&](int partition) {
+    SegmentSumRows(input, row_begin(partition), row_begin(partition + 1),
+                   output_data);
+  });
+  return kTfLiteOk;
+}
+
+}  // namespace
+
+TfLiteStatus SegmentSum(TfLiteContext* context, const float* data,
+                        int num_data_rows, const int32_t* row_indices,
+                        const int32_t* segment_ids, int num_segment_ids,
+                        int row_size, int num_output_rows, float* output_data) {
+  return SegmentSumImpl(context, data, num_data_rows, row_indices, segment_ids,
+                        num_segment_ids, row_size, num_output_rows,
+                        output_data);
+}
+
+QuantizationParams GetQuantizationParams(const TfLiteTensor* tensor) {
+  return {.scale = tensor->params.scale,
+          .zero_point = tensor->params.zero_point};
+}
+
+TfLiteStatus QuantizedSegmentSum(
+    TfLiteContext* context, const int8_t* data,
+    const QuantizationParams& data_params, int num_data_rows,
+    const int32_t* row_indices, const int32_t* segment_ids,
+    int num_segment_ids, int row_size, int num_output_rows,
+    const QuantizationParams& output_params, int8_t* output_data) {
+  TF_LITE_ENSURE(context, data_params.scale > 0.0f);
+  TF_LITE_ENSURE(context, output_params.scale > 0.0f);
+
+  // The quantized values are summed exactly in int32; the zero point of the
+  // input is subtracted once per output element, using the number of input
+  // rows in each segment.
+  std::vector<int32_t> accumulators(static_cast<int64_t>(num_output_rows) *
+                                    row_size);
+  TF_LITE_ENSURE_OK(context,
+                    SegmentSumImpl(context, data, num_data_rows, row_indices,
+                                   segment_ids, num_segment_ids, row_size,
+                                   num_output_rows, accumulators.data()));
+  std::vector<int32_t> num_rows_in_segment(num_output_rows, 0);
+  for (int segment_index = 0; segment_index < num_segment_ids;
+       ++segment_index) {
+    ++num_rows_in_segment[segment_ids[segment_index]];
+  }
+
+  const float multiplier = data_params.scale / output_params.scale;
+  for (int row = 0; row < num_output_rows; ++row) {
+    const int32_t zero_point_sum =
+        num_rows_in_segment[row] * data_params.zero_point;
+    const int32_t* const accumulator_row =
+        accumulators.data() + static_cast<int64_t>(row) * row_size;
+    int8_t* const output_row =
+        output_data + static_cast<int64_t>(row) * row_size;
+    for (int i = 0; i < row_size; ++i) {
+      const float real_value =
+          multiplier * static_cast<float>(accumulator_row[i] - zero_point_sum);
+      const int32_t value = static_cast<int32_t>(std::lround(real_value)) +
+                            output_params.zero_point;
+      output_row[i] = static_cast<int8_t>(
+          std::clamp<int32_t>(value, std::numeric_limits<int8_t>::min(),
+                              std::numeric_limits<int8_t>::max()));
+    }
+  }
+  return kTfLiteOk;
+}
+
+}  // namespace gematria
@@ -0,0 +1,69 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Contains the segment sum kernels shared by the custom TensorFlow Lite ops.
+
+#ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_TFLITE_SEGMENT_SUM_KERNELS_H_
+#define THIRD_PARTY_GEMATRIA_GEMATRIA_TFLITE_SEGMENT_SUM_KERNELS_H_
+
+#include <cstdint>
+
+#include "tensorflow/lite/c/common.h"
+
+namespace gematria {
+
+// Computes a segment sum of rows of `data`: for each i in [0, num_segment_ids),
+// adds the row `row_indices[i]` of `data` to the row `segment_ids[i]` of
+// `output_data`. When `row_indices` is nullptr, uses the row `i` of `data`,
+// i.e. computes tf.math.unsorted_segment_sum. Otherwise, computes
+// tf.math.unsorted_segment_sum(tf.gather(data, row_indices), segment_ids)
+// without materializing the result of the gather.
+//
+// All rows have `row_size` elements. `data` has `num_data_rows` rows, and
+// `output_data` has `num_output_rows` rows; the output rows that do not appear
+// in `segment_ids` are set to zero. Returns an error when a row index or a
+// segment ID is out of bounds; in that case, the contents of `output_data` are
+// undefined.
+//
+// Uses a faster kernel when the segment IDs are sorted. Large inputs are
+// processed in parallel using up to `context->recommended_num_threads` threads.
+// The result does not depend on the kernel or the number of threads.
+TfLiteStatus SegmentSum(TfLiteContext* context, const float* data,
+                        int num_data_rows, const int32_t* row_indices,
+                        const int32_t* segment_ids, int num_segment_ids,
+                        int row_size, int num_output_rows, float* output_data);
+
+// The parameters of per-tensor affine quantization: the real value of a
+// quantized value `q` is `scale * (q - zero_point)`.
+struct QuantizationParams {
+  float scale;
+  int32_t zero_point;
+};
+
+// Returns the per-tensor quantization parameters of `tensor`.
+QuantizationParams GetQuantizationParams(const TfLiteTensor* tensor);
+
+// A version of SegmentSum() for int8 data quantized with `data_params`. The
+// sums are computed exactly in int32 and then requantized to `output_params`;
+// values outside of the range of int8 are saturated.
+TfLiteStatus QuantizedSegmentSum(
+    TfLiteContext* context, const int8_t* data,
+    const QuantizationParams& data_params, int num_data_rows,
+    const int32_t* row_indices, const int32_t* segment_ids,
+    int num_segment_ids, int row_size, int num_output_rows,
+    const QuantizationParams& output_params, int8_t* output_data);
+
+}  // namespace gematria
+
+#endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_TFLITE_SEGMENT_SUM_KERNELS_H_
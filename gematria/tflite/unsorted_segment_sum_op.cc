@@ -14,9 +14,9 @@
 
 #include "gematria/tflite/unsorted_segment_sum_op.h"
 
-#include <algorithm>
 #include <cstdint>
 
+#include "gematria/tflite/segment_sum_kernels.h"
 #include "tensorflow/lite/c/c_api_types.h"
 #include "tensorflow/lite/c/common.h"
 #include "tensorflow/lite/kernels/internal/runtime_shape.h"
@@ -101,8 +101,9 @@ TfLiteStatus UnsortedSegmentSumPrepare(TfLiteContext* context,
                     tflite::GetInputSafe(context, node, kInputNumSegmentsTensor,
                                          &num_segments_tensor));
 
-  // TODO(ondrasej): Consider supporting additional data types.
-  TF_LITE_ENSURE_EQ(context, data_tensor->type, kTfLiteFloat32);
+  // The data is either float32, or int8 with per-tensor quantization.
+  TF_LITE_ENSURE(context, data_tensor->type == kTfLiteFloat32 ||
+                              data_tensor->type == kTfLiteInt8);
   TF_LITE_ENSURE_EQ(context, segment_ids_tensor->type, kTfLiteInt32);
 
   const int num_data_dimensions = tflite::NumDimensions(data_tensor);
@@ -117,7 +118,7 @@ TfLiteStatus UnsortedSegmentSumPrepare(TfLiteContext* context,
   TfLiteTensor* output_tensor = nullptr;
   TF_LITE_ENSURE_OK(context, tflite::GetOutputSafe(context, node, kOutputTensor,
                                                    &output_tensor));
-  TF_LITE_ENSURE_EQ(context, output_tensor->type, kTfLiteFloat32);
+  TF_LITE_ENSURE_EQ(context, output_tensor->type, data_tensor->type);
 
   // TODO(ondrasej): This condition is safe, but perhaps we could find a weaker
   // condition for allocating the output during the `prepare` phase.
@@ -161,7 +162,6 @@ TfLiteStatus UnsortedSegmentSumInvoke(TfLiteContext* context,
   }
   const tflite::RuntimeShape data_shape = tflite::GetTensorShape(data_tensor);
   const int data_flat_size = data_shape.FlatSize();
-  const auto* const data = tflite::GetTensorData<float>(data_tensor);
 
   const tflite::RuntimeShape index_shape =
       tflite::GetTensorShape(segment_ids_tensor);
@@ -171,30 +171,25 @@ TfLiteStatus UnsortedSegmentSumInvoke(TfLiteContext* context,
 
   const tflite::RuntimeShape output_shape =
       tflite::GetTensorShape(output_tensor);
-  const int output_flat_size = output_shape.FlatSize();
 
-  auto* const output_data = tflite::GetTensorData<float>(output_tensor);
   // The size of a single "row" in the output tensor. We use this to compute the
   // address of the segment in the output vector.
   const int row_size = tflite::FlatSizeSkipDim(output_shape, 0);
-  std::fill(output_data, output_data + output_shape.FlatSize(), 0.0f);
-
-  for (int segment_index = 0; segment_index < index_flat_size;
-       ++segment_index) {
-    const int segment = index_data[segment_index];
-    const int input_row_start = segment_index * row_size;
-    const int output_row_start = segment * row_size;
-    TF_LITE_ENSURE(context, input_row_start + row_size <= data_flat_size);
-    TF_LITE_ENSURE(context, output_row_start >= 0);
-    // NOTE(ondrasej): This should also catch the case where the `num_segments`
-    // input is smaller than the largest segment ID in `segment_ids`.
-    TF_LITE_ENSURE(context, output_row_start + row_size <= output_flat_size);
-    for (int i = 0; i < row_size; ++i) {
-      output_data[output_row_start + i] += data[input_row_start + i];
-    }
+  const int num_output_rows = output_shape.Dims(0);
+  const int num_data_rows =
+      row_size == 0 ? index_flat_size : data_flat_size / row_size;
+  if (data_tensor->type == kTfLiteInt8) {
+    return QuantizedSegmentSum(
+        context, tflite::GetTensorData<int8_t>(data_tensor),
+        GetQuantizationParams(data_tensor), num_data_rows,
+        /* row_indices = */ nullptr, index_data, index_flat_size, row_size,
+        num_output_rows, GetQuantizationParams(output_tensor),
+        tflite::GetTensorData<int8_t>(output_tensor));
   }
-
-  return kTfLiteOk;
+  return SegmentSum(context, tflite::GetTensorData<float>(data_tensor),
+                    num_data_rows, /* row_indices = */ nullptr, index_data,
+                    index_flat_size, row_size, num_output_rows,
+                    tflite::GetTensorData<float>(output_tensor));
 }
 
 }  // namespace
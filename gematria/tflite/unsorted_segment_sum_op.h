@@ -14,7 +14,9 @@
 
 // Implements `tf.UnsortedSegmentSum` as a custom TensorFlow Lite op. This
 // op supports the same shapes of inputs and outputs as the original TensorFlow
-// op, but it supports only float32 as data type, and int32 as index type.
+// op, but it supports only float32 and int8 as data types, and int32 as index
+// type. With int8, the data and the output use per-tensor quantization, and
+// they may have different quantization parameters.
 
 #ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_TFLITE_UNSORTED_SEGMENT_SUM_OP_H_
 #define THIRD_PARTY_GEMATRIA_GEMATRIA_TFLITE_UNSORTED_SEGMENT_SUM_OP_H_
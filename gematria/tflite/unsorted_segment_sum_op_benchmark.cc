@@ -0,0 +1,112 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Benchmarks for the UnsortedSegmentSum custom op. The op is run through a
+// TensorFlow Lite interpreter with a single node, so that the measured time
+// includes the overhead of the interpreter, as in a real model.
+
+#include <algorithm>
+#include <cstdint>
+#include <random>
+
+#include "benchmark/benchmark.h"
+#include "gematria/tflite/unsorted_segment_sum_op.h"
+#include "tensorflow/lite/c/c_api_types.h"
+#include "tensorflow/lite/c/common.h"
+#include "tensorflow/lite/interpreter.h"
+
+namespace gematria {
+namespace {
+
+// The number of rows of the data tensor. This is roughly the number of edges
+// in a batch of 100 basic blocks from the BHive data set.
+constexpr int kNumDataRows = 16384;
+
+// The indices of the tensors in the interpreter.
+constexpr int kDataTensor = 0;
+constexpr int kSegmentIdsTensor = 1;
+constexpr int kNumSegmentsTensor = 2;
+constexpr int kOutputTensor = 3;
+
+// Benchmarks the op on a data tensor of shape [kNumDataRows, row_size]. The
+// arguments of the benchmark are:
+//   0: the size of a row of the data tensor,
+//   1: the number of segments,
+//   2: 1 when the segment IDs are sorted, 0 otherwise,
+//   3: the number of threads used by the interpreter.
+void BM_UnsortedSegmentSum(benchmark::State& state) {
+  const int row_size = static_cast<int>(state.range(0));
+  const int num_segments = static_cast<int>(state.range(1));
+  const bool sorted_segment_ids = state.range(2) != 0;
+  const int num_threads = static_cast<int>(state.range(3));
+
+  tflite::Interpreter interpreter;
+  interpreter.AddTensors(4);
+  interpreter.SetInputs({kDataTensor, kSegmentIdsTensor, kNumSegmentsTensor});
+  interpreter.SetOutputs({kOutputTensor});
+  const TfLiteQuantizationParams quantization = {};
+  interpreter.SetTensorParametersReadWrite(kDataTensor, kTfLiteFloat32, "data",
+                                           {kNumDataRows, row_size},
+                                           quantization);
+  interpreter.SetTensorParametersReadWrite(kSegmentIdsTensor, kTfLiteInt32,
+                                           "segment_ids", {kNumDataRows},
+                                           quantization);
+  interpreter.SetTensorParametersReadWrite(
+      kNumSegmentsTensor, kTfLiteInt32, "num_segments", {}, quantization);
+  interpreter.SetTensorParametersReadWrite(kOutputTensor, kTfLiteFloat32,
+                                           "output", {num_segments, row_size},
+                                           quantization);
+  interpreter.AddNodeWithParameters(
+      {kDataTensor, kSegmentIdsTensor, kNumSegmentsTensor}, {kOutputTensor},
+      nullptr, 0, nullptr, RegisterUnsortedSegmentSumOp());
+  interpreter.SetNumThreads(num_threads);
+  if (interpreter.AllocateTensors() != kTfLiteOk) {
+    state.SkipWithError("Could not allocate tensors");
+    return;
+  }
+
+  std::mt19937 random_generator(1);
+  std::uniform_real_distribution<float> data_distribution(-1.0f, 1.0f);
+  float* const data = interpreter.typed_tensor<float>(kDataTensor);
+  std::generate_n(data, kNumDataRows * row_size,
+                  [&]() { return data_distribution(random_generator); });
+  int32_t* const segment_ids =
+      interpreter.typed_tensor<int32_t>(kSegmentIdsTensor);
+  std::uniform_int_distribution<int32_t> segment_distribution(0,
+                                                              num_segments - 1);
+  std::generate_n(segment_ids, kNumDataRows,
+                  [&]() { return segment_distribution(random_generator); });
+  if (sorted_segment_ids) std::sort(segment_ids, segment_ids + kNumDataRows);
+  *interpreter.typed_tensor<int32_t>(kNumSegmentsTensor) = num_segments;
+
+  for (auto _ : state) {
+    if (interpreter.Invoke() != kTfLiteOk) {
+      state.SkipWithError("Invoke failed");
+      return;
+    }
+    benchmark::DoNotOptimize(interpreter.typed_tensor<float>(kOutputTensor));
+  }
+  state.SetItemsProcessed(state.iterations() * kNumDataRows);
+  state.SetBytesProcessed(state.iterations() * kNumDataRows *
+                          (row_size * sizeof(float) + sizeof(int32_t)));
+}
+
+BENCHMARK(BM_UnsortedSegmentSum)
+    ->ArgNames({"row_size", "num_segments", "sorted", "threads"})
+    ->ArgsProduct({{16, 128, 256}, {64, 4096}, {0, 1}, {1, 4}});
+
+}  // namespace
+}  // namespace gematria
+
+BENCHMARK_MAIN();
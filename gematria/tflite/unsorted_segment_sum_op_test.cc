@@ -28,13 +28,15 @@ namespace gematria {
 namespace {
 
 using ::testing::ElementsAre;
+using ::testing::ElementsAreArray;
 
 class UnsortedSegmentSumOpModel : public tflite::SingleOpModel {
  public:
   UnsortedSegmentSumOpModel(const tflite::TensorData& data,
                             const tflite::TensorData& segment_ids,
                             const tflite::TensorData& num_segments,
-                            const tflite::TensorData& output) {
+                            const tflite::TensorData& output,
+                            int num_threads = -1) {
     data_id_ = AddInput(data);
     segment_ids_id_ = AddInput(segment_ids);
     num_segments_id_ = AddInput(num_segments);
@@ -42,7 +44,9 @@ class UnsortedSegmentSumOpModel : public tflite::SingleOpModel {
     SetCustomOp(tflite::string(kUnsortedSegmentSumOpName), {},
                 RegisterUnsortedSegmentSumOp);
     BuildInterpreter({GetShape(data_id_), GetShape(segment_ids_id_),
-                      GetShape(num_segments_id_)});
+                      GetShape(num_segments_id_)},
+                     num_threads, /* allow_fp32_relax_to_fp16 = */ false,
+                     /* apply_delegate = */ true);
   }
 
   int data() const { return data_id_; }
@@ -50,6 +54,10 @@ class UnsortedSegmentSumOpModel : public tflite::SingleOpModel {
   int num_segments() const { return num_segments_id_; }
 
   std::vector<float> GetOutput() { return ExtractVector<float>(output_id_); }
+  std::vector<float> GetDequantizedOutput() {
+    return Dequantize<int8_t>(ExtractVector<int8_t>(output_id_),
+                              GetScale(output_id_), GetZeroPoint(output_id_));
+  }
   std::vector<int32_t> GetOutputShape() { return GetTensorShape(output_id_); }
 
  protected:
@@ -132,6 +140,110 @@ TEST(UnsortedSegmentSumOpModelTest, With2DSegmentIdMatrix) {
   EXPECT_THAT(model.GetOutputShape(), ElementsAre(4));
 }
 
+TEST(UnsortedSegmentSumOpModelTest, SortedSegmentIds) {
+  UnsortedSegmentSumOpModel model(
+      /* data = */ {tflite::TensorType_FLOAT32, {5, 2}},
+      /* segment_ids = */ {tflite::TensorType_INT32, {5}},
+      /* num_segments = */ {tflite::TensorType_INT32, {}},
+      /* output = */ {tflite::TensorType_FLOAT32, {5, 2}});
+  model.PopulateTensor<float>(model.data(), {1.0f, 2.0f, 3.0f, 4.0f, 5.0f,
+                                             6.0f, 7.0f, 8.0f, 9.0f, 10.0f});
+  model.PopulateTensor<int32_t>(model.segment_ids(), {1, 1, 3, 3, 3});
+  model.PopulateTensor<int32_t>(model.num_segments(), {5});
+  ASSERT_EQ(model.Invoke(), kTfLiteOk);
+
+  // Segments 0, 2, and 4 do not appear in the segment IDs, and they remain at
+  // zero.
+  EXPECT_THAT(model.GetOutput(), ElementsAre(0.0f, 0.0f, 4.0f, 6.0f, 0.0f,
+                                             0.0f, 21.0f, 24.0f, 0.0f, 0.0f));
+  EXPECT_THAT(model.GetOutputShape(), ElementsAre(5, 2));
+}
+
+TEST(UnsortedSegmentSumOpModelTest, LargeMatrixWithMultipleThreads) {
+  // The input is large enough to be processed by multiple threads.
+  constexpr int kNumRows = 8192;
+  constexpr int kRowSize = 32;
+  constexpr int kNumSegments = 37;
+  UnsortedSegmentSumOpModel model(
+      /* data = */ {tflite::TensorType_FLOAT32, {kNumRows, kRowSize}},
+      /* segment_ids = */ {tflite::TensorType_INT32, {kNumRows}},
+      /* num_segments = */ {tflite::TensorType_INT32, {}},
+      /* output = */ {tflite::TensorType_FLOAT32, {kNumSegments, kRowSize}},
+      /* num_threads = */ 4);
+  std::vector<float> data(kNumRows * kRowSize);
+  std::vector<int32_t> segment_ids(kNumRows);
+  std::vector<float> expected_output(kNumSegments * kRowSize, 0.0f);
+  for (int row = 0; row < kNumRows; ++row) {
+    segment_ids[row] = (row * 7) % kNumSegments;
+    for (int i = 0; i < kRowSize; ++i) {
+      data[row * kRowSize + i] = static_cast<float>((row + i) % 5);
+      expected_output[segment_ids[row] * kRowSize + i] +=
+          data[row * kRowSize + i];
+    }
+  }
+  model.PopulateTensor<float>(model.data(), data);
+  model.PopulateTensor<int32_t>(model.segment_ids(), segment_ids);
+  model.PopulateTensor<int32_t>(model.num_segments(), {kNumSegments});
+  ASSERT_EQ(model.Invoke(), kTfLiteOk);
+
+  EXPECT_EQ(model.GetOutput(), expected_output);
+  EXPECT_THAT(model.GetOutputShape(), ElementsAre(kNumSegments, kRowSize));
+}
+
+TEST(UnsortedSegmentSumOpModelTest,
+     LargeMatrixWithSortedSegmentIdsAndMultipleThreads) {
+  constexpr int kNumRows = 8192;
+  constexpr int kRowSize = 32;
+  constexpr int kNumSegments = 1000;
+  UnsortedSegmentSumOpModel model(
+      /* data = */ {tflite::TensorType_FLOAT32, {kNumRows, kRowSize}},
+      /* segment_ids = */ {tflite::TensorType_INT32, {kNumRows}},
+      /* num_segments = */ {tflite::TensorType_INT32, {}},
+      /* output = */ {tflite::TensorType_FLOAT32, {kNumSegments, kRowSize}},
+      /* num_threads = */ 4);
+  std::vector<float> data(kNumRows * kRowSize);
+  std::vector<int32_t> segment_ids(kNumRows);
+  std::vector<float> expected_output(kNumSegments * kRowSize, 0.0f);
+  for (int row = 0; row < kNumRows; ++row) {
+    // Use only every other segment, with runs of varying lengths.
+    segment_ids[row] = 2 * ((row * 3 / 7) % (kNumSegments / 2));
+    if (row > 0 && segment_ids[row] < segment_ids[row - 1]) {
+      segment_ids[row] = segment_ids[row - 1];
+    }
+    for (int i = 0; i < kRowSize; ++i) {
+      data[row * kRowSize + i] = static_cast<float>((row + i) % 5);
+      expected_output[segment_ids[row] * kRowSize + i] +=
+          data[row * kRowSize + i];
+    }
+  }
+  model.PopulateTensor<float>(model.data(), data);
+  model.PopulateTensor<int32_t>(model.segment_ids(), segment_ids);
+  model.PopulateTensor<int32_t>(model.num_segments(), {kNumSegments});
+  ASSERT_EQ(model.Invoke(), kTfLiteOk);
+
+  EXPECT_EQ(model.GetOutput(), expected_output);
+  EXPECT_THAT(model.GetOutputShape(), ElementsAre(kNumSegments, kRowSize));
+}
+
+TEST(UnsortedSegmentSumOpModelTest, QuantizedInt8) {
+  UnsortedSegmentSumOpModel model(
+      /* data = */ {tflite::TensorType_INT8, {6}, -8.0f, 8.0f},
+      /* segment_ids = */ {tflite::TensorType_INT32, {6}},
+      /* num_segments = */ {tflite::TensorType_INT32, {}},
+      /* output = */ {tflite::TensorType_INT8, {4}, -32.0f, 32.0f});
+  model.QuantizeAndPopulate<int8_t>(model.data(),
+                                    {4.0f, 5.0f, 6.0f, -7.0f, 8.0f, 2.0f});
+  model.PopulateTensor<int32_t>(model.segment_ids(), {0, 1, 2, 0, 0, 2});
+  model.PopulateTensor<int32_t>(model.num_segments(), {4});
+  ASSERT_EQ(model.Invoke(), kTfLiteOk);
+
+  // The tolerance accounts for the quantization of the inputs and the output.
+  EXPECT_THAT(model.GetDequantizedOutput(),
+              ElementsAreArray(tflite::ArrayFloatNear(
+                  {5.0f, 5.0f, 8.0f, 0.0f}, /* max_abs_error = */ 0.5f)));
+  EXPECT_THAT(model.GetOutputShape(), ElementsAre(4));
+}
+
 TEST(UnsortedSegmentSumOpModelTest, NotMatchingShapes) {
   // The shape of the segment IDs tensor does not match the shape of the data
   // tensor (they have a different size in the first dimension).
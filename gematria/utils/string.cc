@@ -14,7 +14,9 @@
 
 #include "gematria/utils/string.h"
 
+#include <array>
 #include <cassert>
+#include <cstddef>
 #include <cstdint>
 #include <optional>
 #include <string>
@@ -24,19 +26,30 @@
 namespace gematria {
 namespace {
 
-constexpr int kInvalidHexDigit = 256;
+constexpr uint8_t kInvalidHexDigit = 0xff;
 
-int ParseHexDigit(char digit) {
-  if (digit >= '0' && digit <= '9') {
-    return digit - '0';
-  }
-  if (digit >= 'a' && digit <= 'f') {
-    return digit - 'a' + 10;
-  }
-  if (digit >= 'A' && digit <= 'F') {
-    return digit - 'A' + 10;
+// The value of each hex digit indexed by its character code, and
+// kInvalidHexDigit for all other characters. Valid digits have only the lower
+// four bits set, which lets ParseHexString() validate the input by OR-ing the
+// values of all digits and checking the upper bits once at the end.
+constexpr std::array<uint8_t, 256> kHexDigitValues = []() {
+  std::array<uint8_t, 256> values = {};
+  for (int c = 0; c < 256; ++c) {
+    if (c >= '0' && c <= '9') {
+      values[c] = c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+      values[c] = c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+      values[c] = c - 'A' + 10;
+    } else {
+      values[c] = kInvalidHexDigit;
+    }
   }
-  return kInvalidHexDigit;
+  return values;
+}();
+
+uint8_t HexDigitValue(char digit) {
+  return kHexDigitValues[static_cast<uint8_t>(digit)];
 }
 
 bool IsAsciiWhitespace(char c) {
@@ -47,25 +60,37 @@ bool IsAsciiWhitespace(char c) {
 
 std::optional<std::vector<uint8_t>> ParseHexString(
     std::string_view hex_string) {
-  if (hex_string.size() % 2 != 0) {
-    return std::nullopt;
-  }
   std::vector<uint8_t> res;
-  while (!hex_string.empty()) {
-    const int hex_value =
-        (ParseHexDigit(hex_string[0]) << 4) + ParseHexDigit(hex_string[1]);
-    if (hex_value >= 256) {
-      return std::nullopt;
-    }
-    res.push_back(hex_value);
-    hex_string.remove_prefix(2);
+  if (!ParseHexString(hex_string, res)) {
+    return std::nullopt;
   }
-
   return res;
 }
 
+bool ParseHexString(std::string_view hex_string, std::vector<uint8_t>& bytes) {
+  if (hex_string.size() % 2 != 0) {
+    return false;
+  }
+  bytes.resize(hex_string.size() / 2);
+  // The loop has no data-dependent branches, so that the compiler can unroll
+  // and vectorize it; invalid digits are detected after the loop.
+  uint8_t all_digits = 0;
+  for (size_t i = 0; i < bytes.size(); ++i) {
+    const uint8_t high = HexDigitValue(hex_string[2 * i]);
+    const uint8_t low = HexDigitValue(hex_string[2 * i + 1]);
+    all_digits |= high | low;
+    bytes[i] = static_cast<uint8_t>(high << 4) | low;
+  }
+  return (all_digits & 0xf0) == 0;
+}
+
 std::vector<std::string> StrSplitAsCopy(std::string_view text, char separator) {
-  std::vector<std::string> splits;
+  const std::vector<std::string_view> splits = StrSplit(text, separator);
+  return std::vector<std::string>(splits.begin(), splits.end());
+}
+
+std::vector<std::string_view> StrSplit(std::string_view text, char separator) {
+  std::vector<std::string_view> splits;
   std::string_view::size_type last_separator = 0;
   std::string_view::size_type next_separator = text.find(separator);
   while (next_separator != std::string_view::npos) {
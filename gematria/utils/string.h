@@ -34,6 +34,13 @@ namespace gematria {
 // that are not hex digits.
 std::optional<std::vector<uint8_t>> ParseHexString(std::string_view hex_string);
 
+// A version of ParseHexString() that writes the bytes to `bytes`, replacing its
+// previous contents. Reuses the memory allocated by `bytes`, so that a loop
+// that parses many hex strings allocates only when the buffer needs to grow.
+// Returns false when `hex_string` is not a valid hex string; the contents of
+// `bytes` are unspecified in that case.
+bool ParseHexString(std::string_view hex_string, std::vector<uint8_t>& bytes);
+
 // Formats `bytes` as a hex string that can be parsed with ParseHexString().
 inline std::string FormatAsHexString(std::string_view bytes) {
   std::stringstream out;
@@ -48,6 +55,10 @@ inline std::string FormatAsHexString(std::string_view bytes) {
 // independent of the input text.
 std::vector<std::string> StrSplitAsCopy(std::string_view text, char separator);
 
+// Splits `text` by `separator`. Unlike StrSplitAsCopy(), the returned splits
+// point to the data of `text`, which must outlive them.
+std::vector<std::string_view> StrSplit(std::string_view text, char separator);
+
 // Strips the leading and trailing whitespace from `text` and returns the
 // modified text.
 void StripAsciiWhitespace(std::string* text);
@@ -59,6 +59,36 @@ TEST(ParseHexStringTest, SomeInvalidHexStrings) {
   }
 }
 
+TEST(ParseHexStringTest, AllBytes) {
+  std::string hex_string;
+  std::vector<uint8_t> expected_bytes;
+  for (int byte = 0; byte < 256; ++byte) {
+    static constexpr char kDigits[] = "0123456789abcdef";
+    hex_string += kDigits[byte >> 4];
+    hex_string += kDigits[byte & 0xf];
+    expected_bytes.push_back(byte);
+  }
+  EXPECT_THAT(ParseHexString(hex_string),
+              Optional(ElementsAreArray(expected_bytes)));
+}
+
+TEST(ParseHexStringTest, NonAsciiCharacter) {
+  EXPECT_EQ(ParseHexString("0\xff"), std::nullopt);
+  EXPECT_EQ(ParseHexString("\x80" "0"), std::nullopt);
+}
+
+TEST(ParseHexStringTest, IntoBuffer) {
+  std::vector<uint8_t> bytes = {1, 2, 3, 4, 5};
+  EXPECT_TRUE(ParseHexString("abcd", bytes));
+  EXPECT_THAT(bytes, ElementsAre(0xab, 0xcd));
+  EXPECT_TRUE(ParseHexString("", bytes));
+  EXPECT_THAT(bytes, ElementsAre());
+  EXPECT_TRUE(ParseHexString("0123456789", bytes));
+  EXPECT_THAT(bytes, ElementsAre(0x01, 0x23, 0x45, 0x67, 0x89));
+  EXPECT_FALSE(ParseHexString("012", bytes));
+  EXPECT_FALSE(ParseHexString("01234g", bytes));
+}
+
 TEST(FormatAsHexStringTest, EmptySpan) { EXPECT_EQ(FormatAsHexString(""), ""); }
 
 TEST(FormatAsHexStringTest, NonEmptySpan) {
@@ -85,6 +115,21 @@ TEST(StrSplitAsCopyTest, SeparatorAtEnd) {
   EXPECT_THAT(StrSplitAsCopy("foo;bar;", ';'), ElementsAre("foo", "bar", ""));
 }
 
+TEST(StrSplitTest, Separators) {
+  EXPECT_THAT(StrSplit("", ';'), ElementsAre(""));
+  EXPECT_THAT(StrSplit("foobar", ';'), ElementsAre("foobar"));
+  EXPECT_THAT(StrSplit(";foo;;bar;", ';'),
+              ElementsAre("", "foo", "", "bar", ""));
+}
+
+TEST(StrSplitTest, PointsToInput) {
+  constexpr std::string_view kText = "foo;bar";
+  const std::vector<std::string_view> splits = StrSplit(kText, ';');
+  ASSERT_THAT(splits, ElementsAre("foo", "bar"));
+  EXPECT_EQ(splits[0].data(), kText.data());
+  EXPECT_EQ(splits[1].data(), kText.data() + 4);
+}
+
 TEST(StripAsciiWhitespaceTest, EmptyText) {
   std::string text;
   StripAsciiWhitespace(&text);
@@ -0,0 +1,271 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "gematria/utils/tracing.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace gematria {
+namespace tracing_internal {
+
+std::atomic<int> tracing_mode = static_cast<int>(TracingMode::kDisabled);
+std::atomic<int64_t> counters[kNumTraceCounters] = {};
+
+}  // namespace tracing_internal
+
+namespace {
+
+// The maximal number of events recorded by a single thread; the events after
+// that are dropped (but still counted in the scope stats), so that a long run
+// with tracing enabled does not use unbounded memory.
+constexpr size_t kMaxEventsPerThread = 1 << 20;
+
+struct ScopeStats {
+  int64_t count = 0;
+  std::chrono::nanoseconds total_time{0};
+};
+
+struct TraceEvent {
+  const char* name;
+  std::chrono::steady_clock::time_point start;
+  std::chrono::nanoseconds duration;
+};
+
+// The data recorded by one thread. Each thread has its own buffer, so that the
+// threads do not contend on a lock; the mutex is taken only by the owning
+// thread and by the export functions.
+struct ThreadBuffer {
+  explicit ThreadBuffer(int thread_id) : thread_id(thread_id) {}
+
+  const int thread_id;
+  std::mutex mutex;
+  std::unordered_map<const char*, ScopeStats> scopes;
+  std::vector<TraceEvent> events;
+  int64_t num_dropped_events = 0;
+};
+
+// Keeps the buffers of all threads, including the threads that already
+// finished.
+struct TraceRegistry {
+  const std::chrono::steady_clock::time_point epoch =
+      std::chrono::steady_clock::now();
+  std::mutex mutex;
+  std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+};
+
+TraceRegistry& GetRegistry() {
+  static TraceRegistry* const registry = new TraceRegistry();
+  return *registry;
+}
+
+ThreadBuffer& GetThreadBuffer() {
+  thread_local const std::shared_ptr<ThreadBuffer> buffer = []() {
+    TraceRegistry& registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    auto new_buffer = std::make_shared<ThreadBuffer>(
+        static_cast<int>(registry.buffers.size()) + 1);
+    registry.buffers.push_back(new_buffer);
+    return new_buffer;
+  }();
+  return *buffer;
+}
+
+// Returns the stats of all scopes merged across threads, keyed by the name of
+// the scope. Also returns the total number of dropped events.
+std::map<std::string, ScopeStats> MergeScopeStats(int64_t& num_dropped_events) {
+  std::map<std::string, ScopeStats> merged;
+  num_dropped_events = 0;
+  TraceRegistry& registry = GetRegistry();
+  std::lock_guard<std::mutex> registry_lock(registry.mutex);
+  for (const auto& buffer : registry.buffers) {
+    std::lock_guard<std::mutex> lock(buffer->mutex);
+    for (const auto& [name, stats] : buffer->scopes) {
+      ScopeStats& merged_stats = merged[name];
+      merged_stats.count += stats.count;
+      merged_stats.total_time += stats.total_time;
+    }
+    num_dropped_events += buffer->num_dropped_events;
+  }
+  return merged;
+}
+
+// Appends `text` to `json` as a JSON string literal.
+void AppendJsonString(std::string_view text, std::string& json) {
+  json += '"';
+  for (const char c : text) {
+    if (c == '"' || c == '\\') json += '\\';
+    json += c;
+  }
+  json += '"';
+}
+
+double ToMicroseconds(std::chrono::nanoseconds duration) {
+  return std::chrono::duration<double, std::micro>(duration).count();
+}
+
+}  // namespace
+
+namespace tracing_internal {
+
+void RecordScope(const char* name, std::chrono::steady_clock::time_point start,
+                 std::chrono::steady_clock::time_point end) {
+  const std::chrono::nanoseconds duration = end - start;
+  ThreadBuffer& buffer = GetThreadBuffer();
+  std::lock_guard<std::mutex> lock(buffer.mutex);
+  ScopeStats& stats = buffer.scopes[name];
+  ++stats.count;
+  stats.total_time += duration;
+  if (tracing_mode.load(std::memory_order_relaxed) ==
+      static_cast<int>(TracingMode::kEvents)) {
+    if (buffer.events.size() < kMaxEventsPerThread) {
+      buffer.events.push_back({name, start, duration});
+    } else {
+      ++buffer.num_dropped_events;
+    }
+  }
+}
+
+}  // namespace tracing_internal
+
+std::string_view TraceCounterName(TraceCounter counter) {
+  switch (counter) {
+    case TraceCounter::kBlocks:
+      return "blocks";
+    case TraceCounter::kNodes:
+      return "nodes";
+    case TraceCounter::kEdges:
+      return "edges";
+    case TraceCounter::kOovReplacements:
+      return "oov_replacements";
+    case TraceCounter::kInterpreterResizes:
+      return "interpreter_resizes";
+    case TraceCounter::kCacheHits:
+      return "cache_hits";
+    case TraceCounter::kCacheMisses:
+      return "cache_misses";
+  }
+  return "unknown";
+}
+
+void SetTracingMode(TracingMode mode) {
+  // Create the registry before the first event, so that the timestamps of the
+  // events are relative to the moment the tracing was enabled.
+  GetRegistry();
+  tracing_internal::tracing_mode.store(static_cast<int>(mode),
+                                       std::memory_order_relaxed);
+}
+
+void ResetTracing() {
+  for (std::atomic<int64_t>& counter : tracing_internal::counters) {
+    counter.store(0, std::memory_order_relaxed);
+  }
+  TraceRegistry& registry = GetRegistry();
+  std::lock_guard<std::mutex> registry_lock(registry.mutex);
+  for (const auto& buffer : registry.buffers) {
+    std::lock_guard<std::mutex> lock(buffer->mutex);
+    buffer->scopes.clear();
+    buffer->events.clear();
+    buffer->num_dropped_events = 0;
+  }
+}
+
+int64_t GetTraceCounter(TraceCounter counter) {
+  return tracing_internal::counters[static_cast<int>(counter)].load(
+      std::memory_order_relaxed);
+}
+
+std::string FormatTracingStats() {
+  std::string stats;
+  char line[256];
+  for (int i = 0; i < kNumTraceCounters; ++i) {
+    const auto counter = static_cast<TraceCounter>(i);
+    std::snprintf(line, sizeof(line), "counter %s: %" PRId64 "\n",
+                  std::string(TraceCounterName(counter)).c_str(),
+                  GetTraceCounter(counter));
+    stats += line;
+  }
+  int64_t num_dropped_events = 0;
+  for (const auto& [name, scope_stats] : MergeScopeStats(num_dropped_events)) {
+    const double total_us = ToMicroseconds(scope_stats.total_time);
+    std::snprintf(line, sizeof(line),
+                  "scope %s: %" PRId64 " calls, %.3f ms total, %.3f us mean\n",
+                  name.c_str(), scope_stats.count, total_us / 1000.0,
+                  total_us / std::max<int64_t>(scope_stats.count, 1));
+    stats += line;
+  }
+  if (num_dropped_events > 0) {
+    std::snprintf(line, sizeof(line), "dropped events: %" PRId64 "\n",
+                  num_dropped_events);
+    stats += line;
+  }
+  return stats;
+}
+
+std::string FormatChromeTraceJson() {
+  TraceRegistry& registry = GetRegistry();
+  const auto now = std::chrono::steady_clock::now();
+  std::string json = R"({"displayTimeUnit":"ns","traceEvents":[)";
+  bool first_event = true;
+  char buffer[128];
+  const auto start_event = [&]() {
+    if (!first_event) json += ',';
+    first_event = false;
+  };
+  {
+    std::lock_guard<std::mutex> registry_lock(registry.mutex);
+    for (const auto& thread_buffer : registry.buffers) {
+      std::lock_guard<std::mutex> lock(thread_buffer->mutex);
+      for (const TraceEvent& event : thread_buffer->events) {
+        start_event();
+        json += R"({"name":)";
+        AppendJsonString(event.name, json);
+        std::snprintf(buffer, sizeof(buffer),
+                      R"(,"ph":"X","pid":1,"tid":%d,"ts":%.3f,"dur":%.3f})",
+                      thread_buffer->thread_id,
+                      ToMicroseconds(event.start - registry.epoch),
+                      ToMicroseconds(event.duration));
+        json += buffer;
+      }
+    }
+  }
+  const double now_us = ToMicroseconds(now - registry.epoch);
+  for (int i = 0; i < kNumTraceCounters; ++i) {
+    const auto counter = static_cast<TraceCounter>(i);
+    start_event();
+    json += R"({"name":)";
+    AppendJsonString(TraceCounterName(counter), json);
+    std::snprintf(buffer, sizeof(buffer),
+                  R"(,"ph":"C","pid":1,"ts":%.3f,"args":{"value":%)" PRId64
+                  "}}",
+                  now_us, GetTraceCounter(counter));
+    json += buffer;
+  }
+  json += "]}";
+  return json;
+}
+
+}  // namespace gematria
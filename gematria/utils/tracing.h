@@ -0,0 +1,167 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Contains a lightweight instrumentation layer for the hot paths of the
+// inference stack: scoped timers and global counters. Tracing is off by default
+// and costs a single relaxed atomic load per instrumentation point; tools turn
+// it on with SetTracingMode(). Building with -DGEMATRIA_DISABLE_TRACING (or
+// `--define gematria_tracing=0` in Bazel) removes the instrumentation points
+// completely.
+//
+// The collected data can be exported as a plain-text summary or in the Chrome
+// trace event JSON format, which can be loaded in Perfetto or in
+// chrome://tracing.
+//
+// Typical usage:
+//   void BuildGraph() {
+//     GEMATRIA_TRACE_SCOPE("BuildGraph");
+//     ...
+//     GEMATRIA_TRACE_COUNTER(kNodes, num_new_nodes);
+//   }
+
+#ifndef THIRD_PARTY_GEMATRIA_GEMATRIA_UTILS_TRACING_H_
+#define THIRD_PARTY_GEMATRIA_GEMATRIA_UTILS_TRACING_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace gematria {
+
+// The counters collected by the instrumentation.
+enum class TraceCounter {
+  // The number of basic block graphs built by the graph builder.
+  kBlocks,
+  // The number of nodes in the graphs built by the graph builder.
+  kNodes,
+  // The number of edges in the graphs built by the graph builder.
+  kEdges,
+  // The number of tokens replaced by the out-of-vocabulary token.
+  kOovReplacements,
+  // The number of batches for which the TFLite interpreter had to resize its
+  // input tensors and reallocate the tensor arena.
+  kInterpreterResizes,
+  // The number of basic blocks found in a cache (the prediction cache or the
+  // graphs already in the batch).
+  kCacheHits,
+  // The number of basic blocks that were not found in the prediction cache.
+  kCacheMisses,
+};
+
+inline constexpr int kNumTraceCounters = 7;
+
+// Returns the name of `counter` used in the exported data.
+std::string_view TraceCounterName(TraceCounter counter);
+
+enum class TracingMode {
+  // No data is collected.
+  kDisabled,
+  // Collects the counters, and the number of calls and the total time of each
+  // scope.
+  kStats,
+  // Like kStats, but also records each scope as a separate event for the
+  // Chrome trace export.
+  kEvents,
+};
+
+// Sets the tracing mode for all threads. Data collected before the call is
+// kept.
+void SetTracingMode(TracingMode mode);
+
+// Discards all data collected so far.
+void ResetTracing();
+
+namespace tracing_internal {
+
+extern std::atomic<int> tracing_mode;
+extern std::atomic<int64_t> counters[kNumTraceCounters];
+
+void RecordScope(const char* name, std::chrono::steady_clock::time_point start,
+                 std::chrono::steady_clock::time_point end);
+
+}  // namespace tracing_internal
+
+// Returns true when tracing is enabled in any mode.
+inline bool IsTracingEnabled() {
+  return tracing_internal::tracing_mode.load(std::memory_order_relaxed) !=
+         static_cast<int>(TracingMode::kDisabled);
+}
+
+// Adds `value` to `counter` when tracing is enabled.
+inline void AddTraceCounter(TraceCounter counter, int64_t value = 1) {
+  if (!IsTracingEnabled()) return;
+  tracing_internal::counters[static_cast<int>(counter)].fetch_add(
+      value, std::memory_order_relaxed);
+}
+
+// Returns the current value of `counter`.
+int64_t GetTraceCounter(TraceCounter counter);
+
+// Records the time between its creation and its destruction under `name`. The
+// name must be a string literal or otherwise outlive the collected data.
+class ScopedTraceEvent {
+ public:
+  explicit ScopedTraceEvent(const char* name)
+      : name_(IsTracingEnabled() ? name : nullptr) {
+    if (name_ != nullptr) start_ = std::chrono::steady_clock::now();
+  }
+  ScopedTraceEvent(const ScopedTraceEvent&) = delete;
+  ScopedTraceEvent& operator=(const ScopedTraceEvent&) = delete;
+  ~ScopedTraceEvent() {
+    if (name_ != nullptr) {
+      tracing_internal::RecordScope(name_, start_,
+                                    std::chrono::steady_clock::now());
+    }
+  }
+
+ private:
+  const char* const name_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+// Returns a human-readable summary of the collected data: one line per counter
+// and one line per scope with the number of calls and the total and mean time.
+std::string FormatTracingStats();
+
+// Returns the collected data in the Chrome trace event JSON format. Each scope
+// recorded in the kEvents mode is a complete ("X") event on the thread that
+// recorded it, and the final values of the counters are counter ("C") events.
+std::string FormatChromeTraceJson();
+
+}  // namespace gematria
+
+#define GEMATRIA_TRACE_CONCAT_INTERNAL(a, b) a##b
+#define GEMATRIA_TRACE_CONCAT(a, b) GEMATRIA_TRACE_CONCAT_INTERNAL(a, b)
+
+#ifdef GEMATRIA_DISABLE_TRACING
+#define GEMATRIA_TRACE_SCOPE(name) \
+  do {                             \
+  } while (false)
+#define GEMATRIA_TRACE_COUNTER(counter, value) \
+  do {                                         \
+  } while (false)
+#else
+// Records the time until the end of the enclosing scope under `name`.
+#define GEMATRIA_TRACE_SCOPE(name)                                   \
+  ::gematria::ScopedTraceEvent GEMATRIA_TRACE_CONCAT(gematria_trace_scope_, \
+                                                     __LINE__)(name)
+// Adds `value` to the counter ::gematria::TraceCounter::`counter`.
+#define GEMATRIA_TRACE_COUNTER(counter, value) \
+  ::gematria::AddTraceCounter(::gematria::TraceCounter::counter, (value))
+#endif  // GEMATRIA_DISABLE_TRACING
+
+#endif  // THIRD_PARTY_GEMATRIA_GEMATRIA_UTILS_TRACING_H_
@@ -0,0 +1,89 @@
+// Copyright 2023 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "gematria/utils/tracing.h"
+
+#include <string>
+#include <thread>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+namespace gematria {
+namespace {
+
+using ::testing::HasSubstr;
+using ::testing::Not;
+
+class TracingTest : public ::testing::Test {
+ protected:
+  void SetUp() override { ResetTracing(); }
+  void TearDown() override {
+    SetTracingMode(TracingMode::kDisabled);
+    ResetTracing();
+  }
+};
+
+TEST_F(TracingTest, DisabledByDefault) {
+  {
+    GEMATRIA_TRACE_SCOPE("DisabledScope");
+    GEMATRIA_TRACE_COUNTER(kBlocks, 1);
+  }
+  EXPECT_EQ(GetTraceCounter(TraceCounter::kBlocks), 0);
+  EXPECT_THAT(FormatTracingStats(), Not(HasSubstr("DisabledScope")));
+}
+
+TEST_F(TracingTest, Counters) {
+  SetTracingMode(TracingMode::kStats);
+  GEMATRIA_TRACE_COUNTER(kNodes, 10);
+  GEMATRIA_TRACE_COUNTER(kNodes, 5);
+  AddTraceCounter(TraceCounter::kCacheHits);
+  EXPECT_EQ(GetTraceCounter(TraceCounter::kNodes), 15);
+  EXPECT_EQ(GetTraceCounter(TraceCounter::kCacheHits), 1);
+  const std::string stats = FormatTracingStats();
+  EXPECT_THAT(stats, HasSubstr("counter nodes: 15\n"));
+  EXPECT_THAT(stats, HasSubstr("counter cache_hits: 1\n"));
+  EXPECT_THAT(stats, HasSubstr("counter edges: 0\n"));
+
+  ResetTracing();
+  EXPECT_EQ(GetTraceCounter(TraceCounter::kNodes), 0);
+}
+
+TEST_F(TracingTest, ScopeStats) {
+  SetTracingMode(TracingMode::kStats);
+  for (int i = 0; i < 3; ++i) {
+    GEMATRIA_TRACE_SCOPE("Loop");
+  }
+  std::thread thread([]() { GEMATRIA_TRACE_SCOPE("Loop"); });
+  thread.join();
+  const std::string stats = FormatTracingStats();
+  EXPECT_THAT(stats, HasSubstr("scope Loop: 4 calls"));
+  // Events are not recorded in the kStats mode.
+  EXPECT_THAT(FormatChromeTraceJson(), Not(HasSubstr(R"("ph":"X")")));
+}
+
+TEST_F(TracingTest, ChromeTraceJson) {
+  SetTracingMode(TracingMode::kEvents);
+  { GEMATRIA_TRACE_SCOPE("Outer"); }
+  GEMATRIA_TRACE_COUNTER(kInterpreterResizes, 2);
+  const std::string json = FormatChromeTraceJson();
+  EXPECT_THAT(json, HasSubstr(R"({"displayTimeUnit":"ns","traceEvents":[)"));
+  EXPECT_THAT(json, HasSubstr(R"({"name":"Outer","ph":"X","pid":1,)"));
+  EXPECT_THAT(json, HasSubstr(R"({"name":"interpreter_resizes","ph":"C",)"));
+  EXPECT_THAT(json, HasSubstr(R"("args":{"value":2}})"));
+}
+
+}  // namespace
+}  // namespace gematria
@@ -4,6 +4,9 @@
 # RUN: llvm-mc -o %t.o --filetype=obj -triple=x86_64-unknown-linux-gnu %t/bb-frequency-test.s
 # RUN: llvm-cm %t.o --csv=%t/bb-frequency.csv -granite_model=%S/Inputs/gb-token-mit-2022_12_02.tflite -evaluator=granite| FileCheck %t/bb-frequency-test.s
 # RUN: llvm-cm %t.o --csv=%t/bb-frequency.csv -granite_model=%S/Inputs/gb-token-mit-2022_12_02.tflite -evaluator=count| FileCheck %t/bb-frequency-test.s --check-prefix=CHECK-COUNT
+## Check the JSON lines output, written to a file.
+# RUN: llvm-cm %t.o --csv=%t/bb-frequency.csv -evaluator=count -output_format=jsonl -o %t.jsonl
+# RUN: FileCheck %t/bb-frequency-test.s --check-prefix=CHECK-JSON < %t.jsonl
 
 //--- bb-frequency.csv
 main,0,1.000000e+00
@@ -18,6 +21,13 @@ main,3,3.809524e-01
 # CHECK-COUNT: <main>:
 # CHECK-COUNT: Calculated Frequency: 6.000000e+00
 
+# CHECK-JSON:      {"names":["main"],"address":0,"hash":"{{[0-9a-f]+}}",
+# CHECK-JSON-SAME: "config":{"evaluator":"count","mcpu":"skylake","triple":"{{[^"]+}}"},
+# CHECK-JSON-SAME: "num_blocks":3,"latency":{{[0-9.e+-]+}},"blocks":[
+# CHECK-JSON-SAME: {"id":0,"frequency":1,"prediction":4},
+# CHECK-JSON-SAME: {"id":2,"frequency":{{[0-9.e+-]+}},"prediction":2},
+# CHECK-JSON-SAME: {"id":3,"frequency":{{[0-9.e+-]+}},"prediction":2}]}
+
  .text
  .file "bb-frequency.ll"
  .globl main                            # -- Begin function main
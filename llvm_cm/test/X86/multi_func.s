@@ -2,6 +2,41 @@
 # RUN: llvm-mc -o %t.o --filetype=obj -triple=x86_64-unknown-linux-gnu %s
 # RUN: llvm-cm %t.o -csv=%S/Inputs/multi-func.csv -granite_model=%S/Inputs/gb-token-mit-2022_12_02.tflite -evaluator=granite | FileCheck %s
 # RUN: llvm-cm %t.o -csv=%S/Inputs/multi-func.csv -granite_model=%S/Inputs/gb-token-mit-2022_12_02.tflite -evaluator=count | FileCheck %s --check-prefix=CHECK-COUNT
+## Check that evaluating the functions on multiple threads does not change the
+## output or its order.
+# RUN: llvm-cm %t.o -csv=%S/Inputs/multi-func.csv -granite_model=%S/Inputs/gb-token-mit-2022_12_02.tflite -evaluator=granite -j 4 | FileCheck %s
+# RUN: llvm-cm %t.o -csv=%S/Inputs/multi-func.csv -granite_model=%S/Inputs/gb-token-mit-2022_12_02.tflite -evaluator=count -j 4 | FileCheck %s --check-prefix=CHECK-COUNT
+## Check that evaluating all functions of the binary in shared GRANITE batches
+## gives the same per-function latencies as evaluating them one by one, with
+## and without pipelining the batches.
+# RUN: llvm-cm %t.o -csv=%S/Inputs/multi-func.csv -granite_model=%S/Inputs/gb-token-mit-2022_12_02.tflite -evaluator=granite -granite_whole_binary | FileCheck %s
+# RUN: llvm-cm %t.o -csv=%S/Inputs/multi-func.csv -granite_model=%S/Inputs/gb-token-mit-2022_12_02.tflite -evaluator=granite -granite_whole_binary -granite_pipeline_depth=1 -granite_max_blocks_per_batch=3 | FileCheck %s
+## Check that parsing the CSV file on multiple threads does not change the
+## frequencies.
+# RUN: llvm-cm %t.o -csv=%S/Inputs/multi-func.csv -evaluator=count -j 4 -csv_min_bytes_per_thread=64 | FileCheck %s --check-prefix=CHECK-COUNT
+## Check that only the selected functions are evaluated.
+# RUN: llvm-cm %t.o -csv=%S/Inputs/multi-func.csv -evaluator=count -function=main,isMatch -function_regex='^bubble' | FileCheck %s --check-prefix=CHECK-SELECT
+## Check that the results from --previous_results are reused for unchanged
+## functions evaluated with the same configuration, and that the functions are
+## evaluated again when the evaluator, the model or the task number differ. The
+## latencies in the stale files are replaced, so that reused results can be
+## told apart from new evaluations.
+# RUN: llvm-cm %t.o -csv=%S/Inputs/multi-func.csv -evaluator=count -output_format=jsonl -o %t.jsonl
+# RUN: llvm-cm %t.o -csv=%S/Inputs/multi-func.csv -evaluator=count -output_format=jsonl -previous_results=%t.jsonl -o %t.2.jsonl
+# RUN: diff %t.jsonl %t.2.jsonl
+# RUN: sed -e 's/"latency":[^,]*/"latency":42/' %t.jsonl > %t.stale-count.jsonl
+# RUN: llvm-cm %t.o -csv=%S/Inputs/multi-func.csv -evaluator=count -previous_results=%t.stale-count.jsonl | FileCheck %s --check-prefix=CHECK-REUSED
+# RUN: llvm-cm %t.o -csv=%S/Inputs/multi-func.csv -granite_model=%S/Inputs/gb-token-mit-2022_12_02.tflite -evaluator=granite -previous_results=%t.stale-count.jsonl | FileCheck %s
+# RUN: sed -e 's/"mcpu":"skylake"/"mcpu":"haswell"/' %t.stale-count.jsonl > %t.stale-mcpu.jsonl
+# RUN: llvm-cm %t.o -csv=%S/Inputs/multi-func.csv -evaluator=count -previous_results=%t.stale-mcpu.jsonl | FileCheck %s --check-prefix=CHECK-COUNT
+# RUN: llvm-cm %t.o -csv=%S/Inputs/multi-func.csv -granite_model=%S/Inputs/gb-token-mit-2022_12_02.tflite -evaluator=granite -output_format=jsonl -o %t.granite.jsonl
+# RUN: FileCheck %s --check-prefix=CHECK-CONFIG < %t.granite.jsonl
+# RUN: sed -e 's/"latency":[^,]*/"latency":42/' %t.granite.jsonl > %t.stale-granite.jsonl
+# RUN: llvm-cm %t.o -csv=%S/Inputs/multi-func.csv -granite_model=%S/Inputs/gb-token-mit-2022_12_02.tflite -evaluator=granite -previous_results=%t.stale-granite.jsonl | FileCheck %s --check-prefix=CHECK-REUSED
+# RUN: sed -e 's/"task_number":2/"task_number":1/' %t.stale-granite.jsonl > %t.stale-task.jsonl
+# RUN: llvm-cm %t.o -csv=%S/Inputs/multi-func.csv -granite_model=%S/Inputs/gb-token-mit-2022_12_02.tflite -evaluator=granite -previous_results=%t.stale-task.jsonl | FileCheck %s
+# RUN: sed -e 's/"model_md5":"[0-9a-f]*"/"model_md5":"0"/' %t.stale-granite.jsonl > %t.stale-model.jsonl
+# RUN: llvm-cm %t.o -csv=%S/Inputs/multi-func.csv -granite_model=%S/Inputs/gb-token-mit-2022_12_02.tflite -evaluator=granite -previous_results=%t.stale-model.jsonl | FileCheck %s
 
 
 # CHECK:      <reverse>:
@@ -31,6 +66,18 @@
 # CHECK-COUNT: <main>:
 # CHECK-COUNT: Calculated Frequency: 2.346250e+02
 
+# CHECK-REUSED-COUNT-6: Calculated Frequency: 4.200000e+01
+
+# CHECK-CONFIG: {"names":["reverse"],{{.*}}"config":{"evaluator":"granite","mcpu":"skylake","model_md5":"{{[0-9a-f]+}}","task_number":2,"triple":"{{.*}}"},
+
+# CHECK-SELECT-NOT: <reverse>:
+# CHECK-SELECT:      <isMatch>:
+# CHECK-SELECT-NEXT: Calculated Frequency: 2.274074e+01
+# CHECK-SELECT-NEXT: <bubbleSort>:
+# CHECK-SELECT-NEXT: Calculated Frequency: 2.007125e+03
+# CHECK-SELECT-NEXT: <main>:
+# CHECK-SELECT-NEXT: Calculated Frequency: 2.346250e+02
+
  .text
  .file "test.c"
  .globl reverse                         # -- Begin function reverse
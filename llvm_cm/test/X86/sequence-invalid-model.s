@@ -0,0 +1,8 @@
+## Check that the sequence evaluator rejects a model that is not a sequence
+## model, e.g. a GRANITE model.
+# RUN: llvm-mc -o %t.o --filetype=obj -triple=x86_64-unknown-linux-gnu %s
+# RUN: not llvm-cm %t.o -csv=%p/Inputs/dummy.csv -evaluator=sequence -granite_model=%S/Inputs/gb-token-mit-2022_12_02.tflite 2>&1 | FileCheck %s
+
+# CHECK: Unexpected number of input tensors. Expected 3 to 4, found 9.
+
+main:
@@ -14,23 +14,30 @@
 #include <stdlib.h>
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cinttypes>
 #include <cstddef>
 #include <cstdint>
 #include <cstdlib>
+#include <iterator>
 #include <limits>
 #include <memory>
+#include <optional>
 #include <string>
-#include <unordered_map>
+#include <thread>
+#include <tuple>
 #include <utility>
 #include <vector>
 
 #include "gematria/basic_block/basic_block.h"
 #include "gematria/granite/graph_builder_model_inference.h"
+#include "gematria/granite/pipelined_graph_builder_model_inference.h"
 #include "gematria/llvm/canonicalizer.h"
+#include "gematria/sequence/sequence_model_inference.h"
 #include "llvm/ADT/ArrayRef.h"
 #include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
 #include "llvm/ADT/MapVector.h"
 #include "llvm/ADT/STLExtras.h"
 #include "llvm/ADT/SmallString.h"
@@ -38,6 +45,7 @@
 #include "llvm/ADT/StringExtras.h"
 #include "llvm/ADT/StringMap.h"
 #include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/StringSet.h"
 #include "llvm/ADT/Twine.h"
 #include "llvm/BinaryFormat/ELF.h"
 #include "llvm/Config/llvm-config.h"
@@ -67,12 +75,18 @@
 #include "llvm/Support/Error.h"
 #include "llvm/Support/ErrorHandling.h"
 #include "llvm/Support/ErrorOr.h"
+#include "llvm/Support/FileSystem.h"
 #include "llvm/Support/Format.h"
+#include "llvm/Support/FormatVariadic.h"
 #include "llvm/Support/InitLLVM.h"
-#include "llvm/Support/LineIterator.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MD5.h"
 #include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Regex.h"
 #include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/ToolOutputFile.h"
 #include "llvm/Support/WithColor.h"
+#include "llvm/Support/xxhash.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Target/TargetMachine.h"
 #include "tensorflow/lite/model_builder.h"
@@ -95,22 +109,28 @@ static cl::opt<std::string> CPU("mcpu", cl::desc("Target a specific cpu type."),
                                 cl::init("skylake"),
                                 cl::value_desc("cpu-name"));
 
-enum class EvaluationType : int { Counter, Granite };
+enum class EvaluationType : int { Counter, Granite, Sequence };
 static cl::opt<EvaluationType> EvaluationMethod(
     "evaluator", cl::desc("Choose llvm-cm latency output method: "),
     cl::init(EvaluationType::Counter),
     cl::values(clEnumValN(EvaluationType::Counter, "count",
                           "use weighted instruction counting"),
                clEnumValN(EvaluationType::Granite, "granite",
-                          "use GRANITE  model values")));
+                          "use GRANITE  model values"),
+               clEnumValN(EvaluationType::Sequence, "sequence",
+                          "use sequence (e.g. hierarchical LSTM) model "
+                          "values")));
 
 static cl::opt<std::string> EvaluatorFilename(
-    "granite_model", cl::desc("GRANITE tflite model file or any other model."),
+    "granite_model",
+    cl::desc("GRANITE or sequence tflite model file, depending on "
+             "--evaluator."),
     cl::value_desc("filename"));
 
 static cl::opt<uint64_t> uArchTaskNumber(
     "task_number", cl::init(2),
-    cl::desc("Specify uarch-specific task number if using GRANITE model"));
+    cl::desc("Specify uarch-specific task number if using GRANITE or sequence "
+             "model"));
 
 static cl::opt<std::string> CSVFilename(
     "csv",
@@ -118,6 +138,93 @@ static cl::opt<std::string> CSVFilename(
              "profile information as a csv file."),
     cl::value_desc("filename"), cl::Required);
 
+static cl::opt<bool> GraniteWholeBinary(
+    "granite_whole_binary", cl::init(false),
+    cl::desc("Collect the basic blocks of all functions in the binary first, "
+             "and evaluate them using the GRANITE model in large batches "
+             "shared by multiple functions. The output is the same as in the "
+             "default mode, but it is printed after all functions are "
+             "processed."));
+
+static cl::opt<int> GraniteMaxBlocksPerBatch(
+    "granite_max_blocks_per_batch", cl::init(0),
+    cl::desc("In the --granite_whole_binary mode, the maximal number of basic "
+             "blocks in a batch. When not positive, the number of blocks is "
+             "not limited."));
+
+static cl::opt<int> GraniteMaxNodesPerBatch(
+    "granite_max_nodes_per_batch", cl::init(100000),
+    cl::desc("In the --granite_whole_binary mode, a batch is evaluated as soon "
+             "as the graphs of its basic blocks have at least this many "
+             "nodes. When not positive, the number of nodes is not "
+             "limited."));
+
+static cl::opt<int> GranitePipelineDepth(
+    "granite_pipeline_depth", cl::init(2),
+    cl::desc("In the --granite_whole_binary mode, the number of batches that "
+             "can be in the inference pipeline at the same time. The graphs "
+             "of the next batch are built while the model runs on the "
+             "previous ones. With 1, the graphs of a batch are built only "
+             "after the inference for the previous batch finishes."));
+
+static cl::opt<unsigned> NumThreads(
+    "j", cl::init(1),
+    cl::desc("The number of threads used to disassemble and evaluate "
+             "functions. Each thread has its own disassembler and cost model. "
+             "The output is printed in the order of the symbols regardless of "
+             "the number of threads. When zero, uses one thread per hardware "
+             "thread."));
+
+enum class OutputFormatType : int { Text, JsonLines };
+static cl::opt<OutputFormatType> OutputFormat(
+    "output_format", cl::desc("Choose the format of the llvm-cm output: "),
+    cl::init(OutputFormatType::Text),
+    cl::values(clEnumValN(OutputFormatType::Text, "text",
+                          "print the names and the latency of each function"),
+               clEnumValN(OutputFormatType::JsonLines, "jsonl",
+                          "print one JSON object per line for each function, "
+                          "with its names, address, latency and the "
+                          "predictions for its basic blocks")));
+
+static cl::opt<std::string> OutputFilename("o", cl::init("-"),
+                                           cl::desc("Output file name."),
+                                           cl::value_desc("filename"));
+
+static cl::list<std::string> SelectedFunctionNames(
+    "function", cl::CommaSeparated,
+    cl::desc("Evaluate only the functions with these names. When any of "
+             "--function, --function_regex or --function_address is used, "
+             "only the functions that match at least one of them are "
+             "evaluated."),
+    cl::value_desc("name"));
+
+static cl::opt<std::string> SelectedFunctionRegex(
+    "function_regex",
+    cl::desc("Evaluate only the functions whose names match this regular "
+             "expression. See --function."),
+    cl::value_desc("regex"));
+
+static cl::list<uint64_t> SelectedFunctionAddresses(
+    "function_address", cl::CommaSeparated,
+    cl::desc("Evaluate only the functions that start at these addresses. See "
+             "--function."),
+    cl::value_desc("address"));
+
+static cl::opt<std::string> PreviousResultsFilename(
+    "previous_results",
+    cl::desc("The output of a previous run in the jsonl format. Functions "
+             "whose machine code, basic block labels and frequencies did not "
+             "change since that run are not evaluated again; their results "
+             "are copied from the file. Only the results of a run with the "
+             "same evaluator, model, task number, triple and CPU are reused; "
+             "the other functions are evaluated again."),
+    cl::value_desc("filename"));
+
+static cl::opt<unsigned> CSVMinBytesPerThread(
+    "csv_min_bytes_per_thread", cl::init(4 << 20), cl::Hidden,
+    cl::desc("The minimal size of the part of the CSV file parsed by one "
+             "thread. Smaller files are parsed on fewer threads."));
+
 // BB indices in the BBFreqMap that are not present in the CSV file will be
 // assigned an "BBFreq::Invalid (-1)" value.
 class BBFreq final {
@@ -133,6 +240,10 @@ class BBFreq final {
   static constexpr double Invalid = -1;
 };
 
+// The basic block frequencies from the CSV file, indexed by the name of the
+// function and the index of the basic block.
+using BBFreqMapTy = StringMap<SmallVector<BBFreq, 20>>;
+
 static void exitIf(bool Cond, Twine Message) {
   if (Cond) {
     WithColor::error(errs(), "llvm-cm") << Message << "\n";
@@ -160,18 +271,90 @@ static bool instructionTerminatesBasicBlock(const MCInstrInfo &instruction_info,
          desc.isBarrier() || desc.hasUnmodeledSideEffects();
 }
 
-double calcFrequency(StringRef CurrSymbol,
-                     const StringMap<SmallVector<BBFreq, 20>> &BBFreqMap,
+// Returns true when `Inst` is passed to the ML models. The models were trained
+// on basic blocks without the terminators and without these instructions.
+static bool isModeledInstruction(const MCInstrInfo &MII, const MCInst &Inst) {
+  return !instructionTerminatesBasicBlock(MII, Inst) &&
+         MII.getName(Inst.getOpcode()) != "CDQ" &&
+         MII.getName(Inst.getOpcode()) != "NOOP";
+}
+
+// Returns the loaded TFLite model from --granite_model. Exits when the model
+// can't be loaded.
+static std::unique_ptr<tflite::FlatBufferModel> loadTfLiteModel() {
+  std::unique_ptr<tflite::FlatBufferModel> InfModel =
+      tflite::FlatBufferModel::BuildFromFile(EvaluatorFilename.c_str());
+  exitIf(InfModel == nullptr,
+         "Could not load the TfLite model from " + EvaluatorFilename);
+  return InfModel;
+}
+
+// Returns the frequencies of the basic blocks of `Symbol` from `BBFreqMap`.
+// Returns an empty array when the function is not in the CSV file; functions
+// that are in the file always have at least one entry.
+ArrayRef<BBFreq> lookupFrequencies(const BBFreqMapTy &BBFreqMap,
+                                   StringRef Symbol) {
+  const auto It = BBFreqMap.find(Symbol);
+  if (It == BBFreqMap.end()) return {};
+  return It->second;
+}
+
+// Returns the frequency of the basic block `BB` of the function `CurrSymbol`,
+// whose frequencies were returned by lookupFrequencies().
+double calcFrequency(StringRef CurrSymbol, ArrayRef<BBFreq> Frequencies,
                      uint64_t BB) {
-  exitIf(!BBFreqMap.contains(CurrSymbol),
+  exitIf(Frequencies.empty(),
          "Function " + CurrSymbol + " not found in CSV file");
-  exitIf(BB >= BBFreqMap.lookup(CurrSymbol).size(),
+  exitIf(BB >= Frequencies.size(),
          "Basic block index not found in CSV file: Index " + Twine(BB) +
              " is+ out of bounds");
-  exitIf(BBFreqMap.lookup(CurrSymbol)[BB] == BBFreq::Invalid,
+  exitIf(Frequencies[BB] == BBFreq::Invalid,
          "Basic block index not found in CSV file for function " + CurrSymbol +
              ": Index " + Twine(BB) + " is not present");
-  return BBFreqMap.lookup(CurrSymbol)[BB];
+  return Frequencies[BB];
+}
+
+// The ID of a basic block from the BB address map and the address at which the
+// basic block starts.
+struct BBLabel {
+  uint64_t Address;
+  uint64_t ID;
+};
+
+// The prediction of a cost model for one basic block of a function.
+struct BlockPrediction {
+  // The ID of the basic block from the BB address map.
+  uint64_t ID;
+  // The frequency of the basic block from the CSV file.
+  double Frequency;
+  // The cost of one execution of the basic block.
+  double Prediction;
+};
+
+// The result of the evaluation of one function.
+struct FunctionEvaluation {
+  // The sum of the predictions for the basic blocks weighted by their
+  // frequencies.
+  double Latency = 0.0;
+  // The predictions for the basic blocks evaluated by the cost model, in the
+  // order of their addresses.
+  std::vector<BlockPrediction> Blocks;
+};
+
+// A basic block of a function collected by the ML-based cost models, with its
+// ID and frequency.
+struct WeightedBasicBlock {
+  gematria::BasicBlock Block;
+  uint64_t ID;
+  double Frequency;
+};
+
+// Adds the prediction for `Block` to `Evaluation`.
+static void addBlockPrediction(const WeightedBasicBlock &Block,
+                               double Prediction,
+                               FunctionEvaluation &Evaluation) {
+  Evaluation.Latency += Prediction * Block.Frequency;
+  Evaluation.Blocks.push_back({Block.ID, Block.Frequency, Prediction});
 }
 
 // Abstraction for latency evaluator, applicate to future models.
@@ -181,24 +364,40 @@ class CostModel {
  protected:
   // Handles latency calculation at the function level, once basic blocks have
   // all been assembled, as well as function level accumulation.
-  virtual double getLatencyForGivenBlocks() = 0;
+  virtual FunctionEvaluation evaluateGivenBlocks() = 0;
   // How individual instructions are handled by a model.
   virtual void handleInstr(MCInst &Inst, MCInstrInfo &MII) = 0;
 
-  // Determines how individual basic blocks are handled.
-  virtual void evaluateBasicBlock(double Freq) = 0;
+  // Determines how individual basic blocks are handled. `ID` is the ID of the
+  // basic block from the BB address map.
+  virtual void evaluateBasicBlock(uint64_t ID, double Freq) = 0;
   virtual uint64_t getNumBasicBlocks() = 0;
 
+  // Clears the per-function state of the model, so that the same model object
+  // can be used to evaluate multiple functions.
+  virtual void reset() = 0;
+
  public:
   virtual ~CostModel() = default;
 
-  double getLatency(
+  // Disassembles the function, passes all its basic blocks to
+  // evaluateBasicBlock(), and returns the latency of the function and the
+  // predictions for its basic blocks.
+  FunctionEvaluation evaluateFunction(
       MCDisassembler &DisAsm, uint64_t SectionAddr, ArrayRef<uint8_t> Bytes,
       uint64_t Start, uint64_t End, uint64_t Index,
       raw_svector_ostream &CommentStream, MCInstrInfo &MII,
-      const std::unordered_map<uint64_t, std::vector<uint64_t>> &Labels,
-      StringRef CurrSymbol,
-      const StringMap<SmallVector<BBFreq, 20>> &BBFreqMap);
+      ArrayRef<BBLabel> Labels, StringRef CurrSymbol,
+      ArrayRef<BBFreq> Frequencies);
+
+  // Resets the model, disassembles the function, and passes all its basic
+  // blocks to evaluateBasicBlock(), but does not compute the latency.
+  void collectBasicBlocks(
+      MCDisassembler &DisAsm, uint64_t SectionAddr, ArrayRef<uint8_t> Bytes,
+      uint64_t Start, uint64_t End, uint64_t Index,
+      raw_svector_ostream &CommentStream, MCInstrInfo &MII,
+      ArrayRef<BBLabel> Labels, StringRef CurrSymbol,
+      ArrayRef<BBFreq> Frequencies);
 };
 
 class GraniteCostModel : public CostModel {
@@ -215,16 +414,24 @@ class GraniteCostModel : public CostModel {
 
   std::unique_ptr<tflite::FlatBufferModel> InfModel;
   std::unique_ptr<gematria::GraphBuilderModelInference> Inference;
+  // The pipeline used by evaluateDeferredFunctions(). Created on first use.
+  std::unique_ptr<gematria::PipelinedGraphBuilderModelInference> Pipeline;
 
-  std::vector<std::pair<gematria::BasicBlock, double>> BasicBlocksAndFreq;
+  std::vector<WeightedBasicBlock> BasicBlocksAndFreq;
 
   std::vector<MCInst> InstVec;
 
+  // The basic blocks of the functions deferred by deferFunction(), and the
+  // indices one past the last block of each function in DeferredBlocksAndFreq.
+  std::vector<WeightedBasicBlock> DeferredBlocksAndFreq;
+  std::vector<size_t> DeferredFunctionEnds;
+
  public:
-  // Factory method to create a Granite-based cost model.
-  static std::unique_ptr<CostModel> create(const TargetMachine *TM) {
-    std::unique_ptr<tflite::FlatBufferModel> InfModel =
-        tflite::FlatBufferModel::BuildFromFile(EvaluatorFilename.c_str());
+  // Factory method to create a Granite-based cost model. Loading the model is
+  // expensive; the returned object should be created once and reused for all
+  // functions.
+  static std::unique_ptr<GraniteCostModel> create(const TargetMachine *TM) {
+    std::unique_ptr<tflite::FlatBufferModel> InfModel = loadTfLiteModel();
 
     auto InferenceOr = unwrapOrError(
         gematria::GraphBuilderModelInference::FromTfLiteModel(InfModel.get()));
@@ -232,24 +439,31 @@ class GraniteCostModel : public CostModel {
     // TODO(dayannd): Change this to make use of Expected<>.
     if (InferenceOr == nullptr) return nullptr;
 
-    return std::unique_ptr<CostModel>(
+    return std::unique_ptr<GraniteCostModel>(
         new GraniteCostModel(TM, std::move(InfModel), std::move(InferenceOr)));
   }
 
   uint64_t getNumBasicBlocks() override { return BasicBlocksAndFreq.size(); }
 
-  double getLatencyForGivenBlocks() override {
+  void reset() override {
     Inference->Reset();
+    BasicBlocksAndFreq.clear();
+    InstVec.clear();
+  }
 
-    for (const auto &BasicBlock : BasicBlocksAndFreq) {
-      exitIf(!Inference->AddBasicBlockToBatch(BasicBlock.first),
+  FunctionEvaluation evaluateGivenBlocks() override {
+    Inference->Reset();
+
+    for (const WeightedBasicBlock &BasicBlock : BasicBlocksAndFreq) {
+      exitIf(!Inference->AddBasicBlockToBatch(BasicBlock.Block),
              "Basic block could not be added to batch!");
     }
 
     const std::vector<gematria::GraphBuilderModelInference::OutputType>
         Predictions = unwrapOrError(Inference->RunInference());
     assert(Predictions.size() == BasicBlocksAndFreq.size());
-    double LatencyAccumulator = 0.0;
+    FunctionEvaluation Evaluation;
+    Evaluation.Blocks.reserve(Predictions.size());
 
     // The tasks: IVB, HSW, and SKL. We only care about SKL right now.
     for (unsigned Block = 0; Block < Predictions.size(); ++Block) {
@@ -257,26 +471,178 @@ class GraniteCostModel : public CostModel {
       // All Gematria models are implemented as multi-task models, even if
       // they have just one output head (and `output` contains just a single
       // value).
-      LatencyAccumulator += Costs[2] * BasicBlocksAndFreq[Block].second;
+      addBlockPrediction(BasicBlocksAndFreq[Block], Costs[2], Evaluation);
     }
 
-    return LatencyAccumulator;
+    return Evaluation;
+  }
+
+  // Returns the basic blocks collected for the current function and their
+  // frequencies, and removes them from the model.
+  std::vector<WeightedBasicBlock> takeBasicBlocks() {
+    return std::exchange(BasicBlocksAndFreq, {});
+  }
+
+  // Adds a function with the given basic blocks to the list of deferred
+  // functions. Their latency is computed later by evaluateDeferredFunctions().
+  void deferFunction(std::vector<WeightedBasicBlock> BlocksAndFreq) {
+    std::move(BlocksAndFreq.begin(), BlocksAndFreq.end(),
+              std::back_inserter(DeferredBlocksAndFreq));
+    DeferredFunctionEnds.push_back(DeferredBlocksAndFreq.size());
+  }
+
+  // Computes the latencies of all functions deferred by deferFunction(), in
+  // the order in which they were deferred. Basic blocks of different functions
+  // are evaluated together in batches limited by --granite_max_blocks_per_batch
+  // and --granite_max_nodes_per_batch.
+  std::vector<FunctionEvaluation> evaluateDeferredFunctions() {
+    // The graphs of the next batch are built while the model runs on the
+    // previous batches in a background thread.
+    if (Pipeline == nullptr) {
+      Pipeline = unwrapOrError(
+          gematria::PipelinedGraphBuilderModelInference::Create(
+              *Inference, GranitePipelineDepth));
+    }
+
+    struct PendingBatch {
+      size_t BatchBegin;
+      size_t BatchEnd;
+      gematria::PipelinedGraphBuilderModelInference::FutureType Predictions;
+    };
+    std::vector<PendingBatch> Batches;
+    size_t BatchBegin = 0;
+    auto SubmitBatch = [&](size_t BatchEnd) {
+      Batches.push_back({BatchBegin, BatchEnd, Pipeline->SubmitBatch()});
+      BatchBegin = BatchEnd;
+    };
+
+    for (size_t Block = 0; Block < DeferredBlocksAndFreq.size(); ++Block) {
+      exitIf(!Pipeline->AddBasicBlockToBatch(
+                 DeferredBlocksAndFreq[Block].Block),
+             "Basic block could not be added to batch!");
+      const bool BatchIsFull =
+          (GraniteMaxBlocksPerBatch > 0 &&
+           Pipeline->num_blocks_in_batch() >= GraniteMaxBlocksPerBatch) ||
+          (GraniteMaxNodesPerBatch > 0 &&
+           Pipeline->num_nodes_in_batch() >= GraniteMaxNodesPerBatch);
+      if (BatchIsFull) SubmitBatch(Block + 1);
+    }
+    if (BatchBegin < DeferredBlocksAndFreq.size()) {
+      SubmitBatch(DeferredBlocksAndFreq.size());
+    }
+
+    std::vector<FunctionEvaluation> Evaluations(DeferredFunctionEnds.size());
+    size_t Function = 0;
+    for (PendingBatch &Batch : Batches) {
+      const std::vector<gematria::GraphBuilderModelInference::OutputType>
+          Predictions = unwrapOrError(Batch.Predictions.get());
+      assert(Predictions.size() == Batch.BatchEnd - Batch.BatchBegin);
+      for (size_t Block = Batch.BatchBegin; Block < Batch.BatchEnd; ++Block) {
+        while (Block >= DeferredFunctionEnds[Function]) ++Function;
+        // See evaluateGivenBlocks() for the choice of the task.
+        addBlockPrediction(DeferredBlocksAndFreq[Block],
+                           Predictions[Block - Batch.BatchBegin][2],
+                           Evaluations[Function]);
+      }
+    }
+
+    DeferredBlocksAndFreq.clear();
+    DeferredFunctionEnds.clear();
+    return Evaluations;
   }
 
   void handleInstr(MCInst &Inst, MCInstrInfo &MII) override {
-    if (!instructionTerminatesBasicBlock(MII, Inst) &&
-        MII.getName(Inst.getOpcode()) != "CDQ" &&
-        MII.getName(Inst.getOpcode()) != "NOOP") {
-      InstVec.push_back(Inst);
+    if (isModeledInstruction(MII, Inst)) InstVec.push_back(Inst);
+  }
+
+  void evaluateBasicBlock(uint64_t ID, double Freq) override {
+    if (InstVec.empty()) {
+      return;
     }
+    BasicBlocksAndFreq.push_back(
+        {Canonicalizer.BasicBlockFromMCInst(InstVec), ID, Freq});
+    InstVec.clear();
+  }
+};
+
+// Evaluates the basic blocks with a sequence model, e.g. the hierarchical LSTM
+// model, through gematria::SequenceModelInference. The basic blocks are
+// canonicalized in the same way as for GraniteCostModel.
+class SequenceCostModel : public CostModel {
+ private:
+  SequenceCostModel(
+      const TargetMachine *TM,
+      std::unique_ptr<tflite::FlatBufferModel> InfModel,
+      std::unique_ptr<gematria::SequenceModelInference> Inference)
+      : Canonicalizer(TM),
+        InfModel(std::move(InfModel)),
+        Inference(std::move(Inference)) {}
+
+  gematria::X86Canonicalizer Canonicalizer;
+
+  std::unique_ptr<tflite::FlatBufferModel> InfModel;
+  std::unique_ptr<gematria::SequenceModelInference> Inference;
+
+  std::vector<WeightedBasicBlock> BasicBlocksAndFreq;
+
+  std::vector<MCInst> InstVec;
+
+ public:
+  // Factory method to create a cost model based on a sequence model. Loading
+  // the model is expensive; the returned object should be created once and
+  // reused for all functions.
+  static std::unique_ptr<SequenceCostModel> create(const TargetMachine *TM) {
+    std::unique_ptr<tflite::FlatBufferModel> InfModel = loadTfLiteModel();
+    std::unique_ptr<gematria::SequenceModelInference> Inference =
+        unwrapOrError(gematria::SequenceModelInference::FromTfLiteModel(
+            InfModel.get()));
+    return std::unique_ptr<SequenceCostModel>(
+        new SequenceCostModel(TM, std::move(InfModel), std::move(Inference)));
+  }
+
+  uint64_t getNumBasicBlocks() override { return BasicBlocksAndFreq.size(); }
+
+  void reset() override {
+    Inference->Reset();
+    BasicBlocksAndFreq.clear();
+    InstVec.clear();
   }
 
-  void evaluateBasicBlock(double Freq) override {
+  FunctionEvaluation evaluateGivenBlocks() override {
+    Inference->Reset();
+
+    for (const WeightedBasicBlock &BasicBlock : BasicBlocksAndFreq) {
+      exitIf(!Inference->AddBasicBlockToBatch(BasicBlock.Block),
+             "Basic block could not be added to batch!");
+    }
+
+    const std::vector<gematria::SequenceModelInference::OutputType>
+        Predictions = unwrapOrError(Inference->RunInference());
+    assert(Predictions.size() == BasicBlocksAndFreq.size());
+    FunctionEvaluation Evaluation;
+    Evaluation.Blocks.reserve(Predictions.size());
+    for (unsigned Block = 0; Block < Predictions.size(); ++Block) {
+      const auto &Costs = Predictions[Block];
+      exitIf(uArchTaskNumber >= Costs.size(),
+             "--task_number is out of range; the model has " +
+                 Twine(Costs.size()) + " tasks");
+      addBlockPrediction(BasicBlocksAndFreq[Block], Costs[uArchTaskNumber],
+                         Evaluation);
+    }
+
+    return Evaluation;
+  }
+
+  void handleInstr(MCInst &Inst, MCInstrInfo &MII) override {
+    if (isModeledInstruction(MII, Inst)) InstVec.push_back(Inst);
+  }
+
+  void evaluateBasicBlock(uint64_t ID, double Freq) override {
     if (InstVec.empty()) {
       return;
     }
     BasicBlocksAndFreq.push_back(
-        std::make_pair(Canonicalizer.BasicBlockFromMCInst(InstVec), Freq));
+        {Canonicalizer.BasicBlockFromMCInst(InstVec), ID, Freq});
     InstVec.clear();
   }
 };
@@ -289,7 +655,7 @@ class CountCostModel : public CostModel {
 
   uint64_t NumInsts = 0;
 
-  double TotalFuncLatency = 0.0;
+  FunctionEvaluation Evaluation;
 
  public:
   // Factory method for standard weighted instruction count model.
@@ -299,13 +665,22 @@ class CountCostModel : public CostModel {
 
   uint64_t getNumBasicBlocks() override { return NumBasicBlocks; }
 
+  void reset() override {
+    NumBasicBlocks = 0;
+    NumInsts = 0;
+    Evaluation = FunctionEvaluation();
+  }
+
   void handleInstr(MCInst &Inst, MCInstrInfo &MII) override { ++NumInsts; }
 
-  double getLatencyForGivenBlocks() override { return TotalFuncLatency; }
+  FunctionEvaluation evaluateGivenBlocks() override {
+    return std::exchange(Evaluation, {});
+  }
 
-  void evaluateBasicBlock(double Freq) override {
+  void evaluateBasicBlock(uint64_t ID, double Freq) override {
     double BBLatency = Freq * NumInsts;
-    TotalFuncLatency += BBLatency;
+    Evaluation.Latency += BBLatency;
+    Evaluation.Blocks.push_back({ID, Freq, static_cast<double>(NumInsts)});
     ++NumBasicBlocks;
     NumInsts = 0;
   }
@@ -353,50 +728,240 @@ SymbolInfoTy createSymbolInfo(const object::ObjectFile &Obj,
                                   : static_cast<uint8_t>(ELF::STT_NOTYPE));
 }
 
-void printFunctionNames(ArrayRef<SymbolInfoTy> Aliases) {
-  for (const auto &Alias : Aliases) outs() << "<" << Alias.Name << ">: \n";
+void printFunctionNames(raw_ostream &Out, ArrayRef<StringRef> Names) {
+  for (StringRef Name : Names) Out << "<" << Name << ">: \n";
+}
+
+template <typename T>
+static ArrayRef<uint8_t> asBytes(ArrayRef<T> Values) {
+  return ArrayRef<uint8_t>(reinterpret_cast<const uint8_t *>(Values.data()),
+                           Values.size() * sizeof(T));
+}
+
+// Returns a hash of the inputs of the evaluation of a function: its machine
+// code, the offsets and IDs of its basic block labels, and the frequencies of
+// its basic blocks. The hash does not depend on the address of the function,
+// so that functions that only moved in the binary are recognized by
+// --previous_results.
+static uint64_t hashFunctionInputs(ArrayRef<uint8_t> Code,
+                                   uint64_t FunctionAddress,
+                                   ArrayRef<BBLabel> Labels,
+                                   ArrayRef<BBFreq> Frequencies) {
+  std::vector<uint64_t> LabelData;
+  LabelData.reserve(2 * Labels.size());
+  for (const BBLabel &Label : Labels) {
+    LabelData.push_back(Label.Address - FunctionAddress);
+    LabelData.push_back(Label.ID);
+  }
+  const uint64_t Hashes[] = {xxHash64(Code),
+                             xxHash64(asBytes(ArrayRef(LabelData))),
+                             xxHash64(asBytes(Frequencies))};
+  return xxHash64(asBytes(ArrayRef(Hashes)));
+}
+
+// Returns the options that affect the results of the evaluation: the
+// evaluator, the triple and the CPU, and for the GRANITE and sequence
+// evaluators the MD5 of the model file and the task number. The configuration is stored with each
+// result in the jsonl output format, so that --previous_results reuses only the
+// results of the same configuration.
+static json::Object getEvaluatorConfig() {
+  StringRef Evaluator = "count";
+  if (EvaluationMethod == EvaluationType::Granite) Evaluator = "granite";
+  if (EvaluationMethod == EvaluationType::Sequence) Evaluator = "sequence";
+  json::Object Config{{"evaluator", Evaluator},
+                      {"triple", std::string(TripleName)},
+                      {"mcpu", std::string(CPU)}};
+  if (EvaluationMethod != EvaluationType::Counter) {
+    ErrorOr<std::unique_ptr<MemoryBuffer>> ModelOrErr =
+        MemoryBuffer::getFile(EvaluatorFilename);
+    exitIf(!ModelOrErr, "failed to open file " + EvaluatorFilename);
+    const MD5::MD5Result Hash =
+        MD5::hash(arrayRefFromStringRef((*ModelOrErr)->getBuffer()));
+    Config["model_md5"] = Hash.digest().str();
+    Config["task_number"] = static_cast<int64_t>(uArchTaskNumber);
+  }
+  return Config;
+}
+
+// Returns `Config` as a compact JSON string, used to compare configurations.
+static std::string formatEvaluatorConfig(const json::Object &Config) {
+  return formatv("{0}", json::Value(json::Object(Config))).str();
 }
 
+// The evaluations from the file passed to --previous_results, indexed by the
+// hashes of the inputs of the functions.
+using PreviousResultsTy = DenseMap<uint64_t, FunctionEvaluation>;
+
+// Parses a line of the jsonl output format. Returns false when the line is
+// not valid. Stores the configuration of the evaluation in `Config` as a
+// compact JSON string, or an empty string when the line does not have one.
+static bool parseFunctionJson(StringRef Line, uint64_t &Hash,
+                              std::string &Config,
+                              FunctionEvaluation &Evaluation) {
+  Expected<json::Value> Value = json::parse(Line);
+  if (!Value) {
+    consumeError(Value.takeError());
+    return false;
+  }
+  const json::Object *Object = Value->getAsObject();
+  if (Object == nullptr) return false;
+  const auto HashStr = Object->getString("hash");
+  const auto Latency = Object->getNumber("latency");
+  const json::Array *Blocks = Object->getArray("blocks");
+  if (!HashStr || HashStr->getAsInteger(16, Hash) || !Latency ||
+      Blocks == nullptr) {
+    return false;
+  }
+  const json::Object *ConfigObject = Object->getObject("config");
+  Config = ConfigObject == nullptr ? std::string()
+                                   : formatEvaluatorConfig(*ConfigObject);
+  Evaluation.Latency = *Latency;
+  Evaluation.Blocks.clear();
+  for (const json::Value &Block : *Blocks) {
+    const json::Object *BlockObject = Block.getAsObject();
+    if (BlockObject == nullptr) return false;
+    const auto ID = BlockObject->getInteger("id");
+    const auto Frequency = BlockObject->getNumber("frequency");
+    const auto Prediction = BlockObject->getNumber("prediction");
+    if (!ID || !Frequency || !Prediction) return false;
+    Evaluation.Blocks.push_back(
+        {static_cast<uint64_t>(*ID), *Frequency, *Prediction});
+  }
+  return true;
+}
+
+// Reads the file passed to --previous_results. Keeps only the results that were
+// evaluated with the configuration `Config`, from formatEvaluatorConfig().
+static PreviousResultsTy loadPreviousResults(StringRef Config) {
+  PreviousResultsTy PreviousResults;
+  if (PreviousResultsFilename.empty()) return PreviousResults;
+
+  llvm::ErrorOr<std::unique_ptr<MemoryBuffer>> FileOrErr =
+      MemoryBuffer::getFile(PreviousResultsFilename);
+  exitIf(!FileOrErr, "failed to open file " + PreviousResultsFilename);
+  StringRef Text = (*FileOrErr)->getBuffer();
+  int LineNumber = 0;
+  while (!Text.empty()) {
+    StringRef Line;
+    std::tie(Line, Text) = Text.split('\n');
+    ++LineNumber;
+    if (Line.trim().empty()) continue;
+    uint64_t Hash = 0;
+    std::string LineConfig;
+    FunctionEvaluation Evaluation;
+    exitIf(!parseFunctionJson(Line, Hash, LineConfig, Evaluation),
+           "invalid function result at " + PreviousResultsFilename + ":" +
+               Twine(LineNumber));
+    if (LineConfig != Config) continue;
+    PreviousResults[Hash] = std::move(Evaluation);
+  }
+  return PreviousResults;
+}
+
+// Prints the evaluation of a function as a single-line JSON object with the
+// fields "names", "address", "hash", "config", "num_blocks", "latency" and
+// "blocks". "hash" is the result of hashFunctionInputs() as a hex string.
+// "config" is the object from getEvaluatorConfig(). "blocks" is an array of
+// objects with the fields "id", "frequency" and "prediction" for each basic
+// block evaluated by the cost model.
+void printFunctionJson(raw_ostream &Out, ArrayRef<StringRef> Names,
+                       uint64_t Address, uint64_t Hash,
+                       const json::Object &Config,
+                       const FunctionEvaluation &Evaluation) {
+  json::OStream Json(Out);
+  Json.object([&]() {
+    Json.attributeArray("names", [&]() {
+      for (StringRef Name : Names) Json.value(Name);
+    });
+    Json.attribute("address", static_cast<int64_t>(Address));
+    Json.attribute("hash", utohexstr(Hash, /*LowerCase=*/true));
+    Json.attribute("config", json::Object(Config));
+    Json.attribute("num_blocks",
+                   static_cast<int64_t>(Evaluation.Blocks.size()));
+    Json.attribute("latency", Evaluation.Latency);
+    Json.attributeArray("blocks", [&]() {
+      for (const BlockPrediction &Block : Evaluation.Blocks) {
+        Json.object([&]() {
+          Json.attribute("id", static_cast<int64_t>(Block.ID));
+          Json.attribute("frequency", Block.Frequency);
+          Json.attribute("prediction", Block.Prediction);
+        });
+      }
+    });
+  });
+  Out << "\n";
+}
+
+// Appends the labels of the basic blocks of the function between `Start` and
+// `End` to `Labels`. The appended labels are sorted by address; labels with the
+// same address are in the order of the BB address map.
 static void collectBBtoAddressLabels(
     const DenseMap<uint64_t, llvm::object::BBAddrMap> &AddrToBBAddrMap,
     uint64_t SectionAddr, uint64_t Start, uint64_t End,
-    std::unordered_map<uint64_t, std::vector<uint64_t>> &Labels) {
+    std::vector<BBLabel> &Labels) {
   if (AddrToBBAddrMap.empty()) return;
-  Labels.clear();
   const uint64_t StartAddress = SectionAddr + Start;
   const uint64_t EndAddress = SectionAddr + End;
   auto Iter = AddrToBBAddrMap.find(StartAddress);
   if (Iter == AddrToBBAddrMap.end()) return;
+  const size_t FirstFunctionLabel = Labels.size();
   for (const llvm::object::BBAddrMap::BBEntry &BB :
        Iter->second.getBBEntries()) {
     const uint64_t BBAddress = BB.Offset + Iter->second.getFunctionAddress();
     if (BBAddress >= EndAddress) continue;
-    Labels[BBAddress].push_back(BB.ID);
+    Labels.push_back({BBAddress, BB.ID});
   }
+  // The entries of the BB address map are normally sorted by their offsets
+  // already.
+  const auto ByAddress = [](const BBLabel &Left, const BBLabel &Right) {
+    return Left.Address < Right.Address;
+  };
+  auto FunctionLabels =
+      llvm::make_range(Labels.begin() + FirstFunctionLabel, Labels.end());
+  if (!llvm::is_sorted(FunctionLabels, ByAddress))
+    llvm::stable_sort(FunctionLabels, ByAddress);
+}
+
+FunctionEvaluation CostModel::evaluateFunction(
+    MCDisassembler &DisAsm, uint64_t SectionAddr, ArrayRef<uint8_t> Bytes,
+    uint64_t Start, uint64_t End, uint64_t Index,
+    raw_svector_ostream &CommentStream, MCInstrInfo &MII,
+    ArrayRef<BBLabel> Labels, StringRef CurrSymbol,
+    ArrayRef<BBFreq> Frequencies) {
+  collectBasicBlocks(DisAsm, SectionAddr, Bytes, Start, End, Index,
+                     CommentStream, MII, Labels, CurrSymbol, Frequencies);
+  return evaluateGivenBlocks();
 }
 
-double CostModel::getLatency(
+void CostModel::collectBasicBlocks(
     MCDisassembler &DisAsm, uint64_t SectionAddr, ArrayRef<uint8_t> Bytes,
     uint64_t Start, uint64_t End, uint64_t Index,
     raw_svector_ostream &CommentStream, MCInstrInfo &MII,
-    const std::unordered_map<uint64_t, std::vector<uint64_t>> &Labels,
-    StringRef CurrSymbol, const StringMap<SmallVector<BBFreq, 20>> &BBFreqMap) {
+    ArrayRef<BBLabel> Labels, StringRef CurrSymbol,
+    ArrayRef<BBFreq> Frequencies) {
+  reset();
   uint64_t ThisBb = -1;
   bool EnteredBb = false;
+  // The labels are sorted by address, so a single cursor finds the labels at
+  // each instruction. Labels that do not start at an instruction boundary are
+  // skipped.
+  size_t NextLabel = 0;
   while (Index < End) {
     uint64_t CurrAddr = SectionAddr + Index;
-    auto FirstIter = Labels.find(CurrAddr);
-    if (FirstIter != Labels.end()) {
-      for (auto Label : FirstIter->second) {
-        if (EnteredBb)
-          evaluateBasicBlock(calcFrequency(CurrSymbol, BBFreqMap, ThisBb));
-        EnteredBb = true;
-        ThisBb = Label;
-
-        LLVM_DEBUG(dbgs() << "<"
-                          << "BB" + Twine(Label) << ">: "
-                          << format("%016" PRIx64 " ", CurrAddr) << "\n");
-      }
+    while (NextLabel < Labels.size() && Labels[NextLabel].Address < CurrAddr)
+      ++NextLabel;
+    for (; NextLabel < Labels.size() && Labels[NextLabel].Address == CurrAddr;
+         ++NextLabel) {
+      const uint64_t Label = Labels[NextLabel].ID;
+      if (EnteredBb)
+        evaluateBasicBlock(ThisBb,
+                           calcFrequency(CurrSymbol, Frequencies, ThisBb));
+      EnteredBb = true;
+      ThisBb = Label;
+
+      LLVM_DEBUG(dbgs() << "<"
+                        << "BB" + Twine(Label) << ">: "
+                        << format("%016" PRIx64 " ", CurrAddr) << "\n");
     }
     MCInst Inst;
     uint64_t Size = 0;
@@ -411,40 +976,102 @@ double CostModel::getLatency(
           BytesSlice.size(), DisAsm.suggestBytesToSkip(BytesSlice, CurrAddr));
     Index += Size;
   }
-  evaluateBasicBlock(calcFrequency(CurrSymbol, BBFreqMap, ThisBb));
-  double Latency = getLatencyForGivenBlocks();
-  outs() << "Calculated Frequency: " << Latency << "\n";
-  return Latency;
+  evaluateBasicBlock(ThisBb, calcFrequency(CurrSymbol, Frequencies, ThisBb));
+}
+
+// Parses the lines of the CSV file in `Text` and adds their frequencies to
+// `BBFreqMap`. `Text` must contain only whole lines. Returns the error message
+// for the first invalid line, or an empty string when all lines are valid.
+static std::string parseBBFreqLines(StringRef Text, BBFreqMapTy &BBFreqMap) {
+  // The lines of a function are usually next to each other in the file; the
+  // frequencies of the last function are kept to avoid looking it up in the
+  // map for each line. The values of a StringMap are not moved when the map
+  // grows.
+  StringRef LastFuncName;
+  SmallVector<BBFreq, 20> *LastFreqs = nullptr;
+  while (!Text.empty()) {
+    StringRef Line;
+    std::tie(Line, Text) = Text.split('\n');
+    if (!Line.empty() && Line.back() == '\r') Line = Line.drop_back();
+    if (Line.empty()) continue;
+
+    // The columns are the function name, the basic block index and the
+    // frequency. Additional columns are ignored.
+    const auto [FuncName, AfterFuncName] = Line.split(',');
+    const auto [BBIndexStr, AfterBBIndex] = AfterFuncName.split(',');
+    const StringRef FreqStr = AfterBBIndex.split(',').first;
+    if (FuncName.empty()) return "Function name cannot be empty";
+    double FreqVal = BBFreq::Invalid;
+    if (FreqStr.getAsDouble(FreqVal, true)) {
+      return "Frequency value could not be parsed";
+    }
+    uint64_t BBIndex = -1;
+    if (BBIndexStr.getAsInteger(10, BBIndex)) {
+      return "BBIndex could not be parsed";
+    }
+
+    if (LastFreqs == nullptr || FuncName != LastFuncName) {
+      LastFreqs = &BBFreqMap[FuncName];
+      LastFuncName = FuncName;
+    }
+    if (BBIndex >= LastFreqs->size()) LastFreqs->resize(BBIndex + 1);
+    (*LastFreqs)[BBIndex] = FreqVal;
+  }
+  return "";
 }
 
-void populateBBFreqMap(StringMap<SmallVector<BBFreq, 20>> &BBFreqMap) {
+// Reads the basic block frequencies from the CSV file. Large files are split
+// into chunks of whole lines that are parsed on up to `MaxThreads` threads;
+// the chunks are merged in the order of the file, so that the result is the
+// same as when the lines are parsed one by one.
+void populateBBFreqMap(BBFreqMapTy &BBFreqMap, unsigned MaxThreads) {
   if (CSVFilename.empty()) return;
 
   llvm::ErrorOr<std::unique_ptr<MemoryBuffer>> FileOrErr =
       MemoryBuffer::getFileOrSTDIN(CSVFilename);
   exitIf(!FileOrErr, "failed to open file " + CSVFilename);
 
-  constexpr int FuncIdx = 0;
-  constexpr int BBIdx = 1;
-  constexpr int FreqIdx = 2;
-
-  llvm::line_iterator LineIter(**FileOrErr, /*SkipBlanks=*/true);
-
-  for (; !LineIter.is_at_eof(); ++LineIter) {
-    SmallVector<StringRef, 4> Row;
-    LineIter->split(Row, ',', 3);
-    StringRef FuncName = Row[FuncIdx];
-    exitIf(FuncName.empty(), "Function name cannot be empty");
-    double FreqVal = BBFreq::Invalid;
-    exitIf(Row[FreqIdx].getAsDouble(FreqVal, true),
-           "Frequency value could not be parsed");
-    uint64_t BBIndex = -1;
-    exitIf(Row[BBIdx].getAsInteger(10, BBIndex), "BBIndex could not be parsed");
-    auto &VecName = BBFreqMap[FuncName];
-    if (BBIndex >= VecName.size()) {
-      VecName.resize(BBIndex + 1);
+  // Smaller files are not worth the cost of starting the threads and merging
+  // the maps.
+  StringRef Text = (*FileOrErr)->getBuffer();
+  const size_t NumChunks = std::clamp<size_t>(
+      Text.size() / std::max<unsigned>(CSVMinBytesPerThread, 1), 1,
+      MaxThreads);
+  SmallVector<StringRef, 8> Chunks;
+  for (size_t Chunk = 0; Chunk + 1 < NumChunks; ++Chunk) {
+    // Each chunk ends after the first line break after its share of the
+    // remaining text.
+    const size_t LineBreak =
+        Text.find('\n', Text.size() / (NumChunks - Chunk));
+    if (LineBreak == StringRef::npos) break;
+    Chunks.push_back(Text.take_front(LineBreak + 1));
+    Text = Text.drop_front(LineBreak + 1);
+  }
+  Chunks.push_back(Text);
+
+  // The first chunk is parsed directly into `BBFreqMap`.
+  std::vector<BBFreqMapTy> ChunkMaps(Chunks.size() - 1);
+  std::vector<std::string> Errors(Chunks.size());
+  std::vector<std::thread> Workers;
+  for (size_t Chunk = 1; Chunk < Chunks.size(); ++Chunk) {
+    Workers.emplace_back([&, Chunk]() {
+      Errors[Chunk] = parseBBFreqLines(Chunks[Chunk], ChunkMaps[Chunk - 1]);
+    });
+  }
+  Errors[0] = parseBBFreqLines(Chunks[0], BBFreqMap);
+  for (std::thread &Worker : Workers) Worker.join();
+  // Report the first invalid line of the file.
+  for (const std::string &Error : Errors) exitIf(!Error.empty(), Error);
+
+  for (const BBFreqMapTy &ChunkMap : ChunkMaps) {
+    for (const auto &Entry : ChunkMap) {
+      SmallVector<BBFreq, 20> &Freqs = BBFreqMap[Entry.getKey()];
+      const SmallVector<BBFreq, 20> &ChunkFreqs = Entry.getValue();
+      if (ChunkFreqs.size() > Freqs.size()) Freqs.resize(ChunkFreqs.size());
+      for (size_t BB = 0; BB < ChunkFreqs.size(); ++BB) {
+        if (ChunkFreqs[BB] != BBFreq::Invalid) Freqs[BB] = ChunkFreqs[BB];
+      }
     }
-    VecName[BBIndex] = FreqVal;
   }
 }
 
@@ -487,23 +1114,61 @@ int main(int argc, char *argv[]) {
   std::unique_ptr<MCInstrInfo> MII(TheTarget->createMCInstrInfo());
   assert(MII && "Unable to create target instruction info!");
 
-  MCContext Ctx(Triple(TripleName), AsmInfo.get(), MRI.get(), SubInfo.get());
-
-  std::unique_ptr<MCObjectFileInfo> MOFI(
-      TheTarget->createMCObjectFileInfo(Ctx, false));
-  Ctx.setObjectFileInfo(MOFI.get());
-
-  std::unique_ptr<MCDisassembler> DisAsm(
-      TheTarget->createMCDisassembler(*SubInfo, Ctx));
-  assert(DisAsm && "Unable to create disassembler!");
+  // The MC layer objects and the cost models are not thread-safe. Each thread
+  // that disassembles and evaluates functions uses its own EvaluationContext;
+  // the objects created above are only read and they are shared by all
+  // threads.
+  struct EvaluationContext {
+    std::unique_ptr<MCContext> Ctx;
+    std::unique_ptr<MCObjectFileInfo> MOFI;
+    std::unique_ptr<MCDisassembler> DisAsm;
+    std::unique_ptr<TargetMachine> TM;
+    std::unique_ptr<CostModel> Handler;
+    // Points to `Handler` when it is a GRANITE cost model.
+    GraniteCostModel *GraniteHandler = nullptr;
+    SmallString<40> Comments;
+  };
+  auto CreateEvaluationContext = [&]() {
+    auto Context = std::make_unique<EvaluationContext>();
+    Context->Ctx = std::make_unique<MCContext>(
+        Triple(TripleName), AsmInfo.get(), MRI.get(), SubInfo.get());
+    Context->MOFI.reset(
+        TheTarget->createMCObjectFileInfo(*Context->Ctx, false));
+    Context->Ctx->setObjectFileInfo(Context->MOFI.get());
+
+    Context->DisAsm.reset(
+        TheTarget->createMCDisassembler(*SubInfo, *Context->Ctx));
+    assert(Context->DisAsm && "Unable to create disassembler!");
+
+    Context->TM.reset(TheTarget->createTargetMachine(
+        TripleName, CPU, FeatureVals->getString(), TargetOptions(),
+        Reloc::Model::Static));
+    assert(Context->TM && "Unable to create target machine!");
+
+    // Create the cost model only once per context; evaluateFunction() resets
+    // its per-function state for each function.
+    if (EvaluationMethod == EvaluationType::Granite) {
+      std::unique_ptr<GraniteCostModel> Granite =
+          GraniteCostModel::create(Context->TM.get());
+      Context->GraniteHandler = Granite.get();
+      Context->Handler = std::move(Granite);
+    } else if (EvaluationMethod == EvaluationType::Sequence) {
+      Context->Handler = SequenceCostModel::create(Context->TM.get());
+    } else if (EvaluationMethod == EvaluationType::Counter) {
+      Context->Handler = CountCostModel::create();
+    }
+    assert(Context->Handler && "A valid Handler type must be specified!");
+    return Context;
+  };
 
-  std::unique_ptr<TargetMachine> TM(
-      TheTarget->createTargetMachine(TripleName, CPU, FeatureVals->getString(),
-                                     TargetOptions(), Reloc::Model::Static));
-  assert(TM && "Unable to create target machine!");
+  // The maximal number of threads used for parsing the CSV file and for
+  // evaluating the functions.
+  const unsigned MaxThreads = std::max<unsigned>(
+      1, NumThreads > 0 ? NumThreads.getValue()
+                        : std::thread::hardware_concurrency());
 
-  StringMap<SmallVector<BBFreq, 20>> BBFreqMap;
-  populateBBFreqMap(BBFreqMap);
+  BBFreqMapTy BBFreqMap;
+  populateBBFreqMap(BBFreqMap, MaxThreads);
 
   // Section information should be stored to determine whether
   // or not the section is relevant to disassembly.
@@ -550,6 +1215,61 @@ int main(int argc, char *argv[]) {
 
   GetBBAddrMapping();
 
+  // The functions to evaluate, in the order of their symbols.
+  struct FunctionToEvaluate {
+    uint64_t SectionAddr;
+    ArrayRef<uint8_t> Bytes;
+    uint64_t Start;
+    uint64_t End;
+    uint64_t Index;
+    // The labels of the basic blocks of the function, a part of `AllLabels`.
+    // Set only after all functions are collected, because `AllLabels` may be
+    // reallocated until then.
+    ArrayRef<BBLabel> BBtoAddressLabels;
+    size_t FirstLabel;
+    size_t NumLabels;
+    // The names of all symbols at the start of the function. The first one is
+    // used to look up the basic block frequencies.
+    SmallVector<StringRef, 1> Names;
+    // The frequencies of the basic blocks of the function, from
+    // lookupFrequencies().
+    ArrayRef<BBFreq> Frequencies;
+    // The hash of the inputs of the evaluation, from hashFunctionInputs().
+    uint64_t Hash = 0;
+    // The result of the evaluation from --previous_results, or nullptr when
+    // the function must be evaluated.
+    const FunctionEvaluation *PreviousEvaluation = nullptr;
+  };
+  std::vector<FunctionToEvaluate> Functions;
+
+  // The function selection. When none of the selection options is used, all
+  // functions are evaluated.
+  const bool SelectFunctions = !SelectedFunctionNames.empty() ||
+                               !SelectedFunctionRegex.empty() ||
+                               !SelectedFunctionAddresses.empty();
+  const StringSet<> SelectedNames(SelectedFunctionNames.begin(),
+                                  SelectedFunctionNames.end());
+  const DenseSet<uint64_t> SelectedAddresses(SelectedFunctionAddresses.begin(),
+                                             SelectedFunctionAddresses.end());
+  std::optional<Regex> SelectedRegex;
+  if (!SelectedFunctionRegex.empty()) {
+    SelectedRegex.emplace(SelectedFunctionRegex);
+    std::string RegexError;
+    exitIf(!SelectedRegex->isValid(RegexError),
+           "invalid --function_regex: " + RegexError);
+  }
+  auto IsSelected = [&](ArrayRef<SymbolInfoTy> Aliases, uint64_t Address) {
+    if (!SelectFunctions || SelectedAddresses.contains(Address)) return true;
+    return llvm::any_of(Aliases, [&](const SymbolInfoTy &Alias) {
+      return SelectedNames.contains(Alias.Name) ||
+             (SelectedRegex.has_value() && SelectedRegex->match(Alias.Name));
+    });
+  };
+
+  // The basic block labels of all functions. Sharing one vector avoids
+  // allocating a container of labels for each function.
+  std::vector<BBLabel> AllLabels;
+
   // Begin iterating over the sections. For each section, get the symbols,
   // instructions and basic blocks and calculate the weighted
   // frequency of each basic block.
@@ -564,8 +1284,6 @@ int main(int argc, char *argv[]) {
 
     ArrayRef<uint8_t> Bytes =
         arrayRefFromStringRef(unwrapOrError(Section.getContents()));
-    SmallString<40> Comments;
-    raw_svector_ostream CommentStream(Comments);
 
     // For each symbol in the current section, disassemble the instructions
     // and obtain the location of each basic block.
@@ -592,37 +1310,162 @@ int main(int argc, char *argv[]) {
       // If the symbol range does not overlap with our section,
       // move to the next symbol.
       if (Start >= End || End <= StartAddr) continue;
+      if (!IsSelected(Aliases, Start)) continue;
 
       // Adjust the start and end addresses to be relative to the start of the
       // section.
       Start -= SectionAddr;
       End -= SectionAddr;
 
-      std::unordered_map<uint64_t, std::vector<uint64_t>> BBtoAddressLabels;
-      collectBBtoAddressLabels(BBAddrMap, SectionAddr, Start, End,
-                               BBtoAddressLabels);
-
-      // TODO(dayannd): Implement function selection.
-      printFunctionNames(Aliases);
+      FunctionToEvaluate &Function = Functions.emplace_back();
+      Function.FirstLabel = AllLabels.size();
+      collectBBtoAddressLabels(BBAddrMap, SectionAddr, Start, End, AllLabels);
+      Function.NumLabels = AllLabels.size() - Function.FirstLabel;
 
       uint64_t Index = Start;
       if (SectionAddr < StartAddr)
         Index = std::max<uint64_t>(Index, StartAddr - SectionAddr);
 
-      StringRef CurrSymbolName = Aliases[0].Name;
+      Function.SectionAddr = SectionAddr;
+      Function.Bytes = Bytes;
+      Function.Start = Start;
+      Function.End = End;
+      Function.Index = Index;
+      for (const SymbolInfoTy &Alias : Aliases)
+        Function.Names.push_back(Alias.Name);
+      Function.Frequencies =
+          lookupFrequencies(BBFreqMap, Function.Names.front());
+    }
+  }
+  const json::Object EvaluatorConfig = getEvaluatorConfig();
+  const PreviousResultsTy PreviousResults =
+      loadPreviousResults(formatEvaluatorConfig(EvaluatorConfig));
+  for (FunctionToEvaluate &Function : Functions) {
+    Function.BBtoAddressLabels =
+        ArrayRef<BBLabel>(AllLabels).slice(Function.FirstLabel,
+                                           Function.NumLabels);
+    Function.Hash = hashFunctionInputs(
+        Function.Bytes.slice(Function.Start, Function.End - Function.Start),
+        Function.SectionAddr + Function.Start, Function.BBtoAddressLabels,
+        Function.Frequencies);
+    auto PreviousIt = PreviousResults.find(Function.Hash);
+    if (PreviousIt != PreviousResults.end())
+      Function.PreviousEvaluation = &PreviousIt->second;
+  }
 
-      std::unique_ptr<CostModel> Handler;
+  // There is no point in having more threads than functions.
+  const unsigned ThreadCount =
+      std::max<size_t>(1, std::min<size_t>(Functions.size(), MaxThreads));
+  std::vector<std::unique_ptr<EvaluationContext>> Contexts;
+  for (unsigned Thread = 0; Thread < ThreadCount; ++Thread)
+    Contexts.push_back(CreateEvaluationContext());
+  EvaluationContext &MainContext = *Contexts.front();
+
+  // In the whole-binary mode, the names of the functions are printed together
+  // with their latencies after all functions are evaluated.
+  const bool WholeBinary =
+      GraniteWholeBinary && MainContext.GraniteHandler != nullptr;
+
+  std::error_code OutputError;
+  ToolOutputFile Output(OutputFilename, OutputError, sys::fs::OF_None);
+  exitIf(static_cast<bool>(OutputError),
+         "failed to open output file " + OutputFilename + ": " +
+             OutputError.message());
+  raw_ostream &Out = Output.os();
+  // The output can have millions of lines; write it in large chunks. A
+  // terminal is left unbuffered, so that the output appears as the functions
+  // are evaluated.
+  if (!Out.is_displayed()) Out.SetBufferSize(1 << 20);
+
+  auto PrintFunction = [&](const FunctionToEvaluate &Function,
+                           const FunctionEvaluation &Evaluation) {
+    if (OutputFormat == OutputFormatType::JsonLines) {
+      printFunctionJson(Out, Function.Names,
+                        Function.SectionAddr + Function.Start, Function.Hash,
+                        EvaluatorConfig, Evaluation);
+      return;
+    }
+    printFunctionNames(Out, Function.Names);
+    Out << "Calculated Frequency: " << Evaluation.Latency << "\n";
+  };
+  auto CollectBasicBlocks = [&](EvaluationContext &Context,
+                                const FunctionToEvaluate &Function) {
+    raw_svector_ostream CommentStream(Context.Comments);
+    Context.GraniteHandler->collectBasicBlocks(
+        *Context.DisAsm, Function.SectionAddr, Function.Bytes, Function.Start,
+        Function.End, Function.Index, CommentStream, *MII,
+        Function.BBtoAddressLabels, Function.Names.front(),
+        Function.Frequencies);
+    return Context.GraniteHandler->takeBasicBlocks();
+  };
+  auto EvaluateFunction = [&](EvaluationContext &Context,
+                              const FunctionToEvaluate &Function) {
+    if (Function.PreviousEvaluation != nullptr)
+      return *Function.PreviousEvaluation;
+    raw_svector_ostream CommentStream(Context.Comments);
+    return Context.Handler->evaluateFunction(
+        *Context.DisAsm, Function.SectionAddr, Function.Bytes, Function.Start,
+        Function.End, Function.Index, CommentStream, *MII,
+        Function.BBtoAddressLabels, Function.Names.front(),
+        Function.Frequencies);
+  };
 
-      if (EvaluationMethod == EvaluationType::Granite) {
-        Handler = GraniteCostModel::create(TM.get());
-      } else if (EvaluationMethod == EvaluationType::Counter) {
-        Handler = CountCostModel::create();
+  if (ThreadCount == 1 && !WholeBinary) {
+    for (const FunctionToEvaluate &Function : Functions) {
+      if (OutputFormat != OutputFormatType::Text) {
+        PrintFunction(Function, EvaluateFunction(MainContext, Function));
+        continue;
       }
-      assert(Handler && "A valid Handler type must be specified!");
+      // Print the names of the functions before evaluating them, so that
+      // errors are reported right after the name of the function that caused
+      // them.
+      printFunctionNames(Out, Function.Names);
+      const double Latency = EvaluateFunction(MainContext, Function).Latency;
+      Out << "Calculated Frequency: " << Latency << "\n";
+    }
+    Output.keep();
+    return 0;
+  }
 
-      Handler->getLatency(*DisAsm, SectionAddr, Bytes, Start, End, Index,
-                          CommentStream, *MII, BBtoAddressLabels,
-                          CurrSymbolName, BBFreqMap);
+  // Disassemble (and in the default mode also evaluate) the functions on
+  // `ThreadCount` threads. Each thread takes the next function that was not
+  // processed yet, and stores the results at the index of the function.
+  std::vector<FunctionEvaluation> Evaluations(Functions.size());
+  std::vector<std::vector<WeightedBasicBlock>> BlocksByFunction(
+      WholeBinary ? Functions.size() : 0);
+  std::atomic<size_t> NextFunction = 0;
+  auto ProcessFunctions = [&](EvaluationContext &Context) {
+    for (size_t Function = NextFunction++; Function < Functions.size();
+         Function = NextFunction++) {
+      if (WholeBinary) {
+        // Functions with a previous result are deferred with no blocks, and
+        // their result is replaced after the evaluation.
+        if (Functions[Function].PreviousEvaluation != nullptr) continue;
+        BlocksByFunction[Function] =
+            CollectBasicBlocks(Context, Functions[Function]);
+      } else {
+        Evaluations[Function] = EvaluateFunction(Context, Functions[Function]);
+      }
+    }
+  };
+  std::vector<std::thread> Workers;
+  for (unsigned Thread = 1; Thread < ThreadCount; ++Thread)
+    Workers.emplace_back(ProcessFunctions, std::ref(*Contexts[Thread]));
+  ProcessFunctions(MainContext);
+  for (std::thread &Worker : Workers) Worker.join();
+
+  if (WholeBinary) {
+    for (std::vector<WeightedBasicBlock> &Blocks : BlocksByFunction) {
+      MainContext.GraniteHandler->deferFunction(std::move(Blocks));
+    }
+    Evaluations = MainContext.GraniteHandler->evaluateDeferredFunctions();
+    for (size_t Function = 0; Function < Functions.size(); ++Function) {
+      if (Functions[Function].PreviousEvaluation != nullptr)
+        Evaluations[Function] = *Functions[Function].PreviousEvaluation;
     }
   }
+  assert(Evaluations.size() == Functions.size());
+  for (size_t Function = 0; Function < Functions.size(); ++Function)
+    PrintFunction(Functions[Function], Evaluations[Function]);
+  Output.keep();
 }